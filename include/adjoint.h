@@ -0,0 +1,94 @@
+/**
+ * \file
+ * Track-length tallies on rectilinear grids, which map detection efficiencies when particles are tracked backward from a detector (GLOBAL option adjoint).
+ */
+
+#ifndef ADJOINT_H_
+#define ADJOINT_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "stepper.h"
+
+class TParticle;
+
+/**
+ * Track-length tally of one particle type on a rectilinear grid, defined in the EFFICIENCYMAPS section of the configuration
+ *
+ * Each entry of the section has the form
+ *
+ * <name> <particle> <xmin> <xmax> <nx> <ymin> <ymax> <ny> <zmin> <zmax> <nz>
+ *
+ * Every trajectory step of the particle type adds its length times the statistical weight of the particle to the cells it crosses.
+ * Divided by the cell volume, this is the fluence of the simulated particles in each cell.
+ * If the particles are tracked backward from a detector surface emitting them with a cosine distribution (GLOBAL option adjoint),
+ * the detection probability of particles emitted isotropically in a cell, averaged over the cell and the source spectrum,
+ * is A/4 times the fluence per started particle, where A is the area of the detector surface.
+ */
+class TEfficiencyMap{
+private:
+	std::string name; ///< Name of map, used as file name
+	std::string particlename; ///< Particle type scored in map
+	double min[3]; ///< Lower corner of grid
+	double max[3]; ///< Upper corner of grid
+	unsigned n[3]; ///< Number of cells in each direction
+	double piece; ///< Max. length of the pieces into which steps are cut, each piece is scored in the cell containing its center
+	std::vector<double> sum; ///< Sum of weighted track lengths in each cell
+	std::vector<double> sum2; ///< Sum of squared weighted track lengths of each particle in each cell
+	std::map<const TParticle*, std::map<unsigned long, double> > pending; ///< Weighted track lengths of particles that are still tracked, added to the sums when they finish
+
+public:
+	/**
+	 * Constructor, parses definition of map
+	 *
+	 * @param aname Name of map
+	 * @param definition Particle type and grid, as given in the EFFICIENCYMAPS section
+	 */
+	TEfficiencyMap(const std::string &aname, const std::string &definition);
+
+	/**
+	 * Score a straight trajectory step
+	 *
+	 * @param p Particle, steps of other particle types are ignored
+	 * @param y1 State at start of step
+	 * @param y2 State at end of step
+	 */
+	void Score(const TParticle &p, const state_type &y1, const state_type &y2);
+
+	/**
+	 * Add scores of a particle to the sums once it has finished
+	 *
+	 * Particles are scored as a whole, so the squared sums give the statistical uncertainty of correlated steps correctly.
+	 *
+	 * @param p Particle
+	 */
+	void Finish(const TParticle &p);
+
+	/**
+	 * Write cell centers, fluence (sum of weighted track lengths divided by the cell volume), and squared fluence of single particles to a file
+	 *
+	 * @param outfile Output file
+	 * @param append Add sums contained in an existing file, e.g. when a simulation is resumed
+	 */
+	void Write(const boost::filesystem::path &outfile, const bool append) const;
+
+	/**
+	 * Get name of map
+	 *
+	 * @return Returns name given in the EFFICIENCYMAPS section
+	 */
+	const std::string& GetName() const { return name; };
+
+	/**
+	 * Get memory used by sums and scores of particles that are still tracked
+	 *
+	 * @return Returns approximate size [bytes]
+	 */
+	std::size_t MemoryUsage() const;
+};
+
+#endif // ADJOINT_H_
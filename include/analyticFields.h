@@ -7,6 +7,8 @@
 #ifndef ANALYTICFIELDS_H_
 #define ANALYTICFIELDS_H_
 
+#include <vector>
+
 #include "field.h"
 
 /**
@@ -308,12 +310,16 @@ public:
 /**
  * Class calculating magnetic field from user-defined formulas
  * 
- * Field gradients are calculated numerically with a five-point stencil method
+ * Field gradients are calculated from user-defined formulas, if given, or numerically with a five-point stencil method.
+ * Formulas that cannot be compiled to native code are interpreted, each thread with its own copies, so a single instance can be used by several threads.
  */
 class TCustomBField: public TField{
 private:
-	std::unique_ptr<double> tvar, xvar, yvar, zvar; ///< Variables used to evaluate formulas, they need to be pointers to make sure references stored in the exprtk expression do not get invalidated when copying
-	std::array<exprtk::expression<double>, 3> Bexpr; ///< Formula interpreters, one for each field component
+	std::array<std::string, 3> Bformulas; ///< Formulas of each field component
+	std::vector<std::string> dBformulas; ///< Formulas of each derivative dBi/dxj at index 3*i + j (empty: derivatives are calculated numerically)
+	std::shared_ptr<const TScalerSlot> slot; ///< Index of this field in each thread's list of interpreted formulas, so threads never share the variables the formulas are evaluated with
+	std::array<TNativeFormula, 3> Bnative; ///< Field formulas compiled to native code (nullptr: formulas are interpreted)
+	std::vector<TNativeFormula> dBnative; ///< Derivative formulas compiled to native code (empty: derivatives are calculated numerically or interpreted)
 public:
 	/**
 	 * Constructor
@@ -321,14 +327,15 @@ public:
 	 * @param _Bx String containing formula for x component of field
 	 * @param _By String containing formula for y component of field
 	 * @param _Bz String containing formula for z component of field
+	 * @param _dB Strings containing formulas for the nine derivatives dBx/dx, dBx/dy, dBx/dz, dBy/dx, ..., dBz/dz (optional, by default derivatives are calculated numerically)
 	 */
-	TCustomBField(const std::string &_Bx, const std::string &_By, const std::string &_Bz);
+	TCustomBField(const std::string &_Bx, const std::string &_By, const std::string &_Bz, const std::vector<std::string> &_dB = std::vector<std::string>());
 
 
 	/**
 	 * Calculates B field B[3] and the derivatives dBidxj[3][3] for a given point x,y,z and time t
 	 * 
-	 * Spatial derivatives are calculated numerically using a five-point stencil method
+	 * Spatial derivatives are calculated from derivative formulas, if given, or numerically using a five-point stencil method, which needs four evaluations of the field formula per derivative
 	 *
 	 * @param x Cartesian x coordinate
 	 * @param y Cartesian y coordinate
@@ -0,0 +1,70 @@
+/**
+ * \file
+ * Checkpoints storing the state of a running simulation, so it can be continued after the program was interrupted, e.g. by a batch system.
+ */
+
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "particle.h"
+#include "geometry.h"
+#include "fields.h"
+#include "mc.h"
+
+/**
+ * Particle waiting to be tracked, or interrupted while it was tracked, together with the random-number generator it draws from
+ */
+struct TParticleTask{
+	std::unique_ptr<TParticle> particle; ///< Particle
+	TMCGenerator::result_type secondaryindex = 0; ///< Index of the particle's random-number substream, see TMCGenerator::SecondaryIndex (0: primary particle)
+	TMCGenerator mc; ///< Random-number generator, positioned in the particle's substream
+	bool advanced = false; ///< Particle was already advanced together with other primary particles by TTracker::AdvanceBatch (not stored in checkpoints)
+};
+
+
+/**
+ * State of a simulation of a single process: counters, primary particles not created yet, and all particles not finished yet.
+ *
+ * Fields, geometry, and source are not stored, they are loaded from the configuration again when the simulation is resumed.
+ * Particles are stored at the end of a trajectory step, the integrator restarts from there with its initial step size.
+ */
+struct TCheckpoint{
+	std::uint64_t seed = 0; ///< Random seed of simulation
+	long long jobnumber = 0; ///< Job number of simulation
+	long long firstparticle = 0; ///< Number of first primary particle that has not been created yet
+	long long particlecount = 0; ///< Number of primary particles that have not been created yet
+	unsigned long finishedparticles = 0; ///< Number of primary particles whose tracking has finished
+	int steps = 0; ///< Number of integration steps of all finished particles
+	std::map<std::string, std::map<int, double> > ID_counter; ///< Sum of statistical weights of finished particles with each stop ID for each particle type
+	std::vector<TParticleTask> tasks; ///< Particles that have not finished yet, filled by Read
+
+	/**
+	 * Write checkpoint to file
+	 *
+	 * The file is first written under a temporary name and then renamed, so an interruption while writing never leaves an incomplete checkpoint.
+	 * Prints a warning if the file could not be written.
+	 *
+	 * @param file File name
+	 * @param queued Particles that have not finished yet (instead of TCheckpoint::tasks, so they do not have to be moved out of the scheduler)
+	 */
+	void Write(const boost::filesystem::path &file, const std::vector<const TParticleTask*> &queued) const;
+
+	/**
+	 * Read checkpoint written by Write
+	 *
+	 * @param file File name
+	 * @param geometry Experiment geometry, used to look up solids of stored particles
+	 * @param field TFieldManager containing all electromagnetic fields, used to recreate stored particles
+	 */
+	void Read(const boost::filesystem::path &file, const TGeometry &geometry, const TFieldManager &field);
+};
+
+#endif // CHECKPOINT_H_
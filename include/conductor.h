@@ -6,6 +6,10 @@
 #ifndef RACETRACK_H_
 #define RACETRACK_H_
 
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
 #include "field.h"
 
 /**
@@ -46,4 +50,48 @@ public:
 };
 
 
+/**
+ * Set of straight conductors, e.g. the wire segments of a coil model.
+ *
+ * Segments are read from a file and stored as separate arrays of coordinates and currents,
+ * so that the fields of all segments can be summed in a loop the compiler can vectorize.
+ */
+class TConductorSetField: public TField{
+private:
+	static const std::size_t LANES = 4; ///< Number of segments evaluated together; arrays are padded with segments without current to a multiple of this number
+	std::vector<double> x1; ///< x coordinates of start points
+	std::vector<double> y1; ///< y coordinates of start points
+	std::vector<double> z1; ///< z coordinates of start points
+	std::vector<double> Lx; ///< x components of vectors from start to end points
+	std::vector<double> Ly; ///< y components of vectors from start to end points
+	std::vector<double> Lz; ///< z components of vectors from start to end points
+	std::vector<double> I; ///< currents through segments, multiplied by mu0/(4 pi)
+public:
+	/**
+	 * Constructor, reads segments from file
+	 *
+	 * Each line of the file contains the current I and the start and end points x1 y1 z1 x2 y2 z2 of one segment, lines beginning with # or % are skipped.
+	 *
+	 * @param ft File containing segments
+	 */
+	TConductorSetField(const boost::filesystem::path &ft);
+
+	/**
+	 * Compute sum of magnetic fields of all segments.
+	 *
+	 * For parameter doc see TField::BField.
+	 */
+	void BField(const double x, const double y, const double z, const double t,
+			double B[3], double dBidxj[3][3]) const override;
+
+	/**
+	 * Conductors produce no electric field.
+	 *
+	 * For parameter doc see TField::EField.
+	 */
+	void EField(const double x, const double y, const double z, const double t,
+			double &V, double Ei[3]) const override {};
+};
+
+
 #endif /*RACETRACK_H_*/
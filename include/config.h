@@ -11,6 +11,7 @@
 
 #include <string>
 #include <map>
+#include <vector>
 #include <iosfwd>
 
 #include "exprtk.hpp"
@@ -120,5 +121,30 @@ public:
  */
 double EvalFormula(TConfig &config, const std::string formulaname, const std::map<std::string, double> &variables);
 
+/**
+ * Find formula with given name and compile it for repeated evaluation
+ *
+ * The variables are bound by reference, so the compiled expression always uses their current values.
+ * The variable map must not be modified structurally (inserting or erasing elements) while the expression is in use.
+ *
+ * @param config TConfig containing configuration variables
+ * @param formulaname Name of the formula to be compiled
+ * @param variables Map of variable names and values referenced by the formula
+ * @param expr Returns compiled expression
+ */
+void CompileFormula(TConfig &config, const std::string &formulaname, std::map<std::string, double> &variables, exprtk::expression<double> &expr);
+
+/**
+ * Find formula with given name and compile it using the variables in a symbol table
+ *
+ * @param config TConfig containing configuration variables
+ * @param formulaname Name of the formula to be compiled
+ * @param symbols Symbol table containing variables referenced by the formula
+ * @param expr Returns compiled expression
+ * @param usedvariables Returns names of variables used in the formula
+ */
+void CompileFormula(TConfig &config, const std::string &formulaname, exprtk::symbol_table<double> &symbols, exprtk::expression<double> &expr,
+					std::vector<std::string> &usedvariables);
+
 
 #endif /* CONFIG_H_ */
@@ -0,0 +1,99 @@
+/**
+ * \file
+ * Convergence-driven number of simulated particles: no further particles are created once the statistical uncertainties of chosen observables have reached their targets.
+ */
+
+#ifndef CONVERGENCE_H_
+#define CONVERGENCE_H_
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "logger.h"
+
+/**
+ * Counters of finished particles and histogram bins, summed over all threads of a simulation
+ */
+struct TConvergenceSample{
+	std::map<std::string, std::map<int, double> > ID_counter; ///< Sum of statistical weights of finished particles with each stop ID for each particle type
+	std::map<std::string, THistogramBins> histograms; ///< Bins of histograms in HISTOGRAMS section by name
+
+	/**
+	 * Add counters and bins of another sample
+	 *
+	 * @param sample Sample to add
+	 */
+	void Add(const TConvergenceSample &sample);
+};
+
+/**
+ * Decides when a simulation has reached the statistical precision given in the GLOBAL option precision
+ *
+ * Each observable is followed by the target of its relative uncertainty:
+ * - stopID <particle> <ID> <target>: fraction of the statistical weight of finished particles of a type that stopped with this ID (particles killed by Russian roulette are not counted),
+ *   with the binomial uncertainty sqrt((1 - f)/(f*N)), where N is the summed weight, which equals the number of particles without importance sampling
+ * - bin <histogram> <bin> <target>: sum of weights in a bin of a histogram in the HISTOGRAMS section (0: underflow, 1 to nbins, nbins + 1: overflow), with uncertainty sqrt(sum of squared weights)
+ * - mean <histogram> <target>: weighted mean of the variable filled into a histogram, calculated from the bin centers without underflow and overflow, with the standard error of the mean
+ *
+ * The observables are only evaluated after precisionmin primary particles have finished. Tracking also stops after precisiontime seconds, and simcount remains the max. number of particles.
+ */
+class TConvergenceMonitor{
+private:
+	enum TObservableType{ STOPID, BIN, MEAN };
+
+	/**
+	 * Observable with its target uncertainty
+	 */
+	struct TObservable{
+		TObservableType type; ///< Type of observable
+		std::string name; ///< Particle type (STOPID) or histogram name (BIN, MEAN)
+		int index; ///< Stop ID (STOPID) or bin (BIN)
+		double target; ///< Target of relative uncertainty
+		std::string description; ///< Observable as given in the configuration, used in output
+	};
+
+	std::vector<TObservable> observables; ///< Observables whose uncertainties have to reach their targets
+	unsigned long minparticles = 100; ///< Number of finished primary particles before the uncertainties are evaluated (GLOBAL option precisionmin)
+	double maxtime = 0; ///< Wall-clock time [s] after which tracking stops even if the targets were not reached, 0: unlimited (GLOBAL option precisiontime)
+	std::chrono::steady_clock::time_point start; ///< Time the monitor was created
+	bool converged = false; ///< Set when the targets or the time limit have been reached
+
+	/**
+	 * Calculate relative uncertainty of an observable
+	 *
+	 * @param observable Observable
+	 * @param sample Counters and histograms of finished particles
+	 *
+	 * @return Returns relative uncertainty, infinity if the observable has no entries yet
+	 */
+	double Uncertainty(const TObservable &observable, const TConvergenceSample &sample) const;
+public:
+	/**
+	 * Constructor, reads observables and limits from the GLOBAL section and checks the histograms they refer to
+	 *
+	 * @param config Configuration
+	 */
+	TConvergenceMonitor(TConfig &config);
+
+	/**
+	 * Check if any observables were given
+	 *
+	 * @return Returns true if the number of particles is driven by the statistical precision
+	 */
+	bool Enabled() const { return not observables.empty(); };
+
+	/**
+	 * Check if all observables have reached their target uncertainties or the time limit was exceeded, and print the uncertainties the first time it is
+	 *
+	 * @param sample Counters and histograms of finished particles, summed over all threads
+	 * @param finished Number of finished primary particles
+	 *
+	 * @return Returns true if no further particles have to be created
+	 */
+	bool Converged(const TConvergenceSample &sample, const unsigned long finished);
+};
+
+#endif // CONVERGENCE_H_
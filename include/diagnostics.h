@@ -0,0 +1,47 @@
+/**
+ * \file
+ * Counters of problems that occur during tracking, summarized at program exit instead of printing every occurrence to the terminal.
+ *
+ * Each thread counts problems in its own counters, so tracking threads never wait for each other or for the terminal.
+ */
+
+#ifndef DIAGNOSTICS_H_
+#define DIAGNOSTICS_H_
+
+/**
+ * Problems during tracking that are counted and written to the diagnosticlog
+ */
+enum TDiagnostic{
+	DIAG_ITERATION_PRECISION = 1, ///< Collision-point iteration was limited by numerical precision
+	DIAG_ITERATION_MAX = 2, ///< Collision-point iteration reached max. number of bisections
+	DIAG_SOLID_NOT_ENTERED = 3, ///< Particle left a solid which it did not enter before
+	DIAG_PARALLEL_TRACK = 4, ///< Particle crossed a surface with a track parallel to it
+	DIAG_CPUTIME_BUDGET = 5, ///< Particle exceeded its CPU-time budget
+	DIAG_STEP_BUDGET = 6, ///< Particle exceeded its step budget
+	DIAG_HIT_BUDGET = 7, ///< Particle exceeded its hit budget
+	DIAG_MR_NOT_APPLICABLE = 8, ///< Micro-roughness model was not applicable to a surface hit, specular reflection was used instead
+	DIAG_CODES ///< Number of problem types plus one
+};
+
+namespace Diagnostics{
+	/**
+	 * Count a problem in the calling thread's counters and keep its details if the thread has not kept enough samples of its type yet
+	 *
+	 * @param code Type of problem
+	 * @param solid ID of solid in which the problem occurred
+	 * @param particle Number of particle
+	 * @param t Time
+	 * @param pos Position
+	 * @param value Additional value describing the problem, see TLogger::PrintDiagnostic
+	 */
+	void Count(const TDiagnostic code, const unsigned solid, const int particle, const double t, const double pos[3], const double value);
+
+	/**
+	 * Print number of problems of each type in each solid, summed over all threads, together with a few samples of each type
+	 *
+	 * Must only be called when no other thread is tracking particles. Prints nothing if no problems occurred.
+	 */
+	void Print();
+}
+
+#endif // DIAGNOSTICS_H_
@@ -0,0 +1,137 @@
+/**
+ * \file
+ * Distribution of primary particles over threads and, if compiled with MPI, over processes.
+ */
+
+#ifndef DISTRIBUTOR_H_
+#define DISTRIBUTOR_H_
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <mutex>
+#include <thread>
+
+/**
+ * Initializes MPI when constructed and finalizes it when destroyed, if PENTrack was compiled with the USE_MPI option.
+ *
+ * Without MPI, the program runs as a single process with rank 0.
+ */
+class TProcessGroup{
+public:
+	/**
+	 * Constructor, initializes MPI with support for calls from several threads, one at a time
+	 *
+	 * @param argc Number of command line parameters
+	 * @param argv Command line parameters
+	 */
+	TProcessGroup(int &argc, char **&argv);
+
+	/**
+	 * Destructor, finalizes MPI
+	 */
+	~TProcessGroup();
+
+	/**
+	 * Return rank of this process (0 without MPI)
+	 */
+	static int Rank();
+
+	/**
+	 * Return number of processes (1 without MPI)
+	 */
+	static int Size();
+
+	/**
+	 * Copy value from process with rank 0 to all other processes
+	 *
+	 * @param value Value, overwritten in all processes except rank 0
+	 */
+	static void Broadcast(std::uint64_t &value);
+
+	/**
+	 * Sum particle counters and step counts of all processes in process with rank 0
+	 *
+	 * @param ID_counter Sum of statistical weights of particles with each stop ID for each particle type, returns sum over all processes in rank 0
+	 * @param steps Number of integration steps, returns sum over all processes in rank 0
+	 */
+	static void Reduce(std::map<std::string, std::map<int, double> > &ID_counter, int &steps);
+};
+
+
+/**
+ * Hands out numbers of primary particles to the threads of all processes.
+ *
+ * The process with rank 0 owns the range of particle numbers and hands out blocks of them to the other processes when they ask for more,
+ * in a separate thread, so processes that track long-lived particles simply ask less often. Each process hands out the numbers in its block one at a time.
+ * Since every particle draws from the random-number substream given by its number, results do not depend on how the blocks are distributed.
+ */
+class TParticleDistributor{
+private:
+	long long next; ///< Next particle number not yet handed out to any process (only used in rank 0)
+	long long end; ///< One past the last particle number (only used in rank 0)
+	long long blocksize; ///< Number of particles handed out to a process at once
+	long long blocknext = 0; ///< Next particle number in block of this process
+	long long blockend = 0; ///< One past the last particle number in block of this process
+	bool finished = false; ///< Set when this process will not get any more particles
+	mutable std::mutex rangemutex; ///< Protects next, locked by dispatcher thread and threads of rank 0
+	std::thread dispatcher; ///< Thread answering requests of other processes (only in rank 0)
+
+	/**
+	 * Take block of particle numbers from range
+	 *
+	 * @param first Returns first particle number in block
+	 *
+	 * @return Returns number of particles in block (0: all particles have been handed out)
+	 */
+	long long TakeBlock(long long &first);
+
+	/**
+	 * Answer requests for blocks of other processes until all of them have been told that there are no more particles
+	 */
+	void Dispatch();
+public:
+	/**
+	 * Constructor, starts dispatcher thread in rank 0 if there are several processes
+	 *
+	 * @param first Number of first particle
+	 * @param count Number of particles
+	 * @param ablocksize Number of particles handed out to a process at once
+	 */
+	TParticleDistributor(const long long first, const long long count, const long long ablocksize);
+
+	/**
+	 * Destructor, calls Finish
+	 */
+	~TParticleDistributor();
+
+	/**
+	 * Get number of next particle to be tracked by this process
+	 *
+	 * Must not be called by several threads at the same time.
+	 *
+	 * @param number Returns particle number
+	 * @param stop Do not hand out further particles to this process, e.g. after a signal was caught
+	 *
+	 * @return Returns false if there are no more particles for this process
+	 */
+	bool Next(long long &number, const bool stop);
+
+	/**
+	 * Get range of particle numbers that have not been handed out yet, e.g. to write them to a checkpoint
+	 *
+	 * Only valid if there is a single process, must not be called at the same time as Next.
+	 *
+	 * @param first Returns first particle number not handed out yet
+	 *
+	 * @return Returns number of particles not handed out yet
+	 */
+	long long Remaining(long long &first) const;
+
+	/**
+	 * Wait until the dispatcher thread has answered all requests of other processes, has to be called before other MPI communication
+	 */
+	void Finish();
+};
+
+#endif // DISTRIBUTOR_H_
@@ -8,9 +8,15 @@
 #define FIELD_H_
 
 #include <array>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <string>
+#include <functional>
+#include <vector>
 
 #include "exprtk.hpp"
+#include "formulacompiler.h"
 
 
 /**
@@ -33,6 +39,24 @@ public:
 	virtual void BField (const double x, const double y, const double z, const double t,
             double B[3], double dBidxj[3][3]) const = 0;
 
+	/**
+	 * Calculate magnetic field at many points, stored as structure of arrays.
+	 *
+	 * The default implementation calls the single-point version for each point.
+	 * Fields can override it with a kernel that processes all points in one pass, e.g. to offload it to an accelerator.
+	 * Points outside the field are left unchanged, as in the single-point version, so callers have to initialize B and dBidxj.
+	 *
+	 * @param n Number of points
+	 * @param x Cartesian x coordinates
+	 * @param y Cartesian y coordinates
+	 * @param z Cartesian z coordinates
+	 * @param t Times
+	 * @param B Returns magnetic field vector at each point
+	 * @param dBidxj Return spatial derivatives of magnetic field components at each point (optional)
+	 */
+	virtual void BField (const std::size_t n, const double *x, const double *y, const double *z, const double *t,
+            double *const B[3], double *const dBidxj[3][3]) const;
+
 	/**
 	 * Calculate electric field and potential at a given position.
 	 *
@@ -48,16 +72,79 @@ public:
 	virtual void EField (const double x, const double y, const double z, const double t,
             double &V, double Ei[3]) const = 0;
 
+	/**
+	 * Get memory allocated by the field, e.g. for interpolation tables
+	 *
+	 * @return Returns approximate size [bytes], 0 for analytic fields
+	 */
+	virtual std::size_t MemoryUsage() const { return 0; }
+
+	/**
+	 * Hint that the field will soon be evaluated along a straight path, e.g. the extrapolated next trajectory step.
+	 *
+	 * Tables can start loading the memory they will read, so it arrives while other work is done. The default implementation does nothing.
+	 *
+	 * @param x1 Cartesian x coordinate of start of path
+	 * @param y1 Cartesian y coordinate of start of path
+	 * @param z1 Cartesian z coordinate of start of path
+	 * @param x2 Cartesian x coordinate of end of path
+	 * @param y2 Cartesian y coordinate of end of path
+	 * @param z2 Cartesian z coordinate of end of path
+	 */
+	virtual void Prefetch(const double x1, const double y1, const double z1, const double x2, const double y2, const double z2) const { }
+
 };
 
 
+/**
+ * Index of an interpreted formula in each thread's list of compiled expressions, shared by all copies of a TFieldScaler or TCustomBField
+ *
+ * The index is returned to the free list when the last copy is destroyed. A formula reusing it gets a new generation,
+ * so each thread recompiles the formula instead of evaluating the stale expression left in the slot.
+ */
+struct TScalerSlot{
+	std::size_t index; ///< index in each thread's list of compiled expressions
+	uint64_t generation; ///< unique number of this slot assignment
+
+	/**
+	 * Constructor, takes a free slot or a new one
+	 */
+	TScalerSlot();
+
+	/**
+	 * Destructor, returns slot to the free list
+	 */
+	~TScalerSlot();
+};
+
 /**
  * Class to calculate a time-dependent field-scaling factor based on a formula string
+ *
+ * exprtk expressions store their variables inside the expression and cannot be evaluated by several threads at once.
+ * Each thread therefore compiles its own copy of the formula on first use.
+ * The copies are indexed by a slot shared by all copies of the scaler. When the last copy is destroyed, the slot is reused by the next scaler,
+ * which replaces the stale copy in each thread, so reloading fields does not accumulate compiled formulas.
+ * Formulas that do not depend on time are evaluated only once in the constructor.
+ * Each thread remembers the last evaluated time and scaling factor, so repeated calls with the same time do not evaluate the formula again.
  */
 class TFieldScaler{
 private:
-	exprtk::expression<double> scaler; ///< formula interpreter for field scaling
-	std::unique_ptr<double> tvar; ///< time variable for use in scaling-formula parsers. It needs to be a pointer to make sure the reference in the exprtk expression will not be invalidated when copying
+	std::string formula; ///< formula describing time-dependence of field
+	bool constant; ///< true if formula does not depend on time
+	double constantFactor; ///< scaling factor if formula is constant
+	std::shared_ptr<const TScalerSlot> slot; ///< index of this formula in each thread's list of compiled expressions
+	TNativeFormula native; ///< formula compiled to native code (nullptr: formula is interpreted by exprtk)
+	std::vector<double> tabletimes; ///< nodes of cubic table replacing the formula between the first and last node (empty: no table)
+	std::vector<std::array<double, 4> > tablecoeffs; ///< coefficients of cubic polynomial between each pair of nodes, in powers of the relative position in the interval
+
+	/**
+	 * Evaluate time-dependent formula with this thread's compiled expression
+	 *
+	 * @param t Time
+	 *
+	 * @return Return scaling factor
+	 */
+	double evaluate(const double t) const;
 public:
 	/**
 	 * Calculate time-dependent scaling factor from parsed formula
@@ -66,7 +153,37 @@ public:
 	 *
 	 * @return Return scaling factor
 	 */
-	double scalingFactor(const double t) const;
+	double scalingFactor(const double t) const{ return constant ? constantFactor : evaluate(t); };
+
+	/**
+	 * Check if scaling formula is constant in time
+	 *
+	 * @return Returns true if formula does not depend on time
+	 */
+	bool isConstant() const{ return constant; };
+
+	/**
+	 * Replace time-dependent formula by a table of piecewise cubic polynomials between tmin and tmax
+	 *
+	 * The interval is divided into steps of the given resolution.
+	 * Each step is bisected until the cubic polynomial deviates from the formula by less than the tolerance at several points inside it,
+	 * so discontinuities of the formula end up in tiny intervals and are not smeared over a whole step.
+	 * Features of the formula that are narrower than a fraction of the resolution might be missed.
+	 * Outside the table the formula is evaluated as before.
+	 *
+	 * @param tmin Start of table
+	 * @param tmax End of table
+	 * @param resolution Largest distance between nodes
+	 * @param tolerance Maximum absolute deviation of the table from the formula
+	 *
+	 * @return Returns number of intervals in which the tolerance could not be reached, i.e. discontinuities of the formula
+	 */
+	std::size_t tabulate(const double tmin, const double tmax, const double resolution, const double tolerance);
+
+	/**
+	 * Get formula describing time-dependence of field
+	 */
+	const std::string& getFormula() const{ return formula; };
 
 	/**
 	 * Scale scalar field F with gradient dFdxi by calculated scaling factor
@@ -124,6 +241,27 @@ public:
 	 */
 	virtual bool inBounds(const double x, const double y, const double z) const = 0;
 
+	/**
+	 * Calculate distance of coordinates to the boundary region
+	 *
+	 * @param x x coordinate
+	 * @param y y coordinate
+	 * @param z z coordinate
+	 *
+	 * @return Returns distance to the region enclosed by the boundaries, zero if coordinates are inside or no valid boundaries are set
+	 */
+	virtual double distance(const double x, const double y, const double z) const = 0;
+
+	/**
+	 * Get box enclosing the region inside the boundaries
+	 *
+	 * @param min Returns minimum x, y, and z coordinates
+	 * @param max Returns maximum x, y, and z coordinates
+	 *
+	 * @return Returns false if no valid boundaries are set, i.e. the region is unbounded
+	 */
+	virtual bool getBounds(std::array<double, 3> &min, std::array<double, 3> &max) const = 0;
+
 	/**
 	 * Smoothly scale field at the edges of the boundary region
 	 *
@@ -174,6 +312,19 @@ private:
 	 * @return Returns derivative of smthrStp at parameter x
 	 */
 	double smthrStpDer(const double x) const;
+
+	/**
+	 * Calculate factor f(x)*f(y)*f(z) by which fields are scaled at the edges of the boundary region, and its gradient
+	 *
+	 * @param x x coordinate
+	 * @param y y coordinate
+	 * @param z z coordinate
+	 * @param Fscale Returns scaling factor (0 outside of the boundary box)
+	 * @param dFscaledxi Returns gradient of scaling factor
+	 *
+	 * @return Returns false if fields do not have to be scaled at (x,y,z), Fscale and dFscaledxi are not set then
+	 */
+	bool smoothingFactor(const double x, const double y, const double z, double &Fscale, double dFscaledxi[3]) const;
 public:
 	/**
 	 * Check if valid boundaries are set
@@ -193,6 +344,27 @@ public:
 	 */
 	bool inBounds(const double x, const double y, const double z) const override;
 
+	/**
+	 * Calculate distance of coordinates to the boundary box
+	 *
+	 * @param x x coordinate
+	 * @param y y coordinate
+	 * @param z z coordinate
+	 *
+	 * @return Returns distance to the box xmin-xmax, ymin-ymax, zmin-zmax, zero if coordinates are inside or no valid boundaries are set
+	 */
+	double distance(const double x, const double y, const double z) const override;
+
+	/**
+	 * Get boundary box
+	 *
+	 * @param min Returns xmin, ymin, zmin
+	 * @param max Returns xmax, ymax, zmax
+	 *
+	 * @return Returns false if no valid boundaries are set
+	 */
+	bool getBounds(std::array<double, 3> &min, std::array<double, 3> &max) const override;
+
 	/**
 	 * Smoothly scale field at the edges of the boundary region
 	 *
@@ -246,10 +418,12 @@ public:
  */
 class TFieldContainer{
 private:
-	std::unique_ptr<TField> field; ///< Class derived from TField
+	std::shared_ptr<const TField> field; ///< Class derived from TField, tables might be shared with other containers
 	TFieldScaler BScaler; ///< Scaler class for magnetic field
 	TFieldScaler EScaler; ///< Scaler class for electric field
 	std::unique_ptr<TFieldBoundary> boundary; ///< Class derived from TFieldBoundary
+	double rffrequency = 0; ///< Angular frequency of RF carrier multiplying the magnetic field [rad/s] (0: field is not an RF drive), see DeclareRF
+	double rfphase = 0; ///< Phase of RF carrier [rad]
 public:
 	/**
 	 * Constructor for a field using a box-shaped boundary
@@ -265,7 +439,7 @@ public:
 	 * @param zmin Minimum z coordinate of bounding box
 	 * @param boundaryWidth If coordinates fall within this distance from the boundary, the field will be scaled to smoothly transition to no field outside the boundary
 	 */
-	TFieldContainer(std::unique_ptr<TField> &&_field, const std::string &BScalingFormula, const std::string &EScalingFormula,
+	TFieldContainer(std::shared_ptr<const TField> _field, const std::string &BScalingFormula, const std::string &EScalingFormula,
 					const double xmax, const double xmin, const double ymax, const double ymin, const double zmax, const double zmin, const double boundaryWidth):
 						field(std::move(_field)), BScaler(TFieldScaler(BScalingFormula)), EScaler(TFieldScaler(EScalingFormula)), 
 						boundary(std::unique_ptr<TFieldBoundary>(new TFieldBoundaryBox(xmax, xmin, ymax, ymin, zmax, zmin, boundaryWidth))) {}
@@ -277,7 +451,7 @@ public:
 	 * @param BScalingFormula String containing the formula to calculate a time-dependent magnetic-field scaling factor (optional)
 	 * @param EScalingFormula String containing the formula to calculate a time-dependent electric-field scaling factor (optional)
 	 */
-	TFieldContainer(std::unique_ptr<TField> &&_field, const std::string &BScalingFormula = "1", const std::string &EScalingFormula = "1"):
+	TFieldContainer(std::shared_ptr<const TField> _field, const std::string &BScalingFormula = "1", const std::string &EScalingFormula = "1"):
 		TFieldContainer(std::move(_field), BScalingFormula, EScalingFormula, 0., 0., 0., 0., 0., 0., 0.) {}
 
 
@@ -294,6 +468,23 @@ public:
 	void BField(const double x, const double y, const double z, const double t, double B[3], double dBidxj[3][3]) const;
 
 
+	/**
+	 * Calculate magnetic field at many points taking into account time-dependent scaling and boundary
+	 *
+	 * Only points inside the boundary with non-zero scaling are passed to the field's batched evaluation.
+	 * Gives the same results as calling the single-point version for each point.
+	 *
+	 * @param n Number of points
+	 * @param x Cartesian x coordinates
+	 * @param y Cartesian y coordinates
+	 * @param z Cartesian z coordinates
+	 * @param t Times
+	 * @param B Returns magnetic field vector at each point
+	 * @param dBidxj Return spatial derivatives of magnetic field components at each point (optional)
+	 */
+	void BField(const std::size_t n, const double *x, const double *y, const double *z, const double *t, double *const B[3], double *const dBidxj[3][3]) const;
+
+
 	/**
 	 * Calculate electric potential and field at coordinates x,y,z taking into account time-dependent scaling and boundary
 	 *
@@ -305,10 +496,118 @@ public:
 	 * @param Ei Returns electric field vector
 	 */
 	void EField(const double x, const double y, const double z, const double t, double &V, double Ei[3]) const;
+
+
+	/**
+	 * Calculate distance of coordinates to the region in which this field is non-zero
+	 *
+	 * @param x Cartesian x coordinate
+	 * @param y Cartesian y coordinate
+	 * @param z Cartesian z coordinate
+	 *
+	 * @return Returns distance to the field's boundary, zero if coordinates are inside or the field has no boundary
+	 */
+	double BoundaryDistance(const double x, const double y, const double z) const{ return boundary->distance(x, y, z); };
+
+
+	/**
+	 * Get box enclosing the region in which this field is non-zero
+	 *
+	 * @param min Returns minimum x, y, and z coordinates
+	 * @param max Returns maximum x, y, and z coordinates
+	 *
+	 * @return Returns false if the field has no boundary
+	 */
+	bool GetBounds(std::array<double, 3> &min, std::array<double, 3> &max) const{ return boundary->getBounds(min, max); };
+
+
+	/**
+	 * Hint that the field will soon be evaluated along a straight path, see TField::Prefetch
+	 */
+	void Prefetch(const double x1, const double y1, const double z1, const double x2, const double y2, const double z2) const{ field->Prefetch(x1, y1, z1, x2, y2, z2); };
+
+
+	/**
+	 * Check if magnetic field is static
+	 *
+	 * @return Returns true if scaling formula of magnetic field does not depend on time
+	 */
+	bool IsBFieldStatic() const{ return BScaler.isConstant() and rffrequency == 0; };
+
+
+	/**
+	 * Declare magnetic field as RF drive, multiplying it by the carrier cos(frequency*t + phase)
+	 *
+	 * The scaling formula becomes the envelope of the drive. Spin integrators in the rotating frame (TTracker::IntegrateSpinRWA) use envelope and carrier separately.
+	 *
+	 * @param frequency Angular frequency of carrier [rad/s]
+	 * @param phase Phase of carrier [rad]
+	 */
+	void DeclareRF(const double frequency, const double phase){ rffrequency = frequency; rfphase = phase; };
+
+
+	/**
+	 * Get angular frequency of RF carrier
+	 *
+	 * @return Returns frequency [rad/s], 0 if field is not an RF drive
+	 */
+	double GetRFFrequency() const{ return rffrequency; };
+
+
+	/**
+	 * Get phase of RF carrier
+	 *
+	 * @return Returns phase [rad]
+	 */
+	double GetRFPhase() const{ return rfphase; };
+
+
+	/**
+	 * Calculate envelope of an RF magnetic field, i.e. the magnetic field without the carrier, at coordinates x,y,z taking into account time-dependent scaling and boundary
+	 *
+	 * @param x Cartesian x coordinate
+	 * @param y Cartesian y coordinate
+	 * @param z Cartesian z coordinate
+	 * @param t Time
+	 * @param B Returns amplitude of magnetic field vector
+	 */
+	void RFAmplitude(const double x, const double y, const double z, const double t, double B[3]) const;
+
+
+	/**
+	 * Get field contained in this container
+	 *
+	 * @return Returns field, which might be shared with other containers
+	 */
+	const TField& GetField() const{ return *field; };
+
+
+	/**
+	 * Replace time-dependent scaling formulas by tables of piecewise cubic polynomials, see TFieldScaler::tabulate
+	 *
+	 * @param tmin Start of tables
+	 * @param tmax End of tables
+	 * @param resolution Largest distance between nodes
+	 * @param tolerance Maximum absolute deviation of the tables from the formulas
+	 */
+	void TabulateScalers(const double tmin, const double tmax, const double resolution, const double tolerance);
 };
 
 
 
 
 
+/**
+ * Share a field table between all fields using it, e.g. between the TFieldManagers of the points of a parameter scan
+ *
+ * Returns the table loaded earlier with identical parameters if it is still used, otherwise loads it.
+ *
+ * @param parameters String containing the table file and all parameters that influence the table
+ * @param load Function loading the table
+ *
+ * @return Returns shared table
+ */
+std::shared_ptr<const TField> SharedTable(const std::string &parameters, const std::function<std::unique_ptr<TField>()> &load);
+
+
 #endif /* FIELD_H_ */
@@ -7,6 +7,8 @@
 #define FIELD_2D_H_
 
 #include <memory>
+#include <vector>
+#include <array>
 
 #include "field.h"
 
@@ -18,6 +20,7 @@
  * This class loads a special file format from "Vectorfields Opera" containing a regular, rectangular table of magnetic and electric fields and
  * calculates bicubic interpolation coefficients (4x4 matrix for each grid point) to allow fast evaluation of the fields at arbitrary points.
  * Therefore it assumes that the fields are axisymmetric around the z axis.
+ * The coefficients of all magnetic and of all electric field components are stored interleaved, so each is evaluated in one pass without looking up the grid cell again.
  *
  */
 class TabField: public TField{
@@ -29,7 +32,11 @@ class TabField: public TField{
 		double r_mi; ///< lower radial coordinate of rectangular grid
 		double z_mi; ///< lower axial coordinate of rectangular grid
 		bool fBrc, fBphic, fBzc, fErc, fEphic, fEzc, fVc; ///< remember which field components were loaded from table file
-		alglib::spline2dinterpolant Brc, Bphic, Bzc, Erc, Ephic, Ezc, Vc; ///< spline interpolant for each field component
+		template<int N> using bicubic_coeff = std::array<double, 16*N>; ///< bicubic interpolation coefficients of N components for one grid cell, coefficient of (r - r_i)^i*(z - z_j)^j of component l at index (4*i + j)*N + l
+		std::vector<double> rgrid, zgrid; ///< radial and axial coordinates of grid points
+		std::vector<bicubic_coeff<3> > Bcoeffs; ///< interpolation coefficients of Br, Bphi, and Bz for each grid cell (empty if no magnetic field was loaded), components missing in the table have zero coefficients
+		std::vector<bicubic_coeff<3> > Ecoeffs; ///< interpolation coefficients of Er, Ephi, and Ez for each grid cell (empty if no electric field was loaded)
+		std::vector<bicubic_coeff<1> > Vcoeffs; ///< interpolation coefficients of electric potential for each grid cell (empty if no potential was loaded)
 
 
 		/**
@@ -64,6 +71,36 @@ class TabField: public TField{
 				const alglib::real_1d_array BTabs[3], const alglib::real_1d_array ETabs[3], const alglib::real_1d_array &VTab);
 
 
+		/**
+		 * Calculate bicubic interpolation coefficients for a table column
+		 *
+		 * Builds a bicubic spline with alglib::spline2dbuildbicubicv and copies its coefficients into a coefficient table.
+		 *
+		 * @tparam N Number of components stored in coefficient table
+		 * @param rind Vector containing r-components of grid
+		 * @param zind Vector containing z-components of grid
+		 * @param Tab Vector containing field component at each grid point
+		 * @param component Index of field component in coefficient table
+		 * @param coeffs Coefficient table, coefficients are stored at index component
+		 */
+		template<int N> void PreInterpol(const alglib::real_1d_array &rind, const alglib::real_1d_array &zind, const alglib::real_1d_array &Tab,
+				const unsigned component, std::vector<bicubic_coeff<N> > &coeffs) const;
+
+
+		/**
+		 * Find grid cell that contains a specific point.
+		 *
+		 * @param r Radial coordinate
+		 * @param z Axial coordinate
+		 * @param cell Returns index of grid cell in coefficient tables
+		 * @param dr Returns radial distance of point from lower corner of grid cell
+		 * @param dz Returns axial distance of point from lower corner of grid cell
+		 *
+		 * @return Returns false if point is outside of grid
+		 */
+		bool FindCell(const double r, const double z, unsigned long &cell, double &dr, double &dz) const;
+
+
 	public:
 		/**
 		 * Constructor.
@@ -72,8 +109,9 @@ class TabField: public TField{
 		 *
 		 * @param tabfile Path of table file
 		 * @param alengthconv Factor to convert length units in file to PENTrack units (default: expect cm (cgs), convert to m)
+		 * @param nthreads Number of threads used to build the splines of the field components
 		 */
-		TabField(const std::string &tabfile, const double alengthconv);
+		TabField(const std::string &tabfile, const double alengthconv, const unsigned nthreads = 1);
 
 		/**
 		 * Get magnetic field at a specific point.
@@ -106,6 +144,13 @@ class TabField: public TField{
 		 */
 		void EField(const double x, const double y, const double z, const double t,
 				double &V, double Ei[3]) const override;
+
+		/**
+		 * Get memory used by the grid and interpolation coefficients
+		 *
+		 * @return Returns size [bytes]
+		 */
+		std::size_t MemoryUsage() const override;
 };
 
 
@@ -113,9 +158,11 @@ class TabField: public TField{
  * Instantiate a 2D field map created with OPERA
  * 
  * @param params Parameter string read from config file.
+ * @param formulas Formulas that can be used in scaling formulas
+ * @param nthreads Number of threads used to build the splines of the field components
  * 
  * @return Returns created 2D field map.
  */
-TFieldContainer ReadOperaField2(const std::string &params, const std::map<std::string, std::string> &formulas);
+TFieldContainer ReadOperaField2(const std::string &params, const std::map<std::string, std::string> &formulas, const unsigned nthreads = 1);
 
 #endif // FIELD_2D_H_
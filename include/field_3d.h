@@ -8,26 +8,109 @@
 
 #include "field.h"
 
+#include <algorithm>
 #include <vector>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <future>
 
 #include "boost/multi_array.hpp"
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
 
 /**
  * Class for tricubic field interpolation, create one for every table file you want to use.
  *
  * This class loads a tabulated magnetic and electric field on a rectilinear, three-dimensional grid and
  * calculates tricubic interpolation coefficients (4x4x4 = 64 for each grid point) to allow fast evaluation of the fields at arbitrary points.
+ * The coefficients can be written to a binary cache file, which later runs map into memory instead of recalculating them.
+ * Grid cells are stored in bricks of BRICK x BRICK x BRICK cells, so the coefficients of neighboring cells lie close together in memory and in the cache file,
+ * and only the pages containing the bricks visited by particles are read from a mapped cache file.
+ * Coefficients calculated at startup are backed by transparent huge pages on Linux, so jumping between bricks causes fewer TLB misses.
+ * To halve memory usage of large tables, the coefficients can be stored in single precision.
+ * Tables that do not need smooth fields, e.g. potentials of weak secondary electric fields or coarse diagnostic runs, can be interpolated trilinearly instead,
+ * storing only the values at the eight corners of each cell (8 instead of 64 numbers per component) and evaluating them with a fraction of the operations.
  *
  */
 class TabField3: public TField{
 private:
         std::array<std::vector<double>, 3> xyz; ///< coordinates of points on interpolation grid
+        std::array<double, 3> spacing; ///< grid spacing along x, y, and z if grid points are uniformly spaced along that axis, 0 otherwise
+        double minspacing; ///< smallest distance between neighboring grid points along any axis
         typedef boost::multi_array<double, 3> array3D;
-        typedef std::array<double, 64> tricubic_coeff; ///< interpolation coefficients for one grid cell
-        typedef boost::multi_array<tricubic_coeff, 3> field_type; ///< interpolation coefficients for all grid cells
-        std::array<field_type, 3> Bc; ///< interpolation coefficients for magnetix x,y, and z components
-        field_type Vc; ///< interpolation coefficients for electric potential
+        static const int COMPONENTS = 4; ///< number of interpolated field components (Bx, By, Bz, V)
+        typedef std::array<double, 64*COMPONENTS> tricubic_coeff; ///< interpolation coefficients of all components for one grid cell, the coefficients of all components for each monomial are stored next to each other so they can be evaluated together
+        std::array<unsigned long, 3> cells = {{0, 0, 0}}; ///< number of grid cells along x, y, and z
+        static const unsigned long BRICK = 8; ///< number of grid cells along each edge of a brick of cells stored together, bricks at the upper ends of the grid are smaller
+        typedef std::array<float, 64*COMPONENTS> tricubic_coeff_single; ///< interpolation coefficients of one grid cell stored in single precision, same layout as TabField3::tricubic_coeff
+        typedef std::array<double, 8*COMPONENTS> trilinear_coeff; ///< values of all components at the corners of one grid cell (corner i + 2*j + 4*k of component l at index (i + 2*j + 4*k)*COMPONENTS + l)
+        std::vector<tricubic_coeff> tablecoeffs; ///< interpolation coefficients calculated from table
+        std::vector<tricubic_coeff_single> tablecoeffs_single; ///< interpolation coefficients calculated from table, if stored in single precision
+        std::vector<trilinear_coeff> tablecoeffs_linear; ///< corner values taken from table, if interpolated trilinearly
+        boost::iostreams::mapped_file_source cache; ///< cache file containing interpolation coefficients
+        const tricubic_coeff *coeffs = nullptr; ///< interpolation coefficients of all grid cells for magnetic x, y, and z components and electric potential (pointing into tablecoeffs or cache), components missing in the table have zero coefficients
+        const tricubic_coeff_single *coeffs_single = nullptr; ///< single-precision interpolation coefficients (pointing into tablecoeffs_single or cache), used instead of TabField3::coeffs if set
+        const trilinear_coeff *coeffs_linear = nullptr; ///< corner values for trilinear interpolation (pointing into tablecoeffs_linear or cache), used instead of TabField3::coeffs if set
+
+        /**
+         * Grid cell found by the last lookup of a thread in a table, tried first by its next lookup along axes with non-uniform spacing
+         */
+        struct TCellHint{
+            const TabField3 *field; ///< Table the cell belongs to, only used to find the hint (a new table at the address of a deleted one just gets a bad first guess)
+            std::array<long, 3> index; ///< Index of the cell
+        };
+        static const std::size_t CELL_HINTS = 8; ///< Number of tables for which each thread keeps its last cell
+        static thread_local std::array<TCellHint, CELL_HINTS> hints; ///< Last cell of each thread in the tables it used most recently
+        static thread_local std::size_t nexthint; ///< Entry in TabField3::hints replaced when a thread uses another table
+        static const unsigned PREFETCH_CELLS = 8; ///< Maximum number of grid cells TabField3::Prefetch loads along a path
 private:
+		/**
+		 * Determine which axes of the grid are uniformly spaced and store spacing in TabField3::spacing, and the smallest spacing in TabField3::minspacing
+		 */
+		void CalcSpacing();
+
+
+		/**
+		 * Check if any interpolation coefficients were loaded
+		 *
+		 * @return Returns false if the table contained no field components
+		 */
+		bool HasCoefficients() const{ return coeffs != nullptr || coeffs_single != nullptr || coeffs_linear != nullptr; }
+
+
+		/**
+		 * Return position of a grid cell in the list of interpolation coefficients
+		 *
+		 * Bricks are stored in x-major order, and the cells inside each brick as well.
+		 *
+		 * @param ix Index of grid cell along x
+		 * @param iy Index of grid cell along y
+		 * @param iz Index of grid cell along z
+		 */
+		unsigned long CellIndex(const unsigned long ix, const unsigned long iy, const unsigned long iz) const{
+			unsigned long bx = ix/BRICK, by = iy/BRICK, bz = iz/BRICK; // index of brick
+			unsigned long wx = std::min(BRICK, cells[0] - bx*BRICK), wy = std::min(BRICK, cells[1] - by*BRICK), wz = std::min(BRICK, cells[2] - bz*BRICK); // size of brick
+			return ((bx*cells[1] + by*wx)*cells[2] + bz*wx*wy)*BRICK + ((ix - bx*BRICK)*wy + iy - by*BRICK)*wz + iz - bz*BRICK;
+		}
+
+
+		/**
+		 * Return interpolation coefficients of a grid cell
+		 *
+		 * @tparam coeff Type of coefficient array, TabField3::tricubic_coeff or TabField3::tricubic_coeff_single
+		 * @param c Coefficients of all grid cells
+		 * @param ix Index of grid cell along x
+		 * @param iy Index of grid cell along y
+		 * @param iz Index of grid cell along z
+		 */
+		template<typename coeff> const coeff& Coefficients(const coeff *c, const unsigned long ix, const unsigned long iy, const unsigned long iz) const{
+			return c[CellIndex(ix, iy, iz)];
+		}
+
+
 		/**
 		 * Print some information for each table column
 		 *
@@ -43,8 +126,9 @@ private:
          * @param Tab 3D array of field components on grid points
          * @param diff_dim Coordinate dimension to differentiate (0, 1, or 2 for x, y, or z)
          * @param DiffTab Returns 3D array of field components differentiated with respect to dimension diff_dim
+         * @param nthreads Number of threads the grid lines are distributed over
          */
-        void CalcDerivs(const array3D &Tab, const unsigned long diff_dim, array3D &DiffTab) const;
+        void CalcDerivs(const array3D &Tab, const unsigned long diff_dim, array3D &DiffTab, const unsigned nthreads) const;
 
 
 		/**
@@ -52,26 +136,50 @@ private:
 		 *
 		 * Calls TabField3::CalcDerivs and determines the interpolation coefficients with ::tricubic_get_coeff
 		 *
+		 * If coefficients are stored in single precision, the interpolation is compared to the one with double-precision coefficients at the center of each grid cell.
+		 * If the table is interpolated trilinearly, only the corner values are stored and the trilinear interpolation is compared to the tricubic one at the center of each grid cell.
+		 *
          * @param Tab 3D array of field components on grid
-         * @param coeff Returns 3D array of tricubic interpolation coefficients for each grid cell
+         * @param component Index of field component (0, 1, 2, 3 for Bx, By, Bz, V), coefficients are stored at this index in TabField3::tablecoeffs, TabField3::tablecoeffs_single, or TabField3::tablecoeffs_linear
+         * @param maxerror Returns largest deviation of field component and its spatial derivatives caused by single-precision coefficients or trilinear interpolation
+         * @param nthreads Number of threads the grid cells are distributed over
          */
-        void PreInterpol(const array3D &Tab, field_type &coeff) const;
+        void PreInterpol(const array3D &Tab, const unsigned component, std::array<double, 2> &maxerror, const unsigned nthreads);
 
 
 		/**
-		 * Interpolate field component at a specific point.
+		 * Find grid cell that contains a specific point.
 		 *
-		 * Uses a binary search to find the grid cell that contains the point (x,y,z) and and calculates the tricubic interpolation using the coefficients belonging to the grid cell.
+		 * Calculates the cell index directly along axes with uniform grid spacing.
+		 * Along other axes, the cell found by the last lookup of this thread and its neighbors are tested first, before a binary search is used.
+		 * Successive lookups during a trajectory step almost always end up in the same or a neighboring cell.
 		 *
-		 * @param x X coordinate where the field shall be evaluated
-		 * @param y Y coordinate where the field shall be evaluated
-		 * @param z Z coordinate where the field shall be evaluated
-		 * @param coeffs 3D array of tricubic interpolation coefficients
-		 * @param F Returns interpolated field component
-		 * @param dFdxi Returns spatial derivatives of field component (can be null)
+		 * @param x X coordinate
+		 * @param y Y coordinate
+		 * @param z Z coordinate
+		 * @param index Returns index of grid cell
+		 * @param r Returns coordinates of point scaled to unit cube of grid cell
+		 * @param dist Returns size of grid cell
+		 *
+		 * @return Returns false if point is outside of grid
+		 */
+		bool FindCell(const double x, const double y, const double z, std::array<long, 3> &index, std::array<double, 3> &r, std::array<double, 3> &dist) const;
+
+
+		/**
+		 * Interpolate all field components in a grid cell.
+		 *
+		 * Calculates the tricubic (or trilinear) interpolation of values and spatial derivatives of all components in one pass
+		 * using the coefficients belonging to the grid cell returned by TabField3::FindCell.
+		 *
+		 * @param index Index of grid cell
+		 * @param r Coordinates of point scaled to unit cube of grid cell
+		 * @param dist Size of grid cell
+		 * @param F Returns interpolated field components Bx, By, Bz, and V
+		 * @param dFdxi Returns spatial derivatives of field components
 		 */
-		void Interpolate(const double x, const double y, const double z,
-                            const field_type& coeffs, double &F, double dFdxi[3]) const;
+		void Interpolate(const std::array<long, 3> &index, const std::array<double, 3> &r, const std::array<double, 3> &dist,
+                            double F[COMPONENTS], double dFdxi[COMPONENTS][3]) const;
 	public:
 		/**
 		 * Constructor.
@@ -81,8 +189,55 @@ private:
          * @param xyzTab Lists of x, y, and z coordinates of grid points
          * @param BTab Lists of Bx, By, and Bz magnetic field components on grid points
          * @param VTab List of electric potentials on grid points
+         * @param single_precision Store interpolation coefficients in single precision and print the resulting interpolation error
+         * @param nthreads Number of threads used to calculate interpolation coefficients
+         * @param trilinear Interpolate trilinearly and print the deviation from tricubic interpolation, cannot be combined with single_precision
+		 */
+        TabField3(const std::array<std::vector<double>, 3> &xyzTab, const std::array<std::vector<double>, 3> &BTab, const std::vector<double> &VTab,
+                  const bool single_precision = false, const unsigned nthreads = 1, const bool trilinear = false);
+
+
+		/**
+		 * Constructor.
+		 *
+		 * Maps interpolation coefficients from a cache file written by TabField3::WriteCache into memory.
+		 *
+		 * @param cachefile Path of cache file
+		 * @param key Key identifying table file and load parameters, has to match the key stored in the cache file
+		 */
+		TabField3(const boost::filesystem::path &cachefile, const std::uint64_t key);
+
+
+		TabField3(const TabField3&) = delete; ///< not copyable, TabField3::coeffs points into the object's own storage
+		TabField3(TabField3&&) = default; ///< moving keeps TabField3::coeffs valid, as the storage is moved along
+
+
+		/**
+		 * Write grid and interpolation coefficients to a cache file
+		 *
+		 * Writes to a temporary file first and renames it, so other processes never map an incomplete file.
+		 *
+		 * @param cachefile Path of cache file
+		 * @param key Key identifying table file and load parameters
 		 */
-        TabField3(const std::array<std::vector<double>, 3> &xyzTab, const std::array<std::vector<double>, 3> &BTab, const std::vector<double> &VTab);
+		void WriteCache(const boost::filesystem::path &cachefile, const std::uint64_t key) const;
+
+
+		/**
+		 * Get minimum and maximum coordinates of interpolation grid
+		 *
+		 * @param min Returns minimum x, y, and z coordinates
+		 * @param max Returns maximum x, y, and z coordinates
+		 */
+		void GetBounds(std::array<double, 3> &min, std::array<double, 3> &max) const;
+
+
+		/**
+		 * Get smallest distance between neighboring grid points along any axis
+		 *
+		 * @return Returns smallest grid spacing
+		 */
+		double GetMinimumSpacing() const;
 
 
 		/**
@@ -101,6 +256,17 @@ private:
 		void BField(const double x, const double y, const double z, const double t, double B[3], double dBidxj[3][3]) const override;
 
 
+		/**
+		 * Get magnetic field at many points.
+		 *
+		 * First looks up the grid cells of all points, then evaluates the interpolation of all points in one loop over the cells found,
+		 * which does not branch on the grid layout and only reads the coefficient table.
+		 * For parameter doc see TField::BField.
+		 */
+		void BField(const std::size_t n, const double *x, const double *y, const double *z, const double *t,
+				double *const B[3], double *const dBidxj[3][3]) const override;
+
+
 		/**
 		 * Get electric field at a specific point.
 		 *
@@ -116,20 +282,345 @@ private:
 		 */
 		void EField(const double x, const double y, const double z, const double t,
 				double &V, double Ei[3]) const override;
+
+		/**
+		 * Get memory used by the grid and interpolation coefficients
+		 *
+		 * @return Returns size [bytes], including coefficients mapped from a cache file
+		 */
+		std::size_t MemoryUsage() const override;
+
+		/**
+		 * Prefetch interpolation coefficients of the grid cells crossed by a straight path into the CPU cache.
+		 *
+		 * Samples the path at half the grid spacing, up to TabField3::PREFETCH_CELLS cells, and issues a prefetch instruction for every cache line of their coefficients.
+		 * Does not change the cell hints used by TabField3::FindCell. Does nothing if the compiler has no prefetch instruction.
+		 * For parameter doc see TField::Prefetch.
+		 */
+		void Prefetch(const double x1, const double y1, const double z1, const double x2, const double y2, const double z2) const override;
+};
+
+/**
+ * Class for tricubic field interpolation on an adaptively refined octree.
+ *
+ * Resamples another field in a box that is recursively split into eight octants wherever a tricubic interpolation of the whole octant
+ * deviates from the original field by more than a given tolerance. Smooth regions are covered by few large cells,
+ * so fine tables that are only needed near a few features need much less memory.
+ */
+class TabField3Adaptive: public TField{
+private:
+	static const int COMPONENTS = 4; ///< number of interpolated field components (Bx, By, Bz, V)
+	typedef std::array<double, 64*COMPONENTS> tricubic_coeff; ///< interpolation coefficients of all components for one cell, same layout as TabField3::tricubic_coeff
+	std::array<double, 3> min; ///< lower corner of box covered by octree
+	std::array<double, 3> max; ///< upper corner of box covered by octree
+	std::vector<long> tree; ///< nodes of octree, starting with the root; value >= 0 is index of first of eight consecutive children (x-major order), value < 0 is -(index + 1) of coefficients of a leaf
+	std::vector<tricubic_coeff> leafcoeffs; ///< interpolation coefficients of leaf cells
+
+	/**
+	 * Interpolate all field components at a point
+	 *
+	 * @param x X coordinate
+	 * @param y Y coordinate
+	 * @param z Z coordinate
+	 * @param F Returns interpolated field components Bx, By, Bz, and V
+	 * @param dFdxi Returns spatial derivatives of field components
+	 *
+	 * @return Returns false if point is outside of octree
+	 */
+	bool Interpolate(const double x, const double y, const double z, double F[COMPONENTS], double dFdxi[COMPONENTS][3]) const;
+public:
+	/**
+	 * Constructor, builds octree from another field
+	 *
+	 * Values and spatial derivatives at the corners of each cell are taken from the original field, mixed derivatives are calculated by finite differences.
+	 * The interpolated field is compared with the original field at 15 points inside each cell.
+	 *
+	 * @param source Original field, evaluated at time 0
+	 * @param _min Lower corner of box
+	 * @param _max Upper corner of box
+	 * @param minsize Cells with an edge shorter than minsize are not split any further
+	 * @param Btolerance Largest allowed deviation of magnetic-field components [T]
+	 * @param Vtolerance Largest allowed deviation of electric potential [V]
+	 * @param nthreads Number of threads the cells of each level are distributed over
+	 */
+	TabField3Adaptive(const TField &source, const std::array<double, 3> &_min, const std::array<double, 3> &_max, const double minsize,
+					  const double Btolerance, const double Vtolerance, const unsigned nthreads = 1);
+
+	/**
+	 * Get magnetic field at a specific point.
+	 *
+	 * For parameter doc see TField::BField.
+	 */
+	void BField(const double x, const double y, const double z, const double t, double B[3], double dBidxj[3][3]) const override;
+
+	/**
+	 * Get electric field at a specific point.
+	 *
+	 * For parameter doc see TField::EField.
+	 */
+	void EField(const double x, const double y, const double z, const double t, double &V, double Ei[3]) const override;
+
+	/**
+	 * Get memory used by the octree and interpolation coefficients
+	 *
+	 * @return Returns size [bytes]
+	 */
+	std::size_t MemoryUsage() const override;
+};
+
+/**
+ * Class for time-dependent fields given by a series of 3D tables (snapshots) at different times.
+ *
+ * Fields are interpolated linearly in time between the two snapshots bracketing the time of evaluation, and kept constant before the first and after the last snapshot.
+ * Snapshots are loaded when they are first needed and the least recently used ones are unloaded again, so only a few of them are resident at a time.
+ * When a snapshot is loaded, the one following it is loaded in the background.
+ * Each thread keeps the pair of snapshots it used last, so evaluations at nearby times do not have to lock the list of snapshots.
+ */
+class TabField3Series: public TField{
+private:
+	std::vector<double> times; ///< times of snapshots, in ascending order
+	std::function<std::unique_ptr<TabField3>(const std::size_t)> load; ///< function loading a snapshot
+	std::size_t maxresident; ///< number of snapshots that are kept loaded
+	unsigned long serial; ///< unique serial number of this field, used to identify its entries in TabField3Series::current
+	mutable std::mutex mutex; ///< protects the members below
+	mutable std::condition_variable loaded; ///< notified when a snapshot has been loaded
+	mutable std::vector<std::shared_ptr<const TabField3> > snapshots; ///< loaded snapshots (nullptr: not resident)
+	mutable std::vector<bool> loading; ///< true while a snapshot is being loaded
+	mutable std::vector<unsigned long> lastuse; ///< value of TabField3Series::uses when a snapshot was last requested
+	mutable unsigned long uses = 0; ///< number of snapshot requests
+	mutable bool prefetching = false; ///< true while a snapshot is being loaded in the background
+	mutable std::future<void> prefetch; ///< background loading of next snapshot, declared last so it finishes before the other members are destroyed
+
+	/**
+	 * Pair of snapshots used last by a thread
+	 */
+	struct TSnapshotPair{
+		unsigned long serial; ///< serial number of field the pair belongs to
+		std::size_t index; ///< index of first snapshot
+		std::shared_ptr<const TabField3> first; ///< snapshot at or before the time of evaluation
+		std::shared_ptr<const TabField3> second; ///< snapshot after the time of evaluation (nullptr if there is only one)
+	};
+	static thread_local std::vector<TSnapshotPair> current; ///< pairs used last by this thread, one for each series
+
+	/**
+	 * Return snapshot, loading it if it is not resident. mutex has to be locked.
+	 *
+	 * @param i Index of snapshot
+	 * @param lock Lock on mutex, released while the snapshot is loaded
+	 */
+	std::shared_ptr<const TabField3> Snapshot(const std::size_t i, std::unique_lock<std::mutex> &lock) const;
+
+	/**
+	 * Make loaded snapshot resident and unload least recently used snapshots. mutex has to be locked.
+	 *
+	 * @param i Index of snapshot
+	 * @param snapshot Loaded snapshot
+	 */
+	void Store(const std::size_t i, const std::shared_ptr<const TabField3> &snapshot) const;
+
+	/**
+	 * Find snapshots bracketing a time
+	 *
+	 * @param t Time
+	 * @param first Returns snapshot at or before t
+	 * @param second Returns snapshot after t (nullptr if there is only one snapshot)
+	 * @param w Returns weight of second snapshot in linear interpolation
+	 */
+	void Snapshots(const double t, const TabField3 *&first, const TabField3 *&second, double &w) const;
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param _times Times of snapshots, in ascending order
+	 * @param _load Function loading a snapshot, called with its index. Is called by several threads and in the background, so it must not change shared state.
+	 * @param _maxresident Number of snapshots kept loaded (at least 3)
+	 */
+	TabField3Series(const std::vector<double> &_times, const std::function<std::unique_ptr<TabField3>(const std::size_t)> &_load, const std::size_t _maxresident = 3);
+
+	/**
+	 * Get boundaries of the grid of the first snapshot, all snapshots should cover the same region
+	 *
+	 * @param min Returns lower corner of grid
+	 * @param max Returns upper corner of grid
+	 */
+	void GetBounds(std::array<double, 3> &min, std::array<double, 3> &max) const;
+
+	/**
+	 * Get magnetic field at a specific point, interpolated in time between snapshots
+	 *
+	 * For parameter doc see TField::BField.
+	 */
+	void BField(const double x, const double y, const double z, const double t, double B[3], double dBidxj[3][3]) const override;
+
+	/**
+	 * Get electric field at a specific point, interpolated in time between snapshots
+	 *
+	 * For parameter doc see TField::EField.
+	 */
+	void EField(const double x, const double y, const double z, const double t, double &V, double Ei[3]) const override;
+
+	/**
+	 * Get memory used by the snapshots that are currently loaded
+	 *
+	 * @return Returns size [bytes]
+	 */
+	std::size_t MemoryUsage() const override;
 };
 
+/**
+ * Symmetries of a field whose table only covers its fundamental domain, see TabField3Symmetric
+ */
+struct TTableSymmetry{
+	std::array<int, 3> mirror = {{0, 0, 0}}; ///< Mirror symmetry at the planes x = 0, y = 0, and z = 0: 1 if the sources are mirror-symmetric, -1 if they change sign, 0 if there is no symmetry
+	unsigned rotation = 1; ///< Order of discrete rotational symmetry about the z axis (1: no symmetry)
+};
+
+/**
+ * Class for symmetric fields whose table only covers the fundamental domain
+ *
+ * Each point is rotated about the z axis into the sector 0 <= phi < 360 deg/N of an N-fold rotational symmetry,
+ * and then reflected at the mirror planes onto the side covered by the table. The field found there is transformed back.
+ * The magnetic field is a pseudovector, so at a plane of mirror-symmetric sources its normal component is even and its other components are odd,
+ * and the electric potential is even. Sources changing sign at the plane flip all of these signs.
+ */
+class TabField3Symmetric: public TField{
+private:
+	std::shared_ptr<const TField> table; ///< field covering the fundamental domain
+	std::array<double, 3> tablemin; ///< lower corner of table
+	std::array<double, 3> tablemax; ///< upper corner of table
+	TTableSymmetry symmetry; ///< symmetries of field
+	std::array<double, 3> side; ///< side of each mirror plane covered by the table (1 or -1)
+	std::vector<std::array<double, 2> > sectors; ///< cosine and sine of the angle at which each sector of the rotational symmetry starts
+	double slack; ///< mapped points outside of the table by less than this distance are moved onto its boundary, so rounding errors of the rotation do not create gaps between sectors
+
+	/**
+	 * Map point into fundamental domain
+	 *
+	 * @param x X coordinate
+	 * @param y Y coordinate
+	 * @param z Z coordinate
+	 * @param u Returns coordinates in fundamental domain
+	 * @param R Returns orthogonal matrix mapping the point into the fundamental domain (u = R*x)
+	 * @param Bsign Returns sign of magnetic field in fundamental domain relative to the mapped field
+	 * @param Vsign Returns sign of electric potential in fundamental domain relative to the mapped potential
+	 *
+	 * @return Returns false if the mapped point lies outside of the table
+	 */
+	bool Map(const double x, const double y, const double z, double u[3], double R[3][3], double &Bsign, double &Vsign) const;
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param _table Field covering the fundamental domain
+	 * @param _min Lower corner of table
+	 * @param _max Upper corner of table
+	 * @param _symmetry Symmetries of field. With a rotational symmetry, the table has to cover the sector 0 <= phi < 360 deg/N.
+	 */
+	TabField3Symmetric(std::shared_ptr<const TField> _table, const std::array<double, 3> &_min, const std::array<double, 3> &_max, const TTableSymmetry &_symmetry);
+
+	/**
+	 * Get boundaries of the whole symmetric field
+	 *
+	 * @param min Returns lower corner of the box covered by the field
+	 * @param max Returns upper corner of the box covered by the field
+	 */
+	void GetBounds(std::array<double, 3> &min, std::array<double, 3> &max) const;
+
+	/**
+	 * Get magnetic field at a specific point.
+	 *
+	 * For parameter doc see TField::BField.
+	 */
+	void BField(const double x, const double y, const double z, const double t, double B[3], double dBidxj[3][3]) const override;
+
+	/**
+	 * Get magnetic field at many points, evaluating the table for all mapped points at once.
+	 *
+	 * For parameter doc see TField::BField.
+	 */
+	void BField(const std::size_t n, const double *x, const double *y, const double *z, const double *t,
+			double *const B[3], double *const dBidxj[3][3]) const override;
+
+	/**
+	 * Get electric field at a specific point.
+	 *
+	 * For parameter doc see TField::EField.
+	 */
+	void EField(const double x, const double y, const double z, const double t, double &V, double Ei[3]) const override;
+
+	/**
+	 * Get memory used by the table of the fundamental domain
+	 *
+	 * @return Returns size [bytes]
+	 */
+	std::size_t MemoryUsage() const override;
+};
+
+/**
+ * Calculate key identifying interpolation coefficients in a cache file
+ *
+ * Combines a 64-bit FNV-1a hash of the parameters with the contents of a table file.
+ *
+ * @param parameters String containing all parameters that influence the interpolation coefficients
+ * @param ft Table file (optional)
+ *
+ * @return Returns key
+ */
+std::uint64_t TableKey(const std::string &parameters, const boost::filesystem::path &ft = boost::filesystem::path());
+
+/**
+ * Load interpolated table from cache file, or calculate it and store it in cache file
+ *
+ * Holds a lock on the cache file while it is generated, so simultaneous jobs calculate the coefficients only once.
+ * All jobs then map the same cache file into memory, sharing one physical copy of the coefficients.
+ *
+ * @param cachefile Cache file
+ * @param key Key identifying the table, see TableKey
+ * @param calculate Function calculating the interpolated table if it is not found in the cache file
+ *
+ * @return Returns interpolated table
+ */
+std::unique_ptr<TabField3> GetCachedTable(const boost::filesystem::path &cachefile, const std::uint64_t key, const std::function<std::unique_ptr<TabField3>()> &calculate);
+
 /**
  * Read 3D table file exported from OPERA
  * @param params String containing parameters defined in config.in. Should contain field type "3Dtable", file name, magnetic field scaling formula, electric field scaling formula, and boundary width
+ * (and length conversion factor for type "OPERA3D"), optionally followed by precision of interpolation coefficients ("double" or "float"), interpolation order ("tricubic" or "trilinear"), and symmetries of the field (mirrorx, mirrory, mirrorz, antimirrorx, antimirrory, antimirrorz, or rotzN, see TabField3Symmetric).
+ * Type "OPERA3D_ADAPTIVE" expects the length conversion factor followed by the tolerances of magnetic field and electric potential and resamples the table on an octree (see TabField3Adaptive).
+ * @param formulas Formulas that can be used in scaling formulas
+ * @param cachedir Directory in which interpolation coefficients are cached (empty: no cache)
+ * @param nthreads Number of threads used to calculate interpolation coefficients
+ * @param stride Only every stride-th grid node along each axis (and the last one) is used, for quick exploratory runs with coarser tables
+ * @return Pointer to created class, derived from TField
+ */
+TFieldContainer ReadOperaField3(const std::string &params, const std::map<std::string, std::string> &formulas, const boost::filesystem::path &cachedir = boost::filesystem::path(),
+                                const unsigned nthreads = 1, const unsigned stride = 1);
+
+/**
+ * Read series of 3D table files exported from OPERA at different times, see TabField3Series
+ * @param params String containing parameters defined in config.in. Should contain field type "OPERA3D_SERIES", name of a file listing the time and table file of each snapshot,
+ * magnetic field scaling formula, electric field scaling formula, boundary width, and length conversion factor, optionally followed by precision of interpolation coefficients ("double" or "float"), interpolation order ("tricubic" or "trilinear"), and symmetries of the field.
+ * All tables have to cover the same region. If a cache directory is given, interpolation coefficients of all snapshots are calculated at startup and snapshots are mapped from the cache files when needed.
+ * @param formulas Formulas that can be used in scaling formulas
+ * @param cachedir Directory in which interpolation coefficients are cached (empty: no cache, snapshots are read from the table files when needed)
+ * @param nthreads Number of threads used to calculate interpolation coefficients
+ * @param stride Only every stride-th grid node along each axis (and the last one) is used, for quick exploratory runs with coarser tables
  * @return Pointer to created class, derived from TField
  */
-TFieldContainer ReadOperaField3(const std::string &params, const std::map<std::string, std::string> &formulas);
+TFieldContainer ReadOperaField3Series(const std::string &params, const std::map<std::string, std::string> &formulas, const boost::filesystem::path &cachedir = boost::filesystem::path(),
+                                      const unsigned nthreads = 1, const unsigned stride = 1);
 
 /**
 * Read generic file containing table of magnetic field mapped on list of points, e.g. exported from COMSOL
-* @param params String containing parameters defined in config.in. Should contain field type "COMSOL", file name, magnetic field scaling formula, and boundary width
+* @param params String containing parameters defined in config.in. Should contain field type "COMSOL", file name, magnetic field scaling formula, boundary width, and length conversion factor,
+* optionally followed by precision of interpolation coefficients ("double" or "float"), interpolation order ("tricubic" or "trilinear"), and symmetries of the field
+* @param formulas Formulas that can be used in scaling formulas
+* @param cachedir Directory in which interpolation coefficients are cached (empty: no cache)
+* @param nthreads Number of threads used to calculate interpolation coefficients
+* @param stride Only every stride-th grid node along each axis (and the last one) is used, for quick exploratory runs with coarser tables
 * @return Pointer to created class, derived from TField
 */
-TFieldContainer ReadComsolField(const std::string &params, const std::map<std::string, std::string> &formulas);
+TFieldContainer ReadComsolField(const std::string &params, const std::map<std::string, std::string> &formulas, const boost::filesystem::path &cachedir = boost::filesystem::path(),
+                                const unsigned nthreads = 1, const unsigned stride = 1);
 
 #endif // FIELD_3D_H_
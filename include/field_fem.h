@@ -0,0 +1,157 @@
+/**
+ * \file
+ * Interpolation of magnetic fields given on unstructured tetrahedral meshes, e.g. exported from finite-element solvers.
+ */
+
+#ifndef FIELD_FEM_H_
+#define FIELD_FEM_H_
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "field.h"
+
+/**
+ * Magnetic field interpolated on the tetrahedral mesh of a finite-element solution, without resampling it onto a regular grid.
+ *
+ * The gradient at each node is recovered from the volume-weighted average of the constant gradients of the linear interpolation in the adjacent tetrahedra.
+ * Inside each tetrahedron the field is interpolated quadratically from the values at its four corners and at its six edge midpoints,
+ * which are estimated by cubic Hermite interpolation along each edge from the values and recovered gradients at its ends.
+ * The interpolation is therefore continuous across faces, reproduces linear fields exactly, and has gradients that vary linearly inside each tetrahedron.
+ *
+ * Points are located by walking from the tetrahedron found last by the same thread to the neighbour across the face the point lies behind.
+ * If the walk leaves the mesh or takes too long, a bounding-volume hierarchy over the tetrahedra is searched.
+ * Memory therefore scales with the size of the mesh rather than with its finest element.
+ */
+class TabFieldFEM: public TField{
+private:
+    /**
+     * Tetrahedron of the mesh
+     */
+    struct TTetrahedron{
+        std::array<std::uint32_t, 4> nodes; ///< Indices of corner nodes
+        std::array<std::int32_t, 4> neighbors; ///< Index of tetrahedron sharing the face opposite of each corner (-1: face is on the boundary of the mesh)
+        double T[3][3]; ///< Barycentric coordinates of corners 1 to 3 of a point p are T*(p - corner 0)
+    };
+
+    /**
+     * Node of the bounding-volume hierarchy
+     */
+    struct TBVHNode{
+        double min[3]; ///< Lower corner of bounding box
+        double max[3]; ///< Upper corner of bounding box
+        std::uint32_t first; ///< Index of second child (first child follows this node), or first entry in TabFieldFEM::bvhorder if this is a leaf
+        std::uint32_t count; ///< Number of tetrahedra in leaf (0: node has children)
+    };
+
+    std::vector<std::array<double, 3> > nodes; ///< Coordinates of mesh nodes
+    std::vector<std::array<double, 3> > values; ///< Magnetic field at each node
+    std::vector<std::array<std::array<double, 3>, 3> > gradients; ///< Recovered gradient dB_i/dx_j at each node
+    std::vector<TTetrahedron> tetrahedra; ///< Tetrahedra of the mesh
+    std::vector<TBVHNode> bvh; ///< Bounding-volume hierarchy over the tetrahedra, first node is root
+    std::vector<std::uint32_t> bvhorder; ///< Indices of tetrahedra in the order referenced by the leaves of TabFieldFEM::bvh
+    std::array<double, 3> min; ///< Lower corner of bounding box of mesh
+    std::array<double, 3> max; ///< Upper corner of bounding box of mesh
+
+    /**
+     * Tetrahedron in which a thread found the last point, starting point of the next walk
+     */
+    struct TLocationHint{
+        const TabFieldFEM *field = nullptr; ///< Field that found the tetrahedron
+        std::uint32_t tetrahedron = 0; ///< Index of tetrahedron
+    };
+    static thread_local TLocationHint hint; ///< Hint of the current thread
+
+    /**
+     * Calculate barycentric coordinates of a point in a tetrahedron
+     *
+     * @param tet Index of tetrahedron
+     * @param p Point
+     * @param lambda Returns barycentric coordinates with respect to each corner
+     *
+     * @return Returns index of smallest barycentric coordinate, the point is outside of the tetrahedron behind the face opposite of this corner if it is negative
+     */
+    int Barycentric(const std::uint32_t tet, const double p[3], double lambda[4]) const;
+
+    /**
+     * Find tetrahedron containing a point
+     *
+     * @param p Point
+     * @param lambda Returns barycentric coordinates of point in tetrahedron
+     *
+     * @return Returns index of tetrahedron, or -1 if the point is outside of the mesh
+     */
+    long Locate(const double p[3], double lambda[4]) const;
+
+    /**
+     * Build subtree of bounding-volume hierarchy containing a range of TabFieldFEM::bvhorder
+     *
+     * @param centroids Centroid of each tetrahedron
+     * @param begin First entry in bvhorder belonging to subtree
+     * @param end Entry in bvhorder after last tetrahedron belonging to subtree
+     */
+    void BuildBVH(const std::vector<std::array<double, 3> > &centroids, const std::size_t begin, const std::size_t end);
+
+public:
+    /**
+     * Constructor, prepares interpolation
+     *
+     * @param anodes Coordinates of mesh nodes [m]
+     * @param avalues Magnetic field at each node [T]
+     * @param elements Indices of the four corner nodes of each tetrahedron, starting at zero
+     * @param nthreads Number of threads used to prepare the tetrahedra
+     */
+    TabFieldFEM(std::vector<std::array<double, 3> > anodes, std::vector<std::array<double, 3> > avalues, const std::vector<std::array<std::uint32_t, 4> > &elements,
+                const unsigned nthreads = 1);
+
+    /**
+     * Interpolate magnetic field
+     *
+     * Leaves B and dBidxj unchanged outside of the mesh.
+     *
+     * @param x Cartesian x coordinate
+     * @param y Cartesian y coordinate
+     * @param z Cartesian z coordinate
+     * @param t Time
+     * @param B Returns magnetic-field components
+     * @param dBidxj Returns spatial derivatives of magnetic-field components (optional)
+     */
+    void BField(const double x, const double y, const double z, const double t, double B[3], double dBidxj[3][3]) const override;
+
+    /**
+     * Mesh contains no electric fields, does nothing
+     */
+    void EField(const double x, const double y, const double z, const double t, double &V, double Ei[3]) const override{ }
+
+    /**
+     * Get bounding box of mesh
+     *
+     * @param amin Returns lower corner
+     * @param amax Returns upper corner
+     */
+    void GetBounds(std::array<double, 3> &amin, std::array<double, 3> &amax) const{ amin = min; amax = max; }
+
+    std::size_t MemoryUsage() const override;
+};
+
+
+/**
+ * Read magnetic field on a tetrahedral mesh from a file exported from COMSOL in the "Sectionwise" format, see TabFieldFEM
+ *
+ * The file contains a section "% Coordinates" listing the nodes, a section "% Elements (tetrahedra)" listing the four corner nodes of each element (starting at 1),
+ * and three sections "% Data (...)" listing Bx, By, and Bz at each node. Other lines starting with % are ignored.
+ *
+ * @param params String containing parameters defined in config.in. Should contain field type "FEM", file name, magnetic field scaling formula, boundary width, and length conversion factor
+ * @param formulas Formulas that can be used in scaling formulas
+ * @param nthreads Number of threads used to prepare the mesh
+ *
+ * @return Returns field container
+ */
+TFieldContainer ReadFEMField(const std::string &params, const std::map<std::string, std::string> &formulas, const unsigned nthreads = 1);
+
+#endif // FIELD_FEM_H_
@@ -7,6 +7,7 @@
 #define FIELDS_H_
 
 #include <vector>
+#include <array>
 
 #include "field.h"
 #include "config.h"
@@ -18,7 +19,102 @@
 class TFieldManager{
 private:
     std::vector< TFieldContainer > fields; ///< list of fields
-		
+
+	/**
+	 * Coarse grid of voxels covering the boundary boxes of all bounded fields, used to skip fields that do not contain a point.
+	 */
+	struct TFieldIndex{
+		std::array<double, 3> min; ///< Lower corner of grid
+		std::array<double, 3> max; ///< Upper corner of grid
+		std::array<double, 3> size; ///< Size of voxels
+		std::array<unsigned, 3> n = {{0, 0, 0}}; ///< Number of voxels along each axis
+		std::vector< std::vector<unsigned> > voxelfields; ///< Indices of fields whose boundary box overlaps each voxel, plus all unbounded fields, in ascending order
+		std::vector<unsigned> unboundedfields; ///< Indices of fields without boundary, visited for points outside the grid
+	};
+	TFieldIndex index; ///< Spatial index of fields
+	std::vector<bool> baked; ///< Fields that are replaced by the table of baked fields inside TFieldManager::bakeregion
+	TFieldBoundaryBox bakeregion; ///< Region covered by table of baked fields (no bounds: no fields baked)
+	double rffrequency = 0; ///< Common carrier frequency of all RF pulses [rad/s] (0: no RF pulses)
+
+	/**
+	 * Declare a loaded field as RF pulse, see TFieldContainer::DeclareRF
+	 *
+	 * @param params String containing definition of RF pulse in FIELDS section of configuration: "RFPulse", identifier of field, carrier frequency [rad/s] (number or formula), and carrier phase [degree]
+	 * @param identifiers Index in TFieldManager::fields of each loaded field, by its identifier in the FIELDS section
+	 * @param formulas Formulas that can be used for the carrier frequency
+	 */
+	void DeclareRF(const std::string &params, const std::map<std::string, unsigned> &identifiers, const std::map<std::string, std::string> &formulas);
+
+	/**
+	 * Sample static analytic magnetic fields on a grid and replace them by a single tricubic table inside the grid.
+	 *
+	 * Appends the table to TFieldManager::fields and marks the sampled fields in TFieldManager::baked.
+	 *
+	 * @param params String containing boundaries of baked region (xmax xmin ymax ymin zmax zmin) and grid spacing
+	 * @param definitions Definitions of all fields in FIELDS section of configuration, used to identify cached tables
+	 * @param bakeable Fields that are analytic magnetic fields and can be baked
+	 * @param formulas Formulas used in field definitions
+	 * @param cachedir Directory in which the table is cached (empty: no cache)
+	 * @param nthreads Number of threads used to sample fields and calculate interpolation coefficients
+	 */
+	void BakeFields(const std::string &params, const std::vector<std::string> &definitions, const std::vector<bool> &bakeable,
+					const std::map<std::string, std::string> &formulas, const boost::filesystem::path &cachedir, const unsigned nthreads);
+
+	/**
+	 * Build spatial index TFieldManager::index over boundary boxes of all fields
+	 */
+	void BuildIndex();
+
+	/**
+	 * Get fields that might be non-zero at a point.
+	 *
+	 * @param x Cartesian x coordinate
+	 * @param y Cartesian y coordinate
+	 * @param z Cartesian z coordinate
+	 *
+	 * @return Returns indices of fields whose boundary box might contain the point, plus all unbounded fields, in ascending order
+	 */
+	const std::vector<unsigned>& FieldsAt(const double x, const double y, const double z) const;
+
+	/**
+	 * Fields evaluated at a point in space and time
+	 */
+	struct TFieldCacheEntry{
+		unsigned long serial = 0; ///< Serial number of field manager that evaluated the fields (0: entry unused)
+		double x, y, z, t; ///< Position and time at which fields were evaluated
+		bool hasB = false, hasdB = false, hasE = false; ///< Which of the fields below were evaluated
+		double B[3]; ///< Magnetic field
+		double dBidxj[3][3]; ///< Spatial derivatives of magnetic field
+		double V; ///< Electric potential
+		double Ei[3]; ///< Electric field
+	};
+
+	/**
+	 * Small ring buffer of recently evaluated fields.
+	 *
+	 * Within one trajectory step the same point is evaluated several times (last integrator stage, spin tracking, logging).
+	 * The cache is thread-local, so each tracker running in its own thread has its own cache and no locking is needed.
+	 */
+	struct TFieldCache{
+		std::array<TFieldCacheEntry, 8> entries; ///< Cached entries
+		unsigned int next = 0; ///< Index of entry that will be overwritten next
+	};
+
+	static thread_local TFieldCache cache; ///< Field cache of current thread
+	unsigned long serial; ///< Unique serial number of this field manager, used to identify its cache entries
+
+	/**
+	 * Find cache entry for a point, or create a new one if there is no entry for it yet.
+	 *
+	 * @param x Cartesian x coordinate
+	 * @param y Cartesian y coordinate
+	 * @param z Cartesian z coordinate
+	 * @param t Time
+	 *
+	 * @return Returns entry for this point
+	 */
+	TFieldCacheEntry& GetCacheEntry(const double x, const double y, const double z, const double t) const;
+
 public:
 	TFieldManager(const TFieldManager &f) = delete; ///< TFieldManager is not copyable
 	TFieldManager& operator=(const TFieldManager &f) = delete; ///< TFieldManager is not copyable
@@ -46,6 +142,24 @@ public:
 	void BField(const double x, const double y, const double z, const double t, double B[3], double dBidxj[3][3] = nullptr) const;
 
 
+	/**
+	 * Calculate superposition of all loaded magnetic fields at many points, stored as structure of arrays
+	 *
+	 * Used by TTracker::AdvanceBatch to evaluate each Runge-Kutta stage of a batch of particles in one call.
+	 * Sorts the points by the fields that might contain them and passes all points of a field to its batched evaluation (TField::BField) at once,
+	 * so tables can process them in a single kernel. Results are identical to the single-point version, but the field cache is not used.
+	 *
+	 * @param n Number of points
+	 * @param x Cartesian x coordinates
+	 * @param y Cartesian y coordinates
+	 * @param z Cartesian z coordinates
+	 * @param t Times
+	 * @param B Returns magnetic x, y, and z components of magnetic field at each point
+	 * @param dBidxj Returns spatial derivatives of each magnetic-field component at each point (optional)
+	 */
+	void BField(const std::size_t n, const double *x, const double *y, const double *z, const double *t, double *const B[3], double *const dBidxj[3][3] = nullptr) const;
+
+
 	/**
 	 * Calculate electric field and potential at a given position.
 	 *
@@ -60,6 +174,69 @@ public:
 	 */
 	void EField(const double x, const double y, const double z, const double t,
 			double &V, double Ei[3]) const;
+
+
+	/**
+	 * Calculate distance from a given position to the closest region in which any field is non-zero, as defined by the fields' boundaries.
+	 *
+	 * @param x Cartesian x coordinate
+	 * @param y Cartesian y coordinate
+	 * @param z Cartesian z coordinate
+	 *
+	 * @return Returns distance to closest field boundary, zero if the position is inside any field or any field has no boundary, infinity if there are no fields
+	 */
+	double FieldFreeDistance(const double x, const double y, const double z) const;
+
+	/**
+	 * Hint that fields will soon be evaluated along a straight path, e.g. the extrapolated next trajectory step.
+	 *
+	 * Passes the path to TField::Prefetch of all fields that might contain its end point, so field tables load the cells it crosses into the cache.
+	 *
+	 * @param x1 Cartesian x coordinate of start of path
+	 * @param y1 Cartesian y coordinate of start of path
+	 * @param z1 Cartesian z coordinate of start of path
+	 * @param x2 Cartesian x coordinate of end of path
+	 * @param y2 Cartesian y coordinate of end of path
+	 * @param z2 Cartesian z coordinate of end of path
+	 */
+	void Prefetch(const double x1, const double y1, const double z1, const double x2, const double y2, const double z2) const;
+
+	/**
+	 * Calculate magnetic field split into static fields and RF pulses, which is used to integrate spins in the frame rotating with the RF carrier
+	 *
+	 * The total magnetic field is B0 + B1c*cos(omega*t) - B1s*sin(omega*t) with the carrier frequency omega returned by RFFrequency.
+	 * "Static" fields include all fields not declared as RF pulses, even if their scaling formulas depend on time. The field cache is not used.
+	 *
+	 * @param x Cartesian x coordinate
+	 * @param y Cartesian y coordinate
+	 * @param z Cartesian z coordinate
+	 * @param t Time
+	 * @param B0 Returns sum of all fields that are not RF pulses
+	 * @param B1c Returns envelope of RF pulses in phase with cos(omega*t)
+	 * @param B1s Returns envelope of RF pulses in phase with -sin(omega*t)
+	 */
+	void BFieldRF(const double x, const double y, const double z, const double t, double B0[3], double B1c[3], double B1s[3]) const;
+
+	/**
+	 * Get carrier frequency shared by all RF pulses
+	 *
+	 * @return Returns angular frequency [rad/s], 0 if there are no RF pulses
+	 */
+	double RFFrequency() const{ return rffrequency; }
+
+	/**
+	 * Check if all magnetic fields are constant in time
+	 *
+	 * @return Returns true if no magnetic-field scaling formula depends on time
+	 */
+	bool IsBFieldStatic() const;
+
+	/**
+	 * Get memory used by all fields and the spatial index
+	 *
+	 * @return Returns approximate size [bytes], tables shared by several fields are counted once
+	 */
+	std::size_t MemoryUsage() const;
 };
 
 #endif // FIELDS_H_
@@ -0,0 +1,49 @@
+/**
+ * \file
+ * Compile formulas to native code.
+ */
+
+#ifndef FORMULACOMPILER_H_
+#define FORMULACOMPILER_H_
+
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+/**
+ * Natively compiled formula
+ *
+ * @param t Value of variable "t"
+ * @param x Value of variable "x"
+ * @param y Value of variable "y"
+ * @param z Value of variable "z"
+ *
+ * @return Returns value of formula
+ */
+typedef double (*TNativeFormula)(const double t, const double x, const double y, const double z);
+
+/**
+ * Enable compilation of formulas to native code.
+ *
+ * Formulas are translated to C++ and compiled into shared libraries with the compiler given in the environment variable CXX (default: c++).
+ * The libraries are stored in a directory and reused by later runs using the same formulas.
+ *
+ * @param dir Directory in which the compiled formulas are stored (empty: disable compilation)
+ */
+void EnableNativeFormulas(const boost::filesystem::path &dir);
+
+/**
+ * Compile formula to native code.
+ *
+ * Supports numbers, the variables in the list, the constants pi, epsilon, inf, true, and false, the operators +, -, *, /, %, ^, comparisons, and, or, not, ternary operators,
+ * if(condition, a, b), and common mathematical functions. The compiled formula is compared to the exprtk interpreter at several points before it is used.
+ *
+ * @param formula Formula string in exprtk syntax
+ * @param variables Variables that may be used in the formula, a subset of "t", "x", "y", and "z"
+ *
+ * @return Returns compiled formula, or nullptr if native compilation is not enabled, the formula uses unsupported syntax, or no compiler is available
+ */
+TNativeFormula CompileNativeFormula(const std::string &formula, const std::vector<std::string> &variables);
+
+#endif // FORMULACOMPILER_H_
@@ -6,12 +6,18 @@
 #ifndef GEOMETRY_H_
 #define GEOMETRY_H_
 
+#include <algorithm>
+#include <array>
+#include <iterator>
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
 
 #include "trianglemesh.h"
+#include "primitives.h"
 #include "config.h"
+#include "transfer.h"
 
 #include <boost/format.hpp>
 #include <boost/filesystem.hpp>
@@ -36,13 +42,51 @@ std::istream& operator>>(std::istream &str, material &mat);
 std::ostream& operator<<(std::ostream &str, const material &mat);
 
 
+/**
+ * Constants of the interface between two materials that do not depend on the energy of a neutron hitting it, calculated once when the geometry is loaded
+ */
+struct TMaterialInterface{
+	/**
+	 * Constants of the material on one side of the interface
+	 */
+	struct TSide{
+		double FermiImag; ///< Imaginary part of Fermi potential [eV]
+		double LambertProb; ///< Probability of diffuse reflection according to Lambert or modified Lambert model
+		double SpinflipProb; ///< Probability for spin flip on reflection
+		double LossPerBounce; ///< Probability of loss when hitting the wall (independent of neutron energy)
+		double MRmaxenergy; ///< Largest kinetic energy and potential step [eV] for which the MicroRoughness model is valid (wave numbers smaller than 1/RMSRoughness), 0 if the surface is not rough
+	};
+	TSide leaving; ///< Material the neutron is leaving
+	TSide entering; ///< Material the neutron is entering
+	double potentialstep; ///< Difference of real Fermi potentials of entering and leaving material [eV]
+	double fieldstep; ///< Difference of internal magnetic fields of entering and leaving material [T]
+
+	/**
+	 * Constructor, calculates constants
+	 *
+	 * @param aleaving Material the neutron is leaving
+	 * @param aentering Material the neutron is entering
+	 */
+	TMaterialInterface(const material &aleaving, const material &aentering);
+};
+
+
 /// Struct to store solid information (read from geometry.in)
 struct solid{
-	boost::filesystem::path filename; ///< name of file containing STL mesh
+	boost::filesystem::path filename; ///< name of file containing STL mesh, or expression of analytic solid (see TPrimitive::Parse)
 	std::string name; ///< name of solid
 	material mat; ///< material of solid
+	unsigned matindex = 0; ///< index of material in list of materials, selects the entry of other solids' interfaces
+	std::shared_ptr<const std::vector<TMaterialInterface> > interfaces; ///< interfaces between this solid's material and each material, indexed by matindex, shared by all solids with the same material
 	unsigned ID; ///< ID of solid
-	std::vector<std::pair<double, double> > ignoretimes; ///< pairs of times, between which the solid should be ignored
+	std::vector<std::pair<double, double> > ignoretimes; ///< pairs of times, between which the solid should be ignored, sorted and merged by MergeIgnoretimes
+	double importance; ///< importance of the region inside the solid, particles are split or killed by Russian roulette when the importance changes (read from IMPORTANCE section, default 1)
+	std::vector<material> weightmats; ///< alternative materials of weighted tracking, one for each entry in the WEIGHTS section (empty if there is no WEIGHTS section)
+	bool record; ///< state of particles entering the solid is written to a phase-space file (read from PHASESPACE section)
+	bool stoprecorded; ///< particles are stopped after their state was written to a phase-space file (read from PHASESPACE section)
+	unsigned transferexit = 0; ///< ID of the solid at the exit of a guide section starting at this solid, 0: no guide section (read from TRANSFER section)
+	std::shared_ptr<const TTransferTable> transfer; ///< particles entering the solid jump to an exit state drawn from this table; if empty, their entry and exit states are written to transfer files (read from TRANSFER section)
+	std::vector<std::pair<unsigned, std::shared_ptr<const solid> > > surfaces; ///< copies of this solid with the materials of its tagged triangles, see TCollision::tag (read from SURFACES section)
 
 	/**
 	 * Comparison operator used to sort solids by priority (descending)
@@ -53,6 +97,32 @@ struct solid{
 	 */
 	bool operator< (const solid s) const { return ID > s.ID; };
 
+	/**
+	 * Get constants of the interface between this solid's material and the material of another solid
+	 *
+	 * @param entering Solid on the other side of the interface
+	 *
+	 * @return Returns constants for a particle leaving this solid and entering the other one
+	 */
+	const TMaterialInterface& GetInterface(const solid &entering) const{
+		return (*interfaces)[entering.matindex];
+	}
+
+	/**
+	 * Get solid with the material of a tagged surface
+	 *
+	 * @param tag Surface tag of hit triangle, see TCollision::tag
+	 *
+	 * @return Returns copy of this solid with the material assigned to the tag, or this solid if no material is assigned to it
+	 */
+	const solid& GetSurface(const unsigned tag) const{
+		for (auto &s: surfaces){
+			if (s.first == tag)
+				return *s.second;
+		}
+		return *this;
+	}
+
 	/**
 	 * Check if solid is ignored at a certain time
 	 * 
@@ -61,9 +131,54 @@ struct solid{
 	 * @return Returns true if solid is ignored at time t
 	 */
 	bool is_ignored(const double t) const{
-	    return std::any_of(ignoretimes.begin(), ignoretimes.end(),
-	            [&t](const std::pair<double, double> &its){ return t >= its.first && t < its.second; }
-	            ); // check if collision time lies between any pair of ignore times};
+		if (ignoretimes.empty())
+			return false;
+		auto its = LastIgnoretimesBefore(t);
+		return its != ignoretimes.end() && t < its->second;
+	}
+
+	/**
+	 * Check if solid is ignored during a whole time interval
+	 *
+	 * @param t1 Start of interval
+	 * @param t2 End of interval
+	 *
+	 * @return Returns true if solid is ignored at all times between t1 and t2
+	 */
+	bool is_ignored(const double t1, const double t2) const{
+		auto its = LastIgnoretimesBefore(t1);
+		return its != ignoretimes.end() && t1 < its->second && t2 < its->second; // merged intervals cannot be extended by following ones
+	}
+
+	/**
+	 * Sort pairs of ignore times and merge overlapping and adjacent ones, so is_ignored only has to check a single pair
+	 */
+	void MergeIgnoretimes(){
+		std::sort(ignoretimes.begin(), ignoretimes.end());
+		std::vector<std::pair<double, double> > merged;
+		for (auto &its: ignoretimes){
+			if (its.second <= its.first) // empty interval
+				continue;
+			if (not merged.empty() && its.first <= merged.back().second)
+				merged.back().second = std::max(merged.back().second, its.second);
+			else
+				merged.push_back(its);
+		}
+		ignoretimes.swap(merged);
+	}
+
+private:
+	/**
+	 * Find pair of ignore times with the latest start time not after t
+	 *
+	 * @param t Time
+	 *
+	 * @return Returns iterator pointing to pair, or end of list if all pairs start after t
+	 */
+	std::vector<std::pair<double, double> >::const_iterator LastIgnoretimesBefore(const double t) const{
+		auto its = std::upper_bound(ignoretimes.begin(), ignoretimes.end(), t,
+				[](const double time, const std::pair<double, double> &i){ return time < i.first; }); // first pair starting after t
+		return its == ignoretimes.begin() ? ignoretimes.end() : std::prev(its);
 	}
 };
 
@@ -80,9 +195,86 @@ std::ostream& operator<<(std::ostream &str, const solid &sld);
  */
 struct TGeometry{
 	private:
-		std::vector<solid> solids; ///< solids list
+		std::vector<solid> solids; ///< solids list, including default solid
+		std::vector<int> solidindex; ///< Index in solids list of each solid ID (-1 if no solid with this ID exists)
+		bool collisioncache = false; ///< Test segments against cached triangles close to previous segments first (collisioncache option in GLOBAL section)
+		bool ignoretimes = false; ///< Set if any solid has ignore times, otherwise collisions are never ignored and their solids do not have to be looked up
+		std::vector<std::pair<unsigned, std::shared_ptr<const TPrimitive> > > primitives; ///< Analytic solids, paired with ID of solid they belong to, shared with copies of the geometry
+		CGAL::Bbox_3 boundingbox; ///< Overall bounding box of all triangle meshes and analytic solids
+		std::vector<CGAL::Bbox_3> boundingboxes; ///< Bounding boxes of each triangle mesh and analytic solid, their union is the simulated volume
+		std::array<double, 3> cellorigin; ///< Corner of periodic unit cell (PERIODIC section)
+		std::vector<std::array<double, 3> > latticevectors; ///< Lattice vectors spanning the periodic unit cell, empty if the geometry is not periodic
+		std::vector<std::array<double, 3> > dualvectors; ///< Vectors whose scalar product with a position relative to cellorigin gives its coordinate along each lattice vector
+
+		/**
+		 * Add collisions of line segment p1->p2 with analytic solids to list of collisions and sort it
+		 *
+		 * @param p1 Start point of line segment
+		 * @param p2 End point of line segment
+		 * @param colls List of collisions with triangle meshes, returns collisions with all solids sorted along the segment
+		 */
+		void AddPrimitiveCollisions(const double p1[3], const double p2[3], std::vector<TCollision> &colls) const;
+
+		/**
+		 * Read transformations of instances of STL solids from INSTANCES section of config
+		 *
+		 * Each line contains the solid ID followed by seven numbers for each instance: translation x y z [m], and axis ax ay az and angle [degree] of a rotation about the origin that is applied before the translation.
+		 *
+		 * @param config TConfig struct, may not contain an INSTANCES section
+		 *
+		 * @return Returns list of transformations for each listed solid ID
+		 */
+		static std::map<unsigned, std::vector<CTransformation> > ReadInstances(TConfig &config);
+
+		/**
+		 * Set importance of all solids from IMPORTANCE section of config (solid ID followed by importance), solids not listed get importance 1
+		 *
+		 * @param config TConfig struct, may not contain an IMPORTANCE section
+		 */
+		void ReadImportances(TConfig &config);
+
+		/**
+		 * Mark solids listed in PHASESPACE section of config (solid ID followed by 0 or 1 to stop recorded particles), the state of particles entering them is written to phase-space files
+		 *
+		 * @param config TConfig struct, may not contain a PHASESPACE section
+		 */
+		void ReadPhaseSpaceSolids(TConfig &config);
+
+		/**
+		 * Read guide sections listed in TRANSFER section of config, see solid::transfer
+		 *
+		 * Each line contains the ID of the solid at the entrance of a section and the ID of the solid at its exit,
+		 * optionally followed by the number of speed and angle bins, the guide axis at the entrance, and the transfer files a table is built from.
+		 * Sections without files are recorded.
+		 *
+		 * @param config TConfig struct, may not contain a TRANSFER section
+		 */
+		void ReadTransfers(TConfig &config);
+
+		/**
+		 * Assign materials to tagged surfaces of solids listed in SURFACES section of config (solid ID followed by pairs of surface tag and material name), see solid::GetSurface
+		 *
+		 * Has to be called after all other properties of the solids are set, since the surfaces are copies of the solids.
+		 *
+		 * @param config TConfig struct, may not contain a SURFACES section
+		 * @param materials List of materials
+		 * @param interfaces Interfaces between each material and all materials, see solid::interfaces
+		 * @param weightmaterials Alternative materials of weighted tracking
+		 */
+		void ReadSurfaces(TConfig &config, const std::vector<material> &materials, const std::vector<std::shared_ptr<const std::vector<TMaterialInterface> > > &interfaces,
+				const std::vector<std::vector<material> > &weightmaterials);
+
+		/**
+		 * Read unit cell of a periodic geometry from PERIODIC section of config
+		 *
+		 * The section contains the corner "origin x y z" of the cell and up to three lattice vectors "a1 x y z", "a2 x y z", "a3 x y z" [m].
+		 * Particles leaving the cell through a face spanned by the other vectors re-enter it through the opposite face.
+		 *
+		 * @param config TConfig struct, may not contain a PERIODIC section
+		 */
+		void ReadPeriodicCell(TConfig &config);
 	public:
-		TTriangleMesh mesh; ///< kd-tree structure containing triangle meshes from STL-files
+		std::shared_ptr<TTriangleMesh> mesh; ///< kd-tree structure containing triangle meshes from STL-files, shared with copies of the geometry
 		solid defaultsolid; ///< "vacuum", this solid's properties are used when the particle is not inside any other solid
 		
 		/**
@@ -92,35 +284,150 @@ struct TGeometry{
 		 */
 		TGeometry(TConfig &geometryin);
 
+		/**
+		 * Constructor, copies geometry but assigns materials to solids again, e.g. for a point of a parameter scan
+		 *
+		 * Triangle meshes and analytic solids are shared with the original geometry.
+		 *
+		 * @param geometry Geometry to copy
+		 * @param materialsin TConfig struct containing MATERIALS section
+		 */
+		TGeometry(const TGeometry &geometry, TConfig &materialsin);
+
+		/**
+		 * Read names of alternative material sets from WEIGHTS section of config
+		 *
+		 * The order of the names matches the order of solid::weightmats.
+		 *
+		 * @param config TConfig struct, may not contain a WEIGHTS section
+		 *
+		 * @return Returns list of names (empty if there is no WEIGHTS section)
+		 */
+		static std::vector<std::string> ReadWeightNames(TConfig &config);
+
+
+		/**
+		 * Get bounding box of all solids with finite extent, e.g. half-spaces are skipped
+		 *
+		 * @return Returns bounding box
+		 */
+		CGAL::Bbox_3 GetBoundingBox() const{
+			CGAL::Bbox_3 bbox;
+			bool empty = true;
+			for (const CGAL::Bbox_3 &b: boundingboxes){
+				if (std::isinf(b.xmin()) || std::isinf(b.ymin()) || std::isinf(b.zmin()) || std::isinf(b.xmax()) || std::isinf(b.ymax()) || std::isinf(b.zmax()))
+					continue;
+				bbox = empty ? b : bbox + b;
+				empty = false;
+			}
+			if (empty)
+				throw std::runtime_error("Geometry does not contain any solid with finite extent!");
+			return bbox;
+		};
+
 
 		/**
 		 * Check if segment is intersecting with geometry bounding box.
 		 *
+		 * Segments outside the overall bounding box are rejected and segments with an end point inside a bounding box of any solid are accepted
+		 * by comparing coordinates, only remaining segments are intersected with each solid's bounding box.
+		 *
 		 * @param y1 Position vector of segment start
 		 * @param y2 Position vector of segment end
 		 *
 		 * @return Returns true if segment is intersecting bounding box
 		 */
 		bool CheckSegment(const double y1[3], const double y2[3]) const{
-			return mesh.InBoundingBox(CSegment(CPoint(y1[0], y1[1], y1[2]), CPoint(y2[0], y2[1], y2[2])));
+			for (int i = 0; i < 3; ++i){
+				if (std::max(y1[i], y2[i]) < boundingbox.min(i) || std::min(y1[i], y2[i]) > boundingbox.max(i))
+					return false;
+			}
+			auto inbox = [](const double p[3], const CGAL::Bbox_3 &b){
+				return p[0] >= b.xmin() && p[0] <= b.xmax() && p[1] >= b.ymin() && p[1] <= b.ymax() && p[2] >= b.zmin() && p[2] <= b.zmax();
+			};
+			if (std::any_of(boundingboxes.begin(), boundingboxes.end(), [&](const CGAL::Bbox_3 &b){ return inbox(y1, b) || inbox(y2, b); }))
+				return true;
+			CSegment segment(CPoint(y1[0], y1[1], y1[2]), CPoint(y2[0], y2[1], y2[2]));
+			return std::any_of(boundingboxes.begin(), boundingboxes.end(), [&segment](const CGAL::Bbox_3 &b){ return CGAL::do_intersect(segment, b); });
 		};
 		
 
 		/**
 		 * Checks if line segment p1->p2 collides with a surface.
 		 *
-		 * Calls KDTree::Collision to check for collisions and removes all collisions
+		 * Calls TTriangleMesh::Collision and intersects the segment with all analytic solids to check for collisions and flags all collisions
 		 * which should be ignored (given by ignore times in geometry configuration file).
 		 *
 		 * @param x1 Start time of line segment
 		 * @param p1 Start point of line segment
 		 * @param x2 End time of line segment
 		 * @param p2 End point of line segment
-		 * @param colls List of collisions, paired with bool indicator it it should be ignored
+		 * @param colls Returns list of collisions sorted along the segment, owned by the caller and reused between calls
+		 *
+		 * @return Returns true if line segment collides with a surface
+		 */
+		bool GetCollisions(const double x1, const double p1[3], const double x2, const double p2[3], std::vector<TCollision> &colls) const;
+
+		/**
+		 * Checks if line segment p1->p2 collides with a surface, see GetCollisions.
+		 *
+		 * If the collisioncache option is set, tests the segment against the triangles in a cache first, see TTriangleMesh::Collision.
+		 *
+		 * @param x1 Start time of line segment
+		 * @param p1 Start point of line segment
+		 * @param x2 End time of line segment
+		 * @param p2 End point of line segment
+		 * @param colls Returns list of collisions sorted along the segment, owned by the caller and reused between calls
+		 * @param cache Cache of triangles close to previous segments, owned by the caller
 		 *
 		 * @return Returns true if line segment collides with a surface
 		 */
-		bool GetCollisions(const double x1, const double p1[3], const double x2, const double p2[3], std::multimap<TCollision, bool> &colls) const;
+		bool GetCollisions(const double x1, const double p1[3], const double x2, const double p2[3], std::vector<TCollision> &colls, TCollisionCache &cache) const;
+
+		/**
+		 * Check several line segments for collisions with surfaces, e.g. the steps of a batch of particles, see GetCollisions.
+		 *
+		 * The segments are tested against the triangle meshes together, see TTriangleMesh::Collision of several segments.
+		 *
+		 * @param x1 Start time of each segment
+		 * @param p1 Start point of each segment
+		 * @param x2 End time of each segment
+		 * @param p2 End point of each segment
+		 * @param colls Returns list of collisions of each segment sorted along the segment, in the same order as p1
+		 */
+		void GetCollisions(const std::vector<double> &x1, const std::vector<std::array<double, 3> > &p1, const std::vector<double> &x2,
+				const std::vector<std::array<double, 3> > &p2, std::vector<std::vector<TCollision> > &colls) const;
+
+
+		/**
+		 * Check if a box may contain a surface of any solid, including ignored solids
+		 *
+		 * Exact for triangle meshes. Analytic solids are assumed to be in the box unless their bounding box does not overlap it
+		 * or their surface is farther from the box's center than its corners.
+		 *
+		 * @param min Lower corner of box
+		 * @param max Upper corner of box
+		 *
+		 * @return Returns false if no segment inside the box can collide with a surface
+		 */
+		bool BoxContainsSurface(const double min[3], const double max[3]) const;
+
+
+		/**
+		 * Get distance of point p to the closest surface of any solid, including ignored solids
+		 *
+		 * No line segment completely contained in a sphere with this radius around p can collide with a surface.
+		 *
+		 * @param p Point
+		 *
+		 * @return Returns distance to closest surface
+		 */
+		double GetSafetyDistance(const double p[3]) const{
+			double d = mesh->Distance(p[0], p[1], p[2]);
+			for (auto &prim: primitives)
+				d = std::min(d, prim.second->Distance(CPoint(p[0], p[1], p[2])));
+			return d;
+		};
 		
 			
 		/**
@@ -128,10 +435,11 @@ struct TGeometry{
 		 *
 		 * @param t Time
 		 * @param p Point to test
+		 * @param outside ID of a solid the point is known to lie outside of, e.g. because a surface source emitted it from one of its triangles, see TTriangleMesh::GetSolids (-1: test all solids)
 		 *
-		 * @return Map of solids in which the point is inside paired with information if it was ignored or not
+		 * @return List of solids in which the point is inside paired with information if it was ignored or not. Solids are owned by TGeometry.
 		 */
-		std::vector<std::pair<solid, bool> > GetSolids(const double t, const double p[3]) const;
+		std::vector<std::pair<const solid*, bool> > GetSolids(const double t, const double p[3], const int outside = -1) const;
 
 
 		/**
@@ -142,17 +450,73 @@ struct TGeometry{
 		 *
 		 * @return Returns solid with highest priority, that was not ignored at time t
 		 */
-		solid GetSolid(const double t, const double p[3]) const;
+		const solid& GetSolid(const double t, const double p[3]) const;
 
 
 		/**
-		 * Get solid with given ID
+		 * Get number of lattice vectors of periodic unit cell
+		 *
+		 * @return Returns 0 if the geometry is not periodic
+		 */
+		unsigned GetLatticeDimension() const{ return latticevectors.size(); };
+
+
+		/**
+		 * Get coordinate of point along a lattice vector, in units of the vector's length
+		 *
+		 * @param axis Index of lattice vector
+		 * @param p Point
+		 *
+		 * @return Returns coordinate, points inside the unit cell have coordinates in [0, 1)
+		 */
+		double GetCellCoordinate(const unsigned axis, const double p[3]) const{
+			const std::array<double, 3> &d = dualvectors[axis];
+			return (p[0] - cellorigin[0])*d[0] + (p[1] - cellorigin[1])*d[1] + (p[2] - cellorigin[2])*d[2];
+		};
+
+
+		/**
+		 * Check if point lies inside the periodic unit cell
+		 *
+		 * @param p Point
+		 *
+		 * @return Returns true if all coordinates along lattice vectors are in [0, 1), always true if the geometry is not periodic
+		 */
+		bool InCell(const double p[3]) const{
+			for (unsigned i = 0; i < latticevectors.size(); ++i){
+				double f = GetCellCoordinate(i, p);
+				if (f < 0 || f >= 1)
+					return false;
+			}
+			return true;
+		};
+
+
+		/**
+		 * Move point into a neighbouring copy of the periodic unit cell
+		 *
+		 * @param p Point, returns point shifted by cells times the lattice vector
+		 * @param axis Index of lattice vector
+		 * @param cells Number of cells to shift by
+		 */
+		void ShiftCell(double p[3], const unsigned axis, const int cells) const{
+			for (int i = 0; i < 3; ++i)
+				p[i] += cells*latticevectors[axis][i];
+		};
+
+
+		/**
+		 * Get solid with given ID from table indexed by ID
 		 * 
 		 * @param ID ID
 		 * 
 		 * @return Returns solid with given ID
 		 */
-		 solid GetSolid(const unsigned ID) const;
+		const solid& GetSolid(const unsigned ID) const{
+			if (ID >= solidindex.size() or solidindex[ID] < 0)
+				throw std::runtime_error((boost::format("Could not find solid with ID %s") % ID).str());
+			return solids[solidindex[ID]];
+		};
 };
 
 #endif /*GEOMETRY_H_*/
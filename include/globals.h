@@ -7,6 +7,7 @@
 #include <string>
 #include <iostream>
 #include <atomic>
+#include <functional>
 
 #include <boost/filesystem.hpp>
 
@@ -18,19 +19,28 @@ enum stopID {	ID_UNKNOWN = 0, ///< standard flag for particles
 				ID_INITIAL_NOT_FOUND = -5, ///< flag for particles which had a too low total energy to find a initial spot in the source volume
 				ID_CGAL_ERROR = -6, ///< flag for particles which produced an error during geometry collision checks
 				ID_GEOMETRY_ERROR = -7, ///< flag for particles which produced an error while tracking material boundaries along the trajectory
+				ID_KILLED_BY_ROULETTE = -8, ///< flag for particles which were killed by Russian roulette when entering a region of lower importance
+				ID_BUDGET_EXCEEDED = -9, ///< flag for particles which exceeded their CPU-time, step, or hit budget
+				ID_RECORDED = -10, ///< flag for particles which were stopped after their state was written to a phase-space file when entering a solid
 				ID_ABSORBED_IN_MATERIAL = 1, ///< flag for particles that were absorbed inside a material
 				ID_ABSORBED_ON_SURFACE = 2 ///< flag for particles that were absorbed on a material surface
 };
 
 enum simType {	PARTICLE = 1, ///< set simtype in configuration to this value to simulate particles
+				REPLAY = 2, ///< set simtype in configuration to this value to track only the particle given by replayparticle with full logging
 				BF_ONLY = 3, ///< set simtype in configuration to this value to print out a ramp heating analysis
 				BF_CUT = 4, ///< set simtype in configuration to this value to print out a planar slice through electric/magnetic fields
+				BF_POINTS = 5, ///< set simtype in configuration to this value to print out electric/magnetic fields at a list of points read from a file
+				SPIN_REPLAY = 6, ///< set simtype in configuration to this value to track spins again along trajectories recorded with the trajectorylog option
 				GEOMETRY = 7, ///< set simtype in configuration to this value to print out a sampling of the geometry
 				MR_THETA_OUT_ANGLE = 8, ///< set simtype in configuration to this value to output a 3d histogram of the MR model's diffuse reflection probability for every solid angle
-				MR_THETA_I_ENERGY = 9 ///< set simtype in configuration to this value to output a 3d histogram of the MR models' diffuse reflection probability for theta_i vs neutron energy
+				MR_THETA_I_ENERGY = 9, ///< set simtype in configuration to this value to output a 3d histogram of the MR models' diffuse reflection probability for theta_i vs neutron energy
+				ESTIMATE = 10, ///< set simtype in configuration to this value to estimate CPU time, memory, and output volume of a run from a sample of its particles
+				MERGE = 11 ///< set simtype in configuration to this value to merge log shards listed in the manifests of previous jobs into a single indexed dataset
 };
 
 extern std::atomic<bool> quit;    // flag indicating that program was aborted by signal
+extern std::atomic<bool> suspendtracking; // flag telling tracking threads to pause between trajectory steps, e.g. to write a checkpoint
 
 // physical constants
 extern const long double pi; ///< Pi
@@ -217,4 +227,46 @@ double MaxwellBoltzSpectrum (const double T, const double E);
  */
 std::string ResolveFormula(const std::string &formulaName, const std::map<std::string, std::string> &formulas);
 
+/**
+ * Call a function for every index in a range, distributing the indices over several threads
+ *
+ * The range is split into one contiguous block per thread. Exceptions thrown in any thread are rethrown after all threads have finished.
+ *
+ * @param count Number of indices, function is called for indices 0 to count - 1
+ * @param nthreads Maximum number of threads
+ * @param func Function called with first and one-past-last index of each block
+ */
+void ParallelFor(const unsigned long count, const unsigned nthreads, const std::function<void(const unsigned long begin, const unsigned long end)> &func);
+
+/**
+ * Pin calling thread to a single CPU, so it stays on the NUMA node holding the memory it touched first
+ *
+ * CPUs are counted in the order of the process's affinity mask, so consecutive indices share a socket on most systems.
+ * Indices larger than the number of CPUs wrap around. Only implemented on Linux.
+ *
+ * @param index Index of thread
+ *
+ * @return Returns false if the thread could not be pinned
+ */
+bool PinThread(const unsigned index);
+
+/**
+ * Read a list of numbers and ranges of numbers separated by whitespace, e.g. "1-10 57"
+ *
+ * @param list List
+ *
+ * @return Returns first and last number of each range, a single number is a range with equal first and last number
+ */
+std::vector<std::pair<int, int> > ReadNumberRanges(const std::string &list);
+
+/**
+ * Check if a number lies in one of several ranges
+ *
+ * @param ranges First and last number of each range, see ReadNumberRanges
+ * @param number Number
+ *
+ * @return Returns true if number lies in any range
+ */
+bool InNumberRanges(const std::vector<std::pair<int, int> > &ranges, const int number);
+
 #endif /*GLOBALS_H_*/
@@ -10,6 +10,8 @@
 #ifndef HARMONICFIELD_H_
 #define HARMONICFIELD_H_
 
+#include <array>
+
 #include "field.h"
 #include <boost/math/special_functions/legendre.hpp>
 #include <boost/math/special_functions/factorials.hpp>
@@ -38,7 +40,20 @@ private:
 	double axis_y; // y-component of rotational axis
 	double axis_z; // z-component of rotational axis
 	double angle;  // angle through which to rotate
-	double G[24]; ///< G parameters; coefficients of the harmonic expansion
+	int order; ///< Highest order of the harmonic expansion with non-zero terms
+	std::array<double, 20> Bcoeff[3]; ///< Coefficients of monomials (1, x, y, z, xx, xy, ..., zzz) in each magnetic-field component, summed over all harmonic terms
+	std::array<double, 10> dBcoeff[3][3]; ///< Coefficients of monomials (1, x, y, z, xx, xy, ..., zz) in each spatial derivative of the magnetic field
+
+	/**
+	 * Evaluate monomial expansion of magnetic field and its derivatives, specialized for a given maximum order
+	 *
+	 * @param x the x-coordinate in the field's coordinate system, including offset
+	 * @param y the y-coordinate in the field's coordinate system, including offset
+	 * @param z the z-coordinate in the field's coordinate system, including offset
+	 * @param B Returns magnetic-field components
+	 * @param dBidxj Returns spatial derivatives of magnetic-field components (optional)
+	 */
+	template<int N> void Evaluate(const double x, const double y, const double z, double B[3], double dBidxj[3][3]) const;
 
 public:
 	/**
@@ -0,0 +1,75 @@
+/**
+ * \file
+ * Surface hits tallied per triangle in memory (particle option hitmap), a compact alternative to the hitlog.
+ */
+
+#ifndef HITMAP_H_
+#define HITMAP_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "trianglemesh.h"
+
+/**
+ * Hits of one particle type on each triangle of one solid
+ *
+ * The tallies are written as cell data of a VTK polygon file containing the triangles of the solid, which can be shown directly e.g. in ParaView.
+ */
+class THitMap{
+private:
+	/**
+	 * Sums over the hits on a triangle
+	 */
+	struct TTriangleTally{
+		double count = 0; ///< Number of hits
+		double weight = 0; ///< Sum of statistical weights
+		double absorbed = 0; ///< Sum of statistical weights of particles absorbed on the surface
+		double E = 0; ///< Sum of kinetic energies [eV] times weights
+		double angle = 0; ///< Sum of incidence angles to the surface normal [degree] times weights
+	};
+	std::vector<TTriangleTally> triangles; ///< Tallies of each triangle, in the order of TCollision::triangle
+public:
+	/**
+	 * Constructor, starts with empty tallies
+	 *
+	 * @param ntriangles Number of triangles of solid
+	 */
+	explicit THitMap(const std::size_t ntriangles): triangles(ntriangles){ };
+
+	/**
+	 * Add a hit
+	 *
+	 * @param triangle Index of hit triangle
+	 * @param weight Statistical weight of particle
+	 * @param E Kinetic energy of particle [eV]
+	 * @param angle Angle between velocity and surface normal [degree], between 0 and 90
+	 * @param absorbed True if particle was absorbed on the surface
+	 */
+	void Add(const std::uint32_t triangle, const double weight, const double E, const double angle, const bool absorbed);
+
+	/**
+	 * Write triangles and tallies to a VTK file
+	 *
+	 * The cell data contain the number of hits (count), their summed weight (weight), the weight of absorbed particles (absorbed), its fraction (lossfraction),
+	 * and the weighted mean kinetic energy (E [eV]) and incidence angle (angle [degree]) on each triangle.
+	 *
+	 * @param outfile Output file
+	 * @param vertices Vertices of all triangles of the solid, see TTriangleMesh::GetSolidTriangles
+	 * @param title Title written into the file header
+	 * @param append Add tallies contained in an existing file, e.g. when a simulation is resumed
+	 */
+	void Write(const boost::filesystem::path &outfile, const std::vector<CTriangleVertices> &vertices, const std::string &title, const bool append);
+
+	/**
+	 * Get memory used by tallies
+	 *
+	 * @return Returns size [bytes]
+	 */
+	std::size_t MemoryUsage() const{ return triangles.capacity()*sizeof(TTriangleTally); }
+};
+
+#endif // HITMAP_H_
@@ -3,34 +3,257 @@
 
 #include <memory>
 #include <map>
+#include <vector>
+#include <string>
 #include <fstream>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+#include <boost/iostreams/filtering_stream.hpp>
 
 #include "particle.h"
 #include "geometry.h"
 #include "fields.h"
+#include "replay.h"
+#include "adjoint.h"
+#include "hitmap.h"
+#include "manifest.h"
+#include "diagnostics.h"
 
 #ifdef USEROOT
 #include "TFile.h"
 #include "TNtupleD.h"
 #endif
 
+#ifdef USEHDF5
+#include "hdf5.h"
+#endif
+
+
+/**
+ * Histogram of a variable of one log type, filled in memory instead of writing each log entry to a file (HISTOGRAMS section)
+ *
+ * The first and last bins count underflows and overflows, so histograms of several jobs can be merged by adding their bins.
+ */
+struct TLogHistogram{
+    std::string name; ///< Name of histogram, used as file name
+    std::string variable; ///< Column or formula filled into histogram
+    std::string filter; ///< Formula that has to return true for an entry to be filled into histogram (empty: no filter)
+    std::string weight; ///< Column or formula used as weight of each entry (empty: weight 1)
+    unsigned nbins = 0; ///< Number of bins between min and max
+    double min = 0; ///< Lower edge of first bin
+    double max = 0; ///< Upper edge of last bin
+    int column = -1; ///< Column index of variable, -1 if variable is a formula
+    int weightcolumn = -1; ///< Column index of weight, -1 if weight is a formula
+    exprtk::expression<double> formula; ///< Compiled formula of variable (empty if it is a column)
+    exprtk::expression<double> filterformula; ///< Compiled filter formula (empty if histogram has no filter)
+    exprtk::expression<double> weightformula; ///< Compiled weight formula (empty if weight is a column or not set)
+    std::vector<double> entries; ///< Number of entries in each bin, including underflow and overflow
+    std::vector<double> weights; ///< Sum of weights in each bin
+    std::vector<double> weights2; ///< Sum of squared weights in each bin
+};
+
+/**
+ * Bins of a histogram summed over the loggers of several threads, e.g. to monitor the statistical precision of a running simulation (see TConvergenceMonitor)
+ */
+struct THistogramBins{
+    double min = 0; ///< Lower edge of first bin
+    double max = 0; ///< Upper edge of last bin
+    std::vector<double> weights; ///< Sum of weights in each bin, including underflow and overflow
+    std::vector<double> weights2; ///< Sum of squared weights in each bin
+};
+
+/**
+ * Options of a single log type (e.g. "end", "snapshot", "track", "hit", "spin") for one particle type, parsed once from the config
+ *
+ * Each log type has a fixed list of columns. The logged variables are resolved to column indices once,
+ * and the Print functions only calculate columns that are logged or used by a formula.
+ */
+struct TLogSettings{
+    std::string particlename; ///< Name of particle type these options belong to
+    std::string suffix; ///< Log type these options belong to
+    bool enabled = false; ///< Set if entries of this log type are collected, because they are written or filled into histograms
+    bool write = false; ///< Set if entries of this log type are written (<suffix>log)
+    double interval = 0.; ///< Logging interval of track and spin logs (<suffix>loginterval)
+    double tolerance = 0.; ///< Max. distance [m] of dropped track points from the logged polyline, replaces interval if larger than zero (<suffix>logtolerance)
+    std::string filter; ///< Name of formula used to filter log entries (<suffix>logfilter)
+    std::vector<std::string> vars; ///< List of variables and formulas to be logged (<suffix>logvars)
+    bool defaultvars = false; ///< Set if logvars was empty and default columns are logged, a notice is printed with the first entry
+
+    std::vector<double> row; ///< Values of all columns of the current log entry, compiled formulas reference these values
+    std::vector<bool> needed; ///< Marks columns that have to be calculated for each log entry
+    std::vector<int> columns; ///< Column index of each logged variable, -1 if variable is a formula
+    std::vector<exprtk::expression<double> > formulas; ///< Compiled formula of each logged variable (empty if it is a column)
+    exprtk::expression<double> filterformula; ///< Compiled filter formula
+    std::vector<double> values; ///< Buffer for values passed to DoLog
+    std::vector<TLogHistogram> histograms; ///< Histograms filled with entries of this log type
+
+    TLogSettings() = default; ///< Default constructor
+    TLogSettings(const TLogSettings&) = delete; ///< Compiled formulas reference row, so settings must not be copied
+    TLogSettings& operator=(const TLogSettings&) = delete; ///< Compiled formulas reference row, so settings must not be copied
+};
+
+/**
+ * Logging options for one particle type
+ */
+struct TParticleLogSettings{
+    TLogSettings end; ///< Options for endlog
+    TLogSettings snapshot; ///< Options for snapshotlog
+    TLogSettings track; ///< Options for tracklog
+    TLogSettings hit; ///< Options for hitlog
+    TLogSettings spin; ///< Options for spinlog
+    TLogSettings diagnostic; ///< Options for diagnosticlog
+    std::vector<double> snapshots; ///< Sorted list of snapshot times
+    bool trajectory = false; ///< Record trajectories for spin replay (option trajectorylog), see PrintTrajectory
+    bool hitmap = false; ///< Tally hits on each triangle in memory (option hitmap), see TallyHit
+};
+
+/**
+ * Buffer of log entries waiting to be passed to DoLog by the asynchronous log writer
+ */
+struct TLogBuffer{
+    std::vector<double> data; ///< Values of all buffered log entries
+    std::vector<std::pair<const TLogSettings*, size_t> > rows; ///< Log options and offset in data of each buffered log entry
+};
 
 /**
  * Virtual base class printing particle states, track, spin
+ *
+ * If asynclog is set in the GLOBAL config section, log entries are collected in a buffer while a separate writer thread
+ * passes the entries of a second buffer to DoLog. When the writer thread falls behind, Log blocks until a buffer is free,
+ * so memory usage is bounded by two buffers of logbuffersize values.
  */
 class TLogger {
+private:
+    std::map<std::string, TParticleLogSettings> settings; ///< Logging options for each particle type
+    std::map<std::string, std::ofstream> phasespacefiles; ///< Phase-space file of each particle type, see PrintPhaseSpace
+    std::map<std::string, std::ofstream> transferfiles; ///< Transfer file of each particle type and guide section, see PrintTransfer
+    std::map<std::string, std::ofstream> trajectoryfiles; ///< Trajectory file of each particle type, see PrintTrajectory
+    std::map<std::pair<std::string, unsigned>, THitMap> hitmaps; ///< Hit tallies of each particle type and solid, see TallyHit
+    const TGeometry *hitmapgeometry = nullptr; ///< Geometry containing the triangles of the hit tallies, set by TallyHit
+    std::vector<TEfficiencyMap> efficiencymaps; ///< Track-length tallies defined in the EFFICIENCYMAPS section, see ScoreStep
+    std::map<const TParticle*, std::vector<TTrajectoryKnot> > trajectories; ///< Knots recorded for each particle whose trajectory is being recorded, written and removed when its end state is printed
+    const std::string *lastparticlename = nullptr; ///< Particle name of last settings lookup
+    TParticleLogSettings *lastsettings = nullptr; ///< Settings returned by last lookup
+
+    static const unsigned MAX_TRACK_WINDOW = 1000; ///< Max. number of track points dropped in a row by the track simplification, bounds its cost per point
+
+    /**
+     * State of the streaming simplification of one particle's track (tracklogtolerance)
+     */
+    struct TTrackSimplification{
+        std::array<double, 3> anchor; ///< Position of last logged point
+        std::vector<std::array<double, 3> > window; ///< Positions of points after the anchor that were not logged, all within the tolerance of the line from the anchor to the last one
+        value_type x; ///< Time of last point in window, the candidate logged when the next point does not fit
+        state_type y; ///< State of candidate
+        const solid *sld; ///< Solid containing candidate
+    };
+    std::map<const TParticle*, TTrackSimplification> tracksimplifications; ///< Simplification state of each particle whose track is being logged, removed when its end state is printed
+
+    /**
+     * Parse log options of one log type from a particle's config section and resolve logged variables to columns
+     *
+     * @param particlename Name of particle type
+     * @param suffix Log type (e.g. "end", "snapshot", "track", "hit", "spin")
+     * @param columns Names of all columns of this log type
+     * @param default_titles Columns logged if logvars is empty
+     * @param logsettings Returns parsed options
+     */
+    void ReadLogSettings(const std::string &particlename, const std::string &suffix,
+                         const std::vector<std::string> &columns, const std::vector<std::string> &default_titles, TLogSettings &logsettings);
+
+    /**
+     * Write all histograms to files, adding the contents of existing files if logs are appended (e.g. when a simulation is resumed)
+     */
+    void WriteHistograms();
+
+    size_t buffersize = 0; ///< Maximum number of values in each buffer of the asynchronous log writer (0: log synchronously)
+    TLogBuffer front; ///< Buffer filled by Log
+    TLogBuffer back; ///< Buffer written by writer thread
+    std::mutex buffermutex; ///< Protects buffers and status of writer thread
+    std::condition_variable backfull; ///< Signals writer thread that back buffer has to be written
+    std::condition_variable backempty; ///< Signals Log that back buffer was written
+    bool finished = false; ///< Set when logger is closing, writer thread writes all remaining entries and exits
+    std::exception_ptr writererror; ///< Exception thrown by DoLog in writer thread, rethrown by next call to Log
+    std::thread writer; ///< Writer thread
+
+    /**
+     * Loop run by writer thread, passes buffered log entries to DoLog until FinishLog is called
+     */
+    void WriteLoop();
+
+    /**
+     * Copy a log entry into the front buffer, waiting for the writer thread if the buffer is full
+     *
+     * Can be called from several threads at the same time.
+     *
+     * @param logsettings Options of this log type, including values to be logged
+     */
+    void Enqueue(const TLogSettings &logsettings);
+
+    /**
+     * Collect variables of a track point and pass them to the Log function
+     *
+     * @param p Particle to be printed
+     * @param x Time
+     * @param y State
+     * @param sld Solid in which the particle is
+     * @param field TFieldManager containing all electromagnetic fields
+     */
+    void LogTrackPoint(const std::unique_ptr<TParticle>& p, const value_type x, const state_type &y, const solid &sld, const TFieldManager &field);
+
+    /**
+     * Log the candidate point of a particle's simplified track, if any, and forget its simplification state
+     *
+     * @param p Particle
+     * @param field TFieldManager containing all electromagnetic fields
+     */
+    void FlushTrack(const std::unique_ptr<TParticle>& p, const TFieldManager &field);
 protected:
     TConfig config; ///< configuration parameters read from config files
+    int shard; ///< Index appended to output file names when several loggers run in parallel (-1: no index)
+    std::string prefix; ///< Prefix of output file names, e.g. to distinguish the points of a parameter scan (GLOBAL option logprefix)
+    std::map<std::string, TLogManifestEntry> manifest; ///< Tables written by this logger, indexed by particle name and log type
 
     /**
-     * Evaluates the logvars and corresponding filters and formulas set in the config file and calls DoLog
+     * Constructor, parses log options of all particle types
+     *
+     * @param aconfig List of configuration parameters read from config file
+     * @param ashard Index appended to output file names, used when several loggers run in parallel (-1: no index)
+     */
+    TLogger(TConfig &aconfig, const int ashard);
+
+    /**
+     * Build path of output file from prefix, job number, and shard index
+     *
+     * @param name Rest of file name, e.g. particle name, log type, and extension
+     *
+     * @return Returns path in output directory
+     */
+    boost::filesystem::path OutputFile(const std::string &name) const;
+
+    /**
+     * Get logging options for a particle type
+     *
+     * Repeated lookups for the same particle are answered without searching the option list.
+     *
+     * @param particlename Name of particle type
+     *
+     * @return Returns options of this particle type
+     */
+    TParticleLogSettings& GetSettings(const std::string &particlename);
+
+    /**
+     * Evaluates filter and formulas of the current log entry stored in TLogSettings::row and calls DoLog
      * 
      * @param particlename Name of particle being logged
      * @param suffix Indicates logging type (e.g. "end", "snapshot", "track", "spin")
-     * @param variables Maps of variable names and their values used to evaluate logvars
-     * @param default_titles Optional parameter containing default variables to be logged in case none are given in the config
+     * @param logsettings Options of this log type
      */
-    void Log(const std::string &particlename, const std::string &suffix, const std::map<std::string, double> &variables, const std::vector<std::string> &default_titles = {});
+    void Log(const std::string &particlename, const std::string &suffix, TLogSettings &logsettings);
 
     /**
      * Virtual function actually doing the logging. Must be implemented in all derived classes
@@ -41,12 +264,80 @@ protected:
      * @param vars List of variables to be logged
      */
     virtual void DoLog(const std::string &particlename, const std::string &suffix, const std::vector<std::string> &titles, const std::vector<double> &vars) = 0;
+
+    /**
+     * Virtual function telling where a table is written. Must be implemented in all derived classes
+     *
+     * @param particlename Name of particle
+     * @param suffix Log type (e.g. "end", "snapshot", "track", "spin")
+     * @param entry Returns file name and dataset in entry of manifest
+     */
+    virtual void LocateTable(const std::string &particlename, const std::string &suffix, TLogManifestEntry &entry) const = 0;
+
+    /**
+     * Pass all remaining buffered log entries to DoLog, stop writer thread, and write histograms.
+     *
+     * Has to be called at the beginning of destructors of all derived classes, before their output files are closed.
+     */
+    void FinishLog();
 public:
-    virtual ~TLogger(){ }; ///< Virtual desctructor (empty)
+    /**
+     * Virtual destructor, adds tables written by this logger to the manifest returned by TakeManifest
+     */
+    virtual ~TLogger();
+
+    /**
+     * Write a row to a table, bypassing filters, formulas, and histograms, and count it in the manifest
+     *
+     * Must not be called while the asynchronous writer thread is running (GLOBAL option asynclog).
+     *
+     * @param particlename Name of particle
+     * @param suffix Log type (e.g. "end", "snapshot", "track", "spin")
+     * @param titles Column names
+     * @param vars Values of row
+     */
+    void WriteRow(const std::string &particlename, const std::string &suffix, const std::vector<std::string> &titles, const std::vector<double> &vars);
+
+    /**
+     * Take tables written by all loggers destroyed so far, e.g. to write the manifest of a job
+     *
+     * @return Returns tables and forgets them
+     */
+    static std::vector<TLogManifestEntry> TakeManifest();
+
+    /**
+     * Add bins of all histograms filled so far to a list, may only be called from the thread that logs particles
+     *
+     * @param bins List of histograms by name, histograms missing in the list are added
+     */
+    void AddHistogramBins(std::map<std::string, THistogramBins> &bins) const;
+
+    /**
+     * Get memory used by histograms, hit and efficiency maps, recorded trajectories, and buffers, may only be called from the thread that logs particles
+     *
+     * @return Returns approximate size [bytes]
+     */
+    virtual std::size_t MemoryUsage() const;
+
+    /**
+     * Score a trajectory step of a particle in all efficiency maps, see TEfficiencyMap
+     *
+     * The step is scored as straight line, the particle's scores are added to the maps when its end state is printed.
+     *
+     * @param p Particle
+     * @param y1 State at start of step
+     * @param y2 State at end of step
+     */
+    void ScoreStep(const std::unique_ptr<TParticle>& p, const state_type &y1, const state_type &y2){
+        for (auto &m: efficiencymaps)
+            m.Score(*p, y1, y2);
+    };
+
     /**
      * Print start and current states of a particle
      *
-     * Collects variables and passes them to the virtual Log function
+     * Collects variables and passes them to the virtual Log function.
+     * At the end of tracking (suffix "end"), it also logs the last point of the particle's simplified track.
      *
      * @param p Particle to be printed
      * @param x Current time
@@ -56,13 +347,13 @@ public:
      * @param field TFieldManager containing all electromagnetic fields
      * @param suffix Indicates logging type (e.g. "end", "snapshot"), passed to the virtual Log function
      */
-    void Print(const std::unique_ptr<TParticle>& p, const value_type x, const state_type &y, const state_type &spin,
+    void Print(const std::unique_ptr<TParticle>& p, const value_type x, const state_type &y, const spin_state_type &spin,
             const TGeometry &geom, const TFieldManager &field, const std::string suffix = "end");
 
     /**
-     * Print start and current values at a specific time within an integration step
+     * Print start and current values at all snapshot times within an integration step
      *
-     * Collects variables and passes them to the virtual Log function
+     * Collects variables and passes them to the virtual Log function, once for every snapshot time in [x1, x2)
      *
      * @param p Particle to be printed
      * @param x1 Start time of integration step
@@ -73,15 +364,21 @@ public:
      * @param stepper Stepper can be used to interpolate state between x1 and x2
      * @param geom Geometry of the simulation
      * @param field TFieldManager containing all electromagnetic fields
+     *
+     * @return Returns true if a snapshot was taken in this integration step
      */
-    void PrintSnapshot(const std::unique_ptr<TParticle>& p, const value_type x1, const state_type &y1, const value_type x2, const state_type &y2,
-                       const state_type &spin, const dense_stepper_type& stepper, const TGeometry &geom, const TFieldManager &field);
+    bool PrintSnapshot(const std::unique_ptr<TParticle>& p, const value_type x1, const state_type &y1, const value_type x2, const state_type &y2,
+                       const spin_state_type &spin, const TStepper & stepper, const TGeometry &geom, const TFieldManager &field);
 
 
     /**
      * Print point on particle trajectory
      *
-     * Collects variables and passes them to the virtual Log function
+     * Collects variables and passes them to the virtual Log function.
+     * Points are thinned out by the track length between them (trackloginterval),
+     * or, if tracklogtolerance is set, by a streaming polyline simplification:
+     * a point is only dropped if it and all points dropped since the last logged one lie within the tolerance of the straight line from the last logged point to the next logged one.
+     * The first point and the points marked with keep are always logged.
      *
      * @param p Particle to be printed
      * @param x1 Start time of integration step
@@ -91,9 +388,10 @@ public:
      * @param spin Spin vector
      * @param sld Solid in which the particle is currently.
      * @param field TFieldManager containing all electromagnetic fields
+     * @param keep Point has to be kept by the track simplification, e.g. the end of a step with a surface hit or snapshot
      */
     void PrintTrack(const std::unique_ptr<TParticle>& p, const value_type x1, const state_type &y1, const value_type x, const state_type& y,
-                    const state_type &spin, const solid &sld, const TFieldManager &field);
+                    const spin_state_type &spin, const solid &sld, const TFieldManager &field, const bool keep = false);
 
 
     /**
@@ -111,6 +409,19 @@ public:
      */
     void PrintHit(const std::unique_ptr<TParticle>& p, const value_type x, const state_type &y1, const state_type &y2, const double *normal, const solid &leaving, const solid &entering);
 
+    /**
+     * Add a surface hit to the hit map of the particle type and the hit solid, if the option hitmap is set
+     *
+     * Hits on solids without triangle meshes (analytic primitives) are not tallied.
+     *
+     * @param p Particle
+     * @param y1 State before hit
+     * @param coll Collision with hit surface
+     * @param absorbed True if the particle was absorbed on the surface
+     * @param geom Geometry containing the hit triangle
+     */
+    void TallyHit(const std::unique_ptr<TParticle>& p, const state_type &y1, const TCollision &coll, const bool absorbed, const TGeometry &geom);
+
 
     /**
      * Write spin state of particle
@@ -118,13 +429,78 @@ public:
      * Collects variables and passes them to the virtual Log function
      *
      * @param p Particle to be printed
+     * @param x1 Time of previous spin integration step, spin state is only printed if an integer multiple of spinloginterval lies between x1 and x
      * @param x Time to print the spin state at
-     * @param spinstepper Integration stepper used to interpolate spin trajectory
+     * @param spin Spin state at time x
      * @param trajectory_stepper Trajectory integrator used to calculate spin-precession axis at time t
      * @param field TFieldManager containing all electromagnetic fields
      */
-    void PrintSpin(const std::unique_ptr<TParticle>& p, const value_type x, const dense_stepper_type& spinstepper,
-                   const dense_stepper_type &trajectory_stepper, const TFieldManager &field);
+    void PrintSpin(const std::unique_ptr<TParticle>& p, const value_type x1, const value_type x, const spin_state_type &spin,
+                   const TStepper &trajectory_stepper, const TFieldManager &field);
+
+
+    /**
+     * Write state of particle to the binary phase-space file of its particle type, independent of the log format
+     *
+     * Called when a particle enters a solid listed in the PHASESPACE section.
+     * The file can be used as particle source of a following simulation (sourcemode phasespace).
+     *
+     * @param p Particle to be printed
+     * @param x Time
+     * @param y State vector
+     * @param spin Spin vector
+     */
+    void PrintPhaseSpace(const std::unique_ptr<TParticle>& p, const value_type x, const state_type &y, const spin_state_type &spin);
+
+
+    /**
+     * Write outcome of a particle passing a guide section to the binary transfer file of its particle type and the section, independent of the log format
+     *
+     * Called when a particle that entered a section listed in the TRANSFER section without transfer files leaves it through its exit solid or stops.
+     * The files can be used as transfer tables of a following simulation, see TTransferTable.
+     *
+     * @param p Particle to be printed
+     * @param entryID ID of solid at the entrance of the section
+     * @param x1 Time when particle entered the section
+     * @param y1 State vector when particle entered the section
+     * @param weight1 Statistical weight when particle entered the section
+     * @param x2 Time when particle left the section or stopped
+     * @param y2 State vector when particle left the section or stopped
+     * @param stopID 0 if particle left the section, its stop ID otherwise
+     */
+    void PrintTransfer(const std::unique_ptr<TParticle>& p, const unsigned entryID, const value_type x1, const state_type &y1, const double weight1,
+                       const value_type x2, const state_type &y2, const int stopID);
+
+
+    /**
+     * Record a trajectory-integration step of a particle whose trajectory is recorded (option trajectorylog)
+     *
+     * Adds the start of the step, if the particle jumped to it, the interpolated end of the step, and the state after events at the end of the step, e.g. a wall reflection, if it differs.
+     * The trajectory is written to the binary trajectory file of its particle type when the end state of the particle is printed, independent of the log format.
+     * The file can be used to track the spin again in different fields (simtype 6), see TTracker::ReplaySpin.
+     * Has to be called before the spin is tracked across the step, since spin tracking may change the polarisation.
+     *
+     * @param p Particle
+     * @param stepper Trajectory integrator containing the last step
+     * @param x Time at end of step, may be earlier than the end of the integrator's step, e.g. at a wall hit
+     * @param y State vector at end of step, after events at the end of the step
+     */
+    void PrintTrajectory(const std::unique_ptr<TParticle>& p, const TStepper &stepper, const value_type x, const state_type &y);
+
+
+    /**
+     * Write problem that occurred during tracking of a particle, together with its state
+     *
+     * Counts the problem for the summary printed at exit (see Diagnostics::Count), collects variables, and passes them to the virtual Log function
+     *
+     * @param p Particle to be printed
+     * @param code Type of problem
+     * @param x Time
+     * @param y State vector
+     * @param sld Solid in which the particle is currently
+     * @param value Additional value describing the problem, e.g. the length of the segment of a collision-point iteration or the exceeded budget
+     */
+    void PrintDiagnostic(const std::unique_ptr<TParticle>& p, const TDiagnostic code, const value_type x, const state_type &y, const solid &sld, const double value);
 
 };
 
@@ -133,7 +509,28 @@ public:
  */
 class TTextLogger: public TLogger {
 private:
-    std::map<std::string, std::ofstream> logstreams; ///< List of file streams used for logging
+    static const std::size_t LINE_BUFFER_SIZE = 1 << 16; ///< Size [bytes] up to which formatted log entries are collected before they are written to a file
+
+    /**
+     * Output file of one particle and log type
+     */
+    struct TLogStream{
+        std::ofstream file; ///< Output file
+        boost::iostreams::filtering_ostream compressor; ///< Stream compressing log entries before they are written to file (empty if logcompression is not set)
+        std::ostream *out = nullptr; ///< Stream log entries are written to, either file or compressor
+        std::string buffer; ///< Formatted log entries that were not written to out yet
+    };
+    std::map<std::string, TLogStream> logstreams; ///< List of file streams used for logging
+    bool append = false; ///< Append to existing files instead of overwriting them, e.g. when resuming from a checkpoint (GLOBAL option appendlog)
+    std::string compression; ///< Compression of log files, "gzip" or "bzip2" (GLOBAL option logcompression, empty: uncompressed)
+
+    /**
+     * Write buffered log entries of a file
+     *
+     * @param stream Output file
+     * @param name Name of output file, used in error messages
+     */
+    void WriteBuffer(TLogStream &stream, const std::string &name);
 
     /**
      * Logs given variables to selected text file
@@ -144,18 +541,35 @@ private:
      * @param vars List of variables to be logged
      */
     void DoLog(const std::string &particlename, const std::string &suffix, const std::vector<std::string> &titles, const std::vector<double> &vars) override;
+
+    /**
+     * Tables are written to text files named after particle and log type
+     *
+     * @param particlename Name of particle
+     * @param suffix Log type
+     * @param entry Returns file name in entry of manifest
+     */
+    void LocateTable(const std::string &particlename, const std::string &suffix, TLogManifestEntry &entry) const override;
 public:
     /**
      * Constructor, reads relevant configuration parameters
      * 
      * @param aconfig List of configuration parameters read from config file
+     * @param ashard Index appended to file names, used when several loggers run in parallel (-1: no index)
      */
-    TTextLogger(TConfig& aconfig){ config = aconfig; };
+    TTextLogger(TConfig& aconfig, const int ashard = -1);
 
     /**
-     * Destructor, closes all opened file streams
+     * Destructor, writes remaining buffered entries and closes all opened file streams
+     */
+    ~TTextLogger() final;
+
+    /**
+     * Get memory used by the logger, including formatted entries, file buffers, and compressor states of all open log files
+     *
+     * @return Returns approximate size [bytes]
      */
-    ~TTextLogger() final { for (auto &s: logstreams){ s.second.close(); } };
+    std::size_t MemoryUsage() const override;
 };
 
 #ifdef USEROOT
@@ -165,6 +579,8 @@ public:
 class TROOTLogger: public TLogger {
 private:
     TFile* ROOTfile; ///< ROOT file to print to
+    std::map<std::string, TNtupleD*> trees; ///< Trees of each particle and output type, owned by ROOTfile
+    int basketsize = 0; ///< Size of baskets [bytes] buffering each branch before it is compressed and written (GLOBAL option ROOTbasketsize, 0: ROOT default)
 
     /**
      * Logs given variables to selected ROOT tree
@@ -175,13 +591,23 @@ private:
      * @param vars List of variables to be logged
      */
     void DoLog(const std::string &particlename, const std::string &suffix, const std::vector<std::string> &titles, const std::vector<double> &vars) override;
+
+    /**
+     * Tables are written to trees named after particle and log type in the ROOT file
+     *
+     * @param particlename Name of particle
+     * @param suffix Log type
+     * @param entry Returns file name and tree in entry of manifest
+     */
+    void LocateTable(const std::string &particlename, const std::string &suffix, TLogManifestEntry &entry) const override;
 public:
     /**
      * Constructor, reads relevant configuration parameters from config and opens ROOT file
      * 
      * @param config List of configuration parameters read from config file
+     * @param ashard Index appended to file name, used when several loggers run in parallel (-1: no index)
      */
-    TROOTLogger(TConfig &aconfig);
+    TROOTLogger(TConfig &aconfig, const int ashard = -1);
 
     /**
      * Destructor, writes ROOT trees to file and closes it
@@ -190,14 +616,101 @@ public:
 };
 #endif
 
+#ifdef USEHDF5
+/**
+ * Class to print particle states to compressed, column-wise HDF5 files. Only available if cmake found the HDF5 library.
+ *
+ * Each particle and output type is written to a group containing one extensible, chunked and compressed dataset per logged variable,
+ * so analysis code can read single columns without parsing the whole file.
+ */
+class THDF5Logger: public TLogger {
+private:
+    /**
+     * Group of datasets for one particle and output type, including buffered rows not yet written to the file
+     */
+    struct THDF5Stream{
+        hid_t group; ///< HDF5 group containing datasets
+        std::vector<hid_t> datasets; ///< One dataset for each column
+        std::vector<std::vector<double> > buffers; ///< Buffered values of each column
+        hsize_t rows = 0; ///< Number of rows already written to the datasets
+    };
+
+    hid_t file; ///< HDF5 file to print to
+    std::map<std::string, THDF5Stream> streams; ///< List of streams, one for each particle and output type
+
+    /**
+     * Append buffered rows of a stream to its datasets and clear buffers
+     *
+     * @param stream Stream to flush
+     */
+    void Flush(THDF5Stream &stream);
+
+    /**
+     * Buffers given variables and writes them to the dataset of that particle and output type when a chunk is full
+     * 
+     * @param particlename Name of particle to be printed
+     * @param suffix Select group to log to (e.g. "end", "snapshot", "track", "spin")
+     * @param titles List of variable names, used as dataset names
+     * @param vars List of variables to be logged
+     */
+    void DoLog(const std::string &particlename, const std::string &suffix, const std::vector<std::string> &titles, const std::vector<double> &vars) override;
+
+    /**
+     * Tables are written to groups named after particle and log type in the HDF5 file
+     *
+     * @param particlename Name of particle
+     * @param suffix Log type
+     * @param entry Returns file name and group in entry of manifest
+     */
+    void LocateTable(const std::string &particlename, const std::string &suffix, TLogManifestEntry &entry) const override;
+public:
+    /**
+     * Constructor, reads relevant configuration parameters from config and creates HDF5 file
+     * 
+     * @param aconfig List of configuration parameters read from config file
+     * @param ashard Index appended to file name, used when several loggers run in parallel (-1: no index)
+     */
+    THDF5Logger(TConfig &aconfig, const int ashard = -1);
+
+    /**
+     * Destructor, writes remaining buffered rows and closes file
+     */
+    ~THDF5Logger() final;
+
+    /**
+     * Get memory used by the logger, including buffered rows of all datasets
+     *
+     * @return Returns approximate size [bytes]
+     */
+    std::size_t MemoryUsage() const override;
+};
+#endif
+
 /**
  * Instantiates on of the classes derived from TLogger, depending on configuration variables
  * 
  * @param config List of configuration variables
+ * @param shard Index appended to output file names, used when several loggers run in parallel (-1: no index)
  * 
  * @returns Class derived from TLogger
  */
-std::unique_ptr<TLogger> CreateLogger(TConfig& config);
+std::unique_ptr<TLogger> CreateLogger(TConfig& config, const int shard = -1);
+
+/**
+ * Write a table of values into a file.
+ *
+ * Depending on the GLOBAL option "fieldoutput" the table is written as text file (.out) with one row per line,
+ * as binary file (.bin) with one header line containing the column titles followed by the values as native doubles row by row,
+ * or as HDF5 file (.h5) with one compressed dataset per column.
+ *
+ * @param config TConfig class containing output options
+ * @param outfile Filename of result file without extension
+ * @param titles Column titles
+ * @param values Table values, row by row
+ *
+ * @return Returns filename of written file
+ */
+boost::filesystem::path PrintTable(TConfig &config, const boost::filesystem::path &outfile, const std::vector<std::string> &titles, const std::vector<double> &values);
 
 
 #endif //PENTRACK_LOGGER_H
@@ -0,0 +1,67 @@
+/**
+ * \file
+ * Manifest listing the log tables written by a job, and merging of the tables of many jobs and shards into a single dataset (simtype 11).
+ */
+
+#ifndef MANIFEST_H_
+#define MANIFEST_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "config.h"
+
+/**
+ * Log table written by a logger, e.g. the endlog of neutrons in a text file or an HDF5 group
+ */
+struct TLogManifestEntry{
+	std::string file; ///< Name of file in output directory
+	std::string dataset; ///< Tree or group containing the table, empty for text files
+	std::string particlename; ///< Particle type
+	std::string logtype; ///< Log type, e.g. end, track, or hit
+	int shard = -1; ///< Index of logger that wrote the table (-1: single logger)
+	unsigned long long rows = 0; ///< Number of rows
+	std::vector<std::string> columns; ///< Column names
+};
+
+/**
+ * Write manifest of a job
+ *
+ * The manifest is a text file starting with the line "PENTrack manifest 1", followed by the lines "job <jobnumber>" and "seed <seed>"
+ * and one line per table: "table <file> <dataset> <particle> <logtype> <shard> <rows> <number of columns> <columns...>", with "-" for an empty dataset.
+ *
+ * @param file Manifest file
+ * @param entries Tables written by all loggers of the job
+ * @param seed Random seed of the job
+ * @param jobnumber Job number
+ * @param append Add rows listed in an existing manifest of the same tables, e.g. when a simulation was resumed and appended to its text logs
+ */
+void WriteLogManifest(const boost::filesystem::path &file, std::vector<TLogManifestEntry> entries, const std::uint64_t seed, const int jobnumber, const bool append);
+
+/**
+ * Read manifest of a job
+ *
+ * @param file Manifest file
+ * @param seed Returns random seed of the job
+ * @param jobnumber Returns job number
+ *
+ * @return Returns tables listed in manifest
+ */
+std::vector<TLogManifestEntry> ReadLogManifest(const boost::filesystem::path &file, std::uint64_t &seed, int &jobnumber);
+
+/**
+ * Concatenate the log tables of all jobs found in the output directory (simtype 11)
+ *
+ * Reads the manifests of the jobs given by the GLOBAL option mergejobs (default: all manifests with the current logprefix),
+ * reads the shards of each table in parallel, and writes them in order of job and shard with a single logger of the type selected in the configuration,
+ * e.g. into one HDF5 or ROOT file. An index lists the rows that each shard contributed to each table.
+ *
+ * @param config Configuration
+ * @param nthreads Number of threads reading shards in parallel
+ */
+void MergeLogs(TConfig &config, const unsigned nthreads);
+
+#endif // MANIFEST_H_
@@ -7,8 +7,203 @@
 #define MC_H_
 
 #include <random>
+#include <vector>
+#include <numeric>
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <iostream>
 
-typedef std::mt19937_64 TMCGenerator; ///< typedef to default random-number generator
+class TPhiloxGenerator;
+
+/**
+ * Halton low-discrepancy sequence with random digit permutations (J. Matoušek, J. Complexity 14 (1998) 527, doi:10.1006/jcom.1998.0489)
+ *
+ * Coordinate d of point n is the radical inverse of n in the d-th prime base, with the digit at each position mapped through its own random permutation.
+ * The permutations are drawn from the key (seed, job number), so every point is uniformly distributed in the unit cube,
+ * points of the same job keep their low discrepancy, and jobs with different seeds or job numbers are independent randomizations, whose spread estimates the error.
+ * The permutations also remove the correlations between dimensions with large bases of the unscrambled sequence.
+ */
+class TScrambledHalton{
+private:
+	std::vector<unsigned> bases; ///< Prime base of each dimension
+	std::vector<std::vector<std::vector<double> > > permutations; ///< Permuted digits at each position of each dimension, multiplied by the value of the position
+public:
+	static const unsigned MAX_DIMENSIONS = 32; ///< Max. number of dimensions
+
+	/**
+	 * Constructor, draws digit permutations
+	 *
+	 * @param dimensions Number of dimensions (at most MAX_DIMENSIONS)
+	 * @param mc Random-number generator, the permutations depend only on its seed and job number, not on its substream
+	 */
+	TScrambledHalton(const unsigned dimensions, TPhiloxGenerator mc);
+
+	/**
+	 * Return number of dimensions
+	 */
+	unsigned Dimensions() const { return bases.size(); };
+
+	/**
+	 * Return coordinate of a point, scaled to the range of 64-bit integers, so it can be returned by a UniformRandomBitGenerator
+	 *
+	 * @param n Index of point
+	 * @param d Dimension
+	 *
+	 * @return Returns coordinate times 2^64
+	 */
+	std::uint64_t Coordinate(std::uint64_t n, const unsigned d) const;
+};
+
+
+/**
+ * Counter-based random-number generator Philox4x64-10 (J. K. Salmon et al., Proc. SC11, doi:10.1145/2063384.2063405).
+ *
+ * Each block of four random numbers is a bijective function of a 256-bit counter, scrambled with a 128-bit key in ten rounds.
+ * The key is built from the random seed and the job number, the counter from the particle number, an index of the secondary particle,
+ * and the number of blocks already drawn in this substream. Every particle thus draws from its own substream,
+ * independent of how many numbers other particles used, and of the thread and the order in which particles are tracked.
+ *
+ * Optionally, the first numbers drawn after StartQuasiRandom are the coordinates of a point of a TScrambledHalton sequence instead,
+ * e.g. so particle sources create initial states with low discrepancy while the physics during tracking keeps drawing pseudo-random numbers.
+ *
+ * Satisfies the concept UniformRandomBitGenerator of STL
+ */
+class TPhiloxGenerator{
+public:
+	typedef std::uint64_t result_type; ///< type returned by operator()
+private:
+	std::array<result_type, 2> key; ///< key (seed, job number)
+	std::array<result_type, 4> counter; ///< counter (block, particle number, secondary index, 0)
+	std::array<result_type, 4> block; ///< current block of random numbers
+	unsigned next; ///< index of next random number in block
+	const TScrambledHalton *quasirandom = nullptr; ///< Sequence returning the next numbers (nullptr: pseudo-random numbers only)
+	result_type quasipoint = 0; ///< Index of point in sequence
+	unsigned quasidimension = 0; ///< Next coordinate of point to be returned, pseudo-random numbers are returned when all coordinates were used
+
+	/**
+	 * Calculate high and low 64 bits of product of two 64-bit numbers
+	 */
+	static void mulhilo(const result_type a, const result_type b, result_type &hi, result_type &lo){
+		unsigned __int128 product = static_cast<unsigned __int128>(a)*b;
+		hi = static_cast<result_type>(product >> 64);
+		lo = static_cast<result_type>(product);
+	}
+public:
+	/**
+	 * Scramble counter with key in ten Philox rounds
+	 *
+	 * @param ctr Counter
+	 * @param k Key
+	 *
+	 * @return Returns block of four random numbers
+	 */
+	static std::array<result_type, 4> philox(std::array<result_type, 4> ctr, std::array<result_type, 2> k){
+		for (int round = 0; round < 10; ++round){
+			if (round > 0){
+				k[0] += 0x9E3779B97F4A7C15ULL;
+				k[1] += 0xBB67AE8584CAA73BULL;
+			}
+			result_type hi0, lo0, hi1, lo1;
+			mulhilo(0xD2E7470EE14C6C93ULL, ctr[0], hi0, lo0);
+			mulhilo(0xCA5A826395121157ULL, ctr[2], hi1, lo1);
+			ctr = {hi1 ^ ctr[1] ^ k[0], lo1, hi0 ^ ctr[3] ^ k[1], lo0};
+		}
+		return ctr;
+	}
+
+	/**
+	 * Constructor
+	 *
+	 * @param seed Random seed
+	 * @param job Job number, jobs with the same seed and different job numbers draw independent random numbers
+	 */
+	explicit TPhiloxGenerator(const result_type seed = 0, const result_type job = 0): key{{seed, job}}{
+		SetSubstream(0, 0);
+	}
+
+	/**
+	 * Start drawing random numbers from the beginning of a substream
+	 *
+	 * @param particlenumber Number of particle
+	 * @param secondary Index of secondary particle, see SecondaryIndex (0: primary particle)
+	 */
+	void SetSubstream(const result_type particlenumber, const result_type secondary){
+		counter = {0, particlenumber, secondary, 0};
+		next = 4;
+	}
+
+	/**
+	 * Calculate index of substream of a secondary particle from the index of its parent, so substreams of particles in decay chains differ
+	 *
+	 * @param parent Index of parent particle (0: primary particle)
+	 * @param n Position of secondary particle in list of its parent's secondaries
+	 *
+	 * @return Returns index of secondary particle, never 0
+	 */
+	static result_type SecondaryIndex(const result_type parent, const result_type n){
+		result_type index = parent*0x9E3779B97F4A7C15ULL + n + 1;
+		return index == 0 ? 1 : index;
+	}
+
+	/**
+	 * Return the coordinates of a point of a quasi-random sequence as the next random numbers, followed by pseudo-random numbers of the current substream
+	 *
+	 * @param sequence Quasi-random sequence, has to exist until StopQuasiRandom is called
+	 * @param point Index of point in sequence
+	 */
+	void StartQuasiRandom(const TScrambledHalton &sequence, const result_type point){
+		quasirandom = &sequence;
+		quasipoint = point;
+		quasidimension = 0;
+	}
+
+	/**
+	 * Continue with pseudo-random numbers of the current substream
+	 */
+	void StopQuasiRandom(){
+		quasirandom = nullptr;
+	}
+
+	static constexpr result_type min(){ return 0; } ///< return min random value
+	static constexpr result_type max(){ return std::numeric_limits<result_type>::max(); } ///< return max random value
+
+	/**
+	 * Return next random number
+	 */
+	result_type operator()(){
+		if (quasirandom != nullptr && quasidimension < quasirandom->Dimensions())
+			return quasirandom->Coordinate(quasipoint, quasidimension++);
+		if (next == 4){
+			block = philox(counter, key);
+			++counter[0];
+			next = 0;
+		}
+		return block[next++];
+	}
+
+	/**
+	 * Write state of generator to stream, so it can continue drawing the same numbers after it was read back
+	 */
+	friend std::ostream& operator<<(std::ostream &str, const TPhiloxGenerator &g){
+		return str << g.key[0] << ' ' << g.key[1] << ' ' << g.counter[0] << ' ' << g.counter[1] << ' ' << g.counter[2] << ' ' << g.counter[3] << ' ' << g.next;
+	}
+
+	/**
+	 * Read state of generator written by operator<<
+	 */
+	friend std::istream& operator>>(std::istream &str, TPhiloxGenerator &g){
+		str >> g.key[0] >> g.key[1] >> g.counter[0] >> g.counter[1] >> g.counter[2] >> g.counter[3] >> g.next;
+		if (str && g.next < 4){ // recalculate current block from previous counter
+			std::array<result_type, 4> ctr = g.counter;
+			--ctr[0];
+			g.block = philox(ctr, g.key);
+		}
+		return str;
+	}
+};
+
+typedef TPhiloxGenerator TMCGenerator; ///< typedef to default random-number generator
 
 namespace std{
 
@@ -189,6 +384,64 @@ struct inversetransform_sqrt{
  */
 template<typename T> using sqrt_distribution = inversetransform_sampler<T, inversetransform_sqrt<T> >;
 
+
+/**
+ * Generate random integers 0..n-1 with probabilities proportional to a list of weights, using Walker's alias method
+ *
+ * Produces the same distribution as discrete_distribution, but each sample takes constant time instead of a binary search over all weights.
+ */
+template<typename IntType = int>
+class alias_distribution{
+public:
+	typedef IntType result_type; ///< type returned by operator()
+private:
+	std::vector<double> _prob; ///< probability to return an index itself instead of its alias
+	std::vector<result_type> _alias; ///< alias returned for each index
+public:
+	alias_distribution(){} ///< empty constructor, creates empty distribution
+
+	/**
+	 * Build alias table from weights
+	 *
+	 * @param first Iterator pointing to first weight
+	 * @param last Iterator pointing behind last weight
+	 */
+	template<class InputIt> alias_distribution(InputIt first, InputIt last){
+		std::vector<double> w(first, last);
+		double sum = std::accumulate(w.begin(), w.end(), 0.);
+		_prob.resize(w.size(), 1);
+		_alias.resize(w.size());
+		std::vector<result_type> small, large;
+		for (std::size_t i = 0; i < w.size(); ++i){
+			w[i] *= w.size()/sum; // scale weights to mean 1
+			_alias[i] = i;
+			(w[i] < 1 ? small : large).push_back(i);
+		}
+		while (not small.empty() && not large.empty()){ // fill up each entry with weight < 1 with part of an entry with weight > 1
+			result_type s = small.back(), l = large.back();
+			small.pop_back();
+			_prob[s] = w[s];
+			_alias[s] = l;
+			w[l] -= 1 - w[s];
+			if (w[l] < 1){
+				large.pop_back();
+				small.push_back(l);
+			}
+		} // entries left over in either list have weight 1 up to round-off
+	}
+
+	/**
+	 * Return random index weighted by its weight
+	 */
+	template<class Random> result_type operator()(Random &r) const{
+		std::uniform_int_distribution<std::size_t> indexdist(0, _prob.size() - 1);
+		std::uniform_real_distribution<double> unidist(0, 1);
+		std::size_t i = indexdist(r);
+		return unidist(r) < _prob[i] ? i : _alias[i];
+	}
+	std::size_t size() const { return _prob.size(); } ///< return number of weights
+};
+
 } // end namespace std
 
 /**
@@ -34,9 +34,10 @@ public:
 	 * @param amc Random number generator
 	 * @param geometry Experiment geometry
 	 * @param afield Optional fields (can be NULL)
+	 * @param startsolid Solid at starting point, if it is already known (nullptr: find it in geometry)
 	 */
 	TMercury(const int number, const double t, const double x, const double y, const double z, const double E, const double phi, const double theta, const double polarisation,
-			TMCGenerator &amc, const TGeometry &geometry, const TFieldManager &afield);
+			TMCGenerator &amc, const TGeometry &geometry, const TFieldManager &afield, const solid *startsolid = nullptr);
 
 protected:
 	/**
@@ -45,7 +46,7 @@ protected:
 	 *
 	 * For parameter doc see TParticle::OnHit
 	 */
-	void OnHit(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const double normal[3],
+	TEventResult OnHit(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const double normal[3],
 			const solid &leaving, const solid &entering, TMCGenerator &mc, stopID &ID, std::vector<TParticle*> &secondaries) const;
 
 	/**
@@ -55,7 +56,7 @@ protected:
 	 *
 	 * For parameter doc see TParticle::OnStep
 	 */
-	void OnStep(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const dense_stepper_type &stepper,
+	TEventResult OnStep(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const TStepper &stepper,
 			const solid &currentsolid, TMCGenerator &mc, stopID &ID, std::vector<TParticle*> &secondaries) const;
 
 
@@ -8,6 +8,12 @@
 #ifndef INCLUDE_MICROROUGHNESS_H_
 #define INCLUDE_MICROROUGHNESS_H_
 
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "mc.h"
+
 namespace MR{
 	/**
 	 * Check if the MicroRoughness is model is applicable to the current interaction, see equations (17) and (18) in Steyerl's publication
@@ -39,6 +45,25 @@ namespace MR{
 	 */
 	double MRDist(const bool transmit, const bool integral, const double v[3], const double normal[3], const double Estep, const double RMSroughness, const double correlationLength, const double theta, const double phi);
 
+	/**
+	 * Evaluate MicroRoughness model probability distribution MRDist for many scattering angles of the same incident particle,
+	 * calculating all factors that depend only on the incident velocity once
+	 *
+	 * @param transmit True if the particle is transmitted through the surface, false if it is reflected
+	 * @param integral Compute phi-integral of diffuse scattering probability distribution
+	 * @param v velocity right before surface hit
+	 * @param normal Normal vector of hit surface
+	 * @param Estep potential step at the material boundary
+	 * @param RMSroughness root-mean-square roughness of the surface at the material boundary
+	 * @param correlationLength correlation length of the surface at the boundary
+	 * @param n Number of scattering angles
+	 * @param theta Array of n polar angles of scattered velocity vectors (0 < theta < pi/2)
+	 * @param phi Array of n azimuthal angles of scattered velocity vectors (0 < phi < 2*pi), ignored if integral == true
+	 * @param result Returns n probabilities, see MRDist
+	 */
+	void MRDist(const bool transmit, const bool integral, const double v[3], const double normal[3], const double Estep, const double RMSroughness, const double correlationLength,
+			const std::size_t n, const double theta[], const double phi[], double result[]);
+
 	/**
 	 * Calculate total diffuse scattering probability according to MicroRoughness model by doing numerical theta-integration of MRDist with integral = true
 	 *
@@ -53,6 +78,22 @@ namespace MR{
 	 */
 	double MRProb(const bool transmit, const double v[3], const double normal[3], const double Estep, const double RMSroughness, const double correlationLength);
 
+	/**
+	 * Calculate total diffuse scattering probability according to MicroRoughness model by doing numerical theta-integration of MRDist with integral = true,
+	 * controlling the integration error with the given tolerance
+	 *
+	 * @param transmit True if the particle is transmitted through the surface, false if it is reflected
+	 * @param v velocity right before surface hit
+	 * @param normal Normal vector of hit surface
+	 * @param Estep potential step at the material boundary
+	 * @param RMSroughness root-mean-square roughness of the surface at the material boundary
+	 * @param correlationLength correlation length of the surface at the boundary
+	 * @param tolerance Absolute and relative tolerance of each integration step
+	 *
+	 * @return Returns probability of reflection/transmission
+	 */
+	double MRProb(const bool transmit, const double v[3], const double normal[3], const double Estep, const double RMSroughness, const double correlationLength, const double tolerance);
+
 	/*
 	 * Calculate maximum of MicroRoughness model distribution by doing numerical minimization of TNeutron::NegMRDist
 	 *
@@ -66,6 +107,75 @@ namespace MR{
 	 * @return Returns maximal value of MicroRoughness model distribution in range (theta = 0..pi/2, phi = 0..2pi)
 	 */
 	double MRDistMax(const bool transmit, const double v[3], const double normal[3], const double Estep, const double RMSroughness, const double correlationLength);
+
+	/**
+	 * Sample scattering angles theta, phi from MicroRoughness model distribution MRDist
+	 *
+	 * The distribution is the product of a Gaussian in the momentum transferred parallel to the surface, with width 1/correlationLength, and a factor depending only on theta.
+	 * The parallel momentum of the scattered neutron is sampled from the Gaussian (or uniformly if the Gaussian does not overlap well with the allowed momenta) and the result is accepted
+	 * with the ratio of the remaining factor and its analytical maximum, so the samples follow MRDist exactly.
+	 *
+	 * @param transmit True if the particle is transmitted through the surface, false if it is reflected
+	 * @param v velocity right before surface hit
+	 * @param normal Normal vector of hit surface
+	 * @param Estep potential step at the material boundary
+	 * @param RMSroughness root-mean-square roughness of the surface at the material boundary
+	 * @param correlationLength correlation length of the surface at the boundary
+	 * @param mc Random-number generator
+	 * @param theta Returns polar angle of scattered velocity vector (0 < theta < pi/2)
+	 * @param phi Returns azimuthal angle of scattered velocity vector (0 < phi < 2*pi)
+	 */
+	void MRSampleDirection(const bool transmit, const double v[3], const double normal[3], const double Estep, const double RMSroughness, const double correlationLength,
+			TMCGenerator &mc, double &theta, double &phi);
+
+	/**
+	 * Enable interpolation of total diffuse scattering probabilities from tables in MRProbTabulated. Has to be called before particles are tracked.
+	 *
+	 * @param tolerance Maximum absolute interpolation error of the tables (0: disable tables)
+	 */
+	void EnableMRProbTables(const double tolerance);
+
+	/**
+	 * Interpolate total diffuse scattering probability MRProb from a table, which is calculated once per thread for each combination of transmit, Estep, RMSroughness, and correlationLength.
+	 *
+	 * The table is spanned by the incident wave number, up to the limit 1/RMSroughness where the MicroRoughness model becomes invalid, and its component normal to the surface.
+	 * Its nodes are densest around the critical wave number of the potential step. The number of nodes is doubled until the interpolation reproduces MRProb within the tolerance
+	 * set with EnableMRProbTables. If tables are disabled, the tolerance is not reached, or the particle lies outside of the table, MRProb is calculated directly.
+	 *
+	 * @param transmit True if the particle is transmitted through the surface, false if it is reflected
+	 * @param v velocity right before surface hit
+	 * @param normal Normal vector of hit surface
+	 * @param Estep potential step at the material boundary
+	 * @param RMSroughness root-mean-square roughness of the surface at the material boundary
+	 * @param correlationLength correlation length of the surface at the boundary
+	 *
+	 * @return Returns probability of reflection/transmission
+	 */
+	double MRProbTabulated(const bool transmit, const double v[3], const double normal[3], const double Estep, const double RMSroughness, const double correlationLength);
+
+	/**
+	 * Calculate table of total diffuse scattering probabilities as MRProbTabulated does, and write it to a binary file that ReadMRProbTables can load
+	 *
+	 * The file starts with a text line "MRProbTable transmit Estep RMSroughness correlationLength nk ncostheta", followed by the nodes along the incident wave number,
+	 * the nodes along the cosine of the incident angle, and the table values row by row as native doubles. The accuracy is set with EnableMRProbTables.
+	 *
+	 * @param filename Name of file
+	 * @param transmit True if the particle is transmitted through the surface, false if it is reflected
+	 * @param Estep potential step at the material boundary
+	 * @param RMSroughness root-mean-square roughness of the surface at the material boundary
+	 * @param correlationLength correlation length of the surface at the boundary
+	 * @param nthreads Number of threads calculating the table
+	 */
+	void WriteMRProbTable(const std::string &filename, const bool transmit, const double Estep, const double RMSroughness, const double correlationLength, const unsigned nthreads);
+
+	/**
+	 * Load tables written by WriteMRProbTable, MRProbTabulated interpolates them in all threads instead of calculating tables for the same parameters. Has to be called before particles are tracked.
+	 *
+	 * Replaces tables loaded by previous calls. Loaded tables are used even if tables are disabled in EnableMRProbTables.
+	 *
+	 * @param filenames Names of files
+	 */
+	void ReadMRProbTables(const std::vector<std::string> &filenames);
 };
 
 
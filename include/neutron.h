@@ -36,10 +36,16 @@ public:
 	 * @param amc Random number generator
 	 * @param geometry Experiment geometry
 	 * @param afield Optional fields (can be NULL)
+	 * @param startsolid Solid at starting point, if it is already known (nullptr: find it in geometry)
 	 */
 	TNeutron(const int number, const double t, const double x, const double y, const double z, const double E, const double phi, const double theta, const double polarisation,
-			TMCGenerator &amc, const TGeometry &geometry, const TFieldManager &afield);
+			TMCGenerator &amc, const TGeometry &geometry, const TFieldManager &afield, const solid *startsolid = nullptr);
 	
+private:
+	mutable double opticaldepth; ///< remaining optical depth until absorption, sampled when the neutron enters an absorbing solid (negative if not sampled yet)
+	mutable unsigned absorbingsolid; ///< ID of solid for which opticaldepth was sampled
+	mutable double absorptionconst; ///< energy-independent factor 2*sqrt(m_n)*W*e/hbar of the absorption coefficient in absorbingsolid
+
 protected:
 	/**
 	 * Calculate neutron-specific potential in material
@@ -71,10 +77,12 @@ protected:
 	 *
 	 * Uses Fermi-potential formalism to calculate reflection/transmission probabilities.
 	 * Diffuse reflection can be done according to Lambert model or Micro Roughness model.
+	 * In weighted tracking the neutron is never absorbed, instead the survival weights of nominal and alternative materials are multiplied by their reflection probabilities
+	 * and the ratio of their probabilities of the sampled reflection or transmission.
 	 *
 	 * For parameter doc see TParticle::OnHit
 	 */
-	void OnHit(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const double normal[3],
+	TEventResult OnHit(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const double normal[3],
 			const solid &leaving, const solid &entering, TMCGenerator &mc, stopID &ID, std::vector<TParticle*> &secondaries) const;
 
 
@@ -83,14 +91,17 @@ protected:
 	 *
 	 * Refracts neutron velocity.
 	 * For parameter documentation see TNeutron::OnHit.
+	 *
+	 * @return Returns false if the velocity did not change (no potential step)
 	 */
-	void Transmit(const value_type x1, const state_type &y1, value_type &x2, state_type &y2,
+	bool Transmit(const value_type x1, const state_type &y1, value_type &x2, state_type &y2,
 			const double normal[3], const double Estep) const;
 
 	/**
 	 * Transmit neutron through surface.
 	 *
 	 * Refracts or scatters the neutron according to Micro Roughness model.
+	 * Must only be called if the model is valid for the neutron's energy and the potential step (see MR::MRValid), which OnHit checks with TMaterialInterface::TSide::MRmaxenergy.
 	 * For parameter documentation see TNeutron::OnHit.
 	 */
 	void TransmitMR(const value_type x1, const state_type &y1, value_type &x2, state_type &y2,
@@ -118,6 +129,7 @@ protected:
 	 * Reflect neutron from surface.
 	 *
 	 * Reflects or scatters the neutron according to Micro Roughness model.
+	 * Must only be called if the model is valid for the neutron's energy and the potential step (see MR::MRValid), which OnHit checks with TMaterialInterface::TSide::MRmaxenergy.
 	 * For parameter documentation see TNeutron::OnHit.
 	 */
 	void ReflectMR(const value_type x1, const state_type &y1, value_type &x2, state_type &y2,
@@ -135,9 +147,11 @@ protected:
 	/**
 	 * Checks for absorption in solids using Fermi-potential formalism and does some additional calculations for neutrons
 	 *
+	 * In weighted tracking the neutron is never absorbed, instead the survival weights of nominal and alternative materials are multiplied by their probabilities to pass through the solid.
+	 *
 	 * For parameter doc see TParticle::OnStep
 	 */
-	void OnStep(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const dense_stepper_type &stepper,
+	TEventResult OnStep(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const TStepper &stepper,
 			const solid &currentsolid, TMCGenerator &mc, stopID &ID, std::vector<TParticle*> &secondaries) const;
 
 
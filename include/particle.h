@@ -8,25 +8,114 @@
 
 #include <fstream>
 #include <vector>
+#include <array>
 #include <map>
+#include <limits>
 
-#include <boost/numeric/odeint.hpp>
-#include "interpolation.h"
 
 #include "geometry.h"
 #include "mc.h"
 #include "fields.h"
+#include "stepper.h"
 
 static const double MAX_TRACK_DEVIATION = 0.001; ///< max deviation of actual trajectory from straight line between start and end points of a step used for geometry-intersection test. If deviation is larger, the step will be split
-static const int STATE_VARIABLES = 9; ///< number of variables in trajectory integration (position, velocity, proper time, polarization, path length)
-static const int SPIN_STATE_VARIABLES = 5; ///< number of variables in spin integration (spin vector, time, total phase)
 
-typedef double value_type; ///< data type used for trajectory integration
-typedef std::vector<value_type> state_type; ///< type representing current particle state (position, velocity, proper time, and polarization) or spin state (x,y,z component)
-typedef boost::numeric::odeint::runge_kutta_dopri5<state_type, value_type> stepper_type; ///< basic integration stepper (5th-order Runge-Kutta)
-typedef boost::numeric::odeint::controlled_runge_kutta<stepper_type> controlled_stepper_type; ///< integration step length controller
-typedef boost::numeric::odeint::dense_output_runge_kutta<controlled_stepper_type> dense_stepper_type; ///< integration step interpolator
-//	typedef boost::numeric::odeint::bulirsch_stoer_dense_out<state_type, value_type> dense_stepper_type2; ///< alternative stepper type (Bulirsch-Stoer)
+struct TParticle;
+
+/**
+ * System functor passed to the trajectory integrator, evaluating fields and equations of motion of a TParticle.
+ *
+ * Specialized for particles with or without charge and magnetic moment, so that field evaluations
+ * and force terms not needed for a particle type are removed at compile time.
+ * Use TParticle::derivs if charge and magnetic moment are not known at compile time.
+ */
+template<bool charged, bool magnetic>
+struct TEquationOfMotion{
+	const TParticle &particle; ///< Particle whose trajectory is integrated
+	const TFieldManager &field; ///< Fields acting on the particle
+
+	/**
+	 * Calculate derivatives dy/dx of particle state
+	 *
+	 * @param y	State vector (position, velocity, proper time, and polarization)
+	 * @param dydx Returns derivatives of y with respect to x
+	 * @param x Time
+	 */
+	void operator()(const state_type &y, state_type &dydx, const value_type x) const;
+};
+
+/**
+ * Cubic spline interpolating the spin-precession axis between equidistant points in time along a trajectory step.
+ *
+ * Uses the same parabolically terminated boundary conditions as alglib::spline1dbuildcubic, but keeps all nodes and coefficients
+ * in fixed-size arrays, so it can be reused for every trajectory step without allocating memory.
+ */
+struct TSpinAxisInterpolant{
+	static const int POINTS = 11; ///< Number of interpolation nodes
+	std::array<double, POINTS> t; ///< Times of nodes
+	std::array<double, POINTS> omega[3]; ///< Components of spin-precession axis at nodes
+	std::array<double, POINTS> domega[3]; ///< Time derivatives of spin-precession axis at nodes, calculated by Build()
+
+	/**
+	 * Calculate spin-precession axis at nodes and the derivatives of the spline
+	 *
+	 * @param p Particle whose spin-precession axis is interpolated
+	 * @param x1 Start time of trajectory step
+	 * @param x2 End time of trajectory step
+	 * @param stepper Trajectory integrator used to calculate spin-precession axis
+	 * @param field TFieldManager used to calculate magnetic and electric fields
+	 */
+	void Build(const TParticle &p, const value_type x1, const value_type x2, const TStepper &stepper, const TFieldManager &field);
+
+	/**
+	 * Interpolate spin-precession axis
+	 *
+	 * @param x Time, outside of the nodes the spline is extrapolated
+	 * @param omegax Returns x component of spin-precession axis
+	 * @param omegay Returns y component of spin-precession axis
+	 * @param omegaz Returns z component of spin-precession axis
+	 */
+	void Evaluate(const value_type x, double &omegax, double &omegay, double &omegaz) const;
+};
+
+/**
+ * Computational cost of tracking a particle, written to endlog to find regions of phase space or geometry that are expensive to simulate
+ */
+struct TTrackingCost{
+	double walltime = 0; ///< Wall-clock time spent tracking the particle [s]
+	double cputime = 0; ///< CPU time spent tracking the particle [s]
+	unsigned long derivs = 0; ///< Number of evaluations of the equation of motion
+	unsigned long collisionqueries = 0; ///< Number of collision tests of trajectory segments
+	unsigned long steps = 0; ///< Number of trajectory-integrator steps
+	double stepsum = 0; ///< Sum of trajectory-integrator step sizes [s]
+	double minstep = std::numeric_limits<double>::infinity(); ///< Smallest trajectory-integrator step size [s]
+	unsigned long iterations = 0; ///< Number of bisections while iterating collision points
+	unsigned long spinsteps = 0; ///< Number of spin-integrator steps
+};
+
+/**
+ * Particle constants in double precision, precomputed once per particle for the equation of motion and spin precession
+ *
+ * The constants in globals.h and the particle properties are long double. Using them directly in the derivative kernels
+ * would promote every operation to extended precision, which is much slower and prevents vectorization.
+ */
+struct TParticleConstants{
+	double chargepermass; ///< q/(m*e), converts Lorentz force into acceleration [C/kg]
+	double mupermass; ///< mu/(m*e), converts gradient of |B| into acceleration [J/(T kg)]
+	double gyro; ///< gyromagnetic ratio [rad/(s T)]
+	double g; ///< gravitational acceleration [m/s^2]
+	double inversec2; ///< 1/c^2 [s^2/m^2]
+};
+
+/**
+ * Outcome of TParticle::OnHit and TParticle::OnStep, tells the tracker how to continue without comparing states
+ */
+enum TEventResult{
+	EVENT_UNCHANGED = 0, ///< End point of the segment was not modified
+	EVENT_TRANSMITTED, ///< End state was modified at the same position and time, e.g. refracted velocity or flipped spin; on a hit the particle crossed the surface
+	EVENT_REFLECTED, ///< End point was reset to the start of the segment with a new velocity, the particle did not cross the surface
+	EVENT_ABSORBED ///< Particle was stopped and its stop ID set, end point may have been moved to the point of absorption
+};
 
 /**
  * Basic particle class (virtual).
@@ -42,6 +131,7 @@ private:
 	const long double m; ///< mass [eV/c^2] (has to be initialized in all derived classes!)
 	const long double mu; ///< magnetic moment [J/T] (has to be initialized in all derived classes!)
 	const long double gamma; ///< gyromagnetic ratio [rad/(s T)] (has to be initialized in all derived classes!)
+	const TParticleConstants constants; ///< Constants used by equation of motion and spin precession, derived from q, m, mu, and gamma
 	int particlenumber; ///< particle number
 	stopID ID; ///< particle fate (defined in globals.h)
 	
@@ -49,18 +139,36 @@ private:
 	value_type tend; ///< stop time
 	state_type ystart; ///< state vector before integration (position, velocity, proper time, polarization, and path length)
 	state_type yend; ///< state vector after integration (position, velocity, proper time, polarization, and path length)
-	state_type spinstart; ///< spin vector before integration
-	state_type spinend; ///< spin vector after integration
-	solid solidstart; ///< solid in which the particle started
-	solid solidend; ///< solid in which particle stopped
+	spin_state_type spinstart; ///< spin vector before integration
+	spin_state_type spinend; ///< spin vector after integration
+	const solid *solidstart; ///< solid in which the particle started (owned by TGeometry, not copied, since solids contain strings and lists)
+	const solid *solidend; ///< solid in which particle stopped (owned by TGeometry)
+	std::vector<std::pair<const solid*, bool> > startsolids; ///< solids containing the starting point if the source already determined them (see TGeometry::GetSolids), cleared when the final state is set (empty: unknown)
 
 	double Hmax; ///< max total energy
 	int Nhit; ///< number of material boundary hits
 	int Nspinflip; ///< number of spin flips
 	long double noflipprob; ///< total probability of NO spinflip calculated by spin tracking
 	int Nstep; ///< number of integration steps
+	double tau; ///< proper time at which tracking of particle stops, drawn when tracking starts (<0: not drawn yet)
+	double statweight; ///< statistical weight, reduced when the particle is split and increased when it survives Russian roulette
+	mutable double hitlossprob; ///< sum of absorption probabilities of all surface hits, reported by TParticle::OnHit
+	mutable double hitflipprob; ///< sum of spin-flip probabilities of all surface hits, reported by TParticle::OnHit
+	bool fatesampled; ///< remaining fate of particle was sampled by TTracker::SampleFate instead of tracking it to the end
+	std::array<int, 3> cell; ///< copy of the periodic unit cell the particle is in, counted along each lattice vector (see TGeometry::ReadPeriodicCell)
+	bool adjoint; ///< particle is tracked backward from a detector, set by TTracker for every tracking run (GLOBAL option adjoint)
+	mutable std::vector<double> weights; ///< survival weights for nominal materials and each alternative of weighted tracking (see solid::weightmats), empty if weighted tracking is disabled
+	mutable TTrackingCost cost; ///< computational cost of tracking, updated during const evaluations of the equation of motion
 
 	std::vector<std::unique_ptr<TParticle> > secondaries; ///< list of secondary particles
+	std::vector<TParticle*> newsecondaries; ///< Output slot for secondaries created by OnStep, OnHit, or Decay, reused so steps do not allocate
+
+	/**
+	 * Take ownership of secondary particles created by OnStep, OnHit, or Decay, they inherit the statistical and survival weights of this particle
+	 *
+	 * @param secs Secondary particles, cleared after ownership was taken
+	 */
+	void AddSecondaries(std::vector<TParticle*> &secs);
 public:
 	/**
 	 * Return name of particle
@@ -97,6 +205,13 @@ public:
 	 */
 	double GetGyromagneticRatio() const { return gamma; };
 
+	/**
+	 * Return constants used by equation of motion and spin precession
+	 *
+	 * @return Double-precision particle constants
+	 */
+	const TParticleConstants& GetConstants() const { return constants; };
+
 	/**
 	 * Return number of particle
 	 *
@@ -144,28 +259,49 @@ public:
 	 *
 	 * @return Initial spin vector of particle
 	 */
-	state_type GetInitialSpin() const { return spinstart; };
+	const spin_state_type& GetInitialSpin() const { return spinstart; };
+
+	/**
+	 * Replace initial spin vector of particle, e.g. with the spin read from a phase-space file
+	 *
+	 * @param spin Initial spin vector, also used as final spin vector until the particle is tracked
+	 */
+	void SetInitialSpin(const spin_state_type &spin){ spinstart = spinend = spin; };
 
 	/**
 	 * Return final spin vector of particle
 	 *
 	 * @return Final spin vector of particle
 	 */
-	state_type GetFinalSpin() const { return spinend; };
+	const spin_state_type& GetFinalSpin() const { return spinend; };
 
 	/**
 	 * Return solid in which particle was created
 	 *
 	 * @return Solid in which particle was created
 	 */
-	solid GetInitialSolid() const { return solidstart; };
+	const solid& GetInitialSolid() const { return *solidstart; };
 
 	/**
 	 * Return solid in which particle was stopped
 	 *
 	 * @return Solid in which particle stopped
 	 */
-	solid GetFinalSolid() const { return solidend; };
+	const solid& GetFinalSolid() const { return *solidend; };
+
+	/**
+	 * Return solids containing the starting point, if the source determined them and the particle was not moved yet
+	 *
+	 * @return Solids paired with information if they are ignored, as returned by TGeometry::GetSolids (empty: unknown, have to be found in the geometry)
+	 */
+	const std::vector<std::pair<const solid*, bool> >& GetStartSolids() const { return startsolids; };
+
+	/**
+	 * Store solids containing the starting point, so the tracker does not have to classify it again, e.g. when a surface source knows which side of a surface the particle starts on
+	 *
+	 * @param solids Solids paired with information if they are ignored, as returned by TGeometry::GetSolids
+	 */
+	void SetStartSolids(const std::vector<std::pair<const solid*, bool> > &solids){ startsolids = solids; };
 
 	/**
 	 * Return maximal total energy on trajectory of particle
@@ -202,6 +338,37 @@ public:
 	 */
 	double GetNoSpinFlipProbability() const { return noflipprob; };
 
+	/**
+	 * Return sums of absorption and spin-flip probabilities of all surface hits, reported by TParticle::OnHit
+	 *
+	 * Divided by the time the particle was tracked, they are its wall-loss and wall-depolarisation rates.
+	 *
+	 * @param lossprob Returns sum of absorption probabilities
+	 * @param flipprob Returns sum of spin-flip probabilities
+	 */
+	void GetHitProbabilities(double &lossprob, double &flipprob) const { lossprob = hitlossprob; flipprob = hitflipprob; };
+
+	/**
+	 * Check if remaining fate of particle was sampled by TTracker::SampleFate instead of tracking it to the end
+	 *
+	 * @return Returns true if fate was sampled
+	 */
+	bool IsFateSampled() const { return fatesampled; };
+
+	/**
+	 * Return copy of the periodic unit cell the particle is in
+	 *
+	 * @return Returns number of cells the particle moved along each lattice vector since it was created
+	 */
+	const std::array<int, 3>& GetCell() const { return cell; };
+
+	/**
+	 * Check if particle is tracked backward from a detector, so OnHit has to apply the reverse of surface interactions
+	 *
+	 * @return Returns true in adjoint tracking mode
+	 */
+	bool IsAdjoint() const { return adjoint; };
+
 	/**
 	 * Return number of steps taken by integrator
 	 *
@@ -209,6 +376,41 @@ public:
 	 */
 	int GetNumberOfSteps() const { return Nstep; };
 
+	/**
+	 * Return statistical weight of particle
+	 *
+	 * @return Statistical weight, 1 unless the particle was split or survived Russian roulette
+	 */
+	double GetStatisticalWeight() const { return statweight; };
+
+	/**
+	 * Set statistical weight of particle
+	 *
+	 * @param w Statistical weight
+	 */
+	void SetStatisticalWeight(const double w){ statweight = w; };
+
+	/**
+	 * Return survival weights of weighted tracking
+	 *
+	 * @return Survival weight for nominal materials followed by weights for each alternative in solid::weightmats (empty if weighted tracking is disabled)
+	 */
+	const std::vector<double>& GetSurvivalWeights() const { return weights; };
+
+	/**
+	 * Return computational cost of tracking the particle, counted by the tracker and the equation of motion
+	 *
+	 * @return Cost counters
+	 */
+	TTrackingCost& TrackingCost() const { return cost; };
+
+	/**
+	 * Return proper time at which tracking of particle stops, i.e. its decay time or max. simulation time
+	 *
+	 * @return Proper time, negative if tracking of particle has not started yet
+	 */
+	double GetStopProperTime() const { return tau; };
+
 	/**
 	 * Return initial total energy
 	 *
@@ -244,6 +446,13 @@ public:
 	 */
 	std::vector<std::unique_ptr<TParticle> >& GetSecondaryParticles(){ return secondaries; }
 
+	/**
+	 * Return list of secondary particles
+	 *
+	 * @return List of particles
+	 */
+	const std::vector<std::unique_ptr<TParticle> >& GetSecondaryParticles() const { return secondaries; }
+
 	/**
 	 * Set ID of particle
 	 * 
@@ -259,7 +468,61 @@ public:
 	 * @param spin 3-vector of particle spin
 	 * @param sld Solid the particle was stopped in
 	 */
-	void SetFinalState(const value_type& x, const state_type& y, const state_type& spin, const solid& sld);
+	void SetFinalState(const value_type& x, const state_type& y, const spin_state_type& spin, const solid& sld);
+
+	/**
+	 * Restart counting spin flips and the probability that the spin did not flip, e.g. when the spin is tracked again along the same trajectory (see TTracker::ReplaySpin)
+	 *
+	 * @param flips Number of spin flips that do not depend on spin tracking, e.g. on walls
+	 */
+	void ResetSpinFlips(const int flips){ Nspinflip = flips; noflipprob = 1; }
+
+	/**
+	 * Mark remaining fate of particle as sampled and add the surface hits and spin flips it would have had until then, see TTracker::SampleFate
+	 *
+	 * @param hits Number of sampled surface hits
+	 * @param flips Number of sampled spin flips on surfaces
+	 */
+	void SetFateSampled(const int hits, const int flips){ Nhit += hits; Nspinflip += flips; fatesampled = true; }
+
+	/**
+	 * Count particle moving into a neighbouring copy of the periodic unit cell, see TTracker::CrossCell
+	 *
+	 * @param axis Index of lattice vector
+	 * @param cells Number of cells the particle moved along the lattice vector
+	 */
+	void ChangeCell(const unsigned axis, const int cells){ cell[axis] += cells; }
+
+	/**
+	 * Set proper time at which tracking of particle stops
+	 *
+	 * @param atau Proper time
+	 */
+	void SetStopProperTime(const double atau){ tau = atau; }
+
+	/**
+	 * Set if particle is tracked backward from a detector (see TTracker::adjoint)
+	 *
+	 * @param aadjoint True in adjoint tracking mode
+	 */
+	void SetAdjoint(const bool aadjoint){ adjoint = aadjoint; }
+
+	/**
+	 * Write state of particle to stream, e.g. to continue tracking it after the program was interrupted
+	 *
+	 * Includes everything that changes during tracking, except secondary particles.
+	 *
+	 * @param out Stream
+	 */
+	void WriteState(std::ostream &out) const;
+
+	/**
+	 * Read state of particle written by WriteState
+	 *
+	 * @param in Stream
+	 * @param geometry Experiment geometry, used to look up solids by their ID
+	 */
+	void ReadState(std::istream &in, const TGeometry &geometry);
 
 	/**
 	 * Constructor, initializes TParticle::type, TParticle::q, TParticle::m, TParticle::mu
@@ -283,10 +546,11 @@ public:
 	 * @param amc Random number generator
 	 * @param geometry Experiment geometry
 	 * @param afield TFieldManager containing all electromagnetic fields
+	 * @param startsolid Solid at starting point, if it is already known (nullptr: find it in geometry)
 	 */
 	TParticle(const char *aname, const  double qq, const long double mm, const long double mumu, const long double agamma, const int number,
 			const double t, const double x, const double y, const double z, const double E, const double phi, const double theta, const double polarisation,
-			TMCGenerator &amc, const TGeometry &geometry, const TFieldManager &afield);
+			TMCGenerator &amc, const TGeometry &geometry, const TFieldManager &afield, const solid *startsolid = nullptr);
 
 	TParticle(const TParticle &p) = delete; ///< TParticle is not copyable
 	TParticle& operator=(const TParticle &p) = delete; ///< TParticle is not copyable
@@ -296,6 +560,26 @@ public:
 	 */
 	virtual ~TParticle(){ };
 
+	/**
+	 * Allocate memory for a particle object
+	 *
+	 * Memory of destroyed particles is kept in a free list of the destroying thread and reused for the next particle of the same size,
+	 * so tracking many short-lived particles and their secondaries does not call the global allocator for each of them.
+	 *
+	 * @param size Size of particle object
+	 *
+	 * @return Returns pointer to memory
+	 */
+	static void* operator new(std::size_t size);
+
+	/**
+	 * Return memory of a destroyed particle object to the free list of the calling thread
+	 *
+	 * @param ptr Pointer to memory
+	 * @param size Size of particle object
+	 */
+	static void operator delete(void *ptr, std::size_t size);
+
 
 	/**
 	 * Equations of motion dy/dx = f(x,y).
@@ -326,12 +610,26 @@ public:
 	 */
 	void EquationOfMotion(const state_type &y, state_type &dydx, const value_type x, const double B[3], const double dBidxj[3][3], const double E[3]) const;
 
+	/**
+	 * Equations of motion dy/dx = f(x,y), specialized for particles with or without charge and magnetic moment.
+	 *
+	 * Terms that vanish for the particle (Lorentz force, force on magnetic moment) are removed at compile time.
+	 * Must only be called with charged == (q != 0) and magnetic == (mu != 0).
+	 *
+	 * @param y	State vector (position, velocity, proper time, and polarization)
+	 * @param dydx Returns derivatives of y with respect to x
+	 * @param x Time
+	 * @param B Magnetic field (only used if magnetic is true or charged is true)
+	 * @param dBidxj Spatial derivatives of magnetic field (only used if magnetic is true)
+	 * @param E Electric field (only used if charged is true)
+	 */
+	template<bool charged, bool magnetic>
+	void EquationOfMotion(const state_type &y, state_type &dydx, const value_type x, const double B[3], const double dBidxj[3][3], const double E[3]) const;
+
 
     /**
      * Call OnStep for particle-dependent physics processes on a step.
      *
-     * Check if trajectory has been altered by physics processes, return true if it was.
-     *
      * @param x1 Start time of line segment
      * @param y1 Start point of line segment
      * @param x2 End time of line segment
@@ -340,11 +638,12 @@ public:
      * @param currentsolid Material the particle is in during this step
      * @param mc Random-number generator
      * @param field TFieldManager used to calculate electric and magnetic fields
+     * @param energyinterval Max. total energy is updated every energyinterval-th step (1: every step, 0: never)
 	 * 
-     * @return Returns true if trajectory was altered
+     * @return Returns outcome of OnStep
      */
-    void DoStep(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const dense_stepper_type &stepper,
-                const solid &currentsolid, TMCGenerator &mc, const TFieldManager &field);
+    TEventResult DoStep(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const TStepper &stepper,
+                const solid &currentsolid, TMCGenerator &mc, const TFieldManager &field, const unsigned energyinterval = 1);
 
     /**
      * Call OnHit to check if particle should cross material boundary.
@@ -360,9 +659,9 @@ public:
 	 * @param entering Material that particle is entering
      * @param mc Random-number generator
 	 * 
-     * @return Returns true if trajectory was altered
+     * @return Returns outcome of OnHit
      */
-    void DoHit(const value_type x1, const state_type &y1, value_type &x2, state_type &y2,
+    TEventResult DoHit(const value_type x1, const state_type &y1, value_type &x2, state_type &y2,
                const double normal[3], const solid &leaving, const solid &entering,
                TMCGenerator &mc);
 
@@ -401,7 +700,7 @@ public:
 	 * @param Omegay Returns y component of precession axis in lab frame
 	 * @param Omegaz Returns z component of precession axis in lab frame
 	 */
-	void SpinPrecessionAxis(const double t, const dense_stepper_type &stepper, const TFieldManager &field, double &Omegax, double &Omegay, double &Omegaz) const;
+	void SpinPrecessionAxis(const double t, const TStepper &stepper, const TFieldManager &field, double &Omegax, double &Omegay, double &Omegaz) const;
 
 	/**
 	 * Calculate spin precession axis.
@@ -418,20 +717,35 @@ public:
 	 */
 	void SpinPrecessionAxis(const double t, const double B[3], const double E[3], const state_type &dydt, double &Omegax, double &Omegay, double &Omegaz) const;
 
+	/**
+	 * Calculate spin precession axis split into the contributions of static fields and of RF pulses, see TFieldManager::BFieldRF
+	 *
+	 * The total precession axis is Omega0 + Omegac*cos(omega*t) - Omegas*sin(omega*t) with the carrier frequency omega of the RF pulses.
+	 * Electric fields and Thomas precession are included in Omega0.
+	 *
+	 * @param t Time
+	 * @param stepper Trajectory integrator used to calculate position and velocity at time t
+	 * @param field TFieldManager used to calculate electric and magnetic fields
+	 * @param Omega0 Returns precession axis due to static fields
+	 * @param Omegac Returns precession axis due to the envelope of RF pulses in phase with cos(omega*t)
+	 * @param Omegas Returns precession axis due to the envelope of RF pulses in phase with -sin(omega*t)
+	 */
+	void RFSpinPrecessionAxes(const double t, const TStepper &stepper, const TFieldManager &field, double Omega0[3], double Omegac[3], double Omegas[3]) const;
+
     /**
 	 * Equations of motion of spin vector.
 	 *
-	 * Calculates spin-precession axis either directly or from pre-calculated splines
+	 * Calculates spin-precession axis either directly or from a pre-calculated spline
 	 *
 	 * @param y Current spin vector
 	 * @param dydx Calculated time derivative of spin vector
 	 * @param x Current time
 	 * @param stepper Trajectory integrator used to calculate spin-precession axis
 	 * @param field TFieldManager used to calculate magnetic and electric fields
-	 * @param omega_int Vector of three splines used to interpolate spin-precession axis (can be empty)
+	 * @param omega_int Spline used to interpolate spin-precession axis (nullptr: calculate spin-precession axis directly)
 	 */
-	void SpinDerivs(const state_type &y, state_type &dydx, const value_type x,
-			const dense_stepper_type &stepper, const TFieldManager *field, const std::vector<alglib::spline1dinterpolant> &omega_int) const;
+	void SpinDerivs(const spin_state_type &y, spin_state_type &dydx, const value_type x,
+			const TStepper &stepper, const TFieldManager *field, const TSpinAxisInterpolant *omega_int) const;
 
 	/**
 	 * Calculate kinetic energy.
@@ -445,6 +759,21 @@ public:
 	double GetKineticEnergy(const value_type v[3]) const;
 
 protected:
+	/**
+	 * Return survival weights of weighted tracking, which can be multiplied in TParticle::OnHit and TParticle::OnStep instead of stopping the particle
+	 *
+	 * @return Survival weights, see GetSurvivalWeights
+	 */
+	std::vector<double>& SurvivalWeights() const { return weights; };
+
+	/**
+	 * Report probabilities of a surface hit in TParticle::OnHit, independent of its sampled outcome
+	 *
+	 * @param lossprob Probability that the particle is absorbed by the surface
+	 * @param flipprob Probability that the surface flips the spin
+	 */
+	void AddHitProbabilities(const double lossprob, const double flipprob) const { hitlossprob += lossprob; hitflipprob += flipprob; };
+
 	/**
 	 * This virtual method is executed, when a particle crosses a material boundary.
 	 *
@@ -461,8 +790,10 @@ protected:
 	 * @param mc Random-number generator
 	 * @param ID If particle is stopped, set this to the appropriate stopID
 	 * @param secondaries Add any secondary particles produced in this interaction
+	 *
+	 * @return Returns how the end point was modified, EVENT_TRANSMITTED and EVENT_REFLECTED also cover changes of polarisation
 	 */
-	virtual void OnHit(const value_type x1, const state_type &y1, value_type &x2, state_type &y2,
+	virtual TEventResult OnHit(const value_type x1, const state_type &y1, value_type &x2, state_type &y2,
 						const double normal[3], const solid &leaving, const solid &entering,
 						TMCGenerator &mc, stopID &ID, std::vector<TParticle*> &secondaries) const = 0;
 
@@ -482,8 +813,10 @@ protected:
 	 * @param mc Random-number generator
 	 * @param ID If particle is stopped, set this to the appropriate stopID
 	 * @param secondaries Add any secondary particles produced in this interaction
+	 *
+	 * @return Returns how the end point was modified, EVENT_TRANSMITTED if only the end state (e.g. polarisation) changed
 	 */
-	virtual void OnStep(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const dense_stepper_type &stepper,
+	virtual TEventResult OnStep(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const TStepper &stepper,
 			const solid &currentsolid, TMCGenerator &mc, stopID &ID, std::vector<TParticle*> &secondaries) const = 0;
 
 
@@ -0,0 +1,145 @@
+/**
+ * \file
+ * Library interface to run simulations inside another program, e.g. a parameter scan or an optimizer written in Python,
+ * without paying process startup and field and geometry loading for each run.
+ */
+
+#ifndef PENTRACK_H_
+#define PENTRACK_H_
+
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+class TConfig;
+class TFieldManager;
+class TGeometry;
+class TParticleSource;
+class TRegionMap;
+
+/**
+ * Final states of tracked particles, one row per particle
+ */
+struct TTrackResult{
+	std::vector<std::string> columns; ///< Column names, same as in the end log
+	std::vector<std::string> particles; ///< Name of each particle (neutron, proton, ...), one entry per row
+	std::vector<double> values; ///< Row-major table with columns.size() values per particle
+	long long steps = 0; ///< Number of integration steps of all particles
+
+	/**
+	 * Number of rows
+	 */
+	std::size_t size() const{ return columns.empty() ? 0 : values.size()/columns.size(); }
+};
+
+
+/**
+ * Simulation with fields and geometry loaded once, which tracks batches of particles on request
+ *
+ * The configuration is read like the one of the PENTrack executable.
+ * Particles are numbered and draw from the same random-number substreams as in the executable,
+ * so a batch tracked with the same seed, job number and particle numbers gives the same results as a run of the executable.
+ * Log files are only written if requested, the final states of all particles are returned by Track instead.
+ * Fields, geometry, and source are owned by this object and are used by a single simulation at a time,
+ * since several global settings (e.g. job number and paths) are shared by all simulations in a process.
+ */
+class TSimulation{
+public:
+	/**
+	 * Constructor, loads fields, geometry, and source
+	 *
+	 * @param configfile Configuration file
+	 * @param overrides Options replacing those in the configuration, keys have the form "SECTION.option", e.g. "GLOBAL.simtime"
+	 * @param seed Random seed (0: generated from clock)
+	 * @param jobnumber Job number, selects random-number streams
+	 * @param outpath Directory for log files
+	 * @param writelogs Write log files as defined in the configuration (false: all logs are disabled)
+	 */
+	TSimulation(const std::string &configfile, const std::map<std::string, std::string> &overrides = {}, const std::uint64_t seed = 0,
+			const long long jobnumber = 0, const std::string &outpath = "out/", const bool writelogs = false);
+
+	/**
+	 * Destructor
+	 */
+	~TSimulation();
+
+	/**
+	 * Replace source, fields and geometry are kept
+	 *
+	 * @param options SOURCE options replacing those in the configuration
+	 */
+	void SetSource(const std::map<std::string, std::string> &options);
+
+	/**
+	 * Read configuration file again and replace all overrides given before, reloading only what changed
+	 *
+	 * Fields are reloaded if the FIELDS, FORMULAS, or GLOBAL sections or files they refer to changed,
+	 * the geometry if GLOBAL or any other section except FIELDS, FORMULAS, sources, HISTOGRAMS, and particle options or files it refers to changed,
+	 * and the source if its options or the geometry changed. Particle options, simtime, and secondaries take effect without reloading.
+	 *
+	 * @param overrides Options replacing those in the configuration, keys have the form "SECTION.option"
+	 *
+	 * @return Returns list of reloaded parts, e.g. "fields geometry source", or an empty string if nothing was reloaded
+	 */
+	std::string Reconfigure(const std::map<std::string, std::string> &overrides);
+
+	/**
+	 * Track particles with numbers firstparticle ... firstparticle + count - 1, including their secondaries and copies created by splitting
+	 *
+	 * @param count Number of primary particles
+	 * @param firstparticle Number of first particle
+	 * @param nthreads Number of threads tracking particles in parallel
+	 *
+	 * @return Returns final states of all particles, ordered by particle number, each primary particle followed by its secondaries
+	 */
+	TTrackResult Track(const long long count, const long long firstparticle = 1, const int nthreads = 1);
+
+	/**
+	 * Random seed used by the simulation
+	 */
+	std::uint64_t GetSeed() const{ return seed; }
+
+	/**
+	 * Maximum simulation time [s] of each particle (GLOBAL option simtime)
+	 */
+	double GetSimTime() const{ return simtime; }
+
+private:
+	/**
+	 * Read configuration file, apply overrides, and add defaults of particle options
+	 *
+	 * @param overrides Options replacing those in the configuration
+	 *
+	 * @return Returns configuration
+	 */
+	std::unique_ptr<TConfig> ReadConfig(const std::map<std::string, std::string> &overrides) const;
+
+	/**
+	 * Find input files referred to by options of the given sections, with their modification times
+	 *
+	 * @param sections Sections to search
+	 *
+	 * @return Returns modification time of each existing file named in an option
+	 */
+	std::map<std::string, std::time_t> InputFiles(const std::vector<std::string> &sections) const;
+
+	std::unique_ptr<TConfig> config; ///< Configuration including overrides
+	std::unique_ptr<TFieldManager> field; ///< Fields
+	std::unique_ptr<TGeometry> geometry; ///< Geometry
+	std::unique_ptr<TParticleSource> source; ///< Particle source
+	std::unique_ptr<TRegionMap> regionmap; ///< Map of wall distances and field bounds shared by all trackers (nullptr: GLOBAL option regionmap not set)
+	std::uint64_t seed; ///< Random seed
+	long long jobnumber; ///< Job number
+	double simtime = 1500.; ///< Maximum simulation time [s]
+	int secondaries = 1; ///< Track secondary particles
+	bool sourceprepared = false; ///< TParticleSource::Prepare was called for the current source
+	std::string configfile; ///< Absolute path of configuration file
+	bool writelogs; ///< Write log files as defined in the configuration
+	std::map<std::string, std::time_t> fieldfiles; ///< Files read by the fields, with modification times when they were loaded
+	std::map<std::string, std::time_t> geometryfiles; ///< Files read by geometry and source, with modification times when they were loaded
+};
+
+#endif // PENTRACK_H_
@@ -0,0 +1,260 @@
+/**
+ * \file
+ * Analytic solids (boxes, spheres, cylinders, cones, half-spaces, solids of revolution) and unions and differences of them,
+ * which can be used in the GEOMETRY section instead of STL files.
+ * Segments are intersected with their surfaces exactly, without tessellating them into triangles.
+ */
+
+#ifndef PRIMITIVES_H_
+#define PRIMITIVES_H_
+
+#include <vector>
+#include <memory>
+#include <string>
+
+#include "trianglemesh.h"
+
+/**
+ * Crossing of a segment with the surface of a TPrimitive
+ */
+struct TPrimitiveCrossing{
+	double s; ///< Parametric coordinate of crossing along segment (P = p1 + s*(p2 - p1))
+	CVector normal; ///< Outward unit normal of surface at crossing
+};
+
+/**
+ * Base class of analytic solids
+ */
+class TPrimitive{
+public:
+	/**
+	 * Destructor
+	 */
+	virtual ~TPrimitive(){ };
+
+	/**
+	 * Check if point is inside solid
+	 *
+	 * @param p Point
+	 *
+	 * @return Returns true if point is inside solid
+	 */
+	virtual bool Inside(const CPoint &p) const = 0;
+
+	/**
+	 * Find all crossings of segment with surface of solid
+	 *
+	 * Segments touching the surface without crossing it, or lying in a flat face, do not cross it.
+	 *
+	 * @param segment Segment
+	 * @param crossings Crossings are appended to this list, in no particular order
+	 */
+	virtual void Intersect(const CSegment &segment, std::vector<TPrimitiveCrossing> &crossings) const = 0;
+
+	/**
+	 * Get lower bound of distance of a point to the surface of solid
+	 *
+	 * The distance is exact for all basic solids. For unions and differences it is the distance to the closest surface of its parts.
+	 *
+	 * @param p Point
+	 *
+	 * @return Returns distance to surface
+	 */
+	virtual double Distance(const CPoint &p) const = 0;
+
+	/**
+	 * Get bounding box of solid
+	 *
+	 * @return Returns bounding box, infinite for half-spaces
+	 */
+	virtual CGAL::Bbox_3 BoundingBox() const = 0;
+
+	/**
+	 * Create solid from an expression in the GEOMETRY section
+	 *
+	 * The expression must not contain whitespace. Known solids are (all coordinates in m)
+	 * - box(x1,y1,z1,x2,y2,z2): Axis-aligned box between two corners
+	 * - sphere(x,y,z,r): Sphere with center and radius
+	 * - cylinder(x1,y1,z1,x2,y2,z2,r): Cylinder between centers of its two faces, with radius
+	 * - cone(x1,y1,z1,x2,y2,z2,r1,r2): Truncated cone between centers of its two faces, with radius at each face
+	 * - plane(x,y,z,nx,ny,nz): Half-space behind plane through a point, with outward normal
+	 * - revolution(x,y,z,ax,ay,az,r1,h1,r2,h2,r3,h3,...): Closed profile polygon with corners (r, h) rotated about the axis through a point with direction a,
+	 *   r is the distance from the axis and h the position along it relative to the point
+	 * - union(A,B,...): Points inside any of the solids A, B, ...
+	 * - difference(A,B,...): Points inside A, but not inside B, ...
+	 *
+	 * @param expression Expression
+	 *
+	 * @return Returns solid described by the expression
+	 */
+	static std::unique_ptr<TPrimitive> Parse(const std::string &expression);
+
+	/**
+	 * Check if the description of a solid in the GEOMETRY section is an expression for an analytic solid instead of a file name
+	 *
+	 * @param description Description
+	 *
+	 * @return Returns true if description starts with the name of a known solid followed by an opening parenthesis
+	 */
+	static bool IsPrimitive(const std::string &description);
+};
+
+
+/**
+ * Axis-aligned box
+ */
+class TBoxPrimitive: public TPrimitive{
+private:
+	CPoint min; ///< Lower corner
+	CPoint max; ///< Upper corner
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param corner1 A corner of the box
+	 * @param corner2 Opposite corner of the box
+	 */
+	TBoxPrimitive(const CPoint &corner1, const CPoint &corner2);
+	bool Inside(const CPoint &p) const override;
+	void Intersect(const CSegment &segment, std::vector<TPrimitiveCrossing> &crossings) const override;
+	double Distance(const CPoint &p) const override;
+	CGAL::Bbox_3 BoundingBox() const override;
+};
+
+
+/**
+ * Sphere
+ */
+class TSpherePrimitive: public TPrimitive{
+private:
+	CPoint center; ///< Center
+	double radius; ///< Radius
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param c Center
+	 * @param r Radius
+	 */
+	TSpherePrimitive(const CPoint &c, const double r);
+	bool Inside(const CPoint &p) const override;
+	void Intersect(const CSegment &segment, std::vector<TPrimitiveCrossing> &crossings) const override;
+	double Distance(const CPoint &p) const override;
+	CGAL::Bbox_3 BoundingBox() const override;
+};
+
+
+/**
+ * Truncated cone, a cylinder if both radii are equal
+ */
+class TConePrimitive: public TPrimitive{
+private:
+	CPoint base; ///< Center of first face
+	CVector axis; ///< Unit vector along axis from first to second face
+	double length; ///< Distance between faces
+	double radius1; ///< Radius of first face
+	double radius2; ///< Radius of second face
+	double slope; ///< Change of radius per length along axis
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param c1 Center of first face
+	 * @param c2 Center of second face
+	 * @param r1 Radius of first face
+	 * @param r2 Radius of second face
+	 */
+	TConePrimitive(const CPoint &c1, const CPoint &c2, const double r1, const double r2);
+	bool Inside(const CPoint &p) const override;
+	void Intersect(const CSegment &segment, std::vector<TPrimitiveCrossing> &crossings) const override;
+	double Distance(const CPoint &p) const override;
+	CGAL::Bbox_3 BoundingBox() const override;
+};
+
+
+/**
+ * Half-space behind a plane
+ */
+class THalfSpacePrimitive: public TPrimitive{
+private:
+	CPoint point; ///< Point on plane
+	CVector normal; ///< Outward unit normal of plane
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param p Point on plane
+	 * @param n Outward normal of plane
+	 */
+	THalfSpacePrimitive(const CPoint &p, const CVector &n);
+	bool Inside(const CPoint &p) const override;
+	void Intersect(const CSegment &segment, std::vector<TPrimitiveCrossing> &crossings) const override;
+	double Distance(const CPoint &p) const override;
+	CGAL::Bbox_3 BoundingBox() const override;
+};
+
+
+/**
+ * Solid of revolution, a closed polygon in the (r, h) half-plane rotated about an axis
+ *
+ * Each edge of the profile sweeps a cone, cylinder, or annulus, which segments are intersected with exactly.
+ */
+class TRevolutionPrimitive: public TPrimitive{
+private:
+	CPoint base; ///< Point on axis, origin of h
+	CVector axis; ///< Unit vector along axis
+	std::vector<std::pair<double, double> > profile; ///< Corners (r, h) of profile polygon, ordered counter-clockwise with r as first coordinate
+	CGAL::Bbox_3 bbox; ///< Bounding box
+
+	/**
+	 * Get distance from axis and position along axis of a point
+	 *
+	 * @param p Point
+	 * @param rho Returns distance from axis
+	 * @param h Returns position along axis
+	 */
+	void ProfileCoordinates(const CPoint &p, double &rho, double &h) const;
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param c Point on axis
+	 * @param a Direction of axis
+	 * @param corners Corners (r, h) of profile polygon, at least three with r >= 0, the last one is connected to the first one
+	 */
+	TRevolutionPrimitive(const CPoint &c, const CVector &a, const std::vector<std::pair<double, double> > &corners);
+	bool Inside(const CPoint &p) const override;
+	void Intersect(const CSegment &segment, std::vector<TPrimitiveCrossing> &crossings) const override;
+	double Distance(const CPoint &p) const override;
+	CGAL::Bbox_3 BoundingBox() const override;
+};
+
+
+/**
+ * Union or difference of several solids
+ *
+ * The surface of the combined solid consists of those parts of its parts' surfaces that do not lie inside another part (union),
+ * or the parts of the first solid's surface outside all others and of the other solids' surfaces inside the first solid (difference).
+ */
+class TCSGPrimitive: public TPrimitive{
+public:
+	enum TOperation { csgunion, csgdifference }; ///< Operation combining the parts
+private:
+	TOperation operation; ///< Operation combining the parts
+	std::vector<std::unique_ptr<TPrimitive> > parts; ///< Parts, the first one is the solid the others are subtracted from in a difference
+	CGAL::Bbox_3 bbox; ///< Bounding box of combined solid
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param op Operation combining the parts
+	 * @param p Parts, at least two
+	 */
+	TCSGPrimitive(const TOperation op, std::vector<std::unique_ptr<TPrimitive> > &&p);
+	bool Inside(const CPoint &p) const override;
+	void Intersect(const CSegment &segment, std::vector<TPrimitiveCrossing> &crossings) const override;
+	double Distance(const CPoint &p) const override;
+	CGAL::Bbox_3 BoundingBox() const override;
+};
+
+#endif // PRIMITIVES_H_
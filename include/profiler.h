@@ -0,0 +1,231 @@
+/**
+ * \file
+ * Optional profiler measuring how much time particle tracking spends in each of its phases.
+ *
+ * Timers are only compiled in if PENTrack is built with the cmake option PROFILE=ON, otherwise the PROFILE macros expand to nothing.
+ * The same timers can record the phases of selected particles as spans on a timeline in Chrome's trace-event JSON format.
+ * With the cmake option PROFILE_COUNTERS=ON they also read hardware performance counters of the CPU with perf_event_open (Linux only).
+ */
+
+#ifndef PROFILER_H_
+#define PROFILER_H_
+
+#include <chrono>
+#include <string>
+
+#include <boost/filesystem.hpp>
+
+/**
+ * Phases of particle tracking that are timed by the profiler
+ */
+enum TProfilePhase{
+	PROFILE_DO_STEP, ///< Integrator step
+	PROFILE_DERIVS, ///< Evaluation of equation of motion, including fields
+	PROFILE_GETCOLLISIONS, ///< Collision test of a trajectory segment with the geometry
+	PROFILE_ITERATE_COLLISION, ///< Iteration of collision point
+	PROFILE_DOHIT, ///< Handling of a collision by the tracker
+	PROFILE_ONHIT, ///< Particle-specific interaction with a surface
+	PROFILE_INTEGRATESPIN, ///< Spin tracking
+	PROFILE_PRINT, ///< Logging of end point
+	PROFILE_PRINTSNAPSHOT, ///< Logging of snapshots
+	PROFILE_PRINTTRACK, ///< Logging of trajectory points
+	PROFILE_PRINTHIT, ///< Logging of surface hits
+	PROFILE_PRINTSPIN, ///< Logging of spin trajectory
+	PROFILE_PHASES ///< Number of phases
+};
+
+/**
+ * Hardware events counted in each tracking phase if PENTrack is built with PROFILE_COUNTERS=ON
+ */
+enum TProfileEvent{
+	PROFILE_CYCLES, ///< CPU cycles
+	PROFILE_INSTRUCTIONS, ///< Retired instructions
+	PROFILE_LLC_MISSES, ///< Loads missing the last-level cache
+	PROFILE_BRANCH_MISSES, ///< Mispredicted branches
+	PROFILE_DTLB_MISSES, ///< Loads missing the data TLB
+	PROFILE_EVENTS ///< Number of events
+};
+
+namespace Profiler{
+	/**
+	 * Select particle type to which following measurements of the calling thread are attributed
+	 *
+	 * If the particle is selected for tracing, following measurements are also recorded as spans until FinishParticle is called.
+	 *
+	 * @param name Particle name
+	 * @param number Particle number (0: unknown, never traced)
+	 */
+	void SetParticle(const std::string &name, const int number);
+
+	/**
+	 * Select region of the particle's tolerance map to which following measurements of the calling thread are attributed, see TToleranceRegion
+	 *
+	 * Measurements in a region are reported as a separate profile named after the particle type and the region.
+	 *
+	 * @param region Name of region (empty: outside of all regions)
+	 */
+	void SetRegion(const std::string &region);
+
+	/**
+	 * Finish tracking of the particle selected with SetParticle in the calling thread, write its spans to the trace file if it was traced
+	 *
+	 * @param start Time at which tracking of the particle started
+	 */
+	void FinishParticle(const std::chrono::steady_clock::time_point start);
+
+	/**
+	 * Add a timed call of a tracking phase to the calling thread's profile
+	 *
+	 * @param phase Tracking phase
+	 * @param start Time at which call started
+	 * @param ns Duration of call in nanoseconds
+	 */
+	void Add(const TProfilePhase phase, const std::chrono::steady_clock::time_point start, const long long ns);
+
+	/**
+	 * Read hardware counters of the calling thread, opening them on first use
+	 *
+	 * Only user-space events are counted. Does nothing if counters were not compiled in or cannot be opened, e.g. if /proc/sys/kernel/perf_event_paranoid is larger than 2.
+	 *
+	 * @param counts Returns current count of each event, zero if not available
+	 */
+	void ReadEvents(unsigned long long counts[PROFILE_EVENTS]);
+
+	/**
+	 * Add hardware events counted during a call of a tracking phase to the calling thread's profile
+	 *
+	 * @param phase Tracking phase
+	 * @param counts Number of each event
+	 */
+	void AddEvents(const TProfilePhase phase, const unsigned long long counts[PROFILE_EVENTS]);
+
+	/**
+	 * Add a timed evaluation of a single field to the calling thread's profile
+	 *
+	 * @param field Index of field in TFieldManager
+	 * @param ns Duration of evaluation in nanoseconds
+	 */
+	void AddField(const unsigned field, const long long ns);
+
+	/**
+	 * Add recursion depth reached by an iteration of a collision point to the calling thread's profile
+	 *
+	 * @param depth Number of bisections
+	 */
+	void AddIterationDepth(const unsigned depth);
+
+	/**
+	 * Print profiles of all threads, summed for each particle type, and write them to a file
+	 *
+	 * Must only be called when no other thread is tracking particles. Does nothing if the profiler was not compiled in.
+	 *
+	 * @param file File name
+	 */
+	void Print(const boost::filesystem::path &file);
+
+	/**
+	 * Start writing spans of all tracking phases except derivs of selected particles to a trace file,
+	 * which can be viewed as a timeline e.g. in Perfetto (ui.perfetto.dev) or chrome://tracing
+	 *
+	 * Must be called before particles are tracked. Only prints a warning if particles are selected but the profiler was not compiled in.
+	 *
+	 * @param file File name
+	 * @param particles List of particle numbers and ranges of particle numbers separated by whitespace, e.g. "1-10 57"
+	 * @param interval Additionally trace every interval-th particle (0: none)
+	 */
+	void StartTrace(const boost::filesystem::path &file, const std::string &particles, const int interval);
+
+	/**
+	 * Complete the trace file started with StartTrace
+	 *
+	 * Must only be called when no other thread is tracking particles.
+	 */
+	void StopTrace();
+}
+
+/**
+ * Selects the particle to which measurements of the calling thread are attributed during its lifetime
+ */
+class TProfileParticle{
+private:
+	std::chrono::steady_clock::time_point start; ///< Time at which particle was selected
+public:
+	/**
+	 * Constructor, selects particle
+	 *
+	 * @param name Particle name
+	 * @param number Particle number (0: unknown, never traced)
+	 */
+	TProfileParticle(const std::string &name, const int number): start(std::chrono::steady_clock::now()){ Profiler::SetParticle(name, number); }
+
+	/**
+	 * Destructor, writes spans of particle if it was traced
+	 */
+	~TProfileParticle(){ Profiler::FinishParticle(start); }
+};
+
+/**
+ * Timer adding its lifetime to a tracking phase or field in the calling thread's profile
+ */
+class TProfileTimer{
+private:
+	std::chrono::steady_clock::time_point start; ///< Time at which timer was constructed
+	int phase; ///< Tracking phase (field index if negative)
+#ifdef USEPERFCOUNTERS
+	unsigned long long counts[PROFILE_EVENTS]; ///< Hardware counters at construction
+#endif
+public:
+	/**
+	 * Constructor, starts timer for a tracking phase
+	 *
+	 * @param aphase Tracking phase
+	 */
+	explicit TProfileTimer(const TProfilePhase aphase): phase(aphase){
+#ifdef USEPERFCOUNTERS
+		Profiler::ReadEvents(counts);
+#endif
+		start = std::chrono::steady_clock::now();
+	}
+
+	/**
+	 * Constructor, starts timer for evaluation of a single field
+	 *
+	 * @param field Index of field in TFieldManager
+	 */
+	explicit TProfileTimer(const unsigned field): start(std::chrono::steady_clock::now()), phase(-1 - static_cast<int>(field)){ }
+
+	/**
+	 * Destructor, adds elapsed time to profile
+	 */
+	~TProfileTimer(){
+		long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+		if (phase < 0)
+			Profiler::AddField(-1 - phase, ns);
+		else{
+#ifdef USEPERFCOUNTERS
+			unsigned long long end[PROFILE_EVENTS];
+			Profiler::ReadEvents(end);
+			for (int i = 0; i < PROFILE_EVENTS; ++i)
+				end[i] -= counts[i];
+			Profiler::AddEvents(static_cast<TProfilePhase>(phase), end);
+#endif
+			Profiler::Add(static_cast<TProfilePhase>(phase), start, ns);
+		}
+	}
+};
+
+#ifdef USEPROFILER
+#define PROFILE(phase) TProfileTimer profiletimer(phase) ///< Time the rest of the enclosing scope as a tracking phase
+#define PROFILE_FIELD(field) TProfileTimer profiletimer(field) ///< Time the rest of the enclosing scope as evaluation of a field
+#define PROFILE_PARTICLE(name, number) TProfileParticle profileparticle(name, number) ///< Attribute measurements in the rest of the enclosing scope to particle type and number
+#define PROFILE_DEPTH(depth) Profiler::AddIterationDepth(depth) ///< Record depth of a collision-point iteration
+#define PROFILE_REGION(region) Profiler::SetRegion(region) ///< Attribute following measurements to a region of the particle's tolerance map
+#else
+#define PROFILE(phase)
+#define PROFILE_FIELD(field)
+#define PROFILE_PARTICLE(name, number)
+#define PROFILE_DEPTH(depth)
+#define PROFILE_REGION(region)
+#endif
+
+#endif // PROFILER_H_
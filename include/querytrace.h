@@ -0,0 +1,134 @@
+/**
+ * \file
+ * Recording of the field evaluations and collision tests issued while tracking selected particles (GLOBAL options querytraceparticles and querytraceinterval),
+ * so they can be replayed against other field and geometry backends with PENTrack_bench.
+ */
+
+#ifndef QUERYTRACE_H_
+#define QUERYTRACE_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+/**
+ * Query recorded in a query trace
+ */
+struct TQuery{
+	/**
+	 * Types of queries
+	 */
+	enum TType: std::uint8_t{
+		PARTICLE = 0, ///< Start of a particle, its number is stored in t1
+		BFIELD = 1, ///< Magnetic field without derivatives at p1, t1
+		BGRADIENT = 2, ///< Magnetic field and its spatial derivatives at p1, t1
+		EFIELD = 3, ///< Electric potential and field at p1, t1
+		SEGMENT = 4 ///< Collision test of segment from p1 at t1 to p2 at t2
+	};
+	TType type; ///< Type of query
+	double t1; ///< Time of field evaluation or start of segment [s]
+	double p1[3]; ///< Position of field evaluation or start of segment [m]
+	double t2; ///< Time at end of segment [s]
+	double p2[3]; ///< End of segment [m]
+};
+
+namespace QueryTrace{
+	extern thread_local bool recording; ///< True if the calling thread records queries of its current particle
+
+	/**
+	 * Start writing queries of selected particles to a binary trace file
+	 *
+	 * Must be called before particles are tracked. Does nothing if no particles are selected.
+	 * The file starts with the 8 characters "PTQUERY1", followed by one record per query: its type as one byte,
+	 * t1 and p1 as four doubles, and for segments t2 and p2 as four more doubles, all in the byte order of the machine.
+	 *
+	 * @param file File name
+	 * @param particles List of particle numbers and ranges of particle numbers, see ReadNumberRanges
+	 * @param interval Additionally record every interval-th particle (0: none)
+	 */
+	void Start(const boost::filesystem::path &file, const std::string &particles, const int interval);
+
+	/**
+	 * Complete the trace file started with Start
+	 *
+	 * Must only be called when no other thread is tracking particles.
+	 */
+	void Stop();
+
+	/**
+	 * Select particle whose queries the calling thread issues next, start recording if it is selected
+	 *
+	 * @param number Particle number
+	 */
+	void SetParticle(const int number);
+
+	/**
+	 * Stop recording queries of the calling thread and write them to the trace file
+	 */
+	void FinishParticle();
+
+	/**
+	 * Add a query to the calling thread's buffer, writing the buffer to the trace file when it is full
+	 *
+	 * @param q Query
+	 */
+	void AddQuery(const TQuery &q);
+
+	/**
+	 * Record a field evaluation if the calling thread is recording
+	 *
+	 * @param type BFIELD, BGRADIENT, or EFIELD
+	 * @param x X coordinate [m]
+	 * @param y Y coordinate [m]
+	 * @param z Z coordinate [m]
+	 * @param t Time [s]
+	 */
+	inline void RecordField(const TQuery::TType type, const double x, const double y, const double z, const double t){
+		if (recording)
+			AddQuery({type, t, {x, y, z}, 0., {0., 0., 0.}});
+	}
+
+	/**
+	 * Record a collision test if the calling thread is recording
+	 *
+	 * @param t1 Time at start of segment [s]
+	 * @param p1 Start of segment [m]
+	 * @param t2 Time at end of segment [s]
+	 * @param p2 End of segment [m]
+	 */
+	inline void RecordSegment(const double t1, const double p1[3], const double t2, const double p2[3]){
+		if (recording)
+			AddQuery({TQuery::SEGMENT, t1, {p1[0], p1[1], p1[2]}, t2, {p2[0], p2[1], p2[2]}});
+	}
+
+	/**
+	 * Read all queries from a trace file
+	 *
+	 * @param file File name
+	 *
+	 * @return Returns queries in the order in which they were written
+	 */
+	std::vector<TQuery> Read(const boost::filesystem::path &file);
+}
+
+/**
+ * Selects the particle whose queries the calling thread records during its lifetime
+ */
+class TQueryTraceParticle{
+public:
+	/**
+	 * Constructor, selects particle
+	 *
+	 * @param number Particle number
+	 */
+	explicit TQueryTraceParticle(const int number){ QueryTrace::SetParticle(number); }
+
+	/**
+	 * Destructor, writes queries of particle if they were recorded
+	 */
+	~TQueryTraceParticle(){ QueryTrace::FinishParticle(); }
+};
+
+#endif // QUERYTRACE_H_
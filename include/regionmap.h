@@ -0,0 +1,148 @@
+/**
+ * \file
+ * Voxel map classifying regions of the simulation volume, so the tracker can choose cheaper propagation modes without evaluating fields or geometry (GLOBAL option regionmap).
+ */
+
+#ifndef REGIONMAP_H_
+#define REGIONMAP_H_
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+class TConfig;
+class TFieldManager;
+class TGeometry;
+
+/**
+ * Coarse voxel grid over the bounding box of the geometry, storing bounds of the magnetic field and of the distance to walls in each voxel
+ *
+ * The distance to walls is a strict lower bound, calculated from the safety distance at the center of each voxel minus half its diagonal.
+ * The magnetic-field bounds are estimates: the gradient in a voxel is assumed to be at most twice the largest gradient at its corners,
+ * and the field magnitude at the corners is extended by this gradient over half the voxel diagonal.
+ * If any magnetic field depends on time, the field bounds are left undetermined (|B| between 0 and infinity).
+ * The map is cached in the fieldcache directory, keyed by the field and geometry configuration and the sizes and modification times of the files it refers to.
+ */
+class TRegionMap{
+public:
+	/**
+	 * Bounds inside one voxel
+	 */
+	struct TVoxel{
+		float Bmin; ///< Lower bound of magnetic-field magnitude [T]
+		float Bmax; ///< Upper bound of magnetic-field magnitude [T]
+		float gradB; ///< Upper bound of magnetic-field gradient (Frobenius norm) [T/m]
+		float walldistance; ///< Lower bound of distance to closest surface [m]
+	};
+
+	/**
+	 * Build map or load it from the cache, if the GLOBAL option regionmap is set
+	 *
+	 * @param config Configuration, uses GLOBAL options regionmap, fieldcache, and nthreads
+	 * @param geom Geometry
+	 * @param field Fields
+	 *
+	 * @return Returns map, or nullptr if regionmap is not set
+	 */
+	static std::unique_ptr<TRegionMap> Create(TConfig &config, const TGeometry &geom, const TFieldManager &field);
+
+	/**
+	 * Find voxel containing a point
+	 *
+	 * @param p Point
+	 *
+	 * @return Returns voxel, or nullptr if the point lies outside of the map
+	 */
+	const TVoxel* Find(const double p[3]) const{
+		std::size_t index = 0;
+		for (int i = 0; i < 3; ++i){
+			double u = (p[i] - min[i])/voxelsize;
+			if (not (u >= 0 && u < n[i])) // also catches NaN
+				return nullptr;
+			index = index*n[i] + static_cast<std::size_t>(u);
+		}
+		return &voxels[index];
+	}
+
+	/**
+	 * Lower bound of distance from a point to the closest surface
+	 *
+	 * @param p Point
+	 *
+	 * @return Returns distance [m], 0 outside of the map
+	 */
+	double WallDistance(const double p[3]) const{
+		const TVoxel *v = Find(p);
+		return v ? v->walldistance : 0.;
+	}
+
+	/**
+	 * Estimate lower bound of spin adiabaticity parameter (Larmor frequency divided by rotation rate of the field seen by the particle) at a point
+	 *
+	 * @param p Point
+	 * @param gamma Absolute gyromagnetic ratio of particle [1/Ts]
+	 * @param v Speed of particle [m/s]
+	 *
+	 * @return Returns gamma*Bmin^2/(v*gradB), 0 outside of the map
+	 */
+	double Adiabaticity(const double p[3], const double gamma, const double v) const{
+		const TVoxel *voxel = Find(p);
+		if (voxel == nullptr || voxel->Bmin <= 0)
+			return 0.;
+		return gamma*double(voxel->Bmin)*voxel->Bmin/(v*voxel->gradB);
+	}
+
+	/**
+	 * Get memory used by voxels
+	 *
+	 * @return Returns size [bytes]
+	 */
+	std::size_t MemoryUsage() const{ return voxels.capacity()*sizeof(TVoxel); }
+
+private:
+	/**
+	 * Constructor, voxels are filled by Create
+	 *
+	 * @param amin Lower corner of map
+	 * @param asize Edge length of voxels
+	 * @param an Number of voxels along each axis
+	 */
+	TRegionMap(const std::array<double, 3> &amin, const double asize, const std::array<std::size_t, 3> &an);
+
+	/**
+	 * Sample fields at voxel corners and distances at voxel centers
+	 *
+	 * @param geom Geometry
+	 * @param field Fields
+	 * @param nthreads Number of threads
+	 */
+	void Build(const TGeometry &geom, const TFieldManager &field, const unsigned nthreads);
+
+	/**
+	 * Read map from cache file
+	 *
+	 * @param file Cache file
+	 * @param key Key identifying the configuration
+	 *
+	 * @return Returns false if the file does not exist or belongs to another configuration
+	 */
+	bool Read(const boost::filesystem::path &file, const std::uint64_t key);
+
+	/**
+	 * Write map to cache file, writing to a temporary file first and renaming it
+	 *
+	 * @param file Cache file
+	 * @param key Key identifying the configuration
+	 */
+	void Write(const boost::filesystem::path &file, const std::uint64_t key) const;
+
+	std::array<double, 3> min; ///< Lower corner of map
+	double voxelsize; ///< Edge length of voxels
+	std::array<std::size_t, 3> n; ///< Number of voxels along each axis
+	std::vector<TVoxel> voxels; ///< Voxels in x-major order
+};
+
+#endif // REGIONMAP_H_
@@ -0,0 +1,51 @@
+/**
+ * \file
+ * Recorded trajectories, along which the spin of particles is tracked again in different fields without tracking the particles again.
+ */
+
+#ifndef REPLAY_H_
+#define REPLAY_H_
+
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "stepper.h"
+
+/**
+ * Point on a recorded trajectory, written by TLogger::PrintTrajectory
+ *
+ * Knots are the ends of the trajectory-integration steps. Between two continuous knots, the position is interpolated with a cubic Hermite polynomial,
+ * matching the velocities at both knots, which is exact for parabolas in gravity.
+ */
+struct TTrajectoryKnot{
+	double t; ///< Time [s]
+	state_type y; ///< Particle state (position, velocity, proper time, polarisation, and trajectory length)
+	double continued; ///< 1 if the particle moved continuously from the previous knot to this one, 0 if it jumped to this knot, e.g. when it was reflected on a wall or moved across a guide section
+};
+
+const char TRAJECTORY_HEADER[] = "PENTrack trajectory 2\n"; ///< First line of trajectory files, changed when their format changes
+
+/**
+ * Trajectory of one particle read from a trajectory file
+ *
+ * In the file, each trajectory consists of a text line with the particle type and its final state written by TParticle::WriteState,
+ * followed by the number of knots as a double and the knots in native byte order.
+ */
+struct TRecordedTrajectory{
+	std::string name; ///< Particle type
+	std::string state; ///< Final state of particle written by TParticle::WriteState
+	std::vector<TTrajectoryKnot> knots; ///< Knots in order of time
+};
+
+/**
+ * Read all trajectories from trajectory files written by TLogger::PrintTrajectory
+ *
+ * @param files Trajectory files
+ *
+ * @return Returns list of trajectories in order of the files
+ */
+std::vector<TRecordedTrajectory> ReadTrajectories(const std::vector<boost::filesystem::path> &files);
+
+#endif // REPLAY_H_
@@ -0,0 +1,74 @@
+/**
+ * \file
+ * Parameter scans defined in the SCAN section of the configuration.
+ */
+
+#ifndef SCAN_H_
+#define SCAN_H_
+
+#include <string>
+#include <vector>
+#include <iosfwd>
+
+#include "config.h"
+
+/**
+ * Grid of parameter sets defined in the SCAN section of the configuration.
+ *
+ * Each entry of the section has the form
+ *
+ * SECTION.variable value1 | value2 | ...
+ *
+ * and replaces the variable in the given section of the configuration by each of the values in turn.
+ * The grid contains all combinations of the values of all entries, the last entry varying fastest.
+ * Entries in the PARTICLES section are applied to all particle types.
+ * Since geometry and global options are only read once, entries in the GLOBAL and GEOMETRY sections are not allowed.
+ */
+class TParameterScan{
+private:
+	std::vector<std::string> sections; ///< Section of each scanned variable
+	std::vector<std::string> variables; ///< Name of each scanned variable
+	std::vector<std::vector<std::string> > values; ///< List of values of each scanned variable
+
+	/**
+	 * Return values of all scanned variables at a point in the grid
+	 *
+	 * @param point Index of point
+	 *
+	 * @return Returns value of each scanned variable
+	 */
+	std::vector<std::string> Values(const unsigned long point) const;
+public:
+	/**
+	 * Constructor, reads SCAN section of configuration
+	 *
+	 * @param config Configuration, may not contain a SCAN section
+	 */
+	explicit TParameterScan(TConfig &config);
+
+	/**
+	 * Return number of points in grid
+	 *
+	 * @return Returns number of points (0: no SCAN section)
+	 */
+	unsigned long size() const;
+
+	/**
+	 * Create configuration of a point in the grid
+	 *
+	 * @param config Configuration
+	 * @param point Index of point
+	 *
+	 * @return Returns copy of config with scanned variables replaced by their values at the point
+	 */
+	TConfig Point(TConfig config, const unsigned long point) const;
+
+	/**
+	 * Write table of scanned variables and their values at each point
+	 *
+	 * @param str Stream to write to
+	 */
+	void Print(std::ostream &str) const;
+};
+
+#endif // SCAN_H_
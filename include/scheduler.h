@@ -0,0 +1,245 @@
+/**
+ * \file
+ * Work-stealing scheduler distributing tasks that create further tasks over several threads.
+ */
+
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <deque>
+#include <algorithm>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+
+/**
+ * Work-stealing scheduler for tasks of very different duration, e.g. tracking of primary and secondary particles.
+ *
+ * Each worker thread owns a double-ended queue. Tasks created while processing another task (secondary particles) are pushed to the back of the queue
+ * of the worker processing it and taken from the back again by that worker, so long chains are processed depth-first.
+ * If its queue is empty, a worker takes a new task from a shared source (primary particles) and, once the source is exhausted,
+ * steals tasks from the front of the other workers' queues.
+ *
+ * @tparam Task Type of task, has to be default-constructible and movable
+ */
+template<class Task> class TTaskScheduler{
+private:
+	/**
+	 * Queue of tasks owned by each worker
+	 */
+	struct TWorkerQueue{
+		std::mutex mutex; ///< Protects tasks, locked by owner and thieves
+		std::deque<Task> tasks; ///< Tasks waiting to be processed
+	};
+	std::vector<std::unique_ptr<TWorkerQueue> > queues; ///< Queue of each worker
+	std::atomic<long> pending; ///< Number of tasks that are queued or being processed
+	std::mutex sourcemutex; ///< Serializes calls of the shared source
+	std::atomic<bool> sourceempty; ///< Set when the shared source has no more tasks
+	std::atomic<bool> stopped; ///< Set by Stop, workers stop taking tasks and leave queued tasks where they are
+	std::atomic<bool> paused; ///< Set by Suspend, workers wait in Next until Resume is called
+	std::mutex pausemutex; ///< Protects idle, used with pausecondition
+	std::condition_variable pausecondition; ///< Notified when a worker becomes idle or when workers are resumed
+	unsigned idle; ///< Number of workers waiting in Next while paused or having finished
+
+	/**
+	 * Take task from back of worker's own queue
+	 *
+	 * @param worker Index of worker
+	 * @param task Returns task
+	 *
+	 * @return Returns false if queue is empty
+	 */
+	bool PopLocal(const unsigned worker, Task &task){
+		TWorkerQueue &q = *queues[worker];
+		std::lock_guard<std::mutex> lock(q.mutex);
+		if (q.tasks.empty())
+			return false;
+		task = std::move(q.tasks.back());
+		q.tasks.pop_back();
+		return true;
+	}
+
+	/**
+	 * Take task from front of other workers' queues, starting with the workers with the closest indices
+	 *
+	 * Pinned threads with close indices run on the same socket, so stolen tasks preferably stay on the NUMA node whose caches hold their data.
+	 *
+	 * @param worker Index of stealing worker
+	 * @param task Returns task
+	 *
+	 * @return Returns false if all other queues are empty
+	 */
+	bool Steal(const unsigned worker, Task &task){
+		const unsigned n = queues.size();
+		for (unsigned i = 1; i < n; ++i){
+			unsigned distance = (i + 1)/2; // worker + 1, worker - 1, worker + 2, worker - 2, ...
+			TWorkerQueue &q = *queues[i % 2 == 1 ? (worker + distance) % n : (worker + n - distance) % n];
+			std::lock_guard<std::mutex> lock(q.mutex);
+			if (not q.tasks.empty()){
+				task = std::move(q.tasks.front());
+				q.tasks.pop_front();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/**
+	 * Count worker leaving Next for good, so Suspend does not wait for it
+	 */
+	void Finished(){
+		std::lock_guard<std::mutex> lock(pausemutex);
+		++idle;
+		pausecondition.notify_all();
+	}
+
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param nworkers Number of worker threads
+	 */
+	TTaskScheduler(const unsigned nworkers): pending(0), sourceempty(false), stopped(false), paused(false), idle(0){
+		for (unsigned i = 0; i < std::max(nworkers, 1u); ++i)
+			queues.emplace_back(new TWorkerQueue);
+	}
+
+	/**
+	 * Add task created by a worker to its queue
+	 *
+	 * @param worker Index of worker
+	 * @param task Task
+	 */
+	void Push(const unsigned worker, Task task){
+		++pending;
+		TWorkerQueue &q = *queues[worker];
+		std::lock_guard<std::mutex> lock(q.mutex);
+		q.tasks.push_back(std::move(task));
+	}
+
+	/**
+	 * Get next task for a worker
+	 *
+	 * Takes a task from the worker's own queue, from the source, or from another worker's queue, in this order.
+	 * If no task is available but other workers are still processing tasks that could create new ones, waits for them.
+	 * Every task returned has to be marked as finished with Done after it was processed and all tasks created by it were pushed.
+	 *
+	 * @param worker Index of worker
+	 * @param task Returns task
+	 * @param source Function taking a Task reference, returns false if it cannot create more tasks. Is called by one worker at a time.
+	 *
+	 * @return Returns false if all tasks have been processed or Stop was called
+	 */
+	template<class Source> bool Next(const unsigned worker, Task &task, Source &&source){
+		while (true){
+			if (paused.load()){
+				std::unique_lock<std::mutex> lock(pausemutex);
+				++idle;
+				pausecondition.notify_all();
+				pausecondition.wait(lock, [this]{ return not paused.load(); });
+				--idle;
+			}
+			if (stopped.load()){
+				Finished();
+				return false;
+			}
+			if (PopLocal(worker, task))
+				return true;
+			if (not sourceempty.load()){
+				std::lock_guard<std::mutex> lock(sourcemutex);
+				if (not sourceempty.load()){
+					if (source(task)){
+						++pending;
+						return true;
+					}
+					sourceempty = true;
+				}
+			}
+			if (Steal(worker, task))
+				return true;
+			if (pending.load() == 0){
+				Finished();
+				return false;
+			}
+			std::this_thread::yield();
+		}
+	}
+
+	/**
+	 * Take a further task directly from the shared source, e.g. to process several tasks together with the one returned by Next
+	 *
+	 * Does not wait and does not take tasks from any queue. The task is not counted as pending, it has to be added to a queue with Push.
+	 *
+	 * @param task Returns task
+	 * @param source Function taking a Task reference, returns false if it cannot create more tasks. Is called by one worker at a time.
+	 *
+	 * @return Returns false if the source is exhausted or Stop was called
+	 */
+	template<class Source> bool TakeFromSource(Task &task, Source &&source){
+		if (stopped.load() || sourceempty.load())
+			return false;
+		std::lock_guard<std::mutex> lock(sourcemutex);
+		if (sourceempty.load())
+			return false;
+		if (source(task))
+			return true;
+		sourceempty = true;
+		return false;
+	}
+
+	/**
+	 * Mark task returned by Next as finished
+	 */
+	void Done(){
+		--pending;
+	}
+
+	/**
+	 * Make all workers return from Next without taking further tasks, e.g. after a signal was caught
+	 *
+	 * Tasks that are still queued can be inspected with ForEach after all workers have finished.
+	 */
+	void Stop(){
+		stopped = true;
+	}
+
+	/**
+	 * Wait until all workers are waiting in Next or have finished, so queued tasks can be inspected with ForEach
+	 *
+	 * Workers must not be blocked by anything else than the scheduler, otherwise this never returns.
+	 */
+	void Suspend(){
+		std::unique_lock<std::mutex> lock(pausemutex);
+		paused = true;
+		pausecondition.wait(lock, [this]{ return idle == queues.size(); });
+	}
+
+	/**
+	 * Let workers suspended by Suspend continue
+	 */
+	void Resume(){
+		std::lock_guard<std::mutex> lock(pausemutex);
+		paused = false;
+		pausecondition.notify_all();
+	}
+
+	/**
+	 * Call function for every queued task, in the order in which each worker would process them
+	 *
+	 * Must only be called while workers are suspended or after all workers have finished.
+	 *
+	 * @param f Function taking a const Task reference
+	 */
+	template<class Function> void ForEach(Function &&f){
+		for (auto &q: queues){
+			std::lock_guard<std::mutex> lock(q->mutex);
+			for (auto t = q->tasks.rbegin(); t != q->tasks.rend(); ++t)
+				f(static_cast<const Task&>(*t));
+		}
+	}
+};
+
+#endif // SCHEDULER_H_
@@ -10,10 +10,39 @@
 #include <string>
 #include <limits>
 #include <random>
+#include <cstdint>
+#include <memory>
+#include <array>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
 
 #include "particle.h"
 #include "mc.h"
 
+/**
+ * Particle state stored in phase-space files, written by TLogger::PrintPhaseSpace and read by TPhaseSpaceSource
+ *
+ * Files start with PHASESPACE_HEADER, followed by records in native byte order.
+ */
+struct TPhaseSpaceRecord{
+	double t; ///< Time [s]
+	double x; ///< x coordinate [m]
+	double y; ///< y coordinate [m]
+	double z; ///< z coordinate [m]
+	double vx; ///< x component of velocity [m/s]
+	double vy; ///< y component of velocity [m/s]
+	double vz; ///< z component of velocity [m/s]
+	double polarisation; ///< Polarisation (-1 or 1)
+	double Sx; ///< x component of spin vector
+	double Sy; ///< y component of spin vector
+	double Sz; ///< z component of spin vector
+	double statweight; ///< Statistical weight
+};
+
+const char PHASESPACE_HEADER[] = "PENTrack phase space 1\n"; ///< First line of phase-space files, changed when the format of TPhaseSpaceRecord changes
+
 /**
  * Virtual base class for all particle sources
  */
@@ -26,6 +55,37 @@ protected:
 	std::piecewise_linear_distribution<double> phi_v; ///< Parsed initial azimuthal angle distribution of velocity given by user
 	std::piecewise_linear_distribution<double> theta_v; ///< Parsed initial polar angle distribution of velocity given by user
 	double polarization; ///< Initial polarization of created particles
+	unsigned fQuasiRandomDimensions; ///< Number of random numbers drawn for the initial state of each particle that are taken from a quasi-random sequence (source option quasirandom, 0: pseudo-random numbers only)
+	std::unique_ptr<TScrambledHalton> quasirandom; ///< Quasi-random sequence, created with the first particle
+	std::unique_ptr<TParticle> probe; ///< Particle used to evaluate potential energies without creating particles, see GetPotentialEnergy
+
+	/**
+	 * Create probe particle used by GetPotentialEnergy, if it does not exist yet
+	 *
+	 * @param mc Random-number generator
+	 * @param geometry Geometry of the simulation
+	 * @param field TFieldManager containing all electromagnetic fields
+	 *
+	 * @return Returns probe particle
+	 */
+	const TParticle& GetProbe(TMCGenerator &mc, const TGeometry &geometry, const TFieldManager &field);
+
+	/**
+	 * Calculate potential energy of a particle at rest, without creating a particle. GetProbe has to be called first.
+	 *
+	 * @param t Time
+	 * @param x x coordinate
+	 * @param y y coordinate
+	 * @param z z coordinate
+	 * @param polarisation Polarisation of particle (-1 or 1)
+	 * @param geometry Geometry of the simulation
+	 * @param field TFieldManager containing all electromagnetic fields
+	 * @param sld Returns solid at the point, can be handed to CreateParticle
+	 *
+	 * @return Returns potential energy [eV]
+	 */
+	double GetPotentialEnergy(const double t, const double x, const double y, const double z, const double polarisation,
+			const TGeometry &geometry, const TFieldManager &field, const solid *&sld) const;
 public:
 	int ParticleCounter; ///< Count number of particles created by source
 	/**
@@ -63,11 +123,12 @@ public:
 	 * @param mc Random-number generator
 	 * @param geometry Geometry of the simulation
 	 * @param field TFieldManager containing all electromagnetic fields
+	 * @param startsolid Solid at creation point, if it is already known (nullptr: find it in geometry)
 	 *
 	 * @return Returns newly created particle, memory has to be freed by user
 	 */
 	TParticle* CreateParticle(double t, double x, double y, double z, double E, double phi, double theta, double polarisation,
-			TMCGenerator &mc, const TGeometry &geometry, const TFieldManager &field);
+			TMCGenerator &mc, const TGeometry &geometry, const TFieldManager &field, const solid *startsolid = nullptr);
 
 
 	/**
@@ -76,6 +137,43 @@ public:
 	 * @return Returns newly created particle, memory has to be freed by user
 	 */
 	virtual TParticle* CreateParticle(TMCGenerator &mc, TGeometry &geometry, const TFieldManager &field) = 0;
+
+	/**
+	 * Create a block of particles with consecutive numbers
+	 *
+	 * Each particle draws from its own random-number generator, in the same order as CreateParticle, so the particles are the same as those created one by one.
+	 * The default implementation calls CreateParticle for each particle, derived classes can generate initial states of the whole block at once.
+	 *
+	 * @param firstnumber Number of first particle
+	 * @param mc Random-number generators, one for each particle, set to the substream of its particle
+	 * @param geometry Geometry of the simulation
+	 * @param field TFieldManager containing all electromagnetic fields
+	 * @param particles Returns one newly created particle for each entry of mc
+	 */
+	virtual void CreateParticles(const long long firstnumber, std::vector<TMCGenerator> &mc, TGeometry &geometry, const TFieldManager &field,
+			std::vector<std::unique_ptr<TParticle> > &particles);
+
+	/**
+	 * Let a random-number generator return the coordinates of a point of a scrambled Halton sequence as its next numbers, if the source option quasirandom is set
+	 *
+	 * The source draws the initial state of the particle from them, so the initial states of all particles have low discrepancy and integrated results converge faster.
+	 * TMCGenerator::StopQuasiRandom has to be called after the particle was created, so it draws pseudo-random numbers during tracking.
+	 *
+	 * @param mc Random-number generator, set to the substream of the particle
+	 * @param number Particle number, selects the point of the sequence
+	 */
+	void StartQuasiRandom(TMCGenerator &mc, const long long number);
+
+	/**
+	 * Do initialization that needs random numbers before the first particle is created, otherwise CreateParticle does it when it is first called.
+	 *
+	 * Calling it with a separate substream keeps the random numbers drawn for each particle independent of whether it is the first one created.
+	 *
+	 * @param mc Random-number generator
+	 * @param geometry Geometry of the simulation
+	 * @param field TFieldManager containing all electromagnetic fields
+	 */
+	virtual void Prepare(TMCGenerator &mc, TGeometry &geometry, const TFieldManager &field){ }
 };
 
 
@@ -85,6 +183,16 @@ public:
  * It keeps a list of STL triangles on which initial coordinates are generated
  */
 class TSurfaceSource: public TParticleSource{
+private:
+	/**
+	 * Triangle of the geometry intersecting the source volume
+	 */
+	struct TSourceTriangle{
+		TMeshTriangle triangle; ///< Vertices, normal, area, and ID of triangle
+		bool inside; ///< True if the whole triangle is inside the source volume, points on it do not need to be checked with InSourceVolume
+	};
+	std::vector<TSourceTriangle> triangles; ///< Triangles intersecting the source volume, collected when the first particle is created
+	std::alias_distribution<std::size_t> triangle_sampler; ///< Probability distribution to randomly sample triangles weighted by their areas
 protected:
 	double Enormal; ///< Boost given to particles starting from this surface
 
@@ -103,6 +211,19 @@ protected:
 	 * Abstract function, has to be implemented by every derived class.
 	 */
 	virtual bool InSourceVolume(const double x, const double y, const double z) const = 0;
+
+	/**
+	 * Check if a whole triangle is inside the source volume.
+	 *
+	 * Can be implemented by derived classes, if the source volume is convex and this can be decided from the triangle's vertices.
+	 *
+	 * @param vertices Vertices of triangle
+	 *
+	 * @return Returns true if the triangle is inside the source volume, false if it is not or this is not known
+	 */
+	virtual bool TriangleInSourceVolume(const CTriangleVertices &vertices) const{
+		return false;
+	}
 public:
 	/**
 	 * Constructor.
@@ -132,14 +253,82 @@ public:
  */
 class TVolumeSource: public TParticleSource{
 private:
+	boost::filesystem::path MinPotCacheFile; ///< File in which the minimal potential energy is cached (empty: no cache)
+	std::uint64_t MinPotCacheKey; ///< Key identifying the source, field, and geometry configuration in MinPotCacheFile
+	unsigned fNThreads; ///< Number of threads used to search for the minimal potential energy
+
 	/**
-	 * find potential minimum in source volume
+	 * Find potential minimum in source volume
+	 *
+	 * Samples the potential energy at random points in the source volume, distributed over fNThreads threads,
+	 * and refines the lowest samples with a local pattern search. The result is read from and written to MinPotCacheFile, if it is set.
 	 */
 	void FindPotentialMinimum(TMCGenerator &mc, const TGeometry &geometry, const TFieldManager &field);
+
+	/**
+	 * Sample potential energy at random points and refine lowest samples with local pattern search, see FindPotentialMinimum
+	 *
+	 * @param mc Random-number generator
+	 * @param geometry Geometry of the simulation
+	 * @param field TFieldManager containing all electromagnetic fields
+	 *
+	 * @return Returns minimal potential energy found in source volume
+	 */
+	double SamplePotentialMinimum(TMCGenerator &mc, const TGeometry &geometry, const TFieldManager &field) const;
+
+	/**
+	 * Potential energy of a particle at rest, minimized over the polarisations the source can create particles with
+	 *
+	 * @param t Time
+	 * @param x x coordinate
+	 * @param y y coordinate
+	 * @param z z coordinate
+	 * @param geometry Geometry of the simulation
+	 * @param field TFieldManager containing all electromagnetic fields
+	 *
+	 * @return Returns minimal potential energy [eV]
+	 */
+	double MinimalPotentialEnergy(const double t, const double x, const double y, const double z, const TGeometry &geometry, const TFieldManager &field) const;
+
+	std::array<double, 3> PotGridOrigin; ///< Lower corner of grid of potential-energy bounds spanning the source volume
+	std::array<double, 3> PotGridSpacing; ///< Size of cells in potential-energy grid
+	std::array<int, 3> PotGridSize; ///< Number of cells in potential-energy grid along each axis
+	std::vector<double> PotGridBound; ///< Lower bound of potential energy in each cell of the grid (empty: grid not built yet)
+
+	/**
+	 * Build grid of lower bounds of the potential energy over the source volume
+	 *
+	 * Samples the potential energy at random points in the source volume, distributed over fNThreads threads.
+	 * The bound of each cell is its lowest sample minus the largest difference to the lowest samples in the neighbouring cells, but not lower than MinPot.
+	 * Cells without samples in them or their neighbourhood are bounded by MinPot.
+	 *
+	 * @param mc Random-number generator
+	 * @param geometry Geometry of the simulation
+	 * @param field TFieldManager containing all electromagnetic fields
+	 */
+	void BuildPotentialGrid(TMCGenerator &mc, const TGeometry &geometry, const TFieldManager &field);
+
+	/**
+	 * Find index of cell in potential-energy grid containing a point
+	 *
+	 * @param x x coordinate
+	 * @param y y coordinate
+	 * @param z z coordinate
+	 *
+	 * @return Returns index in PotGridBound, or PotGridBound.size() if point lies outside of the grid
+	 */
+	std::size_t PotentialGridCell(const double x, const double y, const double z) const;
 protected:
 	double MinPot; ///< minimal potential energy in source volume
 	bool fPhaseSpaceWeighting; ///< Tells source to weight particle density according to available phase space.
 
+	/**
+	 * Check if point is inside the source volume.
+	 *
+	 * Abstract function, has to be implemented by every derived class.
+	 */
+	virtual bool InSourceVolume(const double x, const double y, const double z) const = 0;
+
 	/**
 	 * Produce random point in the source volume
 	 *
@@ -160,10 +349,23 @@ public:
 	 * @param sourceconf Map of source options
 	 */
 	TVolumeSource(std::map<std::string, std::string> &sourceconf):
-			TParticleSource(sourceconf), MinPot(std::numeric_limits<double>::infinity()), fPhaseSpaceWeighting(false){
+			TParticleSource(sourceconf), MinPotCacheKey(0), fNThreads(1), MinPot(std::numeric_limits<double>::infinity()), fPhaseSpaceWeighting(false){
 		std::istringstream(sourceconf["PhaseSpaceWeighting"]) >> fPhaseSpaceWeighting;
 	}
 
+	/**
+	 * Set up search for minimal potential energy in source volume
+	 *
+	 * @param cachefile File in which the minimal potential energy is cached (empty: no cache)
+	 * @param key Key identifying the source, field, and geometry configuration
+	 * @param nthreads Number of threads used to sample the potential energy
+	 */
+	void SetPotentialMinimumSearch(const boost::filesystem::path &cachefile, const std::uint64_t key, const unsigned nthreads){
+		MinPotCacheFile = cachefile;
+		MinPotCacheKey = key;
+		fNThreads = std::max(nthreads, 1u);
+	}
+
 	/**
 	 * Create particle in source volume
 	 *
@@ -171,6 +373,20 @@ public:
 	 *
 	 */
 	TParticle* CreateParticle(TMCGenerator &mc, TGeometry &geometry, const TFieldManager &field) final;
+
+	/**
+	 * Create a block of particles in source volume
+	 *
+	 * Without phase-space weighting, start times and points of the whole block are drawn first and then classified by the geometry,
+	 * so the particle constructors do not have to find their start solids. With phase-space weighting, particles are created one by one.
+	 */
+	void CreateParticles(const long long firstnumber, std::vector<TMCGenerator> &mc, TGeometry &geometry, const TFieldManager &field,
+			std::vector<std::unique_ptr<TParticle> > &particles) final;
+
+	/**
+	 * Find minimal potential energy and build grid of its lower bounds, if particle density is weighted by available phase space
+	 */
+	void Prepare(TMCGenerator &mc, TGeometry &geometry, const TFieldManager &field) final;
 };
 
 /**
@@ -193,6 +409,13 @@ private:
 		y = ymin + unidist(mc)*(ymax - ymin);
 		z = zmin + unidist(mc)*(zmax - zmin);
 	}
+
+	/**
+	 * Check if a point is inside the cuboid coordinate range
+	 */
+	bool InSourceVolume(const double x, const double y, const double z) const final{
+		return x >= xmin && x <= xmax && y >= ymin && y <= ymax && z >= zmin && z <= zmax;
+	}
 public:
 	/**
 	 * Constructor.
@@ -229,6 +452,17 @@ private:
 		y = r*sin(phi_r);
 		z = zmin + unidist(mc)*(zmax - zmin);
 	}
+
+	/**
+	 * Check if a point is inside the cylindrical coordinate range
+	 */
+	bool InSourceVolume(const double x, const double y, const double z) const final{
+		double r = sqrt(x*x + y*y);
+		double phi = atan2(y, x);
+		while (phi < phimin)
+			phi += 2*pi;
+		return r >= rmin && r <= rmax && phi <= phimax && z >= zmin && z <= zmax;
+	}
 public:
 	/**
 	 * Constructor.
@@ -272,7 +506,18 @@ private:
 	bool InSourceVolume(const double x, const double y, const double z) const final{
 		double r = sqrt(x*x + y*y);
 		double phi = atan2(y, x);
-		return r > rmin && r < rmax && phi > phimin && phi < phimax && z > zmin && z < zmax;
+		while (phi < phimin)
+			phi += 2*pi;
+		return r > rmin && r < rmax && phi < phimax && z > zmin && z < zmax;
+	}
+
+	/**
+	 * Check if a triangle is inside the cylindrical coordinate range, which is convex if it is a full cylinder or a sector up to 180 degrees without inner radius
+	 */
+	bool TriangleInSourceVolume(const CTriangleVertices &vertices) const final{
+		if (rmin > 0 || (phimax - phimin > pi && phimax - phimin < 2*pi))
+			return false;
+		return std::all_of(vertices.begin(), vertices.end(), [this](const CPoint &v){ return InSourceVolume(v.x(), v.y(), v.z()); });
 	}
 
 public:
@@ -284,7 +529,11 @@ public:
 	 * @param sourceconf Map of source options
 	 */
 	explicit TCylindricalSurfaceSource(std::map<std::string, std::string> &sourceconf):
-			TSurfaceSource(sourceconf), rmin(0), rmax(0), phimin(0), phimax(0), zmin(0), zmax(0){}
+			TSurfaceSource(sourceconf), rmin(0), rmax(0), phimin(0), phimax(0), zmin(0), zmax(0){
+		std::istringstream(sourceconf["parameters"]) >> rmin >> rmax >> phimin >> phimax >> zmin >> zmax;
+		phimin *= conv;
+		phimax *= conv;
+	}
 };
 
 /**
@@ -309,6 +558,13 @@ private:
 		y = p[1];
 		z = p[2];
 	}
+
+	/**
+	 * Check if point is contained in source volume bounded by triangle mesh
+	 */
+	bool InSourceVolume(const double x, const double y, const double z) const final{
+		return sourcevol.InSolid(x, y, z);
+	}
 public:
 	/**
 	 * Constructor.
@@ -320,6 +576,7 @@ public:
 		boost::filesystem::path STLfile;
 		std::istringstream(sourceconf["STLfile"]) >> STLfile;
 		sourcevol.ReadFile(boost::filesystem::absolute(STLfile, configpath.parent_path()).native(), 0);
+		sourcevol.BuildVolumeCells();
 	}
 };
 
@@ -381,9 +638,131 @@ public:
 };
 
 
+/**
+ * Particle source replaying particle states written to phase-space files by an earlier simulation (see PHASESPACE section)
+ *
+ * This allows to simulate upstream stages once, e.g. production and guide transport, and reuse the particles in many downstream simulations.
+ * The files are memory-mapped. Each particle is created from the record with its particle number, starting over when all records were used,
+ * or from a randomly drawn record if resample is set. Position, velocity, polarisation, spin, and statistical weight are taken from the record.
+ */
+class TPhaseSpaceSource: public TParticleSource{
+private:
+	std::vector<boost::iostreams::mapped_file_source> files; ///< Memory-mapped phase-space files
+	std::vector<std::size_t> firstrecords; ///< Index of first record in each file, counting records of all files
+	std::size_t nrecords; ///< Total number of records in all files
+	bool resample; ///< Draw records randomly instead of using them in order
+public:
+	/**
+	 * Constructor, maps the files given in the phasespacefiles option
+	 *
+	 * @param sourceconf Map of source options
+	 */
+	explicit TPhaseSpaceSource(std::map<std::string, std::string> &sourceconf);
+
+	/**
+	 * Create particle from a record of the phase-space files
+	 *
+	 * @param mc Random-number generator
+	 * @param geometry Geometry of the simulation
+	 * @param field TFieldManager containing all electromagnetic fields
+	 *
+	 * @return Returns newly created particle, memory has to be freed by user
+	 */
+	TParticle* CreateParticle(TMCGenerator &mc, TGeometry &geometry, const TFieldManager &field) override;
+
+	/**
+	 * Create probe particle, whose mass is needed to convert velocities into kinetic energies
+	 *
+	 * @param mc Random-number generator
+	 * @param geometry Geometry of the simulation
+	 * @param field TFieldManager containing all electromagnetic fields
+	 */
+	void Prepare(TMCGenerator &mc, TGeometry &geometry, const TFieldManager &field) override{
+		GetProbe(mc, geometry, field);
+	}
+};
+
+
+/**
+ * Particle source combining several sources, e.g. to simulate neutrons, a mercury co-magnetometer, and background electrons in a single run
+ *
+ * Each source creates a contiguous range of particle numbers. Numbers beyond the last range start over with the first source,
+ * so the source of each particle depends only on its number.
+ */
+class TMultiSource: public TParticleSource{
+private:
+	std::vector<std::unique_ptr<TParticleSource> > sources; ///< Combined sources
+	std::vector<long long> lastnumbers; ///< Number of last particle created by each source
+
+	/**
+	 * Find source creating a particle
+	 *
+	 * @param number Particle number
+	 *
+	 * @return Returns index of source
+	 */
+	std::size_t SourceIndex(const long long number) const;
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param sourceconf Map of source options, only particle is used to name the combination of particle types
+	 * @param asources Sources to combine
+	 * @param counts Number of particles created by each source
+	 */
+	TMultiSource(std::map<std::string, std::string> &sourceconf, std::vector<std::unique_ptr<TParticleSource> > &asources, const std::vector<long long> &counts);
+
+	/**
+	 * Let the source responsible for the next particle number create it
+	 *
+	 * @param mc Random-number generator
+	 * @param geometry Geometry of the simulation
+	 * @param field TFieldManager containing all electromagnetic fields
+	 *
+	 * @return Returns newly created particle, memory has to be freed by user
+	 */
+	TParticle* CreateParticle(TMCGenerator &mc, TGeometry &geometry, const TFieldManager &field) override;
+
+	/**
+	 * Split a block of particles into the ranges of the sources and let each source create its part
+	 *
+	 * @param firstnumber Number of first particle
+	 * @param mc Random-number generators, one for each particle, set to the substream of its particle
+	 * @param geometry Geometry of the simulation
+	 * @param field TFieldManager containing all electromagnetic fields
+	 * @param particles Returns one newly created particle for each entry of mc
+	 */
+	void CreateParticles(const long long firstnumber, std::vector<TMCGenerator> &mc, TGeometry &geometry, const TFieldManager &field,
+			std::vector<std::unique_ptr<TParticle> > &particles) override;
+
+	/**
+	 * Prepare all sources, in order
+	 *
+	 * @param mc Random-number generator
+	 * @param geometry Geometry of the simulation
+	 * @param field TFieldManager containing all electromagnetic fields
+	 */
+	void Prepare(TMCGenerator &mc, TGeometry &geometry, const TFieldManager &field) override;
+};
+
+
+/**
+ * Check if a config section defines a particle source, i.e. it is called SOURCE or SOURCE_<name>
+ *
+ * @param section Name of section
+ *
+ * @return Returns true if section defines a source
+ */
+bool IsSourceSection(const std::string &section);
+
+
 /**
  * Create particle source as defined in config
  *
+ * If the config contains SOURCE_<name> sections in addition to SOURCE, a TMultiSource combining all of them is created.
+ * Each source creates the number of particles given by its option sourcecount, the remaining of the simcount particles are split
+ * between the other sources in proportion to their option sourceweight (default: 1).
+ *
  * @param config TConfig class containing SOURCE options
  * @param geometry Geometry used in the simulation
  *
@@ -392,4 +771,28 @@ public:
 TParticleSource* CreateParticleSource(TConfig &config, const TGeometry &geometry);
 
 
+/**
+ * Create particle of given type
+ *
+ * @param name Particle name (neutron, proton, electron, mercury, or xenon)
+ * @param number Particle number
+ * @param t Creation time
+ * @param x Initial x coordinate
+ * @param y Initial y coordinate
+ * @param z Initial z coordinate
+ * @param E Initial kinetic energy
+ * @param phi Azimuthal angle of initial velocity vector
+ * @param theta Polar angle of initial velocity vector
+ * @param polarisation Initial polarisation of particle (-1, 0, 1)
+ * @param mc Random-number generator
+ * @param geometry Geometry of the simulation
+ * @param field TFieldManager containing all electromagnetic fields
+ * @param startsolid Solid at creation point, if it is already known (nullptr: find it in geometry)
+ *
+ * @return Returns newly created particle, memory has to be freed by user
+ */
+TParticle* CreateParticle(const std::string &name, const int number, double t, double x, double y, double z, double E, double phi, double theta, double polarisation,
+		TMCGenerator &mc, const TGeometry &geometry, const TFieldManager &field, const solid *startsolid = nullptr);
+
+
 #endif /* SOURCE_H_ */
@@ -0,0 +1,114 @@
+/**
+ * \file
+ * Status file that is rewritten periodically while particles are tracked, so the progress of long-running jobs can be monitored.
+ */
+
+#ifndef STATUS_H_
+#define STATUS_H_
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+/**
+ * Get current and peak resident memory of the process
+ *
+ * @param current Returns current resident memory [kB] (0 if unknown)
+ * @param peak Returns peak resident memory [kB] (0 if unknown)
+ */
+void ResidentMemory(long &current, long &peak);
+
+/**
+ * Live progress and metrics of a running simulation
+ *
+ * Worker threads report the particles they start and finish, the main thread calls Update regularly,
+ * which rewrites the status file every interval seconds.
+ * The file contains the number of finished primary particles, particles and integration steps per second, the estimated remaining time,
+ * the sum of statistical weights of finished particles with each stop ID, memory use, and the particle each thread is tracking together with its tracking time,
+ * so a thread stuck in a pathological trajectory can be spotted before the job runs out of time.
+ * It is written as JSON or in the Prometheus text format (e.g. for the textfile collector of the node exporter).
+ * The file is written under a temporary name and renamed, so readers never see an incomplete file.
+ */
+class TStatusMonitor{
+public:
+	enum TFormat{ JSON, PROMETHEUS };
+
+	/**
+	 * Constructor
+	 *
+	 * @param file Status file
+	 * @param interval Interval [s] between updates of the status file (<= 0: no status file is written and all other methods do nothing)
+	 * @param format Format of status file
+	 * @param nthreads Number of threads tracking particles
+	 * @param total Number of primary particles that are simulated in total
+	 * @param finished Number of primary particles that were already finished, e.g. before the simulation was resumed from a checkpoint
+	 * @param ID_counter Sum of statistical weights of already finished particles with each stop ID for each particle type
+	 * @param steps Number of integration steps of already finished particles
+	 */
+	TStatusMonitor(const boost::filesystem::path &file, const double interval, const TFormat format, const int nthreads,
+			const unsigned long total, const unsigned long finished, const std::map<std::string, std::map<int, double> > &ID_counter, const long long steps);
+
+	/**
+	 * Report that a thread started tracking a particle, may be called from any thread
+	 *
+	 * @param ithread Thread index
+	 * @param name Particle name
+	 * @param number Particle number
+	 */
+	void StartParticle(const int ithread, const std::string &name, const long long number);
+
+	/**
+	 * Report that a thread finished tracking a particle, may be called from any thread
+	 *
+	 * @param ithread Thread index
+	 * @param name Particle name
+	 * @param stopID Stop ID of particle
+	 * @param weight Statistical weight of particle
+	 * @param steps Number of integration steps of particle
+	 * @param primary Particle is a primary particle created by the source
+	 */
+	void FinishParticle(const int ithread, const std::string &name, const int stopID, const double weight, const long long steps, const bool primary);
+
+	/**
+	 * Rewrite status file if its interval has elapsed since it was last written, called regularly by the main thread
+	 */
+	void Update();
+
+	/**
+	 * Write final status file
+	 *
+	 * @param state State of simulation written to the file, e.g. "finished" or "interrupted"
+	 */
+	void Finish(const std::string &state);
+
+private:
+	/**
+	 * Write status file
+	 *
+	 * @param state State of simulation
+	 */
+	void Write(const std::string &state);
+
+	boost::filesystem::path file; ///< Status file
+	double interval; ///< Interval [s] between updates of the status file
+	TFormat format; ///< Format of status file
+	unsigned long total; ///< Number of primary particles simulated in total
+	unsigned long startfinished; ///< Number of primary particles finished before this run started, excluded from rates
+	long long startsteps; ///< Number of integration steps made before this run started, excluded from rates
+	std::chrono::steady_clock::time_point start; ///< Time this run started
+	std::chrono::steady_clock::time_point lastupdate; ///< Time the status file was last written
+	std::atomic<unsigned long> finished; ///< Number of finished primary particles
+	std::atomic<long long> steps; ///< Number of integration steps of finished particles
+	std::mutex countermutex; ///< Protects ID_counter and current particle names
+	std::map<std::string, std::map<int, double> > ID_counter; ///< Sum of statistical weights of finished particles with each stop ID for each particle type
+	std::vector<std::string> currentnames; ///< Name of particle each thread is tracking (empty: idle)
+	std::vector<long long> currentnumbers; ///< Number of particle each thread is tracking
+	std::vector<std::chrono::steady_clock::time_point> currentstarts; ///< Time each thread started tracking its current particle
+};
+
+#endif // STATUS_H_
@@ -0,0 +1,333 @@
+/**
+ * \file
+ * Trajectory integrators.
+ */
+
+#ifndef STEPPER_H_
+#define STEPPER_H_
+
+#include <array>
+
+#include <boost/numeric/odeint.hpp>
+
+#include "fields.h"
+#include "geometry.h"
+
+static const int STATE_VARIABLES = 9; ///< number of variables in trajectory integration (position, velocity, proper time, polarization, path length)
+static const int SPIN_STATE_VARIABLES = 5; ///< number of variables in spin integration (spin vector, time, total phase)
+
+typedef double value_type; ///< data type used for trajectory integration
+typedef std::array<value_type, STATE_VARIABLES> state_type; ///< type representing current particle state (position, velocity, proper time, polarization, and path length), fixed size so integration does not allocate memory
+typedef std::array<value_type, SPIN_STATE_VARIABLES> spin_state_type; ///< type representing current spin state (x,y,z component, time, and phase)
+typedef boost::numeric::odeint::runge_kutta_dopri5<state_type, value_type> stepper_type; ///< basic integration stepper (5th-order Runge-Kutta)
+typedef boost::numeric::odeint::controlled_runge_kutta<stepper_type> controlled_stepper_type; ///< integration step length controller
+typedef boost::numeric::odeint::dense_output_runge_kutta<controlled_stepper_type> dense_stepper_type; ///< integration step interpolator
+typedef boost::numeric::odeint::runge_kutta_dopri5<spin_state_type, value_type> spin_stepper_type; ///< basic spin integration stepper (5th-order Runge-Kutta)
+typedef boost::numeric::odeint::controlled_runge_kutta<spin_stepper_type> controlled_spin_stepper_type; ///< spin integration step length controller
+typedef boost::numeric::odeint::dense_output_runge_kutta<controlled_spin_stepper_type> dense_spin_stepper_type; ///< spin integration step interpolator
+typedef boost::numeric::odeint::controlled_runge_kutta<boost::numeric::odeint::runge_kutta_fehlberg78<state_type, value_type> > controlled_rkf78_stepper_type; ///< adaptive 8th-order Runge-Kutta-Fehlberg stepper
+typedef boost::numeric::odeint::bulirsch_stoer_dense_out<state_type, value_type> dense_bs_stepper_type; ///< adaptive Bulirsch-Stoer stepper with dense output
+typedef boost::numeric::odeint::runge_kutta4<state_type, value_type> rk4_stepper_type; ///< classic 4th-order Runge-Kutta stepper
+typedef std::array<value_type, 7> gc_state_type; ///< guiding-center state (guiding-center position, relativistic parallel velocity gamma*v_par, proper time, path length, gyrophase)
+
+struct TParticle;
+
+/**
+ * Trajectory integrator with dense output.
+ *
+ * Uses either an adaptive 5th-order Runge-Kutta stepper (dopri5), an adaptive 8th-order Runge-Kutta-Fehlberg stepper for long flights in smooth fields,
+ * an adaptive Bulirsch-Stoer stepper for very smooth analytic fields, a classic 4th-order Runge-Kutta stepper with fixed spatial step length for rough tabulated fields,
+ * a fixed-step relativistic Boris pusher, which follows the gyration of charged particles in strong magnetic fields with much fewer field evaluations,
+ * or guiding-center tracking, which only follows the drift of the gyration center where the magnetic field is adiabatic and switches to the Boris pusher near walls.
+ * Optionally, particles are propagated analytically on parabolas while they are outside the boundaries of all fields.
+ * Neutral atoms that feel essentially only gravity (e.g. comagnetometer atoms) can be propagated on parabolas everywhere, ignoring all fields,
+ * so each step ends only at the next wall hit.
+ * All methods provide the same interface to interpolate the particle state within the last step.
+ */
+class TStepper{
+public:
+	/**
+	 * Integration method
+	 */
+	enum TMethod{
+		DOPRI5, ///< Adaptive Runge-Kutta stepper
+		RKF78, ///< Adaptive Runge-Kutta-Fehlberg 7(8) stepper
+		BULIRSCHSTOER, ///< Adaptive Bulirsch-Stoer stepper
+		RK4, ///< Classic Runge-Kutta stepper with fixed spatial step length
+		BORIS, ///< Relativistic Boris pusher with a fixed number of steps per gyration period
+		GUIDINGCENTER, ///< Guiding-center tracking in adiabatic magnetic fields far from walls, Boris pusher elsewhere
+		FREEMOLECULAR ///< Event-driven ballistic steps on parabolas under gravity, ignoring all fields
+	};
+private:
+	TMethod method; ///< Integration method
+	dense_stepper_type dopri5; ///< Runge-Kutta stepper, used if method is DOPRI5
+	controlled_rkf78_stepper_type rkf78; ///< Runge-Kutta-Fehlberg stepper, used if method is RKF78
+	dense_bs_stepper_type bulirschstoer; ///< Bulirsch-Stoer stepper, used if method is BULIRSCHSTOER
+	rk4_stepper_type rk4; ///< Classic Runge-Kutta stepper, used if method is RK4
+	double stepsperperiod; ///< Number of Boris steps per gyration period
+	value_type x1 = 0; ///< Time at start of last step, if method has no dense output of its own
+	value_type x2 = 0; ///< Time at end of last step, if method has no dense output of its own
+	state_type y1; ///< Particle state at start of last step, if method has no dense output of its own
+	state_type y2; ///< Particle state at end of last step, if method has no dense output of its own
+	value_type dt = 0; ///< Length of last Boris or RK4 step, or of next RKF78 step
+	double Babs = -1; ///< Absolute magnetic field in last Boris step, used to choose the next step length (<0: not known yet)
+	state_type dr1; ///< Time derivative of position at start of last step, used to interpolate position
+	state_type dr2; ///< Time derivative of position at end of last step, used to interpolate position
+	double gcadiabaticity; ///< Max. adiabaticity parameter (Larmor radius times relative magnetic-field gradient) for guiding-center tracking
+	double gcwalldistance; ///< Min. distance to walls, in Larmor radii, for guiding-center tracking
+	const TGeometry *geometry; ///< Geometry used to determine distance to walls for guiding-center tracking
+	bool guiding = false; ///< True if the last step followed the guiding center
+	gc_state_type gc1; ///< Guiding-center state at start of last step
+	gc_state_type gc; ///< Guiding-center state at end of last step
+	bool ballistic; ///< Propagate particles analytically in regions without fields
+	bool freeflight = false; ///< True if the last step was a ballistic step in a field-free region
+	std::array<double, 3> b1; ///< Magnetic-field direction at start of last guiding-center step
+	std::array<double, 3> b2; ///< Magnetic-field direction at end of last guiding-center step
+	double uperp1; ///< Perpendicular relativistic velocity gamma*v_perp at start of last guiding-center step
+	double uperp2; ///< Perpendicular relativistic velocity gamma*v_perp at end of last guiding-center step
+	double uperp2B; ///< Adiabatic invariant u_perp^2/B (u = gamma*v) during guiding-center tracking [m^2/s^2/T]
+
+	/**
+	 * Return true if method provides its own dense output, otherwise the state is interpolated between y1 and y2
+	 */
+	bool dense_output() const{ return method == DOPRI5 || method == BULIRSCHSTOER; };
+
+	/**
+	 * Do one step of the odeint stepper selected by method
+	 *
+	 * @param eom Equation of motion
+	 */
+	template<class System> void RungeKuttaStep(const System &eom);
+
+	/**
+	 * Do one step of the Boris pusher
+	 *
+	 * The particle drifts for half a step, receives a kick by electric, magnetic, gravitational, and (if it has a magnetic moment) magnetic-gradient forces,
+	 * and drifts for another half step. The step length is chosen to resolve the gyration period in the last magnetic field
+	 * and limited to a spatial length of 10*MAX_TRACK_DEVIATION.
+	 *
+	 * @param p Particle to integrate
+	 * @param field Fields acting on particle
+	 */
+	void BorisStep(const TParticle &p, const TFieldManager &field);
+
+	/**
+	 * Check if guiding-center approximation is valid at a point
+	 *
+	 * Requires the adiabaticity parameter to be smaller than gcadiabaticity and the distance to walls to be larger than gcwalldistance Larmor radii.
+	 *
+	 * @param p Particle
+	 * @param pos Position
+	 * @param uperp2 Squared perpendicular relativistic velocity (gamma*v_perp)^2
+	 * @param B Magnetic field at pos
+	 * @param dBidxj Spatial derivatives of magnetic field at pos
+	 * @param margin Factor applied to both thresholds, to avoid switching back and forth between guiding-center and full tracking
+	 *
+	 * @return Returns true if guiding-center approximation is valid
+	 */
+	bool GuidingCenterValid(const TParticle &p, const double pos[3], const double uperp2, const double B[3], const double dBidxj[3][3], const double margin) const;
+
+	/**
+	 * Convert current particle state y2 into guiding-center state gc
+	 *
+	 * @param p Particle
+	 * @param B Magnetic field at particle position
+	 */
+	void ToGuidingCenter(const TParticle &p, const double B[3]);
+
+	/**
+	 * Convert guiding-center state gc into particle state y at the gyrophase stored in gc
+	 *
+	 * @param p Particle
+	 * @param B Magnetic field at guiding-center position
+	 * @param y Returns particle state
+	 * @param atgc If true, return guiding-center position instead of particle position
+	 */
+	void FromGuidingCenter(const TParticle &p, const double B[3], state_type &y, const bool atgc) const;
+
+	/**
+	 * Guiding-center equations of motion (lowest-order relativistic drift approximation)
+	 *
+	 * Includes parallel motion, mirror force, ExB-, gravitational-, gradient-, and curvature drifts.
+	 *
+	 * @param p Particle
+	 * @param field Fields acting on particle
+	 * @param g Guiding-center state
+	 * @param x Time
+	 * @param dgdx Returns time derivative of guiding-center state
+	 */
+	void GuidingCenterDerivs(const TParticle &p, const TFieldManager &field, const gc_state_type &g, const value_type x, gc_state_type &dgdx) const;
+
+	/**
+	 * Do one Runge-Kutta step of guiding-center tracking
+	 *
+	 * The step length is limited so that the guiding center moves at most half the remaining distance to walls
+	 * and the magnetic field changes by less than one percent.
+	 *
+	 * @param p Particle
+	 * @param field Fields acting on particle
+	 */
+	void GuidingCenterStep(const TParticle &p, const TFieldManager &field);
+
+	/**
+	 * Do one ballistic step in a field-free region
+	 *
+	 * The particle follows a parabola under gravity. The step length is chosen such that the particle moves at most a given distance
+	 * and the parabola deviates from a straight line by at most MAX_TRACK_DEVIATION/2.
+	 *
+	 * @param length Max. distance the particle may move during the step
+	 */
+	void FreeFlightStep(const double length);
+
+	/**
+	 * Calculate particle state on the parabola of the last ballistic step
+	 *
+	 * @param x Time
+	 * @param y Returns particle state
+	 */
+	void FreeFlightState(const value_type x, state_type &y) const;
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param amethod Integration method
+	 * @param abstol Absolute error tolerance of adaptive steppers (DOPRI5, RKF78, and BULIRSCHSTOER)
+	 * @param reltol Relative error tolerance of adaptive steppers (DOPRI5, RKF78, and BULIRSCHSTOER)
+	 * @param asteps Number of Boris steps per gyration period (only used if amethod is BORIS or GUIDINGCENTER)
+	 * @param adiabaticity Max. adiabaticity parameter for guiding-center tracking (only used if amethod is GUIDINGCENTER)
+	 * @param walldistance Min. distance to walls, in Larmor radii, for guiding-center tracking (only used if amethod is GUIDINGCENTER)
+	 * @param geom Geometry used to determine distance to walls (required if amethod is GUIDINGCENTER)
+	 * @param aballistic If true, particles are propagated analytically on parabolas while they are outside the boundaries of all fields
+	 */
+	TStepper(const TMethod amethod = DOPRI5, const double abstol = 1e-9, const double reltol = 1e-9, const double asteps = 100, const double adiabaticity = 0.01, const double walldistance = 10, const TGeometry *geom = nullptr,
+			const bool aballistic = false);
+
+	/**
+	 * (Re-)start integration
+	 *
+	 * @param y Initial particle state
+	 * @param x Initial time
+	 * @param adt Initial step length (only used by adaptive methods)
+	 */
+	void initialize(const state_type &y, const value_type x, const value_type adt);
+
+	/**
+	 * Continue integration after the trajectory was changed at the end of the last step, e.g. by a wall reflection
+	 *
+	 * Keeps the step length proposed by the step-size controller and, for the Boris pusher, the magnetic field of the last step,
+	 * so the first step after the change is not chosen from scratch.
+	 * Only the derivative at the new state is evaluated again; the fields at that point are usually served by the field cache,
+	 * since spin tracking and logging evaluate them at the end of each step.
+	 *
+	 * @param y Particle state after the change
+	 * @param x Time of the change
+	 */
+	void restart(const state_type &y, const value_type x);
+
+	/**
+	 * Change error tolerances of adaptive methods (DOPRI5, RKF78, and BULIRSCHSTOER) and continue integration, e.g. when the particle enters a region of its tolerance map
+	 *
+	 * Keeps the step length proposed by the step-size controller, like restart. Other methods are not affected.
+	 *
+	 * @param abstol Absolute error tolerance
+	 * @param reltol Relative error tolerance
+	 * @param y Current particle state
+	 * @param x Current time
+	 */
+	void set_tolerances(const double abstol, const double reltol, const state_type &y, const value_type x);
+
+	/**
+	 * Do one integration step
+	 *
+	 * @param p Particle to integrate
+	 * @param field Fields acting on particle
+	 */
+	void do_step(const TParticle &p, const TFieldManager &field);
+
+	/**
+	 * Replace last step with a step calculated outside the stepper, e.g. by TTracker::AdvanceBatch
+	 *
+	 * Only possible for methods without dense output of their own, the state within the step is interpolated like in RKF78 and RK4 steps.
+	 *
+	 * @param ax1 Time at start of step
+	 * @param ay1 Particle state at start of step
+	 * @param ax2 Time at end of step
+	 * @param ay2 Particle state at end of step
+	 */
+	void set_step(const value_type ax1, const state_type &ay1, const value_type ax2, const state_type &ay2);
+
+	/**
+	 * Interpolate particle state within last step
+	 *
+	 * @param x Time between previous_time() and current_time()
+	 * @param y Returns interpolated particle state
+	 */
+	void calc_state(const value_type x, state_type &y) const;
+
+	/**
+	 * Calculate time at which the trajectory within the last step crosses a plane
+	 *
+	 * Only possible for ballistic steps, where the crossing of the parabola is calculated analytically.
+	 *
+	 * @param xa Start of time interval, at which trajectory is on one side of the plane
+	 * @param xb End of time interval, at which trajectory is on the other side of the plane
+	 * @param p Point on plane
+	 * @param n Normal of plane
+	 * @param x Returns crossing time
+	 *
+	 * @return Returns true if crossing time could be calculated
+	 */
+	bool plane_crossing(const value_type xa, const value_type xb, const double p[3], const double n[3], value_type &x) const;
+
+	/**
+	 * Return true if the last step was a ballistic step in a field-free region
+	 */
+	bool free_flight() const{ return freeflight; };
+
+	/**
+	 * Return particle state at end of last step
+	 */
+	const state_type& current_state() const{
+		if (!dense_output() || freeflight)
+			return y2;
+		return method == DOPRI5 ? dopri5.current_state() : bulirschstoer.current_state();
+	};
+
+	/**
+	 * Return time at end of last step
+	 */
+	value_type current_time() const{
+		if (!dense_output() || freeflight)
+			return x2;
+		return method == DOPRI5 ? dopri5.current_time() : bulirschstoer.current_time();
+	};
+
+	/**
+	 * Return particle state at start of last step
+	 */
+	const state_type& previous_state() const{
+		if (!dense_output() || freeflight)
+			return y1;
+		return method == DOPRI5 ? dopri5.previous_state() : bulirschstoer.previous_state();
+	};
+
+	/**
+	 * Return time at start of last step
+	 */
+	value_type previous_time() const{
+		if (!dense_output() || freeflight)
+			return x1;
+		return method == DOPRI5 ? dopri5.previous_time() : bulirschstoer.previous_time();
+	};
+
+	/**
+	 * Return length of next step
+	 */
+	value_type current_time_step() const{
+		if (!dense_output())
+			return dt;
+		return method == DOPRI5 ? dopri5.current_time_step() : bulirschstoer.current_time_step();
+	};
+};
+
+#endif // STEPPER_H_
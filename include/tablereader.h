@@ -0,0 +1,117 @@
+/**
+ * \file
+ * Fast reader for text files containing tables of numbers.
+ */
+
+#ifndef TABLEREADER_H_
+#define TABLEREADER_H_
+
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+
+/**
+ * Class reading numbers and lines from a, possibly compressed, text file.
+ *
+ * Reads the file in large blocks through a buffer and parses numbers directly from the buffer with strtod,
+ * avoiding the overhead of formatted stream input and of string copies for every value.
+ * Files ending in .bz2 or .gz are decompressed on the fly.
+ */
+class TTableReader{
+private:
+	std::ifstream file; ///< Input file
+	boost::iostreams::filtering_istream stream; ///< Stream decompressing input file if necessary
+	std::vector<char> buffer; ///< Buffer containing block of file, always null-terminated
+	std::size_t pos = 0; ///< Position of next unread character in buffer
+	std::size_t end = 0; ///< End of valid data in buffer
+	bool eof = false; ///< Set when stream reached end of file
+	unsigned long line = 1; ///< Number of current line
+
+	/**
+	 * Make sure that buffer contains at least a given number of unread characters, or all remaining characters of the file
+	 *
+	 * @param minimum Number of unread characters required
+	 *
+	 * @return Returns false if no unread characters are left
+	 */
+	bool Fill(const std::size_t minimum);
+
+	/**
+	 * Skip whitespace
+	 *
+	 * @param newlines Also skip line breaks
+	 * @param commas Also skip commas
+	 *
+	 * @return Returns false if end of file (or end of line if newlines is false) was reached
+	 */
+	bool Skip(const bool newlines, const bool commas);
+
+	/**
+	 * Parse number at current position
+	 *
+	 * @param value Returns number
+	 *
+	 * @return Returns false if no number could be parsed, position is then not changed
+	 */
+	bool Parse(double &value);
+public:
+	/**
+	 * Constructor, opens file
+	 *
+	 * @param filepath Path of file
+	 */
+	TTableReader(const boost::filesystem::path &filepath);
+
+	/**
+	 * Read next number, skipping any whitespace and line breaks in front
+	 *
+	 * @param value Returns number
+	 *
+	 * @return Returns false if end of file was reached or next characters are not a number
+	 */
+	bool ReadNumber(double &value);
+
+	/**
+	 * Read next number in current line, skipping whitespace and commas in front
+	 *
+	 * @param value Returns number
+	 *
+	 * @return Returns false if end of line was reached or next characters are not a number
+	 */
+	bool ReadNumberInLine(double &value);
+
+	/**
+	 * Read rest of current line, like std::getline
+	 *
+	 * @param str Returns rest of line without line break
+	 *
+	 * @return Returns false if end of file was reached before any character could be read
+	 */
+	bool ReadLine(std::string &str);
+
+	/**
+	 * Skip whitespace and empty lines
+	 *
+	 * @return Returns false if end of file was reached
+	 */
+	bool SkipEmptyLines();
+
+	/**
+	 * Return next unread character without consuming it
+	 *
+	 * @return Returns next character, or 0 at end of file
+	 */
+	char Peek();
+
+	/**
+	 * Return number of current line
+	 *
+	 * @return Returns line number, starting from 1
+	 */
+	unsigned long LineNumber() const{ return line; }
+};
+
+#endif // TABLEREADER_H_
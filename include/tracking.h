@@ -3,49 +3,405 @@
 
 #include <string>
 #include <memory>
+#include <array>
+#include <limits>
+#include <map>
+#include <vector>
 
 #include "mc.h"
 #include "geometry.h"
 #include "fields.h"
 #include "particle.h"
 #include "logger.h"
+#include "replay.h"
+#include "regionmap.h"
 
+static const TMCGenerator::result_type CLONE_INDEX = 1ULL << 63; ///< Flag in position n of TMCGenerator::SecondaryIndex of particles split by TTracker, distinguishing them from decay products
+static const unsigned long MAX_CLONES = 1UL << 20; ///< Max. number of particles created by a single split, so the step number and the copy fit into the substream index
+
+static const double MAGNUS_SPIN_TOLERANCE = 1e-11; ///< Max. difference [rad] between fourth-order Magnus and midpoint rotation angle in a single spin-integration step
+
+/**
+ * Particle-specific spin-tracking options
+ */
+struct TSpinOptions{
+    bool flipspin = false; ///< Choose polarization randomly when the magnetic field rises above Bmax (option flipspin)
+    bool interpolatefields = false; ///< Interpolate spin-precession axis along trajectory steps (option interpolatefields)
+    bool magnus = false; ///< Use Magnus integrator instead of adaptive Runge-Kutta (option spinintegrator)
+    bool rwa = false; ///< Integrate in the frame rotating with the carrier of RF pulses, in the rotating-wave approximation (option spinintegrator rwa)
+    double Bmax = 0; ///< Spin is only integrated where the magnetic field is below this value [T] (option Bmax)
+    double adiabaticity = 0; ///< Spin is also integrated outside of times where the adiabaticity parameter is below this value, 0: only in times (option spinadiabaticity)
+    std::vector<double> times; ///< Time intervals in which spin is integrated [s] (option spintimes)
+
+    /**
+     * Read options from particle-specific configuration
+     *
+     * @param particleconf Option map containing particle specific options
+     */
+    explicit TSpinOptions(const std::map<std::string, std::string> &particleconf);
+};
+
+/**
+ * Particle-specific options of the trajectory integrator
+ */
+struct TIntegratorOptions{
+    TStepper::TMethod method = TStepper::DOPRI5; ///< Integration method (option integrator)
+    double abstol = 1e-9; ///< Absolute error tolerance of adaptive integrators (option abstol)
+    double reltol = 1e-9; ///< Relative error tolerance of adaptive integrators (option reltol)
+    double borissteps = 100; ///< Steps per gyration period of Boris and guiding-center integrators (option borissteps)
+    double gcadiabaticity = 0.01; ///< Max. adiabaticity parameter for guiding-center tracking (option gcadiabaticity)
+    double gcwalldistance = 10; ///< Min. distance to walls [Larmor radii] for guiding-center tracking (option gcwalldistance)
+    bool ballistic = false; ///< Step exactly along gravitational parabolas in field-free regions (option ballistic)
+
+    /**
+     * Read options from particle-specific configuration
+     *
+     * @param particleconf Option map containing particle specific options
+     */
+    explicit TIntegratorOptions(const std::map<std::string, std::string> &particleconf);
+};
+
+/**
+ * Region in which the trajectory integrator uses its own error tolerances and chord deviation, defined in the TOLERANCES section
+ *
+ * Each entry of the section has the form "name type parameters abstol reltol maxdeviation", with the types
+ * "solid ID" (particle is in the solid with this ID), "box x1 y1 z1 x2 y2 z2" (particle is in this axis-aligned box),
+ * "nearwall d" (the region map's lower bound of the wall distance is below d [m]), and "gradient g" (the region map's upper bound of the magnetic-field gradient is above g [T/m]).
+ */
+struct TToleranceRegion{
+    /**
+     * Type of region
+     */
+    enum TType{
+        SOLID, ///< Particle is in a solid
+        BOX, ///< Particle is in an axis-aligned box
+        NEARWALL, ///< Particle is in a voxel of the region map close to a wall
+        GRADIENT ///< Particle is in a voxel of the region map with a strong magnetic-field gradient
+    };
+    std::string name; ///< Name of region, also used as name of its profile
+    TType type; ///< Type of region
+    unsigned solidID = 0; ///< ID of solid (type SOLID)
+    double min[3] = {0, 0, 0}; ///< Lower corner of box (type BOX)
+    double max[3] = {0, 0, 0}; ///< Upper corner of box (type BOX)
+    double limit = 0; ///< Wall distance [m] (type NEARWALL) or magnetic-field gradient [T/m] (type GRADIENT)
+    double abstol; ///< Absolute error tolerance of adaptive integrators in this region
+    double reltol; ///< Relative error tolerance of adaptive integrators in this region
+    double maxdeviation; ///< Max. deviation of the trajectory from the chords tested for collisions in this region [m], replaces MAX_TRACK_DEVIATION
+
+    /**
+     * Constructor, reads region from an entry of the TOLERANCES section
+     *
+     * @param aname Name of region
+     * @param definition Type, parameters, and tolerances of region
+     */
+    TToleranceRegion(const std::string &aname, const std::string &definition);
+
+    /**
+     * Check if a particle is in this region
+     *
+     * @param p Position of particle
+     * @param currentsolid Solid the particle is in
+     * @param map Region map (required for types NEARWALL and GRADIENT)
+     *
+     * @return Returns true if the particle is in this region
+     */
+    bool Contains(const double p[3], const solid &currentsolid, const TRegionMap *map) const;
+};
+
+/**
+ * All particle-specific tracking options, read and checked once before any particle is tracked
+ *
+ * Options missing in the configuration keep their defaults, options that cannot be read throw an exception.
+ */
+struct TParticleOptions{
+    double tau = 0; ///< Exponential decay lifetime [s], 0: particle stops at tmax (option tau)
+    double tmax = 0; ///< Proper time at which a particle that does not decay stops [s] (option tmax)
+    double lmax = std::numeric_limits<double>::infinity(); ///< Max. trajectory length [m] (option lmax)
+    double maxcputime = 0; ///< CPU time [s] after which a particle is stopped, 0: unlimited (option maxcputime)
+    int maxsteps = 0; ///< Number of integration steps after which a particle is stopped, 0: unlimited (option maxsteps)
+    int maxhits = 0; ///< Number of surface hits after which a particle is stopped, 0: unlimited (option maxhits)
+    int fatehits = 0; ///< Number of surface hits after which the remaining fate of a particle is sampled by TTracker::SampleFate, 0: never (option fatehits)
+    double fatetime = 0; ///< Time [s] after creation after which the remaining fate of a particle is sampled by TTracker::SampleFate, 0: never (option fatetime)
+    unsigned batchsize = 1; ///< Number of primary particles advanced together by TTracker::AdvanceBatch (option batchsize)
+    unsigned energyinterval = 1; ///< Max. total energy is updated every energyinterval-th step, 0: never (option energymonitor exact, sampled <n>, or off)
+    unsigned parareal = 0; ///< Number of time slices integrated in parallel by TTracker::AdvanceParareal, 0: off (option parareal)
+    double pararealtol = 1e-6; ///< Parareal iterations stop when no slice-boundary position changes by more than this [m] (option pararealtol)
+    double pararealcoarsetol = 1e-5; ///< Tolerances of the coarse propagator of the parareal iterations (option pararealcoarsetol)
+    TIntegratorOptions integrator; ///< Options of the trajectory integrator
+    TSpinOptions spin; ///< Spin-tracking options
+    std::vector<TToleranceRegion> tolerancemap; ///< Regions with their own integrator tolerances, the first one containing the particle applies (option tolerancemap, resolved from the TOLERANCES section by TTracker)
+
+    /**
+     * Read and check options from particle-specific configuration
+     *
+     * @param particleconf Option map containing particle specific options
+     */
+    explicit TParticleOptions(const std::map<std::string, std::string> &particleconf);
+};
 
 /**
  * Class used to interpolate particle trajectories and track their path through the experiment geometry.
  */
 class TTracker {
 private:
-    std::vector<std::pair<solid, bool> > currentsolids; ///< solids in which particle is currently inside
+    std::vector<std::pair<const solid*, bool> > currentsolids; ///< solids (owned by TGeometry) in which particle is currently inside
+    const solid *currentsolid = nullptr; ///< First non-ignored solid in currentsolids, updated by UpdateCurrentsolid whenever the list changes
     std::unique_ptr<TLogger> logger; ///< class to log particle states
+    std::array<double, 3> safetycenter; ///< Center of a sphere around a previous particle position that does not contain any surface
+    double safetyradius = 0; ///< Radius of this sphere, steps contained in this sphere are not checked for collisions (0: no valid sphere)
+    value_type collisionfreetime = -std::numeric_limits<value_type>::infinity(); ///< Chords of the current integration step ending before this time are far from any surface and not checked for collisions
+    TCollisionCache collisioncache; ///< Triangles close to the last collision tests, so successive tests of nearby segments do not have to search the whole geometry
+    std::vector<TCollision> collisions; ///< Collision list reused by CheckHit and iterate_collision
+    std::vector<TCollision> hitcollisions; ///< Collisions of the short segment around an iterated collision point, found by iterate_collision or find_collision_root and processed by DoHit
+    std::vector<std::pair<const solid*, bool> > newsolids; ///< List of solids after a hit, reused by DoHit
+    std::map<std::string, TParticleOptions> particleoptions; ///< Options of each particle type, read once by the constructor
+    bool rootfinding = false; ///< Iterate collision points by finding the crossing of the hit triangle's plane instead of bisecting the trajectory (GLOBAL option collisioniteration)
+    bool checkpoint = false; ///< Particles may be continued from a checkpoint, so a signal interrupts tracking only between trajectory steps (GLOBAL option checkpoint)
+    bool secondaries = true; ///< Secondary particles are tracked (GLOBAL option secondaries), otherwise decay products are not created at all
+    bool fieldprefetch = false; ///< After each step, prefetch the field-table cells the extrapolated next step will cross (GLOBAL option fieldprefetch), see TFieldManager::Prefetch
+    const TRegionMap *regionmap = nullptr; ///< Map of wall distances and field bounds (GLOBAL option regionmap, nullptr: not used), owned by the caller, see SetRegionMap
+    bool adjoint = false; ///< Particles start at a detector and are tracked backward (GLOBAL option adjoint), which is only valid for neutral particles in static fields, see TParticle::IsAdjoint
+    int nthreads = 1; ///< Number of threads tracking particles in this process (GLOBAL option nthreads), threads not busy tracking integrate parareal slices, see AdvanceParareal
+    dense_spin_stepper_type spinstepper = boost::numeric::odeint::make_dense_output(1e-12, 1e-12, spin_stepper_type()); ///< Spin integrator, reinitialized for every trajectory step
+    TSpinAxisInterpolant spinaxis; ///< Interpolant of spin-precession axis along current trajectory step, rebuilt for every trajectory step if interpolatefields is set
+    unsigned energyinterval = 1; ///< TParticleOptions::energyinterval of the particles currently tracked, passed to TParticle::DoStep
+    double trackdeviation = MAX_TRACK_DEVIATION; ///< Max. deviation of the trajectory from chords tested for collisions in the tolerance region the particle tracked by IntegrateParticle is in
+    std::vector<std::pair<std::unique_ptr<TParticle>, TMCGenerator::result_type> > clones; ///< Copies of particles split since last call of TakeClones, paired with their position n in TMCGenerator::SecondaryIndex
+    TTrackingCost *cost = nullptr; ///< Cost counters of the particle currently tracked by IntegrateParticle
+    const solid *transferentry = nullptr; ///< Entrance of the recorded guide section the particle currently tracked by IntegrateParticle is in (nullptr: not in a recorded section), see solid::transfer
+    value_type transferx; ///< Time when the particle entered this section
+    state_type transfery; ///< State vector when the particle entered this section
+    double transferweight; ///< Statistical weight when the particle entered this section
 public:
     /**
      * Constructor.
      * 
-     * Reads relevant configuration parameters
+     * Reads relevant configuration parameters, including the options of each particle type
      * 
      * @param config List of configuration parameters read from config files.
+     * @param shard Index appended to log file names, used when several trackers run in parallel (-1: no index)
      */
-    TTracker(TConfig& config);
+    TTracker(TConfig& config, const int shard = -1);
 
     /**
      * Integrate particle trajectory.
      *
      * Takes state vector yend and integrates the trajectory step by step.
      * If a step is longer than MAX_SAMPLE_DIST, the step is split by interpolating intermediate points.
+     * When the particle crosses into another region of its tolerance map, its integrator tolerances and the max. deviation of the trajectory from the chords tested for collisions are changed before the next step.
      * On each step it checks for interaction with solids, prints snapshots and track into files and calls TParticle::OnStep.
      * Integration is stopped and ID set if TParticle::tau or tmax are reached; or if something happens to the particle (absorption, error, ...)
      *
      * @param p Particle to integrate
      * @param tmax Max. absolute time at which integration will be stopped
-     * @param particleconf Option map containing particle specific options from particle.in
      * @param mc Random-number generator
      * @param geom Geometry of the simulation
      * @param field TFieldManager containing all electromagnetic fields
      */
-    void IntegrateParticle(std::unique_ptr<TParticle>& p, const double tmax, std::map<std::string, std::string> &particleconf,
-                           TMCGenerator &mc, const TGeometry &geom, const TFieldManager &field);
+    void IntegrateParticle(std::unique_ptr<TParticle>& p, const double tmax, TMCGenerator &mc, const TGeometry &geom, const TFieldManager &field);
+
+    /**
+     * Return copies of particles that were split by IntegrateParticle since the last call
+     *
+     * Each copy continues from the state in which it was split.
+     * It should draw random numbers from substream TMCGenerator::SecondaryIndex(index of split particle, n).
+     *
+     * @return Returns list of copies, each paired with n
+     */
+    std::vector<std::pair<std::unique_ptr<TParticle>, TMCGenerator::result_type> > TakeClones();
+
+    /**
+     * Use region map to skip geometry and field-gradient queries where it guarantees that they are not needed
+     *
+     * InSafetySphere tries the map's lower bound of the wall distance before calculating the exact distance,
+     * and IntegrateSpin does not evaluate field gradients where the map's bound of the adiabaticity parameter exceeds spinadiabaticity.
+     *
+     * @param map Region map, has to outlive the tracker (nullptr: do not use any map)
+     */
+    void SetRegionMap(const TRegionMap *map){ regionmap = map; }
+
+    /**
+     * Advance several particles of the same type together until they hit a surface
+     *
+     * The particle states are stored as structure of arrays, and each particle is advanced with classic 4th-order Runge-Kutta steps with a fixed spatial length of 10*MAX_TRACK_DEVIATION.
+     * Every Runge-Kutta stage is computed for all particles in one loop, with one batched field evaluation.
+     * Each step is handled like a collision-free step of IntegrateParticle, including physics on the step, spin tracking, and logging.
+     * Steps leaving the particles' safety spheres are tested for collisions with surfaces together, see TGeometry::GetCollisions of several segments.
+     * A particle is peeled off when its next step collides with a surface, leaves the bounding box of the geometry, or reaches the end of its tracking (tmax, tau, lmax, or step budget),
+     * or when it is in an absorbing material or charged. It stays unfinished, and IntegrateParticle continues tracking it from its final state.
+     *
+     * @param batch Particles to advance, paired with their random-number generators
+     * @param tmax Max. absolute time at which integration will be stopped
+     * @param geom Geometry of the simulation
+     * @param field TFieldManager containing all electromagnetic fields
+     */
+    void AdvanceBatch(const std::vector<std::pair<std::unique_ptr<TParticle>*, TMCGenerator*> > &batch, const double tmax,
+                      const TGeometry &geom, const TFieldManager &field);
+
+    /**
+     * Track the spin of a particle again along its recorded trajectory, e.g. in different fields, without integrating the trajectory
+     *
+     * Each pair of continuous knots is passed to IntegrateSpin as a trajectory step, interpolated like the steps of AdvanceBatch, using the spin options of the particle type.
+     * The spin is kept across jumps between knots, e.g. wall reflections, and polarisation flips in jumps (spin flips on walls) are applied to the replayed polarisation.
+     * The particle keeps its recorded trajectory, stop ID, and weight, only its final spin and polarisation, its spin-flip counters, and the spin log change.
+     * Its end state is logged like that of a tracked particle.
+     *
+     * @param p Particle in the final state recorded with the trajectory, returns particle with replayed spin
+     * @param knots Recorded trajectory, starting at the creation of the particle
+     * @param mc Random-number generator
+     * @param geom Geometry of the simulation
+     * @param field TFieldManager containing all electromagnetic fields
+     */
+    void ReplaySpin(const std::unique_ptr<TParticle>& p, const std::vector<TTrajectoryKnot> &knots, TMCGenerator &mc, const TGeometry &geom, const TFieldManager &field);
+
+    /**
+     * Get options of a particle type
+     *
+     * @param particlename Name of particle type
+     * @return Returns options read by the constructor
+     */
+    const TParticleOptions& GetParticleOptions(const std::string &particlename) const;
+
+    /**
+     * Add bins of all histograms filled by the logger of this tracker, see TLogger::AddHistogramBins
+     *
+     * @param bins List of histograms by name, histograms missing in the list are added
+     */
+    void AddHistogramBins(std::map<std::string, THistogramBins> &bins) const { logger->AddHistogramBins(bins); }
+
+    /**
+     * Get memory used by the logger of this tracker, see TLogger::MemoryUsage
+     *
+     * @return Returns approximate size [bytes]
+     */
+    std::size_t LoggerMemoryUsage() const { return logger->MemoryUsage(); }
 private:
+    /**
+     * Draw proper time at which particle stops (decay time or tmax), if it was not drawn before
+     *
+     * @param p Particle
+     * @param options Options of this particle type
+     * @param mc Random-number generator
+     * @return Returns stop proper time
+     */
+    double InitStopProperTime(const std::unique_ptr<TParticle>& p, const TParticleOptions &options, TMCGenerator &mc);
+
+    /**
+     * Split particle or play Russian roulette when it enters a region with a different importance
+     *
+     * If the importance increases by a factor r, the particle is split into r particles on average, each carrying 1/r of its statistical weight.
+     * If it decreases, the particle survives with probability r and its weight is increased by 1/r, otherwise it is killed.
+     *
+     * @param p Particle
+     * @param ratio Ratio r of new and old importance
+     * @param x Time
+     * @param y State vector
+     * @param spin Spin vector
+     * @param mc Random-number generator
+     * @param geom Geometry of the simulation
+     * @param field TFieldManager containing all electromagnetic fields
+     */
+    void ChangeImportance(const std::unique_ptr<TParticle>& p, const double ratio, const value_type x, const state_type &y, const spin_state_type &spin,
+                          TMCGenerator &mc, const TGeometry &geom, const TFieldManager &field);
+    /**
+     * Record or skip guide sections listed in the TRANSFER section when the particle enters a different solid, see solid::transfer
+     *
+     * When the particle enters a section with a transfer table, it is moved to the exit or loss state of a record drawn from the table,
+     * unless the table has no records for its velocity or it would reach tmax or decay in the section. Its spin is kept.
+     * When it enters a recorded section, its state is stored, and written to the section's transfer file when it enters the exit solid, returns into the entrance solid, or stops.
+     *
+     * @param p Particle
+     * @param x Time, returns time at the exit if the section was skipped
+     * @param y State vector, returns state at the exit if the section was skipped
+     * @param tmax Max. absolute time at which integration will be stopped
+     * @param tau Proper time at which particle stops
+     * @param mc Random-number generator
+     * @param geom Geometry of the simulation
+     *
+     * @return Returns true if the particle was moved to the exit of a section
+     */
+    bool DoTransfer(const std::unique_ptr<TParticle>& p, value_type &x, state_type &y, const double tmax, const double tau, TMCGenerator &mc, const TGeometry &geom);
+
+    /**
+     * Check if a segment of the trajectory leaves the periodic unit cell, see TGeometry::ReadPeriodicCell
+     *
+     * If the end point lies outside the cell, the face crossed first is estimated along the straight segment,
+     * and the time at which the trajectory crosses it is iterated with the Illinois method.
+     *
+     * @param x1 Start time of segment
+     * @param y1 State at start of segment
+     * @param x2 End time of segment, returns time just after the trajectory crossed the face
+     * @param y2 State at end of segment, returns state just after the trajectory crossed the face
+     * @param stepper Trajectory integrator, used to calculate intermediate state vectors
+     * @param geom Geometry of the simulation
+     * @param axis Returns index of the lattice vector along which the particle leaves the cell
+     * @param direction Returns +1 if the particle leaves the cell along the lattice vector, -1 if it leaves against it
+     *
+     * @return Returns true if the segment leaves the cell
+     */
+    bool FindCellExit(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const TStepper &stepper, const TGeometry &geom,
+                      unsigned &axis, int &direction) const;
+
+    /**
+     * Move particle that left the periodic unit cell through a face into the cell through the opposite face and count the cell it moved into
+     *
+     * @param p Particle
+     * @param x Time
+     * @param y State vector, returns state shifted by the lattice vector
+     * @param axis Index of lattice vector along which the particle left the cell
+     * @param direction +1 if the particle left the cell along the lattice vector, -1 if it left against it
+     * @param geom Geometry of the simulation
+     */
+    void CrossCell(const std::unique_ptr<TParticle>& p, const value_type x, state_type &y, const unsigned axis, const int direction, const TGeometry &geom);
+
+    /**
+     * Sample the remaining fate of a long-trapped particle from a Markov model instead of tracking it to the end
+     *
+     * The wall-loss and wall-depolarisation rates are the sums of absorption and spin-flip probabilities of all its surface hits so far (see TParticle::GetHitProbabilities),
+     * divided by the time it was tracked. The particle is absorbed on a surface after an exponentially distributed time, unless it decays or reaches tmax or lmax first,
+     * extrapolated with its average rates of proper time and trajectory length. The numbers of further hits and spin flips are Poisson distributed.
+     * Position, velocity, and spin vector are kept, since they are not predictable after many hits.
+     * Particles without surface hits or with survival weights of weighted tracking are not sampled.
+     *
+     * @param p Particle
+     * @param x Time, returns time at which particle stops
+     * @param y State vector, returns state with extrapolated proper time, polarisation, and trajectory length
+     * @param tmax Max. absolute time at which integration will be stopped
+     * @param tau Proper time at which particle stops
+     * @param lmax Max. trajectory length
+     * @param mc Random-number generator
+     */
+    void SampleFate(const std::unique_ptr<TParticle>& p, value_type &x, state_type &y, const double tmax, const double tau, const double lmax, TMCGenerator &mc) const;
+
+    /**
+     * Advance a particle that does not touch any surface over a long time with the parareal algorithm, integrating slices of its trajectory in parallel
+     *
+     * The time until tmax or the particle's decay is divided into options.parareal slices. A coarse propagator (DOPRI5 with tolerances pararealcoarsetol) predicts the state at the start of each slice,
+     * then each slice is integrated from its predicted start with the particle's integrator, and the predictions are corrected serially with the coarse propagator
+     * until no slice-boundary position changes by more than pararealtol. Velocities are not compared, since a changed velocity changes the positions at all later boundaries.
+     * After k iterations the first k slices are exact, so the algorithm never takes more iterations than there are slices.
+     * The slices are integrated by the calling thread and by as many threads as are left idle of the nthreads tracking threads.
+     * Each fine step is checked for collisions with surfaces, using safety spheres like IntegrateParticle.
+     * The particle is moved to the end of the last slice before the first slice that may touch a surface, leave the geometry, or exceed lmax.
+     * Step physics and spin tracking are skipped within the advanced slices, so TParticleOptions rejects options that would need them.
+     *
+     * @param p Particle
+     * @param x Time, returns time at end of advanced slices
+     * @param y State vector, returns state at end of advanced slices
+     * @param tmax Max. absolute time at which integration will be stopped
+     * @param tau Proper time at which particle stops
+     * @param options Options of this particle type
+     * @param geom Geometry of the simulation
+     * @param field TFieldManager containing all electromagnetic fields
+     * @param maxsteps Number of steps the particle may still take, the iterations are aborted when the coarse and fine steps of all slices exceed it
+     * @param maxcputime CPU time [s] the particle may still use, the iterations are aborted when all threads together exceed it
+     * @param steps Returns number of coarse and fine steps taken
+     *
+     * @return Returns true if the particle was advanced
+     */
+    bool AdvanceParareal(const std::unique_ptr<TParticle>& p, value_type &x, state_type &y, const double tmax, const double tau, const TParticleOptions &options,
+                         const TGeometry &geom, const TFieldManager &field, const long maxsteps, const double maxcputime, unsigned long &steps);
+
     /**
      * Check if particle hit a material boundary
      *
@@ -63,31 +419,82 @@ private:
      * @return Returns true if particle was reflected/absorbed
      */
     bool CheckHit(const std::unique_ptr<TParticle>& p, const value_type x1, const state_type &y1, value_type &x2, state_type &y2,
-             const dense_stepper_type &stepper, TMCGenerator &mc, const TGeometry &geom, const TFieldManager &field);
+             const TStepper &stepper, TMCGenerator &mc, const TGeometry &geom, const TFieldManager &field);
+
+    /**
+     * Check if line segment is contained in the safety sphere around a previous particle position, updating the sphere if necessary
+     *
+     * If the segment is not contained in the current sphere, the sphere is moved to the segment's start point
+     * and its radius set to the distance to the closest surface.
+     *
+     * @param y1 Start point of line segment
+     * @param y2 End point of line segment
+     * @param geom Geometry to check distance against
+     * @return Returns true if the segment cannot collide with any surface
+     */
+    bool InSafetySphere(const state_type &y1, const state_type &y2, const TGeometry &geom);
+
+    /**
+     * Check line segment for collisions with the geometry and count the test in the tracking cost of the current particle
+     *
+     * @param x1 Start time of line segment
+     * @param y1 Start point of line segment
+     * @param x2 End time of line segment
+     * @param y2 End point of line segment
+     * @param colls List of collisions, filled by TGeometry::GetCollisions
+     * @param geom Geometry
+     * @return Returns true if line segment collides with a surface
+     */
+    bool CollisionQuery(const value_type x1, const state_type &y1, const value_type x2, const state_type &y2,
+                        std::vector<TCollision> &colls, const TGeometry &geom);
 
     /**
      * Iterate collision point
      *
      * Split trajectory in half if there was a collision and call function recursively for each segment until length of segment is smaller than REFLECT_TOLERANCE.
+     * TTracker::collisions has to contain the collisions of the segment when called; on success, the collisions of the returned segment are stored in TTracker::hitcollisions.
      *
+     * @param p Particle, problems are written to its diagnosticlog
      * @param x1 Start time of line segment
      * @param y1 Start point of line segment
      * @param x2 End time of line segment
      * @param y2 End point of line segment
-     * @param coll Collision found in this segment
+     * @param coll Collision found in this segment (copied, since the collision list is reused by recursive calls)
      * @param stepper Trajectory integrator, used to calculate intermediate state vectors
      * @param geom Geometry
      * @param interation Increase iteration count for each recursive call to limit number of iterations
      * @return Returns true if collision point was successfully iterated
      */
-    bool iterate_collision(value_type &x1, state_type &y1, value_type &x2, state_type &y2,
-                           const TCollision &coll, const dense_stepper_type &stepper, const TGeometry &geom,
+    bool iterate_collision(const std::unique_ptr<TParticle>& p, value_type &x1, state_type &y1, value_type &x2, state_type &y2,
+                           const TCollision coll, const TStepper &stepper, const TGeometry &geom,
                            const unsigned int iteration = 0);
 
+    /**
+     * Iterate collision point by root finding
+     *
+     * Finds the time at which the interpolated trajectory crosses the plane of the hit triangle with the Illinois variant of regula falsi
+     * and shrinks the segment around it to less than REFLECT_TOLERANCE. The result is verified with two collision tests;
+     * if the crossing cannot be confirmed, iterate_collision is used instead.
+     * On success, the collisions of the returned segment are stored in TTracker::hitcollisions.
+     * Ballistic steps are always iterated this way, calculating the crossing of the parabola analytically.
+     *
+     * @param p Particle, problems are written to its diagnosticlog
+     * @param x1 Start time of line segment
+     * @param y1 Start point of line segment
+     * @param x2 End time of line segment
+     * @param y2 End point of line segment
+     * @param coll First collision found in this segment
+     * @param stepper Trajectory integrator, used to calculate intermediate state vectors
+     * @param geom Geometry
+     * @return Returns true if collision point was successfully iterated
+     */
+    bool find_collision_root(const std::unique_ptr<TParticle>& p, value_type &x1, state_type &y1, value_type &x2, state_type &y2,
+                             const TCollision coll, const TStepper &stepper, const TGeometry &geom);
+
     /**
      * Call particle's OnStep function for particle-dependent physics processes on a step.
      *
-     * Check if trajectory has been altered by physics processes, return true if it was.
+     * Check if trajectory has been altered by physics processes, return true if it was. The (possibly shortened) segment is scored in the efficiency maps.
      *
      * @param p Particle
      * @param x1 Start time of line segment
@@ -101,12 +508,13 @@ private:
      * @return Returns true if trajectory was altered
      */
     bool DoStep(const std::unique_ptr<TParticle>& p, const value_type x1, const state_type &y1, value_type &x2, state_type &y2,
-            const dense_stepper_type &stepper, const solid &currentsolid, TMCGenerator &mc, const TFieldManager &field);
+            const TStepper &stepper, const solid &currentsolid, TMCGenerator &mc, const TFieldManager &field);
 
     /**
      * Call particle's OnHit function to check if particle should cross material boundary.
      *
      * Update list of solids the particle is in, check for geometry-tracking errors.
+     * The collisions of the segment are taken from TTracker::hitcollisions, filled when the collision point was iterated.
      *
      * @param p Particle
      * @param x1 Start time of line segment
@@ -120,18 +528,23 @@ private:
      * @return Returns true if trajectory was altered
      */
     bool DoHit(const std::unique_ptr<TParticle>& p, const value_type x1, const state_type &y1, value_type &x2, state_type &y2,
-            const dense_stepper_type &stepper, TMCGenerator &mc, const TGeometry &geom);
+            const TStepper &stepper, TMCGenerator &mc, const TGeometry &geom);
 
     /**
-     * Return first non-ignored solid in TParticle::currentsolids list
+     * Return first non-ignored solid in TTracker::currentsolids list
      */
-    const solid& GetCurrentsolid() const;
+    const solid& GetCurrentsolid() const{ return *currentsolid; };
+
+    /**
+     * Find first non-ignored solid in TTracker::currentsolids list, has to be called whenever the list changes
+     */
+    void UpdateCurrentsolid();
 
     /**
      * Simulate spin precession
      *
      * Integrates general BMT equation over one time step.
-     * If the conditions given by times and Bmax are not fulfilled, the spin vector will simply be rotated along the magnetic field, keeping the spin projection onto the magnetic field constant.
+     * If the conditions given by times, adiabaticity, and Bmax are not fulfilled, the spin vector will simply be rotated along the magnetic field, keeping the spin projection onto the magnetic field constant.
      *
      * @param p Particle
      * @param spin Spin vector, returns new spin vector after step
@@ -141,15 +554,55 @@ private:
      * @param times Absolute time intervals in between spin integration should be carried out [s]
      * @param field TFieldManager to calculate electric and magnetic field
      * @param interpolatefields If this is set to true, the magnetic and electric fields will be interpolated between the trajectory-step points. This will speed up spin tracking in high, static fields, but might break spin tracking in small, quickly varying fields (e.g. spin-flip pulses)
+     * @param magnus If this is set to true, the spin is rotated with IntegrateSpinMagnus instead of integrating the BMT equation with an adaptive Runge-Kutta stepper
+     * @param rwa If this is set to true and RF pulses are defined, the spin is integrated with IntegrateSpinRWA
      * @param Bmax Spin integration will only be carried out, if magnetic field is below this value [T]
+     * @param adiabaticity Spin integration is also carried out outside of times, if the adiabaticity parameter (Larmor frequency divided by rotation rate of the magnetic field seen by the particle) is below this value at the start or end of the step or across the step (0: only in times)
      * @param mc TMCGenerator random number generator
      * @param flipspin If set to true, polarisation in y2 will be randomly set when magnetic field rises above Bmax, weighted by spin projection onto the magnetic field
      *
      * @return Return probability of spin flip
      */
-    void IntegrateSpin(const std::unique_ptr<TParticle>& p, state_type &spin, const dense_stepper_type &stepper,
+    void IntegrateSpin(const std::unique_ptr<TParticle>& p, spin_state_type &spin, const TStepper &stepper,
             const double x2, state_type &y2, const std::vector<double> &times, const TFieldManager &field,
-            const bool interpolatefields, const double Bmax, TMCGenerator &mc, const bool flipspin) const;
+            const bool interpolatefields, const bool magnus, const bool rwa, const double Bmax, const double adiabaticity, TMCGenerator &mc, const bool flipspin);
+
+    /**
+     * Rotate spin vector with a fourth-order Magnus integrator
+     *
+     * Each step rotates the spin exactly around the rotation vector given by the Magnus expansion of the spin-precession axis at two Gauss-Legendre points,
+     * so the length of the spin vector is preserved. The step length is limited by the change of the precession axis during the step, not by the precession period.
+     *
+     * @param p Particle
+     * @param spin Spin vector at time x1, returns spin vector at time x2
+     * @param stepper Trajectory integrator used to calculate spin-precession axis
+     * @param x1 Start time [s]
+     * @param x2 End time [s]
+     * @param field TFieldManager to calculate electric and magnetic field
+     * @param omega_int Spline used to interpolate spin-precession axis (nullptr: calculate spin-precession axis directly)
+     */
+    void IntegrateSpinMagnus(const std::unique_ptr<TParticle>& p, spin_state_type &spin, const TStepper &stepper,
+            const value_type x1, const value_type x2, const TFieldManager &field, const TSpinAxisInterpolant *omega_int);
+
+    /**
+     * Integrate spin in the frame rotating with the carrier of the RF pulses, in the rotating-wave approximation
+     *
+     * The frame rotates with the carrier frequency about the direction n of the precession axis of the static fields at the start of the step.
+     * In this frame the spin precesses about (Omega0.n - omega)*n plus the co-rotating half of the RF precession axis perpendicular to n, see TParticle::RFSpinPrecessionAxes.
+     * The counter-rotating half of the RF pulses and the components of the static precession axis perpendicular to n oscillate with the carrier frequency in this frame and are dropped,
+     * so the adaptive Runge-Kutta stepper only has to resolve the detuning, the envelope, and the motion of the particle, not every oscillation of the carrier.
+     * At the end of the step the spin follows the change of n adiabatically. Geometric phases and Bloch-Siegert shifts are therefore not simulated.
+     * Falls back to IntegrateSpinMagnus if there is no static field defining the rotation axis.
+     *
+     * @param p Particle
+     * @param spin Spin vector at time x1, returns spin vector at time x2
+     * @param stepper Trajectory integrator used to calculate spin-precession axis
+     * @param x1 Start time [s]
+     * @param x2 End time [s]
+     * @param field TFieldManager to calculate electric and magnetic field, has to contain RF pulses
+     */
+    void IntegrateSpinRWA(const std::unique_ptr<TParticle>& p, spin_state_type &spin, const TStepper &stepper,
+            const value_type x1, const value_type x2, const TFieldManager &field);
 
 
 
@@ -0,0 +1,91 @@
+/**
+ * \file
+ * Transfer tables of field-free guide sections, replacing the tracking of particles through the section by sampling their exit state from an earlier simulation.
+ */
+
+#ifndef TRANSFER_H_
+#define TRANSFER_H_
+
+#include <array>
+#include <string>
+#include <vector>
+
+#include "mc.h"
+
+/**
+ * Outcome of a particle passing a guide section, written by TLogger::PrintTransfer and read by TTransferTable
+ *
+ * Files start with TRANSFER_HEADER, followed by records in native byte order.
+ */
+struct TTransferRecord{
+	double vx; ///< x component of velocity when entering the section [m/s]
+	double vy; ///< y component of velocity when entering the section [m/s]
+	double vz; ///< z component of velocity when entering the section [m/s]
+	double delay; ///< Time between entering and leaving or stopping in the section [s]
+	double propertime; ///< Proper time passed in the section [s]
+	double length; ///< Trajectory length in the section [m]
+	double x; ///< x coordinate when leaving or stopping [m]
+	double y; ///< y coordinate when leaving or stopping [m]
+	double z; ///< z coordinate when leaving or stopping [m]
+	double exitvx; ///< x component of velocity when leaving or stopping [m/s]
+	double exitvy; ///< y component of velocity when leaving or stopping [m/s]
+	double exitvz; ///< z component of velocity when leaving or stopping [m/s]
+	double weightratio; ///< Ratio of statistical weights when leaving or stopping and when entering
+	double stopID; ///< 0 if the particle left the section through the exit solid, stop ID of the particle otherwise
+};
+
+const char TRANSFER_HEADER[] = "PENTrack transfer 1\n"; ///< First line of transfer files, changed when the format of TTransferRecord changes
+
+
+/**
+ * Outcomes of particles passing a guide section, binned by speed and angle of their velocity to the guide axis when entering it
+ *
+ * A particle entering the section is moved to the exit (or loss) state of a record drawn from the bin of its entry velocity.
+ * Bins span the range of recorded entry speeds and the full range of angles.
+ */
+class TTransferTable{
+private:
+	std::vector<TTransferRecord> records; ///< Records sorted by bin
+	std::vector<std::size_t> binstart; ///< Index of first record in each bin, with an additional entry for the end of the last bin
+	std::array<double, 3> axis; ///< Unit vector along guide axis at the entrance
+	double vmin; ///< Lower edge of speed bins [m/s]
+	double vmax; ///< Upper edge of speed bins [m/s]
+	unsigned nspeed; ///< Number of speed bins
+	unsigned nangle; ///< Number of bins in cosine of the angle between velocity and axis
+
+	/**
+	 * Find bin of entry velocity
+	 *
+	 * @param v Velocity [m/s]
+	 *
+	 * @return Returns index of bin, or number of bins if the speed is outside the recorded range
+	 */
+	std::size_t Bin(const double v[3]) const;
+public:
+	/**
+	 * Constructor, reads records from transfer files
+	 *
+	 * @param files Transfer files written by TLogger::PrintTransfer
+	 * @param guideaxis Direction of the guide axis at its entrance, normalized by the constructor
+	 * @param speedbins Number of bins in speed
+	 * @param anglebins Number of bins in cosine of the angle between velocity and guide axis
+	 */
+	TTransferTable(const std::vector<std::string> &files, const std::array<double, 3> &guideaxis, const unsigned speedbins, const unsigned anglebins);
+
+	/**
+	 * Draw the outcome of a particle entering the guide section
+	 *
+	 * @param v Velocity of particle when entering the section [m/s]
+	 * @param mc Random-number generator
+	 *
+	 * @return Returns random record from the bin of v, or nullptr if the bin contains no records
+	 */
+	const TTransferRecord* Sample(const double v[3], TMCGenerator &mc) const;
+
+	/**
+	 * Number of records in table
+	 */
+	std::size_t size() const{ return records.size(); }
+};
+
+#endif // TRANSFER_H_
@@ -0,0 +1,195 @@
+/**
+ * \file
+ * Bounding-volume hierarchy over triangles, as a faster alternative to the CGAL AABB tree for segment-triangle intersection tests.
+ */
+
+#ifndef TRIANGLEBVH_H_
+#define TRIANGLEBVH_H_
+
+#include <array>
+#include <vector>
+#include <cstdint>
+
+/**
+ * Bounding-volume hierarchy with four children per node and triangles stored in packets of four.
+ *
+ * Boxes of all children of a node and all triangles of a packet are stored as structures of arrays, so a segment is tested against four of them at once
+ * in loops the compiler vectorizes with SIMD instructions. Triangles are tested with the Moeller-Trumbore algorithm.
+ * If it reports a crossing close to an edge or a segment almost parallel to a triangle, the triangle is tested again with the watertight algorithm of Woop, Benthin and Wald
+ * (J. Computer Graphics Techniques 2, 65 (2013)), so segments crossing a shared edge of two triangles are never missed.
+ */
+class TTriangleBVH{
+public:
+	static const int width = 4; ///< Number of children of each node and of triangles in each packet
+	static const int segmentpacket = 16; ///< Number of segments traversing the hierarchy together, see Intersect of several segments
+	typedef std::array<double, 3> TVertex; ///< Vertex of a triangle
+	typedef std::array<TVertex, 3> TTriangle; ///< Vertices of a triangle
+
+	/**
+	 * Intersection of a segment with a triangle, returned by Intersect
+	 */
+	struct THit{
+		double t; ///< Parametric coordinate of intersection point along segment (P = p1 + t*(p2 - p1))
+		std::size_t triangle; ///< Index of intersected triangle in list passed to constructor
+		TVertex point; ///< Intersection point
+	};
+
+private:
+	/**
+	 * Node of the hierarchy, containing boxes of its four children
+	 */
+	struct TNode{
+		double min[3][width]; ///< Lower corner of each child's box along each axis
+		double max[3][width]; ///< Upper corner of each child's box along each axis
+		std::uint32_t child[width]; ///< Index of child node, or of first packet if child is a leaf (maximum value: empty slot)
+		std::uint32_t packets[width]; ///< Number of packets in leaf child (0: child is a node)
+	};
+
+	/**
+	 * Four triangles prepared for the Moeller-Trumbore test
+	 */
+	struct TPacket{
+		double v0[3][width]; ///< First vertex of each triangle
+		double e1[3][width]; ///< Edge from first to second vertex
+		double e2[3][width]; ///< Edge from first to third vertex
+		double scale[width]; ///< Product of squared lengths of edges, determinants much smaller than this are treated as parallel segment
+		std::uint32_t triangle[width]; ///< Index of each triangle in list passed to constructor (unused lanes have zero edges and never report an intersection)
+	};
+
+	std::vector<TTriangle> triangles; ///< Triangles in order passed to constructor
+	std::vector<TNode> nodes; ///< Nodes of hierarchy, first node is root
+	std::vector<TPacket> packets; ///< Packets of triangles in leaves
+
+	/**
+	 * Build subtree containing a range of triangles
+	 *
+	 * The range is split into four parts at the median of the triangles' centroids along the axis in which they are spread the most, first into two halves, then each half again.
+	 * Parts containing at most maxleaf triangles become leaves.
+	 *
+	 * @param order Indices of triangles, reordered during build
+	 * @param centroids Centroid of each triangle
+	 * @param begin First index in order belonging to subtree
+	 * @param end Index in order after last triangle belonging to subtree
+	 *
+	 * @return Returns index of root node of subtree
+	 */
+	std::uint32_t Build(std::vector<std::uint32_t> &order, const std::vector<TVertex> &centroids, const std::size_t begin, const std::size_t end);
+
+	/**
+	 * Set box of a node's child to the padded bounding box of a range of triangles
+	 *
+	 * @param node Index of node
+	 * @param slot Child slot of node
+	 * @param order Indices of triangles
+	 * @param begin First index in order belonging to child
+	 * @param end Index in order after last triangle belonging to child
+	 */
+	void SetBox(const std::uint32_t node, const int slot, const std::vector<std::uint32_t> &order, const std::size_t begin, const std::size_t end);
+
+	/**
+	 * Add leaf containing a range of triangles to a node
+	 *
+	 * @param node Index of node
+	 * @param slot Child slot of node the leaf is assigned to
+	 * @param order Indices of triangles
+	 * @param begin First index in order belonging to leaf
+	 * @param end Index in order after last triangle belonging to leaf
+	 */
+	void AddLeaf(const std::uint32_t node, const int slot, const std::vector<std::uint32_t> &order, const std::size_t begin, const std::size_t end);
+
+	/**
+	 * Test segment with watertight segment-triangle test
+	 *
+	 * @param p1 Start point of segment
+	 * @param d Vector from start to end point of segment
+	 * @param triangle Index of triangle
+	 * @param t Returns parametric coordinate along segment of intersection
+	 *
+	 * @return Returns true if segment intersects triangle
+	 */
+	bool WatertightIntersection(const double p1[3], const double d[3], const std::size_t triangle, double &t) const;
+
+	/**
+	 * Find intersections of line segment with triangles in a subtree
+	 *
+	 * @param root Index of root node of subtree
+	 * @param p1 Start point of segment
+	 * @param d Vector from start to end point of segment
+	 * @param hits Intersections are appended to this list
+	 */
+	void IntersectSubtree(const std::uint32_t root, const double p1[3], const double d[3], std::vector<THit> &hits) const;
+
+	/**
+	 * Test segment with the four triangles of a packet
+	 *
+	 * @param packet Packet of triangles
+	 * @param p1 Start point of segment
+	 * @param d Vector from start to end point of segment
+	 * @param dd Squared length of segment
+	 * @param hits Intersections are appended to this list
+	 */
+	void IntersectTriangles(const TPacket &packet, const double p1[3], const double d[3], const double dd, std::vector<THit> &hits) const;
+
+	/**
+	 * Find intersections of up to segmentpacket segments with triangles, traversing the hierarchy once for all of them
+	 *
+	 * @param segments Indices of segments in p1 and p2
+	 * @param count Number of segments
+	 * @param p1 Start points of segments
+	 * @param p2 End points of segments
+	 * @param hits Intersections of each segment are appended to the list with the same index
+	 */
+	void IntersectPacket(const std::uint32_t *segments, const int count, const std::vector<TVertex> &p1, const std::vector<TVertex> &p2, std::vector<std::vector<THit> > &hits) const;
+
+public:
+	static const std::size_t maxleaf = 2*width; ///< Maximum number of triangles in a leaf
+
+	/**
+	 * Constructor, builds hierarchy
+	 *
+	 * @param tris List of triangles
+	 */
+	TTriangleBVH(const std::vector<TTriangle> &tris);
+
+	/**
+	 * Find intersections of line segment p1->p2 with triangles
+	 *
+	 * Segments lying in the plane of a triangle do not intersect it.
+	 *
+	 * @param p1 Start point of segment
+	 * @param p2 End point of segment
+	 * @param hits Returns list of intersections in no particular order
+	 */
+	void Intersect(const double p1[3], const double p2[3], std::vector<THit> &hits) const;
+
+	/**
+	 * Find intersections of several line segments with triangles
+	 *
+	 * Segments are sorted along a Morton curve through the hierarchy's bounding box and grouped into packets of segmentpacket segments, so segments close to each other share a packet.
+	 * Each packet traverses the hierarchy once, testing all its segments against the boxes of a node at once in loops the compiler vectorizes,
+	 * and descends only into boxes hit by at least one of them. Triangles in leaves are tested for each segment hitting the leaf's box.
+	 * Subtrees entered by only a few segments of a packet are traversed by each of them on its own.
+	 * The intersections of each segment are the same, and found in the same order, as with Intersect for this segment alone.
+	 *
+	 * @param p1 Start points of segments
+	 * @param p2 End points of segments, same size as p1
+	 * @param hits Returns list of intersections of each segment in no particular order, in the same order as p1
+	 */
+	void Intersect(const std::vector<TVertex> &p1, const std::vector<TVertex> &p2, std::vector<std::vector<THit> > &hits) const;
+
+	/**
+	 * Get number of nodes
+	 *
+	 * @return Returns number of nodes
+	 */
+	std::size_t NodeCount() const{ return nodes.size(); }
+
+	/**
+	 * Get memory used by triangles, nodes, and packets
+	 *
+	 * @return Returns size [bytes]
+	 */
+	std::size_t MemoryUsage() const{ return triangles.capacity()*sizeof(TTriangle) + nodes.capacity()*sizeof(TNode) + packets.capacity()*sizeof(TPacket); }
+};
+
+#endif // TRIANGLEBVH_H_
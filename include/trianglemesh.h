@@ -25,31 +25,133 @@
 #include <vector>
 #include <memory>
 #include <random>
+#include <array>
+#include <cstdint>
+#include <cmath>
 
 #include <algorithm>
 
+#include <boost/filesystem.hpp>
+
 #include <CGAL/Simple_cartesian.h>
 #include <CGAL/AABB_tree.h>
 #include <CGAL/AABB_traits.h>
-#include <CGAL/AABB_face_graph_triangle_primitive.h>
-#include <CGAL/Surface_mesh.h>
-#include <CGAL/Side_of_triangle_mesh.h>
-#include <CGAL/Polygon_mesh_processing/compute_normal.h>
+
+#include "mc.h"
+#include "trianglebvh.h"
 
 static const double REFLECT_TOLERANCE = 1e-8;  ///< max distance of reflection point to actual surface collision point
+static const double COLLISION_CACHE_PADDING = 2; ///< Box of a TCollisionCache extends this many segment lengths beyond the segment it was built for
+static const std::size_t COLLISION_CACHE_MAX_TRIANGLES = 16; ///< Boxes of a TCollisionCache intersecting more triangles are not cached
 
 typedef CGAL::Simple_cartesian<double> CKernel; ///< Geometric Kernel used for CGAL types
 typedef CKernel::Segment_3 CSegment; ///< CGAL segment type
 typedef CKernel::Point_3 CPoint; ///< CGAL point type
 typedef CKernel::Vector_3 CVector; ///< CGAL vector type
 typedef CKernel::Iso_cuboid_3 CCuboid; ///< CGAL cuboid type
+typedef CKernel::Aff_transformation_3 CTransformation; ///< CGAL affine transformation type, used for rigid transformations of instances of STL files
+
+typedef std::array<CPoint, 3> CTriangleVertices; ///< Vertices of a triangle
+
+
+/**
+ * Triangles of a mesh stored in flat arrays, each triangle refers to its vertices by 32-bit indices
+ *
+ * Replaces the half-edge mesh the triangles are validated with, since tracking only needs the triangles, so very large geometries fit into memory.
+ */
+struct TCompactMesh{
+	std::vector<CPoint> points; ///< Vertices
+	std::vector<std::array<std::uint32_t, 3> > faces; ///< Vertex indices of each triangle, in the order of vertices_around_face in the validated mesh
+	std::vector<CVector> normals; ///< Unit normal of each triangle
+	std::vector<std::uint16_t> tags; ///< Surface tag of each triangle, see TCollision::tag
+	double area = 0; ///< Total area of triangles
+
+	/**
+	 * Get triangle
+	 *
+	 * @param face Index of triangle
+	 *
+	 * @return Returns triangle, with its vertices in the same order as in faces
+	 */
+	CKernel::Triangle_3 Triangle(const std::uint32_t face) const{
+		const std::array<std::uint32_t, 3> &f = faces[face];
+		return CKernel::Triangle_3(points[f[0]], points[f[1]], points[f[2]]);
+	}
 
-typedef CGAL::Surface_mesh<CPoint> CMesh; ///< CGAL triangle mesh type
-typedef CGAL::AABB_face_graph_triangle_primitive<CMesh> CPrimitive; ///< CGAL triangle type contained in AABB tree
+	/**
+	 * Get vertices of triangle
+	 *
+	 * @param face Index of triangle
+	 *
+	 * @return Returns vertices, in the same order as in faces
+	 */
+	CTriangleVertices Vertices(const std::uint32_t face) const{
+		const std::array<std::uint32_t, 3> &f = faces[face];
+		return {{points[f[0]], points[f[1]], points[f[2]]}};
+	}
+};
+
+
+/**
+ * Triangle contained in the AABB tree of a TCompactMesh
+ *
+ * Only stores the index of the triangle, its vertices are looked up in the mesh shared by all primitives of the tree.
+ */
+class CPrimitive{
+public:
+	typedef std::uint32_t Id; ///< Index of triangle in mesh
+	typedef CPoint Point; ///< Point type
+	typedef CKernel::Triangle_3 Datum; ///< Triangle type
+	typedef const TCompactMesh* Shared_data; ///< Mesh containing the triangle, stored once in the tree's traits
+private:
+	Id face; ///< Index of triangle in mesh
+public:
+	CPrimitive(): face(0){ }
+	/**
+	 * Constructor, called by the AABB tree for each index in a range of triangle indices
+	 *
+	 * @param it Iterator pointing to index of triangle
+	 */
+	template<class Iterator> CPrimitive(Iterator it, const TCompactMesh&): face(*it){ }
+	Id id() const{ return face; } ///< Returns index of triangle
+	Datum datum(const Shared_data mesh) const{ return mesh->Triangle(face); } ///< Returns triangle
+	Point reference_point(const Shared_data mesh) const{ return mesh->points[mesh->faces[face][0]]; } ///< Returns first vertex of triangle
+	static Shared_data construct_shared_data(const TCompactMesh &mesh){ return &mesh; } ///< Returns mesh shared by all primitives of a tree
+};
 typedef CGAL::AABB_traits<CKernel, CPrimitive> CTraits; ///< CGAL triangle traits type
 typedef CGAL::AABB_tree<CTraits> CTree; ///< CGAL AABB tree type containing CPrimitives
-typedef boost::optional< CTree::Intersection_and_primitive_id<CSegment>::Type > CIntersection; ///< CGAL segment-triangle intersection type
+typedef CTree::Intersection_and_primitive_id<CSegment>::Type CIntersection; ///< CGAL segment-triangle intersection type, paired with intersected triangle
+
+
+/**
+ * Triangle contained in an AABB tree over several meshes, its ID also contains the mesh
+ */
+class CGlobalPrimitive{
+public:
+	typedef std::pair<std::uint32_t, const TCompactMesh*> Id; ///< Index of triangle and mesh containing it
+	typedef CPoint Point; ///< Point type
+	typedef CKernel::Triangle_3 Datum; ///< Triangle type
+private:
+	Id triangle; ///< Index of triangle and mesh containing it
+public:
+	CGlobalPrimitive(): triangle(0, nullptr){ }
+	/**
+	 * Constructor, called by the AABB tree for each index in a range of triangle indices
+	 *
+	 * @param it Iterator pointing to index of triangle
+	 * @param mesh Mesh containing the triangle
+	 */
+	template<class Iterator> CGlobalPrimitive(Iterator it, const TCompactMesh &mesh): triangle(*it, &mesh){ }
+	Id id() const{ return triangle; } ///< Returns index of triangle and mesh containing it
+	Datum datum() const{ return triangle.second->Triangle(triangle.first); } ///< Returns triangle
+	Point reference_point() const{ return triangle.second->points[triangle.second->faces[triangle.first][0]]; } ///< Returns first vertex of triangle
+};
+typedef CGAL::AABB_traits<CKernel, CGlobalPrimitive> CGlobalTraits; ///< CGAL triangle traits type for AABB tree over several meshes
+typedef CGAL::AABB_tree<CGlobalTraits> CGlobalTree; ///< CGAL AABB tree type containing triangles of several meshes
+typedef CGlobalTree::Intersection_and_primitive_id<CSegment>::Type CGlobalIntersection; ///< CGAL segment-triangle intersection type of global tree, paired with intersected triangle
+
 
+static const std::uint32_t NO_TRIANGLE = 0xFFFFFFFF; ///< Triangle index of collisions with face planes of convex meshes and analytic primitives, see TCollision::triangle
 
 /**
  * Structure returned by TTriangleMesh::Collision.
@@ -58,7 +160,10 @@ struct TCollision{
 	double s; ///< parametric coordinate of intersection point (P = p1 + s*(p2 - p1))
 	double normal[3]; ///< normal (length = 1) of intersected surface
 	unsigned ID; ///< ID of solid the intersected surface belongs to
+	unsigned tag; ///< Surface tag of the intersected triangle, taken from the attribute bytes in the STL file (0: untagged)
+	std::uint32_t triangle; ///< Index of the intersected triangle in the mesh of its solid, NO_TRIANGLE if the surface was not tested triangle by triangle (see TTriangleMesh::ClosestTriangle)
 	double distnormal; ///< distance between start- and endpoint of colliding segment, projected onto normal direction
+	bool ignored; ///< set by TGeometry::GetCollisions if the solid is ignored at the time of the collision
 
 	/**
 	 * Create TCollision object
@@ -67,14 +172,19 @@ struct TCollision{
 	 * @param n Normal vector of hit surface
 	 * @param point Collision point
 	 * @param aID ID of hit surface
+	 * @param atag Surface tag of hit triangle
+	 * @param atriangle Index of hit triangle in mesh of solid
 	 */
-	TCollision(const CSegment &segment, const CVector &n, const CPoint &point, const unsigned aID){
+	TCollision(const CSegment &segment, const CVector &n, const CPoint &point, const unsigned aID, const unsigned atag = 0, const std::uint32_t atriangle = NO_TRIANGLE){
       s = /*std::min(1., std::max(0.,*/ (point - segment.start())*segment.to_vector()/segment.squared_length()/*))*/;
       ID = aID;
+      tag = atag;
+      triangle = atriangle;
       normal[0] = n[0];
       normal[1] = n[1];
       normal[2] = n[2];
       distnormal = segment.to_vector()*n;
+      ignored = false;
     };
 
 	/**
@@ -92,43 +202,334 @@ struct TCollision{
 
 
 
+/**
+ * Triangle of a mesh, returned by TTriangleMesh::GetTriangles
+ */
+struct TMeshTriangle{
+	CTriangleVertices vertices; ///< Vertices of triangle
+	CVector normal; ///< Unit normal of triangle
+	double area; ///< Area of triangle
+	unsigned ID; ///< ID of StL file the triangle belongs to
+};
+
+
+/**
+ * Face plane of a convex mesh, the volume bounded by the mesh lies behind all of its planes
+ */
+struct THalfSpace{
+	CVector normal; ///< Outward unit normal
+	double offset; ///< Distance of plane from origin along normal, points p with normal*p < offset lie behind the plane
+	std::uint16_t tag; ///< Surface tag of all triangles in the plane, see TCollision::tag
+};
+
+
+/**
+ * Regular grid of voxels covering a mesh, each classified as inside, outside, or on the boundary of the volume bounded by the mesh, see TTriangleMesh::ReadFile
+ */
+struct TVoxelGrid{
+	enum TState: std::uint8_t { outside = 0, inside = 1, boundary = 2 }; ///< State of a voxel, only points in boundary voxels have to be tested with a ray
+
+	unsigned resolution = 0; ///< Requested number of voxels along longest side of mesh's bounding box (0: no voxels)
+	std::array<std::uint64_t, 3> cells = {{0, 0, 0}}; ///< Number of voxels along each axis (0: mesh not classified)
+	std::array<double, 3> origin = {{0, 0, 0}}; ///< Lower corner of grid
+	std::array<double, 3> size = {{0, 0, 0}}; ///< Size of voxels along each axis
+	std::vector<std::uint8_t> states; ///< State of each voxel, with x index varying fastest (empty: every voxel is boundary)
+
+	/**
+	 * Get state of voxel containing a point
+	 *
+	 * @param x X coordinate of point
+	 * @param y Y coordinate of point
+	 * @param z Z coordinate of point
+	 *
+	 * @return Returns state, points outside the grid are outside
+	 */
+	TState State(const double x, const double y, const double z) const{
+		if (states.empty())
+			return boundary;
+		const double p[3] = {x, y, z};
+		std::uint64_t index = 0;
+		for (int i = 2; i >= 0; --i){
+			double c = std::floor((p[i] - origin[i])/size[i]);
+			if (not (c >= 0 && c < cells[i]))
+				return outside;
+			index = index*cells[i] + static_cast<std::uint64_t>(c);
+		}
+		return static_cast<TState>(states[index]);
+	}
+};
+
+
+/**
+ * Triangles close to previous collision tests along a trajectory, see TTriangleMesh::Collision
+ */
+struct TCollisionCache{
+	/**
+	 * Triangle intersecting the box of the cache
+	 */
+	struct TTriangle{
+		unsigned mesh; ///< Index of mesh
+		std::uint32_t face; ///< Index of triangle in mesh
+		CGAL::Bbox_3 bbox; ///< Bounding box of triangle
+	};
+	bool valid = false; ///< True if box and triangles are valid
+	bool crowded = false; ///< True if the box intersects too many triangles to cache them, segments inside it are tested against the whole tree
+	CCuboid box; ///< Box around a previously tested segment
+	std::vector<TTriangle> triangles; ///< All triangles intersecting the box
+	std::array<double, 3> origin = {{0, 0, 0}}; ///< Center of box, single-precision coordinates of triangles are relative to it
+	float vertices[3][3][COLLISION_CACHE_MAX_TRIANGLES]; ///< Single-precision coordinates of each triangle's vertices relative to origin, indexed by vertex, axis, and triangle, used to filter triangles a segment certainly misses
+	float plane[4][COLLISION_CACHE_MAX_TRIANGLES]; ///< Unit normal of each triangle and distance of its plane from origin, computed in double precision and rounded to single precision
+	float extent[COLLISION_CACHE_MAX_TRIANGLES]; ///< Largest absolute single-precision coordinate of each triangle's vertices
+};
+
+
 /**
  * Class to hold your STL geometry and do intersection tests.
  */
 class TTriangleMesh{
 private:
 	/**
-	 * Class containing triangle mesh and AABB tree for each loaded StL file
+	 * Class containing triangles and AABB tree for each loaded StL file
 	 */
     struct CTriangleMesh{
-        std::unique_ptr<CMesh> mesh; ///< Triangle mesh
+        std::unique_ptr<TCompactMesh> mesh; ///< Triangles, allocated separately so the trees referring to them stay valid when the list of meshes grows
         std::unique_ptr<CTree> tree; ///< Axis-aligned bounding-box tree for fast intersection search
         int ID; ///< unique ID for each StL file
         std::discrete_distribution<size_t> triangle_sampler; ///< Probability distribution to randomly sample triangles from mesh weighted by their areas.
+        TVoxelGrid voxels; ///< Classification of points inside, outside, or close to the mesh, so only points close to it have to be tested with a ray
+        std::vector<THalfSpace> halfspaces; ///< Face planes if the mesh is a single convex volume (empty: not convex), replace rays and triangle tests
     };
 	std::vector<CTriangleMesh> meshes; ///< List of triangle meshes from all loaded StL files
+	std::vector<CGAL::Bbox_3> meshboxes; ///< Bounding box of each mesh, in the same order as meshes
+	CGAL::Bbox_3 boundingbox; ///< Overall bounding box containing all meshes, updated when meshes are added
 	std::discrete_distribution<size_t> mesh_sampler; ///< Probability distribution to randomly sample meshes weighted by their areas
+	std::unique_ptr<CGlobalTree> globaltree; ///< Optional AABB tree containing triangles of all meshes, replaces queries of each mesh's tree if built
+	std::unique_ptr<TTriangleBVH> bvh; ///< Optional bounding-volume hierarchy containing triangles of all meshes, replaces collision queries of AABB trees if built
+	std::vector<std::pair<unsigned, std::uint32_t> > bvhfaces; ///< Index in meshes and face of each triangle in bvh
+
+	/**
+	 * Box of the decomposition of the volume bounded by the meshes, see BuildVolumeCells
+	 */
+	struct TVolumeCell{
+		CCuboid box; ///< Box
+		bool inside; ///< True if the box contains no triangles and lies completely inside the volume, false if it contains triangles
+	};
+	std::vector<TVolumeCell> volumecells; ///< Boxes covering the volume bounded by the meshes, built by BuildVolumeCells
+	std::alias_distribution<size_t> volumecell_sampler; ///< Probability distribution to randomly sample volume cells weighted by their volumes
+
+	/**
+	 * Find entry in meshes belonging to a mesh contained in the global tree
+	 *
+	 * @param mesh Pointer to mesh
+	 *
+	 * @return Returns triangles, AABB tree and ID of StL file the mesh was read from
+	 */
+	const CTriangleMesh& GetMesh(const TCompactMesh *mesh) const{
+		return *std::find_if(meshes.begin(), meshes.end(), [mesh](const CTriangleMesh &m){ return m.mesh.get() == mesh; });
+	}
+
+	/**
+	 * Count intersections of a vertical ray starting at point p with each mesh
+	 *
+	 * @param x X coordinate of point
+	 * @param y Y coordinate of point
+	 * @param z Z coordinate of point
+	 *
+	 * @return Returns number of intersections for each mesh, in the same order as meshes
+	 */
+	std::vector<size_t> CountRayIntersections(const double x, const double y, const double z) const;
+
+	/**
+	 * Check if a point lies inside a convex mesh
+	 *
+	 * @param m Mesh with face planes
+	 * @param x X coordinate of point
+	 * @param y Y coordinate of point
+	 * @param z Z coordinate of point
+	 *
+	 * @return Returns true if the point lies behind all face planes
+	 */
+	static bool InConvex(const CTriangleMesh &m, const double x, const double y, const double z){
+		for (const THalfSpace &h: m.halfspaces){
+			if (h.normal.x()*x + h.normal.y()*y + h.normal.z()*z >= h.offset)
+				return false;
+		}
+		return true;
+	}
+
+	/**
+	 * Clip segment with a convex mesh (Cyrus-Beck algorithm) and add the points where it enters and leaves the mesh to a list of collisions
+	 *
+	 * @param m Mesh with face planes
+	 * @param segment Segment
+	 * @param colls List of collisions sorted like the result of Collision, new collisions are inserted in order
+	 */
+	static void ConvexCollisions(const CTriangleMesh &m, const CSegment &segment, std::vector<TCollision> &colls);
+
+	/**
+	 * Check if a mesh uses the convex fast path in collision tests, which is not used if all meshes are searched in a global tree or bounding-volume hierarchy
+	 *
+	 * @param m Mesh
+	 *
+	 * @return Returns true if the mesh is convex and collisions are tested with its face planes
+	 */
+	bool ConvexCollisionTest(const CTriangleMesh &m) const{ return not m.halfspaces.empty() && not globaltree && not bvh; }
+
+	/**
+	 * Find cached triangles that a segment certainly misses
+	 *
+	 * The segment is tested against all triangles in the cache at once, in a loop the compiler vectorizes with single-precision SIMD instructions.
+	 * A triangle is missed if both end points lie on the same side of its plane, or if its edges pass the line through the segment on different sides.
+	 * Each of these distances and orientations is only trusted if it exceeds a conservative bound on its rounding error, so the double-precision test would reject a missed triangle as well.
+	 *
+	 * @param cache Collision cache
+	 * @param p1 Start point of segment
+	 * @param p2 End point of segment
+	 * @param missed Returns 1 for each triangle the segment certainly misses, 0 if it has to be tested in double precision
+	 */
+	static void FilterCachedTriangles(const TCollisionCache &cache, const double p1[3], const double p2[3], float missed[COLLISION_CACHE_MAX_TRIANGLES]);
+
+	/**
+	 * Add intersections of a segment found in the bounding-volume hierarchy to a list of collisions
+	 *
+	 * @param segment Segment
+	 * @param hits Intersections of segment with triangles in bvh
+	 * @param colls Collisions are inserted sorted by ascending distance from the start of the segment and descending ID
+	 */
+	void AddBVHCollisions(const CSegment &segment, const std::vector<TTriangleBVH::THit> &hits, std::vector<TCollision> &colls) const;
 
 public:
 	/**
 	 * Read STL-file.
 	 *
+	 * The triangles are repaired and each connected component is checked for holes and self-intersections.
+	 * If a cache directory is given, the repaired mesh, its normals, and the validation results are stored there in a binary file identified by a hash of the STL file,
+	 * and loaded from it by later runs instead of validating the mesh again.
+	 * Closed meshes are covered by a grid of voxels, which are classified as inside, outside, or intersected by triangles, and stored in the cache together with the mesh.
+	 * InSolid and GetSolids only cast rays for points in voxels intersected by triangles.
+	 * Only the triangles of the validated mesh are kept, see TCompactMesh.
+	 *
 	 * @param filename Filename of STL file
 	 * @param ID ID of solid assigned to this STL file
+	 * @param cachedir Directory in which validated meshes are cached (empty: no cache)
+	 * @param voxelresolution Number of voxels along the longest side of the mesh's bounding box (0: no voxels, always cast rays)
 	 *
 	 * @return Returns name of mesh in file
 	 */
-	std::string ReadFile(const std::string &filename, const int ID);
+	std::string ReadFile(const std::string &filename, const int ID, const boost::filesystem::path &cachedir = boost::filesystem::path(), const unsigned voxelresolution = 64);
+
+	/**
+	 * Read several STL-files in parallel, see ReadFile.
+	 *
+	 * Each thread reads, validates and builds the search tree of one file at a time. Meshes are added and messages printed in the order of the list,
+	 * so the result does not depend on the number of threads.
+	 *
+	 * A file can be placed several times with different rigid transformations, e.g. identical segments of a guide.
+	 * It is then read and validated only once, and the transformed copies are combined into a single mesh with a single search tree.
+	 *
+	 * @param files List of filenames of STL files and IDs of solids assigned to them
+	 * @param cachedir Directory in which validated meshes are cached (empty: no cache)
+	 * @param nthreads Number of threads
+	 * @param voxelresolution Number of voxels along the longest side of each mesh's bounding box (0: no voxels, always cast rays)
+	 * @param instances Transformations of the instances of each file, in the same order as files (missing or empty: file is used as it is)
+	 *
+	 * @return Returns names of meshes in files, in the same order as files
+	 */
+	std::vector<std::string> ReadFiles(const std::vector<std::pair<std::string, int> > &files, const boost::filesystem::path &cachedir = boost::filesystem::path(),
+			const unsigned nthreads = 1, const unsigned voxelresolution = 64, const std::vector<std::vector<CTransformation> > &instances = {});
+
+	/**
+	 * Build a single AABB tree containing the triangles of all previously read files.
+	 *
+	 * Afterwards, collision, inside and distance tests traverse this tree once instead of the tree of each file.
+	 * Must be called again if more files are read.
+	 */
+	void BuildGlobalTree();
+
+	/**
+	 * Build a bounding-volume hierarchy containing the triangles of all previously read files, see TTriangleBVH.
+	 *
+	 * Afterwards, collision tests use this hierarchy instead of the AABB trees. Other tests still use the AABB trees.
+	 * Must be called again if more files are read.
+	 */
+	void BuildBVH();
+
+	/**
+	 * Decompose the volume bounded by all previously read files into boxes, which RandomPointInVolume samples from.
+	 *
+	 * Starting with the bounding box, boxes intersected by triangles are split into eight until they make up less than a given fraction of the volume,
+	 * or the number of boxes would exceed a limit. Boxes without triangles are kept if their center is inside the volume.
+	 * Must be called again if more files are read.
+	 *
+	 * @param maxboundaryfraction Maximum volume of boxes intersected by triangles relative to volume of all boxes
+	 * @param maxcells Maximum number of boxes
+	 */
+	void BuildVolumeCells(const double maxboundaryfraction = 0.05, const size_t maxcells = 1000000);
 
 	/**
 	 * Test line segment p1->p2 for collision with all triangles in previously read files.
 	 *
+	 * Collisions are written into a list owned by the caller, so it can be reused without allocating memory for every test.
+	 * A segment lying in the plane of a triangle does not cross it, so it does not collide with it, like a segment parallel to a face of a convex mesh or to a triangle in the bounding-volume hierarchy.
+	 * A segment through an edge or vertex shared by several triangles collides with each of them at the same point.
+	 *
+	 * @param p1 Line start point
+	 * @param p2 Line end point
+	 * @param colls Returns collisions, sorted by ascending distance from p1 and descending ID
+	 */
+	void Collision(const double p1[3], const double p2[3], std::vector<TCollision> &colls) const;
+
+	/**
+	 * Test line segment p1->p2 for collision with all triangles in previously read files, using a cache of triangles close to previous segments
+	 *
+	 * Successive segments of a trajectory are close to each other. If the segment lies inside the cache's box, it is only tested against the triangles intersecting the box,
+	 * with the same intersection test the AABB trees use, so the result is the same as without cache.
+	 * Triangles are first tested with all cached triangles at once in single precision, see FilterCachedTriangles,
+	 * and only triangles the segment does not certainly miss are tested with the double-precision test.
+	 * Otherwise the box is moved to the segment's bounding box extended by COLLISION_CACHE_PADDING segment lengths and filled with the triangles intersecting it.
+	 * If the box intersects more than COLLISION_CACHE_MAX_TRIANGLES triangles, this and later segments inside the box are tested against the full tree.
+	 * The bounding-volume hierarchy is not cached.
+	 *
 	 * @param p1 Line start point
 	 * @param p2 Line end point
+	 * @param colls Returns collisions, sorted by ascending distance from p1 and descending ID
+	 * @param cache Cache owned by the caller, e.g. one per tracked particle, updated if the segment leaves its box
+	 */
+	void Collision(const double p1[3], const double p2[3], std::vector<TCollision> &colls, TCollisionCache &cache) const;
+
+	/**
+	 * Test several line segments for collision with all triangles in previously read files, e.g. the steps of a batch of particles
+	 *
+	 * If the bounding-volume hierarchy was built, the segments traverse it together in packets, see TTriangleBVH::Intersect. Otherwise each segment is tested on its own.
+	 * The collisions of each segment are the same as returned by Collision for this segment alone.
+	 *
+	 * @param p1 Start point of each segment
+	 * @param p2 End point of each segment, same size as p1
+	 * @param colls Returns collisions of each segment, in the same order as p1, each sorted by ascending distance from its start point and descending ID
+	 */
+	void Collision(const std::vector<std::array<double, 3> > &p1, const std::vector<std::array<double, 3> > &p2, std::vector<std::vector<TCollision> > &colls) const;
+
+	/**
+	 * Check if any triangle of all previously read files intersects a box
+	 *
+	 * @param box Box
 	 *
-	 * @return Returns vector containing collisions
+	 * @return Returns true if a triangle intersects the box
 	 */
-	std::vector<TCollision> Collision(const std::vector<double> &p1, const std::vector<double> &p2) const;
+	bool IntersectsBox(const CCuboid &box) const;
+
+	/**
+	 * Calculate distance of point to closest triangle of all previously read files
+	 *
+	 * Uses the distance-query acceleration of the AABB trees.
+	 *
+	 * @param x X coordinate of point
+	 * @param y Y coordinate of point
+	 * @param z Z coordinate of point
+	 *
+	 * @return Returns distance to closest triangle, infinity if no meshes were loaded
+	 */
+	double Distance(const double x, const double y, const double z) const;
 
 	/**
 	 * Test if point is inside the mesh
@@ -147,9 +548,16 @@ public:
 	 * @return Overall bounding box.
 	 */
 	CCuboid GetBoundingBox() const{
-	    std::vector<CCuboid> b;
-	    std::transform(meshes.begin(), meshes.end(), std::back_inserter(b), [](const CTriangleMesh &m){ return m.tree->bbox(); });
-	    return CGAL::bbox_3(b.begin(), b.end());
+	    return boundingbox;
+	}
+
+	/**
+	 * Get bounding boxes of each mesh
+	 *
+	 * @return List of bounding boxes, one for each loaded StL file
+	 */
+	const std::vector<CGAL::Bbox_3>& GetMeshBoundingBoxes() const{
+	    return meshboxes;
 	}
 
 	/**
@@ -173,18 +581,27 @@ public:
 		return InSolid(p[0], p[1], p[2]);
 	}
 
+	/**
+	 * Return list of solids the point is inside of
+	 *
+	 * Rays are only cast for meshes whose voxel containing the point is intersected by triangles.
+	 *
+	 * @param x X coordinate of point
+	 * @param y Y coordinate of point
+	 * @param z Z coordinate of point
+	 * @param outside ID of a solid the point is known to lie outside of, e.g. because it lies just in front of one of its triangles, its mesh is not tested (-1: test all meshes)
+	 *
+	 * @return List of solid IDs
+	 */
+	std::vector<unsigned> GetSolids(const double x, const double y, const double z, const int outside = -1) const;
+
 	/**
 	 * Return list of solids the point is inside of
 	 * @param p Point
 	 * @return List of solid IDs
 	 */
     template<class Point> std::vector<unsigned> GetSolids(Point p) const{
-        std::vector<unsigned> solids;
-        for (auto &m: meshes){
-            if (m.tree->number_of_intersected_primitives(CKernel::Ray_3(CPoint(p[0],p[1],p[2]), CVector(0., 0., 1.))) % 2 != 0)
-                solids.push_back(m.ID);
-        }
-        return solids;
+        return GetSolids(p[0], p[1], p[2]);
     }
 
 	/**
@@ -195,7 +612,7 @@ public:
 	 * @return Returns true if point is contained in bounding box
 	 */
 	template<class Object> bool InBoundingBox(Object p) const{
-        return std::any_of(meshes.begin(), meshes.end(), [&p](const CTriangleMesh &mesh){ return CGAL::do_intersect(p, mesh.tree->bbox()); });
+        return std::any_of(meshboxes.begin(), meshboxes.end(), [&p](const CGAL::Bbox_3 &b){ return CGAL::do_intersect(p, b); });
 	}
 
 	/**
@@ -213,33 +630,93 @@ public:
             meshidx = mesh_sampler(rand);
         }while (not CGAL::do_intersect(meshes[meshidx].tree->bbox(), bbox));
         ID = meshes[meshidx].ID;
-        CMesh::Face_index faceidx(meshes[meshidx].triangle_sampler(rand));
-        std::vector<CPoint> vertices;
-        for (auto v: meshes[meshidx].mesh->vertices_around_face(meshes[meshidx].mesh->halfedge(faceidx))) {
-            vertices.push_back(meshes[meshidx].mesh->point(v));
-        }
+        std::uint32_t faceidx = meshes[meshidx].triangle_sampler(rand);
+        CPoint pp = RandomPointOnTriangle(meshes[meshidx].mesh->Vertices(faceidx), rand);
+        const CVector &nv = meshes[meshidx].mesh->normals[faceidx];
+        p = {pp.x(), pp.y(), pp.z()};
+        n = {nv.x(), nv.y(), nv.z()};
+	}
+
+	/**
+	 * Return uniformly distributed random point on triangle (see Numerical Recipes 3rd ed., p. 1114)
+	 *
+	 * @param vertices Vertices of triangle
+	 * @param rand Random number generator
+	 *
+	 * @return Point
+	 */
+	template<class RandomGenerator> static CPoint RandomPointOnTriangle(const CTriangleVertices &vertices, RandomGenerator &rand){
         std::uniform_real_distribution<double> unidist(0, 1);
-        double a = unidist(rand); // generate random point on triangle (see Numerical Recipes 3rd ed., p. 1114)
+        double a = unidist(rand);
         double b = unidist(rand);
         if (a+b > 1){
             a = 1 - a;
             b = 1 - b;
         }
-        CPoint pp = vertices[0] + a*(vertices[1] - vertices[0]) + b*(vertices[2] - vertices[0]);
-        CVector nv = CGAL::Polygon_mesh_processing::compute_face_normal(faceidx, *meshes[meshidx].mesh);
-        p = {pp.x(), pp.y(), pp.z()};
-        n = {nv.x(), nv.y(), nv.z()};
+        return vertices[0] + a*(vertices[1] - vertices[0]) + b*(vertices[2] - vertices[0]);
 	}
 
+	/**
+	 * Get all triangles intersecting a box
+	 *
+	 * @param bbox Box
+	 *
+	 * @return Returns list of triangles with their normals, areas, and IDs
+	 */
+	std::vector<TMeshTriangle> GetTriangles(const CCuboid &bbox) const;
+
+	/**
+	 * Get vertices of all triangles of a solid
+	 *
+	 * @param ID ID of solid
+	 *
+	 * @return Returns vertices of each triangle, in the order of TCollision::triangle, empty if the solid has no mesh
+	 */
+	std::vector<CTriangleVertices> GetSolidTriangles(const unsigned ID) const;
+
+	/**
+	 * Find the triangle of a solid closest to a point, e.g. to identify the triangle hit on a face plane of a convex mesh
+	 *
+	 * @param ID ID of solid
+	 * @param p Point
+	 *
+	 * @return Returns index of triangle in mesh of solid, NO_TRIANGLE if the solid has no mesh
+	 */
+	std::uint32_t ClosestTriangle(const unsigned ID, const double p[3]) const;
+
+	/**
+	 * Get memory used by triangles, trees, voxel grids, and samplers of all meshes
+	 *
+	 * The nodes of CGAL's AABB trees and their point sets for distance queries are not accessible and estimated from the number of triangles.
+	 *
+	 * @return Returns approximate size [bytes]
+	 */
+	std::size_t MemoryUsage() const;
+
 	/**
 	 * Return random point in volume bounded by mesh
 	 * 
+	 * If BuildVolumeCells was called, the point is sampled in a random cell weighted by its volume and has to be checked with InSolid only if the cell contains triangles.
+	 * Otherwise, points are sampled in the bounding box until one is inside the mesh.
+	 *
 	 * @param rand Random number generator
 	 * 
 	 * @return Point
 	 */
 	template<class RandomGenerator> std::array<double, 3> RandomPointInVolume(RandomGenerator &rand) const{
         std::array<double, 3> p;
+        if (not volumecells.empty()){
+            std::uniform_real_distribution<double> unidist(0, 1);
+            const TVolumeCell *cell;
+            do{
+                cell = &volumecells[volumecell_sampler(rand)];
+                const CCuboid &b = cell->box;
+                p = {b.xmin() + unidist(rand)*(b.xmax() - b.xmin()),
+                     b.ymin() + unidist(rand)*(b.ymax() - b.ymin()),
+                     b.zmin() + unidist(rand)*(b.zmax() - b.zmin())};
+            }while (!cell->inside && !InSolid(p));
+            return p;
+        }
         do{
             p = RandomPointInBoundingBox(rand);
         }while (!InSolid(p));
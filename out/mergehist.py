@@ -0,0 +1,34 @@
+import re
+import os
+import sys
+
+# Add up histograms written by PENTrack (HISTOGRAMS section) of several jobs.
+# Usage: python mergehist.py file1.hist file2.hist ...
+# Writes one merged file <name>.hist for each histogram name into the current directory.
+
+merged = {}
+for fn in sys.argv[1:]:
+  match = re.match('\d+(_\d+)?(\w+)\.hist', os.path.basename(fn))
+  if not match:
+    print('Invalid filename ' + fn)
+    continue
+  name = match.group(2)
+  with open(fn) as f:
+    header = f.readline()
+    rows = [[float(v) for v in line.split()] for line in f if line.strip()]
+  if name not in merged:
+    merged[name] = (header, rows)
+    continue
+  total = merged[name][1]
+  if [r[:2] for r in total] != [r[:2] for r in rows]:
+    print('Binning of ' + fn + ' does not match, skipping it!')
+    continue
+  for t, r in zip(total, rows):
+    for i in range(2, len(t)):
+      t[i] += r[i]
+
+for name, (header, rows) in merged.items():
+  with open(name + '.hist', 'w') as f:
+    f.write(header)
+    for r in rows:
+      f.write(' '.join(repr(v) for v in r) + '\n')
@@ -0,0 +1,67 @@
+/**
+ * \file
+ * Python module wrapping TSimulation, built with cmake -DBUILD_PYTHON=ON.
+ *
+ * Example:
+ *
+ *     import pentrack
+ *     sim = pentrack.Simulation("in/config.in", {"GLOBAL.simtime": "100"}, seed=42)
+ *     result = sim.track(1000, nthreads=8)
+ *     print(result["stopID"], result["tend"])
+ *     sim.set_source({"Emax": "200e-9"})
+ *     sim.reconfigure({"MATERIALS.PolishedSteel": "183 0.0852 0 2e-5 2.6e-9 20e-9 0 0 0"})
+ */
+
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+#include <pybind11/stl.h>
+
+#include "pentrack.h"
+
+namespace py = pybind11;
+
+/**
+ * Track particles and convert the result to a dictionary of NumPy arrays, one per column
+ *
+ * @param sim Simulation
+ * @param count Number of primary particles
+ * @param firstparticle Number of first particle
+ * @param nthreads Number of threads
+ *
+ * @return Returns dictionary with one array per column of TTrackResult, and a list of particle names under key "name"
+ */
+static py::dict Track(TSimulation &sim, const long long count, const long long firstparticle, const int nthreads){
+	TTrackResult result;
+	{
+		py::gil_scoped_release release; // other Python threads may run while particles are tracked
+		result = sim.Track(count, firstparticle, nthreads);
+	}
+	py::dict d;
+	std::size_t rows = result.size(), ncolumns = result.columns.size();
+	for (std::size_t j = 0; j < ncolumns; ++j){
+		py::array_t<double> column(rows);
+		double *c = column.mutable_data();
+		for (std::size_t i = 0; i < rows; ++i)
+			c[i] = result.values[i*ncolumns + j];
+		d[py::str(result.columns[j])] = column;
+	}
+	d["name"] = py::cast(result.particles);
+	return d;
+}
+
+PYBIND11_MODULE(pentrack, m){
+	m.doc() = "Track particles with PENTrack inside a Python process";
+
+	py::class_<TSimulation>(m, "Simulation")
+		.def(py::init<const std::string&, const std::map<std::string, std::string>&, std::uint64_t, long long, const std::string&, bool>(),
+				py::arg("config"), py::arg("overrides") = std::map<std::string, std::string>(), py::arg("seed") = 0, py::arg("jobnumber") = 0,
+				py::arg("outpath") = "out/", py::arg("writelogs") = false,
+				"Load configuration, fields, geometry, and source; overrides are given as {\"SECTION.option\": \"value\"}")
+		.def("set_source", &TSimulation::SetSource, py::arg("options"), "Replace source options, fields and geometry are kept")
+		.def("reconfigure", &TSimulation::Reconfigure, py::arg("overrides"),
+				"Read configuration again with new overrides, reload only fields, geometry, or source whose options or files changed, and return the reloaded parts")
+		.def("track", &Track, py::arg("count"), py::arg("firstparticle") = 1, py::arg("nthreads") = 1,
+				"Track particles and return their final states as a dict of NumPy arrays")
+		.def_property_readonly("seed", &TSimulation::GetSeed)
+		.def_property_readonly("simtime", &TSimulation::GetSimTime);
+}
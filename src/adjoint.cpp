@@ -0,0 +1,115 @@
+#include "adjoint.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+#include "particle.h"
+
+using namespace std;
+
+TEfficiencyMap::TEfficiencyMap(const std::string &aname, const std::string &definition): name(aname){
+	istringstream ss(definition);
+	ss >> particlename;
+	for (int i = 0; i < 3; ++i){
+		ss >> min[i] >> max[i] >> n[i];
+		if (not ss || n[i] == 0 || not (max[i] > min[i]))
+			throw runtime_error("Could not read efficiency map " + name + " " + definition);
+	}
+	piece = 0.5*std::min((max[0] - min[0])/n[0], std::min((max[1] - min[1])/n[1], (max[2] - min[2])/n[2]));
+	sum.assign(static_cast<unsigned long>(n[0])*n[1]*n[2], 0.);
+	sum2.assign(sum.size(), 0.);
+}
+
+
+void TEfficiencyMap::Score(const TParticle &p, const state_type &y1, const state_type &y2){
+	if (p.GetName() != particlename)
+		return;
+	for (int i = 0; i < 3; ++i){
+		if (std::max(y1[i], y2[i]) < min[i] || std::min(y1[i], y2[i]) > max[i]) // step does not touch grid
+			return;
+	}
+	double l = sqrt(pow(y2[0] - y1[0], 2) + pow(y2[1] - y1[1], 2) + pow(y2[2] - y1[2], 2));
+	if (l == 0)
+		return;
+	unsigned long pieces = static_cast<unsigned long>(ceil(l/piece));
+	double score = p.GetStatisticalWeight()*l/pieces;
+	map<unsigned long, double> &cells = pending[&p];
+	for (unsigned long j = 0; j < pieces; ++j){
+		double s = (j + 0.5)/pieces;
+		unsigned long cell = 0;
+		bool inside = true;
+		for (int i = 0; i < 3 && inside; ++i){
+			double c = floor((y1[i] + s*(y2[i] - y1[i]) - min[i])/(max[i] - min[i])*n[i]);
+			inside = c >= 0 && c < n[i];
+			cell = cell*n[i] + static_cast<unsigned long>(c);
+		}
+		if (inside)
+			cells[cell] += score;
+	}
+}
+
+
+void TEfficiencyMap::Finish(const TParticle &p){
+	auto cells = pending.find(&p);
+	if (cells == pending.end())
+		return;
+	for (auto &cell: cells->second){
+		sum[cell.first] += cell.second;
+		sum2[cell.first] += cell.second*cell.second;
+	}
+	pending.erase(cells);
+}
+
+
+void TEfficiencyMap::Write(const boost::filesystem::path &outfile, const bool append) const{
+	double d[3], volume = 1;
+	for (int i = 0; i < 3; ++i){
+		d[i] = (max[i] - min[i])/n[i];
+		volume *= d[i];
+	}
+	vector<double> fluence(sum.size()), fluence2(sum.size());
+	for (unsigned long cell = 0; cell < sum.size(); ++cell){
+		fluence[cell] = sum[cell]/volume;
+		fluence2[cell] = sum2[cell]/volume/volume;
+	}
+	if (append and boost::filesystem::exists(outfile)){ // add cells of map written before simulation was resumed
+		ifstream infile(outfile.string());
+		string header;
+		getline(infile, header);
+		for (unsigned long cell = 0; cell < sum.size(); ++cell){
+			double x, y, z, f, f2;
+			if (not (infile >> x >> y >> z >> f >> f2))
+				throw runtime_error("Could not read " + outfile.string());
+			fluence[cell] += f;
+			fluence2[cell] += f2;
+		}
+	}
+
+	ofstream file(outfile.string());
+	file << setprecision(numeric_limits<double>::max_digits10); // cells have to be added exactly when maps are merged
+	file << "x y z fluence fluence2\n";
+	unsigned long cell = 0;
+	for (unsigned i = 0; i < n[0]; ++i){
+		for (unsigned j = 0; j < n[1]; ++j){
+			for (unsigned k = 0; k < n[2]; ++k){
+				file << min[0] + (i + 0.5)*d[0] << ' ' << min[1] + (j + 0.5)*d[1] << ' ' << min[2] + (k + 0.5)*d[2] << ' ' << fluence[cell] << ' ' << fluence2[cell] << '\n';
+				++cell;
+			}
+		}
+	}
+	if (not file)
+		throw runtime_error("Could not write " + outfile.string());
+}
+
+
+std::size_t TEfficiencyMap::MemoryUsage() const{
+	std::size_t bytes = (sum.capacity() + sum2.capacity())*sizeof(double);
+	for (auto &cells: pending)
+		bytes += cells.second.size()*(sizeof(std::pair<const unsigned long, double>) + 4*sizeof(void*)); // tree node with color and three pointers
+	return bytes;
+}
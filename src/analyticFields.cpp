@@ -147,48 +147,145 @@ void TB0_XY::BField(const double x, const double y, const double z, const double
 }
 
 
-TCustomBField::TCustomBField(const std::string &_Bx, const std::string &_By, const std::string &_Bz){
-	tvar = unique_ptr<double>(new double(0.0));
-	xvar = unique_ptr<double>(new double(0.0));
-	yvar = unique_ptr<double>(new double(0.0));
-	zvar = unique_ptr<double>(new double(0.0));
+/**
+ * Formulas of a TCustomBField interpreted by a single thread
+ */
+struct TCustomBExpressions{
+	uint64_t generation; ///< generation of the slot the expressions were compiled for
+	double t; ///< time variable referenced by the expressions
+	double x; ///< x coordinate referenced by the expressions
+	double y; ///< y coordinate referenced by the expressions
+	double z; ///< z coordinate referenced by the expressions
+	std::array<exprtk::expression<double>, 3> B; ///< Formula interpreters, one for each field component
+	std::vector<exprtk::expression<double> > dB; ///< Formula interpreters for each derivative dBi/dxj at index 3*i + j (empty: derivatives are calculated numerically)
+};
+
+/**
+ * Compile field formulas with variables "t", "x", "y", and "z"
+ *
+ * @param Bformulas Formulas of each field component
+ * @param dBformulas Formulas of each derivative (may be empty)
+ *
+ * @return Returns expressions and the variables they reference
+ */
+static unique_ptr<TCustomBExpressions> CompileCustomBField(const std::array<std::string, 3> &Bformulas, const std::vector<std::string> &dBformulas){
+	unique_ptr<TCustomBExpressions> e(new TCustomBExpressions());
+	e->t = e->x = e->y = e->z = 0.;
 	exprtk::symbol_table<double> symbol_table;
-	symbol_table.add_variable("t",*tvar);
-	symbol_table.add_variable("x",*xvar);
-	symbol_table.add_variable("y",*yvar);
-	symbol_table.add_variable("z",*zvar);
+	symbol_table.add_variable("t", e->t);
+	symbol_table.add_variable("x", e->x);
+	symbol_table.add_variable("y", e->y);
+	symbol_table.add_variable("z", e->z);
 	symbol_table.add_constants();
 	exprtk::parser<double> parser;
 
-	std::array<std::string, 3> expr{_Bx, _By, _Bz};
 	for (int i = 0; i < 3; ++i){
-		Bexpr[i].register_symbol_table(symbol_table);
-		if (not parser.compile(expr[i], Bexpr[i])){
-			throw std::runtime_error(exprtk::parser_error::to_str(parser.get_error(0).mode) + " while parsing CustomBField formula '" + expr[i] + "': " + parser.get_error(0).diagnostic);
+		e->B[i].register_symbol_table(symbol_table);
+		if (not parser.compile(Bformulas[i], e->B[i])){
+			throw std::runtime_error(exprtk::parser_error::to_str(parser.get_error(0).mode) + " while parsing CustomBField formula '" + Bformulas[i] + "': " + parser.get_error(0).diagnostic);
 		}
 	}
+
+	e->dB.resize(dBformulas.size());
+	for (unsigned i = 0; i < dBformulas.size(); ++i){
+		e->dB[i].register_symbol_table(symbol_table);
+		if (not parser.compile(dBformulas[i], e->dB[i])){
+			throw std::runtime_error(exprtk::parser_error::to_str(parser.get_error(0).mode) + " while parsing CustomBField derivative formula '" + dBformulas[i] + "': " + parser.get_error(0).diagnostic);
+		}
+	}
+	return e;
+}
+
+TCustomBField::TCustomBField(const std::string &_Bx, const std::string &_By, const std::string &_Bz, const std::vector<std::string> &_dB)
+		: Bformulas{{_Bx, _By, _Bz}}, dBformulas(_dB), slot(std::make_shared<const TScalerSlot>()){
+	if (not _dB.empty() and _dB.size() != 9)
+		throw std::runtime_error("CustomBField needs formulas for all nine field derivatives or none");
+	CompileCustomBField(Bformulas, dBformulas); // check formulas
+
+	// use native code only if all formulas could be compiled
+	bool native = true;
+	for (int i = 0; i < 3; ++i){
+		Bnative[i] = CompileNativeFormula(Bformulas[i], {"t", "x", "y", "z"});
+		native = native and Bnative[i] != nullptr;
+	}
+	for (const std::string &dB: _dB){
+		dBnative.push_back(CompileNativeFormula(dB, {"t", "x", "y", "z"}));
+		native = native and dBnative.back() != nullptr;
+	}
+	if (not native){
+		Bnative.fill(nullptr);
+		dBnative.clear();
+	}
+}
+
+/**
+ * Calculate derivative of a natively compiled formula with the same five-point stencil as exprtk::derivative
+ *
+ * @param f Compiled formula
+ * @param var Coordinates and time (t, x, y, z)
+ * @param j Index of variable with respect to which the formula is differentiated
+ *
+ * @return Returns derivative
+ */
+static double NativeDerivative(const TNativeFormula f, std::array<double, 4> var, const int j){
+	const double h = 0.00000001;
+	const double v = var[j];
+	var[j] = v + 2*h;
+	double y0 = f(var[0], var[1], var[2], var[3]);
+	var[j] = v + h;
+	double y1 = f(var[0], var[1], var[2], var[3]);
+	var[j] = v - h;
+	double y2 = f(var[0], var[1], var[2], var[3]);
+	var[j] = v - 2*h;
+	double y3 = f(var[0], var[1], var[2], var[3]);
+	return (-y0 + 8*(y1 - y2) + y3)/(12*h);
 }
 
 void TCustomBField::BField(const double x, const double y, const double z, const double t, double B[3], double dBidxj[3][3]) const{
-	*xvar = x;
-	*yvar = y;
-	*zvar = z;
-	*tvar = t;
-	B[0] = Bexpr[0].value();
-	B[1] = Bexpr[1].value();
-	B[2] = Bexpr[2].value();
+	if (Bnative[0] != nullptr){ // native code is thread-safe and does not need the interpreter's variables
+		for (int i = 0; i < 3; ++i){
+			B[i] = Bnative[i](t, x, y, z);
+			if (dBidxj != nullptr){
+				for (int j = 0; j < 3; ++j)
+					dBidxj[i][j] = dBnative.empty() ? NativeDerivative(Bnative[i], {{t, x, y, z}}, j + 1) : dBnative[3*i + j](t, x, y, z);
+			}
+		}
+		return;
+	}
+	thread_local vector<unique_ptr<TCustomBExpressions> > fields; // each thread evaluates its own copies of all formulas
+	if (slot->index >= fields.size())
+		fields.resize(slot->index + 1);
+	unique_ptr<TCustomBExpressions> &compiled = fields[slot->index];
+	if (not compiled or compiled->generation != slot->generation){ // slot was used by a field that has been destroyed, replace its expressions
+		compiled = CompileCustomBField(Bformulas, dBformulas);
+		compiled->generation = slot->generation;
+	}
+	TCustomBExpressions &e = *compiled;
+	e.x = x;
+	e.y = y;
+	e.z = z;
+	e.t = t;
+	B[0] = e.B[0].value();
+	B[1] = e.B[1].value();
+	B[2] = e.B[2].value();
 //	std::cout << B[0] << " " << B[1] << " " << B[2] << " ";
 	
-	if (dBidxj != nullptr){
-		dBidxj[0][0] = exprtk::derivative(Bexpr[0], *xvar);
-		dBidxj[0][1] = exprtk::derivative(Bexpr[0], *yvar);
-		dBidxj[0][2] = exprtk::derivative(Bexpr[0], *zvar);
-		dBidxj[1][0] = exprtk::derivative(Bexpr[1], *xvar);
-		dBidxj[1][1] = exprtk::derivative(Bexpr[1], *yvar);
-		dBidxj[1][2] = exprtk::derivative(Bexpr[1], *zvar);
-		dBidxj[2][0] = exprtk::derivative(Bexpr[2], *xvar);
-		dBidxj[2][1] = exprtk::derivative(Bexpr[2], *yvar);
-		dBidxj[2][2] = exprtk::derivative(Bexpr[2], *zvar);
+	if (dBidxj != nullptr and not e.dB.empty()){
+		for (int i = 0; i < 3; ++i){
+			for (int j = 0; j < 3; ++j)
+				dBidxj[i][j] = e.dB[3*i + j].value();
+		}
+	}
+	else if (dBidxj != nullptr){
+		dBidxj[0][0] = exprtk::derivative(e.B[0], e.x);
+		dBidxj[0][1] = exprtk::derivative(e.B[0], e.y);
+		dBidxj[0][2] = exprtk::derivative(e.B[0], e.z);
+		dBidxj[1][0] = exprtk::derivative(e.B[1], e.x);
+		dBidxj[1][1] = exprtk::derivative(e.B[1], e.y);
+		dBidxj[1][2] = exprtk::derivative(e.B[1], e.z);
+		dBidxj[2][0] = exprtk::derivative(e.B[2], e.x);
+		dBidxj[2][1] = exprtk::derivative(e.B[2], e.y);
+		dBidxj[2][2] = exprtk::derivative(e.B[2], e.z);
 //		std::cout << dBidxj[0][0] << " " << dBidxj[0][1] << " " << dBidxj[0][2] << std::endl;
 	}
 //	std::cout << std::endl;
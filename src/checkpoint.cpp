@@ -0,0 +1,111 @@
+#include "checkpoint.h"
+
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <iostream>
+#include <stdexcept>
+
+#include "source.h"
+#include "globals.h"
+
+using namespace std;
+
+static const string CHECKPOINT_HEADER = "PENTrack checkpoint 6"; ///< First line of checkpoint files, changed when the format changes
+
+/**
+ * Write particle with all its secondaries
+ *
+ * @param out Stream
+ * @param p Particle
+ */
+static void WriteParticle(ostream &out, const TParticle &p){
+	const auto &secondaries = p.GetSecondaryParticles();
+	out << p.GetName() << ' ' << secondaries.size() << '\n';
+	p.WriteState(out);
+	for (auto &s: secondaries)
+		WriteParticle(out, *s);
+}
+
+/**
+ * Read particle with all its secondaries written by WriteParticle
+ *
+ * @param in Stream
+ * @param geometry Experiment geometry
+ * @param field TFieldManager containing all electromagnetic fields
+ *
+ * @return Returns particle
+ */
+static unique_ptr<TParticle> ReadParticle(istream &in, const TGeometry &geometry, const TFieldManager &field){
+	string name;
+	size_t nsecondaries;
+	if (!(in >> name >> nsecondaries))
+		throw runtime_error("Could not read particle from checkpoint!");
+	TMCGenerator mc; // initial state of particle is overwritten by ReadState, random numbers drawn by constructor do not matter
+	unique_ptr<TParticle> p(CreateParticle(name, 0, 0, 0, 0, 0, 0, 0, 0, 0, mc, geometry, field));
+	p->ReadState(in, geometry);
+	for (size_t i = 0; i < nsecondaries; ++i)
+		p->GetSecondaryParticles().push_back(ReadParticle(in, geometry, field));
+	return p;
+}
+
+
+void TCheckpoint::Write(const boost::filesystem::path &file, const std::vector<const TParticleTask*> &queued) const{
+	boost::filesystem::path tmpfile = file.string() + boost::filesystem::unique_path(".%%%%%%%%").string();
+	ofstream f(tmpfile.string());
+	f << CHECKPOINT_HEADER << '\n';
+	f << setprecision(numeric_limits<double>::max_digits10); // counters are sums of statistical weights
+	f << seed << ' ' << jobnumber << '\n';
+	f << firstparticle << ' ' << particlecount << ' ' << finishedparticles << ' ' << steps << '\n';
+	size_t ncounters = 0;
+	for (auto &particle: ID_counter)
+		ncounters += particle.second.size();
+	f << ncounters << '\n';
+	for (auto &particle: ID_counter){
+		for (auto &stopID: particle.second)
+			f << particle.first << ' ' << stopID.first << ' ' << stopID.second << '\n';
+	}
+	f << queued.size() << '\n';
+	for (auto task: queued){
+		f << task->secondaryindex << ' ' << task->mc << '\n';
+		WriteParticle(f, *task->particle);
+	}
+	f.close();
+
+	boost::system::error_code ec;
+	if (f)
+		boost::filesystem::rename(tmpfile, file, ec); // rename is atomic, so an interruption never leaves an incomplete checkpoint
+	if (!f || ec){
+		cout << "Warning: Could not write checkpoint " << file << "\n";
+		boost::filesystem::remove(tmpfile, ec);
+	}
+}
+
+void TCheckpoint::Read(const boost::filesystem::path &file, const TGeometry &geometry, const TFieldManager &field){
+	ifstream f(file.string());
+	string header;
+	if (!getline(f, header) || header != CHECKPOINT_HEADER)
+		throw runtime_error("Could not read checkpoint " + file.string());
+	f >> seed >> jobnumber >> firstparticle >> particlecount >> finishedparticles >> steps;
+	if (jobnumber != ::jobnumber)
+		throw runtime_error("Checkpoint " + file.string() + " belongs to a different job!");
+	size_t n;
+	f >> n;
+	ID_counter.clear();
+	for (size_t i = 0; i < n; ++i){
+		string name;
+		int ID;
+		double count;
+		f >> name >> ID >> count;
+		ID_counter[name][ID] = count;
+	}
+	f >> n;
+	if (!f)
+		throw runtime_error("Could not read checkpoint " + file.string());
+	tasks.clear();
+	tasks.resize(n);
+	for (auto &task: tasks){
+		f >> task.secondaryindex >> task.mc;
+		task.particle = ReadParticle(f, geometry, field);
+	}
+}
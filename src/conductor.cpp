@@ -5,6 +5,10 @@
 
 #include "conductor.h"
 
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
 #include "globals.h"
 
 TConductorField::TConductorField(const double SW1xx, const double SW1yy, const double SW1zz,
@@ -154,3 +158,113 @@ void TConductorField::BField(const double x, const double y, const double z, con
 	}
 }
 
+
+
+TConductorSetField::TConductorSetField(const boost::filesystem::path &ft){
+	std::ifstream f(ft.string());
+	if (!f.is_open())
+		throw std::runtime_error("Could not open conductor file " + ft.string() + "!");
+	std::string line;
+	while (std::getline(f, line)){
+		std::istringstream ss(line);
+		double current, sx, sy, sz, ex, ey, ez;
+		if (!(ss >> std::ws) or ss.peek() == '#' or ss.peek() == '%')
+			continue;
+		if (!(ss >> current >> sx >> sy >> sz >> ex >> ey >> ez))
+			throw std::runtime_error("Could not read conductor segment from line \"" + line + "\" in file " + ft.string() + "!");
+		x1.push_back(sx);
+		y1.push_back(sy);
+		z1.push_back(sz);
+		Lx.push_back(ex - sx);
+		Ly.push_back(ey - sy);
+		Lz.push_back(ez - sz);
+		I.push_back(mu0*current/(4*pi));
+	}
+	std::cout << "Read " << I.size() << " conductor segments from " << ft << "\n";
+	std::size_t n = (I.size() + LANES - 1)/LANES*LANES;
+	for (std::vector<double> *v: {&x1, &y1, &z1, &Lx, &Ly, &Lz, &I})
+		v->resize(n, 0.);
+}
+
+void TConductorSetField::BField(const double x, const double y, const double z, const double t,
+		double B[3], double dBidxj[3][3]) const{
+	// Field of a straight segment from a to b: B = mu0 I/(4 pi) * (r1 x r2) * (|r1| + |r2|)/(|r1| |r2| (|r1| |r2| + r1.r2)), with r1 = x - a and r2 = x - b.
+	// Each lane accumulates the contributions of every LANES-th segment, so the inner loop contains independent operations that can be vectorized.
+	double Bl[3][LANES] = {}, dBl[3][3][LANES] = {};
+	const std::size_t n = I.size();
+	if (dBidxj != nullptr){
+		for (std::size_t k = 0; k < n; k += LANES){
+			for (std::size_t l = 0; l < LANES; ++l){
+				const std::size_t i = k + l;
+				double r1x = x - x1[i], r1y = y - y1[i], r1z = z - z1[i];
+				double r2x = r1x - Lx[i], r2y = r1y - Ly[i], r2z = r1z - Lz[i];
+				double n1 = std::sqrt(r1x*r1x + r1y*r1y + r1z*r1z);
+				double n2 = std::sqrt(r2x*r2x + r2y*r2y + r2z*r2z);
+				double P = n1*n2;
+				double Q = P + r1x*r2x + r1y*r2y + r1z*r2z;
+				double valid = P*Q > 0; // field on the segment itself is singular, skip it (without branches, so the loop can be vectorized)
+				double w = valid*I[i]/(P*Q + 1. - valid);
+				double iQ = valid/(Q + 1. - valid);
+				double in1 = valid/(n1 + 1. - valid);
+				double in2 = valid/(n2 + 1. - valid);
+				double f = (n1 + n2)*w;
+				double cx = r1y*r2z - r1z*r2y, cy = r1z*r2x - r1x*r2z, cz = r1x*r2y - r1y*r2x;
+				// derivatives of f(|r1|, |r2|, r1.r2) and of r1 x r2 = L x (x - a) with respect to x_j
+				double sx = r1x*in1*in1 + r2x*in2*in2, sy = r1y*in1*in1 + r2y*in2*in2, sz = r1z*in1*in1 + r2z*in2*in2;
+				double gx = (r1x*in1 + r2x*in2)*w - f*sx - f*(P*sx + r1x + r2x)*iQ;
+				double gy = (r1y*in1 + r2y*in2)*w - f*sy - f*(P*sy + r1y + r2y)*iQ;
+				double gz = (r1z*in1 + r2z*in2)*w - f*sz - f*(P*sz + r1z + r2z)*iQ;
+				Bl[0][l] += cx*f;
+				Bl[1][l] += cy*f;
+				Bl[2][l] += cz*f;
+				dBl[0][0][l] += cx*gx;
+				dBl[0][1][l] += cx*gy;
+				dBl[0][2][l] += cx*gz;
+				dBl[1][0][l] += cy*gx;
+				dBl[1][1][l] += cy*gy;
+				dBl[1][2][l] += cy*gz;
+				dBl[2][0][l] += cz*gx;
+				dBl[2][1][l] += cz*gy;
+				dBl[2][2][l] += cz*gz;
+				dBl[0][1][l] -= Lz[i]*f;
+				dBl[0][2][l] += Ly[i]*f;
+				dBl[1][0][l] += Lz[i]*f;
+				dBl[1][2][l] -= Lx[i]*f;
+				dBl[2][0][l] -= Ly[i]*f;
+				dBl[2][1][l] += Lx[i]*f;
+			}
+		}
+		for (int i = 0; i < 3; ++i){
+			for (int j = 0; j < 3; ++j){
+				dBidxj[i][j] = 0.;
+				for (std::size_t l = 0; l < LANES; ++l)
+					dBidxj[i][j] += dBl[i][j][l];
+			}
+		}
+	}
+	else{
+		for (std::size_t k = 0; k < n; k += LANES){
+			for (std::size_t l = 0; l < LANES; ++l){
+				const std::size_t i = k + l;
+				double r1x = x - x1[i], r1y = y - y1[i], r1z = z - z1[i];
+				double r2x = r1x - Lx[i], r2y = r1y - Ly[i], r2z = r1z - Lz[i];
+				double n1 = std::sqrt(r1x*r1x + r1y*r1y + r1z*r1z);
+				double n2 = std::sqrt(r2x*r2x + r2y*r2y + r2z*r2z);
+				double P = n1*n2;
+				double Q = P + r1x*r2x + r1y*r2y + r1z*r2z;
+				double valid = P*Q > 0;
+				double w = valid*I[i]/(P*Q + 1. - valid);
+				double f = (n1 + n2)*w;
+				double cx = r1y*r2z - r1z*r2y, cy = r1z*r2x - r1x*r2z, cz = r1x*r2y - r1y*r2x;
+				Bl[0][l] += cx*f;
+				Bl[1][l] += cy*f;
+				Bl[2][l] += cz*f;
+			}
+		}
+	}
+	for (int j = 0; j < 3; ++j){
+		B[j] = 0.;
+		for (std::size_t l = 0; l < LANES; ++l)
+			B[j] += Bl[j][l];
+	}
+}
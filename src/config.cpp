@@ -5,6 +5,7 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <array>
 #include <algorithm>
 
 #include <boost/format.hpp>
@@ -193,19 +194,36 @@ std::ostream& operator<<(std::ostream &str, const TConfig &conf){
 }
 
 double EvalFormula(TConfig &config, const std::string formulaname, const std::map<std::string, double> &variables){
-    auto formula = config["FORMULAS"].lower_bound(formulaname);
-    if (formula == config["FORMULAS"].end() or formula->first != formulaname)
-        throw std::runtime_error("Formula " + formulaname + " not found in config file");
+    std::map<std::string, double> vars(variables);
+    exprtk::expression<double> expr;
+    CompileFormula(config, formulaname, vars, expr);
+    return expr.value();
+}
+
+void CompileFormula(TConfig &config, const std::string &formulaname, std::map<std::string, double> &variables, exprtk::expression<double> &expr){
     exprtk::symbol_table<double> symbols;
-    for (auto var: variables){
-        if (not symbols.add_constant(var.first, var.second)){
+    for (auto &var: variables){
+        if (not symbols.add_variable(var.first, var.second)){
 			throw std::runtime_error("Error parsing variable " + var.first);
 		}
     }
-    exprtk::parser<double> parser;
-    exprtk::expression<double> expr;
+    std::vector<std::string> usedvariables;
+    CompileFormula(config, formulaname, symbols, expr, usedvariables);
+}
+
+void CompileFormula(TConfig &config, const std::string &formulaname, exprtk::symbol_table<double> &symbols, exprtk::expression<double> &expr,
+					std::vector<std::string> &usedvariables){
+    auto formula = config["FORMULAS"].lower_bound(formulaname);
+    if (formula == config["FORMULAS"].end() or formula->first != formulaname)
+        throw std::runtime_error("Formula " + formulaname + " not found in config file");
+    typedef exprtk::parser<double>::settings_t settings_t;
+    exprtk::parser<double> parser(settings_t(settings_t::compile_all_opts + settings_t::e_collect_vars));
     expr.register_symbol_table(symbols);
     if (not parser.compile(formula->second, expr))
         throw std::runtime_error("Could not evaluate formula " + formula->first + ": " + parser.error());
-    return expr.value();
-}
\ No newline at end of file
+    std::vector<exprtk::parser<double>::dependent_entity_collector::symbol_t> symbollist;
+    parser.dec().symbols(symbollist);
+    usedvariables.clear();
+    for (auto &symbol: symbollist)
+        usedvariables.push_back(symbol.first);
+}
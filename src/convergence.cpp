@@ -0,0 +1,147 @@
+#include "convergence.h"
+
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+#include <boost/format.hpp>
+
+#include "globals.h"
+
+using namespace std;
+
+void TConvergenceSample::Add(const TConvergenceSample &sample){
+	for (auto &particle: sample.ID_counter){
+		for (auto &stopID: particle.second)
+			ID_counter[particle.first][stopID.first] += stopID.second;
+	}
+	for (auto &hist: sample.histograms){
+		THistogramBins &bins = histograms[hist.first];
+		if (bins.weights.empty())
+			bins = hist.second;
+		else{
+			for (unsigned i = 0; i < bins.weights.size(); ++i){
+				bins.weights[i] += hist.second.weights[i];
+				bins.weights2[i] += hist.second.weights2[i];
+			}
+		}
+	}
+}
+
+
+TConvergenceMonitor::TConvergenceMonitor(TConfig &config): start(chrono::steady_clock::now()){
+	istringstream(config["GLOBAL"]["precisionmin"]) >> minparticles;
+	istringstream(config["GLOBAL"]["precisiontime"]) >> maxtime;
+	istringstream ss(config["GLOBAL"]["precision"]);
+	string type;
+	while (ss >> type){
+		TObservable o;
+		o.index = 0;
+		if (type == "stopID"){
+			o.type = STOPID;
+			ss >> o.name >> o.index >> o.target;
+			o.description = (boost::format("stopID %1% %2%") % o.name % o.index).str();
+		}
+		else if (type == "bin"){
+			o.type = BIN;
+			ss >> o.name >> o.index >> o.target;
+			o.description = (boost::format("bin %1% %2%") % o.name % o.index).str();
+		}
+		else if (type == "mean"){
+			o.type = MEAN;
+			ss >> o.name >> o.target;
+			o.description = "mean " + o.name;
+		}
+		else
+			throw runtime_error("Unknown observable " + type + " in option precision! Use stopID, bin, or mean.");
+		if (not ss || not (o.target > 0))
+			throw runtime_error("Could not read observable " + type + " in option precision:" + config["GLOBAL"]["precision"]);
+		if (o.type != STOPID){ // histogram has to exist and contain the bin
+			auto hist = config["HISTOGRAMS"].find(o.name);
+			if (hist == config["HISTOGRAMS"].end())
+				throw runtime_error("Option precision uses histogram " + o.name + ", which is not defined in the HISTOGRAMS section!");
+			string particle, logtype, variable;
+			int nbins = 0;
+			istringstream(hist->second) >> particle >> logtype >> variable >> nbins;
+			if (o.index < 0 || o.index > nbins + 1)
+				throw runtime_error((boost::format("Histogram %1% has no bin %2%!") % o.name % o.index).str());
+		}
+		observables.push_back(o);
+	}
+	if (maxtime < 0)
+		throw runtime_error("precisiontime must not be negative!");
+}
+
+
+double TConvergenceMonitor::Uncertainty(const TObservable &observable, const TConvergenceSample &sample) const{
+	const double inf = numeric_limits<double>::infinity();
+	if (observable.type == STOPID){
+		auto particle = sample.ID_counter.find(observable.name);
+		if (particle == sample.ID_counter.end())
+			return inf;
+		double total = 0, count = 0;
+		for (auto &stopID: particle->second){
+			if (stopID.first == ID_KILLED_BY_ROULETTE) // weight of killed particles is carried by the survivors
+				continue;
+			total += stopID.second;
+			if (stopID.first == observable.index)
+				count = stopID.second;
+		}
+		if (count <= 0)
+			return inf;
+		double f = count/total;
+		return sqrt(max(0., 1 - f)/(f*total));
+	}
+
+	auto hist = sample.histograms.find(observable.name);
+	if (hist == sample.histograms.end())
+		return inf;
+	const THistogramBins &bins = hist->second;
+	if (observable.type == BIN){
+		double w = bins.weights[observable.index];
+		return w != 0 ? sqrt(bins.weights2[observable.index])/abs(w) : inf;
+	}
+
+	const unsigned nbins = bins.weights.size() - 2;
+	double W = 0, W2 = 0, S = 0;
+	for (unsigned i = 1; i <= nbins; ++i){
+		double center = bins.min + (i - 0.5)*(bins.max - bins.min)/nbins;
+		W += bins.weights[i];
+		W2 += bins.weights2[i];
+		S += bins.weights[i]*center;
+	}
+	if (W <= 0 || S == 0)
+		return inf;
+	double mean = S/W, var = 0;
+	for (unsigned i = 1; i <= nbins; ++i){
+		double center = bins.min + (i - 0.5)*(bins.max - bins.min)/nbins;
+		var += bins.weights[i]*(center - mean)*(center - mean);
+	}
+	var /= W;
+	return sqrt(var*W2)/W/abs(mean); // standard error with effective number of entries W^2/W2
+}
+
+
+bool TConvergenceMonitor::Converged(const TConvergenceSample &sample, const unsigned long finished){
+	if (converged)
+		return true;
+	bool timeout = maxtime > 0 && chrono::duration<double>(chrono::steady_clock::now() - start).count() > maxtime;
+	if (finished < minparticles && not timeout)
+		return false;
+	vector<double> uncertainties;
+	bool reached = true;
+	for (auto &o: observables){
+		uncertainties.push_back(Uncertainty(o, sample));
+		reached = reached && uncertainties.back() <= o.target;
+	}
+	if (not reached && not timeout)
+		return false;
+
+	converged = true;
+	cout << (reached ? "\nTarget precision reached" : "\nTime limit precisiontime reached before target precision") << " after " << finished << " particles:\n";
+	for (unsigned i = 0; i < observables.size(); ++i)
+		cout << observables[i].description << ": relative uncertainty " << uncertainties[i] << " (target " << observables[i].target << ")\n";
+	return true;
+}
@@ -0,0 +1,96 @@
+#include "diagnostics.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+static const size_t DIAGNOSTIC_SAMPLES = 3; ///< Number of problems of each type whose details are kept and printed
+
+static const char *DIAGNOSTIC_NAMES[DIAG_CODES] = {"", "collision-point iterations limited by numerical precision", "collision-point iterations reaching max. iterations",
+		"particles leaving a solid they did not enter", "tracks parallel to a surface", "particles exceeding their CPU-time budget", "particles exceeding their step budget",
+		"particles exceeding their hit budget", "hits falling back from micro-roughness model to specular reflection"}; ///< Descriptions of problem types
+
+/**
+ * Details of a single problem
+ */
+struct TDiagnosticSample{
+	int particle; ///< Particle number
+	unsigned solid; ///< ID of solid
+	double t; ///< Time
+	double pos[3]; ///< Position
+	double value; ///< Additional value, see TLogger::PrintDiagnostic
+};
+
+/**
+ * Problems counted by a single thread
+ */
+struct TThreadDiagnostics{
+	map<unsigned, unsigned long long> counts[DIAG_CODES]; ///< Number of problems of each type in each solid
+	vector<TDiagnosticSample> samples[DIAG_CODES]; ///< First problems of each type
+};
+
+static mutex registrymutex; ///< Lock for registry
+static vector<shared_ptr<TThreadDiagnostics> > registry; ///< Counters of all threads, kept after threads have finished
+
+/**
+ * Return counters of the calling thread, registering them on first use
+ */
+static TThreadDiagnostics& ThreadDiagnostics(){
+	thread_local shared_ptr<TThreadDiagnostics> diagnostics;
+	if (!diagnostics){
+		diagnostics = make_shared<TThreadDiagnostics>();
+		lock_guard<mutex> lock(registrymutex);
+		registry.push_back(diagnostics);
+	}
+	return *diagnostics;
+}
+
+
+void Diagnostics::Count(const TDiagnostic code, const unsigned solid, const int particle, const double t, const double pos[3], const double value){
+	TThreadDiagnostics &diagnostics = ThreadDiagnostics();
+	++diagnostics.counts[code][solid];
+	if (diagnostics.samples[code].size() < DIAGNOSTIC_SAMPLES)
+		diagnostics.samples[code].push_back({particle, solid, t, {pos[0], pos[1], pos[2]}, value});
+}
+
+
+void Diagnostics::Print(){
+	lock_guard<mutex> lock(registrymutex);
+	bool header = false;
+	for (int code = 1; code < DIAG_CODES; ++code){
+		map<unsigned, unsigned long long> counts;
+		vector<TDiagnosticSample> samples;
+		for (auto &thread: registry){
+			for (auto &c: thread->counts[code])
+				counts[c.first] += c.second;
+			samples.insert(samples.end(), thread->samples[code].begin(), thread->samples[code].end());
+		}
+		if (counts.empty())
+			continue;
+		if (not header)
+			printf("The tracking encountered following problems (number in each solid, first occurrences):\n");
+		header = true;
+
+		unsigned long long total = 0;
+		for (auto &c: counts)
+			total += c.second;
+		printf("%4i: %llu %s (", code, total, DIAGNOSTIC_NAMES[code]);
+		for (auto c = counts.begin(); c != counts.end(); ++c)
+			printf("%ssolid %u: %llu", c == counts.begin() ? "" : ", ", c->first, c->second);
+		printf(")\n");
+
+		// print samples sorted by particle number, each thread kept the first problems it encountered
+		sort(samples.begin(), samples.end(), [](const TDiagnosticSample &s1, const TDiagnosticSample &s2){ return s1.particle < s2.particle || (s1.particle == s2.particle && s1.t < s2.t); });
+		for (size_t i = 0; i < min(samples.size(), DIAGNOSTIC_SAMPLES); ++i){
+			const TDiagnosticSample &s = samples[i];
+			printf("      particle %i in solid %u at t=%gs, x=%gm, y=%gm, z=%gm, value %g\n", s.particle, s.solid, s.t, s.pos[0], s.pos[1], s.pos[2], s.value);
+		}
+	}
+	if (header)
+		printf("\n");
+}
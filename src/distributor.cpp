@@ -0,0 +1,170 @@
+#include "distributor.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#ifdef USEMPI
+#include <mpi.h>
+
+static const int DISTRIBUTOR_REQUEST_TAG = 1; ///< MPI tag of requests for particle blocks
+static const int DISTRIBUTOR_REPLY_TAG = 2; ///< MPI tag of replies containing particle blocks
+#endif
+
+using namespace std;
+
+TProcessGroup::TProcessGroup(int &argc, char **&argv){
+#ifdef USEMPI
+	int provided;
+	MPI_Init_thread(&argc, &argv, MPI_THREAD_SERIALIZED, &provided);
+	if (provided < MPI_THREAD_SERIALIZED)
+		throw runtime_error("MPI library does not support calls from several threads!");
+#endif
+}
+
+TProcessGroup::~TProcessGroup(){
+#ifdef USEMPI
+	MPI_Finalize();
+#endif
+}
+
+int TProcessGroup::Rank(){
+	int rank = 0;
+#ifdef USEMPI
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+#endif
+	return rank;
+}
+
+int TProcessGroup::Size(){
+	int size = 1;
+#ifdef USEMPI
+	MPI_Comm_size(MPI_COMM_WORLD, &size);
+#endif
+	return size;
+}
+
+void TProcessGroup::Broadcast(std::uint64_t &value){
+#ifdef USEMPI
+	unsigned long long v = value;
+	MPI_Bcast(&v, 1, MPI_UNSIGNED_LONG_LONG, 0, MPI_COMM_WORLD);
+	value = v;
+#endif
+}
+
+void TProcessGroup::Reduce(std::map<std::string, std::map<int, double> > &ID_counter, int &steps){
+#ifdef USEMPI
+	int totalsteps = 0;
+	MPI_Reduce(&steps, &totalsteps, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+
+	ostringstream counters; // send counters as lines of particle name, stop ID, and count
+	counters << setprecision(numeric_limits<double>::max_digits10); // counters are sums of statistical weights
+	for (auto &particle: ID_counter){
+		for (auto &stopID: particle.second)
+			counters << particle.first << ' ' << stopID.first << ' ' << stopID.second << '\n';
+	}
+	string local = counters.str();
+	int length = local.size();
+	vector<int> lengths(Size()), offsets(Size());
+	MPI_Gather(&length, 1, MPI_INT, lengths.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+	for (unsigned i = 1; i < offsets.size(); ++i)
+		offsets[i] = offsets[i - 1] + lengths[i - 1];
+	vector<char> all(offsets.back() + lengths.back());
+	MPI_Gatherv(&local[0], length, MPI_CHAR, all.data(), lengths.data(), offsets.data(), MPI_CHAR, 0, MPI_COMM_WORLD);
+
+	if (Rank() == 0){
+		steps = totalsteps;
+		ID_counter.clear();
+		istringstream lines(string(all.begin(), all.end()));
+		string name;
+		int ID;
+		double count;
+		while (lines >> name >> ID >> count)
+			ID_counter[name][ID] += count;
+	}
+#endif
+}
+
+
+TParticleDistributor::TParticleDistributor(const long long first, const long long count, const long long ablocksize)
+		: next(first), end(first + count), blocksize(max(ablocksize, 1LL)){
+	if (TProcessGroup::Rank() == 0 && TProcessGroup::Size() > 1)
+		dispatcher = thread(&TParticleDistributor::Dispatch, this);
+}
+
+TParticleDistributor::~TParticleDistributor(){
+	Finish();
+}
+
+long long TParticleDistributor::TakeBlock(long long &first){
+	lock_guard<mutex> lock(rangemutex);
+	long long n = min(blocksize, end - next);
+	first = next;
+	next += n;
+	return n;
+}
+
+void TParticleDistributor::Dispatch(){
+#ifdef USEMPI
+	int remaining = TProcessGroup::Size() - 1; // processes that have not been told yet that there are no more particles
+	while (remaining > 0){
+		int stop;
+		MPI_Status status;
+		MPI_Recv(&stop, 1, MPI_INT, MPI_ANY_SOURCE, DISTRIBUTOR_REQUEST_TAG, MPI_COMM_WORLD, &status);
+		long long block[2] = {0, 0}; // first particle number and number of particles
+		if (not stop)
+			block[1] = TakeBlock(block[0]);
+		if (block[1] == 0)
+			--remaining;
+		MPI_Send(block, 2, MPI_LONG_LONG, status.MPI_SOURCE, DISTRIBUTOR_REPLY_TAG, MPI_COMM_WORLD);
+	}
+#endif
+}
+
+bool TParticleDistributor::Next(long long &number, const bool stop){
+	if (not stop && blocknext < blockend){
+		number = blocknext++;
+		return true;
+	}
+	if (finished)
+		return false;
+
+	long long n = 0;
+	if (TProcessGroup::Rank() == 0){
+		if (not stop)
+			n = TakeBlock(blocknext);
+	}
+	else{
+#ifdef USEMPI
+		int s = stop;
+		long long block[2];
+		MPI_Send(&s, 1, MPI_INT, 0, DISTRIBUTOR_REQUEST_TAG, MPI_COMM_WORLD); // also sent when stopping, so rank 0 stops waiting for this process
+		MPI_Recv(block, 2, MPI_LONG_LONG, 0, DISTRIBUTOR_REPLY_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+		blocknext = block[0];
+		n = block[1];
+#endif
+	}
+	if (n == 0){
+		finished = true;
+		return false;
+	}
+	blockend = blocknext + n;
+	number = blocknext++;
+	return true;
+}
+
+long long TParticleDistributor::Remaining(long long &first) const{
+	if (TProcessGroup::Size() > 1)
+		throw runtime_error("Particles that have not been tracked yet can only be determined in a single process!");
+	lock_guard<mutex> lock(rangemutex);
+	first = blocknext < blockend ? blocknext : next; // a single process takes consecutive blocks, so the rest of its block is followed by the rest of the range
+	return end - first; // also valid after Next was told to stop
+}
+
+void TParticleDistributor::Finish(){
+	if (dispatcher.joinable())
+		dispatcher.join();
+}
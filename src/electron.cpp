@@ -10,25 +10,26 @@
 const char* NAME_ELECTRON = "electron";
 
 TElectron::TElectron(const int number, const double t, const double x, const double y, const double z, const double E, const double phi, const double theta, const double polarisation,
-		TMCGenerator &amc, const TGeometry &geometry, const TFieldManager &afield)
-			: TParticle(NAME_ELECTRON, -ele_e, m_e, 0, 0, number, t, x, y, z, E, phi, theta, polarisation, amc, geometry, afield){
+		TMCGenerator &amc, const TGeometry &geometry, const TFieldManager &afield, const solid *startsolid)
+			: TParticle(NAME_ELECTRON, -ele_e, m_e, 0, 0, number, t, x, y, z, E, phi, theta, polarisation, amc, geometry, afield, startsolid){
 
 }
 
 
-void TElectron::OnHit(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const double normal[3],
+TEventResult TElectron::OnHit(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const double normal[3],
 		const solid &leaving, const solid &entering, TMCGenerator &mc, stopID &ID, std::vector<TParticle*> &secondaries) const{
-
+	return EVENT_UNCHANGED;
 }
 
 
-void TElectron::OnStep(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const dense_stepper_type &stepper,
+TEventResult TElectron::OnStep(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const TStepper &stepper,
 		const solid &currentsolid, TMCGenerator &mc, stopID &ID, std::vector<TParticle*> &secondaries) const{
 	if (currentsolid.ID > 1){
 		x2 = x1;
 		y2 = y1;
 		ID = ID_ABSORBED_IN_MATERIAL;
 //		printf("Absorption!\n");
+		return EVENT_ABSORBED;
 	}
 /*		else{
 		long double v = sqrt(y1[3]*y1[3] + y1[4]*y1[4] + y1[5]*y1[5]);
@@ -48,6 +49,7 @@ void TElectron::OnStep(const value_type x1, const state_type &y1, value_type &x2
 			}
 		}
 	}*/
+	return EVENT_UNCHANGED;
 }
 
 
@@ -1,16 +1,125 @@
 #include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <set>
+#include <iostream>
 
 #include "field.h"
 
 using namespace std;
 
-double TFieldScaler::scalingFactor(const double t) const{
-    *tvar = t;
-    return scaler.value();
+void TField::BField(const std::size_t n, const double *x, const double *y, const double *z, const double *t,
+        double *const B[3], double *const dBidxj[3][3]) const{
+    for (std::size_t k = 0; k < n; ++k){
+        double Bi[3], dBi[3][3];
+        for (int i = 0; i < 3; ++i){ // pass current values, so points outside the field stay unchanged
+            Bi[i] = B[i][k];
+            for (int j = 0; j < 3; ++j)
+                dBi[i][j] = dBidxj != nullptr ? dBidxj[i][j][k] : 0.;
+        }
+        BField(x[k], y[k], z[k], t[k], Bi, dBidxj != nullptr ? dBi : nullptr);
+        for (int i = 0; i < 3; ++i){
+            B[i][k] = Bi[i];
+            if (dBidxj != nullptr){
+                for (int j = 0; j < 3; ++j)
+                    dBidxj[i][j][k] = dBi[i][j];
+            }
+        }
+    }
 }
 
-void TFieldScaler::scaleScalarField(const double t, double &F, double dFdxi[3]) const{
-    double scaling = scalingFactor(t);
+/**
+ * Scaling formula compiled for use in a single thread
+ */
+struct TScalerExpression{
+    std::uint64_t generation; ///< generation of the slot for which the expression was compiled, see TScalerSlot
+    double t; ///< time variable referenced by the expression
+    double value; ///< value of expression at time t
+    exprtk::expression<double> expression; ///< compiled formula
+};
+
+/**
+ * Compile scaling formula with time variable "t"
+ *
+ * @param formula Formula string
+ *
+ * @return Returns expression and the time variable it references
+ */
+unique_ptr<TScalerExpression> CompileScaler(const std::string &formula){
+    unique_ptr<TScalerExpression> scaler(new TScalerExpression());
+    scaler->t = std::numeric_limits<double>::quiet_NaN(); // make sure first evaluation is not taken from memo
+    scaler->value = 0.;
+    exprtk::symbol_table<double> symbol_table;
+    symbol_table.add_variable("t", scaler->t);
+    symbol_table.add_constants();
+    scaler->expression.register_symbol_table(symbol_table);
+    exprtk::parser<double> parser;
+    if (not parser.compile(formula, scaler->expression)){
+        throw std::runtime_error(exprtk::parser_error::to_str(parser.get_error(0).mode) + " while parsing formula '" + formula + "': " + parser.get_error(0).diagnostic);
+    }
+    return scaler;
+}
+
+static mutex scalerSlotMutex; ///< lock for scalerSlotCount and freeScalerSlots
+static size_t scalerSlotCount = 0; ///< number of slots used so far
+static vector<size_t> freeScalerSlots; ///< slots whose scalers were destroyed
+static atomic<uint64_t> scalerGeneration(0); ///< number of assigned slots, distinguishes scalers that used the same slot
+
+TScalerSlot::TScalerSlot(): generation(++scalerGeneration){
+    lock_guard<mutex> lock(scalerSlotMutex);
+    if (freeScalerSlots.empty())
+        index = scalerSlotCount++;
+    else{
+        index = freeScalerSlots.back();
+        freeScalerSlots.pop_back();
+    }
+}
+
+TScalerSlot::~TScalerSlot(){
+    lock_guard<mutex> lock(scalerSlotMutex);
+    freeScalerSlots.push_back(index);
+}
+
+double TFieldScaler::evaluate(const double t) const{
+    if (not tabletimes.empty() and t >= tabletimes.front() and t <= tabletimes.back()){
+        std::size_t i = std::upper_bound(tabletimes.begin(), tabletimes.end(), t) - tabletimes.begin();
+        i = std::min(std::max<std::size_t>(i, 1), tablecoeffs.size()) - 1;
+        const double u = (t - tabletimes[i])/(tabletimes[i + 1] - tabletimes[i]);
+        const std::array<double, 4> &c = tablecoeffs[i];
+        return ((c[3]*u + c[2])*u + c[1])*u + c[0];
+    }
+    if (native != nullptr)
+        return native(t, 0., 0., 0.);
+    thread_local vector<unique_ptr<TScalerExpression> > scalers; // each thread evaluates its own copies of all formulas
+    if (slot->index >= scalers.size())
+        scalers.resize(slot->index + 1);
+    unique_ptr<TScalerExpression> &compiled = scalers[slot->index];
+    if (not compiled or compiled->generation != slot->generation){ // slot was used by a scaler that has been destroyed, replace its expression
+        compiled = CompileScaler(formula);
+        compiled->generation = slot->generation;
+    }
+    TScalerExpression &scaler = *compiled;
+    if (t != scaler.t){ // fields are usually evaluated several times at the same time, only evaluate formula if t changed
+        scaler.t = t;
+        scaler.value = scaler.expression.value();
+    }
+    return scaler.value;
+}
+
+/**
+ * Multiply scalar field and its gradient by a factor
+ *
+ * @param scaling Scaling factor
+ * @param F Value of scalar field
+ * @param dFdxi Gradient of scalar field (optional)
+ */
+void ScaleScalarField(const double scaling, double &F, double dFdxi[3]){
     F *= scaling;
     if (dFdxi != nullptr){
         dFdxi[0] *= scaling;
@@ -19,28 +128,106 @@ void TFieldScaler::scaleScalarField(const double t, double &F, double dFdxi[3])
     }
 }
 
-
-void TFieldScaler::scaleVectorField(const double t, double F[3], double dFidxj[3][3]) const{
+/**
+ * Multiply vector field and its Jacobian by a factor
+ *
+ * @param scaling Scaling factor
+ * @param F Value of vector field
+ * @param dFidxj Jacobian matrix of vector field (optional)
+ */
+void ScaleVectorField(const double scaling, double F[3], double dFidxj[3][3]){
     for (int i = 0; i < 3; ++i){
         if (dFidxj == nullptr){
-            scaleScalarField(t, F[i], nullptr);
+            ScaleScalarField(scaling, F[i], nullptr);
         }
         else{
-            scaleScalarField(t, F[i], dFidxj[i]);
+            ScaleScalarField(scaling, F[i], dFidxj[i]);
         }
     }
 }
 
+void TFieldScaler::scaleScalarField(const double t, double &F, double dFdxi[3]) const{
+    ScaleScalarField(scalingFactor(t), F, dFdxi);
+}
 
-TFieldScaler::TFieldScaler(const std::string &scalingFormula){
-    tvar = unique_ptr<double>(new double(0.0));
-    exprtk::symbol_table<double> symbol_table;
-    symbol_table.add_variable("t",*tvar);
-    symbol_table.add_constants();
-    scaler.register_symbol_table(symbol_table);
-    exprtk::parser<double> parser;
-    if (not parser.compile(scalingFormula, scaler)){
-        throw std::runtime_error(exprtk::parser_error::to_str(parser.get_error(0).mode) + " while parsing formula '" + scalingFormula + "': " + parser.get_error(0).diagnostic);
+
+void TFieldScaler::scaleVectorField(const double t, double F[3], double dFidxj[3][3]) const{
+    ScaleVectorField(scalingFactor(t), F, dFidxj);
+}
+
+
+TFieldScaler::TFieldScaler(const std::string &scalingFormula): formula(scalingFormula), slot(make_shared<const TScalerSlot>()){
+    unique_ptr<TScalerExpression> scaler = CompileScaler(formula); // check formula and whether it depends on time
+    constant = exprtk::expression_helper<double>::is_constant(scaler->expression);
+    constantFactor = constant ? scaler->expression.value() : 0.;
+    native = constant ? nullptr : CompileNativeFormula(formula, {"t"});
+}
+
+
+std::size_t TFieldScaler::tabulate(const double tmin, const double tmax, const double resolution, const double tolerance){
+    tabletimes.clear();
+    tablecoeffs.clear();
+    if (constant or tmax <= tmin or resolution <= 0)
+        return 0;
+
+    const unsigned CHECKPOINTS = 8; // number of subintervals in which the polynomial is compared to the formula
+    const double minwidth = resolution*std::ldexp(1., -30); // intervals are not bisected further, e.g. at discontinuities
+    // cubic Hermite polynomial with derivatives estimated from inside the interval, so steps at the ends of the interval do not spoil them
+    auto fit = [this](const double a, const double b, const double fa, const double fb){
+        const double h = (b - a)*1e-4;
+        const double da = (-3*fa + 4*evaluate(a + h) - evaluate(a + 2*h))/(2*h)*(b - a);
+        const double db = (3*fb - 4*evaluate(b - h) + evaluate(b - 2*h))/(2*h)*(b - a);
+        return std::array<double, 4>{{fa, da, 3*(fb - fa) - 2*da - db, 2*(fa - fb) + da + db}};
+    };
+
+    std::vector<double> times;
+    std::vector<std::array<double, 4> > coeffs;
+    std::size_t unresolved = 0;
+    const std::size_t steps = static_cast<std::size_t>(std::ceil((tmax - tmin)/resolution));
+    for (std::size_t i = 0; i < steps; ++i){
+        // stack of intervals still to be checked, last one is the leftmost, so accepted intervals are appended in order
+        std::vector<std::array<double, 4> > stack{{{tmin + i*(tmax - tmin)/steps, tmin + (i + 1)*(tmax - tmin)/steps, 0, 0}}};
+        stack.back()[2] = evaluate(stack.back()[0]);
+        stack.back()[3] = evaluate(stack.back()[1]);
+        while (not stack.empty()){
+            const std::array<double, 4> interval = stack.back();
+            const double a = interval[0], b = interval[1], fa = interval[2], fb = interval[3];
+            stack.pop_back();
+            std::array<double, 4> c = fit(a, b, fa, fb);
+            double error = 0;
+            for (unsigned k = 1; k < CHECKPOINTS; ++k){
+                const double u = static_cast<double>(k)/CHECKPOINTS;
+                error = std::max(error, std::abs(((c[3]*u + c[2])*u + c[1])*u + c[0] - evaluate(a + u*(b - a))));
+            }
+            if (error > tolerance and b - a > minwidth){
+                const double m = 0.5*(a + b), fm = evaluate(m);
+                stack.push_back({{m, b, fm, fb}});
+                stack.push_back({{a, m, fa, fm}});
+            }
+            else{
+                if (error > tolerance)
+                    ++unresolved;
+                times.push_back(a);
+                coeffs.push_back(c);
+            }
+        }
+    }
+    times.push_back(tmax);
+    tabletimes = std::move(times); // set table only now, evaluate used the formula so far
+    tablecoeffs = std::move(coeffs);
+    return unresolved;
+}
+
+
+void TFieldContainer::TabulateScalers(const double tmin, const double tmax, const double resolution, const double tolerance){
+    for (TFieldScaler *scaler: {&BScaler, &EScaler}){
+        if (scaler->isConstant())
+            continue;
+        std::size_t unresolved = scaler->tabulate(tmin, tmax, resolution, tolerance);
+        std::cout << "Tabulated scaling formula " << scaler->getFormula();
+        if (unresolved > 0)
+            std::cout << ", " << unresolved << " discontinuities";
+        std::cout << "\n";
     }
 }
 
@@ -68,59 +255,91 @@ bool TFieldBoundaryBox::inBounds(const double x, const double y, const double z)
 }
 
 
-void TFieldBoundaryBox::scaleScalarFieldAtBounds(const double x, const double y, const double z, double &F, double dFdxi[3]) const{
-    if (not hasBounds() or (F == 0 and dFdxi == nullptr) or (F == 0 and dFdxi[0] == 0 and dFdxi[1] == 0 and dFdxi[2] == 0)){ // skip if no boundary is set or field is zero
-        return;
+double TFieldBoundaryBox::distance(const double x, const double y, const double z) const{
+    if (not hasBounds()){
+        return 0.;
     }
-    else if (not inBounds(x, y, z)){ // set field to zero if coordinates are outside bounding box
-        F = 0.;
-        if (dFdxi != nullptr){
-            dFdxi[0] = dFdxi[1] = dFdxi[2] = 0.;
-        }
+    else{
+        double dx = max(max(xmin - x, x - xmax), 0.);
+        double dy = max(max(ymin - y, y - ymax), 0.);
+        double dz = max(max(zmin - z, z - zmax), 0.);
+        return sqrt(dx*dx + dy*dy + dz*dz);
     }
-    else if (boundaryWidth > 0){
-        // F'(x,y,z) = F(x,y,z)*f(x)*f(y)*f(z)
-        // dF'/dx = dF/dx*f(x)*f(y)*f(z) + F*df(x)/dx*f(y)*f(z) --> similar for dF'/dy and dF'/dz
+}
 
-        double Fscale = 1.; // f(x)*f(y)*f(z)
-        std::array<double, 3> dFadd = {0., 0., 0.}; // F*df(x_i)/dx_i / f(x_i)
+bool TFieldBoundaryBox::getBounds(std::array<double, 3> &min, std::array<double, 3> &max) const{
+    if (not hasBounds()){
+        return false;
+    }
+    min = {xmin, ymin, zmin};
+    max = {xmax, ymax, zmax};
+    return true;
+}
 
+bool TFieldBoundaryBox::smoothingFactor(const double x, const double y, const double z, double &Fscale, double dFscaledxi[3]) const{
+    if (not hasBounds()){ // skip if no boundary is set
+        return false;
+    }
+    else if (not inBounds(x, y, z)){ // set field to zero if coordinates are outside bounding box
+        Fscale = 0.;
+        dFscaledxi[0] = dFscaledxi[1] = dFscaledxi[2] = 0.;
+        return true;
+    }
+    else if (boundaryWidth > 0){
+        // f(x,y,z) = f(x)*f(y)*f(z), df/dx = df(x)/dx*f(y)*f(z) --> similar for df/dy and df/dz
+        std::array<double, 3> f = {1., 1., 1.}, df = {0., 0., 0.};
+        bool scaled = false;
         std::array<double, 3> distanceFromLoBoundary = {(x - xmin)/boundaryWidth, (y - ymin)/boundaryWidth, (z - zmin)/boundaryWidth};
         std::array<double, 3> distanceFromHiBoundary = {(xmax - x)/boundaryWidth, (ymax - y)/boundaryWidth, (zmax - z)/boundaryWidth}; // calculate distance to edges in units of BoundaryWidth
         for (int i = 0; i < 3; ++i){
             if (0 <= distanceFromLoBoundary[i] and distanceFromLoBoundary[i] <= 1){
-                Fscale *= smthrStp(distanceFromLoBoundary[i]);
-                if (dFdxi != nullptr) dFadd[i] += F*smthrStpDer(distanceFromLoBoundary[i])/boundaryWidth/smthrStp(distanceFromLoBoundary[i]);
+                f[i] = smthrStp(distanceFromLoBoundary[i]);
+                df[i] = smthrStpDer(distanceFromLoBoundary[i])/boundaryWidth;
+                scaled = true;
             }
             else if (0 <= distanceFromHiBoundary[i] and distanceFromHiBoundary[i] <= 1){
-                Fscale *= smthrStp(distanceFromHiBoundary[i]);
-                if (dFdxi != nullptr) dFadd[i] += -F*smthrStpDer(distanceFromHiBoundary[i])/boundaryWidth/smthrStp(distanceFromHiBoundary[i]);
-            }
-        }
-        if (Fscale != 1.){
-            F *= Fscale; // scale field value
-            if (dFdxi != nullptr){
-                for (int i = 0; i < 3; i++){
-                    dFdxi[i] = dFdxi[i]*Fscale + dFadd[i]*Fscale; // scale derivatives according to product rule
-                }
+                f[i] = smthrStp(distanceFromHiBoundary[i]);
+                df[i] = -smthrStpDer(distanceFromHiBoundary[i])/boundaryWidth;
+                scaled = true;
             }
         }
+        if (not scaled)
+            return false;
+        Fscale = f[0]*f[1]*f[2];
+        dFscaledxi[0] = df[0]*f[1]*f[2];
+        dFscaledxi[1] = f[0]*df[1]*f[2];
+        dFscaledxi[2] = f[0]*f[1]*df[2];
+        return Fscale != 1.;
     }
     else{ // coordinates are in bounds but field doesn't need to be scaled
+        return false;
+    }
+}
+
+
+void TFieldBoundaryBox::scaleScalarFieldAtBounds(const double x, const double y, const double z, double &F, double dFdxi[3]) const{
+    double Fscale, dFscaledxi[3];
+    if (not smoothingFactor(x, y, z, Fscale, dFscaledxi))
         return;
+    if (dFdxi != nullptr){
+        for (int i = 0; i < 3; i++){
+            dFdxi[i] = dFdxi[i]*Fscale + F*dFscaledxi[i]; // scale derivatives according to product rule
+        }
     }
+    F *= Fscale; // scale field value
 }
 
 
 void TFieldBoundaryBox::scaleVectorFieldAtBounds(const double x, const double y, const double z, double F[3], double dFidxj[3][3]) const{
+    double Fscale, dFscaledxi[3];
+    if (not smoothingFactor(x, y, z, Fscale, dFscaledxi)) // factor is computed once and applied to all components
+        return;
     for (int i = 0; i < 3; ++i){
-        if (dFidxj == nullptr){
-            scaleScalarFieldAtBounds(x, y, z, F[i], nullptr);
-        }
-        else{
-            scaleScalarFieldAtBounds(x, y, z, F[i], dFidxj[i]);
+        if (dFidxj != nullptr){
+            for (int j = 0; j < 3; ++j)
+                dFidxj[i][j] = dFidxj[i][j]*Fscale + F[i]*dFscaledxi[j];
         }
-        
+        F[i] *= Fscale;
     }
 }
 
@@ -137,7 +356,10 @@ TFieldBoundaryBox::TFieldBoundaryBox(const double _xmax, const double _xmin, con
 }
 
 void TFieldContainer::BField(const double x, const double y, const double z, const double t, double B[3], double dBidxj[3][3]) const{
-    if (not boundary->inBounds(x, y, z) or BScaler.scalingFactor(t) == 0.){
+    double scaling = BScaler.scalingFactor(t); // evaluate scaling formula only once per call
+    if (rffrequency != 0)
+        scaling *= cos(rffrequency*t + rfphase);
+    if (scaling == 0. or not boundary->inBounds(x, y, z)){
         for (int i = 0; i < 3; ++i){
             B[i] = 0.;
             if (dBidxj != nullptr){
@@ -149,13 +371,87 @@ void TFieldContainer::BField(const double x, const double y, const double z, con
     }
     else{
         field->BField(x, y, z, t, B, dBidxj);
-        BScaler.scaleVectorField(t, B, dBidxj);
+        if (scaling != 1.)
+            ScaleVectorField(scaling, B, dBidxj);
         boundary->scaleVectorFieldAtBounds(x, y, z, B, dBidxj);
     }
 }
 
+void TFieldContainer::BField(const std::size_t n, const double *x, const double *y, const double *z, const double *t, double *const B[3], double *const dBidxj[3][3]) const{
+    vector<size_t> inside; // points inside the boundary with non-zero scaling
+    vector<double> scaling;
+    inside.reserve(n);
+    scaling.reserve(n);
+    for (size_t k = 0; k < n; ++k){
+        for (int i = 0; i < 3; ++i){
+            B[i][k] = 0.;
+            if (dBidxj != nullptr){
+                for (int j = 0; j < 3; ++j)
+                    dBidxj[i][j][k] = 0.;
+            }
+        }
+        double s = BScaler.scalingFactor(t[k]);
+        if (rffrequency != 0)
+            s *= cos(rffrequency*t[k] + rfphase);
+        if (s != 0. and boundary->inBounds(x[k], y[k], z[k])){
+            inside.push_back(k);
+            scaling.push_back(s);
+        }
+    }
+    const size_t m = inside.size();
+    if (m == 0)
+        return;
+
+    vector<double> coords(4*m), F(12*m, 0.); // gathered coordinates and field values of points inside, as structure of arrays
+    double *xi = &coords[0], *yi = xi + m, *zi = yi + m, *ti = zi + m;
+    for (size_t l = 0; l < m; ++l){
+        xi[l] = x[inside[l]];
+        yi[l] = y[inside[l]];
+        zi[l] = z[inside[l]];
+        ti[l] = t[inside[l]];
+    }
+    double *const Bi[3] = {&F[0], &F[m], &F[2*m]};
+    double *const dBi[3][3] = {{&F[3*m], &F[4*m], &F[5*m]}, {&F[6*m], &F[7*m], &F[8*m]}, {&F[9*m], &F[10*m], &F[11*m]}};
+    field->BField(m, xi, yi, zi, ti, Bi, dBidxj != nullptr ? dBi : nullptr);
+
+    for (size_t l = 0; l < m; ++l){ // scale each point like the single-point version and scatter it into the result
+        const size_t k = inside[l];
+        double Bl[3], dBl[3][3];
+        for (int i = 0; i < 3; ++i){
+            Bl[i] = Bi[i][l];
+            for (int j = 0; j < 3; ++j)
+                dBl[i][j] = dBi[i][j][l];
+        }
+        if (scaling[l] != 1.)
+            ScaleVectorField(scaling[l], Bl, dBidxj != nullptr ? dBl : nullptr);
+        boundary->scaleVectorFieldAtBounds(x[k], y[k], z[k], Bl, dBidxj != nullptr ? dBl : nullptr);
+        for (int i = 0; i < 3; ++i){
+            B[i][k] = Bl[i];
+            if (dBidxj != nullptr){
+                for (int j = 0; j < 3; ++j)
+                    dBidxj[i][j][k] = dBl[i][j];
+            }
+        }
+    }
+}
+
+void TFieldContainer::RFAmplitude(const double x, const double y, const double z, const double t, double B[3]) const{
+    double scaling = BScaler.scalingFactor(t);
+    if (scaling == 0. or not boundary->inBounds(x, y, z)){
+        for (int i = 0; i < 3; ++i)
+            B[i] = 0.;
+    }
+    else{
+        field->BField(x, y, z, t, B, nullptr);
+        if (scaling != 1.)
+            ScaleVectorField(scaling, B, nullptr);
+        boundary->scaleVectorFieldAtBounds(x, y, z, B, nullptr);
+    }
+}
+
 void TFieldContainer::EField(const double x, const double y, const double z, const double t, double &V, double Ei[3]) const{
-    if (not boundary->inBounds(x, y, z) or EScaler.scalingFactor(t) == 0.){
+    double scaling = EScaler.scalingFactor(t);
+    if (scaling == 0. or not boundary->inBounds(x, y, z)){
         V = 0.;
         for (int i = 0; i < 3; ++i){
             Ei[i] = 0.;
@@ -163,7 +459,38 @@ void TFieldContainer::EField(const double x, const double y, const double z, con
     }
     else{
         field->EField(x, y, z, t, V, Ei);
-        EScaler.scaleScalarField(t, V, Ei);
+        if (scaling != 1.)
+            ScaleScalarField(scaling, V, Ei);
         boundary->scaleScalarFieldAtBounds(x, y, z, V, Ei);
     }
 }
+
+
+std::shared_ptr<const TField> SharedTable(const std::string &parameters, const std::function<std::unique_ptr<TField>()> &load){
+    static std::mutex tablemutex;
+    static std::condition_variable loaded;
+    static std::map<std::string, std::weak_ptr<const TField> > tables; // tables are freed when the last field using them is destroyed
+    static std::set<std::string> loading; // tables currently loaded by another thread
+    std::unique_lock<std::mutex> lock(tablemutex);
+    while (loading.count(parameters) > 0) // different tables are loaded in parallel, the same table only once
+        loaded.wait(lock);
+    std::shared_ptr<const TField> table = tables[parameters].lock();
+    if (not table){
+        loading.insert(parameters);
+        lock.unlock();
+        try{
+            table = load();
+        }
+        catch (...){
+            lock.lock();
+            loading.erase(parameters);
+            loaded.notify_all();
+            throw;
+        }
+        lock.lock();
+        loading.erase(parameters);
+        tables[parameters] = table;
+        loaded.notify_all();
+    }
+    return table;
+}
@@ -8,13 +8,14 @@
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <vector>
+#include <algorithm>
+#include <functional>
 
 #include "boost/format.hpp"
-#include <boost/iostreams/filtering_stream.hpp>
-#include <boost/iostreams/filter/bzip2.hpp>
-#include <boost/iostreams/filter/gzip.hpp>
 
 #include "globals.h"
+#include "tablereader.h"
 
 using namespace std;
 
@@ -34,7 +35,40 @@ void CylToCart(const double v_r, const double v_phi, const double phi, double &v
 }
 
 
-TFieldContainer ReadOperaField2(const std::string &params, const std::map<std::string, std::string> &formulas){
+/**
+ * Evaluate bicubic interpolation of several field components and their derivatives in one pass, using Horner's scheme.
+ *
+ * @tparam N Number of components
+ * @param a Interpolation coefficients (16*N doubles, coefficient of dr^i*dz^j of component l at index (4*i + j)*N + l)
+ * @param dr Radial distance from lower corner of grid cell
+ * @param dz Axial distance from lower corner of grid cell
+ * @param F Returns interpolated value of each component
+ * @param dFdr Returns derivative of each component with respect to r
+ * @param dFdz Returns derivative of each component with respect to z
+ */
+template<int N>
+inline void bicubic_eval_fused(const double *a, const double dr, const double dz, double F[N], double dFdr[N], double dFdz[N]){
+	for (int l = 0; l < N; ++l)
+		F[l] = dFdr[l] = dFdz[l] = 0.;
+	for (int i = 3; i >= 0; --i){
+		double pz[N] = {}, dpz[N] = {}; // polynomial in z and its derivative
+		for (int j = 3; j >= 0; --j){
+			const double *aj = &a[(4*i + j)*N];
+			for (int l = 0; l < N; ++l){
+				if (j > 0) dpz[l] = dpz[l]*dz + j*aj[l];
+				pz[l] = pz[l]*dz + aj[l];
+			}
+		}
+		for (int l = 0; l < N; ++l){
+			if (i > 0) dFdr[l] = dFdr[l]*dr + i*pz[l];
+			F[l] = F[l]*dr + pz[l];
+			dFdz[l] = dFdz[l]*dr + dpz[l];
+		}
+	}
+}
+
+
+TFieldContainer ReadOperaField2(const std::string &params, const std::map<std::string, std::string> &formulas, const unsigned nthreads){
     std::istringstream ss(params);
     boost::filesystem::path ft;
     std::string fieldtype, Bscale, Escale;
@@ -58,7 +92,11 @@ TFieldContainer ReadOperaField2(const std::string &params, const std::map<std::s
         throw std::runtime_error((boost::format("Could not read all required parameters for field %1%!") % fieldtype).str());
     }
 
-    return TFieldContainer(std::unique_ptr<TabField>(new TabField(boost::filesystem::absolute(ft, configpath.parent_path()).string(), lengthconv)), Bscale, Escale);
+    std::string tabfile = boost::filesystem::absolute(ft, configpath.parent_path()).string();
+    std::shared_ptr<const TField> tab = SharedTable((boost::format("%1% OPERA2D %2$.17g") % tabfile % lengthconv).str(), [&]{
+        return std::unique_ptr<TField>(new TabField(tabfile, lengthconv, nthreads));
+    });
+    return TFieldContainer(tab, Bscale, Escale);
 }
 
 
@@ -66,78 +104,70 @@ void TabField::ReadTabFile(const std::string &tabfile, const double lengthconv,
 		alglib::real_1d_array BTabs[3], alglib::real_1d_array ETabs[3], alglib::real_1d_array &VTab){
 	
 	boost::filesystem::path filepath = boost::filesystem::absolute(tabfile, configpath.parent_path());
-	std::ifstream FINstream(filepath.string(), std::ifstream::in | std::ifstream::binary);
-	boost::iostreams::filtering_istream FIN;
-	if (boost::filesystem::extension(filepath) == ".bz2"){
-		FIN.push(boost::iostreams::bzip2_decompressor());
-	}
-	else if (boost::filesystem::extension(filepath) == ".gz"){
-		FIN.push(boost::iostreams::gzip_decompressor());
-	}
-	FIN.push(FINstream);
-	if (!FINstream.is_open() or !FIN.is_complete()){
-		throw std::runtime_error("Could not open " + filepath.string());
-	}
+	TTableReader FIN(filepath);
 
 	cout << "\nReading " << filepath << "!\n";
-	int intval;
 	string line;
-	FIN >> m >> intval >> n;
+	double header[3];
+	bool good = FIN.ReadNumber(header[0]) && FIN.ReadNumber(header[1]) && FIN.ReadNumber(header[2]);
+	m = header[0];
+	n = header[2];
 	rind.setlength(m);
 	zind.setlength(n);
 
-	getline(FIN,line);
-	getline(FIN,line);
-	getline(FIN,line);
+	good = FIN.ReadLine(line) && good;
+	good = FIN.ReadLine(line) && good;
+	good = FIN.ReadLine(line) && good;
 	bool skipy = true;
 	if (line.substr(0,12) == " 2 Y [LENGU]")  skipy = false;
-	getline(FIN,line);
-	if (!skipy) getline(FIN,line);
+	good = FIN.ReadLine(line) && good;
+	if (!skipy) good = FIN.ReadLine(line) && good;
 
 	if (line.find("RBX") != string::npos){
 		BTabs[0].setlength(m*n);
-		getline(FIN,line);
+		good = FIN.ReadLine(line) && good;
 	}
 	if (line.find("RBY") != string::npos){
 		BTabs[1].setlength(m*n);
-		getline(FIN,line);
+		good = FIN.ReadLine(line) && good;
 	}
 	if (line.find("RBZ") != string::npos){
 		BTabs[2].setlength(m*n);
-		getline(FIN,line);
+		good = FIN.ReadLine(line) && good;
 	}
 
 	if (line.find("EX") != string::npos){
 		ETabs[0].setlength(m*n);
-		getline(FIN,line);
+		good = FIN.ReadLine(line) && good;
 	}
 	if (line.find("EY") != string::npos){
 		ETabs[1].setlength(m*n);
-		getline(FIN,line);
+		good = FIN.ReadLine(line) && good;
 	}
 	if (line.find("EZ") != string::npos){
 		ETabs[2].setlength(m*n);
-		getline(FIN,line);
+		good = FIN.ReadLine(line) && good;
 	}
 
 	if (line.find("RV") != string::npos){	// file contains potential?
 		VTab.setlength(m*n);
-		getline(FIN,line);
+		good = FIN.ReadLine(line) && good;
 	}
 
-	if (!FIN || line.substr(0,2) != " 0"){
+	if (!good || line.substr(0,2) != " 0"){
 		std::cout << filepath << " not found or corrupt! Exiting...\n";
 		exit(-1);
 	}
 
+	std::vector<alglib::real_1d_array*> columns; // columns following coordinates
+	for (alglib::real_1d_array *tab: {&BTabs[0], &BTabs[1], &BTabs[2], &ETabs[0], &ETabs[1], &ETabs[2], &VTab}){
+		if (tab->length() > 0)
+			columns.push_back(tab);
+	}
 	int ri = 0,zi = -1;
 	double r, z, val;
 	progress_display progress(n*m, std::cout);
-	while (FIN.good()){
-		FIN >> r;
-		if (!skipy) FIN >> val;
-		FIN >> z;
-		if (!FIN) break;
+	while (FIN.ReadNumber(r) && (skipy || FIN.ReadNumber(val)) && FIN.ReadNumber(z)){
 		r *= lengthconv;
 		z *= lengthconv;
 		if (zi >= 0 && z < zind[zi]){
@@ -145,6 +175,10 @@ void TabField::ReadTabFile(const std::string &tabfile, const double lengthconv,
 			zi = 0;
 		}
 		else zi++;
+		if (ri >= m || zi >= n){
+			std::cout << "\nThe header says the size is " << m << " by " << n << ", but " << filepath << " contains more grid points! Exiting...\n";
+			exit(-1);
+		}
 
 		// status if read is displayed
 		++progress;
@@ -153,35 +187,10 @@ void TabField::ReadTabFile(const std::string &tabfile, const double lengthconv,
 		rind[ri] = r;
 		zind[zi] = z;
 		int i2 = zi * m + ri;
-		if (BTabs[0].length() > 0){
-			FIN >> val;
-			BTabs[0][i2] = val;
-		}
-		if (BTabs[1].length() > 0){
-			FIN >> val;
-			BTabs[1][i2] = val;
-		}
-		if (BTabs[2].length() > 0){
-			FIN >> val;
-			BTabs[2][i2] = val;
-		}
-		if (ETabs[0].length() > 0){
-			FIN >> val;
-			ETabs[0][i2] = val;
+		for (alglib::real_1d_array *column: columns){
+			if (not FIN.ReadNumber((*column)[i2]))
+				throw std::runtime_error((boost::format("Error reading line %1% of file %2%") % FIN.LineNumber() % filepath.string()).str());
 		}
-		if (ETabs[1].length() > 0){
-			FIN >> val;
-			ETabs[1][i2] = val;
-		}
-		if (ETabs[2].length() > 0){
-			FIN >> val;
-			ETabs[2][i2] = val;
-		}
-		if (VTab.length() > 0){
-			FIN >> val;
-			VTab[i2] = val;
-		}
-		FIN >> ws;
 	}
 
 	std::cout << "\n";
@@ -229,7 +238,46 @@ void TabField::CheckTab(const alglib::real_1d_array &rind, const alglib::real_1d
 	std::cout << "The input table file has values of magnetic field |B| from " << Babsmin << " to " << Babsmax << " and values of electric potential from " << Vmin << " to " << Vmax << "\n";
 }
 
-TabField::TabField(const std::string &tabfile, const double alengthconv){
+template<int N>
+void TabField::PreInterpol(const alglib::real_1d_array &rind, const alglib::real_1d_array &zind, const alglib::real_1d_array &Tab,
+		const unsigned component, std::vector<bicubic_coeff<N> > &coeffs) const{
+	alglib::spline2dinterpolant spline;
+	alglib::spline2dbuildbicubicv(rind, m, zind, n, Tab, 1, spline);
+	alglib::ae_int_t rsize, zsize, d;
+	alglib::real_2d_array tbl;
+	alglib::spline2dunpackv(spline, rsize, zsize, d, tbl); // get polynomial coefficients of each grid cell
+	for (int iz = 0; iz < n - 1; ++iz){
+		for (int ir = 0; ir < m - 1; ++ir){
+			const double *c = &tbl[iz*(m - 1) + ir][4]; // coefficient of (r - r_i)^i*(z - z_j)^j at index 4*i + j
+			for (int i = 0; i < 16; ++i)
+				coeffs[ir*(n - 1) + iz][i*N + component] = c[i]; // store them interleaved with other components
+		}
+	}
+}
+
+
+bool TabField::FindCell(const double r, const double z, unsigned long &cell, double &dr, double &dz) const{
+	if (not (r >= r_mi && r < r_mi + rdist*(m - 1) && z >= z_mi && z < z_mi + zdist*(n - 1)))
+		return false;
+	long ir = std::min(std::max(static_cast<long>((r - r_mi)/rdist), 0L), static_cast<long>(m) - 2);
+	long iz = std::min(std::max(static_cast<long>((z - z_mi)/zdist), 0L), static_cast<long>(n) - 2);
+	// correct for rounding errors and deviations of grid points from a perfectly regular grid
+	while (ir > 0 && r < rgrid[ir])
+		--ir;
+	while (ir < m - 2 && r >= rgrid[ir + 1])
+		++ir;
+	while (iz > 0 && z < zgrid[iz])
+		--iz;
+	while (iz < n - 2 && z >= zgrid[iz + 1])
+		++iz;
+	cell = ir*(n - 1) + iz;
+	dr = r - rgrid[ir];
+	dz = z - zgrid[iz];
+	return true;
+}
+
+
+TabField::TabField(const std::string &tabfile, const double alengthconv, const unsigned nthreads){
 	alglib::real_1d_array rind, zind, BTabs[3], ETabs[3], VTab;
 
 	ReadTabFile(tabfile, alengthconv, rind, zind, BTabs, ETabs, VTab); // open tabfile and read values into arrays
@@ -238,98 +286,77 @@ TabField::TabField(const std::string &tabfile, const double alengthconv){
 
 	std::cout << "Starting Preinterpolation ... ";
 	fBrc = fBphic = fBzc = fErc = fEphic = fEzc = fVc = false;
-	if (BTabs[0].length() > 0){
-		cout << "Br ... ";
-		cout.flush();
-		alglib::spline2dbuildbicubicv(rind, m, zind, n, BTabs[0], 1, Brc);
-		fBrc = true;
-	}
-	if (BTabs[1].length() > 0){
-		cout << "Bhi ... ";
-		cout.flush();
-		alglib::spline2dbuildbicubicv(rind, m, zind, n, BTabs[1], 1, Bphic);
-		fBphic = true;
-	}
-	if (BTabs[2].length() > 0){
-		cout << "Bz ... ";
-		cout.flush();
-		alglib::spline2dbuildbicubicv(rind, m, zind, n, BTabs[2], 1, Bzc);
-		fBzc = true;
-	}
-	if (ETabs[0].length() > 0){
-		cout << "Er ... ";
-		cout.flush();
-		alglib::spline2dbuildbicubicv(rind, m, zind, n, ETabs[0], 1, Erc);
-        VTab.setlength(0); // ignore potential if electric field map found
-		fErc = true;
-	}
-	if (ETabs[1].length() > 0){
-		cout << "Ephi ... ";
-		cout.flush();
-		alglib::spline2dbuildbicubicv(rind, m, zind, n, ETabs[1], 1, Ephic);
-        VTab.setlength(0); // ignore potential if electric field map found
-		fEphic = true;
-	}
-	if (ETabs[2].length() > 0){
-		cout << "Ez ... ";
-		cout.flush();
-		alglib::spline2dbuildbicubicv(rind, m, zind, n, ETabs[2], 1, Ezc);
-        VTab.setlength(0); // ignore potential if electric field map found
-		fEzc = true;
+	if (ETabs[0].length() > 0 || ETabs[1].length() > 0 || ETabs[2].length() > 0)
+		VTab.setlength(0); // ignore potential if electric field map found
+
+	rgrid.assign(&rind[0], &rind[0] + m);
+	zgrid.assign(&zind[0], &zind[0] + n);
+	bicubic_coeff<3> zero3;
+	zero3.fill(0.);
+	if (BTabs[0].length() > 0 || BTabs[1].length() > 0 || BTabs[2].length() > 0)
+		Bcoeffs.assign((m - 1)*(n - 1), zero3);
+	if (ETabs[0].length() > 0 || ETabs[1].length() > 0 || ETabs[2].length() > 0)
+		Ecoeffs.assign((m - 1)*(n - 1), zero3);
+	if (VTab.length() > 0)
+		Vcoeffs.resize((m - 1)*(n - 1));
+
+	struct spline{ const char *name; alglib::real_1d_array *tab; bool *loaded; std::function<void()> build; };
+	std::vector<spline> splines;
+	for (const spline &s: {
+			spline{"Br", &BTabs[0], &fBrc, [&]{ PreInterpol<3>(rind, zind, BTabs[0], 0, Bcoeffs); }},
+			spline{"Bhi", &BTabs[1], &fBphic, [&]{ PreInterpol<3>(rind, zind, BTabs[1], 1, Bcoeffs); }},
+			spline{"Bz", &BTabs[2], &fBzc, [&]{ PreInterpol<3>(rind, zind, BTabs[2], 2, Bcoeffs); }},
+			spline{"Er", &ETabs[0], &fErc, [&]{ PreInterpol<3>(rind, zind, ETabs[0], 0, Ecoeffs); }},
+			spline{"Ephi", &ETabs[1], &fEphic, [&]{ PreInterpol<3>(rind, zind, ETabs[1], 1, Ecoeffs); }},
+			spline{"Ez", &ETabs[2], &fEzc, [&]{ PreInterpol<3>(rind, zind, ETabs[2], 2, Ecoeffs); }},
+			spline{"V", &VTab, &fVc, [&]{ PreInterpol<1>(rind, zind, VTab, 0, Vcoeffs); }}}){
+		if (s.tab->length() > 0){
+			cout << s.name << " ... ";
+			splines.push_back(s);
+		}
 	}
-    if (VTab.length() > 0){
-        cout << "V ... ";
-        cout.flush();
-        alglib::spline2dbuildbicubicv(rind, m, zind, n, VTab, 1, Vc);
-        fVc = true;
-    }
+	cout.flush();
+	ParallelFor(splines.size(), nthreads, [&](const unsigned long begin, const unsigned long end){ // build splines of all field components in parallel
+		for (unsigned long i = begin; i < end; ++i){
+			splines[i].build();
+			*splines[i].loaded = true;
+		}
+	});
 	cout << "Done\n";
 }
 
 void TabField::BField(const double x, const double y, const double z, const double t, double B[3], double dBidxj[3][3]) const{
 	double r = sqrt(x*x+y*y);
-	if (r >= r_mi && r < r_mi + rdist*(m - 1) && z >= z_mi && z < z_mi + zdist*(n - 1)){
-		// bicubic interpolation
-		double Br = 0, Bphi = 0;
-		double Bx = 0, By = 0, Bz = 0;
+	unsigned long cell;
+	double dr, dz;
+	if (!Bcoeffs.empty() && FindCell(r, z, cell, dr, dz)){
+		// bicubic interpolation of all components at once
+		double Bc[3], dBdr[3], dBdz[3];
+		bicubic_eval_fused<3>(Bcoeffs[cell].data(), dr, dz, Bc, dBdr, dBdz);
+		double Br = Bc[0], Bphi = Bc[1];
+		double Bx = 0, By = 0;
 		double phi = atan2(y,x);
 		if (dBidxj != NULL){
-			double dBrdr = 0, dBrdz = 0, dBphidr = 0, dBphidz = 0, dBzdr = 0, dBxdz = 0, dBydz = 0, dBzdz = 0;
-			double dummy;
-			if (fBrc){
-				alglib::spline2ddiff(Brc, r, z, Br, dBrdr, dBrdz, dummy);
-			}
-			if (fBphic){
-				alglib::spline2ddiff(Bphic, r, z, Bphi, dBphidr, dBphidz, dummy);
-			}
+			double dBrdr = dBdr[0], dBphidr = dBdr[1], dBxdz = 0, dBydz = 0;
 			if (r > 0){
 				dBidxj[0][0] = dBrdr*cos(phi)*cos(phi) - dBphidr*cos(phi)*sin(phi) + (Br*sin(phi)*sin(phi) + Bphi*cos(phi)*sin(phi))/r;
 				dBidxj[0][1] = dBrdr*cos(phi)*sin(phi) - dBphidr*sin(phi)*sin(phi) - (Br*cos(phi)*sin(phi) + Bphi*cos(phi)*cos(phi))/r;
 				dBidxj[1][0] = dBrdr*cos(phi)*sin(phi) + dBphidr*cos(phi)*cos(phi) - (Br*cos(phi)*sin(phi) - Bphi*sin(phi)*sin(phi))/r;
 				dBidxj[1][1] = dBrdr*sin(phi)*sin(phi) + dBphidr*cos(phi)*sin(phi) + (Br*cos(phi)*cos(phi) - Bphi*cos(phi)*sin(phi))/r;
 			}
-			CylToCart(dBrdz,dBphidz,phi,dBxdz,dBydz);
+			CylToCart(dBdz[0],dBdz[1],phi,dBxdz,dBydz);
 			dBidxj[0][2] = dBxdz;
 			dBidxj[1][2] = dBydz;
 			if (fBzc){
-				alglib::spline2ddiff(Bzc, r, z, Bz, dBzdr, dBzdz, dummy);
-				dBidxj[2][0] = dBzdr*cos(phi);
-				dBidxj[2][1] = dBzdr*sin(phi);
-				dBidxj[2][2] = dBzdz;
+				dBidxj[2][0] = dBdr[2]*cos(phi);
+				dBidxj[2][1] = dBdr[2]*sin(phi);
+				dBidxj[2][2] = dBdz[2];
 			}
 		}
-		else{
-			if (fBrc)
-				Br = alglib::spline2dcalc(Brc, r, z);
-			if (fBphic)
-				Bphi = alglib::spline2dcalc(Bphic, r, z);
-			if (fBzc)
-				Bz = alglib::spline2dcalc(Bzc, r, z);
-		}
 		CylToCart(Br,Bphi,phi,Bx,By);
 		B[0] = Bx;
 		B[1] = By;
-		B[2] = Bz;
+		B[2] = Bc[2];
 	}
 }
 
@@ -337,63 +364,33 @@ void TabField::BField(const double x, const double y, const double z, const doub
 void TabField::EField(const double x, const double y, const double z, const double t,
 		double &V, double Ei[3]) const{
 	double r = sqrt(x*x+y*y);
-	if (r >= r_mi && r < r_mi + rdist*(m - 1) && z >= z_mi && z < z_mi + zdist*(n - 1)){
-		if (fErc || fEphic || fEzc){ // prefer E-field interpolation over potential interpolation
+	unsigned long cell;
+	double dr, dz;
+	if (FindCell(r, z, cell, dr, dz)){
+		if (!Ecoeffs.empty()){ // prefer E-field interpolation over potential interpolation
 			double phi = atan2(y,x);
-//			if (dEidxj == nullptr){
-				alglib::real_1d_array Er("[0]"), Ephi("[0]"), Ez("[0]");
-				double Ex, Ey;
-				if (fErc)
-					alglib::spline2dcalcvbuf(Erc, r, z, Er); // use cheaper interpolation if derivatives not required
-				if (fEphic)
-					alglib::spline2dcalcvbuf(Ephic, r, z, Ephi);
-				if (fEzc)
-					alglib::spline2dcalcvbuf(Ezc, r, z, Ez);
-				CylToCart(Er[0], Ephi[0], phi, Ex, Ey); // convert r,phi components to x,y components
-				Ei[0] = Ex; // set electric field
-				Ei[1] = Ey;
-				Ei[2] = Ez[0];
-/*			}
-			else{
-				double Er = 0, Ephi = 0, Ex = 0, Ey = 0, Ez = 0, dummy;
-				double dErdr, dErdz, dEphidr, dEphidz, dEzdr, dEzdz, dExdz, dEydz;
-				//bicubic interpolation
-				if (fErc)
-					alglib::spline2ddiff(Erc, r, z, Er, dErdr, dErdz, dummy);
-				if (fEphic)
-					alglib::spline2ddiff(Ephic, r, z, Ephi, dEphidr, dEphidz, dummy);
-				if (fEzc)
-					alglib::spline2ddiff(Ezc, r, z, Ez, dEzdr, dEzdz, dummy);
-				CylToCart(Er,Ephi,phi,Ex,Ey); // convert r,phi components to x,y components
-				Ei[0] = Ex*Escale; // set electric field
-				Ei[1] = Ey*Escale;
-				Ei[2] = Ez*Escale;
-				if (r > 0){ // convert r,phi derivatives to x,y derivatives
-					dEidxj[0][0] = Escale*(dErdr*cos(phi)*cos(phi) - dEphidr*cos(phi)*sin(phi) + (Er*sin(phi)*sin(phi) + Ephi*cos(phi)*sin(phi))/r);
-					dEidxj[0][1] = Escale*(dErdr*cos(phi)*sin(phi) - dEphidr*sin(phi)*sin(phi) - (Er*cos(phi)*sin(phi) + Ephi*cos(phi)*cos(phi))/r);
-					dEidxj[1][0] = Escale*(dErdr*cos(phi)*sin(phi) + dEphidr*cos(phi)*cos(phi) - (Er*cos(phi)*sin(phi) - Ephi*sin(phi)*sin(phi))/r);
-					dEidxj[1][1] = Escale*(dErdr*sin(phi)*sin(phi) + dEphidr*cos(phi)*sin(phi) + (Er*cos(phi)*cos(phi) - Ephi*cos(phi)*sin(phi))/r);
-				}
-				CylToCart(dErdz,dEphidz,phi,dExdz,dEydz); // convert z-derivatives of r,phi components into z-derivatives of x,y components
-				dEidxj[0][2] = dExdz*Escale;
-				dEidxj[1][2] = dEydz*Escale;
-				dEidxj[2][0] = dEzdr*cos(phi)*Escale;
-				dEidxj[2][1] = dEzdr*sin(phi)*Escale;
-				dEidxj[2][2] = dEzdz*Escale;
-			}*/
+			double Ec[3], dEdr[3], dEdz[3];
+			double Ex, Ey;
+			bicubic_eval_fused<3>(Ecoeffs[cell].data(), dr, dz, Ec, dEdr, dEdz);
+			CylToCart(Ec[0], Ec[1], phi, Ex, Ey); // convert r,phi components to x,y components
+			Ei[0] = Ex; // set electric field
+			Ei[1] = Ey;
+			Ei[2] = Ec[2];
 		}
-
-        else if (fVc){
-            double dVdrj[3], dummy;
-            // bicubic interpolation
-            alglib::spline2ddiff(Vc, r, z, V, dVdrj[0], dVdrj[2], dummy);
-            double phi = atan2(y,x);
-            Ei[0] = -dVdrj[0]*cos(phi);
-            Ei[1] = -dVdrj[0]*sin(phi);
-            Ei[2] = -dVdrj[2];
-        }
-
+		else if (!Vcoeffs.empty()){
+			double dVdr, dVdz;
+			// bicubic interpolation
+			bicubic_eval_fused<1>(Vcoeffs[cell].data(), dr, dz, &V, &dVdr, &dVdz);
+			double phi = atan2(y,x);
+			Ei[0] = -dVdr*cos(phi);
+			Ei[1] = -dVdr*sin(phi);
+			Ei[2] = -dVdz;
+		}
+	}
+}
 
 
-    }
+std::size_t TabField::MemoryUsage() const{
+	return (rgrid.capacity() + zgrid.capacity())*sizeof(double) + Bcoeffs.capacity()*sizeof(bicubic_coeff<3>) + Ecoeffs.capacity()*sizeof(bicubic_coeff<3>)
+			+ Vcoeffs.capacity()*sizeof(bicubic_coeff<1>);
 }
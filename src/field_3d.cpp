@@ -7,294 +7,321 @@
 #include "field_3d.h"
 
 #include <cmath>
+#include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <functional>
+#include <mutex>
+#include <atomic>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <cstdint>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 
 #include "interpolation.h"
 #include "boost/format.hpp"
 #include <boost/iterator/zip_iterator.hpp>
-#include <boost/algorithm/string.hpp>
-#include <boost/iostreams/filtering_stream.hpp>
-#include <boost/iostreams/filter/bzip2.hpp>
-#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/interprocess/sync/file_lock.hpp>
 
 #include "tricubic.h"
 #include "globals.h"
+#include "tablereader.h"
 
 /**
- * A faster implementation of the tricubic_eval function from libtricubic.
- * 
- * Uses Horner's scheme.
- * 
- * @param a Interpolation parameters (64 doubles)
+ * Fill coefficient table with zeros, backed by transparent huge pages where the kernel supports them
+ *
+ * Large tables span many 4 kB pages, so particles moving between bricks cause many TLB misses.
+ * The advice has to be given before the memory is first touched, otherwise the kernel only merges the pages later, if at all.
+ *
+ * @param table Coefficient table
+ * @param n Number of grid cells
+ * @param zero Coefficients of a cell filled with zeros
+ */
+template<typename coeff> static void AllocateCoefficients(std::vector<coeff> &table, const std::size_t n, const coeff &zero){
+    table.clear();
+    table.reserve(n);
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    const std::uintptr_t hugepage = 2 << 20;
+    std::uintptr_t begin = (reinterpret_cast<std::uintptr_t>(table.data()) + hugepage - 1)/hugepage*hugepage;
+    std::uintptr_t end = reinterpret_cast<std::uintptr_t>(table.data() + n)/hugepage*hugepage;
+    if (end > begin)
+        madvise(reinterpret_cast<void*>(begin), end - begin, MADV_HUGEPAGE); // if this fails, normal pages are used
+#endif
+    table.assign(n, zero);
+}
+
+
+/**
+ * Evaluate tricubic interpolation of several field components and their derivatives in one pass.
+ *
+ * A faster implementation of the tricubic_eval function from libtricubic, using Horner's scheme.
+ * The coefficients of all components are interleaved, so the innermost loops over components can be vectorized.
+ * Each result is calculated with the same operations as separate evaluations of the value and each derivative would use.
+ *
+ * @tparam N Number of components
+ * @tparam T Type of interpolation parameters (double or float), the evaluation is always done in double precision
+ * @param a Interpolation parameters (64*N doubles, parameter i + 4*j + 16*k of component l at index (i + 4*j + 16*k)*N + l)
  * @param x X coordinate of point field should be evaluated at
  * @param y Y coordinate
  * @param z Z coordinate
- * 
- * @return Interpolated value at point
+ * @param F Returns interpolated value of each component
+ * @param dFdx Returns derivative of each component with respect to x
+ * @param dFdy Returns derivative of each component with respect to y
+ * @param dFdz Returns derivative of each component with respect to z
  */
-inline double tricubic_eval_fast(double a[64], double x, double y, double z) {
-/*	double result = 0.0;
+template<int N, typename T>
+inline void tricubic_eval_fused(const T *a, const double x, const double y, const double z, double F[N], double dFdx[N], double dFdy[N], double dFdz[N]) {
+/*	F = 0.0;
 	for (int i = 0; i < 4; ++i) {
 		for (int j = 0; j < 4; ++j) {
 			for (int k = 0; k < 4; ++k) {
-				result += a[i + 4 * j + 16 * k] * std::pow(x, i) * std::pow(y, j) * std::pow(z, k);
+				F += a[i + 4 * j + 16 * k] * std::pow(x, i) * std::pow(y, j) * std::pow(z, k);
+				dFdx += i * a[i + 4 * j + 16 * k] * std::pow(x, i - 1) * std::pow(y, j) * std::pow(z, k); // and so on
 			}
 		}
 	}
-    return result;
 */
-	double rx = 0.;
+	for (int l = 0; l < N; ++l)
+		F[l] = dFdx[l] = dFdy[l] = dFdz[l] = 0.;
 	for (int i = 3; i >= 0; --i){
-	    double ry = 0.;
-	    for (int j = 3; j >= 0; --j){
-	        double rz = 0.;
-	        for (int k = 3; k >= 0; --k){
-                rz += a[i + 4*j + 16*k];
-                if (k > 0) rz *= z;
-	        }
-	        ry += rz;
-	        if (j > 0) ry *= y;
-	    }
-	    rx += ry;
-	    if (i > 0) rx *= x;
+		double ry[N] = {}, dry[N] = {}, drzy[N] = {}; // polynomial in y and z, and its derivatives with respect to y and z
+		for (int j = 3; j >= 0; --j){
+			double rz[N] = {}, drz[N] = {}; // polynomial in z and its derivative
+			for (int k = 3; k >= 0; --k){
+				const T *ak = &a[(i + 4*j + 16*k)*N];
+				for (int l = 0; l < N; ++l){
+					const double akl = ak[l];
+					if (k > 0) drz[l] = drz[l]*z + k*akl;
+					rz[l] = rz[l]*z + akl;
+				}
+			}
+			for (int l = 0; l < N; ++l){
+				if (j > 0) dry[l] = dry[l]*y + j*rz[l];
+				ry[l] = ry[l]*y + rz[l];
+				drzy[l] = drzy[l]*y + drz[l];
+			}
+		}
+		for (int l = 0; l < N; ++l){
+			if (i > 0) dFdx[l] = dFdx[l]*x + i*ry[l];
+			F[l] = F[l]*x + ry[l];
+			dFdy[l] = dFdy[l]*x + dry[l];
+			dFdz[l] = dFdz[l]*x + drzy[l];
+		}
 	}
-
-	return rx;
 }
 
 
 /**
- * A faster implementation of the tricubic_eval function from libtricubic.
- * 
- * Uses Horner's scheme.
- * 
- * @param a Interpolation parameters (64 doubles)
- * @param x X coordinate of point field should be evaluated at
+ * Evaluate trilinear interpolation of several field components and their derivatives in one pass.
+ *
+ * @tparam N Number of components
+ * @param c Values at the corners of the cell (N doubles per corner, corner i + 2*j + 4*k of component l at index (i + 2*j + 4*k)*N + l)
+ * @param x X coordinate of point field should be evaluated at, scaled to unit cube
  * @param y Y coordinate
  * @param z Z coordinate
- * @param derx Return derx-th derivative with respect to x
- * @param dery Return dery-th derivative with respect to y
- * @param derz Return derz-th derivative with respect to z
- * 
- * @return Interpolated value at point
+ * @param F Returns interpolated value of each component
+ * @param dFdx Returns derivative of each component with respect to x
+ * @param dFdy Returns derivative of each component with respect to y
+ * @param dFdz Returns derivative of each component with respect to z
  */
-inline double tricubic_eval_fast(double a[64], double x, double y, double z, int derx, int dery, int derz) {
-	// fact[i][n] is the coefficient in front of the nth derivative of x^i.
-	// For instance, d2/dx2 x^3 = 6 x, so fact[3][2] = 6.
-	static double fact[4][4] {
-		{ 1.0, 0.0, 0.0, 0.0 },
-		{ 1.0, 1.0, 0.0, 0.0 },
-		{ 1.0, 2.0, 2.0, 0.0 },
-		{ 1.0, 3.0, 6.0, 6.0 },
-	};
-/*
-	double result = 0.0;
-	for (int i = derx; i <= 3; ++i) {
-		for (int j = dery; j <= 3; ++j) {
-			for (int k = derz; k <= 3; ++k) {
-				double deriv_factor = fact[i][derx] * fact[j][dery] * fact[k][derz];
-				double pow_factor = std::pow(x, i - derx) * std::pow(y, j - dery) * std::pow(z, k - derz);
-				result += a[i + 4 * j + 16 * k] * pow_factor * deriv_factor;
-			}
-		}
+template<int N>
+inline void trilinear_eval_fused(const double *c, const double x, const double y, const double z, double F[N], double dFdx[N], double dFdy[N], double dFdz[N]){
+	for (int l = 0; l < N; ++l){
+		const double c000 = c[l], c100 = c[N + l], c010 = c[2*N + l], c110 = c[3*N + l], c001 = c[4*N + l], c101 = c[5*N + l], c011 = c[6*N + l], c111 = c[7*N + l];
+		const double c00 = c000 + (c100 - c000)*x, c10 = c010 + (c110 - c010)*x, c01 = c001 + (c101 - c001)*x, c11 = c011 + (c111 - c011)*x; // edges along x
+		const double c0 = c00 + (c10 - c00)*y, c1 = c01 + (c11 - c01)*y; // lines along z
+		F[l] = c0 + (c1 - c0)*z;
+		dFdz[l] = c1 - c0;
+		dFdy[l] = (c10 - c00)*(1 - z) + (c11 - c01)*z;
+		const double d0 = (c100 - c000) + ((c110 - c010) - (c100 - c000))*y, d1 = (c101 - c001) + ((c111 - c011) - (c101 - c001))*y;
+		dFdx[l] = d0 + (d1 - d0)*z;
 	}
-    return result;
-*/
-    double rx = 0.;
-    for (int i = 3; i >= derx; --i){
-        double ry = 0.;
-        for (int j = 3; j >= dery; --j){
-            double rz = 0.;
-            for (int k = 3; k >= derz; --k){
-                rz += fact[k][derz] * a[i + 4*j + 16*k];
-                if (k > derz) rz *= z;
-            }
-            ry += fact[j][dery] * rz;
-            if (j > dery) ry *= y;
+}
+
+
+/**
+ * Keep only every stride-th node of a table along each axis, and the last one, so coarse tables cover the same region
+ *
+ * @param xyz Lists of x, y, and z coordinates of grid points, returns those of the kept points
+ * @param B Lists of magnetic-field components on grid points, returns those of the kept points
+ * @param V List of electric potentials on grid points, returns those of the kept points
+ * @param stride Number of grid cells merged into one along each axis
+ */
+static void DownsampleTable(std::array<std::vector<double>, 3> &xyz, std::array<std::vector<double>, 3> &B, std::vector<double> &V, const unsigned stride){
+    if (stride <= 1)
+        return;
+    std::array<std::vector<double>, 3> kept; // coordinates of kept nodes along each axis
+    for (int i = 0; i < 3; ++i){
+        std::vector<double> nodes(xyz[i]);
+        std::sort(nodes.begin(), nodes.end());
+        nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+        for (std::size_t j = 0; j < nodes.size(); j += stride)
+            kept[i].push_back(nodes[j]);
+        if (not nodes.empty() && kept[i].back() != nodes.back())
+            kept[i].push_back(nodes.back());
+    }
+    std::size_t n = 0;
+    for (std::size_t k = 0; k < xyz[0].size(); ++k){
+        if (not (std::binary_search(kept[0].begin(), kept[0].end(), xyz[0][k]) && std::binary_search(kept[1].begin(), kept[1].end(), xyz[1][k])
+                 && std::binary_search(kept[2].begin(), kept[2].end(), xyz[2][k])))
+            continue;
+        for (int i = 0; i < 3; ++i){
+            xyz[i][n] = xyz[i][k];
+            if (not B[i].empty())
+                B[i][n] = B[i][k];
         }
-        rx += fact[i][derx] * ry;
-        if (i > derx) rx *= x;
+        if (not V.empty())
+            V[n] = V[k];
+        ++n;
     }
-
-	return rx;
+    for (int i = 0; i < 3; ++i){
+        xyz[i].resize(n);
+        if (not B[i].empty())
+            B[i].resize(n);
+    }
+    if (not V.empty())
+        V.resize(n);
+    std::cout << "Coarsening table with stride " << stride << ", " << n << " grid points left\n";
 }
 
 
-TFieldContainer ReadComsolField(const std::string &params, const std::map<std::string, std::string> &formulas){
-  std::istringstream ss(params);
-  boost::filesystem::path ft;
-  std::string fieldtype, Bscale;
-  double BoundaryWidth, lengthconv;
-  ss >> fieldtype >> ft >> Bscale >> BoundaryWidth >> lengthconv;; // read fieldtype, tablefilename, and rest of parameters
-  Bscale = ResolveFormula(Bscale, formulas);
-  if (!ss){
-      throw std::runtime_error((boost::format("Could not read all required parameters for field %1%!") % fieldtype).str());
-  }
-  ft = boost::filesystem::absolute(ft, configpath.parent_path());
+/**
+ * Read table file exported from COMSOL
+ *
+ * @param ft Table file
+ * @param lengthconv Factor to convert coordinates in table to meters
+ * @param single_precision Store interpolation coefficients in single precision
+ * @param nthreads Number of threads used to calculate interpolation coefficients
+ * @param stride Only every stride-th grid node along each axis is used, see DownsampleTable
+ * @param trilinear Interpolate table trilinearly
+ *
+ * @return Returns interpolated table
+ */
+static std::unique_ptr<TabField3> ReadComsolTable(const boost::filesystem::path &ft, const double lengthconv, const bool single_precision, const unsigned nthreads,
+                                                  const unsigned stride, const bool trilinear){
+  std::array<std::vector<double>, 3> xyz, B;
+  std::vector<double> &x = xyz[0], &y = xyz[1], &z = xyz[2];
+  std::vector<double> &bx = B[0], &by = B[1], &bz = B[2];
+  std::vector<double> V;
 
-  std::string line;
-  std::vector<std::string> line_parts;
-  std::vector<double> x, y, z;
-  std::vector<double> bx, by, bz;
-
-  std::ifstream FINstream(ft.string(), std::ifstream::in);
-  boost::iostreams::filtering_istream FIN;
-  if (boost::filesystem::extension(ft) == ".bz2"){
-  	FIN.push(boost::iostreams::bzip2_decompressor());
-  }
-  else if (boost::filesystem::extension(ft) == ".gz"){
-  	FIN.push(boost::iostreams::gzip_decompressor());
-  }
-  FIN.push(FINstream);
-  if (!FINstream.is_open() or !FIN.is_complete()){
-    throw std::runtime_error("Could not open " + ft.string());
-  }
+  TTableReader FIN(ft);
   std::cout << "\nReading " << ft << "\n";
 
   // Read in file data
-  int lineNum = 0;
-
-  while (getline(FIN,line)){
-    lineNum++;
-    if (line.substr(0,1) == "%" || line.substr(0,1) == "#") continue;     // Skip commented lines
-    boost::split(line_parts, line, boost::is_any_of("\t, "), boost::token_compress_on); //Delineate tab, space, commas
+  std::string line;
+  while (FIN.SkipEmptyLines()){
+    unsigned long lineNum = FIN.LineNumber();
+    if (FIN.Peek() == '%' || FIN.Peek() == '#'){ // Skip commented lines
+      FIN.ReadLine(line);
+      continue;
+    }
 
-    if (line_parts.size() != 6){
+    double values[6];
+    int columns = 0;
+    while (columns < 6 && FIN.ReadNumberInLine(values[columns])) // Numbers can be delineated by tabs, spaces, and commas
+      ++columns;
+    FIN.ReadLine(line); // rest of line has to be empty
+    if (columns != 6 || line.find_first_not_of(" \t\r,") != std::string::npos){
       throw std::runtime_error((boost::format("Error reading line %1% of file %2%") % lineNum % ft.string()).str());
     }
 
-    x.push_back( std::stod(line_parts[0], nullptr) * lengthconv);
-    y.push_back( std::stod(line_parts[1], nullptr) * lengthconv);
-    z.push_back( std::stod(line_parts[2], nullptr) * lengthconv);
-    bx.push_back( std::stod(line_parts[3], nullptr));
-    by.push_back( std::stod(line_parts[4], nullptr));
-    bz.push_back( std::stod(line_parts[5], nullptr));
+    x.push_back(values[0] * lengthconv);
+    y.push_back(values[1] * lengthconv);
+    z.push_back(values[2] * lengthconv);
+    bx.push_back(values[3]);
+    by.push_back(values[4]);
+    bz.push_back(values[5]);
   }
 
   if (x.empty() || y.empty() || z.empty() || bx.empty() || by.empty()|| bz.empty() ) {
     throw std::runtime_error("No data read from " + ft.string());
   }
 
-  auto xminmax = std::minmax_element(x.begin(), x.end());
-  auto yminmax = std::minmax_element(y.begin(), y.end());
-  auto zminmax = std::minmax_element(z.begin(), z.end());
-  return TFieldContainer(std::unique_ptr<TabField3>(new TabField3({x,y,z}, {bx,by,bz}, std::vector<double>())), Bscale, "0", *xminmax.second, *xminmax.first, *yminmax.second, *yminmax.first, *zminmax.second, *zminmax.first, BoundaryWidth);
+  DownsampleTable(xyz, B, V, stride);
+  return std::unique_ptr<TabField3>(new TabField3(xyz, B, V, single_precision, nthreads, trilinear));
 }
 
-TFieldContainer ReadOperaField3(const std::string &params, const std::map<std::string, std::string> &formulas){
-    std::istringstream ss(params);
-    boost::filesystem::path ft;
-    std::string fieldtype, Bscale, Escale;
-    double BoundaryWidth, lengthconv;
-    ss >> fieldtype >> ft >> Bscale >> Escale >> BoundaryWidth;
-	Bscale = ResolveFormula(Bscale, formulas);
-	Escale = ResolveFormula(Escale, formulas);
-    if (fieldtype == "3Dtable"){
-        std::cout << "Field type " << fieldtype << " is deprecated. Consider using the new OPERA3D format. I'm assuming that file " << ft << " is using centimeters, Gauss, Volt/centimeter, and Volts as units.\n";
-        Bscale = "(" + Bscale + ")*0.0001"; // scale magnetic field to Tesla
-        Escale = "(" + Escale + ")*100"; // scale electric field to Volt/meter
-        lengthconv = 0.01;
-    }
-    else if (fieldtype == "OPERA3D"){
-        ss >> lengthconv;
-	}
-    else{
-        throw std::runtime_error("Tried to load 3D table file for unknown field type " + fieldtype + "!\n");
-    }
-    if (!ss){
-        throw std::runtime_error((boost::format("Could not read all required parameters for field %1%!") % fieldtype).str());
-    }
-
-    ft = boost::filesystem::absolute(ft, configpath.parent_path());
-    std::ifstream FINstream(ft.string(), std::ifstream::in);
-    boost::iostreams::filtering_istream FIN;
-    if (boost::filesystem::extension(ft) == ".bz2"){
-        FIN.push(boost::iostreams::bzip2_decompressor());
-    }
-    else if (boost::filesystem::extension(ft) == ".gz"){
-        FIN.push(boost::iostreams::gzip_decompressor());
-    }
-    FIN.push(FINstream);
-    if (!FINstream.is_open() or !FIN.is_complete()){
-        throw std::runtime_error("Could not open " + ft.string());
-    }
-
+/**
+ * Read 3D table file exported from OPERA
+ *
+ * @param ft Table file
+ * @param lengthconv Factor to convert coordinates in table to meters
+ * @param single_precision Store interpolation coefficients in single precision
+ * @param nthreads Number of threads used to calculate interpolation coefficients
+ * @param stride Only every stride-th grid node along each axis is used, see DownsampleTable
+ * @param trilinear Interpolate table trilinearly
+ *
+ * @return Returns interpolated table
+ */
+static std::unique_ptr<TabField3> ReadOperaTable(const boost::filesystem::path &ft, const double lengthconv, const bool single_precision, const unsigned nthreads,
+                                                 const unsigned stride, const bool trilinear){
+    TTableReader FIN(ft);
     std::cout << "\nReading " << ft << " ";
 	std::string line;
-    int xl, yl, zl;
-	FIN >> xl >> yl >> zl;
+    double header[3];
+    bool good = FIN.ReadNumber(header[0]) && FIN.ReadNumber(header[1]) && FIN.ReadNumber(header[2]);
+    int xl = header[0], yl = header[1], zl = header[2];
 
-	getline(FIN,line);
-	getline(FIN,line);
-	getline(FIN,line);
-	getline(FIN,line);
-	getline(FIN,line);
+	for (int i = 0; i < 5; ++i)
+		good = FIN.ReadLine(line) && good;
 
     std::array<std::vector<double>, 3> xyzTab, BTab;
     std::vector<double> VTab;
     for (auto &xi: xyzTab){
-        xi.resize(xl * yl * zl);
+        xi.resize(xl * yl * zl); // preallocate all columns with size given in header
     }
 	if (line.find("BX") != std::string::npos){
         BTab[0].resize(xl*yl*zl);
-		getline(FIN,line);
+		good = FIN.ReadLine(line) && good;
 	}
 	if (line.find("BY") != std::string::npos){
         BTab[1].resize(xl*yl*zl);
-		getline(FIN,line);
+		good = FIN.ReadLine(line) && good;
 	}
 	if (line.find("BZ") != std::string::npos){
         BTab[2].resize(xl*yl*zl);
-		getline(FIN,line);
+		good = FIN.ReadLine(line) && good;
 	}
 
 	if (line.find("V") != std::string::npos){	// file contains potential?
 		VTab.resize(xl*yl*zl);
-		getline(FIN,line);
+		good = FIN.ReadLine(line) && good;
 	}
 
-	if (!FIN || line.substr(0,2) != " 0"){
+	if (!good || line.substr(0,2) != " 0"){
         std::cout << ft << " not found or corrupt! Exiting...\n";
 		exit(-1);
 	}
 
-	std::vector<double> xind(xl), yind(yl), zind(zl);
 	progress_display progress(xl*yl*zl, std::cout);
     int i = 0;
-	while (FIN.good()){
-        double x, y, z, val;
-		FIN >> x;
-		FIN >> y;
-		FIN >> z;
-		if (!FIN) break;
-		x *= lengthconv;
-		y *= lengthconv;
-		z *= lengthconv;
-
+    std::vector<double*> columns; // columns following coordinates
+    for (auto &B: BTab){
+        if (not B.empty())
+            columns.push_back(B.data());
+    }
+    if (not VTab.empty())
+        columns.push_back(VTab.data());
+    double x, y, z;
+	while (FIN.ReadNumber(x) && FIN.ReadNumber(y) && FIN.ReadNumber(z)){
+        if (i >= xl*yl*zl){
+            ++i;
+            break;
+        }
 		// status if read is displayed
 		++progress;
 
-        xyzTab[0][i] = x;
-        xyzTab[1][i] = y;
-        xyzTab[2][i] = z;
-        if (not BTab[0].empty()){
-			FIN >> val;
-            BTab[0][i] = val;
-		}
-        if (not BTab[1].empty()){
-			FIN >> val;
-            BTab[1][i] = val;
-		}
-        if (not BTab[2].empty()){
-			FIN >> val;
-            BTab[2][i] = val;
-		}
-		if (not VTab.empty()){
-			FIN >> val;
-            VTab[i] = val;
-		}
-		FIN >> std::ws;
+        xyzTab[0][i] = x*lengthconv;
+        xyzTab[1][i] = y*lengthconv;
+        xyzTab[2][i] = z*lengthconv;
+        for (double *column: columns){
+            if (not FIN.ReadNumber(column[i]))
+                throw std::runtime_error((boost::format("Error reading line %1% of file %2%") % FIN.LineNumber() % ft.string()).str());
+        }
         ++i;
 	}
 
@@ -303,13 +330,313 @@ TFieldContainer ReadOperaField3(const std::string &params, const std::map<std::s
         throw std::runtime_error((boost::format("The header says the size is %1%, actually it is %2%! Exiting...\n") % (xl*yl*zl) % i).str());
 	}
 
-    auto xminmax = std::minmax_element(xyzTab[0].begin(), xyzTab[0].end());
-    auto yminmax = std::minmax_element(xyzTab[1].begin(), xyzTab[1].end());
-    auto zminmax = std::minmax_element(xyzTab[2].begin(), xyzTab[2].end());
-    return TFieldContainer(std::unique_ptr<TabField3>(new TabField3(xyzTab, BTab, VTab)), Bscale, Escale, *xminmax.second, *xminmax.first, *yminmax.second, *yminmax.first, *zminmax.second, *zminmax.first, BoundaryWidth);
+    DownsampleTable(xyzTab, BTab, VTab, stride);
+    return std::unique_ptr<TabField3>(new TabField3(xyzTab, BTab, VTab, single_precision, nthreads, trilinear));
+}
+
+
+std::uint64_t TableKey(const std::string &parameters, const boost::filesystem::path &ft){
+    std::uint64_t hash = 14695981039346656037ULL;
+    auto add = [&hash](const char *data, const std::streamsize n){
+        for (std::streamsize i = 0; i < n; ++i){
+            hash ^= static_cast<unsigned char>(data[i]);
+            hash *= 1099511628211ULL;
+        }
+    };
+    if (not ft.empty()){
+        std::ifstream f(ft.string(), std::ifstream::binary);
+        if (!f.is_open())
+            throw std::runtime_error("Could not open " + ft.string());
+        std::vector<char> buffer(1 << 20);
+        while (f){
+            f.read(buffer.data(), buffer.size());
+            add(buffer.data(), f.gcount());
+        }
+    }
+    add(parameters.data(), parameters.size());
+    return hash;
+}
+
+
+std::unique_ptr<TabField3> GetCachedTable(const boost::filesystem::path &cachefile, const std::uint64_t key, const std::function<std::unique_ptr<TabField3>()> &calculate){
+    static std::mutex filemutex;
+    static std::map<std::string, std::mutex> filemutexes; // file locks do not exclude other threads of the same process, which might load tables in parallel
+    std::unique_lock<std::mutex> filelock;
+    {
+        std::lock_guard<std::mutex> lock(filemutex);
+        filelock = std::unique_lock<std::mutex>(filemutexes[cachefile.string()], std::defer_lock);
+    }
+    filelock.lock();
+    boost::filesystem::path lockfile = cachefile.string() + ".lock";
+    boost::interprocess::file_lock lock;
+    try{
+        std::ofstream(lockfile.string(), std::ofstream::app); // file_lock requires an existing file
+        boost::interprocess::file_lock(lockfile.c_str()).swap(lock);
+        lock.lock();
+    }
+    catch (boost::interprocess::interprocess_exception &e){
+        std::cout << "Warning: Could not lock " << lockfile << " (" << e.what() << "), simultaneous jobs might calculate the interpolation coefficients themselves\n";
+        boost::interprocess::file_lock().swap(lock);
+    }
+
+    if (boost::filesystem::exists(cachefile)){
+        try{
+            std::cout << "\nLoading interpolation coefficients from " << cachefile << "\n";
+            return std::unique_ptr<TabField3>(new TabField3(cachefile, key));
+        }
+        catch (std::exception &e){
+            std::cout << "Warning: Could not load " << cachefile << " (" << e.what() << "), calculating them instead\n";
+        }
+    }
+    std::unique_ptr<TabField3> tab = calculate();
+    try{
+        std::cout << "Writing interpolation coefficients to " << cachefile << "\n";
+        tab->WriteCache(cachefile, key);
+        tab.reset(new TabField3(cachefile, key)); // replace own copy of coefficients by the shared, memory-mapped one
+    }
+    catch (std::exception &e){
+        std::cout << "Warning: Could not write " << cachefile << " (" << e.what() << ")\n";
+    }
+    return tab;
+}
+
+
+/**
+ * Describe grid stride in the parameters identifying a table, see DownsampleTable
+ *
+ * @param stride Number of grid cells merged into one along each axis
+ *
+ * @return Returns empty string for full tables, so their cache files stay valid
+ */
+static std::string StrideParameter(const unsigned stride){
+    return stride > 1 ? " STRIDE " + std::to_string(stride) : "";
+}
+
+
+/**
+ * Load interpolated table from cache, or read table file and store it in cache
+ *
+ * @param ft Table file
+ * @param parameters String containing all parameters that influence the interpolation coefficients
+ * @param cachedir Cache directory (empty: do not use cache)
+ * @param read Function reading and interpolating the table file
+ *
+ * @return Returns interpolated table
+ */
+static std::unique_ptr<TabField3> GetCachedTable(const boost::filesystem::path &ft, const std::string &parameters, const boost::filesystem::path &cachedir,
+                                                 const std::function<std::unique_ptr<TabField3>()> &read){
+    if (cachedir.empty())
+        return read();
+
+    std::uint64_t key = TableKey(parameters, ft);
+    return GetCachedTable(cachedir / (boost::format("%1%.%2$016x.tricubic") % ft.filename().string() % key).str(), key, read);
+}
+
+
+/**
+ * Read optional parameters from the end of a field's parameters: precision of interpolation coefficients ("double" or "float"), interpolation order ("tricubic" or "trilinear"),
+ * and symmetries of a field whose table only covers its fundamental domain ("mirrorx", "mirrory", "mirrorz", "antimirrorx", "antimirrory", "antimirrorz", or "rotzN" for an N-fold rotation about z)
+ *
+ * @param ss Stream containing the parameters, all other parameters have already been read
+ * @param fieldtype Field type, used in error message
+ * @param symmetry Returns symmetries of the field
+ * @param trilinear Returns true if the table should be interpolated trilinearly
+ *
+ * @return Returns true if coefficients should be stored in single precision
+ */
+static bool ReadTableOptions(std::istream &ss, const std::string &fieldtype, TTableSymmetry &symmetry, bool &trilinear){
+    bool single_precision = false;
+    trilinear = false;
+    std::string option;
+    while (ss >> option){
+        bool mirror = option.size() == 7 && option.compare(0, 6, "mirror") == 0, antimirror = option.size() == 11 && option.compare(0, 10, "antimirror") == 0;
+        char axis = option.back();
+        if (option == "double")
+            single_precision = false;
+        else if (option == "float")
+            single_precision = true;
+        else if (option == "tricubic")
+            trilinear = false;
+        else if (option == "trilinear")
+            trilinear = true;
+        else if ((mirror || antimirror) && axis >= 'x' && axis <= 'z')
+            symmetry.mirror[axis - 'x'] = mirror ? 1 : -1;
+        else if (option.compare(0, 4, "rotz") == 0 && option.size() > 4 && option.find_first_not_of("0123456789", 4) == std::string::npos && std::stoul(option.substr(4)) > 0)
+            symmetry.rotation = std::stoul(option.substr(4));
+        else
+            throw std::runtime_error("Unknown option " + option + " for field " + fieldtype + ", use double, float, tricubic, trilinear, mirrorx, antimirrorx, rotzN, or similar!");
+    }
+    if (single_precision && trilinear)
+        throw std::runtime_error("Field " + fieldtype + " cannot store corner values of trilinear interpolation in single precision, use either float or trilinear!");
+    return single_precision;
+}
+
+
+/**
+ * Create field container for a table, wrapped in TabField3Symmetric if the table only covers the fundamental domain of a symmetric field
+ *
+ * @param table Interpolated table
+ * @param min Lower corner of table
+ * @param max Upper corner of table
+ * @param symmetry Symmetries of field
+ * @param Bscale Magnetic-field scaling formula
+ * @param Escale Electric-field scaling formula
+ * @param BoundaryWidth Width of boundary in which fields are brought to zero
+ *
+ * @return Returns field container
+ */
+static TFieldContainer TableContainer(std::shared_ptr<const TField> table, std::array<double, 3> min, std::array<double, 3> max, const TTableSymmetry &symmetry,
+                                      const std::string &Bscale, const std::string &Escale, const double BoundaryWidth){
+    if (symmetry.rotation > 1 || symmetry.mirror != std::array<int, 3>{{0, 0, 0}}){
+        std::shared_ptr<const TabField3Symmetric> symmetric = std::make_shared<TabField3Symmetric>(std::move(table), min, max, symmetry);
+        symmetric->GetBounds(min, max);
+        std::cout << "Table covers fundamental domain of symmetric field in x = [" << min[0] << ", " << max[0] << "], y = [" << min[1] << ", " << max[1]
+                  << "], z = [" << min[2] << ", " << max[2] << "]\n";
+        table = std::move(symmetric);
+    }
+    return TFieldContainer(std::move(table), Bscale, Escale, max[0], min[0], max[1], min[1], max[2], min[2], BoundaryWidth);
+}
+
+
+TFieldContainer ReadComsolField(const std::string &params, const std::map<std::string, std::string> &formulas, const boost::filesystem::path &cachedir,
+                                const unsigned nthreads, const unsigned stride){
+  std::istringstream ss(params);
+  boost::filesystem::path ft;
+  std::string fieldtype, Bscale;
+  double BoundaryWidth, lengthconv;
+  ss >> fieldtype >> ft >> Bscale >> BoundaryWidth >> lengthconv;; // read fieldtype, tablefilename, and rest of parameters
+  Bscale = ResolveFormula(Bscale, formulas);
+  if (!ss){
+      throw std::runtime_error((boost::format("Could not read all required parameters for field %1%!") % fieldtype).str());
+  }
+  TTableSymmetry symmetry;
+  bool trilinear;
+  bool single_precision = ReadTableOptions(ss, fieldtype, symmetry, trilinear);
+  ft = boost::filesystem::absolute(ft, configpath.parent_path());
+
+  std::string parameters = (boost::format("COMSOL %1$.17g %2%%3%%4%") % lengthconv % single_precision % StrideParameter(stride) % (trilinear ? " TRILINEAR" : "")).str();
+  std::shared_ptr<const TabField3> tab = std::static_pointer_cast<const TabField3>(SharedTable(ft.string() + " " + parameters, [&]() -> std::unique_ptr<TField>{
+      return GetCachedTable(ft, parameters, cachedir, [&]{ return ReadComsolTable(ft, lengthconv, single_precision, nthreads, stride, trilinear); });
+  }));
+  std::array<double, 3> min, max;
+  tab->GetBounds(min, max);
+  return TableContainer(std::move(tab), min, max, symmetry, Bscale, "0", BoundaryWidth);
+}
+
+TFieldContainer ReadOperaField3(const std::string &params, const std::map<std::string, std::string> &formulas, const boost::filesystem::path &cachedir,
+                                const unsigned nthreads, const unsigned stride){
+    std::istringstream ss(params);
+    boost::filesystem::path ft;
+    std::string fieldtype, Bscale, Escale;
+    double BoundaryWidth, lengthconv;
+    ss >> fieldtype >> ft >> Bscale >> Escale >> BoundaryWidth;
+	Bscale = ResolveFormula(Bscale, formulas);
+	Escale = ResolveFormula(Escale, formulas);
+    if (fieldtype == "3Dtable"){
+        std::cout << "Field type " << fieldtype << " is deprecated. Consider using the new OPERA3D format. I'm assuming that file " << ft << " is using centimeters, Gauss, Volt/centimeter, and Volts as units.\n";
+        Bscale = "(" + Bscale + ")*0.0001"; // scale magnetic field to Tesla
+        Escale = "(" + Escale + ")*100"; // scale electric field to Volt/meter
+        lengthconv = 0.01;
+    }
+    else if (fieldtype == "OPERA3D" or fieldtype == "OPERA3D_ADAPTIVE"){
+        ss >> lengthconv;
+	}
+    else{
+        throw std::runtime_error("Tried to load 3D table file for unknown field type " + fieldtype + "!\n");
+    }
+    double Btolerance, Vtolerance;
+    if (fieldtype == "OPERA3D_ADAPTIVE")
+        ss >> Btolerance >> Vtolerance;
+    if (!ss){
+        throw std::runtime_error((boost::format("Could not read all required parameters for field %1%!") % fieldtype).str());
+    }
+    TTableSymmetry symmetry;
+    bool trilinear;
+    bool single_precision = ReadTableOptions(ss, fieldtype, symmetry, trilinear);
+
+    ft = boost::filesystem::absolute(ft, configpath.parent_path());
+    std::string parameters = (boost::format("OPERA3D %1$.17g %2%%3%%4%") % lengthconv % single_precision % StrideParameter(stride) % (trilinear ? " TRILINEAR" : "")).str();
+    std::shared_ptr<const TabField3> tab = std::static_pointer_cast<const TabField3>(SharedTable(ft.string() + " " + parameters, [&]() -> std::unique_ptr<TField>{
+        return GetCachedTable(ft, parameters, cachedir, [&]{ return ReadOperaTable(ft, lengthconv, single_precision, nthreads, stride, trilinear); });
+    }));
+    std::array<double, 3> min, max;
+    tab->GetBounds(min, max);
+    if (fieldtype == "OPERA3D_ADAPTIVE"){ // replace table by octree resampled from it
+        std::shared_ptr<const TField> adaptive = SharedTable((boost::format("%1% %2% ADAPTIVE %3$.17g %4$.17g") % ft.string() % parameters % Btolerance % Vtolerance).str(), [&]{
+            return std::unique_ptr<TField>(new TabField3Adaptive(*tab, min, max, tab->GetMinimumSpacing(), Btolerance, Vtolerance, nthreads));
+        });
+        return TableContainer(adaptive, min, max, symmetry, Bscale, Escale, BoundaryWidth);
+    }
+    return TableContainer(std::move(tab), min, max, symmetry, Bscale, Escale, BoundaryWidth);
 }
 
 
+TFieldContainer ReadOperaField3Series(const std::string &params, const std::map<std::string, std::string> &formulas, const boost::filesystem::path &cachedir,
+                                      const unsigned nthreads, const unsigned stride){
+    std::istringstream ss(params);
+    boost::filesystem::path listfile;
+    std::string fieldtype, Bscale, Escale;
+    double BoundaryWidth, lengthconv;
+    ss >> fieldtype >> listfile >> Bscale >> Escale >> BoundaryWidth >> lengthconv;
+    Bscale = ResolveFormula(Bscale, formulas);
+    Escale = ResolveFormula(Escale, formulas);
+    if (!ss){
+        throw std::runtime_error((boost::format("Could not read all required parameters for field %1%!") % fieldtype).str());
+    }
+    TTableSymmetry symmetry;
+    bool trilinear;
+    bool single_precision = ReadTableOptions(ss, fieldtype, symmetry, trilinear);
+    listfile = boost::filesystem::absolute(listfile, configpath.parent_path());
+
+    std::vector<double> times;
+    std::vector<boost::filesystem::path> files;
+    std::ifstream list(listfile.string());
+    if (!list.is_open())
+        throw std::runtime_error("Could not open " + listfile.string());
+    std::string line;
+    while (std::getline(list, line)){
+        line = line.substr(0, line.find('#')); // strip comments
+        std::istringstream ls(line);
+        double t;
+        boost::filesystem::path ft;
+        if (not (ls >> t))
+            continue; // skip empty lines
+        if (not (ls >> ft))
+            throw std::runtime_error("Could not read table file for time " + std::to_string(t) + " in " + listfile.string());
+        if (not times.empty() and t <= times.back())
+            throw std::runtime_error("Times in " + listfile.string() + " have to be in ascending order!");
+        times.push_back(t);
+        files.push_back(boost::filesystem::absolute(ft, listfile.parent_path()));
+    }
+    if (times.empty())
+        throw std::runtime_error("No table files listed in " + listfile.string());
+
+    std::string parameters = (boost::format("OPERA3D %1$.17g %2%%3%%4%") % lengthconv % single_precision % StrideParameter(stride) % (trilinear ? " TRILINEAR" : "")).str();
+    std::shared_ptr<const TabField3Series> series = std::static_pointer_cast<const TabField3Series>(SharedTable(listfile.string() + " SERIES " + parameters, [&]() -> std::unique_ptr<TField>{
+        // calculate missing cache files at startup, so snapshots only have to be mapped during the simulation
+        std::vector<boost::filesystem::path> cachefiles(files.size());
+        std::vector<std::uint64_t> keys(files.size());
+        if (not cachedir.empty()){
+            for (std::size_t i = 0; i < files.size(); ++i){
+                keys[i] = TableKey(parameters, files[i]);
+                cachefiles[i] = cachedir / (boost::format("%1%.%2$016x.tricubic") % files[i].filename().string() % keys[i]).str();
+                GetCachedTable(cachefiles[i], keys[i], [&]{ return ReadOperaTable(files[i], lengthconv, single_precision, nthreads, stride, trilinear); });
+                if (not boost::filesystem::exists(cachefiles[i]))
+                    cachefiles[i].clear(); // cache could not be written, read table file instead
+            }
+        }
+        return std::unique_ptr<TField>(new TabField3Series(times, [files, cachefiles, keys, lengthconv, single_precision, stride, trilinear](const std::size_t i){
+            if (not cachefiles[i].empty())
+                return std::unique_ptr<TabField3>(new TabField3(cachefiles[i], keys[i]));
+            return ReadOperaTable(files[i], lengthconv, single_precision, 1, stride, trilinear);
+        }));
+    }));
+
+    std::array<double, 3> min, max;
+    series->GetBounds(min, max);
+    return TableContainer(std::move(series), min, max, symmetry, Bscale, Escale, BoundaryWidth);
+}
+
 void TabField3::CheckTab(const std::array<std::vector<double>, 3> &B, const std::vector<double> &V){
 	//  calculate factors for conversion of coordinates to indexes  r = conv_rA + index * conv_rB
     std::cout << "The arrays are " << xyz[0].size() << " by " << xyz[1].size() << " by " << xyz[2].size()
@@ -333,88 +660,116 @@ void TabField3::CheckTab(const std::array<std::vector<double>, 3> &B, const std:
 }
 
 
-void TabField3::CalcDerivs(const array3D &Tab, const unsigned long diff_dim, array3D &DiffTab) const
+void TabField3::CalcDerivs(const array3D &Tab, const unsigned long diff_dim, array3D &DiffTab, const unsigned nthreads) const
 {
-	alglib::real_1d_array x, y, diff;
-    std::array<unsigned long, 3> index;
     DiffTab.resize(boost::extents[Tab.shape()[0]][Tab.shape()[1]][Tab.shape()[2]]);
     unsigned long len = xyz[diff_dim].size();
-    x.setcontent(len, &xyz[diff_dim][0]);
-    y.setlength(len);
-    diff.setlength(len);
-//    std::cout << "x: " << x.tostring(2) << std::endl;
-
     unsigned long dim1 = (diff_dim + 1) % 3;
     unsigned long dim2 = (diff_dim + 2) % 3;
-    for (index[dim1] = 0; index[dim1] < xyz[dim1].size(); index[dim1] = index[dim1] + 1){ // iterate over all indices in both other dimensions
-        for (index[dim2] = 0; index[dim2] < xyz[dim2].size(); index[dim2] = index[dim2] + 1){
-//            std::copy(index.begin(), index.end(), std::ostream_iterator<unsigned long>(std::cout, " "));
-            for (index[diff_dim] = 0; index[diff_dim] < len; index[diff_dim] = index[diff_dim] + 1){
-                y[index[diff_dim]] = Tab(index);
-            }
-//            std::cout << "y: " << y.tostring(2) << std::endl;
-            alglib::spline1dgriddiffcubic(x,y,diff); // get derivatives with respect to coordinate dimension diff_dim
-//            std::cout << " diff: " << diff.tostring(2) << std::endl;
-            for (index[diff_dim] = 0; index[diff_dim] < len; index[diff_dim] = index[diff_dim] + 1){
-                DiffTab(index) = diff[index[diff_dim]];
+    ParallelFor(xyz[dim1].size(), nthreads, [&](const unsigned long begin, const unsigned long end){ // distribute grid lines over threads
+        alglib::real_1d_array x, y, diff;
+        std::array<unsigned long, 3> index;
+        x.setcontent(len, &xyz[diff_dim][0]);
+        y.setlength(len);
+        diff.setlength(len);
+        for (index[dim1] = begin; index[dim1] < end; index[dim1] = index[dim1] + 1){ // iterate over all indices in both other dimensions
+            for (index[dim2] = 0; index[dim2] < xyz[dim2].size(); index[dim2] = index[dim2] + 1){
+                for (index[diff_dim] = 0; index[diff_dim] < len; index[diff_dim] = index[diff_dim] + 1){
+                    y[index[diff_dim]] = Tab(index);
+                }
+                alglib::spline1dgriddiffcubic(x,y,diff); // get derivatives with respect to coordinate dimension diff_dim
+                for (index[diff_dim] = 0; index[diff_dim] < len; index[diff_dim] = index[diff_dim] + 1){
+                    DiffTab(index) = diff[index[diff_dim]];
+                }
             }
-//            std::cout << " diff: " << diff.tostring(2) << std::endl;
-		}
-	}
+        }
+    });
 }
 
 
-void TabField3::PreInterpol(const array3D &Tab, field_type &coeff) const{
-    std::array<unsigned long, 3> len;
-    for (unsigned long i = 0; i < 3; ++i){
-        len[i] = xyz[i].size() - 1;
-    }
-    coeff.resize(len);
-
+void TabField3::PreInterpol(const array3D &Tab, const unsigned component, std::array<double, 2> &maxerror, const unsigned nthreads){
+    const std::array<unsigned long, 3> &len = cells;
     array3D dFdx, dFdy, dFdz, dFdxdy, dFdxdz, dFdydz, dFdxdydz; // derivatives with respect to x, y, z, xy, xz, yz, xyz
-    CalcDerivs(Tab, 0, dFdx); // dF/dx
-    CalcDerivs(Tab, 1, dFdy); // dF/dy
-    CalcDerivs(Tab, 2, dFdz); // dF/dz
-    CalcDerivs(dFdx, 1, dFdxdy); // d2F/dxdy
-    CalcDerivs(dFdx, 2, dFdxdz); // d2F/dxdz
-    CalcDerivs(dFdy, 2, dFdydz); // d2F/dydz
-    CalcDerivs(dFdxdy, 2, dFdxdydz); // d3F/dxdydz
-
-    for (unsigned long ix = 0; ix < len[0]; ++ix){
-        for (unsigned long iy = 0; iy < len[1]; ++iy){
-            for (unsigned long iz = 0; iz < len[2]; ++iz){
-                std::array<std::array<unsigned long, 3>, 8> indices;
-                indices[0] = {ix  ,iy  ,iz  }; // collect indices of corners of each grid cell
-                indices[1] = {ix+1,iy  ,iz  }; // order according to tricubic manual
-                indices[2] = {ix  ,iy+1,iz  };
-                indices[3] = {ix+1,iy+1,iz  };
-                indices[4] = {ix  ,iy  ,iz+1};
-                indices[5] = {ix+1,iy  ,iz+1};
-                indices[6] = {ix  ,iy+1,iz+1};
-                indices[7] = {ix+1,iy+1,iz+1};
-
-                double cellx = xyz[0][ix+1] - xyz[0][ix];
-                double celly = xyz[1][iy+1] - xyz[1][iy];
-                double cellz = xyz[2][iz+1] - xyz[2][iz];
-                std::array<std::array<double, 8>, 8> yyy;
-                for (unsigned i = 0; i < 8; ++i){
-                    yyy[0][i] = Tab(indices[i]); // get values and derivatives at each corner of grid cell
-                    yyy[1][i] = dFdx(indices[i])*cellx;
-                    yyy[2][i] = dFdy(indices[i])*celly;
-                    yyy[3][i] = dFdz(indices[i])*cellz;
-                    yyy[4][i] = dFdxdy(indices[i])*cellx*celly;
-                    yyy[5][i] = dFdxdz(indices[i])*cellx*cellz;
-                    yyy[6][i] = dFdydz(indices[i])*celly*cellz;
-                    yyy[7][i] = dFdxdydz(indices[i])*cellx*celly*cellz;
+    CalcDerivs(Tab, 0, dFdx, nthreads); // dF/dx
+    CalcDerivs(Tab, 1, dFdy, nthreads); // dF/dy
+    CalcDerivs(Tab, 2, dFdz, nthreads); // dF/dz
+    CalcDerivs(dFdx, 1, dFdxdy, nthreads); // d2F/dxdy
+    CalcDerivs(dFdx, 2, dFdxdz, nthreads); // d2F/dxdz
+    CalcDerivs(dFdy, 2, dFdydz, nthreads); // d2F/dydz
+    CalcDerivs(dFdxdy, 2, dFdxdydz, nthreads); // d3F/dxdydz
+
+    std::mutex errormutex;
+    ParallelFor(len[0], nthreads, [&](const unsigned long begin, const unsigned long end){ // distribute grid cells over threads
+        std::array<double, 2> blockerror = {{0., 0.}};
+        for (unsigned long ix = begin; ix < end; ++ix){
+            for (unsigned long iy = 0; iy < len[1]; ++iy){
+                for (unsigned long iz = 0; iz < len[2]; ++iz){
+                    std::array<std::array<unsigned long, 3>, 8> indices;
+                    indices[0] = {ix  ,iy  ,iz  }; // collect indices of corners of each grid cell
+                    indices[1] = {ix+1,iy  ,iz  }; // order according to tricubic manual
+                    indices[2] = {ix  ,iy+1,iz  };
+                    indices[3] = {ix+1,iy+1,iz  };
+                    indices[4] = {ix  ,iy  ,iz+1};
+                    indices[5] = {ix+1,iy  ,iz+1};
+                    indices[6] = {ix  ,iy+1,iz+1};
+                    indices[7] = {ix+1,iy+1,iz+1};
+
+                    double cellx = xyz[0][ix+1] - xyz[0][ix];
+                    double celly = xyz[1][iy+1] - xyz[1][iy];
+                    double cellz = xyz[2][iz+1] - xyz[2][iz];
+                    std::array<std::array<double, 8>, 8> yyy;
+                    for (unsigned i = 0; i < 8; ++i){
+                        yyy[0][i] = Tab(indices[i]); // get values and derivatives at each corner of grid cell
+                        yyy[1][i] = dFdx(indices[i])*cellx;
+                        yyy[2][i] = dFdy(indices[i])*celly;
+                        yyy[3][i] = dFdz(indices[i])*cellz;
+                        yyy[4][i] = dFdxdy(indices[i])*cellx*celly;
+                        yyy[5][i] = dFdxdz(indices[i])*cellx*cellz;
+                        yyy[6][i] = dFdydz(indices[i])*celly*cellz;
+                        yyy[7][i] = dFdxdydz(indices[i])*cellx*celly*cellz;
+                    }
+                    double coeff[64];
+                    tricubic_get_coeff(coeff, &yyy[0][0], &yyy[1][0], &yyy[2][0], &yyy[3][0], &yyy[4][0], &yyy[5][0], &yyy[6][0], &yyy[7][0]); // calculate tricubic interpolation coefficients
+                    unsigned long cell = CellIndex(ix, iy, iz);
+                    if (not tablecoeffs_linear.empty()){
+                        for (unsigned i = 0; i < 8; ++i)
+                            tablecoeffs_linear[cell][i*COMPONENTS + component] = yyy[0][i]; // corners are ordered like i + 2*j + 4*k
+                        double F[2], dF[2], dF2[2], dF3[2]; // compare trilinear with tricubic interpolation at cell center
+                        tricubic_eval_fused<1>(coeff, 0.5, 0.5, 0.5, &F[0], &dF[0], &dF2[0], &dF3[0]);
+                        trilinear_eval_fused<1>(&yyy[0][0], 0.5, 0.5, 0.5, &F[1], &dF[1], &dF2[1], &dF3[1]);
+                        blockerror[0] = std::max(blockerror[0], std::abs(F[0] - F[1]));
+                        blockerror[1] = std::max({blockerror[1], std::abs(dF[0] - dF[1])/cellx, std::abs(dF2[0] - dF2[1])/celly, std::abs(dF3[0] - dF3[1])/cellz});
+                    }
+                    else if (tablecoeffs_single.empty()){
+                        for (unsigned i = 0; i < 64; ++i)
+                            tablecoeffs[cell][i*COMPONENTS + component] = coeff[i]; // and store them interleaved with other components
+                    }
+                    else{
+                        float coeff_single[64];
+                        for (unsigned i = 0; i < 64; ++i){
+                            coeff_single[i] = static_cast<float>(coeff[i]);
+                            tablecoeffs_single[cell][i*COMPONENTS + component] = coeff_single[i];
+                        }
+                        double F[2], dF[2], dF2[2], dF3[2]; // compare interpolation with double and single precision at cell center
+                        tricubic_eval_fused<1>(coeff, 0.5, 0.5, 0.5, &F[0], &dF[0], &dF2[0], &dF3[0]);
+                        tricubic_eval_fused<1>(coeff_single, 0.5, 0.5, 0.5, &F[1], &dF[1], &dF2[1], &dF3[1]);
+                        blockerror[0] = std::max(blockerror[0], std::abs(F[0] - F[1]));
+                        blockerror[1] = std::max({blockerror[1], std::abs(dF[0] - dF[1])/cellx, std::abs(dF2[0] - dF2[1])/celly, std::abs(dF3[0] - dF3[1])/cellz});
+                    }
                 }
-                tricubic_get_coeff(&coeff(indices[0])[0], &yyy[0][0], &yyy[1][0], &yyy[2][0], &yyy[3][0], &yyy[4][0], &yyy[5][0], &yyy[6][0], &yyy[7][0]); // calculate tricubic interpolation coefficients and store in coeff
-			}
-		}
-	}
+            }
+        }
+        std::lock_guard<std::mutex> lock(errormutex);
+        for (unsigned i = 0; i < 2; ++i)
+            maxerror[i] = std::max(maxerror[i], blockerror[i]);
+    });
 }
 
 
-TabField3::TabField3(const std::array<std::vector<double>, 3> &xyzTab, const std::array<std::vector<double>, 3> &BTab, const std::vector<double> &VTab){
+TabField3::TabField3(const std::array<std::vector<double>, 3> &xyzTab, const std::array<std::vector<double>, 3> &BTab, const std::vector<double> &VTab,
+                     const bool single_precision, const unsigned nthreads, const bool trilinear){
+    if (single_precision && trilinear)
+        throw std::runtime_error("Trilinear interpolation cannot store corner values in single precision!");
 
     for (unsigned i = 0; i < 3; ++i){
         std::unique_copy(xyzTab[i].begin(), xyzTab[i].end(), std::back_inserter(xyz[i])); // get list of unique x, y, and z coordinates
@@ -422,6 +777,7 @@ TabField3::TabField3(const std::array<std::vector<double>, 3> &xyzTab, const std
         auto last = std::unique(xyz[i].begin(), xyz[i].end());
         xyz[i].erase(last, xyz[i].end());
 	}
+    CalcSpacing();
     CheckTab(BTab,VTab); // print some info
 
 
@@ -455,75 +811,933 @@ TabField3::TabField3(const std::array<std::vector<double>, 3> &xyzTab, const std
 	}
 
 	std::cout << "Starting Preinterpolation ... ";
-	float size = 0;
+    if (not BTab[0].empty() || not BTab[1].empty() || not BTab[2].empty() || not VTab.empty()){
+        for (unsigned long i = 0; i < 3; ++i){
+            cells[i] = xyz[i].size() - 1;
+        }
+        if (trilinear){
+            trilinear_coeff zero;
+            zero.fill(0.);
+            AllocateCoefficients(tablecoeffs_linear, cells[0]*cells[1]*cells[2], zero);
+            if (not tablecoeffs_linear.empty())
+                coeffs_linear = tablecoeffs_linear.data();
+        }
+        else if (single_precision){
+            tricubic_coeff_single zero;
+            zero.fill(0.f);
+            AllocateCoefficients(tablecoeffs_single, cells[0]*cells[1]*cells[2], zero);
+            if (not tablecoeffs_single.empty())
+                coeffs_single = tablecoeffs_single.data();
+        }
+        else{
+            tricubic_coeff zero;
+            zero.fill(0.);
+            AllocateCoefficients(tablecoeffs, cells[0]*cells[1]*cells[2], zero);
+            if (not tablecoeffs.empty())
+                coeffs = tablecoeffs.data();
+        }
+    }
+    std::array<std::array<double, 2>, COMPONENTS> maxerror = {}; // deviations caused by single-precision coefficients or trilinear interpolation
     if (not BTab[0].empty()){
 		std::cout << "Bx ... ";
 		std::cout.flush();
-        PreInterpol(B[0], Bc[0]); // precalculate interpolation coefficients for B field
-        size += float(Bc[0].num_elements()*64*sizeof(double)/1024/1024);
+        PreInterpol(B[0], 0, maxerror[0], nthreads); // precalculate interpolation coefficients for B field
 	}
     if (not BTab[1].empty()){
 		std::cout << "By ... ";
 		std::cout.flush();
-        PreInterpol(B[1], Bc[1]);
-        size += float(Bc[1].num_elements()*64*sizeof(double)/1024/1024);
+        PreInterpol(B[1], 1, maxerror[1], nthreads);
 	}
     if (not BTab[2].empty()){
 		std::cout << "Bz ... ";
 		std::cout.flush();
-        PreInterpol(B[2], Bc[2]);
-        size += float(Bc[2].num_elements()*64*sizeof(double)/1024/1024);
+        PreInterpol(B[2], 2, maxerror[2], nthreads);
 	}
 	if (not VTab.empty()){
 		std::cout << "V ... ";
 		std::cout.flush();
-        PreInterpol(V, Vc);
-        size += float(Vc.num_elements()*64*sizeof(double)/1024/1024);
+        PreInterpol(V, 3, maxerror[3], nthreads);
 	}
+	float size = float((tablecoeffs.size()*sizeof(tricubic_coeff) + tablecoeffs_single.size()*sizeof(tricubic_coeff_single) + tablecoeffs_linear.size()*sizeof(trilinear_coeff))/1024/1024);
 	std::cout << "Done (" << size << " MB)\n";
+	if (coeffs_single != nullptr || coeffs_linear != nullptr){
+		std::cout << (coeffs_linear != nullptr ? "Trilinear interpolation deviates from tricubic interpolation" : "Single-precision coefficients change interpolated fields") << " at cell centers by up to:";
+		const char *names[COMPONENTS] = {"Bx", "By", "Bz", "V"};
+		for (int i = 0; i < COMPONENTS; ++i)
+			std::cout << " " << names[i] << " " << maxerror[i][0] << " (gradient " << maxerror[i][1] << ")";
+		std::cout << "\n";
+	}
 }
 
 
-void TabField3::Interpolate(const double x, const double y, const double z,
-                            const field_type& coeffs, double &F, double dFdxi[3]) const {
-    std::array<double, 3> r = {x, y, z}, dist;
-	// get coordinate index
-    std::array<long, 3> index;
+namespace{
+/**
+ * Header of cache file storing interpolation coefficients
+ *
+ * It is followed by the x, y, and z coordinates of the grid, padding to a multiple of 64 bytes, and the coefficients of all grid cells.
+ */
+struct TabField3CacheHeader{
+    char magic[8]; ///< Identifies file as coefficient cache
+    std::uint64_t version; ///< Version of cache format
+    std::uint64_t key; ///< Key identifying table file and the parameters it was loaded with
+    std::uint64_t points[3]; ///< Number of grid points in x, y, and z direction
+    std::uint64_t coefficient_size; ///< Size of each coefficient in bytes (8 for double, 4 for single precision)
+    std::uint64_t cell_coefficients; ///< Number of coefficients per field component and grid cell (64 for tricubic, 8 for trilinear interpolation)
+};
+
+const char cache_magic[8] = "PENTab3"; ///< Magic string at start of cache file
+const std::uint64_t cache_version = 4; ///< Version of cache format, increase when layout of file or coefficients changes
+
+/**
+ * Offset of coefficients in cache file
+ *
+ * @param points Number of grid points in x, y, and z direction
+ *
+ * @return Returns offset in bytes
+ */
+std::size_t CacheCoefficientOffset(const std::uint64_t points[3]){
+    std::size_t offset = sizeof(TabField3CacheHeader) + (points[0] + points[1] + points[2])*sizeof(double);
+    return (offset + 63)/64*64;
+}
+}
+
+
+TabField3::TabField3(const boost::filesystem::path &cachefile, const std::uint64_t key){
+    cache.open(cachefile.string());
+    if (cache.size() < sizeof(TabField3CacheHeader))
+        throw std::runtime_error("Cache file " + cachefile.string() + " is too short");
+    TabField3CacheHeader header;
+    std::memcpy(&header, cache.data(), sizeof(header));
+    if (std::memcmp(header.magic, cache_magic, sizeof(cache_magic)) != 0 || header.version != cache_version)
+        throw std::runtime_error("Cache file " + cachefile.string() + " has incompatible format");
+    if (header.key != key)
+        throw std::runtime_error("Cache file " + cachefile.string() + " does not match table file");
+    for (unsigned i = 0; i < 3; ++i){
+        if (header.points[i] < 2)
+            throw std::runtime_error("Cache file " + cachefile.string() + " is corrupt");
+        cells[i] = header.points[i] - 1;
+    }
+    if ((header.coefficient_size != sizeof(double) && header.coefficient_size != sizeof(float)) || (header.cell_coefficients != 64 && header.cell_coefficients != 8)
+        || (header.cell_coefficients == 8 && header.coefficient_size != sizeof(double)))
+        throw std::runtime_error("Cache file " + cachefile.string() + " is corrupt");
+    std::size_t offset = CacheCoefficientOffset(header.points);
+    if (cache.size() != offset + cells[0]*cells[1]*cells[2]*header.cell_coefficients*COMPONENTS*header.coefficient_size)
+        throw std::runtime_error("Cache file " + cachefile.string() + " has wrong size");
+
+    const double *grid = reinterpret_cast<const double*>(cache.data() + sizeof(header));
     for (unsigned i = 0; i < 3; ++i){
-      auto it = std::upper_bound(xyz[i].begin(), xyz[i].end(), r[i]); // find first coordinate larger than x/y/z
-      if (it == xyz[i].end() || it == xyz[i].begin()){ // if x,y,z are outside bounds of field
-          return;
-      }
-      auto low = it - 1;
-      index[i] = std::distance(xyz[i].begin(), low);
-      dist[i] = *it - *low;
-      r[i] = (r[i] - *low)/dist[i]; // scale coordinates to unit cube
+        xyz[i].assign(grid, grid + header.points[i]);
+        grid += header.points[i];
+    }
+    CalcSpacing();
+    if (header.cell_coefficients == 8)
+        coeffs_linear = reinterpret_cast<const trilinear_coeff*>(cache.data() + offset);
+    else if (header.coefficient_size == sizeof(float))
+        coeffs_single = reinterpret_cast<const tricubic_coeff_single*>(cache.data() + offset); // use coefficients directly from memory-mapped file
+    else
+        coeffs = reinterpret_cast<const tricubic_coeff*>(cache.data() + offset);
+    std::cout << "The arrays are " << xyz[0].size() << " by " << xyz[1].size() << " by " << xyz[2].size() << "\n";
+}
+
+
+void TabField3::WriteCache(const boost::filesystem::path &cachefile, const std::uint64_t key) const{
+    if (not HasCoefficients())
+        return;
+    TabField3CacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, cache_magic, sizeof(cache_magic));
+    header.version = cache_version;
+    header.key = key;
+    for (unsigned i = 0; i < 3; ++i)
+        header.points[i] = xyz[i].size();
+    header.coefficient_size = coeffs_single != nullptr ? sizeof(float) : sizeof(double);
+    header.cell_coefficients = coeffs_linear != nullptr ? 8 : 64;
+
+    // write to temporary file first, so other processes never see a partially written cache
+    boost::filesystem::path tmpfile = boost::filesystem::unique_path(cachefile.string() + ".%%%%-%%%%.tmp");
+    {
+        std::ofstream f(tmpfile.string(), std::ofstream::binary);
+        f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (unsigned i = 0; i < 3; ++i)
+            f.write(reinterpret_cast<const char*>(xyz[i].data()), xyz[i].size()*sizeof(double));
+        std::vector<char> padding(CacheCoefficientOffset(header.points) - sizeof(header) - (xyz[0].size() + xyz[1].size() + xyz[2].size())*sizeof(double), 0);
+        f.write(padding.data(), padding.size());
+        if (coeffs_linear != nullptr)
+            f.write(reinterpret_cast<const char*>(coeffs_linear), cells[0]*cells[1]*cells[2]*sizeof(trilinear_coeff));
+        else if (coeffs_single != nullptr)
+            f.write(reinterpret_cast<const char*>(coeffs_single), cells[0]*cells[1]*cells[2]*sizeof(tricubic_coeff_single));
+        else
+            f.write(reinterpret_cast<const char*>(coeffs), cells[0]*cells[1]*cells[2]*sizeof(tricubic_coeff));
+        if (!f){
+            boost::system::error_code ec;
+            boost::filesystem::remove(tmpfile, ec);
+            throw std::runtime_error("Could not write " + tmpfile.string());
+        }
     }
+    boost::filesystem::rename(tmpfile, cachefile);
+}
+
 
-    // tricubic interpolation
-    if (not coeffs.empty()){
-        double *coeff = const_cast<double*>(&coeffs(index)[0]);
-        F = tricubic_eval_fast(coeff, r[0], r[1], r[2]);
-        if (dFdxi != nullptr){
-            dFdxi[0] = tricubic_eval_fast(coeff, r[0], r[1], r[2], 1, 0, 0)/dist[0];
-            dFdxi[1] = tricubic_eval_fast(coeff, r[0], r[1], r[2], 0, 1, 0)/dist[1];
-            dFdxi[2] = tricubic_eval_fast(coeff, r[0], r[1], r[2], 0, 0, 1)/dist[2];
+void TabField3::CalcSpacing(){
+    minspacing = std::numeric_limits<double>::infinity();
+    for (unsigned i = 0; i < 3; ++i){
+        for (unsigned long j = 0; j + 1 < xyz[i].size(); ++j)
+            minspacing = std::min(minspacing, xyz[i][j + 1] - xyz[i][j]);
+        spacing[i] = xyz[i].size() > 1 ? (xyz[i].back() - xyz[i].front())/(xyz[i].size() - 1) : 0.;
+        for (unsigned long j = 0; j < xyz[i].size(); ++j){
+            if (std::abs(xyz[i][j] - (xyz[i].front() + j*spacing[i])) > 1e-3*spacing[i]){ // use binary search for cell lookup if grid is not uniform
+                spacing[i] = 0.;
+                break;
+            }
         }
     }
 }
 
 
+void TabField3::GetBounds(std::array<double, 3> &min, std::array<double, 3> &max) const{
+    for (unsigned i = 0; i < 3; ++i){
+        min[i] = xyz[i].front();
+        max[i] = xyz[i].back();
+    }
+}
+
+
+double TabField3::GetMinimumSpacing() const{
+    return minspacing;
+}
+
+
+thread_local std::array<TabField3::TCellHint, TabField3::CELL_HINTS> TabField3::hints;
+thread_local std::size_t TabField3::nexthint = 0;
+
+
+bool TabField3::FindCell(const double x, const double y, const double z, std::array<long, 3> &index, std::array<double, 3> &r, std::array<double, 3> &dist) const{
+    r = {x, y, z};
+    TCellHint *hint = nullptr;
+    if (spacing[0] == 0 || spacing[1] == 0 || spacing[2] == 0){
+        hint = std::find_if(hints.begin(), hints.end(), [this](const TCellHint &h){ return h.field == this; });
+        if (hint == hints.end()){
+            hint = &hints[nexthint];
+            nexthint = (nexthint + 1) % CELL_HINTS;
+            *hint = {this, {{0, 0, 0}}};
+        }
+    }
+    for (unsigned i = 0; i < 3; ++i){
+        const std::vector<double> &grid = xyz[i];
+        if (not (r[i] >= grid.front() && r[i] < grid.back())) // if x,y,z are outside bounds of field
+            return false;
+        long low;
+        if (spacing[i] > 0){
+            low = std::min(static_cast<long>((r[i] - grid.front())/spacing[i]), static_cast<long>(grid.size()) - 2);
+            // correct for rounding errors, so the cell is the same as found by a binary search
+            while (low > 0 && r[i] < grid[low])
+                --low;
+            while (r[i] >= grid[low + 1])
+                ++low;
+        }
+        else{
+            low = std::min(hint->index[i], static_cast<long>(grid.size()) - 2);
+            if (r[i] >= grid[low] && r[i] < grid[low + 1]){} // same cell as last lookup
+            else if (r[i] >= grid[low + 1] && r[i] < grid[low + 2]) // r[i] < grid.back(), so grid[low + 2] exists
+                ++low;
+            else if (low > 0 && r[i] < grid[low] && r[i] >= grid[low - 1])
+                --low;
+            else{
+                auto it = std::upper_bound(grid.begin(), grid.end(), r[i]); // find first coordinate larger than x/y/z
+                low = std::distance(grid.begin(), it) - 1;
+            }
+            hint->index[i] = low;
+        }
+        index[i] = low;
+        dist[i] = grid[low + 1] - grid[low];
+        r[i] = (r[i] - grid[low])/dist[i]; // scale coordinates to unit cube
+    }
+    return true;
+}
+
+
+void TabField3::Interpolate(const std::array<long, 3> &index, const std::array<double, 3> &r, const std::array<double, 3> &dist,
+                            double F[COMPONENTS], double dFdxi[COMPONENTS][3]) const {
+    double dFdx[COMPONENTS], dFdy[COMPONENTS], dFdz[COMPONENTS];
+    if (coeffs_linear != nullptr)
+        trilinear_eval_fused<COMPONENTS>(&Coefficients(coeffs_linear, index[0], index[1], index[2])[0], r[0], r[1], r[2], F, dFdx, dFdy, dFdz);
+    else if (coeffs_single != nullptr)
+        tricubic_eval_fused<COMPONENTS>(&Coefficients(coeffs_single, index[0], index[1], index[2])[0], r[0], r[1], r[2], F, dFdx, dFdy, dFdz);
+    else
+        tricubic_eval_fused<COMPONENTS>(&Coefficients(coeffs, index[0], index[1], index[2])[0], r[0], r[1], r[2], F, dFdx, dFdy, dFdz);
+    for (int i = 0; i < COMPONENTS; ++i){
+        dFdxi[i][0] = dFdx[i]/dist[0];
+        dFdxi[i][1] = dFdy[i]/dist[1];
+        dFdxi[i][2] = dFdz[i]/dist[2];
+    }
+}
+
+
 void TabField3::BField(const double x, const double y, const double z, const double t, double B[3], double dBidxj[3][3]) const{
+    std::array<long, 3> index;
+    std::array<double, 3> r, dist;
+    if (not HasCoefficients() || not FindCell(x, y, z, index, r, dist)) // look up grid cell once for all components
+        return;
+    double F[COMPONENTS], dFdxi[COMPONENTS][3];
+    Interpolate(index, r, dist, F, dFdxi);
     for (unsigned i = 0; i < 3; ++i){
-        Interpolate(x, y, z, Bc[i], B[i], dBidxj == nullptr ? nullptr : dBidxj[i]);
+        B[i] = F[i];
+        if (dBidxj != nullptr){
+            for (unsigned j = 0; j < 3; ++j)
+                dBidxj[i][j] = dFdxi[i][j];
+        }
+    }
+}
+
+void TabField3::BField(const std::size_t n, const double *x, const double *y, const double *z, const double *t,
+        double *const B[3], double *const dBidxj[3][3]) const{
+    if (not HasCoefficients())
+        return;
+    std::vector<std::size_t> points; // points inside the grid
+    std::vector<unsigned long> cellindex; // position of their grid cells in the list of coefficients
+    std::vector< std::array<double, 3> > rs, dists;
+    points.reserve(n);
+    cellindex.reserve(n);
+    rs.reserve(n);
+    dists.reserve(n);
+    for (std::size_t k = 0; k < n; ++k){
+        std::array<long, 3> index;
+        std::array<double, 3> r, dist;
+        if (FindCell(x[k], y[k], z[k], index, r, dist)){
+            points.push_back(k);
+            cellindex.push_back(CellIndex(index[0], index[1], index[2]));
+            rs.push_back(r);
+            dists.push_back(dist);
+        }
+    }
+
+    for (std::size_t l = 0; l < points.size(); ++l){
+        double F[COMPONENTS], dFdx[COMPONENTS], dFdy[COMPONENTS], dFdz[COMPONENTS];
+        const std::array<double, 3> &r = rs[l], &dist = dists[l];
+        if (coeffs_linear != nullptr)
+            trilinear_eval_fused<COMPONENTS>(&coeffs_linear[cellindex[l]][0], r[0], r[1], r[2], F, dFdx, dFdy, dFdz);
+        else if (coeffs_single != nullptr)
+            tricubic_eval_fused<COMPONENTS>(&coeffs_single[cellindex[l]][0], r[0], r[1], r[2], F, dFdx, dFdy, dFdz);
+        else
+            tricubic_eval_fused<COMPONENTS>(&coeffs[cellindex[l]][0], r[0], r[1], r[2], F, dFdx, dFdy, dFdz);
+        const std::size_t k = points[l];
+        for (int i = 0; i < 3; ++i){
+            B[i][k] = F[i];
+            if (dBidxj != nullptr){
+                dBidxj[i][0][k] = dFdx[i]/dist[0];
+                dBidxj[i][1][k] = dFdy[i]/dist[1];
+                dBidxj[i][2][k] = dFdz[i]/dist[2];
+            }
+        }
     }
 }
 
 void TabField3::EField(const double x, const double y, const double z, const double t,
 		double &V, double Ei[3]) const{
-    double dVdxi[3];
-    Interpolate(x, y, z, Vc, V, dVdxi);
+    std::array<long, 3> index;
+    std::array<double, 3> r, dist;
+    if (not HasCoefficients() || not FindCell(x, y, z, index, r, dist))
+        return;
+    double F[COMPONENTS], dFdxi[COMPONENTS][3];
+    Interpolate(index, r, dist, F, dFdxi);
+    V = F[3];
     for (int i = 0; i < 3; i++){
-        Ei[i] = -dVdxi[i]; // Ei = -dV/dxi
+        Ei[i] = -dFdxi[3][i]; // Ei = -dV/dxi
+    }
+}
+
+
+void TabField3::Prefetch(const double x1, const double y1, const double z1, const double x2, const double y2, const double z2) const{
+#ifdef __GNUC__
+    if (not HasCoefficients())
+        return;
+    const double p1[3] = {x1, y1, z1}, d[3] = {x2 - x1, y2 - y1, z2 - z1};
+    double length = std::sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+    if (not (length > 0))
+        return;
+    double samplestep = 0.5*minspacing/length; // sample at half the grid spacing, so no crossed cell is skipped
+    unsigned long last = std::numeric_limits<unsigned long>::max();
+    unsigned fetched = 0;
+    for (double s = 0; s <= 1 && fetched < PREFETCH_CELLS; s += samplestep){
+        std::array<long, 3> index;
+        unsigned i = 0;
+        for (; i < 3; ++i){
+            const std::vector<double> &grid = xyz[i];
+            double r = p1[i] + s*d[i];
+            if (not (r >= grid.front() && r < grid.back()))
+                break;
+            if (spacing[i] > 0) // rounding errors do not matter here, the neighboring cell would be used soon anyway
+                index[i] = std::min(static_cast<long>((r - grid.front())/spacing[i]), static_cast<long>(grid.size()) - 2);
+            else
+                index[i] = std::distance(grid.begin(), std::upper_bound(grid.begin(), grid.end(), r)) - 1;
+        }
+        if (i < 3) // sample is outside of grid
+            continue;
+        unsigned long cell = CellIndex(index[0], index[1], index[2]);
+        if (cell == last)
+            continue;
+        last = cell;
+        ++fetched;
+        const char *c = coeffs_linear != nullptr ? reinterpret_cast<const char*>(&coeffs_linear[cell])
+                        : coeffs_single != nullptr ? reinterpret_cast<const char*>(&coeffs_single[cell]) : reinterpret_cast<const char*>(&coeffs[cell]);
+        const std::size_t size = coeffs_linear != nullptr ? sizeof(trilinear_coeff) : coeffs_single != nullptr ? sizeof(tricubic_coeff_single) : sizeof(tricubic_coeff);
+        for (std::size_t offset = 0; offset < size; offset += 64) // one prefetch per 64-byte cache line
+            __builtin_prefetch(c + offset);
+    }
+#endif
+}
+
+
+std::size_t TabField3::MemoryUsage() const{
+    std::size_t bytes = tablecoeffs.capacity()*sizeof(tricubic_coeff) + tablecoeffs_single.capacity()*sizeof(tricubic_coeff_single) + tablecoeffs_linear.capacity()*sizeof(trilinear_coeff);
+    for (auto &axis: xyz)
+        bytes += axis.capacity()*sizeof(double);
+    if (cache.is_open())
+        bytes += cache.size(); // mapped pages become resident when they are used
+    return bytes;
+}
+
+
+/**
+ * Evaluate magnetic field and electric potential of a field and their spatial derivatives
+ *
+ * @param source Field
+ * @param p Point at which the field is evaluated
+ * @param F Returns field components Bx, By, Bz, and V
+ * @param dFdxi Returns spatial derivatives of field components
+ */
+static void SampleField(const TField &source, const std::array<double, 3> &p, double F[4], double dFdxi[4][3]){
+    double B[3] = {0., 0., 0.}, dBidxj[3][3] = {{0., 0., 0.}, {0., 0., 0.}, {0., 0., 0.}}, V = 0., Ei[3] = {0., 0., 0.};
+    source.BField(p[0], p[1], p[2], 0., B, dBidxj);
+    source.EField(p[0], p[1], p[2], 0., V, Ei);
+    for (int i = 0; i < 3; ++i){
+        F[i] = B[i];
+        for (int j = 0; j < 3; ++j)
+            dFdxi[i][j] = dBidxj[i][j];
+        dFdxi[3][i] = -Ei[i];
+    }
+    F[3] = V;
+}
+
+
+TabField3Adaptive::TabField3Adaptive(const TField &source, const std::array<double, 3> &_min, const std::array<double, 3> &_max, const double minsize,
+                                     const double Btolerance, const double Vtolerance, const unsigned nthreads)
+        : min(_min), max(_max){
+    struct TCell{
+        std::array<double, 3> lo; ///< lower corner of cell
+        std::array<double, 3> size; ///< edge lengths of cell
+        unsigned long node; ///< index of cell in tree
+    };
+    // evaluate points just inside the upper bounds, since tables do not contain points on their upper boundary
+    std::array<double, 3> upper;
+    for (int i = 0; i < 3; ++i)
+        upper[i] = max[i] - 1e-9*(max[i] - min[i]);
+    const double tolerance[COMPONENTS] = {Btolerance, Btolerance, Btolerance, Vtolerance};
+
+    std::cout << "\nResampling field on octree ";
+    std::vector<TCell> level = {{min, {max[0] - min[0], max[1] - min[1], max[2] - min[2]}, 0}};
+    tree.assign(1, 0);
+    while (not level.empty()){
+        std::vector<tricubic_coeff> coeffs(level.size());
+        std::vector<char> split(level.size(), false);
+        ParallelFor(level.size(), nthreads, [&](const unsigned long begin, const unsigned long end){
+            for (unsigned long c = begin; c < end; ++c){
+                const TCell &cell = level[c];
+                double h[3]; // step size of finite differences
+                for (int i = 0; i < 3; ++i)
+                    h[i] = 1e-3*cell.size[i];
+                auto sample = [&](std::array<double, 3> p, double F[COMPONENTS], double dFdxi[COMPONENTS][3]){
+                    for (int i = 0; i < 3; ++i)
+                        p[i] = std::max(min[i], std::min(p[i], upper[i]));
+                    SampleField(source, p, F, dFdxi);
+                };
+                // derivative of component comp of first derivative along axis a with respect to axis b, calculated by central differences (one-sided at bounds)
+                auto mixed = [&](const std::array<double, 3> &p, const int a, const int b, double d[COMPONENTS]){
+                    std::array<double, 3> p1 = p, p2 = p;
+                    p1[b] = std::max(min[b], p[b] - h[b]);
+                    p2[b] = std::min(upper[b], p[b] + h[b]);
+                    double F[COMPONENTS], dF1[COMPONENTS][3], dF2[COMPONENTS][3];
+                    sample(p1, F, dF1);
+                    sample(p2, F, dF2);
+                    for (int l = 0; l < COMPONENTS; ++l)
+                        d[l] = (dF2[l][a] - dF1[l][a])/(p2[b] - p1[b]);
+                };
+
+                std::array<std::array<std::array<double, 8>, 8>, COMPONENTS> yyy; // values and derivatives at each corner, order according to tricubic manual
+                for (int corner = 0; corner < 8; ++corner){
+                    std::array<double, 3> p = {cell.lo[0] + (corner & 1)*cell.size[0], cell.lo[1] + ((corner >> 1) & 1)*cell.size[1], cell.lo[2] + ((corner >> 2) & 1)*cell.size[2]};
+                    double F[COMPONENTS], dFdxi[COMPONENTS][3], dxy[COMPONENTS], dyx[COMPONENTS], dxz[COMPONENTS], dzx[COMPONENTS], dyz[COMPONENTS], dzy[COMPONENTS];
+                    sample(p, F, dFdxi);
+                    mixed(p, 0, 1, dxy);
+                    mixed(p, 1, 0, dyx);
+                    mixed(p, 0, 2, dxz);
+                    mixed(p, 2, 0, dzx);
+                    mixed(p, 1, 2, dyz);
+                    mixed(p, 2, 1, dzy);
+                    std::array<double, 3> p1 = p, p2 = p;
+                    p1[2] = std::max(min[2], p[2] - h[2]);
+                    p2[2] = std::min(upper[2], p[2] + h[2]);
+                    double dxy1[COMPONENTS], dxy2[COMPONENTS];
+                    mixed(p1, 0, 1, dxy1);
+                    mixed(p2, 0, 1, dxy2);
+                    for (int l = 0; l < COMPONENTS; ++l){
+                        yyy[l][0][corner] = F[l];
+                        yyy[l][1][corner] = dFdxi[l][0]*cell.size[0];
+                        yyy[l][2][corner] = dFdxi[l][1]*cell.size[1];
+                        yyy[l][3][corner] = dFdxi[l][2]*cell.size[2];
+                        yyy[l][4][corner] = (dxy[l] + dyx[l])/2*cell.size[0]*cell.size[1];
+                        yyy[l][5][corner] = (dxz[l] + dzx[l])/2*cell.size[0]*cell.size[2];
+                        yyy[l][6][corner] = (dyz[l] + dzy[l])/2*cell.size[1]*cell.size[2];
+                        yyy[l][7][corner] = (dxy2[l] - dxy1[l])/(p2[2] - p1[2])*cell.size[0]*cell.size[1]*cell.size[2];
+                    }
+                }
+                for (int l = 0; l < COMPONENTS; ++l){
+                    double coeff[64];
+                    tricubic_get_coeff(coeff, &yyy[l][0][0], &yyy[l][1][0], &yyy[l][2][0], &yyy[l][3][0], &yyy[l][4][0], &yyy[l][5][0], &yyy[l][6][0], &yyy[l][7][0]);
+                    for (int i = 0; i < 64; ++i)
+                        coeffs[c][i*COMPONENTS + l] = coeff[i];
+                }
+
+                if (cell.size[0] < minsize or cell.size[1] < minsize or cell.size[2] < minsize)
+                    continue;
+                static const double testpoints[15][3] = {{0.5, 0.5, 0.5}, {0., 0.5, 0.5}, {1., 0.5, 0.5}, {0.5, 0., 0.5}, {0.5, 1., 0.5}, {0.5, 0.5, 0.}, {0.5, 0.5, 1.},
+                                                         {0.25, 0.25, 0.25}, {0.75, 0.25, 0.25}, {0.25, 0.75, 0.25}, {0.75, 0.75, 0.25},
+                                                         {0.25, 0.25, 0.75}, {0.75, 0.25, 0.75}, {0.25, 0.75, 0.75}, {0.75, 0.75, 0.75}};
+                for (auto &r: testpoints){
+                    double F[COMPONENTS], dFdxi[COMPONENTS][3], Fi[COMPONENTS], dFdx[COMPONENTS], dFdy[COMPONENTS], dFdz[COMPONENTS];
+                    sample({cell.lo[0] + r[0]*cell.size[0], cell.lo[1] + r[1]*cell.size[1], cell.lo[2] + r[2]*cell.size[2]}, F, dFdxi);
+                    tricubic_eval_fused<COMPONENTS>(coeffs[c].data(), r[0], r[1], r[2], Fi, dFdx, dFdy, dFdz);
+                    for (int l = 0; l < COMPONENTS; ++l)
+                        split[c] = split[c] or std::abs(Fi[l] - F[l]) > tolerance[l];
+                }
+            }
+        });
+
+        std::vector<TCell> next;
+        for (unsigned long c = 0; c < level.size(); ++c){
+            const TCell &cell = level[c];
+            if (split[c]){
+                tree[cell.node] = tree.size();
+                for (int child = 0; child < 8; ++child){
+                    TCell octant;
+                    for (int i = 0; i < 3; ++i){
+                        octant.size[i] = cell.size[i]/2;
+                        octant.lo[i] = cell.lo[i] + ((child >> (2 - i)) & 1)*octant.size[i];
+                    }
+                    octant.node = tree.size() + child;
+                    next.push_back(octant);
+                }
+                tree.resize(tree.size() + 8);
+            }
+            else{
+                tree[cell.node] = -static_cast<long>(leafcoeffs.size()) - 1;
+                leafcoeffs.push_back(coeffs[c]);
+            }
+        }
+        level.swap(next);
+        std::cout << ".";
+        std::cout.flush();
+    }
+    std::cout << " Done (" << leafcoeffs.size() << " cells, " << float(leafcoeffs.size()*sizeof(tricubic_coeff) + tree.size()*sizeof(long))/1024/1024 << " MB)\n";
+}
+
+
+bool TabField3Adaptive::Interpolate(const double x, const double y, const double z, double F[COMPONENTS], double dFdxi[COMPONENTS][3]) const{
+    std::array<double, 3> p = {x, y, z};
+    for (int i = 0; i < 3; ++i){
+        if (not (p[i] >= min[i] && p[i] < max[i]))
+            return false;
+    }
+    std::array<double, 3> lo = min, size = {max[0] - min[0], max[1] - min[1], max[2] - min[2]};
+    long node = 0;
+    while (tree[node] >= 0){ // descend into octant containing point until a leaf is reached
+        long child = 0;
+        for (int i = 0; i < 3; ++i){
+            size[i] /= 2;
+            if (p[i] >= lo[i] + size[i]){
+                lo[i] += size[i];
+                child += 1 << (2 - i);
+            }
+        }
+        node = tree[node] + child;
+    }
+    double r[3], dFdx[COMPONENTS], dFdy[COMPONENTS], dFdz[COMPONENTS];
+    for (int i = 0; i < 3; ++i)
+        r[i] = (p[i] - lo[i])/size[i];
+    tricubic_eval_fused<COMPONENTS>(leafcoeffs[-tree[node] - 1].data(), r[0], r[1], r[2], F, dFdx, dFdy, dFdz);
+    for (int i = 0; i < COMPONENTS; ++i){
+        dFdxi[i][0] = dFdx[i]/size[0];
+        dFdxi[i][1] = dFdy[i]/size[1];
+        dFdxi[i][2] = dFdz[i]/size[2];
+    }
+    return true;
+}
+
+
+void TabField3Adaptive::BField(const double x, const double y, const double z, const double t, double B[3], double dBidxj[3][3]) const{
+    double F[COMPONENTS], dFdxi[COMPONENTS][3];
+    if (not Interpolate(x, y, z, F, dFdxi))
+        return;
+    for (unsigned i = 0; i < 3; ++i){
+        B[i] = F[i];
+        if (dBidxj != nullptr){
+            for (unsigned j = 0; j < 3; ++j)
+                dBidxj[i][j] = dFdxi[i][j];
+        }
+    }
+}
+
+
+void TabField3Adaptive::EField(const double x, const double y, const double z, const double t, double &V, double Ei[3]) const{
+    double F[COMPONENTS], dFdxi[COMPONENTS][3];
+    if (not Interpolate(x, y, z, F, dFdxi))
+        return;
+    V = F[3];
+    for (int i = 0; i < 3; i++)
+        Ei[i] = -dFdxi[3][i];
+}
+
+
+std::size_t TabField3Adaptive::MemoryUsage() const{
+    return tree.capacity()*sizeof(long) + leafcoeffs.capacity()*sizeof(tricubic_coeff);
+}
+
+
+thread_local std::vector<TabField3Series::TSnapshotPair> TabField3Series::current;
+
+
+TabField3Series::TabField3Series(const std::vector<double> &_times, const std::function<std::unique_ptr<TabField3>(const std::size_t)> &_load, const std::size_t _maxresident)
+        : times(_times), load(_load), maxresident(std::max<std::size_t>(_maxresident, 3)), snapshots(_times.size()), loading(_times.size(), false), lastuse(_times.size(), 0){
+    static std::atomic<unsigned long> serials(0);
+    serial = serials++;
+    if (times.empty())
+        throw std::runtime_error("Field series needs at least one snapshot!");
+}
+
+
+std::shared_ptr<const TabField3> TabField3Series::Snapshot(const std::size_t i, std::unique_lock<std::mutex> &lock) const{
+    while (loading[i]) // snapshot is being loaded by another thread or in the background
+        loaded.wait(lock);
+    lastuse[i] = ++uses;
+    if (snapshots[i])
+        return snapshots[i];
+
+    loading[i] = true;
+    lock.unlock();
+    std::shared_ptr<const TabField3> snapshot;
+    try{
+        snapshot = load(i);
     }
+    catch (...){
+        lock.lock();
+        loading[i] = false;
+        loaded.notify_all();
+        throw;
+    }
+    lock.lock();
+    Store(i, snapshot);
+    return snapshot;
+}
+
+
+void TabField3Series::Store(const std::size_t i, const std::shared_ptr<const TabField3> &snapshot) const{
+    snapshots[i] = snapshot;
+    loading[i] = false;
+    lastuse[i] = ++uses;
+    std::size_t resident = std::count_if(snapshots.begin(), snapshots.end(), [](const std::shared_ptr<const TabField3> &s){ return bool(s); });
+    for (; resident > maxresident; --resident){ // unload least recently used snapshot, threads still using it keep their own reference
+        std::size_t oldest = i;
+        for (std::size_t j = 0; j < snapshots.size(); ++j){
+            if (snapshots[j] && j != i && (oldest == i || lastuse[j] < lastuse[oldest]))
+                oldest = j;
+        }
+        snapshots[oldest].reset();
+    }
+    loaded.notify_all();
+}
+
+
+void TabField3Series::Snapshots(const double t, const TabField3 *&first, const TabField3 *&second, double &w) const{
+    const std::size_t n = times.size();
+    std::size_t i = 0;
+    w = 0;
+    if (n > 1){
+        std::size_t upper = std::upper_bound(times.begin(), times.end(), t) - times.begin();
+        i = std::min(upper > 0 ? upper - 1 : 0, n - 2);
+        w = std::min(std::max((t - times[i])/(times[i + 1] - times[i]), 0.), 1.);
+    }
+
+    for (auto &pair: current){
+        if (pair.serial == serial && pair.index == i){
+            first = pair.first.get();
+            second = pair.second.get();
+            return;
+        }
+    }
+
+    TSnapshotPair pair;
+    pair.serial = serial;
+    pair.index = i;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        pair.first = Snapshot(i, lock);
+        if (i + 1 < n)
+            pair.second = Snapshot(i + 1, lock);
+        const std::size_t next = i + 2;
+        if (next < n && not snapshots[next] && not loading[next] && not prefetching){ // load next snapshot in the background
+            prefetching = true;
+            loading[next] = true;
+            prefetch = std::async(std::launch::async, [this, next]{
+                std::shared_ptr<const TabField3> snapshot;
+                try{
+                    snapshot = load(next);
+                }
+                catch (std::exception &e){
+                    std::cout << "Warning: Could not load snapshot " << next << " of field series in the background (" << e.what() << ")\n";
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                if (snapshot)
+                    Store(next, snapshot);
+                else{
+                    loading[next] = false; // thread needing the snapshot will try again
+                    loaded.notify_all();
+                }
+                prefetching = false;
+            });
+        }
+    }
+
+    auto entry = std::find_if(current.begin(), current.end(), [this](const TSnapshotPair &p){ return p.serial == serial; });
+    if (entry == current.end())
+        entry = current.insert(current.end(), pair);
+    else
+        *entry = pair;
+    first = entry->first.get();
+    second = entry->second.get();
+}
+
+
+void TabField3Series::GetBounds(std::array<double, 3> &min, std::array<double, 3> &max) const{
+    std::unique_lock<std::mutex> lock(mutex);
+    Snapshot(0, lock)->GetBounds(min, max);
+}
+
+
+void TabField3Series::BField(const double x, const double y, const double z, const double t, double B[3], double dBidxj[3][3]) const{
+    const TabField3 *first, *second;
+    double w;
+    Snapshots(t, first, second, w);
+    first->BField(x, y, z, t, B, dBidxj);
+    if (second == nullptr || w == 0)
+        return;
+    double B2[3] = {0, 0, 0}, dB2[3][3] = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}};
+    second->BField(x, y, z, t, B2, dBidxj == nullptr ? nullptr : dB2);
+    for (unsigned i = 0; i < 3; ++i){
+        B[i] += w*(B2[i] - B[i]);
+        if (dBidxj != nullptr){
+            for (unsigned j = 0; j < 3; ++j)
+                dBidxj[i][j] += w*(dB2[i][j] - dBidxj[i][j]);
+        }
+    }
+}
+
+
+void TabField3Series::EField(const double x, const double y, const double z, const double t, double &V, double Ei[3]) const{
+    const TabField3 *first, *second;
+    double w;
+    Snapshots(t, first, second, w);
+    first->EField(x, y, z, t, V, Ei);
+    if (second == nullptr || w == 0)
+        return;
+    double V2 = 0, E2[3] = {0, 0, 0};
+    second->EField(x, y, z, t, V2, E2);
+    V += w*(V2 - V);
+    for (unsigned i = 0; i < 3; ++i)
+        Ei[i] += w*(E2[i] - Ei[i]);
+}
+
+
+std::size_t TabField3Series::MemoryUsage() const{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::size_t bytes = 0;
+    for (auto &snapshot: snapshots){
+        if (snapshot)
+            bytes += snapshot->MemoryUsage();
+    }
+    return bytes;
+}
+
+
+TabField3Symmetric::TabField3Symmetric(std::shared_ptr<const TField> _table, const std::array<double, 3> &_min, const std::array<double, 3> &_max, const TTableSymmetry &_symmetry)
+        : table(std::move(_table)), tablemin(_min), tablemax(_max), symmetry(_symmetry){
+    if (symmetry.rotation == 0)
+        throw std::runtime_error("Order of rotational symmetry has to be at least one!");
+    double extent = 0;
+    for (int i = 0; i < 3; ++i){
+        side[i] = tablemax[i] > 0 ? 1. : -1.; // table is on the positive side unless it lies completely below the plane
+        extent = std::max(extent, std::max(std::abs(tablemin[i]), std::abs(tablemax[i])));
+    }
+    slack = 1e-12*extent;
+    for (unsigned k = 0; k < symmetry.rotation; ++k){
+        double angle = 2*pi*k/symmetry.rotation;
+        sectors.push_back({{std::cos(angle), std::sin(angle)}});
+    }
+}
+
+
+bool TabField3Symmetric::Map(const double x, const double y, const double z, double u[3], double R[3][3], double &Bsign, double &Vsign) const{
+    double c = 1, s = 0;
+    if (symmetry.rotation > 1){ // rotate back by the start angle of the point's sector
+        double phi = std::atan2(y, x);
+        if (phi < 0)
+            phi += 2*pi;
+        std::size_t k = std::min<std::size_t>(sectors.size() - 1, static_cast<std::size_t>(phi/(2*pi)*sectors.size()));
+        c = sectors[k][0];
+        s = sectors[k][1];
+    }
+    const double rotation[3][3] = {{c, s, 0}, {-s, c, 0}, {0, 0, 1}};
+    u[0] = c*x + s*y;
+    u[1] = -s*x + c*y;
+    u[2] = z;
+    Bsign = Vsign = 1;
+    for (int i = 0; i < 3; ++i){
+        double reflect = symmetry.mirror[i] != 0 && u[i]*side[i] < 0 ? -1 : 1;
+        if (reflect < 0){ // a reflection flips the pseudovector B in addition to the sign of the sources
+            u[i] = -u[i];
+            Bsign *= -symmetry.mirror[i];
+            Vsign *= symmetry.mirror[i];
+        }
+        for (int j = 0; j < 3; ++j)
+            R[i][j] = reflect*rotation[i][j];
+    }
+    for (int i = 0; i < 3; ++i){
+        if (u[i] < tablemin[i] - slack || u[i] > tablemax[i] + slack)
+            return false;
+        u[i] = std::max(tablemin[i], std::min(tablemax[i], u[i]));
+    }
+    return true;
+}
+
+
+void TabField3Symmetric::GetBounds(std::array<double, 3> &min, std::array<double, 3> &max) const{
+    min = tablemin;
+    max = tablemax;
+    if (symmetry.rotation > 1){ // sectors fill a cylinder around the z axis
+        double r = 0;
+        for (double x: {tablemin[0], tablemax[0]}){
+            for (double y: {tablemin[1], tablemax[1]})
+                r = std::max(r, std::sqrt(x*x + y*y));
+        }
+        min[0] = min[1] = -r;
+        max[0] = max[1] = r;
+    }
+    for (int i = 0; i < 3; ++i){
+        if (symmetry.mirror[i] != 0){
+            double lower = std::min(min[i], -max[i]), upper = std::max(max[i], -min[i]);
+            min[i] = lower;
+            max[i] = upper;
+        }
+    }
+}
+
+
+/**
+ * Transform magnetic field and its derivatives from the fundamental domain of a symmetric field back to the original point
+ *
+ * @param R Orthogonal matrix that mapped the point into the fundamental domain
+ * @param Bsign Sign of magnetic field in fundamental domain relative to the mapped field
+ * @param Bu Magnetic field in fundamental domain
+ * @param dBu Derivatives of magnetic field in fundamental domain (nullptr: not transformed)
+ * @param B Returns magnetic field at original point
+ * @param dBidxj Returns derivatives of magnetic field at original point
+ */
+static void MapBack(const double R[3][3], const double Bsign, const double Bu[3], const double dBu[3][3], double B[3], double dBidxj[3][3]){
+    for (int i = 0; i < 3; ++i){
+        B[i] = Bsign*(R[0][i]*Bu[0] + R[1][i]*Bu[1] + R[2][i]*Bu[2]); // B = Bsign*R^T*Bu
+        if (dBu != nullptr){
+            for (int j = 0; j < 3; ++j){ // dB/dx = Bsign*R^T*dBu/du*R
+                double d = 0;
+                for (int k = 0; k < 3; ++k){
+                    for (int l = 0; l < 3; ++l)
+                        d += R[k][i]*dBu[k][l]*R[l][j];
+                }
+                dBidxj[i][j] = Bsign*d;
+            }
+        }
+    }
+}
+
+
+void TabField3Symmetric::BField(const double x, const double y, const double z, const double t, double B[3], double dBidxj[3][3]) const{
+    double u[3], R[3][3], Bsign, Vsign;
+    if (not Map(x, y, z, u, R, Bsign, Vsign))
+        return;
+    double Bu[3] = {0, 0, 0}, dBu[3][3] = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}};
+    table->BField(u[0], u[1], u[2], t, Bu, dBidxj != nullptr ? dBu : nullptr);
+    MapBack(R, Bsign, Bu, dBidxj != nullptr ? dBu : nullptr, B, dBidxj);
+}
+
+
+void TabField3Symmetric::BField(const std::size_t n, const double *x, const double *y, const double *z, const double *t,
+        double *const B[3], double *const dBidxj[3][3]) const{
+    std::vector<std::size_t> inside; // points mapped into the table
+    std::vector<std::array<double, 10> > transforms; // matrix and sign of magnetic field of each of these points
+    std::vector<double> coords(4*n);
+    double *ux = &coords[0], *uy = ux + n, *uz = uy + n, *ut = uz + n;
+    for (std::size_t k = 0; k < n; ++k){
+        double u[3], R[3][3], Bsign, Vsign;
+        if (Map(x[k], y[k], z[k], u, R, Bsign, Vsign)){
+            std::size_t l = inside.size();
+            ux[l] = u[0];
+            uy[l] = u[1];
+            uz[l] = u[2];
+            ut[l] = t[k];
+            inside.push_back(k);
+            transforms.push_back({{R[0][0], R[0][1], R[0][2], R[1][0], R[1][1], R[1][2], R[2][0], R[2][1], R[2][2], Bsign}});
+        }
+    }
+    const std::size_t m = inside.size();
+    if (m == 0)
+        return;
+
+    std::vector<double> F(12*m, 0.); // field in fundamental domain, as structure of arrays
+    double *const Bu[3] = {&F[0], &F[m], &F[2*m]};
+    double *const dBu[3][3] = {{&F[3*m], &F[4*m], &F[5*m]}, {&F[6*m], &F[7*m], &F[8*m]}, {&F[9*m], &F[10*m], &F[11*m]}};
+    table->BField(m, ux, uy, uz, ut, Bu, dBidxj != nullptr ? dBu : nullptr);
+
+    for (std::size_t l = 0; l < m; ++l){
+        const std::array<double, 10> &T = transforms[l];
+        const double R[3][3] = {{T[0], T[1], T[2]}, {T[3], T[4], T[5]}, {T[6], T[7], T[8]}};
+        double Bl[3] = {Bu[0][l], Bu[1][l], Bu[2][l]}, dBl[3][3], Bk[3], dBk[3][3];
+        for (int i = 0; i < 3; ++i){
+            for (int j = 0; j < 3; ++j)
+                dBl[i][j] = dBu[i][j][l];
+        }
+        MapBack(R, T[9], Bl, dBidxj != nullptr ? dBl : nullptr, Bk, dBk);
+        const std::size_t k = inside[l];
+        for (int i = 0; i < 3; ++i){
+            B[i][k] = Bk[i];
+            if (dBidxj != nullptr){
+                for (int j = 0; j < 3; ++j)
+                    dBidxj[i][j][k] = dBk[i][j];
+            }
+        }
+    }
+}
+
+
+void TabField3Symmetric::EField(const double x, const double y, const double z, const double t, double &V, double Ei[3]) const{
+    double u[3], R[3][3], Bsign, Vsign;
+    if (not Map(x, y, z, u, R, Bsign, Vsign))
+        return;
+    double Vu = 0, Eu[3] = {0, 0, 0};
+    table->EField(u[0], u[1], u[2], t, Vu, Eu);
+    V = Vsign*Vu;
+    for (int i = 0; i < 3; ++i)
+        Ei[i] = Vsign*(R[0][i]*Eu[0] + R[1][i]*Eu[1] + R[2][i]*Eu[2]); // gradient transforms like a vector
+}
+
+
+std::size_t TabField3Symmetric::MemoryUsage() const{
+    return table->MemoryUsage();
 }
@@ -0,0 +1,394 @@
+/**
+ * \file
+ * Interpolation of magnetic fields given on unstructured tetrahedral meshes.
+ */
+
+#include "field_fem.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <tuple>
+
+#include <boost/format.hpp>
+
+#include "globals.h"
+#include "tablereader.h"
+
+static const double FEM_BARYCENTRIC_TOLERANCE = 1e-12; ///< Points whose barycentric coordinates are all above -FEM_BARYCENTRIC_TOLERANCE are inside a tetrahedron
+static const unsigned FEM_MAX_WALK = 64; ///< Max. number of tetrahedra visited by a walk before the bounding-volume hierarchy is searched
+static const std::size_t FEM_BVH_LEAF = 4; ///< Max. number of tetrahedra in a leaf of the bounding-volume hierarchy
+
+thread_local TabFieldFEM::TLocationHint TabFieldFEM::hint;
+
+
+TabFieldFEM::TabFieldFEM(std::vector<std::array<double, 3> > anodes, std::vector<std::array<double, 3> > avalues, const std::vector<std::array<std::uint32_t, 4> > &elements,
+                         const unsigned nthreads)
+        : nodes(std::move(anodes)), values(std::move(avalues)){
+    if (nodes.empty() || elements.empty())
+        throw std::runtime_error("Mesh of FEM field contains no nodes or no tetrahedra!");
+    if (values.size() != nodes.size())
+        throw std::runtime_error((boost::format("FEM field contains %1% nodes but %2% field values!") % nodes.size() % values.size()).str());
+    min.fill(std::numeric_limits<double>::infinity());
+    max.fill(-std::numeric_limits<double>::infinity());
+    for (auto &node: nodes){
+        for (int i = 0; i < 3; ++i){
+            min[i] = std::min(min[i], node[i]);
+            max[i] = std::max(max[i], node[i]);
+        }
+    }
+
+    // invert edge matrix of each tetrahedron to get its barycentric coordinates
+    tetrahedra.resize(elements.size());
+    std::vector<double> volumes(elements.size()); // 0: degenerate tetrahedron, -1: tetrahedron refers to missing node
+    ParallelFor(elements.size(), nthreads, [&](const unsigned long begin, const unsigned long end){
+        for (std::size_t e = begin; e < end; ++e){
+            TTetrahedron &tet = tetrahedra[e];
+            tet.nodes = elements[e];
+            tet.neighbors.fill(-1);
+            if (*std::max_element(tet.nodes.begin(), tet.nodes.end()) >= nodes.size()){
+                volumes[e] = -1;
+                continue;
+            }
+            double M[3][3]; // edges from corner 0 to corners 1 to 3 in columns
+            for (int i = 0; i < 3; ++i){
+                for (int j = 0; j < 3; ++j)
+                    M[i][j] = nodes[tet.nodes[j + 1]][i] - nodes[tet.nodes[0]][i];
+            }
+            double det = M[0][0]*(M[1][1]*M[2][2] - M[1][2]*M[2][1]) - M[0][1]*(M[1][0]*M[2][2] - M[1][2]*M[2][0]) + M[0][2]*(M[1][0]*M[2][1] - M[1][1]*M[2][0]);
+            if (det == 0)
+                continue;
+            for (int i = 0; i < 3; ++i){ // inverse is the transposed cofactor matrix divided by the determinant
+                for (int j = 0; j < 3; ++j)
+                    tet.T[i][j] = (M[(j + 1) % 3][(i + 1) % 3]*M[(j + 2) % 3][(i + 2) % 3] - M[(j + 1) % 3][(i + 2) % 3]*M[(j + 2) % 3][(i + 1) % 3])/det;
+            }
+            volumes[e] = std::abs(det)/6;
+        }
+    });
+    for (std::size_t e = 0; e < elements.size(); ++e){
+        if (volumes[e] < 0)
+            throw std::runtime_error((boost::format("Tetrahedron %1% refers to node that does not exist!") % (e + 1)).str());
+        else if (volumes[e] == 0)
+            throw std::runtime_error((boost::format("Tetrahedron %1% is degenerate!") % (e + 1)).str());
+    }
+
+    // tetrahedra sharing a face are neighbours, found by sorting all faces by their corners
+    std::vector<std::tuple<std::uint32_t, std::uint32_t, std::uint32_t, std::uint32_t, int> > faces;
+    faces.reserve(4*tetrahedra.size());
+    for (std::size_t e = 0; e < tetrahedra.size(); ++e){
+        for (int i = 0; i < 4; ++i){
+            std::array<std::uint32_t, 3> corners = {{tetrahedra[e].nodes[(i + 1) % 4], tetrahedra[e].nodes[(i + 2) % 4], tetrahedra[e].nodes[(i + 3) % 4]}};
+            std::sort(corners.begin(), corners.end());
+            faces.emplace_back(corners[0], corners[1], corners[2], e, i);
+        }
+    }
+    std::sort(faces.begin(), faces.end());
+    for (std::size_t f = 0; f + 1 < faces.size(); ++f){
+        if (std::get<0>(faces[f]) == std::get<0>(faces[f + 1]) && std::get<1>(faces[f]) == std::get<1>(faces[f + 1]) && std::get<2>(faces[f]) == std::get<2>(faces[f + 1])){
+            tetrahedra[std::get<3>(faces[f])].neighbors[std::get<4>(faces[f])] = std::get<3>(faces[f + 1]);
+            tetrahedra[std::get<3>(faces[f + 1])].neighbors[std::get<4>(faces[f + 1])] = std::get<3>(faces[f]);
+            ++f;
+        }
+    }
+    faces.clear();
+    faces.shrink_to_fit();
+
+    // recover nodal gradients from the constant gradients of the linear interpolation in the adjacent tetrahedra, weighted by their volumes
+    gradients.assign(nodes.size(), std::array<std::array<double, 3>, 3>());
+    std::vector<double> nodevolumes(nodes.size(), 0.);
+    for (std::size_t e = 0; e < tetrahedra.size(); ++e){
+        const TTetrahedron &tet = tetrahedra[e];
+        double gradlambda[4][3];
+        for (int j = 0; j < 3; ++j){
+            gradlambda[0][j] = -(tet.T[0][j] + tet.T[1][j] + tet.T[2][j]);
+            for (int k = 1; k < 4; ++k)
+                gradlambda[k][j] = tet.T[k - 1][j];
+        }
+        double grad[3][3] = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}};
+        for (int k = 0; k < 4; ++k){
+            for (int i = 0; i < 3; ++i){
+                for (int j = 0; j < 3; ++j)
+                    grad[i][j] += values[tet.nodes[k]][i]*gradlambda[k][j];
+            }
+        }
+        for (int k = 0; k < 4; ++k){
+            for (int i = 0; i < 3; ++i){
+                for (int j = 0; j < 3; ++j)
+                    gradients[tet.nodes[k]][i][j] += volumes[e]*grad[i][j];
+            }
+            nodevolumes[tet.nodes[k]] += volumes[e];
+        }
+    }
+    for (std::size_t n = 0; n < nodes.size(); ++n){
+        if (nodevolumes[n] > 0){
+            for (auto &row: gradients[n]){
+                for (auto &g: row)
+                    g /= nodevolumes[n];
+            }
+        }
+    }
+
+    std::vector<std::array<double, 3> > centroids(tetrahedra.size());
+    for (std::size_t e = 0; e < tetrahedra.size(); ++e){
+        for (int i = 0; i < 3; ++i)
+            centroids[e][i] = 0.25*(nodes[tetrahedra[e].nodes[0]][i] + nodes[tetrahedra[e].nodes[1]][i] + nodes[tetrahedra[e].nodes[2]][i] + nodes[tetrahedra[e].nodes[3]][i]);
+    }
+    bvhorder.resize(tetrahedra.size());
+    std::iota(bvhorder.begin(), bvhorder.end(), 0);
+    bvh.reserve(2*tetrahedra.size()/FEM_BVH_LEAF + 1);
+    BuildBVH(centroids, 0, bvhorder.size());
+
+    std::cout << "Prepared FEM mesh with " << nodes.size() << " nodes and " << tetrahedra.size() << " tetrahedra in x = [" << min[0] << ", " << max[0]
+              << "], y = [" << min[1] << ", " << max[1] << "], z = [" << min[2] << ", " << max[2] << "]\n";
+}
+
+
+void TabFieldFEM::BuildBVH(const std::vector<std::array<double, 3> > &centroids, const std::size_t begin, const std::size_t end){
+    std::size_t index = bvh.size();
+    bvh.emplace_back();
+    TBVHNode &node = bvh.back();
+    std::fill(node.min, node.min + 3, std::numeric_limits<double>::infinity());
+    std::fill(node.max, node.max + 3, -std::numeric_limits<double>::infinity());
+    double cmin[3] = {node.min[0], node.min[1], node.min[2]}, cmax[3] = {node.max[0], node.max[1], node.max[2]}; // bounding box of centroids
+    for (std::size_t o = begin; o < end; ++o){
+        const TTetrahedron &tet = tetrahedra[bvhorder[o]];
+        for (int i = 0; i < 3; ++i){
+            for (auto n: tet.nodes){
+                node.min[i] = std::min(node.min[i], nodes[n][i]);
+                node.max[i] = std::max(node.max[i], nodes[n][i]);
+            }
+            cmin[i] = std::min(cmin[i], centroids[bvhorder[o]][i]);
+            cmax[i] = std::max(cmax[i], centroids[bvhorder[o]][i]);
+        }
+    }
+    if (end - begin <= FEM_BVH_LEAF){
+        node.first = begin;
+        node.count = end - begin;
+        return;
+    }
+    int axis = 0; // split at median of centroids along axis in which they are spread the most
+    for (int i = 1; i < 3; ++i){
+        if (cmax[i] - cmin[i] > cmax[axis] - cmin[axis])
+            axis = i;
+    }
+    std::size_t middle = (begin + end)/2;
+    std::nth_element(bvhorder.begin() + begin, bvhorder.begin() + middle, bvhorder.begin() + end, [&centroids, axis](const std::uint32_t a, const std::uint32_t b){
+        return centroids[a][axis] < centroids[b][axis];
+    });
+    node.count = 0;
+    BuildBVH(centroids, begin, middle); // node is invalidated when bvh grows
+    bvh[index].first = bvh.size();
+    BuildBVH(centroids, middle, end);
+}
+
+
+int TabFieldFEM::Barycentric(const std::uint32_t tet, const double p[3], double lambda[4]) const{
+    const TTetrahedron &t = tetrahedra[tet];
+    const std::array<double, 3> &x0 = nodes[t.nodes[0]];
+    double d[3] = {p[0] - x0[0], p[1] - x0[1], p[2] - x0[2]};
+    lambda[0] = 1;
+    int smallest = 0;
+    for (int i = 0; i < 3; ++i){
+        lambda[i + 1] = t.T[i][0]*d[0] + t.T[i][1]*d[1] + t.T[i][2]*d[2];
+        lambda[0] -= lambda[i + 1];
+    }
+    for (int i = 1; i < 4; ++i){
+        if (lambda[i] < lambda[smallest])
+            smallest = i;
+    }
+    return smallest;
+}
+
+
+long TabFieldFEM::Locate(const double p[3], double lambda[4]) const{
+    if (hint.field == this && hint.tetrahedron < tetrahedra.size()){ // walk towards the point from the last tetrahedron found by this thread
+        std::uint32_t tet = hint.tetrahedron;
+        for (unsigned step = 0; step < FEM_MAX_WALK; ++step){
+            int smallest = Barycentric(tet, p, lambda);
+            if (lambda[smallest] >= -FEM_BARYCENTRIC_TOLERANCE){
+                hint.tetrahedron = tet;
+                return tet;
+            }
+            std::int32_t next = tetrahedra[tet].neighbors[smallest];
+            if (next < 0) // walk left the mesh, which might be non-convex, so search the hierarchy
+                break;
+            tet = next;
+        }
+    }
+
+    std::uint32_t stack[64];
+    int depth = 0;
+    stack[depth++] = 0;
+    while (depth > 0){
+        const TBVHNode &node = bvh[stack[--depth]];
+        if (p[0] < node.min[0] || p[0] > node.max[0] || p[1] < node.min[1] || p[1] > node.max[1] || p[2] < node.min[2] || p[2] > node.max[2])
+            continue;
+        if (node.count > 0){
+            for (std::uint32_t o = node.first; o < node.first + node.count; ++o){
+                if (lambda[Barycentric(bvhorder[o], p, lambda)] >= -FEM_BARYCENTRIC_TOLERANCE){
+                    hint.field = this;
+                    hint.tetrahedron = bvhorder[o];
+                    return bvhorder[o];
+                }
+            }
+        }
+        else{
+            stack[depth++] = node.first;
+            stack[depth++] = &node - bvh.data() + 1;
+        }
+    }
+    return -1;
+}
+
+
+void TabFieldFEM::BField(const double x, const double y, const double z, const double t, double B[3], double dBidxj[3][3]) const{
+    const double p[3] = {x, y, z};
+    double lambda[4];
+    long tet = Locate(p, lambda);
+    if (tet < 0)
+        return;
+    const TTetrahedron &te = tetrahedra[tet];
+    double gradlambda[4][3];
+    for (int j = 0; j < 3; ++j){
+        gradlambda[0][j] = -(te.T[0][j] + te.T[1][j] + te.T[2][j]);
+        for (int k = 1; k < 4; ++k)
+            gradlambda[k][j] = te.T[k - 1][j];
+    }
+
+    // quadratic shape functions: corners lambda_k*(2*lambda_k - 1), edge midpoints 4*lambda_k*lambda_l
+    double F[3] = {0, 0, 0}, dF[3][3] = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}};
+    for (int k = 0; k < 4; ++k){
+        const std::array<double, 3> &f = values[te.nodes[k]];
+        double N = lambda[k]*(2*lambda[k] - 1), dN = 4*lambda[k] - 1;
+        for (int i = 0; i < 3; ++i){
+            F[i] += N*f[i];
+            for (int j = 0; j < 3; ++j)
+                dF[i][j] += dN*f[i]*gradlambda[k][j];
+        }
+    }
+    for (int k = 0; k < 3; ++k){
+        for (int l = k + 1; l < 4; ++l){
+            const std::uint32_t a = te.nodes[k], b = te.nodes[l];
+            double edge[3] = {nodes[b][0] - nodes[a][0], nodes[b][1] - nodes[a][1], nodes[b][2] - nodes[a][2]};
+            double N = 4*lambda[k]*lambda[l];
+            for (int i = 0; i < 3; ++i){
+                // cubic Hermite interpolation along the edge, evaluated at its midpoint
+                double fmid = 0.5*(values[a][i] + values[b][i]) + 0.125*((gradients[a][i][0] - gradients[b][i][0])*edge[0] + (gradients[a][i][1] - gradients[b][i][1])*edge[1]
+                                                                          + (gradients[a][i][2] - gradients[b][i][2])*edge[2]);
+                F[i] += N*fmid;
+                for (int j = 0; j < 3; ++j)
+                    dF[i][j] += 4*(lambda[l]*gradlambda[k][j] + lambda[k]*gradlambda[l][j])*fmid;
+            }
+        }
+    }
+    for (int i = 0; i < 3; ++i){
+        B[i] = F[i];
+        if (dBidxj != nullptr){
+            for (int j = 0; j < 3; ++j)
+                dBidxj[i][j] = dF[i][j];
+        }
+    }
+}
+
+
+std::size_t TabFieldFEM::MemoryUsage() const{
+    return nodes.capacity()*sizeof(nodes[0]) + values.capacity()*sizeof(values[0]) + gradients.capacity()*sizeof(gradients[0])
+           + tetrahedra.capacity()*sizeof(TTetrahedron) + bvh.capacity()*sizeof(TBVHNode) + bvhorder.capacity()*sizeof(std::uint32_t);
+}
+
+
+/**
+ * Read tetrahedral mesh and magnetic field exported from COMSOL in the "Sectionwise" format
+ *
+ * @param ft Mesh file
+ * @param lengthconv Factor to convert coordinates to meters
+ * @param nthreads Number of threads used to prepare the mesh
+ *
+ * @return Returns interpolated field
+ */
+static std::unique_ptr<TabFieldFEM> ReadFEMMesh(const boost::filesystem::path &ft, const double lengthconv, const unsigned nthreads){
+    TTableReader FIN(ft);
+    std::cout << "\nReading " << ft << "\n";
+    std::vector<std::array<double, 3> > nodes;
+    std::vector<std::array<std::uint32_t, 4> > elements;
+    std::array<std::vector<double>, 3> B;
+    enum{ HEADER, COORDINATES, ELEMENTS, DATA } section = HEADER;
+    int dataset = -1;
+    std::string line;
+    while (FIN.SkipEmptyLines()){
+        unsigned long lineNum = FIN.LineNumber();
+        if (FIN.Peek() == '%'){ // section headers, other comments are skipped
+            FIN.ReadLine(line);
+            std::string title = line.substr(std::min(line.find_first_not_of("% \t"), line.size()));
+            if (title.compare(0, 11, "Coordinates") == 0)
+                section = COORDINATES;
+            else if (title.compare(0, 9, "Elements ") == 0){
+                if (title.find("tetrahedra") == std::string::npos)
+                    throw std::runtime_error((boost::format("%1% contains elements other than tetrahedra in line %2%!") % ft.string() % lineNum).str());
+                section = ELEMENTS;
+            }
+            else if (title.compare(0, 4, "Data") == 0){
+                if (++dataset >= 3)
+                    throw std::runtime_error((boost::format("%1% contains more than three data sections (Bx, By, Bz) in line %2%!") % ft.string() % lineNum).str());
+                section = DATA;
+            }
+            continue;
+        }
+
+        double v[4];
+        int columns = 0;
+        while (columns < 4 && FIN.ReadNumberInLine(v[columns]))
+            ++columns;
+        FIN.ReadLine(line); // rest of line has to be empty
+        const int expected = section == COORDINATES ? 3 : section == ELEMENTS ? 4 : 1;
+        if (section == HEADER || columns != expected || line.find_first_not_of(" \t\r,") != std::string::npos)
+            throw std::runtime_error((boost::format("Error reading line %1% of file %2%") % lineNum % ft.string()).str());
+        if (section == COORDINATES)
+            nodes.push_back({{v[0]*lengthconv, v[1]*lengthconv, v[2]*lengthconv}});
+        else if (section == ELEMENTS){
+            std::array<std::uint32_t, 4> element;
+            for (int i = 0; i < 4; ++i){
+                if (v[i] < 1)
+                    throw std::runtime_error((boost::format("Invalid node index in line %1% of file %2%") % lineNum % ft.string()).str());
+                element[i] = static_cast<std::uint32_t>(v[i]) - 1; // COMSOL counts nodes from 1
+            }
+            elements.push_back(element);
+        }
+        else{
+            if (not std::isfinite(v[0]))
+                throw std::runtime_error((boost::format("Field value in line %1% of file %2% is not finite!") % lineNum % ft.string()).str());
+            B[dataset].push_back(v[0]);
+        }
+    }
+    for (int i = 0; i < 3; ++i){
+        if (B[i].size() != nodes.size())
+            throw std::runtime_error((boost::format("%1% has to contain Bx, By, and Bz for each of its %2% nodes!") % ft.string() % nodes.size()).str());
+    }
+    std::vector<std::array<double, 3> > values(nodes.size());
+    for (std::size_t n = 0; n < nodes.size(); ++n)
+        values[n] = {{B[0][n], B[1][n], B[2][n]}};
+    return std::unique_ptr<TabFieldFEM>(new TabFieldFEM(std::move(nodes), std::move(values), elements, nthreads));
+}
+
+
+TFieldContainer ReadFEMField(const std::string &params, const std::map<std::string, std::string> &formulas, const unsigned nthreads){
+    std::istringstream ss(params);
+    boost::filesystem::path ft;
+    std::string fieldtype, Bscale;
+    double BoundaryWidth, lengthconv;
+    ss >> fieldtype >> ft >> Bscale >> BoundaryWidth >> lengthconv;
+    if (!ss)
+        throw std::runtime_error((boost::format("Could not read all required parameters for field %1%!") % fieldtype).str());
+    Bscale = ResolveFormula(Bscale, formulas);
+    ft = boost::filesystem::absolute(ft, configpath.parent_path());
+    std::shared_ptr<const TabFieldFEM> mesh = std::static_pointer_cast<const TabFieldFEM>(SharedTable((boost::format("%1% FEM %2$.17g") % ft.string() % lengthconv).str(), [&]{
+        return std::unique_ptr<TField>(ReadFEMMesh(ft, lengthconv, nthreads));
+    }));
+    std::array<double, 3> min, max;
+    mesh->GetBounds(min, max);
+    return TFieldContainer(std::move(mesh), Bscale, "0", max[0], min[0], max[1], min[1], max[2], min[2], BoundaryWidth);
+}
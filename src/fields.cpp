@@ -8,46 +8,170 @@
 #include <string>
 #include <iostream>
 #include <vector>
+#include <atomic>
+#include <future>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <set>
+#include <boost/format.hpp>
 #include "field_2d.h"
 #include "field_3d.h"
+#include "field_fem.h"
 #include "conductor.h"
 #include "edmfields.h"
 #include "harmonicfields.h"
+#include "profiler.h"
+#include "querytrace.h"
+#include "source.h"
 #include "analyticFields.h"
 
 
+thread_local TFieldManager::TFieldCache TFieldManager::cache;
+
+/**
+ * Check if electric fields do not influence a simulation, because it only tracks neutral particles that neither decay into charged particles nor have their spins tracked (motional vxE field)
+ *
+ * @param conf Configuration
+ *
+ * @return Returns true if electric fields are not needed
+ */
+static bool NeutralParticlesOnly(TConfig &conf){
+	auto option = [&conf](const std::string &section, const std::string &name){ // sections are optional, e.g. in unit tests
+		for (const auto &s: conf){
+			auto o = s.first == section ? s.second.find(name) : s.second.end();
+			if (o != s.second.end())
+				return o->second;
+		}
+		return std::string();
+	};
+	int simtype = 0;
+	std::istringstream(option("GLOBAL", "simtype")) >> simtype;
+	if (simtype != PARTICLE and simtype != REPLAY)
+		return false;
+	int secondaries = 1;
+	std::istringstream(option("GLOBAL", "secondaries")) >> secondaries;
+	bool sources = false;
+	for (const auto &s: conf){ // every source has to create neutral particles only
+		if (not IsSourceSection(s.first))
+			continue;
+		sources = true;
+		std::string particle = option(s.first, "particle");
+		if (particle != "neutron" and particle != "mercury" and particle != "xenon")
+			return false;
+		double spintime;
+		if (std::istringstream(option(particle, "spintimes")) >> spintime or std::istringstream(option("PARTICLES", "spintimes")) >> spintime)
+			return false;
+		double tau = 0;
+		if (not (std::istringstream(option(particle, "tau")) >> tau))
+			std::istringstream(option("PARTICLES", "tau")) >> tau;
+		if (particle == "neutron" and secondaries != 0 and tau > 0) // decaying neutrons create protons and electrons
+			return false;
+	}
+	return sources;
+}
+
+
 TFieldManager::TFieldManager(TConfig &conf){
-	for (const auto &i: conf["FIELDS"]){
+	static std::atomic<unsigned long> serials(0);
+	serial = ++serials;
+	std::map<std::string, std::string> formulas; // FORMULAS section is optional
+	boost::filesystem::path cachedir; // directory for cached interpolation coefficients of 3D tables is optional
+	int nthreads = 1; // tables are preprocessed with as many threads as are used for tracking
+	int stride = 1; // 3D tables are used at full resolution by default
+	std::string bakeparams; // baking of static fields is optional
+	bool nativeformulas = false; // formulas are interpreted by default
+	std::string scalertable; // tabulation of time-dependent scaling formulas is optional
+	double simtime = 0;
+	for (const auto &section: conf){
+		if (section.first == "FORMULAS")
+			formulas = section.second;
+		else if (section.first == "GLOBAL"){
+			auto option = section.second.find("fieldcache");
+			if (option != section.second.end())
+				std::istringstream(option->second) >> cachedir;
+			option = section.second.find("nthreads");
+			if (option != section.second.end())
+				std::istringstream(option->second) >> nthreads;
+			option = section.second.find("fieldstride");
+			if (option != section.second.end())
+				std::istringstream(option->second) >> stride;
+			option = section.second.find("bakefields");
+			if (option != section.second.end())
+				bakeparams = option->second;
+			option = section.second.find("nativeformulas");
+			if (option != section.second.end())
+				std::istringstream(option->second) >> nativeformulas;
+			option = section.second.find("scalertable");
+			if (option != section.second.end())
+				scalertable = option->second;
+			option = section.second.find("simtime");
+			if (option != section.second.end())
+				std::istringstream(option->second) >> simtime;
+		}
+	}
+	nthreads = std::max(nthreads, 1);
+	stride = std::max(stride, 1);
+	if (not cachedir.empty()){
+		cachedir = boost::filesystem::absolute(cachedir, configpath.parent_path());
+		boost::filesystem::create_directories(cachedir);
+	}
+	if (nativeformulas)
+		EnableNativeFormulas(cachedir.empty() ? boost::filesystem::temp_directory_path() / "PENTrack-formulas" : cachedir);
+	const bool neutral = NeutralParticlesOnly(conf);
+	std::vector<std::string> definitions;
+	std::vector<bool> bakeable;
+	// tables are read in parallel, analytic fields are created while the fields are collected in the order of the config file
+	auto load = [&, formulas](const std::string &definition) mutable -> std::vector<TFieldContainer>{ // each task gets its own copy of formulas, since operator[] inserts missing formulas
+		std::vector<TFieldContainer> loaded; // empty if field is skipped
 		std::string type;
 		boost::filesystem::path ft;
 		double Ibar, p1, p2, p3, p4, p5, p6, p7;
 		double bW, xma, xmi, yma, ymi, zma, zmi;
 		double axis_x, axis_y, axis_z, angle, G0, G1, G2, G3, G4, G5, G6, G7, G8, G9, G10, G11, G12, G13, G14, G15, G16, G17, G18, G19, G20, G21, G22, G23;
 		std::string Bscale, Escale, Bx, By, Bz;
-		std::istringstream ss(i.second);
+		std::istringstream ss(definition);
 		ss >> type;
+		if (neutral and (type == "OPERA2D" or type == "2Dtable" or type == "OPERA3D" or type == "OPERA3D_ADAPTIVE" or type == "OPERA3D_SERIES" or type == "3Dtable" or type == "COMSOL" or type == "FEM")){
+			std::istringstream tabss(definition);
+			if (tabss >> type >> ft >> Bscale and ResolveFormula(Bscale, formulas) == "0"){
+				std::cout << "Skipping table " << ft << " containing only electric fields, which do not affect the simulated neutral particles\n";
+				return loaded;
+			}
+		}
 
         if (type == "OPERA2D" or type == "2Dtable"){
-            fields.emplace_back(ReadOperaField2(i.second, conf["FORMULAS"]));
+            loaded.emplace_back(ReadOperaField2(definition, formulas, nthreads));
+		}
+        else if (type == "OPERA3D" or type == "OPERA3D_ADAPTIVE" or type == "3Dtable"){
+            loaded.emplace_back(ReadOperaField3(definition, formulas, cachedir, nthreads, stride));
 		}
-        else if (type == "OPERA3D" or type == "3Dtable"){
-            fields.emplace_back(ReadOperaField3(i.second, conf["FORMULAS"]));
+        else if (type == "OPERA3D_SERIES"){
+            loaded.emplace_back(ReadOperaField3Series(definition, formulas, cachedir, nthreads, stride));
 		}
         else if (type == "COMSOL"){
-            fields.emplace_back(ReadComsolField(i.second, conf["FORMULAS"]));
+            loaded.emplace_back(ReadComsolField(definition, formulas, cachedir, nthreads, stride));
+		}
+        else if (type == "FEM"){
+            loaded.emplace_back(ReadFEMField(definition, formulas, nthreads));
 		}
         else if ((type == "Conductor") && (ss >> Ibar >> p1 >> p2 >> p3 >> p4 >> p5 >> p6 >> Bscale)){
 			std::unique_ptr<TField> f(new TConductorField(p1, p2, p3, p4, p5, p6, Ibar));
-			Bscale = ResolveFormula(Bscale, conf["FORMULAS"]);
-            fields.emplace_back(TFieldContainer(std::move(f), Bscale));
+			Bscale = ResolveFormula(Bscale, formulas);
+            loaded.emplace_back(TFieldContainer(std::move(f), Bscale));
+		}
+        else if ((type == "ConductorSet") && (ss >> ft >> Bscale)){
+			std::unique_ptr<TField> f(new TConductorSetField(boost::filesystem::absolute(ft, configpath.parent_path())));
+			Bscale = ResolveFormula(Bscale, formulas);
+            loaded.emplace_back(TFieldContainer(std::move(f), Bscale));
 		}
         else if ((type == "EDMStaticB0GradZField") && (ss >> p1 >> p2 >> p3 >> p4 >> p5 >> p6 >> p7 >> bW >> xma >> xmi >> yma >> ymi >> zma >> zmi >> Bscale)){
 			//conversion to radians
 			p4*=pi/180;
 			p5*=pi/180;
 			std::unique_ptr<TField> f(new TEDMStaticB0GradZField(p1, p2, p3, p4, p5, p6, p7));
-			Bscale = ResolveFormula(Bscale, conf["FORMULAS"]);
-            fields.emplace_back(TFieldContainer(std::move(f), Bscale, "0", xma, xmi, yma, ymi, zma, zmi, bW));
+			Bscale = ResolveFormula(Bscale, formulas);
+            loaded.emplace_back(TFieldContainer(std::move(f), Bscale, "0", xma, xmi, yma, ymi, zma, zmi, bW));
 		}
 		else if (type == "HarmonicExpandedBField" and
 				 ss >> p1 >> p2 >> p3 >> bW >> xma >> xmi >> yma >> ymi >> zma >> zmi >> Bscale >> axis_x >> axis_y >> axis_z >> angle and
@@ -57,104 +181,479 @@ TFieldManager::TFieldManager(TConfig &conf){
 			p4*=pi/180;
 			p5*=pi/180;
 			std::unique_ptr<TField> f(new HarmonicExpandedBField(p1, p2, p3, axis_x, axis_y, axis_z, angle, G0, G1, G2, G3, G4, G5, G6, G7, G8, G9, G10, G11, G12, G13, G14, G15, G16, G17, G18, G19, G20, G21, G22, G23));
-			Bscale = ResolveFormula(Bscale, conf["FORMULAS"]);
-			fields.emplace_back(TFieldContainer(std::move(f), Bscale, "0", xma, xmi, yma, ymi, zma, zmi, bW));
+			Bscale = ResolveFormula(Bscale, formulas);
+			loaded.emplace_back(TFieldContainer(std::move(f), Bscale, "0", xma, xmi, yma, ymi, zma, zmi, bW));
 		}
         else if ((type == "EDMStaticEField") and (ss >> p1 >> p2 >> p3 >> Bscale)){
 			std::unique_ptr<TField> f(new TEDMStaticEField (p1, p2, p3));
-			Bscale = ResolveFormula(Bscale, conf["FORMULAS"]);
-            fields.emplace_back(TFieldContainer(std::move(f), Bscale));
+			Bscale = ResolveFormula(Bscale, formulas);
+            loaded.emplace_back(TFieldContainer(std::move(f), Bscale));
 		}
 		else if (type == "ExponentialFieldX" and ss >> p1 >> p2 >> p3 >> p4 >> p5 >> xma >> xmi >> yma >> ymi >> zma >> zmi >> Bscale){
 			std::unique_ptr<TField> f( new TExponentialFieldX(p1, p2, p3, p4, p5));
-			Bscale = ResolveFormula(Bscale, conf["FORMULAS"]);
-			fields.emplace_back(TFieldContainer(std::move(f), Bscale, "0", xma, xmi, yma, ymi, zma, zmi, 0.));
+			Bscale = ResolveFormula(Bscale, formulas);
+			loaded.emplace_back(TFieldContainer(std::move(f), Bscale, "0", xma, xmi, yma, ymi, zma, zmi, 0.));
 		}
 
 		else if (type == "LinearFieldZ" and	ss >> p1 >> p2 >> xma >> xmi >> yma >> ymi >> zma >> zmi >> Bscale){
 			std::unique_ptr<TField> f( new TLinearFieldZ(p1, p2));
-			Bscale = ResolveFormula(Bscale, conf["FORMULAS"]);
-			fields.emplace_back(TFieldContainer(std::move(f), Bscale, "0", xma, xmi, yma, ymi, zma, zmi, 0.));
+			Bscale = ResolveFormula(Bscale, formulas);
+			loaded.emplace_back(TFieldContainer(std::move(f), Bscale, "0", xma, xmi, yma, ymi, zma, zmi, 0.));
 		}
 
 		else if (type == "B0GradZ" and ss >> p1 >> p2 >> p3 >> xma >> xmi >> yma >> ymi >> zma >> zmi >> Bscale){
 			std::unique_ptr<TField> f(new TB0GradZ(p1, p2, p3));
-			Bscale = ResolveFormula(Bscale, conf["FORMULAS"]);
-			fields.emplace_back(TFieldContainer(std::move(f), Bscale, "0", xma, xmi, yma, ymi, zma, zmi, 0.));
+			Bscale = ResolveFormula(Bscale, formulas);
+			loaded.emplace_back(TFieldContainer(std::move(f), Bscale, "0", xma, xmi, yma, ymi, zma, zmi, 0.));
 		}
 
 		else if (type == "B0GradX2" and ss >> p1 >> p2 >> p3 >> p4 >> xma >> xmi >> yma >> ymi >> zma >> zmi >> Bscale){
 			std::unique_ptr<TField> f( new TB0GradX2(p1, p2, p3, p4));
-			Bscale = ResolveFormula(Bscale, conf["FORMULAS"]);
-			fields.emplace_back(TFieldContainer(std::move(f), Bscale, "0", xma, xmi, yma, ymi, zma, zmi, 0.));
+			Bscale = ResolveFormula(Bscale, formulas);
+			loaded.emplace_back(TFieldContainer(std::move(f), Bscale, "0", xma, xmi, yma, ymi, zma, zmi, 0.));
 		}
 
 		else if (type == "B0GradXY" and ss >> p1 >> p2 >> p3 >> xma >> xmi >> yma >> ymi >> zma >> zmi >> Bscale){
 			std::unique_ptr<TField> f(new TB0GradXY(p1, p2, p3));
-			Bscale = ResolveFormula(Bscale, conf["FORMULAS"]);
-			fields.emplace_back(TFieldContainer(std::move(f), Bscale, "0", xma, xmi, yma, ymi, zma, zmi, 0.));
+			Bscale = ResolveFormula(Bscale, formulas);
+			loaded.emplace_back(TFieldContainer(std::move(f), Bscale, "0", xma, xmi, yma, ymi, zma, zmi, 0.));
 		}
 
 		else if (type == "B0_XY" and ss >> p1 >> p2 >> xma >> xmi >> yma >> ymi >> zma >> zmi >> Bscale){
 			std::unique_ptr<TField> f(new TB0_XY(p1, p2));
-			Bscale = ResolveFormula(Bscale, conf["FORMULAS"]);
-			fields.emplace_back(TFieldContainer(std::move(f), Bscale, "0", xma, xmi, yma, ymi, zma, zmi, 0.));
+			Bscale = ResolveFormula(Bscale, formulas);
+			loaded.emplace_back(TFieldContainer(std::move(f), Bscale, "0", xma, xmi, yma, ymi, zma, zmi, 0.));
 		}
 
 		else if (type == "CustomBField" and ss >> Bx >> By >> Bz >> xma >> xmi >> yma >> ymi >> zma >> zmi >> bW >> Bscale){
-			std::unique_ptr<TField> f(new TCustomBField(conf["FORMULAS"][Bx], conf["FORMULAS"][By], conf["FORMULAS"][Bz]));
-			Bscale = ResolveFormula(Bscale, conf["FORMULAS"]);
-			fields.emplace_back(TFieldContainer(std::move(f), Bscale, "0", xma, xmi, yma, ymi, zma, zmi, bW));
+			std::vector<std::string> dB; // optional derivative formulas
+			std::string dBij;
+			while (ss >> dBij)
+				dB.push_back(formulas[dBij]);
+			std::unique_ptr<TField> f(new TCustomBField(formulas[Bx], formulas[By], formulas[Bz], dB));
+			Bscale = ResolveFormula(Bscale, formulas);
+			loaded.emplace_back(TFieldContainer(std::move(f), Bscale, "0", xma, xmi, yma, ymi, zma, zmi, bW));
 		}
 		else{
             throw std::runtime_error("Could not load field """ + type + """! Check config file for invalid field type or parameters.");
 		}
+		return loaded;
+	};
+	std::vector<std::future<std::vector<TFieldContainer> > > loading;
+	std::vector<std::string> rfpulses; // RF declarations refer to fields by their identifier and are applied after all fields are loaded
+	for (const auto &i: conf["FIELDS"]){
+		std::string type;
+		std::istringstream(i.second) >> type;
+		if (type == "RFPulse"){
+			rfpulses.push_back(i.second);
+			continue;
+		}
+		bool table = type == "OPERA2D" or type == "2Dtable" or type == "OPERA3D" or type == "OPERA3D_ADAPTIVE" or type == "OPERA3D_SERIES" or type == "3Dtable" or type == "COMSOL" or type == "FEM";
+		loading.push_back(std::async(table ? std::launch::async : std::launch::deferred, load, i.second));
+	}
+	auto definition = conf["FIELDS"].begin();
+	std::map<std::string, unsigned> identifiers; // index of each loaded field in TFieldManager::fields
+	for (auto &l: loading){
+		std::string type;
+		std::istringstream(definition->second) >> type;
+		while (type == "RFPulse"){
+			++definition;
+			type.clear();
+			std::istringstream(definition->second) >> type;
+		}
+		std::vector<TFieldContainer> loaded = l.get();
+		if (not loaded.empty()){
+			identifiers[definition->first] = fields.size();
+			fields.push_back(std::move(loaded.front()));
+			definitions.push_back(definition->second);
+			bakeable.push_back(type == "Conductor" or type == "ConductorSet" or type == "EDMStaticB0GradZField" or type == "HarmonicExpandedBField" or type == "ExponentialFieldX" or type == "LinearFieldZ" or
+							   type == "B0GradZ" or type == "B0GradX2" or type == "B0GradXY" or type == "B0_XY" or type == "CustomBField"); // analytic magnetic fields
+		}
+		++definition;
 	}
+	for (const auto &rf: rfpulses)
+		DeclareRF(rf, identifiers, formulas);
+	if (not scalertable.empty()){
+		double resolution, tolerance;
+		std::istringstream ss(scalertable);
+		if (!(ss >> resolution >> tolerance) or resolution <= 0 or tolerance <= 0)
+			throw std::runtime_error("Could not read resolution and tolerance of scaling-formula tables from scalertable option \"" + scalertable + "\"!");
+		for (auto &f: fields)
+			f.TabulateScalers(0, simtime, resolution, tolerance);
+	}
+	baked.assign(fields.size(), false);
+	if (not bakeparams.empty())
+		BakeFields(bakeparams, definitions, bakeable, formulas, cachedir, nthreads);
+	BuildIndex();
 	std::cout << "\n";
 }
 
 
+void TFieldManager::DeclareRF(const std::string &params, const std::map<std::string, unsigned> &identifiers, const std::map<std::string, std::string> &formulas){
+	std::string type, identifier, frequency;
+	double phase;
+	std::istringstream ss(params);
+	if (!(ss >> type >> identifier >> frequency >> phase))
+		throw std::runtime_error("Could not read RF pulse \"" + params + "\"! Check config file for invalid parameters.");
+	auto field = identifiers.find(identifier);
+	if (field == identifiers.end())
+		throw std::runtime_error("RF pulse \"" + params + "\" refers to field " + identifier + ", which is not defined or was skipped!");
+	double omega = TFieldScaler(ResolveFormula(frequency, formulas)).scalingFactor(0);
+	if (not (omega != 0) or not std::isfinite(omega))
+		throw std::runtime_error("RF pulse \"" + params + "\" has invalid carrier frequency!");
+	if (rffrequency != 0 and omega != rffrequency)
+		throw std::runtime_error("RF pulse \"" + params + "\" has a different carrier frequency than other RF pulses, the rotating frame requires a common carrier!");
+	if (fields[field->second].GetRFFrequency() != 0)
+		throw std::runtime_error("Field " + identifier + " is declared as RF pulse twice!");
+	fields[field->second].DeclareRF(omega, phase*pi/180);
+	rffrequency = omega;
+	std::cout << "Field " << identifier << " is an RF pulse with carrier frequency " << omega << " rad/s and phase " << phase << " degree\n";
+}
+
+
+void TFieldManager::BakeFields(const std::string &params, const std::vector<std::string> &definitions, const std::vector<bool> &bakeable,
+								const std::map<std::string, std::string> &formulas, const boost::filesystem::path &cachedir, const unsigned nthreads){
+	std::array<double, 3> min, max;
+	double spacing;
+	std::istringstream ss(params);
+	if (!(ss >> max[0] >> min[0] >> max[1] >> min[1] >> max[2] >> min[2] >> spacing) or spacing <= 0 or min[0] >= max[0] or min[1] >= max[1] or min[2] >= max[2])
+		throw std::runtime_error("Could not read region and grid spacing of baked fields from bakefields option \"" + params + "\"!");
+
+	std::vector<unsigned> bakedfields;
+	std::string parameters = (boost::format("BAKE %1$.17g %2$.17g %3$.17g %4$.17g %5$.17g %6$.17g %7$.17g") % max[0] % min[0] % max[1] % min[1] % max[2] % min[2] % spacing).str();
+	for (unsigned i = 0; i < fields.size(); ++i){
+		if (bakeable[i] and fields[i].IsBFieldStatic()){
+			bakedfields.push_back(i);
+			parameters += "\n" + definitions[i];
+		}
+	}
+	if (bakedfields.empty()){
+		std::cout << "No static fields found that could be baked\n";
+		return;
+	}
+	for (const auto &formula: formulas) // formulas might be used by baked fields
+		parameters += "\n" + formula.first + " " + formula.second;
+
+	std::array<std::vector<double>, 3> grid;
+	for (int j = 0; j < 3; ++j){
+		unsigned long n = std::max(std::ceil((max[j] - min[j])/spacing), 1.) + 1;
+		for (unsigned long i = 0; i < n; ++i)
+			grid[j].push_back(i + 1 == n ? max[j] : min[j] + i*(max[j] - min[j])/(n - 1));
+	}
+
+	auto sample = [&]{
+		std::cout << "\nBaking " << bakedfields.size() << " static fields into " << grid[0].size() << " by " << grid[1].size() << " by " << grid[2].size() << " table\n";
+		unsigned long count = grid[0].size()*grid[1].size()*grid[2].size();
+		std::array<std::vector<double>, 3> xyz, B;
+		for (int j = 0; j < 3; ++j){
+			xyz[j].resize(count);
+			B[j].resize(count);
+		}
+		ParallelFor(grid[0].size(), nthreads, [&](const unsigned long begin, const unsigned long end){
+			for (unsigned long ix = begin; ix < end; ++ix){
+				for (unsigned long iy = 0; iy < grid[1].size(); ++iy){
+					for (unsigned long iz = 0; iz < grid[2].size(); ++iz){
+						unsigned long p = (ix*grid[1].size() + iy)*grid[2].size() + iz;
+						xyz[0][p] = grid[0][ix];
+						xyz[1][p] = grid[1][iy];
+						xyz[2][p] = grid[2][iz];
+						double Bsum[3] = {0, 0, 0};
+						for (unsigned f: bakedfields){
+							double Btmp[3] = {0, 0, 0};
+							fields[f].BField(grid[0][ix], grid[1][iy], grid[2][iz], 0, Btmp, nullptr);
+							for (int j = 0; j < 3; ++j)
+								Bsum[j] += Btmp[j];
+						}
+						for (int j = 0; j < 3; ++j)
+							B[j][p] = Bsum[j];
+					}
+				}
+			}
+		});
+		return std::unique_ptr<TabField3>(new TabField3(xyz, B, std::vector<double>(), false, nthreads));
+	};
+
+	std::shared_ptr<const TField> tab = SharedTable(parameters, [&]() -> std::unique_ptr<TField>{
+		if (cachedir.empty())
+			return sample();
+		std::uint64_t key = TableKey(parameters);
+		return GetCachedTable(cachedir / (boost::format("bakedfields.%1$016x.tricubic") % key).str(), key, sample);
+	});
+	fields.emplace_back(TFieldContainer(tab, "1", "0", max[0], min[0], max[1], min[1], max[2], min[2], 0.));
+	for (unsigned f: bakedfields)
+		baked[f] = true;
+	baked.push_back(false);
+	bakeregion = TFieldBoundaryBox(max[0], min[0], max[1], min[1], max[2], min[2], 0.);
+}
+
+
+void TFieldManager::BuildIndex(){
+	std::vector<std::array<double, 3> > mins(fields.size()), maxs(fields.size());
+	std::vector<bool> bounded(fields.size());
+	std::vector<unsigned> boundedfields;
+	for (unsigned i = 0; i < fields.size(); ++i){
+		bounded[i] = fields[i].GetBounds(mins[i], maxs[i]);
+		if (bounded[i])
+			boundedfields.push_back(i);
+		else
+			index.unboundedfields.push_back(i);
+	}
+	if (boundedfields.empty())
+		return;
+
+	index.min = mins[boundedfields.front()];
+	index.max = maxs[boundedfields.front()];
+	for (unsigned i: boundedfields){
+		for (int j = 0; j < 3; ++j){
+			index.min[j] = std::min(index.min[j], mins[i][j]);
+			index.max[j] = std::max(index.max[j], maxs[i][j]);
+		}
+	}
+	unsigned n = std::min(32., std::ceil(std::cbrt(64.*boundedfields.size()))); // a few voxels per field along each axis, but at most 32^3 voxels
+	for (int j = 0; j < 3; ++j){
+		index.n[j] = n;
+		index.size[j] = (index.max[j] - index.min[j])/n;
+	}
+
+	index.voxelfields.resize(n*n*n);
+	for (unsigned i = 0; i < fields.size(); ++i){
+		std::array<unsigned, 3> lo = {{0, 0, 0}}, hi = {{n - 1, n - 1, n - 1}};
+		if (bounded[i]){
+			for (int j = 0; j < 3; ++j){ // extend voxel range by one on each side, so rounding errors in FieldsAt can not miss a field
+				lo[j] = std::max(std::floor((mins[i][j] - index.min[j])/index.size[j]) - 1., 0.);
+				hi[j] = std::min(std::floor((maxs[i][j] - index.min[j])/index.size[j]) + 1., n - 1.);
+			}
+		}
+		for (unsigned ix = lo[0]; ix <= hi[0]; ++ix){
+			for (unsigned iy = lo[1]; iy <= hi[1]; ++iy){
+				for (unsigned iz = lo[2]; iz <= hi[2]; ++iz)
+					index.voxelfields[(ix*n + iy)*n + iz].push_back(i);
+			}
+		}
+	}
+}
+
+
+const std::vector<unsigned>& TFieldManager::FieldsAt(const double x, const double y, const double z) const{
+	if (index.voxelfields.empty() or not (x >= index.min[0] and x <= index.max[0] and y >= index.min[1] and y <= index.max[1] and z >= index.min[2] and z <= index.max[2]))
+		return index.unboundedfields;
+	std::array<unsigned, 3> i;
+	const double p[3] = {x, y, z};
+	for (int j = 0; j < 3; ++j)
+		i[j] = std::min(static_cast<unsigned>((p[j] - index.min[j])/index.size[j]), index.n[j] - 1);
+	return index.voxelfields[(i[0]*index.n[1] + i[1])*index.n[2] + i[2]];
+}
+
+
+TFieldManager::TFieldCacheEntry& TFieldManager::GetCacheEntry(const double x, const double y, const double z, const double t) const{
+	for (unsigned int i = 1; i <= cache.entries.size(); ++i){ // search most recent entries first
+		TFieldCacheEntry &entry = cache.entries[(cache.next + cache.entries.size() - i) % cache.entries.size()];
+		if (entry.serial == serial && entry.x == x && entry.y == y && entry.z == z && entry.t == t)
+			return entry;
+	}
+	TFieldCacheEntry &entry = cache.entries[cache.next];
+	cache.next = (cache.next + 1) % cache.entries.size();
+	entry.serial = serial;
+	entry.x = x;
+	entry.y = y;
+	entry.z = z;
+	entry.t = t;
+	entry.hasB = entry.hasdB = entry.hasE = false;
+	return entry;
+}
+
+
 void TFieldManager::BField(const double x, const double y, const double z, const double t, double B[3], double dBidxj[3][3]) const{
+	QueryTrace::RecordField(dBidxj != nullptr ? TQuery::BGRADIENT : TQuery::BFIELD, x, y, z, t);
+	TFieldCacheEntry &entry = GetCacheEntry(x, y, z, t);
+	if (!entry.hasB || (dBidxj != nullptr && !entry.hasdB)){ // evaluate fields if they are not cached yet
+		for (int i = 0; i < 3; i++){
+			entry.B[i] = 0;
+			for (int j = 0; j < 3; j++)
+				entry.dBidxj[i][j] = 0;
+		}
+
+		const bool inbakeregion = bakeregion.hasBounds() and bakeregion.inBounds(x, y, z);
+		for (unsigned f: FieldsAt(x, y, z)){ // only visit fields that might contain the point
+			if (inbakeregion and baked[f])
+				continue; // field is included in table of baked fields
+			PROFILE_FIELD(f);
+			const TFieldContainer &it = fields[f];
+			double Btmp[3] = {0,0,0};
+			double dBtmp[3][3] = {{0,0,0},{0,0,0},{0,0,0}};
+			if (dBidxj != nullptr)
+				it.BField(x, y, z, t, Btmp, dBtmp);
+			else
+				it.BField(x, y, z, t, Btmp, nullptr);
+
+			for (int i = 0; i < 3; i++){
+				entry.B[i] += Btmp[i];
+				for (int j = 0; j < 3; j++)
+					entry.dBidxj[i][j] += dBtmp[i][j];
+			}
+		}
+		entry.hasB = true;
+		entry.hasdB = dBidxj != nullptr;
+	}
+
 	for (int i = 0; i < 3; i++){
-		B[i] = 0;
+		B[i] = entry.B[i];
 		if (dBidxj != nullptr){
 			for (int j = 0; j < 3; j++)
-				dBidxj[i][j] = 0;
+				dBidxj[i][j] = entry.dBidxj[i][j];
 		}
 	}
+}
 
-    for (const auto &it: fields){
-		double Btmp[3] = {0,0,0};
-		double dBtmp[3][3] = {{0,0,0},{0,0,0},{0,0,0}};
-		if (dBidxj != nullptr)
-            it.BField(x, y, z, t, Btmp, dBtmp);
-		else
-            it.BField(x, y, z, t, Btmp, nullptr);
 
+void TFieldManager::EField(const double x, const double y, const double z, const double t,
+		double &V, double Ei[3]) const{
+	QueryTrace::RecordField(TQuery::EFIELD, x, y, z, t);
+	TFieldCacheEntry &entry = GetCacheEntry(x, y, z, t);
+	if (!entry.hasE){ // evaluate fields if they are not cached yet
+		entry.V = 0;
 		for (int i = 0; i < 3; i++){
-			B[i] += Btmp[i];
+			entry.Ei[i] = 0;
+		}
+		const bool inbakeregion = bakeregion.hasBounds() and bakeregion.inBounds(x, y, z);
+		for (unsigned f: FieldsAt(x, y, z)){ // only visit fields that might contain the point
+			if (inbakeregion and baked[f])
+				continue; // field is included in table of baked fields
+			PROFILE_FIELD(f);
+			double Vtmp = 0, Etmp[3] = {0,0,0};
+
+			fields[f].EField(x, y, z, t, Vtmp, Etmp);
+
+			entry.V += Vtmp;
+			for (int i = 0; i < 3; i++)
+				entry.Ei[i] += Etmp[i];
+		}
+		entry.hasE = true;
+	}
+
+	V = entry.V;
+	for (int i = 0; i < 3; i++)
+		Ei[i] = entry.Ei[i];
+}
+
+
+void TFieldManager::BField(const std::size_t n, const double *x, const double *y, const double *z, const double *t, double *const B[3], double *const dBidxj[3][3]) const{
+	std::vector< std::vector<std::size_t> > points(fields.size()); // points that each field has to be evaluated at
+	for (std::size_t k = 0; k < n; ++k){
+		QueryTrace::RecordField(dBidxj != nullptr ? TQuery::BGRADIENT : TQuery::BFIELD, x[k], y[k], z[k], t[k]);
+		for (int i = 0; i < 3; ++i){
+			B[i][k] = 0;
 			if (dBidxj != nullptr){
-				for (int j = 0; j < 3; j++)
-					dBidxj[i][j] += dBtmp[i][j];
+				for (int j = 0; j < 3; ++j)
+					dBidxj[i][j][k] = 0;
+			}
+		}
+		const bool inbakeregion = bakeregion.hasBounds() and bakeregion.inBounds(x[k], y[k], z[k]);
+		for (unsigned f: FieldsAt(x[k], y[k], z[k])){
+			if (not (inbakeregion and baked[f]))
+				points[f].push_back(k);
+		}
+	}
+
+	// evaluate each field for all its points at once, summing fields in the same order as the single-point version
+	std::vector<double> coords, F;
+	for (unsigned f = 0; f < fields.size(); ++f){
+		const std::size_t m = points[f].size();
+		if (m == 0)
+			continue;
+		PROFILE_FIELD(f);
+		coords.resize(4*m);
+		F.resize(12*m);
+		double *xf = &coords[0], *yf = xf + m, *zf = yf + m, *tf = zf + m;
+		for (std::size_t l = 0; l < m; ++l){
+			xf[l] = x[points[f][l]];
+			yf[l] = y[points[f][l]];
+			zf[l] = z[points[f][l]];
+			tf[l] = t[points[f][l]];
+		}
+		double *const Bf[3] = {&F[0], &F[m], &F[2*m]};
+		double *const dBf[3][3] = {{&F[3*m], &F[4*m], &F[5*m]}, {&F[6*m], &F[7*m], &F[8*m]}, {&F[9*m], &F[10*m], &F[11*m]}};
+		fields[f].BField(m, xf, yf, zf, tf, Bf, dBidxj != nullptr ? dBf : nullptr);
+		for (std::size_t l = 0; l < m; ++l){
+			const std::size_t k = points[f][l];
+			for (int i = 0; i < 3; ++i){
+				B[i][k] += Bf[i][l];
+				if (dBidxj != nullptr){
+					for (int j = 0; j < 3; ++j)
+						dBidxj[i][j][k] += dBf[i][j][l];
+				}
 			}
 		}
 	}
 }
 
+double TFieldManager::FieldFreeDistance(const double x, const double y, const double z) const{
+	double d = std::numeric_limits<double>::infinity();
+	for (const auto &it: fields){
+		d = std::min(d, it.BoundaryDistance(x, y, z));
+		if (d == 0)
+			break;
+	}
+	return d;
+}
 
-void TFieldManager::EField(const double x, const double y, const double z, const double t,
-		double &V, double Ei[3]) const{
-	V = 0;
-	for (int i = 0; i < 3; i++){
-		Ei[i] = 0;
+
+void TFieldManager::Prefetch(const double x1, const double y1, const double z1, const double x2, const double y2, const double z2) const{
+	const bool inbakeregion = bakeregion.hasBounds() and bakeregion.inBounds(x2, y2, z2);
+	for (unsigned f: FieldsAt(x2, y2, z2)){
+		if (not (inbakeregion and baked[f]))
+			fields[f].Prefetch(x1, y1, z1, x2, y2, z2);
 	}
-    for (const auto &it: fields){
-		double Vtmp = 0, Etmp[3] = {0,0,0};
+}
 
-        it.EField(x, y, z, t, Vtmp, Etmp);
 
-			V += Vtmp;
-			for (int i = 0; i < 3; i++)
-				Ei[i] += Etmp[i];
+void TFieldManager::BFieldRF(const double x, const double y, const double z, const double t, double B0[3], double B1c[3], double B1s[3]) const{
+	for (int i = 0; i < 3; ++i){
+		B0[i] = 0;
+		B1c[i] = 0;
+		B1s[i] = 0;
+	}
+	const bool inbakeregion = bakeregion.hasBounds() and bakeregion.inBounds(x, y, z);
+	for (unsigned f: FieldsAt(x, y, z)){
+		if (inbakeregion and baked[f])
+			continue;
+		PROFILE_FIELD(f);
+		const TFieldContainer &it = fields[f];
+		double Btmp[3] = {0, 0, 0};
+		if (it.GetRFFrequency() == 0){
+			it.BField(x, y, z, t, Btmp, nullptr);
+			for (int i = 0; i < 3; ++i)
+				B0[i] += Btmp[i];
 		}
+		else{ // A*cos(omega*t + phase) = A*cos(phase)*cos(omega*t) - A*sin(phase)*sin(omega*t)
+			it.RFAmplitude(x, y, z, t, Btmp);
+			double c = cos(it.GetRFPhase()), s = sin(it.GetRFPhase());
+			for (int i = 0; i < 3; ++i){
+				B1c[i] += Btmp[i]*c;
+				B1s[i] += Btmp[i]*s;
+			}
+		}
+	}
+}
+
+
+bool TFieldManager::IsBFieldStatic() const{
+	for (const auto &it: fields){
+		if (not it.IsBFieldStatic())
+			return false;
+	}
+	return true;
+}
+
+
+std::size_t TFieldManager::MemoryUsage() const{
+	std::set<const TField*> counted;
+	std::size_t bytes = fields.capacity()*sizeof(TFieldContainer);
+	for (const auto &it: fields){
+		if (counted.insert(&it.GetField()).second)
+			bytes += it.GetField().MemoryUsage();
+	}
+	for (const auto &voxel: index.voxelfields)
+		bytes += sizeof(voxel) + voxel.capacity()*sizeof(unsigned);
+	return bytes;
 }
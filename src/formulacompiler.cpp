@@ -0,0 +1,411 @@
+/**
+ * \file
+ * Compile formulas to native code.
+ */
+
+#include "formulacompiler.h"
+
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <algorithm>
+
+#include <dlfcn.h>
+
+#include <boost/format.hpp>
+
+#include "exprtk.hpp"
+
+static boost::filesystem::path nativedir; ///< Directory containing compiled formulas (empty: native compilation disabled)
+static std::mutex nativemutex; ///< Mutex protecting list of compiled formulas
+static std::map<std::string, TNativeFormula> nativeformulas; ///< Formulas that were already compiled (nullptr: formula could not be compiled)
+
+
+/**
+ * Recursive-descent parser translating a formula in exprtk syntax into an equivalent C++ expression.
+ *
+ * Binary operators are translated into fully parenthesized C++ expressions or calls of helper functions that mirror exprtk's implementation.
+ * Throws std::runtime_error if the formula contains syntax that is not supported.
+ */
+class TFormulaTranslator{
+private:
+	const std::string &formula; ///< Formula string
+	const std::vector<std::string> &variables; ///< Variables allowed in formula
+	std::size_t pos = 0; ///< Position of next character in formula
+	std::string token; ///< Current token (empty at end of formula)
+
+	/**
+	 * Read next token from formula
+	 */
+	void Next(){
+		while (pos < formula.size() and std::isspace(formula[pos]))
+			++pos;
+		token.clear();
+		if (pos >= formula.size())
+			return;
+		std::size_t start = pos;
+		char c = formula[pos];
+		if (std::isdigit(c) or (c == '.' and pos + 1 < formula.size() and std::isdigit(formula[pos + 1]))){
+			while (pos < formula.size() and (std::isdigit(formula[pos]) or formula[pos] == '.'))
+				++pos;
+			if (pos < formula.size() and (formula[pos] == 'e' or formula[pos] == 'E')){
+				std::size_t e = pos + 1;
+				if (e < formula.size() and (formula[e] == '+' or formula[e] == '-'))
+					++e;
+				if (e < formula.size() and std::isdigit(formula[e])){
+					pos = e;
+					while (pos < formula.size() and std::isdigit(formula[pos]))
+						++pos;
+				}
+			}
+		}
+		else if (std::isalpha(c) or c == '_'){
+			while (pos < formula.size() and (std::isalnum(formula[pos]) or formula[pos] == '_'))
+				++pos;
+		}
+		else{
+			++pos;
+			for (const char *op: {"<=", ">=", "==", "!=", "<>", "&&", "||", ":="}){
+				if (formula.compare(start, 2, op) == 0)
+					pos = start + 2;
+			}
+		}
+		token = formula.substr(start, pos - start);
+		if (std::isalpha(c) or c == '_')
+			std::transform(token.begin(), token.end(), token.begin(), ::tolower); // exprtk identifiers are case-insensitive
+	}
+
+	/**
+	 * Check that current token matches expected token and read next token
+	 *
+	 * @param expected Expected token
+	 */
+	void Expect(const std::string &expected){
+		if (token != expected)
+			throw std::runtime_error("expected '" + expected + "' instead of '" + token + "'");
+		Next();
+	}
+
+	/**
+	 * Translate ternary operator "condition ? a : b"
+	 */
+	std::string Ternary(){
+		std::string condition = Or();
+		if (token != "?")
+			return condition;
+		Next();
+		std::string a = Ternary();
+		Expect(":");
+		std::string b = Ternary();
+		return "(" + condition + " != 0 ? " + a + " : " + b + ")";
+	}
+
+	/**
+	 * Translate logical or
+	 */
+	std::string Or(){
+		std::string l = And();
+		while (token == "or" or token == "||"){
+			Next();
+			l = "f_or(" + l + ", " + And() + ")";
+		}
+		return l;
+	}
+
+	/**
+	 * Translate logical and
+	 */
+	std::string And(){
+		std::string l = Comparison();
+		while (token == "and" or token == "&&"){
+			Next();
+			l = "f_and(" + l + ", " + Comparison() + ")";
+		}
+		return l;
+	}
+
+	/**
+	 * Translate comparison operators
+	 */
+	std::string Comparison(){
+		std::string l = Additive();
+		std::string op = token;
+		if (op == "<" or op == "<=" or op == ">" or op == ">="){
+			Next();
+			return "(" + l + " " + op + " " + Additive() + " ? 1. : 0.)";
+		}
+		else if (op == "==" or op == "="){
+			Next();
+			return "f_equal(" + l + ", " + Additive() + ")";
+		}
+		else if (op == "!=" or op == "<>"){
+			Next();
+			return "(1. - f_equal(" + l + ", " + Additive() + "))";
+		}
+		return l;
+	}
+
+	/**
+	 * Translate addition and subtraction
+	 */
+	std::string Additive(){
+		std::string l = Multiplicative();
+		while (token == "+" or token == "-"){
+			std::string op = token;
+			Next();
+			l = "(" + l + " " + op + " " + Multiplicative() + ")";
+		}
+		return l;
+	}
+
+	/**
+	 * Translate multiplication, division, and modulus
+	 */
+	std::string Multiplicative(){
+		std::string l = Unary();
+		while (token == "*" or token == "/" or token == "%"){
+			std::string op = token;
+			Next();
+			if (op == "%")
+				l = "std::fmod(" + l + ", " + Unary() + ")";
+			else
+				l = "(" + l + " " + op + " " + Unary() + ")";
+		}
+		return l;
+	}
+
+	/**
+	 * Translate unary plus and minus, and power operator
+	 */
+	std::string Unary(){
+		if (token == "-"){
+			Next();
+			return "(-" + Unary() + ")";
+		}
+		else if (token == "+"){
+			Next();
+			return Unary();
+		}
+		std::string base = Primary();
+		if (token == "^"){
+			Next();
+			return "std::pow(" + base + ", " + Unary() + ")";
+		}
+		return base;
+	}
+
+	/**
+	 * Translate numbers, variables, constants, function calls, and parenthesized expressions
+	 */
+	std::string Primary(){
+		std::string t = token;
+		if (t.empty())
+			throw std::runtime_error("unexpected end of formula");
+		else if (std::isdigit(t[0]) or t[0] == '.'){
+			Next();
+			return t.find_first_of(".eE") == std::string::npos ? t + "." : t; // make sure integers are translated to floating-point numbers
+		}
+		else if (t == "("){
+			Next();
+			std::string e = Ternary();
+			Expect(")");
+			return e;
+		}
+		else if (not (std::isalpha(t[0]) or t[0] == '_'))
+			throw std::runtime_error("unsupported operator '" + t + "'");
+
+		Next();
+		if (std::find(variables.begin(), variables.end(), t) != variables.end())
+			return t;
+		else if (t == "pi")
+			return (boost::format("%1$.17g") % exprtk::details::numeric::constant::pi).str();
+		else if (t == "epsilon")
+			return "EPSILON";
+		else if (t == "inf")
+			return "HUGE_VAL";
+		else if (t == "true")
+			return "1.";
+		else if (t == "false")
+			return "0.";
+
+		std::vector<std::string> args;
+		Expect("(");
+		while (true){
+			args.push_back(Ternary());
+			if (token == ")")
+				break;
+			Expect(",");
+		}
+		Next();
+		static const std::vector<std::string> unary = {"sin", "cos", "tan", "asin", "acos", "atan", "sinh", "cosh", "tanh", "exp", "log", "log10", "sqrt", "floor", "ceil"};
+		if (args.size() == 1 and std::find(unary.begin(), unary.end(), t) != unary.end())
+			return "std::" + t + "(" + args[0] + ")";
+		else if (args.size() == 1 and (t == "abs" or t == "sgn" or t == "round" or t == "trunc"))
+			return "f_" + t + "(" + args[0] + ")";
+		else if (args.size() == 1 and t == "not")
+			return "(" + args[0] + " == 0 ? 1. : 0.)";
+		else if (args.size() == 2 and (t == "atan2" or t == "pow"))
+			return "std::" + t + "(" + args[0] + ", " + args[1] + ")";
+		else if (args.size() == 2 and t == "hypot")
+			return "f_hypot(" + args[0] + ", " + args[1] + ")";
+		else if (args.size() >= 2 and (t == "min" or t == "max")){
+			std::string e = args.back();
+			for (auto arg = args.rbegin() + 1; arg != args.rend(); ++arg)
+				e = "std::" + t + "<double>(" + *arg + ", " + e + ")";
+			return e;
+		}
+		else if (args.size() == 3 and t == "if")
+			return "(" + args[0] + " != 0 ? " + args[1] + " : " + args[2] + ")";
+		throw std::runtime_error((boost::format("unsupported function '%1%' with %2% arguments") % t % args.size()).str());
+	}
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param _formula Formula string
+	 * @param _variables Variables allowed in formula
+	 */
+	TFormulaTranslator(const std::string &_formula, const std::vector<std::string> &_variables): formula(_formula), variables(_variables){}
+
+	/**
+	 * Translate formula
+	 *
+	 * @return Returns C++ expression
+	 */
+	std::string Translate(){
+		Next();
+		std::string e = Ternary();
+		if (not token.empty())
+			throw std::runtime_error("unexpected '" + token + "'");
+		return e;
+	}
+};
+
+
+/**
+ * Generate C++ source of a shared library containing a single function "formula"
+ *
+ * @param expression C++ expression
+ *
+ * @return Returns source code
+ */
+static std::string FormulaSource(const std::string &expression){
+	return (boost::format(
+		"#include <cmath>\n"
+		"#include <algorithm>\n"
+		"static const double EPSILON = %1$.17g;\n"
+		"static inline double f_abs(const double v){ return v < 0 ? -v : v; }\n"
+		"static inline double f_sgn(const double v){ return v > 0 ? 1. : (v < 0 ? -1. : 0.); }\n"
+		"static inline double f_round(const double v){ return v < 0 ? std::ceil(v - 0.5) : std::floor(v + 0.5); }\n"
+		"static inline double f_trunc(const double v){ return static_cast<double>(static_cast<long long>(v)); }\n"
+		"static inline double f_hypot(const double a, const double b){ return std::sqrt(a*a + b*b); }\n"
+		"static inline double f_and(const double a, const double b){ return a != 0 and b != 0 ? 1. : 0.; }\n"
+		"static inline double f_or(const double a, const double b){ return a != 0 or b != 0 ? 1. : 0.; }\n"
+		"static inline double f_equal(const double a, const double b){ return f_abs(a - b) <= std::max(1., std::max(f_abs(a), f_abs(b)))*EPSILON ? 1. : 0.; }\n"
+		"extern \"C\" double formula(const double t, const double x, const double y, const double z){\n"
+		"\treturn %2%;\n"
+		"}\n") % exprtk::details::numeric::details::epsilon_type<double>::value() % expression).str();
+}
+
+
+/**
+ * Check that compiled formula returns the same values as the exprtk interpreter
+ *
+ * @param formula Formula string
+ * @param variables Variables allowed in formula
+ * @param native Compiled formula
+ *
+ * @return Returns true if values agree at all sample points
+ */
+static bool CheckNativeFormula(const std::string &formula, const std::vector<std::string> &variables, const TNativeFormula native){
+	double t, x, y, z;
+	exprtk::symbol_table<double> symbol_table;
+	for (const std::string &var: variables){
+		symbol_table.add_variable(var, var == "t" ? t : (var == "x" ? x : (var == "y" ? y : z)));
+	}
+	symbol_table.add_constants();
+	exprtk::expression<double> expression;
+	expression.register_symbol_table(symbol_table);
+	exprtk::parser<double> parser;
+	if (not parser.compile(formula, expression))
+		return false;
+	for (int i = 0; i <= 16; ++i){
+		t = i == 16 ? 0. : 0.37*i - 2.1;
+		x = i == 16 ? 0. : 0.11*i - 0.8;
+		y = i == 16 ? 0. : 0.8 - 0.07*i;
+		z = i == 16 ? 0. : 0.05*i - 0.3;
+		double expected = expression.value();
+		double value = native(t, x, y, z);
+		if (not (value == expected or (std::isnan(value) and std::isnan(expected)) or std::abs(value - expected) <= 1e-12*std::max(std::abs(value), std::abs(expected))))
+			return false;
+	}
+	return true;
+}
+
+
+void EnableNativeFormulas(const boost::filesystem::path &dir){
+	std::lock_guard<std::mutex> lock(nativemutex);
+	if (not dir.empty())
+		boost::filesystem::create_directories(dir);
+	nativedir = dir;
+}
+
+
+TNativeFormula CompileNativeFormula(const std::string &formula, const std::vector<std::string> &variables){
+	std::lock_guard<std::mutex> lock(nativemutex);
+	if (nativedir.empty())
+		return nullptr;
+	std::string id = formula;
+	for (const std::string &var: variables)
+		id += "\n" + var;
+	auto found = nativeformulas.find(id);
+	if (found != nativeformulas.end())
+		return found->second;
+
+	TNativeFormula &native = nativeformulas[id];
+	native = nullptr;
+	try{
+		std::string source = FormulaSource(TFormulaTranslator(formula, variables).Translate());
+		const char *cxx = std::getenv("CXX");
+		std::string compiler = cxx == nullptr ? "c++" : cxx;
+
+		std::uint64_t hash = 14695981039346656037ULL; // FNV-1a hash of compiler and source identifying the compiled library
+		for (char c: compiler + "\n" + source){
+			hash ^= static_cast<unsigned char>(c);
+			hash *= 1099511628211ULL;
+		}
+		boost::filesystem::path library = nativedir / (boost::format("formula.%1$016x.so") % hash).str();
+		if (not boost::filesystem::exists(library)){
+			boost::filesystem::path tmp = nativedir / boost::filesystem::unique_path("formula-%%%%-%%%%-%%%%");
+			std::ofstream(tmp.string() + ".cpp") << source;
+			std::string command = compiler + " -O2 -shared -fPIC -o \"" + tmp.string() + ".so\" \"" + tmp.string() + ".cpp\" > /dev/null 2>&1";
+			int result = std::system(command.c_str());
+			boost::filesystem::remove(tmp.string() + ".cpp");
+			if (result != 0){
+				boost::filesystem::remove(tmp.string() + ".so");
+				throw std::runtime_error("compiler " + compiler + " failed");
+			}
+			boost::filesystem::rename(tmp.string() + ".so", library); // rename is atomic, so simultaneous jobs never load incomplete libraries
+		}
+
+		void *handle = dlopen(library.c_str(), RTLD_NOW | RTLD_LOCAL); // library stays loaded until program ends
+		if (handle == nullptr)
+			throw std::runtime_error(dlerror());
+		TNativeFormula f = reinterpret_cast<TNativeFormula>(dlsym(handle, "formula"));
+		if (f == nullptr)
+			throw std::runtime_error(dlerror());
+		if (not CheckNativeFormula(formula, variables, f))
+			throw std::runtime_error("compiled formula does not agree with interpreter");
+		native = f;
+	}
+	catch (std::exception &e){
+		std::cout << "Formula '" << formula << "' is interpreted, it could not be compiled to native code (" << e.what() << ")\n";
+	}
+	return native;
+}
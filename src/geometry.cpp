@@ -2,8 +2,11 @@
 
 #include <iostream>
 #include <algorithm>
+#include <cmath>
 
 #include "globals.h"
+#include "profiler.h"
+#include "querytrace.h"
 
 using namespace std;
 
@@ -78,6 +81,7 @@ std::istream& operator>>(std::istream &str, solid &model){
 			throw std::runtime_error((boost::format("Invalid ignoretimes for solid %d") % model.ID).str());
 		}
 	}
+	model.MergeIgnoretimes();
 	return str;
 }
 
@@ -90,6 +94,122 @@ std::ostream& operator<<(std::ostream &str, const solid &sld){
 	return str;
 }
 
+/**
+ * Read materials from MATERIALS section of config
+ *
+ * @param config TConfig struct containing MATERIALS section
+ *
+ * @return Returns list of materials
+ */
+static vector<material> ReadMaterials(TConfig &config){
+	vector<material> materials;
+	std::transform(config["MATERIALS"].begin(), config["MATERIALS"].end(), back_inserter(materials),
+					[](const std::pair<std::string, std::string> &i){
+						material mat;
+						mat.name = i.first;
+						istringstream(i.second) >> mat;
+						return mat;
+					}
+	); // Read materials from config and add them to list
+	return materials;
+}
+
+/**
+ * Read alternative materials from WEIGHTS section of config
+ *
+ * Each entry has the form "name material FermiImag DiffProb LossPerBounce [material FermiImag DiffProb LossPerBounce ...]"
+ * and replaces these properties of the listed materials, all other materials keep their nominal properties.
+ *
+ * @param config TConfig struct, may not contain a WEIGHTS section
+ * @param materials List of nominal materials
+ *
+ * @return Returns list of materials for each entry
+ */
+static vector<vector<material> > ReadWeightMaterials(TConfig &config, const vector<material> &materials){
+	vector<vector<material> > weightmaterials;
+	for (auto &section: config){
+		if (section.first != "WEIGHTS")
+			continue;
+		for (auto &entry: section.second){
+			vector<material> alternative = materials;
+			istringstream str(entry.second);
+			string name;
+			while (str >> name){
+				auto mat = std::find_if(alternative.begin(), alternative.end(), [&name](const material &m){ return name == m.name; });
+				if (mat == alternative.end())
+					throw std::runtime_error((boost::format("Material %s used in weight %s but not defined!") % name % entry.first).str());
+				double FermiImag, DiffProb, LossPerBounce;
+				if (!(str >> FermiImag >> DiffProb >> LossPerBounce))
+					throw std::runtime_error((boost::format("Could not read material %s of weight %s!") % name % entry.first).str());
+				if (LossPerBounce < 0 or LossPerBounce > 1)
+					throw std::range_error("You set a loss-per-bounce probability outside range 0..1 for material " + name + " of weight " + entry.first + "!");
+				if (DiffProb != mat->DiffProb and (mat->DiffProb <= 0 or mat->DiffProb >= 1 or DiffProb <= 0 or DiffProb > 1)) // Lambert and specular reflections have to be possible in nominal and alternative material
+					throw std::range_error("Diffuse-reflection probability of material " + name + " can only be reweighted from a value between 0 and 1 to a value larger than 0 (weight " + entry.first + ")!");
+				mat->FermiImag = FermiImag;
+				mat->DiffProb = DiffProb;
+				mat->LossPerBounce = LossPerBounce;
+			}
+			weightmaterials.push_back(alternative);
+		}
+	}
+	return weightmaterials;
+}
+
+TMaterialInterface::TMaterialInterface(const material &aleaving, const material &aentering){
+	auto side = [](const material &mat){
+		double MRmaxenergy = 0;
+		if (mat.RMSRoughness != 0 && mat.CorrelLength != 0) // wave number sqrt(2*m_n*E)*ele_e/hbar has to be smaller than 1/RMSRoughness, see MR::MRValid
+			MRmaxenergy = hbar*hbar/(2*m_n*ele_e*ele_e*mat.RMSRoughness*mat.RMSRoughness);
+		return TSide{mat.FermiImag*1e-9, mat.DiffProb + mat.ModifiedLambertProb, mat.SpinflipProb, mat.LossPerBounce, MRmaxenergy};
+	};
+	leaving = side(aleaving);
+	entering = side(aentering);
+	potentialstep = (aentering.FermiReal - aleaving.FermiReal)*1e-9;
+	fieldstep = aentering.InternalBField - aleaving.InternalBField;
+}
+
+/**
+ * Calculate interfaces between each pair of materials
+ *
+ * @param materials List of materials
+ *
+ * @return Returns interfaces between each material and all materials, in the order of the list
+ */
+static vector<shared_ptr<const vector<TMaterialInterface> > > BuildInterfaces(const vector<material> &materials){
+	vector<shared_ptr<const vector<TMaterialInterface> > > interfaces;
+	for (const material &leaving: materials){
+		vector<TMaterialInterface> row;
+		for (const material &entering: materials)
+			row.emplace_back(leaving, entering);
+		interfaces.push_back(make_shared<const vector<TMaterialInterface> >(row));
+	}
+	return interfaces;
+}
+
+/**
+ * Replace material of solid by material with the same name from list
+ *
+ * @param sld Solid, its material name is looked up in the list
+ * @param materials List of materials
+ * @param interfaces Interfaces between each material and all materials, see BuildInterfaces
+ * @param weightmaterials Lists of alternative materials for weighted tracking, see ReadWeightMaterials
+ */
+static void AssignMaterial(solid &sld, const vector<material> &materials, const vector<shared_ptr<const vector<TMaterialInterface> > > &interfaces,
+		const vector<vector<material> > &weightmaterials){
+	auto findmaterial = [&sld](const vector<material> &list){
+		auto mat = std::find_if(list.begin(), list.end(), [&sld](const material &m){ return sld.mat.name == m.name; });
+		if (mat == list.end())
+			throw std::runtime_error((boost::format("Material %s used but not defined!") % sld.mat.name).str());
+		return mat - list.begin();
+	};
+	sld.matindex = findmaterial(materials);
+	sld.mat = materials[sld.matindex];
+	sld.interfaces = interfaces[sld.matindex];
+	sld.weightmats.clear();
+	for (auto &alternative: weightmaterials)
+		sld.weightmats.push_back(alternative[findmaterial(alternative)]);
+}
+
 TGeometry::TGeometry(TConfig &geometryin){
 	boost::filesystem::path matpath;
 	istringstream(geometryin["GLOBAL"]["materials_file"]) >> matpath; // check if there is a materials file linked in the config file
@@ -102,74 +222,434 @@ TGeometry::TGeometry(TConfig &geometryin){
 		geometryin.ReadFromFile(matpath.native());
 	}
 
-	vector<material> materials;
-	std::transform(geometryin["MATERIALS"].begin(), geometryin["MATERIALS"].end(), back_inserter(materials),
-					[](const std::pair<std::string, std::string> &i){
-						material mat;
-						mat.name = i.first;
-						istringstream(i.second) >> mat;
-						return mat;
-					}
-	); // Read materials from config and add them to list
+	vector<material> materials = ReadMaterials(geometryin);
+	vector<shared_ptr<const vector<TMaterialInterface> > > interfaces = BuildInterfaces(materials);
+	vector<vector<material> > weightmaterials = ReadWeightMaterials(geometryin, materials);
+
+	boost::filesystem::path cachedir; // validated meshes are cached in the same directory as field interpolation coefficients
+	istringstream(geometryin["GLOBAL"]["fieldcache"]) >> cachedir;
+	if (not cachedir.empty()){
+		cachedir = boost::filesystem::absolute(cachedir, configpath.parent_path());
+		boost::filesystem::create_directories(cachedir);
+	}
+	int nthreads = 1; // solids are loaded with as many threads as are used for tracking
+	istringstream(geometryin["GLOBAL"]["nthreads"]) >> nthreads;
+	unsigned voxelresolution = 64;
+	istringstream(geometryin["GLOBAL"]["voxelresolution"]) >> voxelresolution;
+	int simtype = 0;
+	double simtime = -1;
+	istringstream(geometryin["GLOBAL"]["simtype"]) >> simtype;
+	if (simtype == PARTICLE || simtype == REPLAY) // solids ignored during the whole simulation never affect particles, other simulation types show all solids
+		istringstream(geometryin["GLOBAL"]["simtime"]) >> simtime;
 
+	map<unsigned, vector<CTransformation> > instances = ReadInstances(geometryin);
+	vector<pair<string, int> > files;
+	vector<vector<CTransformation> > fileinstances; // transformations of the instances of each STL file
+	vector<size_t> stlsolids; // index in solids of each solid loaded from an STL file
+	mesh = make_shared<TTriangleMesh>();
 	for (auto sldparams : geometryin["GEOMETRY"]){
 		solid sld;
 		istringstream(sldparams.first) >> sld.ID;
 		istringstream(sldparams.second) >> sld;
-
-		auto mat = std::find_if(materials.begin(), materials.end(), [&sld](const material &m){ return sld.mat.name == m.name; });
-		if (mat == materials.end())
-			throw std::runtime_error((boost::format("Material %s used but not defined!") % sld.mat.name).str());
-		sld.mat = *mat;
+		AssignMaterial(sld, materials, interfaces, weightmaterials);
 
 		if (sld.ID == 1){
 			sld.name = "default solid";
 			defaultsolid = sld;
 		}
+		else if (TPrimitive::IsPrimitive(sld.filename.string())){
+			sld.name = sld.filename.string();
+			primitives.push_back(make_pair(sld.ID, TPrimitive::Parse(sld.filename.string())));
+			solids.push_back(sld);
+		}
+		else if (simtime >= 0 && sld.is_ignored(0, simtime)){
+			cout << "Solid " << sld.ID << " is ignored during the whole simulation, skipping " << sld.filename << "\n";
+			instances.erase(sld.ID);
+			sld.name = sld.filename.string();
+			solids.push_back(sld);
+		}
 		else{
-			sld.name = mesh.ReadFile(boost::filesystem::absolute(sld.filename, configpath.parent_path()).native(), sld.ID);
+			files.push_back(make_pair(boost::filesystem::absolute(sld.filename, configpath.parent_path()).native(), sld.ID));
+			fileinstances.push_back(instances[sld.ID]);
+			instances.erase(sld.ID);
+			stlsolids.push_back(solids.size());
 			solids.push_back(sld);
 		}
 	}
+	for (auto &i: instances){
+		if (not i.second.empty())
+			throw std::runtime_error((boost::format("You defined instances of solid %1%, which is not loaded from an STL file!") % i.first).str());
+	}
+	vector<string> names = mesh->ReadFiles(files, cachedir, max(nthreads, 1), voxelresolution, fileinstances);
+	for (unsigned i = 0; i < names.size(); ++i)
+		solids[stlsolids[i]].name = names[i];
+
+	if (defaultsolid.name.empty())
+		throw std::runtime_error("You did not define the default solid with ID 1!");
+	solids.push_back(defaultsolid);
+	for (unsigned i = 0; i < solids.size(); ++i){
+		if (solids[i].ID >= solidindex.size())
+			solidindex.resize(solids[i].ID + 1, -1);
+		if (solidindex[solids[i].ID] >= 0) // check if IDs of each solid are unique
+			throw std::runtime_error("You defined solids with identical ID! IDs have to be unique!");
+		solidindex[solids[i].ID] = i;
+		ignoretimes |= not solids[i].ignoretimes.empty();
+	}
+	ReadImportances(geometryin);
+	ReadPhaseSpaceSolids(geometryin);
+	ReadTransfers(geometryin);
+	ReadSurfaces(geometryin, materials, interfaces, weightmaterials);
+	ReadPeriodicCell(geometryin);
+
+	bool mergesolids = false;
+	istringstream(geometryin["GLOBAL"]["mergesolids"]) >> mergesolids;
+	if (mergesolids)
+		mesh->BuildGlobalTree();
+
+	std::string collisionsearch = "CGAL";
+	istringstream(geometryin["GLOBAL"]["collisionsearch"]) >> collisionsearch;
+	if (collisionsearch == "BVH")
+		mesh->BuildBVH();
+	else if (collisionsearch != "CGAL")
+		throw std::runtime_error("Unknown collisionsearch " + collisionsearch + "! Use CGAL or BVH.");
+
+	istringstream(geometryin["GLOBAL"]["collisioncache"]) >> collisioncache;
+
+	boundingboxes = mesh->GetMeshBoundingBoxes();
+	for (auto &prim: primitives)
+		boundingboxes.push_back(prim.second->BoundingBox());
+	for (const CGAL::Bbox_3 &b: boundingboxes)
+		boundingbox += b;
+}
+
+TGeometry::TGeometry(const TGeometry &geometry, TConfig &materialsin): TGeometry(geometry){
+	vector<material> materials = ReadMaterials(materialsin);
+	vector<shared_ptr<const vector<TMaterialInterface> > > interfaces = BuildInterfaces(materials);
+	vector<vector<material> > weightmaterials = ReadWeightMaterials(materialsin, materials);
+	for (solid &sld: solids)
+		AssignMaterial(sld, materials, interfaces, weightmaterials);
+	AssignMaterial(defaultsolid, materials, interfaces, weightmaterials);
+	ReadImportances(materialsin);
+	ReadPhaseSpaceSolids(materialsin);
+	ReadSurfaces(materialsin, materials, interfaces, weightmaterials);
+}
+
+std::map<unsigned, std::vector<CTransformation> > TGeometry::ReadInstances(TConfig &config){
+	map<unsigned, vector<CTransformation> > instances;
+	for (auto &section: config){
+		if (section.first != "INSTANCES")
+			continue;
+		for (auto &entry: section.second){
+			unsigned ID;
+			if (!(istringstream(entry.first) >> ID))
+				throw std::runtime_error("You defined instances for invalid solid ID " + entry.first + "!");
+			istringstream ss(entry.second);
+			double x, y, z, ax, ay, az, angle;
+			while (ss >> x){
+				if (!(ss >> y >> z >> ax >> ay >> az >> angle))
+					throw std::runtime_error("Could not read instances of solid " + entry.first + ", each instance needs a translation x y z and a rotation axis ax ay az and angle!");
+				double norm = sqrt(ax*ax + ay*ay + az*az);
+				if (norm == 0){ // no rotation
+					ax = 0;
+					ay = 0;
+					az = 1;
+					angle = 0;
+				}
+				else{
+					ax /= norm;
+					ay /= norm;
+					az /= norm;
+				}
+				double c = cos(angle*pi/180), s = sin(angle*pi/180), t = 1 - c;
+				// rotation about axis through origin (Rodrigues' formula), followed by translation
+				instances[ID].push_back(CTransformation(t*ax*ax + c, t*ax*ay - s*az, t*ax*az + s*ay, x,
+														t*ax*ay + s*az, t*ay*ay + c, t*ay*az - s*ax, y,
+														t*ax*az - s*ay, t*ay*az + s*ax, t*az*az + c, z));
+			}
+		}
+	}
+	return instances;
+}
+
+void TGeometry::ReadImportances(TConfig &config){
+	for (solid &sld: solids)
+		sld.importance = 1;
+	for (auto &section: config){
+		if (section.first != "IMPORTANCE")
+			continue;
+		for (auto &entry: section.second){
+			unsigned ID;
+			double importance;
+			if (!(istringstream(entry.first) >> ID) || ID >= solidindex.size() || solidindex[ID] < 0)
+				throw std::runtime_error("You defined an importance for solid " + entry.first + ", which does not exist!");
+			if (!(istringstream(entry.second) >> importance) || importance <= 0)
+				throw std::range_error("Importance of solid " + entry.first + " has to be larger than zero!");
+			solids[solidindex[ID]].importance = importance;
+		}
+	}
+	defaultsolid.importance = solids[solidindex[defaultsolid.ID]].importance;
+}
+
+void TGeometry::ReadPhaseSpaceSolids(TConfig &config){
+	for (solid &sld: solids)
+		sld.record = sld.stoprecorded = false;
+	for (auto &section: config){
+		if (section.first != "PHASESPACE")
+			continue;
+		for (auto &entry: section.second){
+			unsigned ID;
+			bool stop = false;
+			if (!(istringstream(entry.first) >> ID) || ID >= solidindex.size() || solidindex[ID] < 0)
+				throw std::runtime_error("You defined a phase-space surface for solid " + entry.first + ", which does not exist!");
+			istringstream(entry.second) >> stop;
+			solids[solidindex[ID]].record = true;
+			solids[solidindex[ID]].stoprecorded = stop;
+		}
+	}
+	defaultsolid.record = solids[solidindex[defaultsolid.ID]].record;
+	defaultsolid.stoprecorded = solids[solidindex[defaultsolid.ID]].stoprecorded;
+}
+
+void TGeometry::ReadTransfers(TConfig &config){
+	for (auto &section: config){
+		if (section.first != "TRANSFER")
+			continue;
+		for (auto &entry: section.second){
+			unsigned ID, exitID;
+			istringstream ss(entry.second);
+			if (!(istringstream(entry.first) >> ID) || ID >= solidindex.size() || solidindex[ID] < 0)
+				throw std::runtime_error("You defined a guide section starting at solid " + entry.first + ", which does not exist!");
+			if (!(ss >> exitID) || exitID >= solidindex.size() || solidindex[exitID] < 0 || exitID == ID)
+				throw std::runtime_error("Guide section starting at solid " + entry.first + " needs the ID of a different existing solid at its exit!");
+			solid &sld = solids[solidindex[ID]];
+			sld.transferexit = exitID;
+			unsigned nspeed, nangle;
+			std::array<double, 3> axis;
+			if (ss >> nspeed){
+				if (!(ss >> nangle >> axis[0] >> axis[1] >> axis[2]))
+					throw std::runtime_error("Guide section starting at solid " + entry.first + " needs numbers of speed and angle bins, and guide axis!");
+				vector<string> files;
+				boost::filesystem::path filename;
+				while (ss >> filename)
+					files.push_back(boost::filesystem::absolute(filename, configpath.parent_path()).native());
+				if (files.empty())
+					throw std::runtime_error("You did not give transfer files for the guide section starting at solid " + entry.first + "!");
+				sld.transfer = make_shared<const TTransferTable>(files, axis, nspeed, nangle);
+			}
+		}
+	}
+	defaultsolid.transferexit = solids[solidindex[defaultsolid.ID]].transferexit;
+	defaultsolid.transfer = solids[solidindex[defaultsolid.ID]].transfer;
+}
+
+void TGeometry::ReadPeriodicCell(TConfig &config){
+	cellorigin = {{0, 0, 0}};
+	for (auto &section: config){
+		if (section.first != "PERIODIC")
+			continue;
+		map<string, array<double, 3> > vectors;
+		for (auto &entry: section.second){
+			array<double, 3> v;
+			if (entry.first != "origin" && entry.first != "a1" && entry.first != "a2" && entry.first != "a3")
+				throw std::runtime_error("Unknown option " + entry.first + " in PERIODIC section! Use origin, a1, a2, and a3.");
+			if (!(istringstream(entry.second) >> v[0] >> v[1] >> v[2]))
+				throw std::runtime_error("Could not read vector " + entry.first + " in PERIODIC section!");
+			if (entry.first == "origin")
+				cellorigin = v;
+			else
+				vectors[entry.first] = v;
+		}
+		for (auto &v: vectors) // ordered a1, a2, a3
+			latticevectors.push_back(v.second);
+	}
+	const size_t n = latticevectors.size();
+	if (n == 0)
+		return;
+
+	// dual vectors are the rows of G^-1 A, with the lattice vectors as rows of A and their Gram matrix G = A A^T
+	vector<vector<double> > G(n, vector<double>(n));
+	dualvectors = latticevectors;
+	double scale = 0;
+	for (size_t i = 0; i < n; ++i){
+		for (size_t j = 0; j < n; ++j)
+			G[i][j] = latticevectors[i][0]*latticevectors[j][0] + latticevectors[i][1]*latticevectors[j][1] + latticevectors[i][2]*latticevectors[j][2];
+		scale = max(scale, G[i][i]);
+	}
+	for (size_t i = 0; i < n; ++i){ // Gauss-Jordan elimination with partial pivoting
+		size_t pivot = i;
+		for (size_t j = i + 1; j < n; ++j){
+			if (abs(G[j][i]) > abs(G[pivot][i]))
+				pivot = j;
+		}
+		if (abs(G[pivot][i]) <= 1e-12*scale)
+			throw std::runtime_error("The lattice vectors in the PERIODIC section are linearly dependent!");
+		swap(G[i], G[pivot]);
+		swap(dualvectors[i], dualvectors[pivot]);
+		for (size_t j = 0; j < n; ++j){
+			if (j == i)
+				continue;
+			double f = G[j][i]/G[i][i];
+			for (size_t k = 0; k < n; ++k)
+				G[j][k] -= f*G[i][k];
+			for (int k = 0; k < 3; ++k)
+				dualvectors[j][k] -= f*dualvectors[i][k];
+		}
+	}
+	for (size_t i = 0; i < n; ++i){
+		for (int k = 0; k < 3; ++k)
+			dualvectors[i][k] /= G[i][i];
+	}
+}
+
+void TGeometry::ReadSurfaces(TConfig &config, const std::vector<material> &materials, const std::vector<std::shared_ptr<const std::vector<TMaterialInterface> > > &interfaces,
+		const std::vector<std::vector<material> > &weightmaterials){
+	for (solid &sld: solids)
+		sld.surfaces.clear();
+	for (auto &section: config){
+		if (section.first != "SURFACES")
+			continue;
+		for (auto &entry: section.second){
+			unsigned ID;
+			if (!(istringstream(entry.first) >> ID) || ID >= solidindex.size() || solidindex[ID] < 0)
+				throw std::runtime_error("You defined surfaces for solid " + entry.first + ", which does not exist!");
+			solid &sld = solids[solidindex[ID]];
+			istringstream ss(entry.second);
+			unsigned tag;
+			string matname;
+			while (ss >> tag){
+				if (!(ss >> matname) || tag == 0 || tag > 0xFFFF)
+					throw std::runtime_error("Invalid surface tag or material for solid " + entry.first + ", tags have to be between 1 and 65535!");
+				solid surface = sld;
+				surface.surfaces.clear();
+				surface.mat.name = matname;
+				AssignMaterial(surface, materials, interfaces, weightmaterials);
+				sld.surfaces.push_back(make_pair(tag, make_shared<const solid>(surface)));
+			}
+		}
+	}
+	defaultsolid.surfaces = solids[solidindex[defaultsolid.ID]].surfaces;
+}
 
-	if (std::unique(solids.begin(), solids.end(), [](const solid s1, const solid s2){ return s1.ID == s2.ID; }) != solids.end()) // check if IDs of each solid are unique
-		throw std::runtime_error("You defined solids with identical ID! IDs have to be unique!");
+std::vector<std::string> TGeometry::ReadWeightNames(TConfig &config){
+	vector<string> names;
+	for (auto &section: config){
+		if (section.first == "WEIGHTS"){
+			for (auto &entry: section.second)
+				names.push_back(entry.first);
+		}
+	}
+	return names;
 }
 
-bool TGeometry::GetCollisions(const double x1, const double p1[3], const double x2, const double p2[3], multimap<TCollision, bool> &colls) const{
-	vector<TCollision> c = mesh.Collision(std::vector<double>{p1[0], p1[1], p1[2]}, std::vector<double>{p2[0], p2[1], p2[2]});
-	colls.clear();
-	for (auto it: c){
-		solid sld = GetSolid(it.ID);
-		double t = x1 + (x2 - x1)*it.s;
-		colls.emplace(it, sld.is_ignored(t));
+bool TGeometry::GetCollisions(const double x1, const double p1[3], const double x2, const double p2[3], vector<TCollision> &colls) const{
+	PROFILE(PROFILE_GETCOLLISIONS);
+	QueryTrace::RecordSegment(x1, p1, x2, p2);
+	mesh->Collision(p1, p2, colls);
+	AddPrimitiveCollisions(p1, p2, colls);
+	if (ignoretimes){
+		for (auto &it: colls){
+			double t = x1 + (x2 - x1)*it.s;
+			it.ignored = GetSolid(it.ID).is_ignored(t);
+		}
 	}
 	return !colls.empty();
 }
 
+bool TGeometry::GetCollisions(const double x1, const double p1[3], const double x2, const double p2[3], vector<TCollision> &colls, TCollisionCache &cache) const{
+	PROFILE(PROFILE_GETCOLLISIONS);
+	QueryTrace::RecordSegment(x1, p1, x2, p2);
+	if (collisioncache)
+		mesh->Collision(p1, p2, colls, cache);
+	else
+		mesh->Collision(p1, p2, colls);
+	AddPrimitiveCollisions(p1, p2, colls);
+	if (ignoretimes){
+		for (auto &it: colls){
+			double t = x1 + (x2 - x1)*it.s;
+			it.ignored = GetSolid(it.ID).is_ignored(t);
+		}
+	}
+	return !colls.empty();
+}
 
-std::vector<std::pair<solid, bool> > TGeometry::GetSolids(const double t, const double p[3]) const{
-	std::vector<std::pair<solid, bool> > currentsolids = { std::make_pair(defaultsolid, false) };
-	for (unsigned ID: mesh.GetSolids(std::array<double, 3>({p[0], p[1], p[2]}))) {
-	    solid sld = GetSolid(ID);
-        currentsolids.push_back(std::make_pair(sld, sld.is_ignored(t)));
-    }
-	return currentsolids;
+void TGeometry::GetCollisions(const std::vector<double> &x1, const std::vector<std::array<double, 3> > &p1, const std::vector<double> &x2,
+		const std::vector<std::array<double, 3> > &p2, std::vector<std::vector<TCollision> > &colls) const{
+	PROFILE(PROFILE_GETCOLLISIONS);
+	for (size_t i = 0; i < p1.size(); ++i)
+		QueryTrace::RecordSegment(x1[i], p1[i].data(), x2[i], p2[i].data());
+	mesh->Collision(p1, p2, colls);
+	for (size_t i = 0; i < colls.size(); ++i){
+		AddPrimitiveCollisions(p1[i].data(), p2[i].data(), colls[i]);
+		if (ignoretimes){
+			for (auto &it: colls[i]){
+				double t = x1[i] + (x2[i] - x1[i])*it.s;
+				it.ignored = GetSolid(it.ID).is_ignored(t);
+			}
+		}
+	}
+}
+
+void TGeometry::AddPrimitiveCollisions(const double p1[3], const double p2[3], vector<TCollision> &colls) const{
+	if (primitives.empty())
+		return;
+	CSegment segment(CPoint(p1[0], p1[1], p1[2]), CPoint(p2[0], p2[1], p2[2]));
+	if (segment.is_degenerate())
+		return;
+	CGAL::Bbox_3 segbox = segment.bbox();
+	vector<TPrimitiveCrossing> crossings;
+	size_t meshcollisions = colls.size();
+	for (auto &prim: primitives){
+		if (not CGAL::do_overlap(segbox, prim.second->BoundingBox()))
+			continue;
+		crossings.clear();
+		prim.second->Intersect(segment, crossings);
+		for (const TPrimitiveCrossing &c: crossings)
+			colls.push_back(TCollision(segment, c.normal, segment.source() + c.s*segment.to_vector(), prim.first));
+	}
+	if (colls.size() > meshcollisions)
+		std::sort(colls.begin(), colls.end());
+}
+bool TGeometry::BoxContainsSurface(const double min[3], const double max[3]) const{
+	CCuboid box(CPoint(min[0], min[1], min[2]), CPoint(max[0], max[1], max[2]));
+	if (mesh->IntersectsBox(box))
+		return true;
+	CGAL::Bbox_3 bbox = box.bbox();
+	CPoint center = CGAL::midpoint(box.min(), box.max());
+	double halfdiagonal = 0.5*std::sqrt(CGAL::squared_distance(box.min(), box.max()));
+	return std::any_of(primitives.begin(), primitives.end(), [&](const std::pair<unsigned, std::shared_ptr<const TPrimitive> > &prim){
+		return CGAL::do_overlap(bbox, prim.second->BoundingBox()) && prim.second->Distance(center) <= halfdiagonal;
+	});
 }
 
-solid TGeometry::GetSolid(const double t, const double p[3]) const{
-	// find first (highest-priority) solid that's not being ignored
-	auto currentsolids = GetSolids(t, p);
-//	for (auto s: currentsolids)
-//		std::cout << s.first.name << " " << s.second << std::endl;
-	auto sld = std::max_element(currentsolids.begin(), currentsolids.end(), [](const std::pair<solid, bool> s1, const std::pair<solid, bool> s2){ return s1.second || (!s2.second && s1.first.ID < s2.first.ID); });
-//	std::cout << sld->first.name << " " << sld->second << std::endl;
-	return sld->first;
+std::vector<std::pair<const solid*, bool> > TGeometry::GetSolids(const double t, const double p[3], const int outside) const{
+	std::vector<std::pair<const solid*, bool> > currentsolids = { std::make_pair(&GetSolid(defaultsolid.ID), false) };
+	for (unsigned ID: mesh->GetSolids(p[0], p[1], p[2], outside)) {
+	    const solid &sld = GetSolid(ID);
+        currentsolids.push_back(std::make_pair(&sld, sld.is_ignored(t)));
+    }
+	for (auto &prim: primitives){
+		if (prim.second->Inside(CPoint(p[0], p[1], p[2]))){
+			const solid &sld = GetSolid(prim.first);
+			currentsolids.push_back(std::make_pair(&sld, sld.is_ignored(t)));
+		}
+	}
+	return currentsolids;
 }
 
-solid TGeometry::GetSolid(const unsigned ID) const{
-	auto sld = std::find_if(solids.begin(), solids.end(), [&ID](const solid &s){ return s.ID == ID; });
-	if (sld == solids.end())
-		throw std::runtime_error((boost::format("Could not find solid with ID %s") % ID).str());
+const solid& TGeometry::GetSolid(const double t, const double p[3]) const{
+	// find first (highest-priority) solid that's not being ignored, without building the full list of GetSolids
+	const solid *sld = &GetSolid(defaultsolid.ID);
+	for (unsigned ID: mesh->GetSolids(std::array<double, 3>({p[0], p[1], p[2]}))){
+		const solid &s = GetSolid(ID);
+		if (s.ID > sld->ID && !s.is_ignored(t))
+			sld = &s;
+	}
+	for (auto &prim: primitives){
+		if (prim.first > sld->ID && prim.second->Inside(CPoint(p[0], p[1], p[2]))){
+			const solid &s = GetSolid(prim.first);
+			if (!s.is_ignored(t))
+				sld = &s;
+		}
+	}
 	return *sld;
 }
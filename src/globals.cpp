@@ -3,12 +3,24 @@
 #include <iostream>
 #include <fstream>
 #include <cmath>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <exception>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 #include <CGAL/Simple_cartesian.h>
 
 #include <boost/format.hpp>
 
 std::atomic<bool> quit(false);
+std::atomic<bool> suspendtracking(false);
 
 const long double pi = 3.1415926535897932384626L; ///< Pi
 const long double ele_e = 1.602176487E-19L; ///< elementary charge [C]
@@ -117,4 +129,85 @@ std::string ResolveFormula(const std::string &formulaName, const std::map<std::s
 	else{
 		return i->second;
 	}
-}
\ No newline at end of file
+}
+
+
+void ParallelFor(const unsigned long count, const unsigned nthreads, const std::function<void(const unsigned long begin, const unsigned long end)> &func){
+	unsigned long nblocks = std::min<unsigned long>(std::max(nthreads, 1u), count);
+	if (nblocks <= 1){
+		if (count > 0)
+			func(0, count);
+		return;
+	}
+	std::exception_ptr error;
+	std::mutex errormutex;
+	std::vector<std::thread> threads;
+	for (unsigned long i = 0; i < nblocks; ++i){
+		threads.emplace_back([&, i]{
+			try{
+				func(i*count/nblocks, (i + 1)*count/nblocks);
+			}
+			catch (...){
+				std::lock_guard<std::mutex> lock(errormutex);
+				if (not error)
+					error = std::current_exception();
+			}
+		});
+	}
+	for (auto &th: threads)
+		th.join();
+	if (error)
+		std::rethrow_exception(error);
+}
+
+
+bool PinThread(const unsigned index){
+#ifdef __linux__
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return false;
+	int ncpus = CPU_COUNT(&allowed);
+	if (ncpus < 1)
+		return false;
+	int n = index % ncpus;
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu){
+		if (CPU_ISSET(cpu, &allowed) && n-- == 0){
+			cpu_set_t pinned;
+			CPU_ZERO(&pinned);
+			CPU_SET(cpu, &pinned);
+			return pthread_setaffinity_np(pthread_self(), sizeof(pinned), &pinned) == 0;
+		}
+	}
+	return false;
+#else
+	return false;
+#endif
+}
+
+
+std::vector<std::pair<int, int> > ReadNumberRanges(const std::string &list){
+	std::istringstream ss(list);
+	std::string token;
+	std::vector<std::pair<int, int> > ranges;
+	while (ss >> token){
+		int first, last;
+		char dash;
+		std::istringstream range(token);
+		if (not (range >> first))
+			throw std::runtime_error("Could not read list of numbers " + list);
+		last = first;
+		if (range >> dash && (dash != '-' || not (range >> last)))
+			throw std::runtime_error("Could not read list of numbers " + list);
+		ranges.push_back(std::make_pair(first, last));
+	}
+	return ranges;
+}
+
+
+bool InNumberRanges(const std::vector<std::pair<int, int> > &ranges, const int number){
+	for (auto &range: ranges){
+		if (number >= range.first && number <= range.second)
+			return true;
+	}
+	return false;
+}
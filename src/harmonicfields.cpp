@@ -15,6 +15,92 @@
 #include <boost/math/quaternion.hpp>
 #include <boost/numeric/ublas/vector.hpp>
 #include <boost/math/constants/constants.hpp>
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+/**
+ * Components of the magnetic field and its spatial derivatives
+ */
+enum THarmonicComponent{ BX, BY, BZ, DBXDX, DBXDY, DBXDZ, DBYDX, DBYDY, DBYDZ, DBZDX, DBZDY, DBZDZ };
+
+/**
+ * Contribution of a harmonic term to one component of the magnetic field or its derivatives
+ */
+struct THarmonicTerm{
+	int G; ///< Index of the coefficient G of the harmonic term
+	THarmonicComponent component; ///< Field component or derivative the term contributes to
+	const char *monomial; ///< Monomial multiplied with coefficient, e.g. "xxy" for x^2*y
+	double factor; ///< Numerical factor of monomial
+};
+
+/**
+ * Monomials up to third order, sorted by order
+ */
+static const std::string monomials[20] = {"", "x", "y", "z", "xx", "xy", "xz", "yy", "yz", "zz", "xxx", "xxy", "xxz", "xyy", "xyz", "xzz", "yyy", "yyz", "yzz", "zzz"};
+
+/**
+ * Cartesian form of the harmonic polynomial expansion up to third order.
+ *
+ * Terms of the magnetic field reproduce the previous hard-coded expressions exactly, including integer fractions like (3 / 8) that evaluate to zero.
+ */
+static const THarmonicTerm harmonicterms[] = {
+	// B_x
+	{2, BX, "", 1}, {3, BX, "y", 1}, {5, BX, "x", -0.5}, {6, BX, "z", 1}, {7, BX, "x", 1}, {8, BX, "xy", 2},
+	{9, BX, "yz", 2}, {10, BX, "xy", -0.5}, {11, BX, "xz", -1}, {12, BX, "xx", -0.75}, {12, BX, "yy", -0.25}, {12, BX, "zz", 1},
+	{13, BX, "xz", 2}, {14, BX, "xx", 1}, {14, BX, "yy", -1}, {15, BX, "xxy", 3}, {15, BX, "yyy", -1}, {16, BX, "xyz", 6},
+	{17, BX, "xxy", -1.5}, {17, BX, "yyy", -0.5}, {17, BX, "yzz", 3}, {18, BX, "xyz", -1}, {21, BX, "xxx", -1}, {21, BX, "xzz", 3},
+	{22, BX, "xxz", 3}, {22, BX, "yyz", -3}, {23, BX, "xxx", 1}, {23, BX, "xyy", -3},
+	// B_y
+	{0, BY, "", 1}, {3, BY, "x", 1}, {4, BY, "z", 1}, {5, BY, "y", -0.5}, {7, BY, "y", -1}, {8, BY, "xx", 1},
+	{8, BY, "yy", -1}, {9, BY, "xz", 2}, {10, BY, "xx", 0.25}, {10, BY, "yy", 0.75}, {10, BY, "zz", -1}, {11, BY, "yz", -1},
+	{12, BY, "xy", -0.5}, {13, BY, "yz", -2}, {14, BY, "xy", -2}, {15, BY, "xxx", 1}, {15, BY, "xyy", -3}, {16, BY, "xxz", 3},
+	{16, BY, "yyz", -3}, {17, BY, "xxx", -0.5}, {17, BY, "xyy", -1.5}, {17, BY, "xzz", 3}, {20, BY, "xyz", -1}, {21, BY, "yzz", -3},
+	{21, BY, "yyy", 1}, {22, BY, "xyz", -6}, {23, BY, "xxy", -3}, {23, BY, "yyy", 1},
+	// B_z
+	{1, BZ, "", 1}, {4, BZ, "y", 1}, {5, BZ, "z", 1}, {6, BZ, "x", 1}, {9, BZ, "xy", 2}, {10, BZ, "yz", 2},
+	{11, BZ, "zz", 1}, {12, BZ, "xz", 2}, {13, BZ, "xx", 1}, {13, BZ, "yy", -1}, {16, BZ, "xxy", 3}, {16, BZ, "yyy", -1},
+	{17, BZ, "xyz", 6}, {18, BZ, "yzz", 3}, {19, BZ, "zzz", 1}, {19, BZ, "xxz", -1}, {19, BZ, "yyz", -1}, {20, BZ, "xzz", 3},
+	{21, BZ, "xxz", 3}, {21, BZ, "yyz", -3}, {22, BZ, "xxx", 1}, {22, BZ, "xyy", -3},
+	// dBxdx
+	{5, DBXDX, "", -0.5}, {7, DBXDX, "", 1}, {8, DBXDX, "y", 2}, {10, DBXDX, "y", -0.5}, {11, DBXDX, "z", -1}, {12, DBXDX, "x", -1.5},
+	{13, DBXDX, "z", 2}, {14, DBXDX, "x", 2}, {15, DBXDX, "xy", 6}, {16, DBXDX, "yz", 6}, {17, DBXDX, "xy", -3}, {18, DBXDX, "yz", -1.5},
+	{19, DBXDX, "xx", 1.125}, {19, DBXDX, "yy", 0.375}, {19, DBXDX, "zz", -1.5}, {20, DBXDX, "xz", -4.5}, {21, DBXDX, "xx", -3}, {21, DBXDX, "zz", 3},
+	{22, DBXDX, "xz", 6}, {23, DBXDX, "xx", 3}, {23, DBXDX, "yy", -3},
+	// dBxdy
+	{3, DBXDY, "", 1}, {8, DBXDY, "x", 2}, {9, DBXDY, "z", 2}, {10, DBXDY, "x", -0.5}, {12, DBXDY, "y", -0.5}, {14, DBXDY, "y", -2},
+	{15, DBXDY, "xx", 3}, {15, DBXDY, "yy", -3}, {16, DBXDY, "xz", 6}, {17, DBXDY, "xx", -1.5}, {17, DBXDY, "yy", -1.5}, {17, DBXDY, "zz", 3},
+	{18, DBXDY, "xz", -1.5}, {19, DBXDY, "xy", 0.75}, {20, DBXDY, "yz", -1.5}, {22, DBXDY, "yz", -6}, {23, DBXDY, "xy", -6},
+	// dBxdz
+	{6, DBXDZ, "", 1}, {9, DBXDZ, "y", 2}, {11, DBXDZ, "x", -1}, {12, DBXDZ, "z", 2}, {13, DBXDZ, "x", 2}, {16, DBXDZ, "xy", 6},
+	{17, DBXDZ, "yz", 6}, {18, DBXDZ, "xy", -1.5}, {19, DBXDZ, "xz", -3}, {20, DBXDZ, "xx", -2.25}, {20, DBXDZ, "yy", -0.75}, {20, DBXDZ, "zz", 3},
+	{21, DBXDZ, "xz", 6}, {22, DBXDZ, "xx", 3}, {22, DBXDZ, "yy", -3},
+	// dBydx
+	{3, DBYDX, "", 1}, {8, DBYDX, "x", 2}, {9, DBYDX, "z", 2}, {10, DBYDX, "x", 0.5}, {12, DBYDX, "y", -0.5}, {14, DBYDX, "y", -2},
+	{15, DBYDX, "xx", 3}, {15, DBYDX, "yy", -3}, {16, DBYDX, "xz", 6}, {17, DBYDX, "xx", -1.5}, {17, DBYDX, "yy", -1.5}, {17, DBYDX, "zz", 3},
+	{18, DBYDX, "xz", -1.5}, {19, DBYDX, "xy", 0.75}, {20, DBYDX, "yz", -1.5}, {22, DBYDX, "yz", -6}, {23, DBYDX, "xy", -6},
+	// dBydy
+	{5, DBYDY, "", -0.5}, {7, DBYDY, "", -1}, {8, DBYDY, "y", -2}, {10, DBYDY, "y", 1.5}, {11, DBYDY, "z", -1}, {12, DBYDY, "x", -0.5},
+	{13, DBYDY, "z", -2}, {14, DBYDY, "x", -2}, {15, DBYDY, "xy", -6}, {16, DBYDY, "yz", -6}, {17, DBYDY, "xy", -3}, {18, DBYDY, "yz", -4.5},
+	{19, DBYDY, "xx", 0.375}, {19, DBYDY, "yy", 1.125}, {19, DBYDY, "zz", -1.5}, {20, DBYDY, "xz", -1.5}, {21, DBYDY, "yy", 3}, {21, DBYDY, "zz", -3},
+	{22, DBYDY, "xz", -6}, {23, DBYDY, "xx", -3}, {23, DBYDY, "yy", 3},
+	// dBydz
+	{4, DBYDZ, "", 1}, {9, DBYDZ, "x", 2}, {10, DBYDZ, "z", -2}, {11, DBYDZ, "y", -1}, {13, DBYDZ, "y", -2}, {16, DBYDZ, "xx", 3},
+	{16, DBYDZ, "yy", -3}, {17, DBYDZ, "xz", 6}, {18, DBYDZ, "xx", -0.75}, {18, DBYDZ, "yy", -2.25}, {18, DBYDZ, "zz", 3}, {19, DBYDZ, "yz", -3},
+	{20, DBYDZ, "xy", -1.5}, {21, DBYDZ, "yz", -6}, {22, DBYDZ, "xy", -6},
+	// dBzdx
+	{6, DBZDX, "", 1}, {9, DBZDX, "y", 2}, {11, DBZDX, "x", -1}, {12, DBZDX, "z", 2}, {13, DBZDX, "x", 2}, {16, DBZDX, "xy", 6},
+	{17, DBZDX, "yz", 6}, {18, DBZDX, "xy", -1.5}, {19, DBZDX, "xz", -3}, {20, DBZDX, "xx", -2.25}, {20, DBZDX, "yy", -0.75}, {20, DBZDX, "zz", 3},
+	{21, DBZDX, "xz", 6}, {22, DBZDX, "xx", 3}, {22, DBZDX, "yy", -3},
+	// dBzdy
+	{4, DBZDY, "", 1}, {9, DBZDY, "x", 2}, {10, DBZDY, "z", 2}, {11, DBZDY, "y", -1}, {13, DBZDY, "y", -2}, {16, DBZDY, "xx", 3},
+	{16, DBZDY, "yy", -3}, {17, DBZDY, "xz", 6}, {18, DBZDY, "xx", -0.75}, {18, DBZDY, "yy", -2.25}, {18, DBZDY, "zz", 3}, {19, DBZDY, "yz", -3},
+	{20, DBZDY, "xy", -1.5}, {21, DBZDY, "yz", -6}, {22, DBZDY, "xy", -6},
+	// dBzdz
+	{5, DBZDZ, "", 1}, {10, DBZDZ, "y", 2}, {11, DBZDZ, "z", 2}, {12, DBZDZ, "x", 2}, {17, DBZDZ, "xy", 6}, {18, DBZDZ, "yz", 6},
+	{19, DBZDZ, "xx", -1.5}, {19, DBZDZ, "yy", -1.5}, {19, DBZDZ, "zz", 3}, {20, DBZDZ, "xz", 6}, {21, DBZDZ, "xx", 3}, {21, DBZDZ, "yy", -3}
+};
+
 
 HarmonicExpandedBField::HarmonicExpandedBField(const double _xoff, const double _yoff, const double _zoff, 
 		const double _axis_x, const double _axis_y, const double _axis_z, const double _angle, 
@@ -33,34 +119,65 @@ HarmonicExpandedBField::HarmonicExpandedBField(const double _xoff, const double
 	axis_z = _axis_z;
 	angle  = _angle;
 
-	// G parameters
-    G[0]  = G0;
-	G[1]  = G1;
-	G[2]  = G2;
-	G[3]  = G3;
-	G[4]  = G4;
-	G[5]  = G5;
-	G[6]  = G6;
-	G[7]  = G7;
-	G[8]  = G8;
-	G[9]  = G9;
-	G[10] = G10;
-	G[11] = G11;
-	G[12] = G12;
-	G[13] = G13;
-	G[14] = G14;
-	G[15] = G15;
-	G[16] = G16;
-	G[17] = G17;
-	G[18] = G18;
-	G[19] = G19;
-	G[20] = G20;
-	G[21] = G21;
-	G[22] = G22;
-	G[23] = G23;
+	// G parameters, collected into coefficients of monomials; terms with vanishing coefficients drop out
+	const double G[24] = {G0, G1, G2, G3, G4, G5, G6, G7, G8, G9, G10, G11, G12, G13, G14, G15, G16, G17, G18, G19, G20, G21, G22, G23};
+	for (int i = 0; i < 3; ++i){
+		Bcoeff[i].fill(0.);
+		for (int j = 0; j < 3; ++j)
+			dBcoeff[i][j].fill(0.);
+	}
+	order = 0;
+	for (const THarmonicTerm &term: harmonicterms){
+		if (G[term.G] == 0)
+			continue;
+		int m = std::find(std::begin(monomials), std::end(monomials), std::string(term.monomial)) - std::begin(monomials);
+		int degree = std::strlen(term.monomial);
+		if (term.component < DBXDX){
+			Bcoeff[term.component][m] += G[term.G]*term.factor;
+			order = std::max(order, degree);
+		}
+		else{
+			dBcoeff[(term.component - DBXDX)/3][(term.component - DBXDX)%3][m] += G[term.G]*term.factor;
+			order = std::max(order, degree + 1);
+		}
+	}
+}
+
 
+template<int N> void HarmonicExpandedBField::Evaluate(const double x, const double y, const double z, double B[3], double dBidxj[3][3]) const{
+	constexpr int nB = (N + 1)*(N + 2)*(N + 3)/6; // number of monomials up to order N
+	constexpr int ndB = N*(N + 1)*(N + 2)/6; // number of monomials up to order N - 1
+	// monomials in the same order as list "monomials", higher powers are built from lower ones
+	double m[20];
+	m[0] = 1.;
+	if (N >= 1){
+		m[1] = x; m[2] = y; m[3] = z;
+	}
+	if (N >= 2){
+		m[4] = x*x; m[5] = x*y; m[6] = x*z; m[7] = y*y; m[8] = y*z; m[9] = z*z;
+	}
+	if (N >= 3){
+		m[10] = x*m[4]; m[11] = x*m[5]; m[12] = x*m[6]; m[13] = x*m[7]; m[14] = x*m[8]; m[15] = x*m[9];
+		m[16] = y*m[7]; m[17] = y*m[8]; m[18] = y*m[9]; m[19] = z*m[9];
 	}
 
+	for (int i = 0; i < 3; ++i){
+		B[i] = 0.;
+		for (int k = 0; k < nB; ++k)
+			B[i] += Bcoeff[i][k]*m[k];
+	}
+	if (dBidxj != nullptr){
+		for (int i = 0; i < 3; ++i){
+			for (int j = 0; j < 3; ++j){
+				dBidxj[i][j] = 0.;
+				for (int k = 0; k < ndB; ++k)
+					dBidxj[i][j] += dBcoeff[i][j][k]*m[k];
+			}
+		}
+	}
+}
+
+
 void HarmonicExpandedBField::BField(const double _x, const double _y, const double _z, const double t, double B[3], double dBidxj[3][3]) const{
 
 	// Updating the x, y, z values with the given offset values
@@ -71,15 +188,16 @@ void HarmonicExpandedBField::BField(const double _x, const double _y, const doub
 	/* 
 	Information about Calculating the Harmonic Polynomial Expansion
 
-	The calculations below are hard-coded using the cartesian form of the 
-	harmonic polynomial expansion. Alternatively, this can be carried out 
+	The calculations are hard-coded in harmonicterms using the cartesian form 
+	of the harmonic polynomial expansion and collected into coefficients of
+	monomials when the field is constructed. Alternatively, this can be carried out 
 	in an iterative fashion using the BOOST library for "Legendre and 
 	associated polynomials":
 	
 	boost.org/doc/libs/1_65_0/libs/math/doc/html/math_toolkit/sf_poly/legendre.html 
 
 	This was not chosen for the implementation here because it was believed
-	that this hard-coded representation displayed the physical form of the 
+	that the hard-coded representation displayed the physical form of the 
 	functions more explicitly. Perhaps more importantly, this form is much
 	easier to debug. 
 
@@ -88,128 +206,12 @@ void HarmonicExpandedBField::BField(const double _x, const double _y, const doub
 	be preferrable. 
 	*/
 
-	// Calculating B_x
-	B[0] = 	  G[2] 	\
-			+ G[3]  * (y) \
-			+ G[5]  * (-x / 2) \
-			+ G[6]  * (z) \
-			+ G[7]  * (x) \
-			+ G[8]  * (2 * x * y) \
-			+ G[9]  * (2 * y * z) \
-			+ G[10] * (-x * y / 2) \
-			+ G[11] * (-x * z) \
-			+ G[12] * (-(3 * pow(x,2) + pow(y,2) - 4 * pow(z,2)) / 4) \
-			+ G[13] * (2 * x * z) \
-			+ G[14] * ((pow(x,2) - pow(y,2))) \
-			+ G[15] * ((3 * pow(x,2) * y - pow(y,3))) \
-			+ G[16] * (6 * x * y * z) \
-			+ G[17] * (-(3 * pow(x,2) * y + pow(y,3) - 6 * y * pow(z,2)) / 2) \
-			+ G[18] * (-(3 / 2) * (x * y * z)) \
-			+ G[19] * ((3 / 8) * (pow(x,3) + x * pow(y,2) - 4 * x * pow(z,2))) \
-			+ G[20] * ((-1 / 4) * (9 * pow(x,2) * z + 3 * pow(y,2) * z - 4 * pow(z,3))) \
-			+ G[21] * (-pow(x,3) + 3 * x * pow(z,2)) \
-			+ G[22] * (3 * (pow(x,2) * z - pow(y,2) * z)) \
-			+ G[23] * (pow(x,3) - 3 * x * pow(y,2));
-	
-	// Calculating B_y
-	B[1] =	  G[0] 	\
-			+ G[3]  * (x) \
-			+ G[4]  * (z) \
-			+ G[5]  * (-y / 2) \
-			+ G[7]  * (-y) \
-			+ G[8]  * (pow(x,2) - pow(y,2)) \
-			+ G[9]  * (2 * x * z) \
-			+ G[10] * ((pow(x,2) + 3 * pow(y,2) - 4 * pow(z,2)) / 4) \
-			+ G[11] * (-y * z) \
-			+ G[12] * (-x * y / 2) \
-			+ G[13] * (-2 * y * z) \
-			+ G[14] * (-2 * x * y) \
-			+ G[15] * (pow(x,3) - 3 * x * pow(y,2)) \
-			+ G[16] * (3 * (pow(x,2) * z - pow(y,2) * z)) \
-			+ G[17] * (-(pow(x,3) + 3 * x * pow(y,2) - 6 * x * pow(z,2)) / 2) \
-			+ G[18] * ( (-1 / 4) * (3 * pow(x,2) * z + 9 * pow(y,2) * z - 4 * pow(z,3))) \
-			+ G[19] * ((3 / 8) * (pow(x,2) * y + pow(y,3) - 4 * y * pow(z,2))) \
-			+ G[20] * ((-3 / 2) * x * y * z) \
-			+ G[21] * (-3 * y * pow(z,2) + pow(y,3)) \
-			+ G[22] * (-6 * x * y * z) \
-			+ G[23] * (-3 * pow(x,2) * y + pow(y,3));
-
-	// Calculating B_z
-	B[2] =	  G[1] 	\
-			+ G[4]  * (y) \
-			+ G[5]  * (z) \
-			+ G[6]  * (x) \
-			+ G[9]  * (2 * x * y) \
-			+ G[10] * (2 * y * z) \
-			+ G[11] * (pow(z,2) - (1 / 2) * (pow(x,2) + pow(y,2))) \
-			+ G[12] * (2 * x * z) \
-			+ G[13] * (pow(x,2) - pow(y,2)) \
-			+ G[16] * (3 * pow(x,2) * y - pow(y,3))\
-			+ G[17] * (6 * x * y * z)  \
-			+ G[18] * (3 * y * pow(z,2) - (3/4) * (pow(x,2) * y + pow(y,3))) \
-			+ G[19] * (pow(z,3) - (3 / 2) * z * (pow(x,2) + pow(y,2))) \
-			+ G[20] * (3 * x * pow(z,2) - (3/4) * (pow(x,3) + x * pow(y,2))) \
-			+ G[21] * (3 * (pow(x,2) * z - pow(y,2) * z)) \
-			+ G[22] * (pow(x,3) - 3 * x * pow(y,2));
-
-	// Calculating dBxdx
-	dBidxj[0][0] = -G[5]/2 + G[7] + 2*G[8]*y - G[10]*y/2 - G[11]*z - \
-					3*G[12]*x/2 + 2*G[13]*z + 2*G[14]*x + 6*G[15]*x*y + \
-					6*G[16]*y*z - 3*G[17]*x*y - 1.5*G[18]*y*z + \
-					G[19]*(1.125*pow(x,2) + 0.375*pow(y,2) - 1.5*pow(z,2)) - \
-					4.5*G[20]*x*z + G[21]*(-3*pow(x,2) + 3*pow(z,2)) + \
-					6*G[22]*x*z + G[23]*(3*pow(x,2) - 3*pow(y,2));
-
-	// Calculating dBxdy
-	dBidxj[0][1] = G[3] + 2*G[8]*x + 2*G[9]*z - G[10]*x/2 - G[12]*y/2 - \
-					2*G[14]*y + G[15]*(3*pow(x,2) - 3*pow(y,2)) + 6*G[16]*x*z+\
-					G[17]*(-3*pow(x,2)/2 - 3*pow(y,2)/2 + 3*pow(z,2)) - \
-					1.5*G[18]*x*z + 0.75*G[19]*x*y - 1.5*G[20]*y*z - \
-					6*G[22]*y*z - 6*G[23]*x*y;
-
-	// Calculating dBxdz
-	dBidxj[0][2] = G[6] + 2*G[9]*y - G[11]*x + 2*G[12]*z + 2*G[13]*x + \
-					6*G[16]*x*y + 6*G[17]*y*z - 1.5*G[18]*x*y - 3.0*G[19]*x*z+\
-					G[20]*(-2.25*pow(x,2) - 0.75*pow(y,2) + 3.0*pow(z,2)) + \
-					6*G[21]*x*z + G[22]*(3*pow(x,2) - 3*pow(y,2));
-
-	// Calculating dBydx
-	dBidxj[1][0] = G[3] + 2*G[8]*x + 2*G[9]*z + G[10]*x/2 - G[12]*y/2 - \
-					2*G[14]*y + G[15]*(3*pow(x,2) - 3*pow(y,2)) + 6*G[16]*x*z+\
-					G[17]*(-3*pow(x,2)/2 - 3*pow(y,2)/2 + 3*pow(z,2)) - \
-					1.5*G[18]*x*z + 0.75*G[19]*x*y - 1.5*G[20]*y*z - \
-					6*G[22]*y*z - 6*G[23]*x*y;
-
-	// Calculating dBydy
-	dBidxj[1][1] = -G[5]/2 - G[7] - 2*G[8]*y + 3*G[10]*y/2 - G[11]*z - \
-					G[12]*x/2 - 2*G[13]*z - 2*G[14]*x - 6*G[15]*x*y - \
-					6*G[16]*y*z - 3*G[17]*x*y - 4.5*G[18]*y*z + \
-					G[19]*(0.375*pow(x,2) + 1.125*pow(y,2) - 1.5*pow(z,2)) - \
-					1.5*G[20]*x*z + G[21]*(3*pow(y,2) - 3*pow(z,2)) - \
-					6*G[22]*x*z + G[23]*(-3*pow(x,2) + 3*pow(y,2));
-
-	// Calculating dBydz
-	dBidxj[1][2] = G[4] + 2*G[9]*x - 2*G[10]*z - G[11]*y - 2*G[13]*y + \
-					G[16]*(3*pow(x,2) - 3*pow(y,2)) + 6*G[17]*x*z + \
-					G[18]*(-0.75*pow(x,2) - 2.25*pow(y,2) + 3.0*pow(z,2)) - \
-					3.0*G[19]*y*z - 1.5*G[20]*x*y - 6*G[21]*y*z - 6*G[22]*x*y;
-
-	// Calculating dBzdx
-	dBidxj[2][0] = G[6] + 2*G[9]*y - 1.0*G[11]*x + 2*G[12]*z + 2*G[13]*x + \
-					6*G[16]*x*y + 6*G[17]*y*z - 1.5*G[18]*x*y - 3.0*G[19]*x*z+\
-					G[20]*(-2.25*pow(x,2) - 0.75*pow(y,2) + 3*pow(z,2)) + \
-					6*G[21]*x*z + G[22]*(3*pow(x,2) - 3*pow(y,2));
-
-	// Calculating dBzdy
-	dBidxj[2][1] = G[4] + 2*G[9]*x + 2*G[10]*z - 1.0*G[11]*y - 2*G[13]*y + \
-					G[16]*(3*pow(x,2) - 3*pow(y,2)) + 6*G[17]*x*z + \
-					G[18]*(-0.75*pow(x,2) - 2.25*pow(y,2) + 3*pow(z,2)) - \
-					3.0*G[19]*y*z - 1.5*G[20]*x*y - 6*G[21]*y*z - 6*G[22]*x*y;
-
-	// Calculating dBzdz
-	dBidxj[2][2] = G[5] + 2*G[10]*y + 2*G[11]*z + 2*G[12]*x + 6*G[17]*x*y + \
-					6*G[18]*y*z + G[19]*(-1.5*pow(x,2) - 1.5*pow(y,2) + \
-					3*pow(z,2)) + 6*G[20]*x*z + G[21]*(3*pow(x,2) -3*pow(y,2));
+	switch (order){
+		case 0: Evaluate<0>(x, y, z, B, dBidxj); break;
+		case 1: Evaluate<1>(x, y, z, B, dBidxj); break;
+		case 2: Evaluate<2>(x, y, z, B, dBidxj); break;
+		default: Evaluate<3>(x, y, z, B, dBidxj); break;
+	}
 
 	/* 
 	Information about Rotations with Quaternions
@@ -284,6 +286,8 @@ void HarmonicExpandedBField::BField(const double _x, const double _y, const doub
         B[1] = p_prime.R_component_3();
         B[2] = p_prime.R_component_4();
 
+        if (dBidxj == nullptr) // no derivatives requested
+            return;
 
         // We create three quaternions, one for the gradient of each of the 
         // gradient vectors
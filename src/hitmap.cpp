@@ -0,0 +1,78 @@
+#include "hitmap.h"
+
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <stdexcept>
+
+using namespace std;
+
+void THitMap::Add(const std::uint32_t triangle, const double weight, const double E, const double angle, const bool absorbed){
+	TTriangleTally &t = triangles.at(triangle);
+	t.count += 1;
+	t.weight += weight;
+	if (absorbed)
+		t.absorbed += weight;
+	t.E += weight*E;
+	t.angle += weight*angle;
+}
+
+
+void THitMap::Write(const boost::filesystem::path &outfile, const std::vector<CTriangleVertices> &vertices, const std::string &title, const bool append){
+	const size_t n = triangles.size();
+	if (vertices.size() != n)
+		throw runtime_error("Number of triangles in hit map " + outfile.string() + " does not match solid!");
+	if (append and boost::filesystem::exists(outfile)){ // add tallies of file written before simulation was resumed
+		ifstream infile(outfile.string());
+		string token;
+		while (infile >> token && token != "CELL_DATA");
+		map<string, vector<double> > cells;
+		size_t ncells = 0;
+		infile >> ncells;
+		string name, type, table, tablename;
+		while (infile >> token >> name >> type >> table >> tablename){ // SCALARS <name> double LOOKUP_TABLE default
+			vector<double> &values = cells[name];
+			values.resize(ncells);
+			for (double &v: values)
+				infile >> v;
+		}
+		if (ncells != n || cells["count"].empty() || cells["weight"].empty() || cells["absorbed"].empty() || cells["E"].empty() || cells["angle"].empty())
+			throw runtime_error("Could not read " + outfile.string());
+		for (size_t i = 0; i < n; ++i){
+			double w = cells["weight"][i];
+			triangles[i].count += cells["count"][i];
+			triangles[i].weight += w;
+			triangles[i].absorbed += cells["absorbed"][i];
+			triangles[i].E += cells["E"][i]*w;
+			triangles[i].angle += cells["angle"][i]*w;
+		}
+	}
+
+	ofstream file(outfile.string());
+	file << setprecision(numeric_limits<double>::max_digits10); // tallies have to be added exactly when files are merged
+	file << "# vtk DataFile Version 3.0\n" << title << "\nASCII\nDATASET POLYDATA\n";
+	file << "POINTS " << 3*n << " double\n";
+	for (const CTriangleVertices &v: vertices){
+		for (int j = 0; j < 3; ++j)
+			file << v[j].x() << ' ' << v[j].y() << ' ' << v[j].z() << '\n';
+	}
+	file << "POLYGONS " << n << ' ' << 4*n << '\n';
+	for (size_t i = 0; i < n; ++i)
+		file << "3 " << 3*i << ' ' << 3*i + 1 << ' ' << 3*i + 2 << '\n';
+	file << "CELL_DATA " << n << '\n';
+	auto scalars = [&](const string &name, const std::function<double(const TTriangleTally&)> &value){
+		file << "SCALARS " << name << " double\nLOOKUP_TABLE default\n";
+		for (const TTriangleTally &t: triangles)
+			file << value(t) << '\n';
+	};
+	scalars("count", [](const TTriangleTally &t){ return t.count; });
+	scalars("weight", [](const TTriangleTally &t){ return t.weight; });
+	scalars("absorbed", [](const TTriangleTally &t){ return t.absorbed; });
+	scalars("lossfraction", [](const TTriangleTally &t){ return t.weight > 0 ? t.absorbed/t.weight : 0.; });
+	scalars("E", [](const TTriangleTally &t){ return t.weight > 0 ? t.E/t.weight : 0.; });
+	scalars("angle", [](const TTriangleTally &t){ return t.weight > 0 ? t.angle/t.weight : 0.; });
+	if (not file)
+		throw runtime_error("Could not write " + outfile.string());
+}
@@ -1,332 +1,1181 @@
 #include "logger.h"
+#include "profiler.h"
+#include "source.h"
+#include "transfer.h"
 
 #include <sstream>
 #include <algorithm>
 #include <iterator>
+#include <tuple>
+#include <chrono>
+#include <iostream>
+#include <cmath>
+#include <cstdio>
+
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/iostreams/filter/bzip2.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
 
 using namespace std;
 
-std::unique_ptr<TLogger> CreateLogger(TConfig& config){
-    bool ROOTlog = false;
+std::unique_ptr<TLogger> CreateLogger(TConfig& config, const int shard){
+    bool ROOTlog = false, HDF5log = false;
     istringstream(config["GLOBAL"]["ROOTlog"]) >> ROOTlog;
-    if (ROOTlog){
+    istringstream(config["GLOBAL"]["HDF5log"]) >> HDF5log;
+    if (ROOTlog and HDF5log)
+        throw runtime_error("ROOTlog and HDF5log cannot be enabled at the same time!");
+    bool appendlog = false;
+    istringstream(config["GLOBAL"]["appendlog"]) >> appendlog;
+    if (appendlog and (ROOTlog or HDF5log))
+        throw runtime_error("appendlog (e.g. to resume from a checkpoint) only works with text logs!");
+    if (HDF5log){
+        #ifdef USEHDF5
+            return std::unique_ptr<TLogger>(new THDF5Logger(config, shard));
+        #else
+            throw runtime_error("HDF5log is set but PENTrack was compiled without HDF5 support!");
+        #endif
+    }
+    else if (ROOTlog){
         #ifdef USEROOT
-            return std::unique_ptr<TLogger>(new TROOTLogger(config));
+            return std::unique_ptr<TLogger>(new TROOTLogger(config, shard));
         #else
             throw runtime_error("ROOTlog is set but PENTrack was compiled without ROOT support!");
         #endif
     }
     else
-	    return std::unique_ptr<TLogger>(new TTextLogger(config));
+	    return std::unique_ptr<TLogger>(new TTextLogger(config, shard));
 }
 
 
-void TLogger::Print(const std::unique_ptr<TParticle>& p, const value_type x, const state_type &y, const state_type &spin,
-        const TGeometry &geom, const TFieldManager &field, const std::string suffix){
-    bool log = false;
-    istringstream(config[p->GetName()][suffix + "log"]) >> log;
-    if (not log)
-        return;
-
-    value_type E = p->GetKineticEnergy(&y[3]);
-    double Bstart[3], Eistart[3], Vstart;
-
-    value_type tstart = p->GetInitialTime();
-    state_type ystart = p->GetInitialState();
-    state_type spinstart = p->GetInitialSpin();
-    field.BField(ystart[0], ystart[1], ystart[2], tstart, Bstart);
-    field.EField(ystart[0], ystart[1], ystart[2], tstart, Vstart, Eistart);
-
-    double H;
-    solid sld = geom.GetSolid(x, &y[0]);
-    H = E + p->GetPotentialEnergy(x, y, field, sld);
-
-    double B[3], Ei[3], V;
-    field.BField(y[0], y[1], y[2], x, B);
-    field.EField(y[0], y[1], y[2], x, V, Ei);
-
-    double wL = 0;
-    if (spin[3] > 0)
-        wL = spin[4]/spin[3];
-
-    map<string, double> variables = {{"jobnumber", static_cast<double>(jobnumber)},
-                                     {"particle", static_cast<double>(p->GetParticleNumber())},
-                                     {"m", p->GetMass()},
-                                     {"q", p->GetCharge()},
-                                     {"mu", p->GetMagneticMoment()},
-                                     {"tstart", tstart},
-                                     {"xstart", ystart[0]},
-                                     {"ystart", ystart[1]},
-                                     {"zstart", ystart[2]},
-                                     {"vxstart", ystart[3]},
-                                     {"vystart", ystart[4]},
-                                     {"vzstart", ystart[5]},
-                                     {"polstart", ystart[7]},
-                                     {"Sxstart", spinstart[0]},
-                                     {"Systart", spinstart[1]},
-                                     {"Szstart", spinstart[2]},
-                                     {"Hstart", p->GetInitialTotalEnergy(geom, field)},
-                                     {"Estart", p->GetInitialKineticEnergy()},
-                                     {"Bstart", sqrt(Bstart[0]*Bstart[0] + Bstart[1]*Bstart[1] + Bstart[2]*Bstart[2])},
-                                     {"Ustart", Vstart},
-                                     {"solidstart", static_cast<double>(p->GetInitialSolid().ID)},
-                                     {"tend", x},
-                                     {"xend", y[0]},
-                                     {"yend", y[1]},
-                                     {"zend", y[2]},
-                                     {"vxend", y[3]},
-                                     {"vyend", y[4]},
-                                     {"vzend", y[5]},
-                                     {"polend", y[7]},
-                                     {"Sxend", spin[0]},
-                                     {"Syend", spin[1]},
-                                     {"Szend", spin[2]},
-                                     {"Hend", H},
-                                     {"Eend", E},
-                                     {"Bend", sqrt(B[0]*B[0] + B[1]*B[1] + B[2]*B[2])},
-                                     {"Uend", V},
-                                     {"solidend", static_cast<double>(sld.ID)},
-                                     {"stopID", static_cast<double>(p->GetStopID())},
-                                     {"Nspinflip", static_cast<double>(p->GetNumberOfSpinflips())},
-                                     {"spinflipprob", 1 - p->GetNoSpinFlipProbability()},
-                                     {"Nhit", static_cast<double>(p->GetNumberOfHits())},
-                                     {"Nstep", static_cast<double>(p->GetNumberOfSteps())},
-                                     {"propert", y[6]},
-                                     {"trajlength", y[8]},
-                                     {"Hmax", p->GetMaxTotalEnergy()},
-                                     {"wL", wL}
-                                    };
-
-    vector<string> default_titles = {"jobnumber", "particle",
+/**
+ * Columns of endlog and snapshotlog
+ */
+namespace endlog{
+    enum column {jobnumber, particle, m, q, mu,
+                 tstart, xstart, ystart, zstart, vxstart, vystart, vzstart, polstart, Sxstart, Systart, Szstart, Hstart, Estart, Bstart, Ustart, solidstart,
+                 tend, xend, yend, zend, vxend, vyend, vzend, polend, Sxend, Syend, Szend, Hend, Eend, Bend, Uend, solidend,
+                 stopID, Nspinflip, spinflipprob, Nhit, Nstep, propert, trajlength, Hmax, wL, statweight, fatesampled, cell1, cell2, cell3,
+                 walltime, cputime, Nderivs, Ncollisionqueries, stepmean, stepmin, Niterations, Nspinstep, lastcolumn = Nspinstep};
+    const vector<string> columns = {"jobnumber", "particle", "m", "q", "mu",
+                                    "tstart", "xstart", "ystart", "zstart", "vxstart", "vystart", "vzstart", "polstart", "Sxstart", "Systart", "Szstart", "Hstart", "Estart", "Bstart", "Ustart", "solidstart",
+                                    "tend", "xend", "yend", "zend", "vxend", "vyend", "vzend", "polend", "Sxend", "Syend", "Szend", "Hend", "Eend", "Bend", "Uend", "solidend",
+                                    "stopID", "Nspinflip", "spinflipprob", "Nhit", "Nstep", "propert", "trajlength", "Hmax", "wL", "statweight", "fatesampled", "cell1", "cell2", "cell3",
+                                    "walltime", "cputime", "Nderivs", "Ncollisionqueries", "stepmean", "stepmin", "Niterations", "Nspinstep"};
+    const vector<string> default_titles = {"jobnumber", "particle",
                                      "tstart", "xstart", "ystart", "zstart", "vxstart", "vystart", "vzstart", "polstart",
                                      "Sxstart", "Systart", "Szstart", "Hstart", "Estart", "Bstart", "Ustart", "solidstart",
                                      "tend", "xend", "yend", "zend", "vxend", "vyend", "vzend", "polend",
                                      "Sxend", "Syend", "Szend", "Hend", "Eend", "Bend", "Uend", 
                                      "solidend", "stopID", "Nspinflip", "spinflipprob", "Nhit", "Nstep", "propert", "trajlength", "Hmax", "wL"};
+}
+
+/**
+ * Columns of tracklog
+ */
+namespace tracklog{
+    enum column {jobnumber, particle, polarisation, t, x, y, z, vx, vy, vz, H, E,
+                 Bx, dBxdx, dBxdy, dBxdz, By, dBydx, dBydy, dBydz, Bz, dBzdx, dBzdy, dBzdz, Ex, Ey, Ez, V};
+    const vector<string> columns = {"jobnumber", "particle",
+                                     "polarisation", "t", "x", "y", "z", "vx", "vy", "vz", "H", "E",
+                                     "Bx", "dBxdx", "dBxdy", "dBxdz", "By", "dBydx", "dBydy", "dBydz", "Bz", "dBzdx", "dBzdy", "dBzdz",
+                                     "Ex", "Ey", "Ez", "V"};
+    const vector<string> &default_titles = columns;
+}
+
+/**
+ * Columns of hitlog
+ */
+namespace hitlog{
+    enum column {jobnumber, particle, t, x, y, z, v1x, v1y, v1z, pol1, v2x, v2y, v2z, pol2, nx, ny, nz, solid1, solid2};
+    const vector<string> columns = {"jobnumber", "particle",
+                                     "t", "x", "y", "z",
+                                     "v1x", "v1y", "v1z", "pol1", "v2x", "v2y", "v2z", "pol2",
+                                     "nx", "ny", "nz", "solid1", "solid2"};
+    const vector<string> &default_titles = columns;
+}
+
+/**
+ * Columns of spinlog
+ */
+namespace spinlog{
+    enum column {jobnumber, particle, t, x, y, z, Sx, Sy, Sz, Wx, Wy, Wz, Bx, By, Bz};
+    const vector<string> columns = {"jobnumber", "particle",
+                                     "t", "x", "y", "z",
+                                     "Sx", "Sy", "Sz", "Wx", "Wy", "Wz", "Bx", "By", "Bz"};
+    const vector<string> &default_titles = columns;
+}
+
+/**
+ * Columns of diagnosticlog
+ */
+namespace diagnosticlog{
+    enum column {jobnumber, particle, code, t, x, y, z, vx, vy, vz, polarisation, solid, Nstep, Nhit, cputime, value};
+    const vector<string> columns = {"jobnumber", "particle", "code",
+                                     "t", "x", "y", "z", "vx", "vy", "vz", "polarisation", "solid",
+                                     "Nstep", "Nhit", "cputime", "value"};
+    const vector<string> &default_titles = columns;
+}
+
+
+TLogger::TLogger(TConfig &aconfig, const int ashard): config(aconfig), shard(ashard){
+    istringstream(config["GLOBAL"]["logprefix"]) >> prefix;
+    vector<string> endcolumns = endlog::columns, enddefaults = endlog::default_titles;
+    bool fatesampling = false;
+    for (auto &section: config){
+        if (section.first == "IMPORTANCE") // particles can be split, so statistical weights are needed to analyze logs
+            enddefaults.push_back("statweight");
+        if (section.first == "PERIODIC") // end positions are folded into the unit cell, the cell counters unfold them
+            enddefaults.insert(enddefaults.end(), {"cell1", "cell2", "cell3"});
+        for (auto option: {"fatehits", "fatetime"}){
+            auto warmup = section.second.find(option);
+            double value = 0;
+            if (warmup != section.second.end() && istringstream(warmup->second) >> value && value > 0)
+                fatesampling = true;
+        }
+    }
+    if (fatesampling) // particles can end with sampled fates, which have to be told apart from tracked ones
+        enddefaults.push_back("fatesampled");
+    vector<string> weightnames = TGeometry::ReadWeightNames(config);
+    if (not weightnames.empty()){ // survival weights of weighted tracking are appended to columns of endlog and snapshotlog
+        vector<string> weightcolumns = {"weight"};
+        for (auto &name: weightnames)
+            weightcolumns.push_back("weight_" + name);
+        endcolumns.insert(endcolumns.end(), weightcolumns.begin(), weightcolumns.end());
+        enddefaults.insert(enddefaults.end(), weightcolumns.begin(), weightcolumns.end());
+    }
+    for (auto &section: config){
+        TParticleLogSettings &s = settings[section.first];
+        ReadLogSettings(section.first, "end", endcolumns, enddefaults, s.end);
+        ReadLogSettings(section.first, "snapshot", endcolumns, enddefaults, s.snapshot);
+        ReadLogSettings(section.first, "track", tracklog::columns, tracklog::default_titles, s.track);
+        ReadLogSettings(section.first, "hit", hitlog::columns, hitlog::default_titles, s.hit);
+        ReadLogSettings(section.first, "spin", spinlog::columns, spinlog::default_titles, s.spin);
+        s.diagnostic.enabled = true; // problems are always logged unless diagnosticlog is switched off
+        ReadLogSettings(section.first, "diagnostic", diagnosticlog::columns, diagnosticlog::default_titles, s.diagnostic);
+        s.diagnostic.defaultvars = false;
+        auto trajectory = section.second.find("trajectorylog");
+        if (trajectory != section.second.end())
+            istringstream(trajectory->second) >> s.trajectory;
+        auto hitmap = section.second.find("hitmap");
+        if (hitmap != section.second.end())
+            istringstream(hitmap->second) >> s.hitmap;
+        auto snapshots = section.second.find("snapshots");
+        if (snapshots != section.second.end()){
+            istringstream snapshottimes(snapshots->second);
+            s.snapshots.assign(istream_iterator<double>(snapshottimes), istream_iterator<double>());
+            sort(s.snapshots.begin(), s.snapshots.end());
+        }
+    }
 
-    Log(p->GetName(), suffix, variables, default_titles);
+    for (auto &section: config){
+        if (section.first == "EFFICIENCYMAPS"){
+            for (auto &m: section.second)
+                efficiencymaps.emplace_back(m.first, m.second);
+        }
+    }
+
+    bool asynclog = false;
+    istringstream(config["GLOBAL"]["asynclog"]) >> asynclog;
+    if (asynclog){
+        buffersize = 1 << 20;
+        auto option = config["GLOBAL"].find("logbuffersize");
+        if (option != config["GLOBAL"].end())
+            istringstream(option->second) >> buffersize;
+        if (buffersize == 0)
+            throw runtime_error("logbuffersize has to be larger than zero!");
+        front.data.reserve(buffersize);
+        back.data.reserve(buffersize);
+        writer = thread(&TLogger::WriteLoop, this);
+    }
 }
 
-void TLogger::PrintSnapshot(const std::unique_ptr<TParticle>& p, const value_type x1, const state_type &y1, const value_type x2, const state_type &y2,
-                   const state_type &spin, const dense_stepper_type& stepper, const TGeometry &geom, const TFieldManager &field){
-    bool log = false;
-    istringstream(config[p->GetName()]["snapshotlog"]) >> log;
-    if (not log)
+void TLogger::ReadLogSettings(const std::string &particlename, const std::string &suffix,
+                              const std::vector<std::string> &columns, const std::vector<std::string> &default_titles, TLogSettings &logsettings){
+    const map<string, string> &particleconf = config[particlename];
+    auto option = particleconf.find(suffix + "log");
+    if (option != particleconf.end())
+        istringstream(option->second) >> logsettings.enabled;
+    option = particleconf.find(suffix + "loginterval");
+    if (option != particleconf.end())
+        istringstream(option->second) >> logsettings.interval;
+    option = particleconf.find(suffix + "logtolerance");
+    if (option != particleconf.end())
+        istringstream(option->second) >> logsettings.tolerance;
+    option = particleconf.find(suffix + "logfilter");
+    if (option != particleconf.end())
+        istringstream(option->second) >> logsettings.filter;
+    option = particleconf.find(suffix + "logvars");
+    if (option != particleconf.end()){
+        istringstream varstr(option->second);
+        logsettings.vars.assign(istream_iterator<string>(varstr), istream_iterator<string>());
+    }
+
+    for (auto &section: config){
+        if (section.first != "HISTOGRAMS")
+            continue;
+        const vector<string> logtypes = {"end", "snapshot", "track", "hit", "spin", "diagnostic"};
+        for (auto &h: section.second){ // <name> <particle> <logtype> <variable> <nbins> <min> <max> [<filter> [<weight>]]
+            TLogHistogram hist;
+            string particle, logtype;
+            istringstream histstr(h.second);
+            histstr >> particle >> logtype >> hist.variable >> hist.nbins >> hist.min >> hist.max;
+            if (not histstr or hist.nbins == 0 or not (hist.max > hist.min))
+                throw runtime_error("Could not read histogram " + h.first + " " + h.second);
+            if (find(logtypes.begin(), logtypes.end(), logtype) == logtypes.end())
+                throw runtime_error("Histogram " + h.first + " uses unknown log type " + logtype);
+            if (particle != particlename or logtype != suffix)
+                continue;
+            histstr >> hist.filter >> hist.weight;
+            if (hist.filter == "-")
+                hist.filter = "";
+            hist.name = h.first;
+            hist.entries.assign(hist.nbins + 2, 0.); // first and last bin count underflows and overflows
+            hist.weights.assign(hist.nbins + 2, 0.);
+            hist.weights2.assign(hist.nbins + 2, 0.);
+            logsettings.histograms.push_back(hist);
+        }
+    }
+
+    logsettings.particlename = particlename;
+    logsettings.suffix = suffix;
+    logsettings.row.assign(columns.size(), 0.);
+    logsettings.needed.assign(columns.size(), false);
+    logsettings.write = logsettings.enabled;
+    logsettings.enabled = logsettings.write or not logsettings.histograms.empty();
+    if (not logsettings.enabled)
         return;
-    istringstream snapshottimes(config[p->GetName()]["snapshots"]);
-    auto tsnap = find_if(istream_iterator<double>(snapshottimes), istream_iterator<double>(), [&](const double& tsnapshot){ return x1 <= tsnapshot and tsnapshot < x2; });
-    if (tsnap != istream_iterator<double>()){
-        state_type ysnap(STATE_VARIABLES);
-        stepper.calc_state(*tsnap, ysnap);
-        Print(p, *tsnap, ysnap, spin, geom, field, "snapshot");
+
+    if (logsettings.write and logsettings.vars.empty()){
+        logsettings.vars = default_titles;
+        logsettings.defaultvars = true;
+    }
+
+    exprtk::symbol_table<double> symbols; // formulas reference the values in row
+    for (unsigned i = 0; i < columns.size(); ++i){
+        if (not symbols.add_variable(columns[i], logsettings.row[i]))
+            throw std::runtime_error("Error parsing variable " + columns[i]);
     }
+    auto markNeeded = [&](const vector<string> &usedvariables){ // mark columns used by formula
+        for (auto &var: usedvariables){
+            for (unsigned i = 0; i < columns.size(); ++i){
+                if (boost::iequals(var, columns[i]))
+                    logsettings.needed[i] = true;
+            }
+        }
+    };
+
+    auto findColumn = [&](const string &var){ // return index of column, or -1 if var is a formula
+        auto column = find(columns.begin(), columns.end(), var);
+        if (column == columns.end())
+            return -1;
+        logsettings.needed[column - columns.begin()] = true;
+        return int(column - columns.begin());
+    };
+
+    vector<string> usedvariables;
+    for (auto &hist: logsettings.histograms){
+        hist.column = findColumn(hist.variable);
+        if (hist.column < 0){
+            CompileFormula(config, hist.variable, symbols, hist.formula, usedvariables);
+            markNeeded(usedvariables);
+        }
+        if (hist.filter != ""){
+            CompileFormula(config, hist.filter, symbols, hist.filterformula, usedvariables);
+            markNeeded(usedvariables);
+        }
+        if (hist.weight != ""){
+            hist.weightcolumn = findColumn(hist.weight);
+            if (hist.weightcolumn < 0){
+                CompileFormula(config, hist.weight, symbols, hist.weightformula, usedvariables);
+                markNeeded(usedvariables);
+            }
+        }
+    }
+    if (not logsettings.write)
+        return;
+
+    if (logsettings.filter != ""){
+        CompileFormula(config, logsettings.filter, symbols, logsettings.filterformula, usedvariables);
+        markNeeded(usedvariables);
+    }
+    logsettings.formulas.resize(logsettings.vars.size());
+    for (unsigned i = 0; i < logsettings.vars.size(); ++i){
+        auto column = find(columns.begin(), columns.end(), logsettings.vars[i]);
+        if (column != columns.end()){
+            logsettings.columns.push_back(column - columns.begin());
+            logsettings.needed[column - columns.begin()] = true;
+        }
+        else{
+            logsettings.columns.push_back(-1);
+            CompileFormula(config, logsettings.vars[i], symbols, logsettings.formulas[i], usedvariables);
+            markNeeded(usedvariables);
+        }
+    }
+    logsettings.values.resize(logsettings.vars.size());
+}
+
+TParticleLogSettings& TLogger::GetSettings(const std::string &particlename){
+    if (lastsettings == nullptr or *lastparticlename != particlename){
+        auto s = settings.find(particlename);
+        if (s == settings.end()){ // particle type without config section, logs nothing
+            s = settings.emplace(piecewise_construct, forward_as_tuple(particlename), forward_as_tuple()).first;
+        }
+        lastparticlename = &s->first;
+        lastsettings = &s->second;
+    }
+    return *lastsettings;
+}
+
+
+void TLogger::Print(const std::unique_ptr<TParticle>& p, const value_type x, const state_type &y, const spin_state_type &spin,
+        const TGeometry &geom, const TFieldManager &field, const std::string suffix){
+    PROFILE(PROFILE_PRINT);
+    TParticleLogSettings &s = GetSettings(p->GetName());
+    if (suffix != "snapshot"){
+        FlushTrack(p, field);
+        for (auto &m: efficiencymaps)
+            m.Finish(*p);
+        auto trajectory = trajectories.find(p.get());
+        if (trajectory != trajectories.end()){
+            ofstream &file = trajectoryfiles[p->GetName()];
+            if (not file.is_open()){
+                bool append = false;
+                istringstream(config["GLOBAL"]["appendlog"]) >> append;
+                boost::filesystem::path outfile = OutputFile(p->GetName() + "trajectory.bin");
+                bool header = not append || not boost::filesystem::exists(outfile) || boost::filesystem::file_size(outfile) == 0;
+                file.open(outfile.c_str(), (append ? ios::app : ios::out) | ios::binary);
+                if (not file.is_open())
+                    throw std::runtime_error("Could not open " + outfile.native());
+                if (header)
+                    file.write(TRAJECTORY_HEADER, sizeof(TRAJECTORY_HEADER) - 1);
+            }
+            file << p->GetName() << ' ';
+            p->WriteState(file);
+            double count = trajectory->second.size();
+            file.write(reinterpret_cast<const char*>(&count), sizeof(count));
+            file.write(reinterpret_cast<const char*>(trajectory->second.data()), trajectory->second.size()*sizeof(TTrajectoryKnot));
+            if (not file)
+                throw std::runtime_error("Could not write trajectory file of " + p->GetName());
+            trajectories.erase(trajectory);
+        }
+    }
+    TLogSettings &logsettings = suffix == "snapshot" ? s.snapshot : s.end;
+    if (not logsettings.enabled)
+        return;
+
+    vector<double> &row = logsettings.row;
+    const vector<bool> &needed = logsettings.needed;
+
+    value_type tstart = p->GetInitialTime();
+    const state_type &ystart = p->GetInitialState();
+    const spin_state_type &spinstart = p->GetInitialSpin();
+    if (needed[endlog::Bstart] or needed[endlog::Ustart]){
+        double Bs[3], Eistart[3], Vstart;
+        field.BField(ystart[0], ystart[1], ystart[2], tstart, Bs);
+        field.EField(ystart[0], ystart[1], ystart[2], tstart, Vstart, Eistart);
+        row[endlog::Bstart] = sqrt(Bs[0]*Bs[0] + Bs[1]*Bs[1] + Bs[2]*Bs[2]);
+        row[endlog::Ustart] = Vstart;
+    }
+    if (needed[endlog::Hstart])
+        row[endlog::Hstart] = p->GetInitialTotalEnergy(geom, field);
+
+    value_type Ekin = p->GetKineticEnergy(&y[3]);
+    if (needed[endlog::Hend] or needed[endlog::solidend]){
+        const solid &sld = geom.GetSolid(x, &y[0]);
+        row[endlog::Hend] = Ekin + p->GetPotentialEnergy(x, y, field, sld);
+        row[endlog::solidend] = sld.ID;
+    }
+    if (needed[endlog::Bend] or needed[endlog::Uend]){
+        double B[3], Ei[3], V;
+        field.BField(y[0], y[1], y[2], x, B);
+        field.EField(y[0], y[1], y[2], x, V, Ei);
+        row[endlog::Bend] = sqrt(B[0]*B[0] + B[1]*B[1] + B[2]*B[2]);
+        row[endlog::Uend] = V;
+    }
+
+    row[endlog::jobnumber] = jobnumber;
+    row[endlog::particle] = p->GetParticleNumber();
+    row[endlog::m] = p->GetMass();
+    row[endlog::q] = p->GetCharge();
+    row[endlog::mu] = p->GetMagneticMoment();
+    row[endlog::tstart] = tstart;
+    row[endlog::xstart] = ystart[0];
+    row[endlog::ystart] = ystart[1];
+    row[endlog::zstart] = ystart[2];
+    row[endlog::vxstart] = ystart[3];
+    row[endlog::vystart] = ystart[4];
+    row[endlog::vzstart] = ystart[5];
+    row[endlog::polstart] = ystart[7];
+    row[endlog::Sxstart] = spinstart[0];
+    row[endlog::Systart] = spinstart[1];
+    row[endlog::Szstart] = spinstart[2];
+    row[endlog::Estart] = p->GetInitialKineticEnergy();
+    row[endlog::solidstart] = p->GetInitialSolid().ID;
+    row[endlog::tend] = x;
+    row[endlog::xend] = y[0];
+    row[endlog::yend] = y[1];
+    row[endlog::zend] = y[2];
+    row[endlog::vxend] = y[3];
+    row[endlog::vyend] = y[4];
+    row[endlog::vzend] = y[5];
+    row[endlog::polend] = y[7];
+    row[endlog::Sxend] = spin[0];
+    row[endlog::Syend] = spin[1];
+    row[endlog::Szend] = spin[2];
+    row[endlog::Eend] = Ekin;
+    row[endlog::stopID] = p->GetStopID();
+    row[endlog::Nspinflip] = p->GetNumberOfSpinflips();
+    row[endlog::spinflipprob] = 1 - p->GetNoSpinFlipProbability();
+    row[endlog::Nhit] = p->GetNumberOfHits();
+    row[endlog::Nstep] = p->GetNumberOfSteps();
+    row[endlog::propert] = y[6];
+    row[endlog::trajlength] = y[8];
+    row[endlog::Hmax] = p->GetMaxTotalEnergy();
+    row[endlog::wL] = spin[3] > 0 ? spin[4]/spin[3] : 0.;
+    row[endlog::statweight] = p->GetStatisticalWeight();
+    row[endlog::fatesampled] = p->IsFateSampled();
+    row[endlog::cell1] = p->GetCell()[0];
+    row[endlog::cell2] = p->GetCell()[1];
+    row[endlog::cell3] = p->GetCell()[2];
+    const TTrackingCost &cost = p->TrackingCost();
+    row[endlog::walltime] = cost.walltime;
+    row[endlog::cputime] = cost.cputime;
+    row[endlog::Nderivs] = cost.derivs;
+    row[endlog::Ncollisionqueries] = cost.collisionqueries;
+    row[endlog::stepmean] = cost.steps > 0 ? cost.stepsum/cost.steps : 0.;
+    row[endlog::stepmin] = cost.steps > 0 ? cost.minstep : 0.;
+    row[endlog::Niterations] = cost.iterations;
+    row[endlog::Nspinstep] = cost.spinsteps;
+    const vector<double> &weights = p->GetSurvivalWeights();
+    for (unsigned i = endlog::lastcolumn + 1; i < row.size(); ++i) // particles without weighted tracking always survive
+        row[i] = i - endlog::lastcolumn - 1 < weights.size() ? weights[i - endlog::lastcolumn - 1] : 1.;
+
+    Log(p->GetName(), suffix, logsettings);
+}
+
+bool TLogger::PrintSnapshot(const std::unique_ptr<TParticle>& p, const value_type x1, const state_type &y1, const value_type x2, const state_type &y2,
+                   const spin_state_type &spin, const TStepper & stepper, const TGeometry &geom, const TFieldManager &field){
+    PROFILE(PROFILE_PRINTSNAPSHOT);
+    TParticleLogSettings &s = GetSettings(p->GetName());
+    if (not s.snapshot.enabled)
+        return false;
+    auto first = lower_bound(s.snapshots.begin(), s.snapshots.end(), x1); // first snapshot time >= x1
+    auto last = lower_bound(first, s.snapshots.end(), x2); // first snapshot time >= x2, long steps can contain several snapshot times
+    if (first == last)
+        return false;
+    vector<state_type> ysnap(last - first);
+    for (auto tsnap = first; tsnap != last; ++tsnap) // interpolate all snapshots of this step before logging them, so the stepper's dense output is evaluated in one pass
+        stepper.calc_state(*tsnap, ysnap[tsnap - first]);
+    for (auto tsnap = first; tsnap != last; ++tsnap)
+        Print(p, *tsnap, ysnap[tsnap - first], spin, geom, field, "snapshot");
+    return true;
+}
+
+/**
+ * Calculate distance of a point from a line segment
+ *
+ * @param r Point
+ * @param a Start of segment
+ * @param b End of segment
+ *
+ * @return Returns distance
+ */
+static double SegmentDistance(const std::array<double, 3> &r, const std::array<double, 3> &a, const std::array<double, 3> &b){
+    double ab[3], ar[3], ab2 = 0, abar = 0;
+    for (int i = 0; i < 3; ++i){
+        ab[i] = b[i] - a[i];
+        ar[i] = r[i] - a[i];
+        ab2 += ab[i]*ab[i];
+        abar += ab[i]*ar[i];
+    }
+    double s = ab2 > 0 ? max(0., min(1., abar/ab2)) : 0.; // closest point on segment is a + s*ab
+    double d2 = 0;
+    for (int i = 0; i < 3; ++i)
+        d2 += pow(ar[i] - s*ab[i], 2);
+    return sqrt(d2);
 }
 
 void TLogger::PrintTrack(const std::unique_ptr<TParticle>& p, const value_type x1, const state_type &y1, const value_type x, const state_type& y,
-                const state_type &spin, const solid &sld, const TFieldManager &field){
-    bool log = false;
-    double interval = 0.;
-    istringstream(config[p->GetName()]["tracklog"]) >> log;
-    istringstream(config[p->GetName()]["trackloginterval"]) >> interval;
-    if (not log or interval <= 0)
+                const spin_state_type &spin, const solid &sld, const TFieldManager &field, const bool keep){
+    PROFILE(PROFILE_PRINTTRACK);
+    TLogSettings &logsettings = GetSettings(p->GetName()).track;
+    if (not logsettings.enabled)
+        return;
+
+    if (logsettings.tolerance > 0){
+        auto it = tracksimplifications.find(p.get());
+        if (it == tracksimplifications.end()){ // first point of track
+            LogTrackPoint(p, x, y, sld, field);
+            tracksimplifications[p.get()].anchor = {{y[0], y[1], y[2]}};
+            return;
+        }
+        if (x == x1) // repeated start point of a continued track
+            return;
+        TTrackSimplification &s = it->second;
+        const std::array<double, 3> r = {{y[0], y[1], y[2]}};
+        bool fits = s.window.size() < MAX_TRACK_WINDOW && all_of(s.window.begin(), s.window.end(),
+                [&](const std::array<double, 3> &w){ return SegmentDistance(w, s.anchor, r) <= logsettings.tolerance; });
+        if (not fits){ // candidate cannot be dropped, log it and continue from there
+            LogTrackPoint(p, s.x, s.y, *s.sld, field);
+            s.anchor = s.window.back();
+            s.window.clear();
+        }
+        if (keep){
+            LogTrackPoint(p, x, y, sld, field);
+            s.anchor = r;
+            s.window.clear();
+        }
+        else{
+            s.window.push_back(r);
+            s.x = x;
+            s.y = y;
+            s.sld = &sld;
+        }
+        return;
+    }
+
+    double interval = logsettings.interval;
+    if (interval <= 0)
         return;
 
     if (y[8] > 0 and int(y1[8]/interval) == int(y[8]/interval)) // if this is the first point or tracklength did cross an integer multiple of trackloginterval
         return;
 
-    double B[3] = {0,0,0};
-    double dBidxj[3][3] = {{0,0,0},{0,0,0},{0,0,0}};
-    double E[3] = {0,0,0};
-    double V = 0;
-    field.BField(y[0],y[1],y[2],x,B, dBidxj);
-    field.EField(y[0],y[1],y[2],x,V,E);
+    LogTrackPoint(p, x, y, sld, field);
+}
+
+void TLogger::FlushTrack(const std::unique_ptr<TParticle>& p, const TFieldManager &field){
+    auto it = tracksimplifications.find(p.get());
+    if (it == tracksimplifications.end())
+        return;
+    if (not it->second.window.empty())
+        LogTrackPoint(p, it->second.x, it->second.y, *it->second.sld, field);
+    tracksimplifications.erase(it);
+}
+
+void TLogger::LogTrackPoint(const std::unique_ptr<TParticle>& p, const value_type x, const state_type &y, const solid &sld, const TFieldManager &field){
+    TLogSettings &logsettings = GetSettings(p->GetName()).track;
+    vector<double> &row = logsettings.row;
+    const vector<bool> &needed = logsettings.needed;
+
+    if (any_of(needed.begin() + tracklog::Bx, needed.begin() + tracklog::dBzdz + 1, [](bool n){ return n; })){
+        double B[3] = {0,0,0};
+        double dBidxj[3][3] = {{0,0,0},{0,0,0},{0,0,0}};
+        field.BField(y[0],y[1],y[2],x,B, dBidxj);
+        for (int i = 0; i < 3; ++i){
+            row[tracklog::Bx + 4*i] = B[i];
+            for (int j = 0; j < 3; ++j)
+                row[tracklog::Bx + 4*i + 1 + j] = dBidxj[i][j];
+        }
+    }
+    if (needed[tracklog::Ex] or needed[tracklog::Ey] or needed[tracklog::Ez] or needed[tracklog::V]){
+        double Ei[3] = {0,0,0};
+        double U = 0;
+        field.EField(y[0],y[1],y[2],x,U,Ei);
+        row[tracklog::Ex] = Ei[0];
+        row[tracklog::Ey] = Ei[1];
+        row[tracklog::Ez] = Ei[2];
+        row[tracklog::V] = U;
+    }
     value_type Ek = p->GetKineticEnergy(&y[3]);
-    value_type H = Ek + p->GetPotentialEnergy(x, y, field, sld);
-
-    map<string, double> variables = {{"jobnumber", static_cast<double>(jobnumber)},
-                                     {"particle", static_cast<double>(p->GetParticleNumber())},
-                                     {"polarisation", y[7]},
-                                     {"t", x},
-                                     {"x", y[0]},
-                                     {"y", y[1]},
-                                     {"z", y[2]},
-                                     {"vx", y[3]},
-                                     {"vy", y[4]},
-                                     {"vz", y[5]},
-                                     {"H", H},
-                                     {"E", Ek},
-                                     {"Bx", B[0]},
-                                     {"dBxdx", dBidxj[0][0]},
-                                     {"dBxdy", dBidxj[0][1]},
-                                     {"dBxdz", dBidxj[0][2]},
-                                     {"By", B[1]},
-                                     {"dBydx", dBidxj[1][0]},
-                                     {"dBydy", dBidxj[1][1]},
-                                     {"dBydz", dBidxj[1][2]},
-                                     {"Bz", B[2]},
-                                     {"dBzdx", dBidxj[2][0]},
-                                     {"dBzdy", dBidxj[2][1]},
-                                     {"dBzdz", dBidxj[2][2]},
-                                     {"Ex", E[0]},
-                                     {"Ey", E[1]},
-                                     {"Ez", E[2]},
-                                     {"V", V}
-                                    };
-
-    vector<string> default_titles = {"jobnumber", "particle",
-                                     "polarisation", "t", "x", "y", "z", "vx", "vy", "vz", "H", "E",
-                                     "Bx", "dBxdx", "dBxdy", "dBxdz", "By", "dBydx", "dBydy", "dBydz", "Bz", "dBzdx", "dBzdy", "dBzdz",
-                                     "Ex", "Ey", "Ez", "V"};
+    if (needed[tracklog::H])
+        row[tracklog::H] = Ek + p->GetPotentialEnergy(x, y, field, sld);
+
+    row[tracklog::jobnumber] = jobnumber;
+    row[tracklog::particle] = p->GetParticleNumber();
+    row[tracklog::polarisation] = y[7];
+    row[tracklog::t] = x;
+    row[tracklog::x] = y[0];
+    row[tracklog::y] = y[1];
+    row[tracklog::z] = y[2];
+    row[tracklog::vx] = y[3];
+    row[tracklog::vy] = y[4];
+    row[tracklog::vz] = y[5];
+    row[tracklog::E] = Ek;
 
-    Log(p->GetName(), "track", variables, default_titles);
+    Log(p->GetName(), "track", logsettings);
 }
 
 void TLogger::PrintHit(const std::unique_ptr<TParticle>& p, const value_type x, const state_type &y1, const state_type &y2, const double *normal, const solid &leaving, const solid &entering){
-    bool log = false;
-    istringstream(config[p->GetName()]["hitlog"]) >> log;
-    if (not log)
+    PROFILE(PROFILE_PRINTHIT);
+    TLogSettings &logsettings = GetSettings(p->GetName()).hit;
+    if (not logsettings.enabled)
         return;
 
-    map<string, double> variables = {{"jobnumber", static_cast<double>(jobnumber)},
-                                     {"particle", static_cast<double>(p->GetParticleNumber())},
-                                     {"t", x},
-                                     {"x", y1[0]},
-                                     {"y", y1[1]},
-                                     {"z", y1[2]},
-                                     {"v1x", y1[3]},
-                                     {"v1y", y1[4]},
-                                     {"v1z", y1[5]},
-                                     {"pol1", y1[7]},
-                                     {"v2x", y2[3]},
-                                     {"v2y", y2[4]},
-                                     {"v2z", y2[5]},
-                                     {"pol2", y2[7]},
-                                     {"nx", normal[0]},
-                                     {"ny", normal[1]},
-                                     {"nz", normal[2]},
-                                     {"solid1", static_cast<double>(leaving.ID)},
-                                     {"solid2", static_cast<double>(entering.ID)}
-                                    };
-
-    vector<string> default_titles = {"jobnumber", "particle",
-                                     "t", "x", "y", "z",
-                                     "v1x", "v1y", "v1z", "pol1", "v2x", "v2y", "v2z", "pol2",
-                                     "nx", "ny", "nz", "solid1", "solid2"};
+    vector<double> &row = logsettings.row;
+    row[hitlog::jobnumber] = jobnumber;
+    row[hitlog::particle] = p->GetParticleNumber();
+    row[hitlog::t] = x;
+    row[hitlog::x] = y1[0];
+    row[hitlog::y] = y1[1];
+    row[hitlog::z] = y1[2];
+    row[hitlog::v1x] = y1[3];
+    row[hitlog::v1y] = y1[4];
+    row[hitlog::v1z] = y1[5];
+    row[hitlog::pol1] = y1[7];
+    row[hitlog::v2x] = y2[3];
+    row[hitlog::v2y] = y2[4];
+    row[hitlog::v2z] = y2[5];
+    row[hitlog::pol2] = y2[7];
+    row[hitlog::nx] = normal[0];
+    row[hitlog::ny] = normal[1];
+    row[hitlog::nz] = normal[2];
+    row[hitlog::solid1] = leaving.ID;
+    row[hitlog::solid2] = entering.ID;
+
+    Log(p->GetName(), "hit", logsettings);
+}
 
-    Log(p->GetName(), "hit", variables, default_titles);
+void TLogger::TallyHit(const std::unique_ptr<TParticle>& p, const state_type &y1, const TCollision &coll, const bool absorbed, const TGeometry &geom){
+    if (not GetSettings(p->GetName()).hitmap)
+        return;
+    std::uint32_t triangle = coll.triangle;
+    if (triangle == NO_TRIANGLE){ // face plane of convex mesh or analytic primitive
+        triangle = geom.mesh->ClosestTriangle(coll.ID, &y1[0]);
+        if (triangle == NO_TRIANGLE)
+            return;
+    }
+    auto key = make_pair(p->GetName(), coll.ID);
+    auto hitmap = hitmaps.find(key);
+    if (hitmap == hitmaps.end())
+        hitmap = hitmaps.emplace(key, THitMap(geom.mesh->GetSolidTriangles(coll.ID).size())).first;
+    hitmapgeometry = &geom;
+    double v = sqrt(y1[3]*y1[3] + y1[4]*y1[4] + y1[5]*y1[5]);
+    double vnormal = abs(y1[3]*coll.normal[0] + y1[4]*coll.normal[1] + y1[5]*coll.normal[2]);
+    hitmap->second.Add(triangle, p->GetStatisticalWeight(), p->GetKineticEnergy(&y1[3]), acos(min(1., vnormal/v))/conv, absorbed);
 }
 
-void TLogger::PrintSpin(const std::unique_ptr<TParticle>& p, const value_type x, const dense_stepper_type& spinstepper,
-               const dense_stepper_type &trajectory_stepper, const TFieldManager &field) {
-    bool log = false;
-    double interval = 0.;
-    istringstream(config[p->GetName()]["spinlog"]) >> log;
-    istringstream(config[p->GetName()]["spinloginterval"]) >> interval;
-    if (not log or interval <= 0)
+void TLogger::PrintSpin(const std::unique_ptr<TParticle>& p, const value_type x1, const value_type x, const spin_state_type &spin,
+               const TStepper &trajectory_stepper, const TFieldManager &field) {
+    PROFILE(PROFILE_PRINTSPIN);
+    TLogSettings &logsettings = GetSettings(p->GetName()).spin;
+    double interval = logsettings.interval;
+    if (not logsettings.enabled or interval <= 0)
         return;
 
-    double x1 = spinstepper.previous_time();
     if (x > x1 and int(x1 / interval) == int(x / interval)) // if time crossed an integer multiple of spinloginterval
         return;
 
-    double B[3] = {0,0,0};
-    state_type y(STATE_VARIABLES);
+    vector<double> &row = logsettings.row;
+    const vector<bool> &needed = logsettings.needed;
+
+    state_type y;
     trajectory_stepper.calc_state(x, y);
-    field.BField(y[0],y[1],y[2],x,B);
-    double Omega[3];
-    p->SpinPrecessionAxis(x, trajectory_stepper, field, Omega[0], Omega[1], Omega[2]);
-
-    state_type spin(spinstepper.current_state());
-    if (x < spinstepper.current_time()){
-        spinstepper.calc_state(x, spin);
-    }
-
-    map<string, double> variables = {{"jobnumber", static_cast<double>(jobnumber)},
-                                     {"particle", static_cast<double>(p->GetParticleNumber())},
-                                     {"t", x},
-                                     {"x", y[0]},
-                                     {"y", y[1]},
-                                     {"z", y[2]},
-                                     {"Sx", spin[0]},
-                                     {"Sy", spin[1]},
-                                     {"Sz", spin[2]},
-                                     {"Wx", Omega[0]},
-                                     {"Wy", Omega[1]},
-                                     {"Wz", Omega[2]},
-                                     {"Bx", B[0]},
-                                     {"By", B[1]},
-                                     {"Bz", B[2]}
-                                    };
-
-    vector<string> default_titles = {"jobnumber", "particle",
-                                     "t", "x", "y", "z",
-                                     "Sx", "Sy", "Sz", "Wx", "Wy", "Wz", "Bx", "By", "Bz"};
+    if (needed[spinlog::Bx] or needed[spinlog::By] or needed[spinlog::Bz]){
+        double B[3] = {0,0,0};
+        field.BField(y[0],y[1],y[2],x,B);
+        row[spinlog::Bx] = B[0];
+        row[spinlog::By] = B[1];
+        row[spinlog::Bz] = B[2];
+    }
+    if (needed[spinlog::Wx] or needed[spinlog::Wy] or needed[spinlog::Wz]){
+        double Omega[3];
+        p->SpinPrecessionAxis(x, trajectory_stepper, field, Omega[0], Omega[1], Omega[2]);
+        row[spinlog::Wx] = Omega[0];
+        row[spinlog::Wy] = Omega[1];
+        row[spinlog::Wz] = Omega[2];
+    }
 
-    Log(p->GetName(), "spin", variables, default_titles);
+    row[spinlog::jobnumber] = jobnumber;
+    row[spinlog::particle] = p->GetParticleNumber();
+    row[spinlog::t] = x;
+    row[spinlog::x] = y[0];
+    row[spinlog::y] = y[1];
+    row[spinlog::z] = y[2];
+    row[spinlog::Sx] = spin[0];
+    row[spinlog::Sy] = spin[1];
+    row[spinlog::Sz] = spin[2];
+
+    Log(p->GetName(), "spin", logsettings);
 }
 
-void TLogger::Log(const std::string &particlename, const std::string &suffix, const std::map<std::string, double> &variables, const std::vector<std::string> &default_titles){
-    vector<string> titles;
-    vector<double> vars;
-    string filter;
-    istringstream(config[particlename][suffix + "logfilter"]) >> filter;
-    if (filter != "" and not EvalFormula(config, filter, variables)){
+void TLogger::PrintDiagnostic(const std::unique_ptr<TParticle>& p, const TDiagnostic code, const value_type x, const state_type &y, const solid &sld, const double value){
+    Diagnostics::Count(code, sld.ID, p->GetParticleNumber(), x, &y[0], value);
+    TLogSettings &logsettings = GetSettings(p->GetName()).diagnostic;
+    if (not logsettings.enabled)
         return;
+
+    vector<double> &row = logsettings.row;
+    row[diagnosticlog::jobnumber] = jobnumber;
+    row[diagnosticlog::particle] = p->GetParticleNumber();
+    row[diagnosticlog::code] = code;
+    row[diagnosticlog::t] = x;
+    row[diagnosticlog::x] = y[0];
+    row[diagnosticlog::y] = y[1];
+    row[diagnosticlog::z] = y[2];
+    row[diagnosticlog::vx] = y[3];
+    row[diagnosticlog::vy] = y[4];
+    row[diagnosticlog::vz] = y[5];
+    row[diagnosticlog::polarisation] = y[7];
+    row[diagnosticlog::solid] = sld.ID;
+    row[diagnosticlog::Nstep] = p->GetNumberOfSteps();
+    row[diagnosticlog::Nhit] = p->GetNumberOfHits();
+    row[diagnosticlog::cputime] = p->TrackingCost().cputime;
+    row[diagnosticlog::value] = value;
+
+    Log(p->GetName(), "diagnostic", logsettings);
+}
+
+void TLogger::PrintPhaseSpace(const std::unique_ptr<TParticle>& p, const value_type x, const state_type &y, const spin_state_type &spin){
+    ofstream &file = phasespacefiles[p->GetName()];
+    if (not file.is_open()){
+        bool append = false;
+        istringstream(config["GLOBAL"]["appendlog"]) >> append;
+        boost::filesystem::path outfile = OutputFile(p->GetName() + "phasespace.bin");
+        bool header = not append || not boost::filesystem::exists(outfile) || boost::filesystem::file_size(outfile) == 0;
+        file.open(outfile.c_str(), (append ? ios::app : ios::out) | ios::binary);
+        if (not file.is_open())
+            throw std::runtime_error("Could not open " + outfile.native());
+        if (header)
+            file.write(PHASESPACE_HEADER, sizeof(PHASESPACE_HEADER) - 1);
+    }
+    TPhaseSpaceRecord record = {x, y[0], y[1], y[2], y[3], y[4], y[5], y[7], spin[0], spin[1], spin[2], p->GetStatisticalWeight()};
+    file.write(reinterpret_cast<const char*>(&record), sizeof(record));
+    if (not file)
+        throw std::runtime_error("Could not write phase-space file of " + p->GetName());
+}
+
+
+void TLogger::PrintTransfer(const std::unique_ptr<TParticle>& p, const unsigned entryID, const value_type x1, const state_type &y1, const double weight1,
+                            const value_type x2, const state_type &y2, const int stopID){
+    string name = p->GetName() + "transfer" + to_string(entryID);
+    ofstream &file = transferfiles[name];
+    if (not file.is_open()){
+        bool append = false;
+        istringstream(config["GLOBAL"]["appendlog"]) >> append;
+        boost::filesystem::path outfile = OutputFile(name + ".bin");
+        bool header = not append || not boost::filesystem::exists(outfile) || boost::filesystem::file_size(outfile) == 0;
+        file.open(outfile.c_str(), (append ? ios::app : ios::out) | ios::binary);
+        if (not file.is_open())
+            throw std::runtime_error("Could not open " + outfile.native());
+        if (header)
+            file.write(TRANSFER_HEADER, sizeof(TRANSFER_HEADER) - 1);
     }
-    if (config[particlename][suffix + "logvars"] == ""){
+    TTransferRecord record = {y1[3], y1[4], y1[5], x2 - x1, y2[6] - y1[6], y2[8] - y1[8], y2[0], y2[1], y2[2], y2[3], y2[4], y2[5],
+                              p->GetStatisticalWeight()/weight1, static_cast<double>(stopID)};
+    file.write(reinterpret_cast<const char*>(&record), sizeof(record));
+    if (not file)
+        throw std::runtime_error("Could not write transfer file of " + p->GetName());
+}
+
+
+void TLogger::PrintTrajectory(const std::unique_ptr<TParticle>& p, const TStepper &stepper, const value_type x, const state_type &y){
+    if (not GetSettings(p->GetName()).trajectory)
+        return;
+    vector<TTrajectoryKnot> &knots = trajectories[p.get()];
+    auto jumped = [](const TTrajectoryKnot &knot, const value_type t, const state_type &s){ // polarisation changed by spin tracking between steps is not a jump
+        return knot.t != t || not equal(s.begin(), s.begin() + 6, knot.y.begin());
+    };
+    value_type x1 = stepper.previous_time();
+    const state_type &y1 = stepper.previous_state();
+    if (knots.empty() || jumped(knots.back(), x1, y1))
+        knots.push_back({x1, y1, 0.});
+    state_type y2;
+    stepper.calc_state(x, y2);
+    knots.push_back({x, y2, 1.});
+    if (jumped(knots.back(), x, y) || y[7] != y2[7])
+        knots.push_back({x, y, 0.});
+}
+
+
+void TLogger::Log(const std::string &particlename, const std::string &suffix, TLogSettings &logsettings){
+    if (logsettings.defaultvars){
         cout << suffix << "log for " << particlename << " is enabled but " << suffix << "logvars is empty. I will default to backward compatible output.\nSee example config on how to use the new logvars and logfilter options.\n";
-        ostringstream os;
-        copy(default_titles.begin(), default_titles.end(), ostream_iterator<string>(os, " "));
-        config[particlename][suffix + "logvars"] = os.str();
-    }
-    istringstream varstr(config[particlename][suffix + "logvars"]);
-    for (istream_iterator<string> var(varstr); var != istream_iterator<string>(); ++var){
-        titles.push_back(*var);
-        auto val = variables.find(*var);
-        if (val != variables.end())
-            vars.push_back(val->second);
+        logsettings.defaultvars = false;
+    }
+    for (auto &hist: logsettings.histograms){
+        if (hist.filter != "" and not hist.filterformula.value())
+            continue;
+        double value = hist.column >= 0 ? logsettings.row[hist.column] : hist.formula.value();
+        double weight = 1;
+        if (hist.weight != "")
+            weight = hist.weightcolumn >= 0 ? logsettings.row[hist.weightcolumn] : hist.weightformula.value();
+        if (std::isnan(value))
+            continue;
+        unsigned bin; // 0: underflow, nbins + 1: overflow
+        if (value < hist.min)
+            bin = 0;
+        else if (value >= hist.max)
+            bin = hist.nbins + 1;
         else
-            vars.push_back(EvalFormula(config, *var, variables));
+            bin = std::min(hist.nbins, unsigned((value - hist.min)/(hist.max - hist.min)*hist.nbins) + 1); // rounding can push values just below max into overflow
+        hist.entries[bin] += 1;
+        hist.weights[bin] += weight;
+        hist.weights2[bin] += weight*weight;
     }
+    if (not logsettings.write)
+        return;
 
+    if (logsettings.filter != "" and not logsettings.filterformula.value()){
+        return;
+    }
+    for (unsigned i = 0; i < logsettings.columns.size(); ++i){
+        int column = logsettings.columns[i];
+        logsettings.values[i] = column >= 0 ? logsettings.row[column] : logsettings.formulas[i].value();
+    }
+
+    if (writer.joinable())
+        Enqueue(logsettings);
+    else
+        WriteRow(particlename, suffix, logsettings.vars, logsettings.values);
+}
+
+
+void TLogger::WriteRow(const std::string &particlename, const std::string &suffix, const std::vector<std::string> &titles, const std::vector<double> &vars){
+    auto entry = manifest.find(particlename + suffix);
+    if (entry == manifest.end()){
+        TLogManifestEntry table;
+        table.particlename = particlename;
+        table.logtype = suffix;
+        table.shard = shard;
+        table.columns = titles;
+        LocateTable(particlename, suffix, table);
+        entry = manifest.emplace(particlename + suffix, table).first;
+    }
     DoLog(particlename, suffix, titles, vars);
+    ++entry->second.rows;
+}
+
+
+static mutex manifestmutex; ///< Lock for finishedtables
+static vector<TLogManifestEntry> finishedtables; ///< Tables written by all loggers destroyed so far
+
+TLogger::~TLogger(){
+    lock_guard<mutex> lock(manifestmutex);
+    for (auto &table: manifest)
+        finishedtables.push_back(table.second);
+}
+
+
+std::vector<TLogManifestEntry> TLogger::TakeManifest(){
+    lock_guard<mutex> lock(manifestmutex);
+    vector<TLogManifestEntry> tables;
+    swap(tables, finishedtables);
+    return tables;
+}
+
+
+void TLogger::Enqueue(const TLogSettings &logsettings){
+    unique_lock<mutex> lock(buffermutex);
+    if (writererror)
+        rethrow_exception(writererror);
+    if (front.data.size() + logsettings.values.size() > buffersize and not front.rows.empty()){
+        backempty.wait(lock, [this]{ return back.rows.empty() or writererror; }); // wait until writer thread has caught up
+        if (writererror)
+            rethrow_exception(writererror);
+        swap(front, back);
+        backfull.notify_one();
+    }
+    front.rows.emplace_back(&logsettings, front.data.size());
+    front.data.insert(front.data.end(), logsettings.values.begin(), logsettings.values.end());
+}
+
+
+void TLogger::WriteLoop(){
+    vector<double> vars;
+    unique_lock<mutex> lock(buffermutex);
+    while (true){
+        // write partially filled buffer if no new entries arrived for a while or logger is closing
+        if (not backfull.wait_for(lock, chrono::seconds(1), [this]{ return not back.rows.empty() or finished; }) or back.rows.empty())
+            swap(front, back);
+        if (back.rows.empty()){
+            if (finished)
+                return;
+            continue;
+        }
+
+        lock.unlock();
+        try{
+            for (auto &row: back.rows){
+                const TLogSettings &logsettings = *row.first;
+                auto begin = back.data.begin() + row.second;
+                vars.assign(begin, begin + logsettings.values.size());
+                WriteRow(logsettings.particlename, logsettings.suffix, logsettings.vars, vars);
+            }
+        }
+        catch (...){
+            lock.lock();
+            writererror = current_exception();
+            backempty.notify_all();
+            return;
+        }
+        lock.lock();
+        back.rows.clear();
+        back.data.clear();
+        backempty.notify_all();
+    }
+}
+
+
+void TLogger::FinishLog(){
+    if (writer.joinable()){
+        {
+            lock_guard<mutex> lock(buffermutex);
+            finished = true;
+        }
+        backfull.notify_one();
+        writer.join();
+        if (writererror){
+            try{
+                rethrow_exception(writererror);
+            }
+            catch (const exception &e){
+                cerr << "Could not write log entries: " << e.what() << '\n';
+            }
+        }
+    }
+    try{
+        WriteHistograms();
+    }
+    catch (const exception &e){
+        cerr << "Could not write histograms: " << e.what() << '\n';
+    }
+    try{
+        bool append = false;
+        istringstream(config["GLOBAL"]["appendlog"]) >> append;
+        for (auto &hitmap: hitmaps){
+            string particlename = hitmap.first.first;
+            unsigned ID = hitmap.first.second;
+            hitmap.second.Write(OutputFile(particlename + "hitmap" + to_string(ID) + ".vtk"), hitmapgeometry->mesh->GetSolidTriangles(ID),
+                                "PENTrack " + particlename + " hits on solid " + to_string(ID), append);
+        }
+        hitmaps.clear(); // hit maps are only written once
+    }
+    catch (const exception &e){
+        cerr << "Could not write hit maps: " << e.what() << '\n';
+    }
+    try{
+        bool append = false;
+        istringstream(config["GLOBAL"]["appendlog"]) >> append;
+        for (auto &m: efficiencymaps)
+            m.Write(OutputFile(m.GetName() + ".map"), append);
+        efficiencymaps.clear(); // maps are only written once
+    }
+    catch (const exception &e){
+        cerr << "Could not write efficiency maps: " << e.what() << '\n';
+    }
+}
+
+
+void TLogger::WriteHistograms(){
+    bool append = false;
+    istringstream(config["GLOBAL"]["appendlog"]) >> append;
+    for (auto &particle: settings){
+        for (TLogSettings *logsettings: {&particle.second.end, &particle.second.snapshot, &particle.second.track,
+                                         &particle.second.hit, &particle.second.spin, &particle.second.diagnostic}){
+            for (auto &hist: logsettings->histograms){
+                boost::filesystem::path outfile = OutputFile(hist.name + ".hist");
+                if (append and boost::filesystem::exists(outfile)){ // add bins of histogram written before simulation was resumed
+                    ifstream infile(outfile.string());
+                    string header;
+                    getline(infile, header);
+                    for (unsigned i = 0; i < hist.nbins + 2; ++i){
+                        double lower, upper, entries, weight, weight2;
+                        if (not (infile >> lower >> upper >> entries >> weight >> weight2))
+                            throw runtime_error("Could not read " + outfile.string());
+                        hist.entries[i] += entries;
+                        hist.weights[i] += weight;
+                        hist.weights2[i] += weight2;
+                    }
+                }
+
+                ofstream file(outfile.string());
+                file << std::setprecision(std::numeric_limits<double>::max_digits10); // bins have to be added exactly when histograms are merged
+                file << "lower upper entries weight weight2\n";
+                for (unsigned i = 0; i < hist.nbins + 2; ++i){
+                    double lower = i == 0 ? -numeric_limits<double>::infinity() : hist.min + (i - 1)*(hist.max - hist.min)/hist.nbins;
+                    double upper = i == hist.nbins + 1 ? numeric_limits<double>::infinity() : hist.min + i*(hist.max - hist.min)/hist.nbins;
+                    file << lower << ' ' << upper << ' ' << hist.entries[i] << ' ' << hist.weights[i] << ' ' << hist.weights2[i] << '\n';
+                }
+                if (not file)
+                    throw runtime_error("Could not write " + outfile.string());
+            }
+            logsettings->histograms.clear(); // histograms are only written once
+        }
+    }
+}
+
+
+void TLogger::AddHistogramBins(std::map<std::string, THistogramBins> &bins) const{
+    for (auto &particle: settings){
+        for (const TLogSettings *logsettings: {&particle.second.end, &particle.second.snapshot, &particle.second.track,
+                                               &particle.second.hit, &particle.second.spin, &particle.second.diagnostic}){
+            for (auto &hist: logsettings->histograms){
+                THistogramBins &b = bins[hist.name];
+                if (b.weights.empty()){
+                    b.min = hist.min;
+                    b.max = hist.max;
+                    b.weights.assign(hist.nbins + 2, 0.);
+                    b.weights2.assign(hist.nbins + 2, 0.);
+                }
+                for (unsigned i = 0; i < hist.nbins + 2; ++i){
+                    b.weights[i] += hist.weights[i];
+                    b.weights2[i] += hist.weights2[i];
+                }
+            }
+        }
+    }
+}
+
+
+std::size_t TLogger::MemoryUsage() const{
+    std::size_t bytes = 2*buffersize*sizeof(double); // front and back buffer of asynchronous writer
+    for (auto &particle: settings){
+        for (const TLogSettings *logsettings: {&particle.second.end, &particle.second.snapshot, &particle.second.track,
+                                               &particle.second.hit, &particle.second.spin, &particle.second.diagnostic}){
+            for (auto &hist: logsettings->histograms)
+                bytes += (hist.entries.capacity() + hist.weights.capacity() + hist.weights2.capacity())*sizeof(double);
+        }
+    }
+    for (auto &hitmap: hitmaps)
+        bytes += hitmap.second.MemoryUsage();
+    for (auto &map: efficiencymaps)
+        bytes += map.MemoryUsage();
+    for (auto &trajectory: trajectories)
+        bytes += trajectory.second.capacity()*sizeof(TTrajectoryKnot);
+    for (auto &simplification: tracksimplifications)
+        bytes += simplification.second.window.capacity()*sizeof(std::array<double, 3>);
+    bytes += (phasespacefiles.size() + transferfiles.size() + trajectoryfiles.size())*BUFSIZ;
+    return bytes;
+}
+
+
+boost::filesystem::path TLogger::OutputFile(const std::string &name) const{
+    std::ostringstream filename;
+    filename << prefix << std::setw(12) << std::setfill('0') << jobnumber << std::setw(0);
+    if (shard >= 0)
+        filename << '_' << shard;
+    filename << name;
+    return outpath / filename.str();
+}
+
+
+TTextLogger::TTextLogger(TConfig &aconfig, const int ashard): TLogger(aconfig, ashard){
+    istringstream(aconfig["GLOBAL"]["appendlog"]) >> append;
+    istringstream(aconfig["GLOBAL"]["logcompression"]) >> compression;
+    if (compression == "none")
+        compression = "";
+    if (compression != "" and compression != "gzip" and compression != "bzip2")
+        throw runtime_error("Unknown logcompression " + compression);
+}
+
+
+std::size_t TTextLogger::MemoryUsage() const{
+    std::size_t bytes = TLogger::MemoryUsage();
+    for (auto &s: logstreams){
+        bytes += s.second.buffer.capacity() + BUFSIZ;
+        if (compression == "gzip")
+            bytes += 256*1024; // zlib deflate state with default window and memory level
+        else if (compression == "bzip2")
+            bytes += 7600*1024; // bzip2 compressor state with default block size of 900 kB
+    }
+    return bytes;
+}
+
+
+TTextLogger::~TTextLogger(){
+    FinishLog();
+    for (auto &s: logstreams){
+        try{
+            WriteBuffer(s.second, s.first);
+        }
+        catch (const exception &e){
+            cerr << e.what() << '\n';
+        }
+        if (not s.second.compressor.empty())
+            s.second.compressor.reset(); // flush compressor into file
+        s.second.file.close();
+    }
+}
+
+
+void TTextLogger::LocateTable(const std::string &particlename, const std::string &suffix, TLogManifestEntry &entry) const{
+    entry.file = OutputFile(particlename + suffix + ".out" + (compression == "gzip" ? ".gz" : compression == "bzip2" ? ".bz2" : "")).filename().string();
+}
+
+
+void TTextLogger::WriteBuffer(TLogStream &stream, const std::string &name){
+    stream.out->write(stream.buffer.data(), stream.buffer.size());
+    stream.buffer.clear();
+    if (not *stream.out)
+        throw std::runtime_error("Could not write " + name + " log");
 }
 
 
 void TTextLogger::DoLog(const std::string &particlename, const std::string &suffix, const std::vector<std::string> &titles, const std::vector<double> &vars){
-    ofstream &file = logstreams[particlename + suffix];
-    if (!file.is_open()){
-        std::ostringstream filename;
-        filename << std::setw(12) << std::setfill('0') << jobnumber << std::setw(0) << particlename << suffix << ".out";
-        boost::filesystem::path outfile = outpath / filename.str();
+    TLogStream &stream = logstreams[particlename + suffix];
+    if (stream.out == nullptr){
+        boost::filesystem::path outfile = OutputFile(particlename + suffix + ".out" + (compression == "gzip" ? ".gz" : compression == "bzip2" ? ".bz2" : ""));
 //		std::cout << "Creating " << outfile << '\n';
-        file.open(outfile.c_str());
-        if(!file.is_open())
+        bool header = not append || not boost::filesystem::exists(outfile) || boost::filesystem::file_size(outfile) == 0;
+        stream.file.open(outfile.c_str(), (append ? ios::app : ios::out) | (compression != "" ? ios::binary : ios::openmode()));
+        if(!stream.file.is_open())
         {
             throw std::runtime_error("Could not open " + outfile.native());
         }
 
-        file << std::setprecision(std::numeric_limits<double>::digits10);
-        copy(titles.begin(), titles.end(), ostream_iterator<string>(file, " "));
-        file << '\n';
+        if (compression == "gzip") // appended compressed streams are concatenated, which gzip and bzip2 readers accept
+            stream.compressor.push(boost::iostreams::gzip_compressor());
+        else if (compression == "bzip2")
+            stream.compressor.push(boost::iostreams::bzip2_compressor());
+        if (stream.compressor.empty())
+            stream.out = &stream.file;
+        else{
+            stream.compressor.push(stream.file);
+            stream.out = &stream.compressor;
+        }
+        stream.buffer.reserve(LINE_BUFFER_SIZE + 1024);
+        if (header){
+            for (auto &title: titles){
+                stream.buffer += title;
+                stream.buffer += ' ';
+            }
+            stream.buffer += '\n';
+        }
     }
 
-    copy(vars.begin(), vars.end(), ostream_iterator<double>(file, " "));
-    file << '\n';
+    // printf formatting produces the same text as the former iostream output with precision digits10, without going through the stream's locale for each number
+    char number[32];
+    for (double v: vars){
+        int length = snprintf(number, sizeof(number), "%.*g ", std::numeric_limits<double>::digits10, v);
+        stream.buffer.append(number, length);
+    }
+    stream.buffer += '\n';
+    if (stream.buffer.size() >= LINE_BUFFER_SIZE)
+        WriteBuffer(stream, particlename + suffix);
 }
 
 #ifdef USEROOT
 
 #include "TObjString.h"
+#include "TROOT.h"
+
+TROOTLogger::TROOTLogger(TConfig& aconfig, const int ashard): TLogger(aconfig, ashard){
+    if (shard >= 0)
+        ROOT::EnableThreadSafety(); // several loggers write their own files in parallel
+    boost::filesystem::path outfile = OutputFile(".root");
+    int compression = -1, threads = 0;
+    auto option = config["GLOBAL"].find("ROOTcompression");
+    if (option != config["GLOBAL"].end())
+        istringstream(option->second) >> compression;
+    option = config["GLOBAL"].find("ROOTbasketsize");
+    if (option != config["GLOBAL"].end())
+        istringstream(option->second) >> basketsize;
+    option = config["GLOBAL"].find("ROOTthreads");
+    if (option != config["GLOBAL"].end())
+        istringstream(option->second) >> threads;
+    if (basketsize < 0 || threads < 0)
+        throw std::runtime_error("ROOTbasketsize and ROOTthreads must not be negative!");
+    if (threads > 0){
+        static std::once_flag implicitMT;
+        std::call_once(implicitMT, [threads](){ ROOT::EnableImplicitMT(threads); }); // compress baskets in parallel, enabled once for all loggers of the process
+    }
 
-TROOTLogger::TROOTLogger(TConfig& aconfig){
-    config = aconfig;
-    ostringstream filename;
-    filename << setw(12) << std::setfill('0') << jobnumber << ".root";
-    boost::filesystem::path outfile = outpath / filename.str();
     ROOTfile = new TFile(outfile.c_str(), "RECREATE");
     if (not ROOTfile->IsOpen())
         throw std::runtime_error("Could not open " + outfile.native());
+    if (compression >= 0)
+        ROOTfile->SetCompressionSettings(compression);
 
     TDirectory *rootdir = ROOTfile->mkdir("config", "config");
     for (auto &section: aconfig){
@@ -341,21 +1190,182 @@ TROOTLogger::TROOTLogger(TConfig& aconfig){
 }
 
 void TROOTLogger::DoLog(const std::string &particlename, const std::string &suffix, const std::vector<std::string> &titles, const std::vector<double> &vars){
-    string name = particlename + suffix;
-    TNtupleD* tree = static_cast<TNtupleD*>(ROOTfile->Get(name.c_str()));
+    TNtupleD* &tree = trees[particlename + suffix]; // looked up once per row, instead of searching the file's directory
     if (not tree){
+        string name = particlename + suffix;
         ostringstream varliststr;
         copy(titles.begin(), titles.end(), ostream_iterator<string>(varliststr, ":"));
         string varlist = varliststr.str();
         varlist.pop_back();
+        ROOTfile->cd();
         tree = new TNtupleD(name.c_str(), name.c_str(), varlist.c_str());
+        if (basketsize > 0)
+            tree->SetBasketSize("*", basketsize);
     }
     tree->Fill(&vars[0]);
 }
 
+void TROOTLogger::LocateTable(const std::string &particlename, const std::string &suffix, TLogManifestEntry &entry) const{
+    entry.file = OutputFile(".root").filename().string();
+    entry.dataset = particlename + suffix;
+}
+
 TROOTLogger::~TROOTLogger(){
+    FinishLog();
     ROOTfile->Write();
     delete ROOTfile;
 }
 
 #endif
+
+
+#ifdef USEHDF5
+
+static const hsize_t HDF5_CHUNK_ROWS = 4096; ///< Number of rows per chunk of HDF5 datasets, rows are buffered until a chunk is full
+static const unsigned HDF5_COMPRESSION_LEVEL = 4; ///< Deflate compression level of HDF5 datasets
+
+THDF5Logger::THDF5Logger(TConfig& aconfig, const int ashard): TLogger(aconfig, ashard){
+    boost::filesystem::path outfile = OutputFile(".h5");
+    file = H5Fcreate(outfile.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    if (file < 0)
+        throw std::runtime_error("Could not open " + outfile.native());
+}
+
+void THDF5Logger::DoLog(const std::string &particlename, const std::string &suffix, const std::vector<std::string> &titles, const std::vector<double> &vars){
+    auto s = streams.find(particlename + suffix);
+    if (s == streams.end()){
+        s = streams.emplace(particlename + suffix, THDF5Stream()).first;
+        THDF5Stream &stream = s->second;
+        stream.group = H5Gcreate2(file, (particlename + suffix).c_str(), H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        if (stream.group < 0)
+            throw std::runtime_error("Could not create HDF5 group " + particlename + suffix);
+
+        hsize_t dims = 0, maxdims = H5S_UNLIMITED, chunkdims = HDF5_CHUNK_ROWS;
+        hid_t space = H5Screate_simple(1, &dims, &maxdims);
+        hid_t properties = H5Pcreate(H5P_DATASET_CREATE);
+        H5Pset_chunk(properties, 1, &chunkdims);
+        H5Pset_shuffle(properties);
+        H5Pset_deflate(properties, HDF5_COMPRESSION_LEVEL);
+        for (auto &title: titles){
+            hid_t dataset = H5Dcreate2(stream.group, title.c_str(), H5T_NATIVE_DOUBLE, space, H5P_DEFAULT, properties, H5P_DEFAULT);
+            if (dataset < 0)
+                throw std::runtime_error("Could not create HDF5 dataset " + title + " in " + particlename + suffix);
+            stream.datasets.push_back(dataset);
+        }
+        H5Pclose(properties);
+        H5Sclose(space);
+        stream.buffers.resize(titles.size());
+        for (auto &buffer: stream.buffers)
+            buffer.reserve(HDF5_CHUNK_ROWS);
+    }
+
+    THDF5Stream &stream = s->second;
+    for (unsigned i = 0; i < vars.size(); ++i)
+        stream.buffers[i].push_back(vars[i]);
+    if (stream.buffers[0].size() >= HDF5_CHUNK_ROWS)
+        Flush(stream);
+}
+
+void THDF5Logger::Flush(THDF5Stream &stream){
+    if (stream.buffers.empty() or stream.buffers[0].empty())
+        return;
+    hsize_t offset = stream.rows, count = stream.buffers[0].size(), size = stream.rows + count;
+    hid_t memspace = H5Screate_simple(1, &count, nullptr);
+    for (unsigned i = 0; i < stream.datasets.size(); ++i){
+        H5Dset_extent(stream.datasets[i], &size);
+        hid_t filespace = H5Dget_space(stream.datasets[i]);
+        H5Sselect_hyperslab(filespace, H5S_SELECT_SET, &offset, nullptr, &count, nullptr);
+        if (H5Dwrite(stream.datasets[i], H5T_NATIVE_DOUBLE, memspace, filespace, H5P_DEFAULT, stream.buffers[i].data()) < 0)
+            throw std::runtime_error("Could not write to HDF5 file");
+        H5Sclose(filespace);
+        stream.buffers[i].clear();
+    }
+    H5Sclose(memspace);
+    stream.rows = size;
+}
+
+void THDF5Logger::LocateTable(const std::string &particlename, const std::string &suffix, TLogManifestEntry &entry) const{
+    entry.file = OutputFile(".h5").filename().string();
+    entry.dataset = particlename + suffix;
+}
+
+std::size_t THDF5Logger::MemoryUsage() const{
+    std::size_t bytes = TLogger::MemoryUsage();
+    for (auto &s: streams){
+        for (auto &buffer: s.second.buffers)
+            bytes += buffer.capacity()*sizeof(double);
+    }
+    return bytes;
+}
+
+THDF5Logger::~THDF5Logger(){
+    FinishLog();
+    for (auto &s: streams){
+        Flush(s.second);
+        for (auto dataset: s.second.datasets)
+            H5Dclose(dataset);
+        H5Gclose(s.second.group);
+    }
+    H5Fclose(file);
+}
+
+#endif
+
+
+boost::filesystem::path PrintTable(TConfig &config, const boost::filesystem::path &outfile, const vector<string> &titles, const vector<double> &values){
+    string format = "text";
+    istringstream(config["GLOBAL"]["fieldoutput"]) >> format;
+    boost::filesystem::path filename = outfile;
+    if (format == "text" or format == "binary"){
+        filename += format == "text" ? ".out" : ".bin";
+        ofstream f(filename.c_str(), format == "text" ? ios_base::out : ios_base::out | ios_base::binary);
+        if (!f)
+            throw runtime_error("Could not open " + filename.string());
+        for (unsigned i = 0; i < titles.size(); ++i)
+            f << titles[i] << (i + 1 < titles.size() ? " " : "\n");
+        if (format == "text"){
+            for (unsigned long i = 0; i < values.size(); ++i)
+                f << values[i] << ((i + 1) % titles.size() == 0 ? "\n" : " ");
+        }
+        else
+            f.write(reinterpret_cast<const char*>(values.data()), values.size()*sizeof(double));
+        if (!f)
+            throw runtime_error("Could not write to " + filename.string());
+    }
+    else if (format == "HDF5"){
+        filename += ".h5";
+        #ifdef USEHDF5
+            hid_t file = H5Fcreate(filename.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+            if (file < 0)
+                throw runtime_error("Could not open " + filename.string());
+            hsize_t rows = values.size()/titles.size();
+            hsize_t chunkrows = min(rows, HDF5_CHUNK_ROWS);
+            vector<double> column(rows);
+            for (unsigned i = 0; i < titles.size(); ++i){
+                for (hsize_t j = 0; j < rows; ++j)
+                    column[j] = values[j*titles.size() + i];
+                hid_t space = H5Screate_simple(1, &rows, nullptr);
+                hid_t properties = H5Pcreate(H5P_DATASET_CREATE);
+                if (chunkrows > 0){
+                    H5Pset_chunk(properties, 1, &chunkrows);
+                    H5Pset_deflate(properties, HDF5_COMPRESSION_LEVEL);
+                }
+                hid_t dataset = H5Dcreate2(file, titles[i].c_str(), H5T_NATIVE_DOUBLE, space, H5P_DEFAULT, properties, H5P_DEFAULT);
+                herr_t status = dataset < 0 ? -1 : H5Dwrite(dataset, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, column.data());
+                H5Dclose(dataset);
+                H5Pclose(properties);
+                H5Sclose(space);
+                if (status < 0){
+                    H5Fclose(file);
+                    throw runtime_error("Could not write dataset " + titles[i] + " to " + filename.string());
+                }
+            }
+            H5Fclose(file);
+        #else
+            throw runtime_error("fieldoutput is set to HDF5 but PENTrack was compiled without HDF5 support!");
+        #endif
+    }
+    else
+        throw runtime_error("Unknown fieldoutput " + format + ". Use text, binary, or HDF5");
+    return filename;
+}
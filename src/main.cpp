@@ -15,6 +15,18 @@
 #include <iomanip>
 #include <chrono>
 #include <memory>
+#include <thread>
+#include <future>
+#include <mutex>
+#include <atomic>
+#include <array>
+#include <algorithm>
+#include <set>
+#include <random>
+#include <ctime>
+#include <cmath>
+#include <numeric>
+#include <limits>
 #include <boost/format.hpp>
 
 #include "tracking.h"
@@ -25,23 +37,52 @@
 #include "source.h"
 #include "mc.h" 
 #include "microroughness.h"
+#include "logger.h"
+#include "diagnostics.h"
+#include "manifest.h"
+#include "scheduler.h"
+#include "distributor.h"
+#include "checkpoint.h"
+#include "scan.h"
+#include "profiler.h"
+#include "querytrace.h"
+#include "status.h"
+#include "convergence.h"
+#include "regionmap.h"
 
 using namespace std;
 
 TConfig ConfigInit(int argc, char **argv); // read config.in
-void OutputCodes(const map<string, map<int, int> > &ID_counter); // print simulation summary at program exit
+void OutputCodes(const map<string, map<int, double> > &ID_counter); // print simulation summary at program exit
 void PrintBFieldCut(TConfig &config, const boost::filesystem::path &outfile, const TFieldManager &field); // evaluate fields on given plane and write to outfile
-void PrintBField(const boost::filesystem::path &outfile, const TFieldManager &field);
-void PrintGeometry(const boost::filesystem::path &outfile, TGeometry &geom); // do many random collisionchecks and write all collisions to outfile
+void PrintBFieldPoints(TConfig &config, const boost::filesystem::path &outfile, const TFieldManager &field); // evaluate fields at points listed in a file and write to outfile
+void PrintBField(TConfig &config, const boost::filesystem::path &outfile, const TFieldManager &field);
+void PrintGeometry(TConfig &config, const boost::filesystem::path &outfile, const TGeometry &geom); // do many random collisionchecks and write all collisions to outfile
 void PrintMROutAngle(TConfig &config, const boost::filesystem::path &outpath); // produce a 3d table of the MR-DRP for each outgoing solid angle
 void PrintMRThetaIEnergy(TConfig &config, const boost::filesystem::path &outpath); // produce a 3d table of the total (integrated) MR-DRP for a given incident angle and energy
+void SimulateParticles(TConfig &config, TGeometry &geom, const TFieldManager &field, TParticleSource &source, TCheckpoint &resumed,
+		map<string, map<int, double> > &ID_counter, int &ntotalsteps); // track particles created by source
+void SimulateScan(TConfig &config, const TParameterScan &scan, const TGeometry &geom, map<string, map<int, double> > &ID_counter, int &ntotalsteps); // track particles for each point of a parameter scan
+void ReplaySpins(TConfig &config, const TParameterScan &scan, const TGeometry &geom, map<string, map<int, double> > &ID_counter); // track spins along recorded trajectories for each point of a parameter scan
+void EstimateCost(TConfig &config, TGeometry &geom, const TFieldManager &field, TParticleSource &source,
+		map<string, map<int, double> > &ID_counter, int &ntotalsteps); // extrapolate cost of a run from a sample of its particles
+void PrintMemory(const string &stage, const TFieldManager &field, const TGeometry &geom); // print memory used by each subsystem and resident memory of the process
 
 
 double SimTime = 1500.; ///< max. simulation time
 int simcount = 1; ///< number of particles for MC simulation (read from config)
 simType simtype = PARTICLE; ///< type of particle which shall be simulated (read from config)
 int secondaries = 1; ///< should secondary particles be simulated? (read from config)
+int nthreads = 1; ///< number of threads tracking particles in parallel (read from config)
+bool pinthreads = false; ///< pin each tracking thread to its own CPU (read from config)
+int replayparticle = 0; ///< number of particle tracked by simtype REPLAY (read from config)
 uint64_t seed = 0; ///< random seed used for random-number generator (generated from high-resolution clock)
+bool checkpoint = false; ///< write state of simulation to checkpoint file when interrupted by a signal (read from config)
+double checkpointinterval = 0; ///< interval [s] between periodic checkpoints (read from config, <= 0: only when interrupted)
+bool resume = false; ///< continue simulation from checkpoint file (command-line option --resume)
+double statusinterval = 0; ///< interval [s] between updates of the status file (read from config, <= 0: no status file)
+TStatusMonitor::TFormat statusformat = TStatusMonitor::JSON; ///< format of the status file (read from config)
+atomic<size_t> loggermemory(0); ///< memory [bytes] used by the loggers of all threads when they finished, largest value of all runs of SimulateParticles
 
 /**
  * Catch signals.
@@ -61,13 +102,15 @@ void catch_alarm (int sig){
  * main function.
  *
  * @param argc Number of parameters passed via the command line
- * @param argv Array of parameters passed via the command line (./Track [jobnumber [configpath [outputpath [seed]]]])
+ * @param argv Array of parameters passed via the command line (./Track [--resume] [jobnumber [configpath [outputpath [seed]]]])
  * @return Return 0 on success, value !=0 on failure
  *
  */
 int main(int argc, char **argv){
+	TProcessGroup processes(argc, argv); // initializes MPI, if compiled with it
+
 	if ((argc > 1) && (strcmp(argv[1], "-h") == 0)){
-		cout << "Usage:\nPENTrack [jobnumber [location/of/config.in [path/to/out/files [seed]]]]" << endl;
+		cout << "Usage:\nPENTrack [--resume] [jobnumber [location/of/config.in [path/to/out/files [seed]]]]" << endl;
 		return 0;
 	}
 
@@ -85,8 +128,18 @@ int main(int argc, char **argv){
 	signal (SIGUSR2, catch_alarm);
 	signal (SIGXCPU, catch_alarm);
 	
+	// time spent in each startup phase, printed before particles are tracked
+	vector<pair<string, double> > startuptimes;
+	chrono::time_point<chrono::steady_clock> phasestart = chrono::steady_clock::now();
+	auto startupphase = [&](const string &name){
+		chrono::time_point<chrono::steady_clock> now = chrono::steady_clock::now();
+		startuptimes.push_back(make_pair(name, chrono::duration<double>(now - phasestart).count()));
+		phasestart = now;
+	};
+
 	// read config
 	TConfig configin = ConfigInit(argc, argv);
+	startupphase("configuration");
 
 	if (simtype == MR_THETA_OUT_ANGLE){
 		PrintMROutAngle(configin, outpath);
@@ -96,46 +149,101 @@ int main(int argc, char **argv){
 		PrintMRThetaIEnergy(configin, outpath);
 		return 0;
 	}
+	else if (simtype == MERGE){
+		MergeLogs(configin, nthreads);
+		return 0;
+	}
 
 
+	// load geometry in the background while fields are loaded, unless only fields are printed
+	future<unique_ptr<TGeometry> > geomloading;
+	if (simtype != BF_ONLY && simtype != BF_CUT && simtype != BF_POINTS){
+		cout << "Loading geometry...\n";
+		TConfig geomconfig = configin; // map::operator[] inserts missing options, so the geometry needs its own copy
+		geomloading = async(launch::async, [geomconfig]() mutable{ return unique_ptr<TGeometry>(new TGeometry(geomconfig)); });
+	}
+
 	cout << "Loading fields...\n";
 	// load field configuration from geometry.in
 	TFieldManager field(configin);
+	startupphase("fields");
 
 	if (simtype == BF_ONLY){
-		PrintBField(outpath / "BF.out", field); // estimate ramp heating
+		PrintBField(configin, outpath / "BF", field); // estimate ramp heating
 		return 0;
 	}
 	else if (simtype == BF_CUT){
-		PrintBFieldCut(configin, outpath / "BFCut.out", field); // print cut through B field
+		PrintBFieldCut(configin, outpath / "BFCut", field); // print cut through B field
+		return 0;
+	}
+	else if (simtype == BF_POINTS){
+		PrintBFieldPoints(configin, outpath / "BFPoints", field); // print fields at list of points
 		return 0;
 	}
 
 
-	cout << "Loading geometry...\n";
 	//load geometry configuration from geometry.in
-	TGeometry geom(configin);
+	unique_ptr<TGeometry> geomptr = geomloading.get();
+	TGeometry &geom = *geomptr;
+	startupphase("geometry"); // time spent waiting for the geometry after the fields were loaded
 	
 	if (simtype == GEOMETRY){
 		// print random points on walls in file to visualize geometry
-		PrintGeometry(outpath / "geometry.out", geom);
+		PrintGeometry(configin, outpath / "geometry", geom);
 		return 0;
 	}
 	
+	boost::filesystem::path checkpointfile = outpath / (boost::format("%012d.checkpoint") % jobnumber).str();
+	TCheckpoint resumed;
+	if (resume){
+		cout << "Loading checkpoint " << checkpointfile << "...\n";
+		resumed.Read(checkpointfile, geom, field);
+		seed = resumed.seed; // particles continue drawing from the random-number streams of the interrupted run
+		startupphase("checkpoint");
+	}
+
 	cout << "Loading random number generator...\n";
-	// load random number generator
-	TMCGenerator mc;
 	if (seed == 0){
 		// get high-resolution timestamp to generate seed
 		using namespace std::chrono;
 		seed = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
 	}
+	TProcessGroup::Broadcast(seed); // all processes draw from the same random-number streams
 	std::cout << "Random Seed: " << seed << "\n\n";
-	mc.seed(seed);
 
-	cout << "Loading source...\n";
-	// load source configuration from geometry.in
-	unique_ptr<TParticleSource> source(CreateParticleSource(configin, geom));
+	TParameterScan scan(configin);
+	unique_ptr<TParticleSource> source;
+	if (simtype == SPIN_REPLAY && TProcessGroup::Size() > 1)
+		throw runtime_error("Spins can only be replayed in a single process!");
+	else if (simtype == ESTIMATE && (scan.size() > 0 || TProcessGroup::Size() > 1))
+		throw runtime_error("Costs can only be estimated for a configuration without parameter scan in a single process!");
+	else if (scan.size() == 0 && simtype != SPIN_REPLAY){
+		cout << "Loading source...\n";
+		// load source configuration from geometry.in
+		source.reset(CreateParticleSource(configin, geom));
+		startupphase("source");
+	}
+	else if (scan.size() > 0 && (checkpoint || simtype == REPLAY || TProcessGroup::Size() > 1))
+		throw runtime_error("Parameter scans cannot be combined with checkpoints, replayed particles, or several processes!");
+
+	cout << "Startup times:";
+	for (auto &phase: startuptimes)
+		printf(" %s %.2fs", phase.first.c_str(), phase.second);
+	cout << "\n";
+	PrintMemory("after startup", field, geom);
+
+	string tracename = (boost::format("%012dtrace.json") % jobnumber).str();
+	if (TProcessGroup::Size() > 1) // each process writes its own trace
+		tracename = (boost::format("%012dtrace%d.json") % jobnumber % TProcessGroup::Rank()).str();
+	int traceinterval = 0;
+	istringstream(configin["GLOBAL"]["traceinterval"]) >> traceinterval;
+	Profiler::StartTrace(outpath / tracename, configin["GLOBAL"]["traceparticles"], traceinterval);
+	string queryname = (boost::format("%012dqueries.bin") % jobnumber).str();
+	if (TProcessGroup::Size() > 1)
+		queryname = (boost::format("%012dqueries%d.bin") % jobnumber % TProcessGroup::Rank()).str();
+	int queryinterval = 0;
+	istringstream(configin["GLOBAL"]["querytraceinterval"]) >> queryinterval;
+	QueryTrace::Start(outpath / queryname, configin["GLOBAL"]["querytraceparticles"], queryinterval);
 
 	int ntotalsteps = 0;     // counters to determine average steps per integrator call
 	float InitTime = (1.*clock())/CLOCKS_PER_SEC; // time statistics
@@ -144,50 +252,57 @@ int main(int argc, char **argv){
 	chrono::time_point<chrono::steady_clock> simstart = chrono::steady_clock::now();
 
 	cout << "\n";
-	map<string, map<int, int> > ID_counter; // 2D map to store number of each ID for each particle type
+	map<string, map<int, double> > ID_counter; // 2D map to store number of each ID for each particle type
 
-	if (simtype == PARTICLE){ // if proton or neutron shall be simulated
-	    cout << "Simulating " << simcount << " " << source->GetParticleName() << "s...\n";
-        progress_display progress(simcount);
-		TTracker t(configin);
-		for (int iMC = 1; iMC <= simcount; iMC++)
-		{
-            if (quit.load())
-                break;
-
-            unique_ptr<TParticle> p(source->CreateParticle(mc, geom, field));
-			t.IntegrateParticle(p, SimTime, configin[p->GetName()], mc, geom, field); // integrate particle
-			ID_counter[p->GetName()][p->GetStopID()]++; // increment counters
-			ntotalsteps += p->GetNumberOfSteps();
-
-			if (secondaries == 1){
-				for (auto& i: p->GetSecondaryParticles()){
-                    if (quit.load())
-                        break;
-
-                    t.IntegrateParticle(i, SimTime, configin[i->GetName()], mc, geom, field); // integrate secondary particles
-					ID_counter[i->GetName()][i->GetStopID()]++;
-					ntotalsteps += i->GetNumberOfSteps();
-				}
-			}
+	if (simtype == REPLAY)
+		cout << "Replaying " << source->GetParticleName() << " " << replayparticle << " of job " << jobnumber << "\n";
 
-            ++progress;
-		}
+	if (simtype == PARTICLE || simtype == REPLAY){ // if proton or neutron shall be simulated
+		if (scan.size() == 0)
+			SimulateParticles(configin, geom, field, *source, resumed, ID_counter, ntotalsteps);
+		else
+			SimulateScan(configin, scan, geom, ID_counter, ntotalsteps);
+		TProcessGroup::Reduce(ID_counter, ntotalsteps); // sum counters of all processes in rank 0
 	}
+	else if (simtype == SPIN_REPLAY)
+		ReplaySpins(configin, scan, geom, ID_counter);
+	else if (simtype == ESTIMATE)
+		EstimateCost(configin, geom, field, *source, ID_counter, ntotalsteps);
 	else{
 		printf("\nDon't know simtype %i! Exiting...\n",simtype);
 		exit(-1);
 	}
 	cout << '\n';
 
-	OutputCodes(ID_counter); // print particle IDs
-	
-	// print statistics
-	printf("The integrator made %d steps. \n", ntotalsteps);
+	vector<TLogManifestEntry> manifest = TLogger::TakeManifest(); // all loggers have been closed
+	if (not manifest.empty()){
+		string logprefix, manifestname = (boost::format("%012dmanifest.out") % jobnumber).str();
+		istringstream(configin["GLOBAL"]["logprefix"]) >> logprefix;
+		if (TProcessGroup::Size() > 1) // each process lists its own shards
+			manifestname = (boost::format("%012dmanifest%d.out") % jobnumber % TProcessGroup::Rank()).str();
+		bool appendlog = false;
+		istringstream(configin["GLOBAL"]["appendlog"]) >> appendlog;
+		WriteLogManifest(outpath / (logprefix + manifestname), manifest, seed, jobnumber, appendlog);
+	}
+
+	if (TProcessGroup::Rank() == 0){
+		OutputCodes(ID_counter); // print particle IDs
+
+		// print statistics
+		printf("The integrator made %d steps. \n", ntotalsteps);
+	}
+	Diagnostics::Print(); // each process summarizes the problems counted by its own threads
 	chrono::time_point<chrono::steady_clock> simend = chrono::steady_clock::now();
 	float SimulationTime = chrono::duration_cast<chrono::milliseconds>(simend - simstart).count()/1000.;
 	printf("Init: %.2fs, Simulation: %.2fs\n",
 			InitTime, SimulationTime);
+	PrintMemory("at exit", field, geom);
+	string profilename = (boost::format("%012dprofile.out") % jobnumber).str();
+	if (TProcessGroup::Size() > 1) // each process writes its own profile
+		profilename = (boost::format("%012dprofile%d.out") % jobnumber % TProcessGroup::Rank()).str();
+	Profiler::StopTrace();
+	QueryTrace::Stop();
+	Profiler::Print(outpath / profilename); // does nothing if profiler was not compiled in
 	if (quit.load())
 	    cout << "Simulation killed by signal!\n";
 	else
@@ -197,6 +312,669 @@ int main(int argc, char **argv){
 }
 
 
+/**
+ * Track particles created by a source
+ *
+ * Particles are distributed to all threads and processes. Writes checkpoints if option checkpoint is set.
+ *
+ * @param config Configuration
+ * @param geom Experiment geometry
+ * @param field TFieldManager containing all electromagnetic fields
+ * @param source Particle source
+ * @param resumed Checkpoint read from file, used if simulation is resumed
+ * @param ID_counter Returns sum of statistical weights of finished particles with each stop ID for each particle type
+ * @param ntotalsteps Returns number of integration steps of all particles
+ */
+void SimulateParticles(TConfig &config, TGeometry &geom, const TFieldManager &field, TParticleSource &source, TCheckpoint &resumed,
+		map<string, map<int, double> > &ID_counter, int &ntotalsteps){
+	boost::filesystem::path checkpointfile = outpath / (boost::format("%012d.checkpoint") % jobnumber).str();
+	cout << "Simulating " << simcount << " " << source.GetParticleName() << "s";
+	if (nthreads > 1)
+		cout << " in " << nthreads << " threads";
+	if (TProcessGroup::Size() > 1)
+		cout << " of each of " << TProcessGroup::Size() << " processes";
+	cout << "...\n";
+	progress_display progress(simcount);
+	long long blocksize = 10;
+	istringstream(config["GLOBAL"]["particleblocksize"]) >> blocksize;
+	long long sortblock = 0; // number of primaries each thread creates at once and sorts by initial position and energy (<= 1: tracked in order of creation)
+	istringstream(config["GLOBAL"]["sortparticles"]) >> sortblock;
+	long long secondarybatch = 0; // number of secondaries of one type each thread collects across primaries before tracking them one after another (<= 1: tracked right after their parent)
+	istringstream(config["GLOBAL"]["secondarybatch"]) >> secondarybatch;
+	long long firstparticle = simtype == REPLAY ? replayparticle : 1, particlecount = simcount;
+	unsigned long finishedparticles = 0; // number of primary particles whose tracking has finished
+	if (resume){ // continue with counters and particles of interrupted run
+		firstparticle = resumed.firstparticle;
+		particlecount = resumed.particlecount;
+		finishedparticles = resumed.finishedparticles;
+		ID_counter = resumed.ID_counter;
+		ntotalsteps = resumed.steps;
+		progress += finishedparticles;
+	}
+	TParticleDistributor particles(firstparticle, particlecount, blocksize); // hands out particle numbers to threads and processes
+	bool sharded = nthreads > 1 || TProcessGroup::Size() > 1; // several loggers write files in parallel
+	mutex countermutex;
+	vector<map<string, map<int, double> > > threadID_counters(nthreads); // counters of each thread, merged when all threads have finished
+	vector<int> threadsteps(nthreads, 0);
+	string statusname = (boost::format("%012dstatus") % jobnumber).str();
+	if (TProcessGroup::Size() > 1) // each process writes its own status file
+		statusname += to_string(TProcessGroup::Rank());
+	string logprefix;
+	istringstream(config["GLOBAL"]["logprefix"]) >> logprefix;
+	TStatusMonitor status(outpath / (logprefix + statusname + (statusformat == TStatusMonitor::JSON ? ".json" : ".prom")), statusinterval, statusformat, nthreads,
+			simcount, finishedparticles, ID_counter, ntotalsteps);
+	// each particle is a task, secondaries are tracked by the thread that created them unless an idle thread steals them
+	TTaskScheduler<TParticleTask> scheduler(nthreads);
+	for (unsigned i = 0; i < resumed.tasks.size(); ++i)
+		scheduler.Push(i % nthreads, move(resumed.tasks[i]));
+
+	// worker threads copy their counters and histograms when the main thread asks for them, so it can check the statistical precision
+	TConvergenceMonitor convergence(config);
+	vector<TConvergenceSample> samples(nthreads);
+	mutex samplemutex;
+	atomic<unsigned> samplerequest(0);
+	atomic<bool> converged(false);
+
+	bool sourceprepared = false; // source is prepared when the first primary particle is created, so it is skipped if none are left
+	double sourcetime = 0;
+	vector<double> loggertimes(nthreads, 0.); // time each thread needed to set up its logger
+	vector<size_t> loggerbytes(nthreads, 0); // memory used by each thread's logger when the thread finished
+
+	unique_ptr<TRegionMap> regionmap = TRegionMap::Create(config, geom, field); // shared by all trackers, nullptr if regionmap is not set
+
+	// secondaries collected by each thread, by particle type, until secondarybatch of one type are collected or no primaries are left
+	struct TSecondaryBatches{
+		mutex batchmutex; ///< Locked by the owning thread, by the thread emptying all batches when the source is exhausted, and when writing a checkpoint
+		map<string, vector<TParticleTask> > tasks; ///< Collected secondaries of each particle type
+	};
+	vector<TSecondaryBatches> collected(nthreads);
+	atomic<bool> primariesdone(false); // set when the source is exhausted, secondaries are queued directly afterwards
+	auto queuebatch = [&](const int owner, vector<TParticleTask> &batch){
+		for (auto b = batch.rbegin(); b != batch.rend(); ++b) // queues are taken from the back, so secondaries are tracked in the order they were collected
+			scheduler.Push(owner, move(*b));
+		batch.clear();
+	};
+	auto queuecollected = [&](){ // called in one thread at a time by the scheduler's source
+		primariesdone = true;
+		for (int i = 0; i < nthreads; ++i){
+			lock_guard<mutex> lock(collected[i].batchmutex);
+			for (auto &batch: collected[i].tasks)
+				queuebatch(i, batch.second);
+			collected[i].tasks.clear();
+		}
+	};
+
+	// each thread tracks particles with its own tracker and logger, fields and geometry are shared
+	auto simulate = [&](const int ithread){
+		if (pinthreads && !PinThread(TProcessGroup::Rank()*nthreads + ithread)) // processes sharing a node get consecutive CPUs
+			cout << "Warning: Could not pin thread " << ithread << " to a CPU\n";
+		TConfig threadconfig = config; // map::operator[] inserts missing options, so each thread needs its own copy
+		chrono::time_point<chrono::steady_clock> loggerstart = chrono::steady_clock::now();
+		TTracker t(threadconfig, simtype == REPLAY ? replayparticle : (sharded ? TProcessGroup::Rank()*nthreads + ithread : -1)); // log files of replayed particle get its number appended to the job number
+		t.SetRegionMap(regionmap.get());
+		loggertimes[ithread] = chrono::duration<double>(chrono::steady_clock::now() - loggerstart).count();
+		auto createparticle = [&](const long long number, TParticleTask &task){
+			if (not sourceprepared){
+				chrono::time_point<chrono::steady_clock> sourcestart = chrono::steady_clock::now();
+				TMCGenerator sourcemc(seed, jobnumber); // source initialization draws from substream of particle number 0, so particles do not depend on which one is created first
+				source.Prepare(sourcemc, geom, field);
+				sourceprepared = true;
+				sourcetime = chrono::duration<double>(chrono::steady_clock::now() - sourcestart).count();
+			}
+			task.mc = TMCGenerator(seed, jobnumber); // each particle draws from its own substream, independent of thread and order of tracking
+			task.mc.SetSubstream(number, 0);
+			task.secondaryindex = 0;
+			source.ParticleCounter = number - 1; // the source numbers the next particle, which selects its random-number substream
+			source.StartQuasiRandom(task.mc, number);
+			task.particle.reset(source.CreateParticle(task.mc, geom, field));
+			task.mc.StopQuasiRandom(); // physics during tracking draws pseudo-random numbers
+		};
+		auto createprimary = [&](TParticleTask &task){ // called by scheduler in one thread at a time
+			long long number;
+			if (sortblock <= 1){
+				if (not particles.Next(number, quit.load() || converged.load())){
+					queuecollected();
+					return false;
+				}
+				createparticle(number, task);
+				return true;
+			}
+			// create a block of primaries and queue them along a Morton curve through their initial positions and energies,
+			// so consecutive particles of this thread touch the same field-table cells and geometry nodes
+			vector<TParticleTask> block;
+			while (static_cast<long long>(block.size()) < sortblock && particles.Next(number, quit.load() || converged.load())){
+				block.emplace_back();
+				createparticle(number, block.back());
+			}
+			if (block.empty()){
+				queuecollected();
+				return false;
+			}
+			double min[4], max[4];
+			vector<array<double, 4> > coords(block.size());
+			for (int j = 0; j < 4; ++j){
+				min[j] = numeric_limits<double>::infinity();
+				max[j] = -numeric_limits<double>::infinity();
+			}
+			for (size_t i = 0; i < block.size(); ++i){
+				const state_type &y = block[i].particle->GetInitialState();
+				coords[i] = {y[0], y[1], y[2], block[i].particle->GetInitialKineticEnergy()};
+				for (int j = 0; j < 4; ++j){
+					min[j] = std::min(min[j], coords[i][j]);
+					max[j] = std::max(max[j], coords[i][j]);
+				}
+			}
+			vector<uint64_t> keys(block.size(), 0);
+			for (size_t i = 0; i < block.size(); ++i){
+				uint64_t cell[4];
+				for (int j = 0; j < 4; ++j){
+					double f = max[j] > min[j] ? (coords[i][j] - min[j])/(max[j] - min[j]) : 0;
+					cell[j] = static_cast<uint64_t>(std::min(std::max(f, 0.), 1.)*65535); // 16 bits per axis
+				}
+				for (int b = 15; b >= 0; --b){
+					for (int j = 0; j < 4; ++j)
+						keys[i] = keys[i] << 1 | (cell[j] >> b & 1);
+				}
+			}
+			vector<size_t> order(block.size());
+			iota(order.begin(), order.end(), 0);
+			stable_sort(order.begin(), order.end(), [&keys](const size_t i1, const size_t i2){ return keys[i1] < keys[i2]; });
+			task = move(block[order[0]]);
+			for (size_t i = order.size() - 1; i > 0; --i) // the queue is taken from the back, idle threads steal from the front
+				scheduler.Push(ithread, move(block[order[i]]));
+			return true;
+		};
+		auto pushsecondary = [&](unique_ptr<TParticle> &particle, const TParticleTask &parent, const TMCGenerator::result_type n){
+			TParticleTask secondary;
+			secondary.particle = move(particle);
+			secondary.secondaryindex = TMCGenerator::SecondaryIndex(parent.secondaryindex, n);
+			secondary.mc = TMCGenerator(seed, jobnumber);
+			secondary.mc.SetSubstream(secondary.particle->GetParticleNumber(), secondary.secondaryindex);
+			if (secondarybatch > 1){ // collect secondaries of the same type across primaries and track them one after another
+				vector<TParticleTask> full;
+				{
+					lock_guard<mutex> lock(collected[ithread].batchmutex);
+					if (not primariesdone.load()){
+						vector<TParticleTask> &batch = collected[ithread].tasks[secondary.particle->GetName()];
+						batch.push_back(move(secondary));
+						if (static_cast<long long>(batch.size()) < secondarybatch)
+							return;
+						full.swap(batch);
+					}
+				}
+				if (not full.empty()){
+					const unsigned batchsize = t.GetParticleOptions(full.front().particle->GetName()).batchsize;
+					for (size_t begin = 0; batchsize > 1 && not quit.load() && begin < full.size(); begin += batchsize){ // neutral secondaries can also be advanced in lockstep
+						vector<pair<unique_ptr<TParticle>*, TMCGenerator*> > lockstep;
+						for (size_t i = begin; i < std::min<size_t>(begin + batchsize, full.size()); ++i){
+							lockstep.emplace_back(&full[i].particle, &full[i].mc);
+							full[i].advanced = true;
+						}
+						t.AdvanceBatch(lockstep, SimTime, geom, field);
+					}
+					queuebatch(ithread, full);
+					return;
+				}
+			}
+			scheduler.Push(ithread, move(secondary)); // track secondary particles in later tasks
+		};
+		unsigned lastsample = 0;
+		TParticleTask task;
+		while (scheduler.Next(ithread, task, createprimary))
+		{
+			unique_ptr<TParticle> &p = task.particle;
+			bool tracked = not quit.load();
+			if (tracked && task.secondaryindex == 0 && not task.advanced){ // advance further primaries together with this one, they are tracked later by this thread
+				const unsigned batchsize = t.GetParticleOptions(p->GetName()).batchsize;
+				if (batchsize > 1){
+					vector<TParticleTask> batch(1);
+					while (batch.size() < batchsize - 1 && scheduler.TakeFromSource(batch.back(), createprimary))
+						batch.emplace_back();
+					batch.pop_back();
+					vector<pair<unique_ptr<TParticle>*, TMCGenerator*> > lockstep{{&p, &task.mc}};
+					for (auto &b: batch)
+						lockstep.emplace_back(&b.particle, &b.mc);
+					t.AdvanceBatch(lockstep, SimTime, geom, field);
+					for (auto &b: batch){
+						b.advanced = true;
+						scheduler.Push(ithread, move(b));
+					}
+				}
+			}
+			if (tracked){
+				status.StartParticle(ithread, p->GetName(), p->GetParticleNumber());
+				t.IntegrateParticle(p, SimTime, task.mc, geom, field); // integrate particle
+				if (p->GetStopID() == ID_BUDGET_EXCEEDED)
+					cout << (boost::format("\n%1% %2% exceeded its budget, replay it with simtype 2, replayparticle %2%, job number %3% and seed %4%\n") % p->GetName() % p->GetParticleNumber() % jobnumber % seed).str();
+				for (auto &clone: t.TakeClones()) // copies created by splitting are always tracked
+					pushsecondary(clone.first, task, clone.second);
+			}
+			else
+				scheduler.Stop(); // leave queued particles for the checkpoint
+
+			if (checkpoint && p->GetStopID() == ID_UNKNOWN){ // tracking was interrupted, continue it after the checkpoint was written or store it in the checkpoint
+				scheduler.Push(ithread, move(task));
+				scheduler.Done();
+				continue;
+			}
+
+			if (tracked){
+				threadID_counters[ithread][p->GetName()][p->GetStopID()] += p->GetStatisticalWeight(); // increment counters
+				threadsteps[ithread] += p->GetNumberOfSteps();
+				status.FinishParticle(ithread, p->GetName(), p->GetStopID(), p->GetStatisticalWeight(), p->GetNumberOfSteps(), task.secondaryindex == 0);
+				if (convergence.Enabled() && samplerequest.load() != lastsample){
+					lastsample = samplerequest.load();
+					lock_guard<mutex> lock(samplemutex);
+					samples[ithread].ID_counter = threadID_counters[ithread];
+					samples[ithread].histograms.clear();
+					t.AddHistogramBins(samples[ithread].histograms);
+				}
+
+				if (secondaries == 1){
+					auto &secs = p->GetSecondaryParticles();
+					for (unsigned i = 0; i < secs.size(); ++i)
+						pushsecondary(secs[i], task, i);
+				}
+			}
+
+			if (task.secondaryindex == 0){
+				lock_guard<mutex> lock(countermutex);
+				++progress;
+				++finishedparticles;
+			}
+			p.reset();
+			scheduler.Done();
+		}
+		loggerbytes[ithread] = t.LoggerMemoryUsage();
+	};
+
+	// write counters and all particles that have not finished yet, workers must be suspended or finished
+	auto writecheckpoint = [&](){
+		TCheckpoint state;
+		state.seed = seed;
+		state.jobnumber = jobnumber;
+		state.particlecount = particles.Remaining(state.firstparticle);
+		state.finishedparticles = finishedparticles;
+		state.ID_counter = ID_counter;
+		state.steps = ntotalsteps;
+		for (int i = 0; i < nthreads; ++i){
+			for (auto &particle: threadID_counters[i]){
+				for (auto &stopID: particle.second)
+					state.ID_counter[particle.first][stopID.first] += stopID.second;
+			}
+			state.steps += threadsteps[i];
+		}
+		vector<const TParticleTask*> queued;
+		scheduler.ForEach([&queued](const TParticleTask &task){ queued.push_back(&task); });
+		for (auto &c: collected){ // secondaries that were collected but not queued yet
+			lock_guard<mutex> lock(c.batchmutex);
+			for (auto &batch: c.tasks){
+				for (auto &task: batch.second)
+					queued.push_back(&task);
+			}
+		}
+		state.Write(checkpointfile, queued);
+	};
+
+	atomic<int> running(nthreads);
+	vector<thread> threads;
+	for (int i = 0; i < nthreads; ++i)
+		threads.emplace_back([&, i]{ simulate(i); --running; });
+	// main thread stops workers after a signal and suspends them to write periodic checkpoints
+	chrono::time_point<chrono::steady_clock> lastcheckpoint = chrono::steady_clock::now();
+	while (running.load() > 0){
+		this_thread::sleep_for(chrono::milliseconds(100));
+		status.Update();
+		if (convergence.Enabled() && not converged.load()){
+			TConvergenceSample total;
+			total.ID_counter = ID_counter; // counters of particles finished before simulation was resumed
+			unsigned long finished;
+			{
+				lock_guard<mutex> lock(samplemutex);
+				for (auto &sample: samples)
+					total.Add(sample);
+			}
+			{
+				lock_guard<mutex> lock(countermutex);
+				finished = finishedparticles;
+			}
+			converged = convergence.Converged(total, finished);
+			++samplerequest;
+		}
+		if (quit.load())
+			scheduler.Stop(); // workers waiting for tasks of other workers would not notice the signal
+		else if (checkpoint && checkpointinterval > 0 &&
+				chrono::duration<double>(chrono::steady_clock::now() - lastcheckpoint).count() > checkpointinterval){
+			suspendtracking = true; // workers interrupt their particles after the current trajectory step and put them back into the queues
+			scheduler.Suspend();
+			writecheckpoint();
+			suspendtracking = false;
+			scheduler.Resume();
+			lastcheckpoint = chrono::steady_clock::now();
+		}
+	}
+	for (auto &th: threads)
+		th.join();
+	status.Finish(quit.load() ? "interrupted" : "finished");
+	printf("\nSource preparation: %.2fs, logger setup: %.2fs\n", sourcetime, *max_element(loggertimes.begin(), loggertimes.end()));
+	size_t usedloggermemory = accumulate(loggerbytes.begin(), loggerbytes.end(), size_t(0)), previous = loggermemory.load();
+	while (usedloggermemory > previous && not loggermemory.compare_exchange_weak(previous, usedloggermemory));
+
+	if (checkpoint){
+		if (quit.load()){
+			writecheckpoint();
+			cout << "\nWrote checkpoint " << checkpointfile << ", continue simulation with option --resume\n";
+		}
+		else{
+			boost::system::error_code ec;
+			boost::filesystem::remove(checkpointfile, ec); // simulation is complete, a periodic checkpoint must not be resumed
+		}
+	}
+
+	for (int i = 0; i < nthreads; ++i){ // merge counters of all threads
+		for (auto &particle: threadID_counters[i]){
+			for (auto &stopID: particle.second)
+				ID_counter[particle.first][stopID.first] += stopID.second;
+		}
+		ntotalsteps += threadsteps[i];
+	}
+
+	particles.Finish();
+}
+
+
+/**
+ * Track particles for each point of a parameter scan
+ *
+ * Each point gets its own fields, geometry, source, and log files with prefix "scan<point>_".
+ * Field tables and meshes that do not change between points are loaded only once.
+ * All points use the same random seed.
+ *
+ * @param config Configuration
+ * @param scan Parameter scan
+ * @param geom Experiment geometry
+ * @param ID_counter Returns sum of statistical weights of finished particles with each stop ID for each particle type, summed over all points
+ * @param ntotalsteps Returns number of integration steps of all particles, summed over all points
+ */
+void SimulateScan(TConfig &config, const TParameterScan &scan, const TGeometry &geom, map<string, map<int, double> > &ID_counter, int &ntotalsteps){
+	int scanparallel = 1;
+	istringstream(config["GLOBAL"]["scanparallel"]) >> scanparallel;
+	scanparallel = max(1, scanparallel);
+	boost::filesystem::path scanfile = outpath / (boost::format("%012dscan.out") % jobnumber).str();
+	ofstream scanout(scanfile.string());
+	scan.Print(scanout);
+	cout << "Scanning " << scan.size() << " parameter sets listed in " << scanfile << "\n";
+
+	atomic<unsigned long> nextpoint(0);
+	mutex countermutex;
+	auto simulatepoints = [&]{
+		unsigned long point;
+		while (not quit.load() && (point = nextpoint++) < scan.size()){
+			TConfig pointconfig = scan.Point(config, point);
+			pointconfig["GLOBAL"]["logprefix"] = (boost::format("scan%1%_") % point).str();
+			TFieldManager pointfield(pointconfig);
+			TGeometry pointgeom(geom, pointconfig);
+			unique_ptr<TParticleSource> pointsource(CreateParticleSource(pointconfig, pointgeom));
+			TCheckpoint noresume;
+			map<string, map<int, double> > pointID_counter;
+			int pointsteps = 0;
+			SimulateParticles(pointconfig, pointgeom, pointfield, *pointsource, noresume, pointID_counter, pointsteps);
+
+			lock_guard<mutex> lock(countermutex);
+			cout << "\nScan point " << point << ":\n";
+			OutputCodes(pointID_counter);
+			for (auto &particle: pointID_counter){
+				for (auto &stopID: particle.second)
+					ID_counter[particle.first][stopID.first] += stopID.second;
+			}
+			ntotalsteps += pointsteps;
+		}
+	};
+	vector<thread> threads;
+	for (int i = 1; i < scanparallel; ++i)
+		threads.push_back(thread(simulatepoints));
+	simulatepoints();
+	for (auto &t: threads)
+		t.join();
+}
+
+
+/**
+ * Track spins again along trajectories recorded with the trajectorylog option, for the configuration or each point of a parameter scan
+ *
+ * The trajectory files are listed in the GLOBAL option trajectoryfiles. Up to nthreads points are replayed in parallel, like scanparallel points in SimulateScan.
+ * Each particle draws random numbers from the substream of its primary particle.
+ *
+ * @param config Configuration
+ * @param scan Parameter scan, the configuration itself is replayed if it has no points
+ * @param geom Experiment geometry
+ * @param ID_counter Returns sum of statistical weights of replayed particles with each stop ID for each particle type, summed over all points
+ */
+void ReplaySpins(TConfig &config, const TParameterScan &scan, const TGeometry &geom, map<string, map<int, double> > &ID_counter){
+	vector<boost::filesystem::path> files;
+	istringstream filenames(config["GLOBAL"]["trajectoryfiles"]);
+	boost::filesystem::path filename;
+	while (filenames >> filename)
+		files.push_back(boost::filesystem::absolute(filename, configpath.parent_path()));
+	if (files.empty())
+		throw runtime_error("Replaying spins requires trajectory files given in the option trajectoryfiles!");
+	const vector<TRecordedTrajectory> trajectories = ReadTrajectories(files);
+	unsigned long npoints = max(scan.size(), 1UL);
+	if (scan.size() > 0){
+		boost::filesystem::path scanfile = outpath / (boost::format("%012dscan.out") % jobnumber).str();
+		ofstream scanout(scanfile.string());
+		scan.Print(scanout);
+		cout << "Replaying spins for " << scan.size() << " parameter sets listed in " << scanfile << "\n";
+	}
+
+	atomic<unsigned long> nextpoint(0);
+	mutex countermutex;
+	auto replaypoints = [&]{
+		unsigned long point;
+		while (not quit.load() && (point = nextpoint++) < npoints){
+			TConfig pointconfig = scan.size() > 0 ? scan.Point(config, point) : config;
+			if (scan.size() > 0)
+				pointconfig["GLOBAL"]["logprefix"] = (boost::format("scan%1%_") % point).str();
+			TFieldManager pointfield(pointconfig);
+			TGeometry pointgeom(geom, pointconfig);
+			TTracker t(pointconfig);
+			map<string, map<int, double> > pointID_counter;
+			unsigned long skipped = 0;
+			for (auto &trajectory: trajectories){
+				if (quit.load())
+					break;
+				const TTrajectoryKnot &start = trajectory.knots.front();
+				TMCGenerator mc(seed, jobnumber);
+				unique_ptr<TParticle> p(CreateParticle(trajectory.name, 0, start.t, start.y[0], start.y[1], start.y[2], 0, 0, 0, start.y[7], mc, pointgeom, pointfield));
+				istringstream state(trajectory.state);
+				p->ReadState(state, pointgeom);
+				if (p->GetInitialTime() != start.t){ // recording started when tracking was continued from a checkpoint
+					++skipped;
+					continue;
+				}
+				mc.SetSubstream(p->GetParticleNumber(), 0);
+				t.ReplaySpin(p, trajectory.knots, mc, pointgeom, pointfield);
+				pointID_counter[p->GetName()][p->GetStopID()] += p->GetStatisticalWeight();
+			}
+
+			lock_guard<mutex> lock(countermutex);
+			if (scan.size() > 0)
+				cout << "\nScan point " << point << ":\n";
+			if (skipped > 0)
+				cout << skipped << " trajectories do not start where their particle was created and were skipped\n";
+			OutputCodes(pointID_counter);
+			for (auto &particle: pointID_counter){
+				for (auto &stopID: particle.second)
+					ID_counter[particle.first][stopID.first] += stopID.second;
+			}
+		}
+	};
+	vector<thread> threads;
+	for (int i = 1; i < nthreads; ++i)
+		threads.push_back(thread(replaypoints));
+	replaypoints();
+	for (auto &t: threads)
+		t.join();
+}
+
+
+/**
+ * Estimate CPU time, memory, and output volume of a run from a random sample of its particles
+ *
+ * Tracks estimatecount primary particles, drawn at random from the simcount particles of the run, together with their secondaries in a single thread.
+ * Each particle is created from the same random numbers as in the full run with the same seed and job number.
+ * CPU times and sizes of the log files written for the sample are extrapolated to simcount particles,
+ * and the number of jobs is suggested that finish within estimatejobtime hours using nthreads threads each.
+ * The report is printed and written to out/<jobnumber>estimate.out.
+ *
+ * @param config Configuration
+ * @param geom Experiment geometry
+ * @param field TFieldManager containing all electromagnetic fields
+ * @param source Particle source
+ * @param ID_counter Returns sum of statistical weights of sampled particles with each stop ID for each particle type
+ * @param ntotalsteps Returns number of integration steps of sampled particles
+ */
+void EstimateCost(TConfig &config, TGeometry &geom, const TFieldManager &field, TParticleSource &source,
+		map<string, map<int, double> > &ID_counter, int &ntotalsteps){
+	long long samplecount = 100;
+	istringstream(config["GLOBAL"]["estimatecount"]) >> samplecount;
+	double jobtime = 24;
+	istringstream(config["GLOBAL"]["estimatejobtime"]) >> jobtime;
+	if (samplecount < 1 || not (jobtime > 0))
+		throw runtime_error("Cost estimates require estimatecount >= 1 and estimatejobtime > 0!");
+
+	set<long long> sample;
+	if (samplecount >= simcount){
+		for (long long number = 1; number <= simcount; ++number)
+			sample.insert(number);
+	}
+	else{
+		TMCGenerator samplemc(seed, jobnumber);
+		samplemc.SetSubstream(0, 1); // particle numbers start at 1 and the source draws from substream 0 of particle 0, so this substream is not used otherwise
+		uniform_int_distribution<long long> number(1, simcount);
+		while (static_cast<long long>(sample.size()) < samplecount)
+			sample.insert(number(samplemc));
+	}
+	cout << "Estimating cost of " << simcount << " " << source.GetParticleName() << "s from a sample of " << sample.size() << "...\n";
+
+	time_t starttime = time(nullptr);
+	TMCGenerator sourcemc(seed, jobnumber);
+	source.Prepare(sourcemc, geom, field);
+	vector<double> cputimes; // CPU time of each sampled primary particle including its secondaries [s]
+	progress_display progress(sample.size());
+	{
+		TTracker t(config); // log files are complete when the tracker is destroyed
+		for (long long number: sample){
+			if (quit.load())
+				break;
+			clock_t start = clock();
+			vector<TParticleTask> tasks(1);
+			tasks[0].mc = TMCGenerator(seed, jobnumber);
+			tasks[0].mc.SetSubstream(number, 0);
+			source.ParticleCounter = number - 1;
+			source.StartQuasiRandom(tasks[0].mc, number);
+			tasks[0].particle.reset(source.CreateParticle(tasks[0].mc, geom, field));
+			tasks[0].mc.StopQuasiRandom();
+			while (not tasks.empty()){
+				TParticleTask task = move(tasks.back());
+				tasks.pop_back();
+				unique_ptr<TParticle> &p = task.particle;
+				t.IntegrateParticle(p, SimTime, task.mc, geom, field);
+				ID_counter[p->GetName()][p->GetStopID()] += p->GetStatisticalWeight();
+				ntotalsteps += p->GetNumberOfSteps();
+				auto pushsecondary = [&](unique_ptr<TParticle> &particle, const TMCGenerator::result_type n){
+					TParticleTask secondary;
+					secondary.particle = move(particle);
+					secondary.secondaryindex = TMCGenerator::SecondaryIndex(task.secondaryindex, n);
+					secondary.mc = TMCGenerator(seed, jobnumber);
+					secondary.mc.SetSubstream(secondary.particle->GetParticleNumber(), secondary.secondaryindex);
+					tasks.push_back(move(secondary));
+				};
+				for (auto &clone: t.TakeClones())
+					pushsecondary(clone.first, clone.second);
+				if (secondaries == 1){
+					auto &secs = p->GetSecondaryParticles();
+					for (unsigned i = 0; i < secs.size(); ++i)
+						pushsecondary(secs[i], i);
+				}
+			}
+			cputimes.push_back(static_cast<double>(clock() - start)/CLOCKS_PER_SEC);
+			++progress;
+		}
+		loggermemory = t.LoggerMemoryUsage();
+	}
+	if (cputimes.empty())
+		return;
+
+	string logprefix;
+	istringstream(config["GLOBAL"]["logprefix"]) >> logprefix;
+	string fileprefix = logprefix + (boost::format("%012d") % jobnumber).str();
+	double bytes = 0; // size of all log files written for the sample
+	for (boost::filesystem::directory_iterator f(outpath); f != boost::filesystem::directory_iterator(); ++f){
+		string name = f->path().filename().string();
+		if (boost::filesystem::is_regular_file(f->status()) && name.compare(0, fileprefix.size(), fileprefix) == 0 && boost::filesystem::last_write_time(f->path()) >= starttime)
+			bytes += boost::filesystem::file_size(f->path());
+	}
+	long currentmemory, peakmemory;
+	ResidentMemory(currentmemory, peakmemory);
+
+	double n = cputimes.size();
+	double mean = accumulate(cputimes.begin(), cputimes.end(), 0.)/n;
+	double variance = 0;
+	for (double c: cputimes)
+		variance += (c - mean)*(c - mean);
+	variance = n > 1 ? variance/(n - 1) : 0.;
+	double maxtime = *max_element(cputimes.begin(), cputimes.end());
+
+	// particles per job N with N*mean + 3*sqrt(N)*sigma <= CPU time of job, so fluctuations of the costs of single particles rarely let a job exceed its time limit
+	double budget = nthreads*jobtime*3600;
+	long long perjob = simcount;
+	if (mean > 0){
+		double x = (-3*sqrt(variance) + sqrt(9*variance + 4*mean*budget))/(2*mean);
+		perjob = min(static_cast<long long>(simcount), max(1LL, static_cast<long long>(floor(x*x))));
+	}
+	long long jobs = (simcount + perjob - 1)/perjob;
+	perjob = (simcount + jobs - 1)/jobs; // spread particles evenly over jobs
+
+	ostringstream report;
+	report << boost::format("Sampled %1% of %2% primary particles\n") % cputimes.size() % simcount;
+	report << boost::format("CPU time per primary particle including secondaries: mean %.3g s, standard deviation %.3g s, max. %.3g s\n") % mean % sqrt(variance) % maxtime;
+	report << boost::format("Estimated CPU time of %d particles: %.3g +- %.2g h\n") % simcount % (mean*simcount/3600) % (sqrt(variance/n)*simcount/3600);
+	report << boost::format("Peak memory per process: %.0f MB, does not grow with simcount or nthreads\n") % (peakmemory/1024.);
+	report << boost::format("Log files: %.3g kB per particle, estimated total %.3g GB\n") % (bytes/n/1e3) % (bytes/n*simcount/1e9);
+	report << boost::format("Suggested split for max. %g h per job with nthreads %d:\n") % jobtime % nthreads;
+	report << boost::format("  job array: %d jobs with different job numbers and simcount %d each\n") % jobs % perjob;
+	report << boost::format("  MPI: %d processes with simcount %d, expected wall-clock time %.3g h\n") % jobs % simcount % (mean*simcount/3600/jobs/nthreads);
+	if (maxtime > jobtime*3600)
+		report << boost::format("Warning: a single particle took %.3g h, longer than a job, limit particles with maxcputime\n") % (maxtime/3600);
+	cout << "\n\n" << report.str();
+	boost::filesystem::path reportfile = outpath / (boost::format("%012destimate.out") % jobnumber).str();
+	ofstream reportout(reportfile.string());
+	reportout << report.str();
+	cout << "Wrote cost estimate to " << reportfile << "\n";
+}
+
+
+/**
+ * Print memory used by fields, geometry, and loggers, together with current and peak resident memory of the process
+ *
+ * Subsystems report approximate sizes of their tables, trees, and buffers, see TFieldManager::MemoryUsage, TTriangleMesh::MemoryUsage, and TLogger::MemoryUsage.
+ * Loggers are only counted after particles were tracked.
+ *
+ * @param stage Stage of the simulation, printed with the report
+ * @param field Fields
+ * @param geom Geometry
+ */
+void PrintMemory(const string &stage, const TFieldManager &field, const TGeometry &geom){
+	long current, peak;
+	ResidentMemory(current, peak);
+	printf("Memory %s: fields %.1f MB, geometry %.1f MB", stage.c_str(), field.MemoryUsage()/1048576., geom.mesh->MemoryUsage()/1048576.);
+	if (loggermemory.load() > 0)
+		printf(", loggers %.1f MB", loggermemory.load()/1048576.);
+	printf(", resident %.1f MB, peak resident %.1f MB\n", current/1024., peak/1024.);
+}
+
+
 /**
  * Read config file.
  *
@@ -213,19 +991,35 @@ TConfig ConfigInit(int argc, char **argv){
 	seed = 0;
 	simtype = PARTICLE;
 	simcount = 1;
+	nthreads = 1;
+	pinthreads = false;
+	replayparticle = 0;
+	checkpoint = false;
+	checkpointinterval = 0;
+	statusinterval = 0;
+	statusformat = TStatusMonitor::JSON;
+	resume = false;
 	/*end default values*/
 
-	if(argc>1) // if user supplied at least 1 arg (jobnumber)
-		istringstream(argv[1]) >> jobnumber;
-	if(argc>2){ // if user supplied 2 or more args (jobnumber, configpath)
-		configpath = boost::filesystem::absolute(argv[2]); // input path pointer set
+	vector<string> args; // positional parameters
+	for (int i = 1; i < argc; ++i){
+		if (strcmp(argv[i], "--resume") == 0)
+			resume = true;
+		else
+			args.push_back(argv[i]);
+	}
+
+	if(args.size()>0) // if user supplied at least 1 arg (jobnumber)
+		istringstream(args[0]) >> jobnumber;
+	if(args.size()>1){ // if user supplied 2 or more args (jobnumber, configpath)
+		configpath = boost::filesystem::absolute(args[1]); // input path pointer set
 		if (boost::filesystem::is_directory(configpath))
 			configpath /= "config.in";
 	}
-	if(argc>3) // if user supplied 3 or more args (jobnumber, configpath, outpath)
-		outpath = boost::filesystem::absolute(argv[3]); // set the output path pointer
-	if (argc>4) // if user supplied 4 or more args (jobnumber, configpath, outpath, seed)
-		istringstream(argv[4]) >> seed;
+	if(args.size()>2) // if user supplied 3 or more args (jobnumber, configpath, outpath)
+		outpath = boost::filesystem::absolute(args[2]); // set the output path pointer
+	if (args.size()>3) // if user supplied 4 or more args (jobnumber, configpath, outpath, seed)
+		istringstream(args[3]) >> seed;
 	
 	TConfig config(configpath.native());
 	config.convert(configpath.native());
@@ -237,7 +1031,36 @@ TConfig ConfigInit(int argc, char **argv){
 	istringstream(config["GLOBAL"]["simcount"])		>> simcount;
 	istringstream(config["GLOBAL"]["simtime"])		>> SimTime;
 	istringstream(config["GLOBAL"]["secondaries"])	>> secondaries;
-	
+	istringstream(config["GLOBAL"]["nthreads"])		>> nthreads;
+	if (nthreads < 1)
+		nthreads = 1;
+	istringstream(config["GLOBAL"]["pinthreads"])	>> pinthreads;
+	istringstream(config["GLOBAL"]["checkpoint"])	>> checkpoint;
+	istringstream(config["GLOBAL"]["checkpointinterval"]) >> checkpointinterval;
+	istringstream(config["GLOBAL"]["statusinterval"]) >> statusinterval;
+	string statusfmt = "json";
+	istringstream(config["GLOBAL"]["statusformat"]) >> statusfmt;
+	if (statusfmt == "prometheus")
+		statusformat = TStatusMonitor::PROMETHEUS;
+	else if (statusfmt != "json")
+		throw std::runtime_error("Unknown statusformat " + statusfmt + "! Use json or prometheus.");
+	if (resume){ // a resumed simulation writes checkpoints again and continues its log files
+		checkpoint = true;
+		config["GLOBAL"]["checkpoint"] = "1";
+		config["GLOBAL"]["appendlog"] = "1";
+	}
+	if (checkpoint && TProcessGroup::Size() > 1)
+		throw std::runtime_error("Checkpoints can only be written by a single process!");
+	double MRprobtolerance = 0;
+	istringstream(config["GLOBAL"]["MRprobtolerance"]) >> MRprobtolerance;
+	MR::EnableMRProbTables(MRprobtolerance);
+	vector<string> MRprobtables;
+	istringstream MRprobtablesin(config["GLOBAL"]["MRprobtables"]);
+	boost::filesystem::path MRprobtablefile;
+	while (MRprobtablesin >> MRprobtablefile) // tables calculated by simtype 9, relative to the config file
+		MRprobtables.push_back(boost::filesystem::absolute(MRprobtablefile, configpath.parent_path()).native());
+	MR::ReadMRProbTables(MRprobtables);
+
 	// add default parameters from PARTICLES section to each individual particle's parameters
 	for (auto i = config["PARTICLES"].begin(); i != config["PARTICLES"].end(); ++i){
 		config["neutron"].insert(*i);
@@ -246,6 +1069,34 @@ TConfig ConfigInit(int argc, char **argv){
 		config["mercury"].insert(*i);
 		config["xenon"].insert(*i);
 	}
+	for (string particlename: {"neutron", "proton", "electron", "mercury", "xenon"}){ // report invalid particle options before anything is loaded
+		try{
+			TParticleOptions options(config[particlename]);
+		}
+		catch (std::runtime_error &e){
+			throw std::runtime_error("Invalid options for " + particlename + ": " + e.what());
+		}
+	}
+
+	if (simtype == REPLAY){ // track a single particle in a single thread and enable all logs for it and its secondaries
+		istringstream(config["GLOBAL"]["replayparticle"]) >> replayparticle;
+		if (seed == 0 || replayparticle < 1)
+			throw std::runtime_error("Replaying a particle requires the random seed of the original run and a replayparticle number >= 1!");
+		simcount = 1;
+		nthreads = 1;
+		for (string particlename: {"neutron", "proton", "electron", "mercury", "xenon"}){
+			for (string log: {"endlog", "tracklog", "hitlog", "snapshotlog", "spinlog", "diagnosticlog"}){
+				config[particlename][log] = "1";
+				config[particlename][log + "filter"] = "";
+			}
+		}
+	}
+	else if (simtype == ESTIMATE){ // the sample writes fresh log files, so their size can be measured
+		if (resume)
+			throw std::runtime_error("Cost estimates cannot be resumed!");
+		checkpoint = false;
+		config["GLOBAL"]["appendlog"] = "0";
+	}
 	
 	return config;
 }
@@ -255,63 +1106,74 @@ TConfig ConfigInit(int argc, char **argv){
  * 
  * Output a table containing the MR diffuse reflection probability for the specified range of solid angles from the config.in file
  *
+ * The 100 rows of azimuthal angles are distributed over nthreads threads, the table is written with PrintTable in the format selected by fieldoutput.
+ *
  * @param config TConfig class containing parameters
  * @param outpath The file name of the file to which results will be printed
  *  
  * Other params are read in from the config.in file
 */
 void PrintMROutAngle(TConfig &config, const boost::filesystem::path &outpath) {
-	vector<double> MRSolidAngleDRPParams; ///< params to output the  MR-DRP values for given theta_inc and phi_inc [Fermi potential, incident neutron energy, b (nm), w (nm), theta_i] (read from config)
+	vector<double> MRSolidAngleDRPParams; ///< params to output the  MR-DRP values for given theta_inc and phi_inc [Fermi potential (neV), incident neutron energy (neV), b (m), w (m), theta_i] (read from config)
 	istringstream ss(config["GLOBAL"]["MRSolidAngleDRP"]);
 	copy(istream_iterator<double>(ss), istream_iterator<double>(), back_inserter(MRSolidAngleDRPParams));
 	if (MRSolidAngleDRPParams.size() != 5)
 		throw std::runtime_error("Incorrect number of parameters to print micro-roughness distribution!");
 	
 	ostringstream oss;
-	oss << "MR-SldAngDRP" << "-F" << MRSolidAngleDRPParams[0] << "-En" << MRSolidAngleDRPParams[1] << "-b" << MRSolidAngleDRPParams[2] << "-w" << MRSolidAngleDRPParams[3] << "-th" << MRSolidAngleDRPParams[4] << ".out"; 
+	oss << "MR-SldAngDRP" << "-F" << MRSolidAngleDRPParams[0] << "-En" << MRSolidAngleDRPParams[1] << "-b" << MRSolidAngleDRPParams[2] << "-w" << MRSolidAngleDRPParams[3] << "-th" << MRSolidAngleDRPParams[4];
  	boost::filesystem::path fileName = outpath / oss.str();
 	
 	cout << "\nGenerating table of MR diffuse reflection probability for all solid angles in " << fileName << "...\n";	
 	
-	ofstream mrproboutfile(fileName.c_str());
-	if (!mrproboutfile)
-		throw ((boost::format("Could not open %1%!") % fileName.c_str()).str());
-
-	//print file header
-	mrproboutfile << "phi_out theta_out mrdrp\n";
 	double theta_inc = MRSolidAngleDRPParams[4];
+	double Estep = MRSolidAngleDRPParams[0]*1e-9;
 	
 	//determine neutron velocity corresponding to the energy and create a state_type vector from it
 	double vabs = sqrt(2*MRSolidAngleDRPParams[1]*1e-9/m_n);
 	double v[3] = {0, vabs*sin(theta_inc), -vabs*cos(theta_inc)};
 	double norm[] = { 0, 0, 1 };
 
-	//write the mrprob values to the output file
-	for (double phi=-pi; phi<pi; phi+=(2*pi)/100) {
-		
-		for (double theta=0; theta<pi/2; theta+=(pi/2)/100) {
-			//the sin(theta) factor is needed to normalize for different size of surface elements in spherical coordinates
-			double mrprob = MR::MRDist(false, false, v, norm, MRSolidAngleDRPParams[0], MRSolidAngleDRPParams[2], MRSolidAngleDRPParams[3], theta, phi)*sin(theta);
-			mrproboutfile << phi << ' ' << theta << ' ' << mrprob << '\n';
-		}
-		for (double theta=0; theta<pi/2; theta+=(pi/2)/100) {
-			//the sin(theta) factor is needed to normalize for different size of surface elements in spherical coordinates
-			double mrprob = MR::MRDist(true, false, v, norm, MRSolidAngleDRPParams[0], MRSolidAngleDRPParams[2], MRSolidAngleDRPParams[3], theta, phi)*sin(theta);
-			mrproboutfile << phi << ' ' << pi - theta << ' ' << mrprob << '\n';
+	const int nphi = 100, ntheta = 100;
+	const vector<string> titles = {"phi_out", "theta_out", "mrdrp"};
+	vector<double> values(nphi*2*ntheta*titles.size());
+	auto start = chrono::steady_clock::now();
+	ParallelFor(nphi, nthreads, [&](const unsigned long begin, const unsigned long end){
+		vector<double> theta(ntheta), phi(ntheta), mrdrp(ntheta);
+		for (int j = 0; j < ntheta; ++j)
+			theta[j] = j*(pi/2)/ntheta;
+		for (unsigned long i = begin; i < end; ++i){
+			fill(phi.begin(), phi.end(), -pi + i*2*pi/nphi);
+			for (bool transmit: {false, true}){ // reflected directions first, then transmitted directions
+				MR::MRDist(transmit, false, v, norm, Estep, MRSolidAngleDRPParams[2], MRSolidAngleDRPParams[3], ntheta, &theta[0], &phi[0], &mrdrp[0]);
+				for (int j = 0; j < ntheta; ++j){
+					double *row = &values[(i*2*ntheta + transmit*ntheta + j)*titles.size()];
+					row[0] = phi[j];
+					row[1] = transmit ? pi - theta[j] : theta[j];
+					//the sin(theta) factor is needed to normalize for different size of surface elements in spherical coordinates
+					row[2] = mrdrp[j]*sin(theta[j]);
+				}
+			}
 		}
-	}
-} // end PrintMRThetaIEnergy
+	});
+	fileName = PrintTable(config, fileName, titles, values);
+	printf("Wrote %s in %fs\n", fileName.c_str(), chrono::duration<double>(chrono::steady_clock::now() - start).count());
+} // end PrintMROutAngle
 
 
 /**
  * 
- * Output a table in root format giving the total MR DRP for a set of incident theta angles and neutron energy. 
+ * Output a table giving the total MR DRP for a set of incident theta angles and neutron energy.
+ *
+ * The 100 rows of incident angles are distributed over nthreads threads, the table is written with PrintTable in the format selected by fieldoutput.
+ * If MRprobtolerance is set, the lookup tables of total reflection and transmission probabilities for the material are also written with MR::WriteMRProbTable,
+ * so they can be listed in the MRprobtables option instead of being calculated by every tracking thread.
  *
  * @param config TConfig class containing parameters
  * @param outpath The file name to which the results will be printed
 */
 void PrintMRThetaIEnergy(TConfig &config, const boost::filesystem::path &outpath) {
-	vector<double> MRThetaIEnergyParams; ///< params for which to output the integrated MR-DRP values [Fermi potential, b (nm), w (nm), theta_i_start, theta_i_end, neut_energy_start, neut_energy_end] (read from config.in)
+	vector<double> MRThetaIEnergyParams; ///< params for which to output the integrated MR-DRP values [Fermi potential (neV), b (m), w (m), theta_i_start, theta_i_end, neut_energy_start (neV), neut_energy_end (neV)] (read from config.in)
 	istringstream ss(config["GLOBAL"]["MRThetaIEnergy"]);
 	copy(istream_iterator<double>(ss), istream_iterator<double>(), back_inserter(MRThetaIEnergyParams));
 	if (MRThetaIEnergyParams.size() != 7)
@@ -319,74 +1181,125 @@ void PrintMRThetaIEnergy(TConfig &config, const boost::filesystem::path &outpath
 
 
 	ostringstream oss;
-	oss << "MR-Tot-DRP" << "-F" << MRThetaIEnergyParams[0] << "-b" << MRThetaIEnergyParams[1] << "-w" << MRThetaIEnergyParams[2] << ".out"; 
+	oss << "MR-Tot-DRP" << "-F" << MRThetaIEnergyParams[0] << "-b" << MRThetaIEnergyParams[1] << "-w" << MRThetaIEnergyParams[2];
  	boost::filesystem::path fileName = outpath / oss.str();	
 	
 	cout << "\nGenerating table of integrated MR diffuse reflection probability for different incident angle and energy in " << fileName << "...\n";	
 
-	ofstream mroutfile(fileName.c_str());
-	if (!mroutfile)
-		throw ((boost::format("Could not open %1%!") % fileName).str());
-
-	mroutfile << "theta_i neut_en totmrdrp\n"; //print the header
-	
-	//define the min and max values of the following for loop
+	//define the min and max values of the grid
 	double theta_start = MRThetaIEnergyParams[3];
 	double theta_end = MRThetaIEnergyParams[4];
 	double neute_start = MRThetaIEnergyParams[5];
 	double neute_end = MRThetaIEnergyParams[6];
+	double Estep = MRThetaIEnergyParams[0]*1e-9;
 	double norm[] = { 0, 0, 1 };
- 	//write the integrated mrprob values to the output file
- 	progress_display progress(100);
-	for (double theta = theta_start; theta<theta_end; theta += (theta_end-theta_start)/100) {
-		//since this part can be slow it is helpful to monitor the progress
-        progress += 100*(theta - theta_start)/(theta_end - theta_start) - progress.count();
-
-		for (double energy = neute_start; energy<neute_end; energy += (neute_end-neute_start)/100) {
-			//determine neutron velocity corresponding to the energy and create a state_type vector from it
-			double vabs = sqrt(2*energy*1e-9/m_n);
-			double v[3] = {0, vabs*sin(theta), -vabs*cos(theta)};
-			//the sin(theta) factor is needed to noramlize for different sizes of surface elements in spherical coordinates
-			double totmrprob = MR::MRProb(false, v, norm, MRThetaIEnergyParams[0], MRThetaIEnergyParams[1], MRThetaIEnergyParams[2]);
-			mroutfile << theta << ' ' << energy << ' ' << totmrprob << '\n';
+	const int ntheta = 100, nenergy = 100;
+	const vector<string> titles = {"theta_i", "neut_en", "totmrdrp"};
+	vector<double> values(ntheta*nenergy*titles.size());
+	auto start = chrono::steady_clock::now();
+	ParallelFor(ntheta, nthreads, [&](const unsigned long begin, const unsigned long end){
+		for (unsigned long i = begin; i < end; ++i){
+			double theta = theta_start + i*(theta_end - theta_start)/ntheta;
+			for (int j = 0; j < nenergy; ++j){
+				double energy = neute_start + j*(neute_end - neute_start)/nenergy;
+				//determine neutron velocity corresponding to the energy and create a state_type vector from it
+				double vabs = sqrt(2*energy*1e-9/m_n);
+				double v[3] = {0, vabs*sin(theta), -vabs*cos(theta)};
+				double *row = &values[(i*nenergy + j)*titles.size()];
+				row[0] = theta;
+				row[1] = energy;
+				row[2] = MR::MRProb(false, v, norm, Estep, MRThetaIEnergyParams[1], MRThetaIEnergyParams[2]);
+			}
+		}
+	});
+	fileName = PrintTable(config, fileName, titles, values);
+	printf("Wrote %s in %fs\n", fileName.c_str(), chrono::duration<double>(chrono::steady_clock::now() - start).count());
+
+	double MRprobtolerance = 0;
+	istringstream(config["GLOBAL"]["MRprobtolerance"]) >> MRprobtolerance;
+	if (MRprobtolerance > 0){ // lookup tables as built during tracking, for reflection and transmission
+		for (bool transmit: {false, true}){
+			boost::filesystem::path tableName = outpath / (oss.str() + (transmit ? "-trans" : "-refl") + ".mrtable");
+			start = chrono::steady_clock::now();
+			MR::WriteMRProbTable(tableName.native(), transmit, Estep, MRThetaIEnergyParams[1], MRThetaIEnergyParams[2], nthreads);
+			printf("Wrote lookup table %s in %fs\n", tableName.c_str(), chrono::duration<double>(chrono::steady_clock::now() - start).count());
 		}
 	}
-	cout << '\n';
 } // end PrintMRThetaIEnergy
 
 
 /**
  * Print final particles statistics.
  *
- * @param ID_counter A list of counters indicating the numbers of particles with each stopID.
+ * @param ID_counter A list of counters indicating the numbers of particles with each stopID, weighted by their statistical weights.
  */
-void OutputCodes(const map<string, map<int, int> > &ID_counter){
+void OutputCodes(const map<string, map<int, double> > &ID_counter){
 	cout << "\nThe simulated particles suffered following fates:\n";
 	for (auto i = ID_counter.begin(); i != ID_counter.end(); i++){
-		map<int, int> counts = i->second;
+		map<int, double> counts = i->second;
 		const char *name = i->first.c_str();
-		printf("%4i: %6i %10s(s) were absorbed on a surface\n",	 2, counts[ 2], name);
-		printf("%4i: %6i %10s(s) were absorbed in a material\n", 1, counts[ 1], name);
-		printf("%4i: %6i %10s(s) were not categorized\n",		 0, counts[ 0], name);
-		printf("%4i: %6i %10s(s) did not finish\n",				-1, counts[-1], name);
-		printf("%4i: %6i %10s(s) hit outer boundaries\n",		-2, counts[-2], name);
-		printf("%4i: %6i %10s(s) produced integration error\n", -3, counts[-3], name);
-		printf("%4i: %6i %10s(s) decayed\n",					-4, counts[-4], name);
-		printf("%4i: %6i %10s(s) found no initial position\n",	-5, counts[-5], name);
-		printf("%4i: %6i %10s(s) encountered CGAL error\n",		-6, counts[-6], name);
-		printf("%4i: %6i %10s(s) encountered geometry error\n",	-7, counts[-7], name);
+		printf("%4i: %6.10g %10s(s) were absorbed on a surface\n",	 2, counts[ 2], name);
+		printf("%4i: %6.10g %10s(s) were absorbed in a material\n", 1, counts[ 1], name);
+		printf("%4i: %6.10g %10s(s) were not categorized\n",		 0, counts[ 0], name);
+		printf("%4i: %6.10g %10s(s) did not finish\n",				-1, counts[-1], name);
+		printf("%4i: %6.10g %10s(s) hit outer boundaries\n",		-2, counts[-2], name);
+		printf("%4i: %6.10g %10s(s) produced integration error\n", -3, counts[-3], name);
+		printf("%4i: %6.10g %10s(s) decayed\n",					-4, counts[-4], name);
+		printf("%4i: %6.10g %10s(s) found no initial position\n",	-5, counts[-5], name);
+		printf("%4i: %6.10g %10s(s) encountered CGAL error\n",		-6, counts[-6], name);
+		printf("%4i: %6.10g %10s(s) encountered geometry error\n",	-7, counts[-7], name);
+		printf("%4i: %6.10g %10s(s) were killed by Russian roulette\n", -8, counts[-8], name);
+		printf("%4i: %6.10g %10s(s) exceeded their budget\n",		-9, counts[-9], name);
 		printf("\n");
 	}
 }
 
 
+/**
+ * Evaluate magnetic and electric fields at a list of points and write them into a file.
+ *
+ * The points are distributed over nthreads threads.
+ *
+ * @param config TConfig class containing output options
+ * @param outfile Filename of result file without extension
+ * @param points List of points
+ * @param t Time at which fields are evaluated
+ * @param field TFieldManager structure which should be evaluated
+ */
+void PrintFields(TConfig &config, const boost::filesystem::path &outfile, const vector<array<double, 3> > &points, const double t, const TFieldManager &field){
+	const vector<string> titles = {"x", "y", "z", "Bx", "dBxdx", "dBxdy", "dBxdz", "By", "dBydx", "dBydy", "dBydz", "Bz", "dBzdx", "dBzdy", "dBzdz", "Ex", "Ey", "Ez", "V"};
+	vector<double> values(points.size()*titles.size());
+	auto start = chrono::steady_clock::now(); // do some time statistics
+	ParallelFor(points.size(), nthreads, [&](const unsigned long begin, const unsigned long end){
+		for (unsigned long i = begin; i < end; ++i){
+			double *row = &values[i*titles.size()];
+			double B[3], dBidxj[3][3], Ei[3], V;
+			field.BField(points[i][0], points[i][1], points[i][2], t, B, dBidxj);
+			field.EField(points[i][0], points[i][1], points[i][2], t, V, Ei);
+			for (int k = 0; k < 3; k++){
+				row[k] = points[i][k];
+				row[3 + 4*k] = B[k];
+				for (int l = 0; l < 3; l++)
+					row[4 + 4*k + l] = dBidxj[k][l];
+				row[15 + k] = Ei[k];
+			}
+			row[18] = V;
+		}
+	});
+	double duration = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	boost::filesystem::path filename = PrintTable(config, outfile, titles, values);
+	// print time statistics
+	printf("\nWrote magnetic and electric fields %lu times into %s in %fs (%fms per call)\n", static_cast<unsigned long>(points.size()), filename.c_str(), duration, duration/points.size()*1000);
+}
+
+
 /**
  * Print planar slice of fields into a file.
  *
  * The slice plane is given by three points BCutPlayPoint[0..8] on the plane
  *
  * @param config TConfig class containing cut parameters
- * @param outfile filename of result file
+ * @param outfile filename of result file without extension
  * @param field TFieldManager structure which should be evaluated
  */
 void PrintBFieldCut(TConfig &config, const boost::filesystem::path &outfile, const TFieldManager &field){
@@ -406,43 +1319,51 @@ void PrintBFieldCut(TConfig &config, const boost::filesystem::path &outfile, con
 	// get directional vectors from points on plane by u = p2-p1, v = p3-p1
 	double u[3] = {BCutPlanePoint[3] - BCutPlanePoint[0], BCutPlanePoint[4] - BCutPlanePoint[1], BCutPlanePoint[5] - BCutPlanePoint[2]};
 	double v[3] = {BCutPlanePoint[6] - BCutPlanePoint[0], BCutPlanePoint[7] - BCutPlanePoint[1], BCutPlanePoint[8] - BCutPlanePoint[2]};
-	
-	// open output file
-	ofstream cutfile(outfile.c_str());
-	if (!cutfile){
-		std::cout << "Could not open " << outfile << "!\n";
-		exit(-1);
-	}
-	// print file header
-	cutfile << "x y z Bx dBxdx dBxdy dBxdz By dBydx dBydy dBydz Bz dBzdx dBzdy dBzdz Ex Ey Ez V\n";
-	
-	double Pp[3];
-	double B[3], dBidxj[3][3],Ei[3],V;
-	float start = clock(); // do some time statistics
+
 	// sample field BCutPlaneSmapleCount1 times in u-direction and BCutPlaneSampleCount2 time in v-direction
+	vector<array<double, 3> > points;
 	for (int i = 0; i < BCutPlaneSampleCount1; i++) {
 		for (int j = 0; j < BCutPlaneSampleCount2; j++){
+			array<double, 3> Pp;
 			for (int k = 0; k < 3; k++)
 				Pp[k] = BCutPlanePoint[k] + i*u[k]/BCutPlaneSampleCount1 + j*v[k]/BCutPlaneSampleCount2;
-			// print B-/E-Field to file
-         			cutfile << Pp[0] << " " << Pp[1] << " " << Pp[2] << " ";
-			
-			field.BField(Pp[0], Pp[1], Pp[2], BCutTime, B, dBidxj);
-			for (int k = 0; k < 3; k++){
-				cutfile << B[k] << " ";
-				for (int l = 0; l < 3; l++)
-					cutfile << dBidxj[k][l] << " ";
-			}
-
-			field.EField(Pp[0], Pp[1], Pp[2], BCutTime, V, Ei);
-			cutfile << Ei[0] << " " << Ei[1] << " " << Ei[2] << " " << V << "\n";
+			points.push_back(Pp);
 		}
 	}
-	start = (clock() - start)/CLOCKS_PER_SEC;
-	//close file
-	cutfile.close();
-	// print time statistics
-	printf("\nWrote magnetic and electric fields %u times into %s in %fs (%fms per call)\n",BCutPlaneSampleCount1*BCutPlaneSampleCount2, outfile.c_str(), start, start/BCutPlaneSampleCount1/BCutPlaneSampleCount2*1000);
+	PrintFields(config, outfile, points, BCutTime, field);
+}
+
+
+/**
+ * Print fields at a list of points into a file.
+ *
+ * The points are read from the file given in the GLOBAL option BPoints, containing one point "x y z" per line
+ *
+ * @param config TConfig class containing file name and time
+ * @param outfile filename of result file without extension
+ * @param field TFieldManager structure which should be evaluated
+ */
+void PrintBFieldPoints(TConfig &config, const boost::filesystem::path &outfile, const TFieldManager &field){
+	boost::filesystem::path pointfile;
+	double t;
+	istringstream str(config["GLOBAL"]["BPoints"]);
+	str >> pointfile >> t;
+	if (not str)
+		throw std::runtime_error("Missing config parameters for BPoints. File name and time are expected");
+	pointfile = boost::filesystem::absolute(pointfile, configpath.parent_path()); // relative paths are assumed to be relative to the config file's path
+
+	ifstream f(pointfile.c_str());
+	if (!f)
+		throw std::runtime_error("Could not open " + pointfile.string());
+	vector<array<double, 3> > points;
+	string line;
+	while (getline(f, line)){
+		istringstream lstr(line);
+		array<double, 3> p;
+		if (lstr >> p[0] >> p[1] >> p[2]) // skip empty lines and headers
+			points.push_back(p);
+	}
+	PrintFields(config, outfile, points, t, field);
 }
 
 
@@ -452,47 +1373,56 @@ void PrintBFieldCut(TConfig &config, const boost::filesystem::path &outfile, con
  * "Count" phase space for each energy bin and calculate "heating" of the neutrons due to
  * phase space compression by magnetic field ramping
  *
- * @param outfile Filename of output file
+ * @param config TConfig class containing output options
+ * @param outfile Filename of output file without extension
  * @param field TField structure which should be evaluated
  */
-void PrintBField(const boost::filesystem::path &outfile, const TFieldManager &field){
-	// print BField to file
-	ofstream bfile(outfile.c_str());
-	if (!bfile){
-		std::cout << "Could not open " << outfile << "!\n";
-		exit(-1);
-	}
-
-	bfile << "r phi z Bx By Bz 0 0 Babs\n";
+void PrintBField(TConfig &config, const boost::filesystem::path &outfile, const TFieldManager &field){
 	double rmin = 0.12, rmax = 0.5, zmin = 0, zmax = 1.2;
 	int E;
 	const int Emax = 108;
 	double dr = 0.1, dz = 0.1;
 	double VolumeB[Emax + 1];
 	for (E = 0; E <= Emax; E++) VolumeB[E] = 0;
-	
-	double EnTest;
-	double B[3];
+
 	// sample space in cylindrical pattern
+	vector<array<double, 2> > points;
 	for (double r = rmin; r <= rmax; r += dr){
-		for (double z = zmin; z <= zmax; z += dz){
-			field.BField(r, 0, z, 500.0, B); // evaluate field
-			double Babs = sqrt(B[0]*B[0] + B[1]*B[1] + B[2]*B[2]);
-			// print field values
-			bfile << r << " " << 0.0 << " " << z << " " << B[0] << " " << B[1] << " " << B[2] << " " << 0.0 << " " << 0.0 << " " << Babs << "\n";
-			std::cout << "r=" << r << ", z=" << z << ", Br=" << B[0] << " T, Bz=" << B[2] << " T\n";
-			
-			// Ramp Heating Analysis
-			for (E = 0; E <= Emax; E++){
-				EnTest = E*1.0e-9 - m_n*gravconst*z - mu_nSI/ele_e * Babs;
-				if (EnTest >= 0){
-					// add the volume segment to the volume that is accessible to a neutron with energy Energie
-					VolumeB[E] = VolumeB[E] + pi * dz * ((r+0.5*dr)*(r+0.5*dr) - (r-0.5*dr)*(r-0.5*dr));
-				}
+		for (double z = zmin; z <= zmax; z += dz)
+			points.push_back({r, z});
+	}
+	const vector<string> titles = {"r", "phi", "z", "Bx", "By", "Bz", "Babs"};
+	vector<double> values(points.size()*titles.size(), 0.);
+	ParallelFor(points.size(), nthreads, [&](const unsigned long begin, const unsigned long end){
+		for (unsigned long i = begin; i < end; ++i){
+			double *row = &values[i*titles.size()];
+			double B[3];
+			field.BField(points[i][0], 0, points[i][1], 500.0, B); // evaluate field
+			row[0] = points[i][0];
+			row[2] = points[i][1];
+			row[3] = B[0];
+			row[4] = B[1];
+			row[5] = B[2];
+			row[6] = sqrt(B[0]*B[0] + B[1]*B[1] + B[2]*B[2]);
+		}
+	});
+
+	double EnTest;
+	for (unsigned long i = 0; i < points.size(); ++i){
+		double r = points[i][0], z = points[i][1];
+		const double *row = &values[i*titles.size()];
+		std::cout << "r=" << r << ", z=" << z << ", Br=" << row[3] << " T, Bz=" << row[5] << " T\n";
+
+		// Ramp Heating Analysis
+		for (E = 0; E <= Emax; E++){
+			EnTest = E*1.0e-9 - m_n*gravconst*z - mu_nSI/ele_e * row[6];
+			if (EnTest >= 0){
+				// add the volume segment to the volume that is accessible to a neutron with energy Energie
+				VolumeB[E] = VolumeB[E] + pi * dz * ((r+0.5*dr)*(r+0.5*dr) - (r-0.5*dr)*(r-0.5*dr));
 			}
 		}
 	}
-	bfile.close();
+	PrintTable(config, outfile, titles, values); // print field values
 
 	// for investigating ramp heating of neutrons, volume accessible to neutrons with and
 	// without B-field is calculated and the heating approximated by thermodynamical means
@@ -510,29 +1440,94 @@ void PrintBField(const boost::filesystem::path &outfile, const TFieldManager &fi
 /**
  * Sample geometry randomly to visualize it.
  *
- * Creates random line segments and prints every intersection point with a surface
- * into outfile
+ * Creates random line segments between points in the bounding box of the geometry and prints every intersection point with a surface
+ * into outfile. The segments are split into blocks tested in parallel, each drawing from its own random-number substream,
+ * so the output only depends on the seed and not on the number of threads. This also measures the throughput of collision tests.
+ *
+ * GLOBAL options: geometrysegments (number of segments, default 1000000) and geometryoutput (text table with extension .out,
+ * or binary PLY point cloud with normals and solid IDs with extension .ply)
  *
- * @param outfile File name of output file
+ * @param config TConfig struct containing GLOBAL section
+ * @param outfile File name of output file, without extension
  * @param geom TGeometry structure which shall be sampled
  */
-void PrintGeometry(const boost::filesystem::path &outfile, TGeometry &geom){
-    unsigned count = 1000000;
-
-    ofstream f(outfile.c_str());
-    f << "x y z ID" << '\n'; // print file header
+void PrintGeometry(TConfig &config, const boost::filesystem::path &outfile, const TGeometry &geom){
+	unsigned long count = 1000000;
+	istringstream(config["GLOBAL"]["geometrysegments"]) >> count;
+	string format = "text";
+	istringstream(config["GLOBAL"]["geometryoutput"]) >> format;
+	if (format != "text" && format != "PLY")
+		throw runtime_error("Unknown geometryoutput " + format + ". Use text or PLY");
+	uint64_t geometryseed = seed;
+	if (geometryseed == 0)
+		geometryseed = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+	CGAL::Bbox_3 bbox = geom.GetBoundingBox();
 
+	struct TGeometryPoint{
+		float p[3]; ///< Intersection point
+		float n[3]; ///< Normal of surface
+		unsigned ID; ///< ID of solid
+	};
+	const unsigned long blocksize = 4096;
+	vector<vector<TGeometryPoint> > points((count + blocksize - 1)/blocksize); // points found by each block of segments
 	chrono::time_point<chrono::steady_clock> collstart = chrono::steady_clock::now();
-	std::mt19937_64 r(std::chrono::duration_cast<std::chrono::nanoseconds>(collstart.time_since_epoch()).count());
-	for (unsigned i = 0; i < count; i++){
-        std::array<double, 3> p, n;
-        unsigned ID;
-        geom.mesh.RandomPointOnSurface(p, n, ID, r, geom.mesh.GetBoundingBox());
-		f << p[0] << " " << p[1] << " " << p[2] << " " << ID << '\n'; // print all intersection points into file
-    }
+	ParallelFor(points.size(), nthreads, [&](const unsigned long begin, const unsigned long end){
+		vector<TCollision> colls;
+		for (unsigned long block = begin; block < end; ++block){
+			TMCGenerator mc(geometryseed, jobnumber);
+			mc.SetSubstream(block, 0);
+			uniform_real_distribution<double> unidist(0, 1);
+			for (unsigned long i = block*blocksize; i < min(count, (block + 1)*blocksize); ++i){
+				double p1[3], p2[3];
+				for (int j = 0; j < 3; ++j)
+					p1[j] = bbox.min(j) + unidist(mc)*(bbox.max(j) - bbox.min(j));
+				for (int j = 0; j < 3; ++j)
+					p2[j] = bbox.min(j) + unidist(mc)*(bbox.max(j) - bbox.min(j));
+				if (not geom.GetCollisions(0, p1, 0, p2, colls))
+					continue;
+				for (const TCollision &c: colls){
+					TGeometryPoint point;
+					for (int j = 0; j < 3; ++j){
+						point.p[j] = static_cast<float>(p1[j] + c.s*(p2[j] - p1[j]));
+						point.n[j] = static_cast<float>(c.normal[j]);
+					}
+					point.ID = c.ID;
+					points[block].push_back(point);
+				}
+			}
+		}
+	});
 	chrono::time_point<chrono::steady_clock> collend = chrono::steady_clock::now();
-	float colltimer = chrono::duration_cast<chrono::nanoseconds>(collend - collstart).count();
-    // print some time statistics
-    printf("Wrote %u points in %fms (%fms per point) into %s\n",count,colltimer/1e6,colltimer/count/1e6, outfile.c_str());
-    f.close();	
+	double colltimer = chrono::duration<double>(collend - collstart).count();
+
+	unsigned long npoints = 0;
+	for (auto &block: points)
+		npoints += block.size();
+	boost::filesystem::path filename = outfile;
+	filename += format == "PLY" ? ".ply" : ".out";
+	ofstream f(filename.c_str(), format == "PLY" ? ios::binary : ios::out);
+	if (format == "PLY"){
+		// properties are written in the byte order of the machine, which is little endian on all platforms PENTrack is built on
+		f << "ply\nformat binary_little_endian 1.0\ncomment PENTrack geometry sampling, seed " << geometryseed << "\nelement vertex " << npoints << '\n'
+		  << "property float x\nproperty float y\nproperty float z\nproperty float nx\nproperty float ny\nproperty float nz\nproperty uint solid\nend_header\n";
+		for (auto &block: points){
+			for (const TGeometryPoint &point: block){
+				f.write(reinterpret_cast<const char*>(point.p), sizeof(point.p));
+				f.write(reinterpret_cast<const char*>(point.n), sizeof(point.n));
+				f.write(reinterpret_cast<const char*>(&point.ID), sizeof(point.ID));
+			}
+		}
+	}
+	else{
+		f << "x y z ID" << '\n'; // print file header
+		for (auto &block: points){
+			for (const TGeometryPoint &point: block)
+				f << point.p[0] << " " << point.p[1] << " " << point.p[2] << " " << point.ID << '\n'; // print all intersection points into file
+		}
+	}
+	if (not f)
+		throw runtime_error("Could not write " + filename.string());
+	// print some time statistics
+	printf("Tested %lu segments with %d threads in %fs (%fus per segment), wrote %lu points into %s (seed %llu)\n",
+			count, nthreads, colltimer, colltimer/max(count, 1ul)*1e6, npoints, filename.c_str(), static_cast<unsigned long long>(geometryseed));
 }
@@ -0,0 +1,275 @@
+#include "manifest.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <iterator>
+#include <memory>
+#include <regex>
+#include <sstream>
+#include <stdexcept>
+#include <tuple>
+
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/format.hpp>
+#include <boost/iostreams/filter/bzip2.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+
+#include "globals.h"
+#include "logger.h"
+
+#ifdef USEHDF5
+#include "hdf5.h"
+#endif
+
+using namespace std;
+
+static const char MANIFEST_HEADER[] = "PENTrack manifest 1"; ///< First line of manifest files
+
+
+void WriteLogManifest(const boost::filesystem::path &file, std::vector<TLogManifestEntry> entries, const std::uint64_t seed, const int jobnumber, const bool append){
+	if (append && boost::filesystem::exists(file)){ // text logs were continued, their rows add up
+		uint64_t oldseed;
+		int oldjob;
+		for (const TLogManifestEntry &old: ReadLogManifest(file, oldseed, oldjob)){
+			auto entry = find_if(entries.begin(), entries.end(), [&](const TLogManifestEntry &e){ return e.file == old.file && e.dataset == old.dataset; });
+			if (entry == entries.end())
+				entries.push_back(old);
+			else
+				entry->rows += old.rows;
+		}
+	}
+	sort(entries.begin(), entries.end(), [](const TLogManifestEntry &a, const TLogManifestEntry &b){
+		return make_tuple(a.particlename, a.logtype, a.shard, a.file) < make_tuple(b.particlename, b.logtype, b.shard, b.file);
+	});
+
+	ofstream out(file.string());
+	out << MANIFEST_HEADER << "\njob " << jobnumber << "\nseed " << seed << '\n';
+	for (const TLogManifestEntry &e: entries){
+		out << "table " << e.file << ' ' << (e.dataset.empty() ? "-" : e.dataset) << ' ' << e.particlename << ' ' << e.logtype << ' '
+				<< e.shard << ' ' << e.rows << ' ' << e.columns.size();
+		for (const string &column: e.columns)
+			out << ' ' << column;
+		out << '\n';
+	}
+	if (!out)
+		throw runtime_error("Could not write manifest " + file.string());
+}
+
+
+std::vector<TLogManifestEntry> ReadLogManifest(const boost::filesystem::path &file, std::uint64_t &seed, int &jobnumber){
+	ifstream in(file.string());
+	string line;
+	if (!getline(in, line) || line != MANIFEST_HEADER)
+		throw runtime_error(file.string() + " is not a PENTrack manifest!");
+	vector<TLogManifestEntry> entries;
+	while (getline(in, line)){
+		istringstream ss(line);
+		string key;
+		ss >> key;
+		if (key == "job")
+			ss >> jobnumber;
+		else if (key == "seed")
+			ss >> seed;
+		else if (key == "table"){
+			TLogManifestEntry e;
+			size_t ncolumns = 0;
+			ss >> e.file >> e.dataset >> e.particlename >> e.logtype >> e.shard >> e.rows >> ncolumns;
+			if (e.dataset == "-")
+				e.dataset.clear();
+			e.columns.resize(ncolumns);
+			for (string &column: e.columns)
+				ss >> column;
+			entries.push_back(e);
+		}
+		if (!ss)
+			throw runtime_error("Could not read line '" + line + "' of manifest " + file.string());
+	}
+	return entries;
+}
+
+
+/**
+ * Table of a job to be merged
+ */
+struct TMergeShard{
+	TLogManifestEntry entry; ///< Table as listed in manifest
+	int jobnumber; ///< Job number
+	uint64_t seed; ///< Random seed of job
+	boost::filesystem::path path; ///< Path of file containing the table
+};
+
+
+/**
+ * Read all rows of a table
+ *
+ * @param shard Table
+ *
+ * @return Returns values row by row
+ */
+static vector<double> ReadShard(const TMergeShard &shard){
+	vector<double> values;
+	const size_t ncolumns = shard.entry.columns.size();
+	if (shard.entry.dataset.empty()){ // text file, possibly compressed
+		ifstream file(shard.path.string(), ios::binary);
+		if (!file)
+			throw runtime_error("Could not open " + shard.path.string());
+		boost::iostreams::filtering_istream in;
+		if (boost::algorithm::ends_with(shard.path.string(), ".gz"))
+			in.push(boost::iostreams::gzip_decompressor());
+		else if (boost::algorithm::ends_with(shard.path.string(), ".bz2"))
+			in.push(boost::iostreams::bzip2_decompressor());
+		in.push(file);
+		string line;
+		bool header = true;
+		values.reserve(shard.entry.rows*ncolumns);
+		while (getline(in, line)){
+			if (header){ // appended logs only have a header at the beginning of the file
+				istringstream titles(line);
+				vector<string> columns{istream_iterator<string>(titles), istream_iterator<string>()};
+				if (columns != shard.entry.columns)
+					throw runtime_error("Columns of " + shard.path.string() + " do not match its manifest!");
+				header = false;
+				continue;
+			}
+			const char *p = line.c_str();
+			char *end;
+			for (size_t i = 0; i < ncolumns; ++i){
+				values.push_back(strtod(p, &end)); // also reads nan and inf
+				if (end == p)
+					throw runtime_error("Could not read row " + to_string(values.size()/ncolumns) + " of " + shard.path.string());
+				p = end;
+			}
+		}
+	}
+	else if (boost::algorithm::ends_with(shard.path.string(), ".h5")){
+		#ifdef USEHDF5
+			hid_t file = H5Fopen(shard.path.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+			if (file < 0)
+				throw runtime_error("Could not open " + shard.path.string());
+			vector<double> column;
+			for (size_t i = 0; i < ncolumns; ++i){
+				string name = shard.entry.dataset + "/" + shard.entry.columns[i];
+				hid_t dataset = H5Dopen2(file, name.c_str(), H5P_DEFAULT);
+				hid_t space = dataset < 0 ? -1 : H5Dget_space(dataset);
+				hsize_t rows = 0;
+				if (space >= 0)
+					H5Sget_simple_extent_dims(space, &rows, nullptr);
+				column.resize(rows);
+				herr_t status = dataset < 0 || rows == 0 ? (dataset < 0 ? -1 : 0) : H5Dread(dataset, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, column.data());
+				if (space >= 0)
+					H5Sclose(space);
+				if (dataset >= 0)
+					H5Dclose(dataset);
+				if (status < 0){
+					H5Fclose(file);
+					throw runtime_error("Could not read dataset " + name + " from " + shard.path.string());
+				}
+				if (i == 0)
+					values.resize(rows*ncolumns);
+				if (values.size() != rows*ncolumns){
+					H5Fclose(file);
+					throw runtime_error("Datasets of " + shard.entry.dataset + " in " + shard.path.string() + " have different lengths!");
+				}
+				for (hsize_t j = 0; j < rows; ++j)
+					values[j*ncolumns + i] = column[j];
+			}
+			H5Fclose(file);
+		#else
+			throw runtime_error("Cannot merge " + shard.path.string() + ", PENTrack was compiled without HDF5 support!");
+		#endif
+	}
+	else
+		throw runtime_error("Cannot merge " + shard.path.string() + ", merge ROOT files with hadd!");
+	return values;
+}
+
+
+void MergeLogs(TConfig &config, const unsigned nthreads){
+	string logprefix;
+	istringstream(config["GLOBAL"]["logprefix"]) >> logprefix;
+	vector<pair<int, int> > jobs = ReadNumberRanges(config["GLOBAL"]["mergejobs"]);
+
+	// manifests are named <logprefix><jobnumber>manifest[<rank>].out
+	regex manifestname("(\\d{12})manifest\\d*\\.out");
+	vector<boost::filesystem::path> manifests;
+	for (boost::filesystem::directory_iterator it(outpath); it != boost::filesystem::directory_iterator(); ++it){
+		string name = it->path().filename().string();
+		smatch match;
+		if (not boost::algorithm::starts_with(name, logprefix))
+			continue;
+		string rest = name.substr(logprefix.size());
+		if (regex_match(rest, match, manifestname) && (jobs.empty() || InNumberRanges(jobs, stoi(match[1].str()))))
+			manifests.push_back(it->path());
+	}
+	if (manifests.empty())
+		throw runtime_error("No manifests found in " + outpath.string() + "!");
+	sort(manifests.begin(), manifests.end());
+
+	map<pair<string, string>, vector<TMergeShard> > tables; // shards of each particle and log type, in order of job, process, and shard
+	for (auto &manifest: manifests){
+		TMergeShard shard;
+		vector<TLogManifestEntry> entries = ReadLogManifest(manifest, shard.seed, shard.jobnumber);
+		for (auto &entry: entries){
+			shard.entry = entry;
+			shard.path = outpath / entry.file;
+			tables[make_pair(entry.particlename, entry.logtype)].push_back(shard);
+		}
+	}
+	cout << "Merging " << tables.size() << " tables from " << manifests.size() << " manifests...\n";
+
+	map<string, map<string, string> > sections;
+	for (auto &section: config){
+		if (section.first != "HISTOGRAMS" && section.first != "EFFICIENCYMAPS") // only rows are merged
+			sections.insert(section);
+	}
+	TConfig mergeconfig(sections);
+	mergeconfig["GLOBAL"]["logprefix"] = logprefix + "merged";
+	mergeconfig["GLOBAL"]["appendlog"] = "0";
+	mergeconfig["GLOBAL"]["asynclog"] = "0";
+	unique_ptr<TLogger> logger = CreateLogger(mergeconfig);
+	const size_t nread = max(nthreads, 1u);
+	ofstream index((outpath / (boost::format("%smerged%012dindex.out") % logprefix % jobnumber).str()).string());
+	index << "particle logtype job seed shard firstrow rows file dataset\n";
+
+	for (auto &table: tables){
+		const string &particlename = table.first.first, &logtype = table.first.second;
+		vector<TMergeShard> &shards = table.second;
+		const vector<string> &columns = shards.front().entry.columns;
+		unsigned long long firstrow = 0;
+		for (size_t begin = 0; begin < shards.size(); begin += nread){ // read a group of shards in parallel, write them in order
+			size_t end = min(shards.size(), begin + nread);
+			vector<vector<double> > values(end - begin);
+			ParallelFor(end - begin, nthreads, [&](const unsigned long first, const unsigned long last){
+				for (unsigned long i = first; i < last; ++i){
+					if (shards[begin + i].entry.columns != columns)
+						throw runtime_error("Columns of " + shards[begin + i].path.string() + " differ from the first shard of " + particlename + logtype + "!");
+					values[i] = ReadShard(shards[begin + i]);
+				}
+			});
+			vector<double> row(columns.size());
+			for (size_t i = begin; i < end; ++i){
+				const TMergeShard &shard = shards[i];
+				unsigned long long rows = values[i - begin].size()/columns.size();
+				if (rows != shard.entry.rows)
+					cout << "Warning: " << shard.path << " contains " << rows << " rows of " << particlename << logtype << ", its manifest lists " << shard.entry.rows << "\n";
+				for (unsigned long long r = 0; r < rows; ++r){
+					copy(values[i - begin].begin() + r*columns.size(), values[i - begin].begin() + (r + 1)*columns.size(), row.begin());
+					logger->WriteRow(particlename, logtype, columns, row);
+				}
+				index << particlename << ' ' << logtype << ' ' << shard.jobnumber << ' ' << shard.seed << ' ' << shard.entry.shard << ' ' << firstrow << ' ' << rows << ' '
+						<< shard.entry.file << ' ' << (shard.entry.dataset.empty() ? "-" : shard.entry.dataset) << '\n';
+				firstrow += rows;
+			}
+		}
+		cout << particlename << logtype << ": " << firstrow << " rows from " << shards.size() << " shards\n";
+	}
+	logger.reset(); // close merged files
+	if (!index)
+		throw runtime_error("Could not write merge index");
+	WriteLogManifest(outpath / (boost::format("%smerged%012dmanifest.out") % logprefix % jobnumber).str(), TLogger::TakeManifest(), 0, jobnumber, false);
+}
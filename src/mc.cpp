@@ -1,13 +1,58 @@
 #include "mc.h"
 
 #include <chrono>
+#include <cmath>
 #include <iostream>
+#include <stdexcept>
+#include <string>
 #include "exprtk.hpp"
 
 #include "globals.h"
 
 const int PIECEWISE_LINEAR_DIST_INTERVALS = 1000;
 
+
+TScrambledHalton::TScrambledHalton(const unsigned dimensions, TPhiloxGenerator mc){
+	if (dimensions > MAX_DIMENSIONS)
+		throw std::runtime_error("Halton sequence has at most " + std::to_string(MAX_DIMENSIONS) + " dimensions!");
+	for (unsigned p = 2; bases.size() < dimensions; ++p){
+		bool prime = true;
+		for (unsigned b: bases)
+			prime = prime && p % b != 0;
+		if (prime)
+			bases.push_back(p);
+	}
+	permutations.resize(dimensions);
+	for (unsigned d = 0; d < dimensions; ++d){
+		const unsigned b = bases[d];
+		unsigned ndigits = std::ceil(std::numeric_limits<double>::digits*std::log(2)/std::log(b)); // digits resolved by a double
+		double unit = 1;
+		mc.SetSubstream(std::numeric_limits<std::uint64_t>::max() - d, 0); // particle numbers never reach these substreams
+		for (unsigned j = 0; j < ndigits; ++j){
+			unit /= b; // value of digit j
+			std::vector<unsigned> perm(b);
+			std::iota(perm.begin(), perm.end(), 0);
+			for (unsigned i = b - 1; i > 0; --i) // Fisher-Yates shuffle
+				std::swap(perm[i], perm[std::uniform_int_distribution<unsigned>(0, i)(mc)]);
+			std::vector<double> digits(b);
+			for (unsigned i = 0; i < b; ++i)
+				digits[i] = perm[i]*unit;
+			permutations[d].push_back(digits);
+		}
+	}
+}
+
+
+std::uint64_t TScrambledHalton::Coordinate(std::uint64_t n, const unsigned d) const{
+	const unsigned b = bases[d];
+	double x = 0;
+	for (auto &digits: permutations[d]){ // leading zeros of n are permuted, too
+		x += digits[n % b];
+		n /= b;
+	}
+	return static_cast<std::uint64_t>(std::ldexp(std::min(x, std::nextafter(1., 0.)), 64)); // rounding must not reach 1
+}
+
 //double TMCGenerator::NeutronSpectrum() const{
 //		return SqrtDist(0, 300e-9);
 
@@ -10,19 +10,19 @@
 const char* NAME_MERCURY = "mercury";
 
 TMercury::TMercury(const int number, const double t, const double x, const double y, const double z, const double E, const double phi, const double theta, const double polarisation,
-		TMCGenerator &amc, const TGeometry &geometry, const TFieldManager &afield)
-			: TParticle(NAME_MERCURY, 0, m_hg, mu_hgSI, gamma_hg, number, t, x, y, z, E, phi, theta, polarisation, amc, geometry, afield){
+		TMCGenerator &amc, const TGeometry &geometry, const TFieldManager &afield, const solid *startsolid)
+			: TParticle(NAME_MERCURY, 0, m_hg, mu_hgSI, gamma_hg, number, t, x, y, z, E, phi, theta, polarisation, amc, geometry, afield, startsolid){
 
 }
 
 
-void TMercury::OnHit(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const double normal[3],
+TEventResult TMercury::OnHit(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const double normal[3],
 		const solid &leaving, const solid &entering, TMCGenerator &mc, stopID &ID, std::vector<TParticle*> &secondaries) const{
 	double vnormal = y1[3]*normal[0] + y1[4]*normal[1] + y1[5]*normal[2]; // velocity normal to reflection plane
 	//particle was neither transmitted nor absorbed, so it has to be reflected
 	std::uniform_real_distribution<double> unidist(0, 1);
 	double prob = unidist(mc);
-	material mat = vnormal < 0 ? entering.mat : leaving.mat;
+	const material &mat = vnormal < 0 ? entering.mat : leaving.mat;
 	double diffprob = mat.DiffProb;
 //	cout << "prob: " << diffprob << '\n';
 	
@@ -58,13 +58,14 @@ void TMercury::OnHit(const value_type x1, const state_type &y1, value_type &x2,
 	if (unidist(mc) < entering.mat.SpinflipProb){
 		y2[7] *= -1;
 	}
+	return EVENT_REFLECTED;
 }
 
 
 //do nothing for each for step
-void TMercury::OnStep(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const dense_stepper_type &stepper,
+TEventResult TMercury::OnStep(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const TStepper &stepper,
 		const solid &currentsolid, TMCGenerator &mc, stopID &ID, std::vector<TParticle*> &secondaries) const{
-
+	return EVENT_UNCHANGED;
 }
 
 //Mercury does not decay
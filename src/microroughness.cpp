@@ -1,9 +1,14 @@
 #include "microroughness.h"
 
-#include <complex>
+#include <map>
+#include <tuple>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
 
 #include "optimization.h"
-#include "specialfunctions.h"
 #include <boost/numeric/odeint.hpp>
 
 #include "globals.h"
@@ -28,55 +33,147 @@ bool MRValid(const double v[3], const double normal[3], const double Estep, cons
 		if (2*RMSroughness*ki < 2 && 2*RMSroughness*kt < 2)
 			return true;
 	}
-	std::cout << "MR model not applicable. Falling back to specular reflection!\n";
 	return false;
 }
 
-double MRDist(const bool transmit, const bool integral, const double v[3], const double normal[3], const double Estep, const double RMSroughness, const double correlationLength, const double theta, const double phi){
-	if (theta < 0 || theta > pi/2)
-		return 0;
-	double v2 = v[0]*v[0] + v[1]*v[1] + v[2]*v[2]; // velocity squared
-	double vnormal = v[0]*normal[0] + v[1]*normal[1] + v[2]*normal[2]; // velocity projected onto surface normal
-	double E = 0.5*m_n*v2; // kinetic energy
-	if (transmit && E <= Estep) // if particle is transmitted: check if energy is higher than potential wall
+/**
+ * Calculate squared amplitude 2*costheta/(costheta + sqrt(costheta^2 - kappa)) of a wave passing a potential step, see equations (20) and (21) in Steyerl's publication
+ *
+ * Below the critical angle (costheta^2 < kappa) the square root is imaginary and the squared amplitude simplifies to 4*costheta^2/kappa,
+ * so no complex arithmetic is needed.
+ *
+ * @param costheta Cosine of angle between wave vector and surface normal
+ * @param kappa Squared critical wave number divided by squared wave number, negative for transmission into a lower potential
+ *
+ * @return Returns squared amplitude
+ */
+static double MRAmplitude(const double costheta, const double kappa){
+	if (costheta <= 0)
 		return 0;
+	double d = costheta*costheta - kappa;
+	if (d < 0)
+		return 4*costheta*costheta/kappa;
+	double S = 2*costheta/(costheta + sqrt(d));
+	return S*S;
+}
 
-	double ki = sqrt(2*m_n*E)*ele_e/hbar; // wave number in first solid
-	std::complex<double> kc = std::sqrt(2*(double)m_n*std::complex<double>(Estep, 0.))*(double)ele_e/(double)hbar; // critical wave number of potential wall
-	double kt = 0;
+/**
+ * Exponentially scaled modified Bessel function of first kind exp(-x)*I0(x), for x >= 0
+ *
+ * Evaluates the Chebyshev expansions of the Cephes library, which alglib::besseli0 uses as well, without the overhead of alglib's error handling and without the exponential,
+ * which would overflow for large x.
+ *
+ * @param x Argument
+ *
+ * @return Returns exp(-x)*I0(x)
+ */
+static double BesselI0e(const double x){
+	static const double A[] = { // Chebyshev coefficients of exp(-x)*I0(x) in [0, 8]
+	-4.41534164647933937950E-18, 3.33079451882223809783E-17, -2.43127984654795469359E-16,
+	1.71539128555513303061E-15, -1.16853328779934516808E-14, 7.67618549860493561688E-14,
+	-4.85644678311192946090E-13, 2.95505266312963983461E-12, -1.72682629144155570723E-11,
+	9.67580903537323691224E-11, -5.18979560163526290666E-10, 2.65982372468238665035E-9,
+	-1.30002500998624804212E-8, 6.04699502254191894932E-8, -2.67079385394061173391E-7,
+	1.11738753912010371815E-6, -4.41673835845875056359E-6, 1.64484480707288970893E-5,
+	-5.75419501008210370398E-5, 1.88502885095841655729E-4, -5.76375574538582365885E-4,
+	1.63947561694133579842E-3, -4.32430999505057594430E-3, 1.05464603945949983183E-2,
+	-2.37374148058994688156E-2, 4.93052842396707084878E-2, -9.49010970480476444210E-2,
+	1.71620901522208775349E-1, -3.04682672343198398683E-1, 6.76795274409476084995E-1
+	};
+	static const double B[] = { // Chebyshev coefficients of sqrt(x)*exp(-x)*I0(x) in (8, infinity)
+	-7.23318048787475395456E-18, -4.83050448594418207126E-18, 4.46562142029675999901E-17,
+	3.46122286769746109310E-17, -2.82762398051658348494E-16, -3.42548561967721913462E-16,
+	1.77256013305652638360E-15, 3.81168066935262242075E-15, -9.55484669882830764870E-15,
+	-4.15056934728722208663E-14, 1.54008621752140982691E-14, 3.85277838274214270114E-13,
+	7.18012445138366623367E-13, -1.79417853150680611778E-12, -1.32158118404477131188E-11,
+	-3.14991652796324136454E-11, 1.18891471078464383424E-11, 4.94060238822496958910E-10,
+	3.39623202570838634515E-9, 2.26666899049817806459E-8, 2.04891858946906374183E-7, 2.89137052083475648297E-6,
+	6.88975834691682398426E-5, 3.36911647825569408990E-3, 8.04490411014108831608E-1
+	};
+	auto chebyshev = [](const double y, const double *c, const int n){
+		double b0 = c[0], b1 = 0, b2 = 0;
+		for (int i = 1; i < n; ++i){
+			b2 = b1;
+			b1 = b0;
+			b0 = y*b1 - b2 + c[i];
+		}
+		return 0.5*(b0 - b2);
+	};
+	if (x <= 8)
+		return chebyshev(x/2 - 2, A, sizeof(A)/sizeof(A[0]));
+	return chebyshev(32/x - 2, B, sizeof(B)/sizeof(B[0]))/sqrt(x);
+}
 
-	double costheta_i = abs(vnormal/sqrt(v2)); // cosine of angle between normal and incoming velocity vector
-	std::complex<double> Si = 2*costheta_i/(costheta_i + sqrt(costheta_i*costheta_i - kc*kc/ki/ki)); // specularly transmitted amplitude
-	std::complex<double> So;
-	if (transmit){
-		kt = sqrt(2*m_n*(E - Estep))*ele_e/hbar; // wave number in second solid
-		if (-real(kc*kc)/kt/kt > cos(theta)*cos(theta)) // this can happen if Estep < 0
+/**
+ * MicroRoughness distribution for a fixed incident velocity, see MRDist
+ *
+ * All factors depending only on the incident velocity are calculated once in the constructor, so the distribution can be evaluated cheaply for many scattering angles.
+ */
+struct TMRDistKernel{
+	const bool transmit; ///< True if the particle is transmitted through the surface, false if it is reflected
+	const bool integral; ///< Compute phi-integral of diffuse scattering probability distribution
+	bool vanishes; ///< True if the distribution vanishes for all angles
+	double ks; ///< Wave number of scattered wave
+	double kappa; ///< Squared critical wave number divided by ks^2, negative for transmission, see MRAmplitude
+	double wpi; ///< Parallel momentum of incident wave times correlation length
+	double wks; ///< Wave number of scattered wave times correlation length
+	double factor; ///< Factors of distribution independent of scattering angles
+
+	/**
+	 * Constructor, parameters are the same as in MRDist
+	 */
+	TMRDistKernel(const bool atransmit, const bool aintegral, const double v[3], const double normal[3], const double Estep, const double RMSroughness, const double correlationLength)
+			: transmit(atransmit), integral(aintegral){
+		double v2 = v[0]*v[0] + v[1]*v[1] + v[2]*v[2]; // velocity squared
+		double vnormal = v[0]*normal[0] + v[1]*normal[1] + v[2]*normal[2]; // velocity projected onto surface normal
+		double E = 0.5*m_n*v2; // kinetic energy
+		vanishes = transmit && E <= Estep; // if particle is transmitted: check if energy is higher than potential wall
+		double ki = sqrt(2*m_n*E)*ele_e/hbar; // wave number in first solid
+		ks = transmit && !vanishes ? sqrt(2*m_n*(E - Estep))*ele_e/hbar : ki; // wave number in second solid or of reflected wave
+		double kc2 = 2*m_n*Estep*ele_e*ele_e/hbar/hbar; // squared critical wave number of potential wall, negative if Estep < 0
+		kappa = (transmit ? -kc2 : kc2)/ks/ks;
+		double costheta_i = abs(vnormal/sqrt(v2)); // cosine of angle between normal and incoming velocity vector
+		double b = RMSroughness, w = correlationLength;
+		wpi = w*ki*sqrt(1 - costheta_i*costheta_i);
+		wks = w*ks;
+		factor = kc2*kc2*b*b*w*w/8/pi/costheta_i*MRAmplitude(costheta_i, kc2/ki/ki); // includes specularly transmitted amplitude
+		if (transmit)
+			factor *= ks/ki;
+	}
+
+	/**
+	 * Evaluate distribution
+	 *
+	 * @param theta Polar angle of scattered velocity vector (0 < theta < pi/2)
+	 * @param phi Azimuthal angle of scattered velocity vector (0 < phi < 2*pi), ignored if integral == true
+	 *
+	 * @return Returns probability of reflection/transmission, see MRDist
+	 */
+	double operator()(const double theta, const double phi) const{
+		if (vanishes || theta < 0 || theta > pi/2)
 			return 0;
-		So = 2*cos(theta)/(cos(theta) + sqrt(cos(theta)*cos(theta) + kc*kc/kt/kt)); // diffusely transmitted amplitude
+		double costheta = cos(theta), sintheta = sin(theta);
+		if (transmit && kappa > costheta*costheta) // this can happen if Estep < 0
+			return 0;
+		double ps = wks*sintheta; // parallel momentum of scattered wave times correlation length
+		double Fmu; // fourier transform of roughness correlation function
+		if (integral) // precalculate phi-integral using modified Bessel function of first kind, exp(-(wpi^2 + ps^2)/2)*I0(wpi*ps) = exp(-(wpi - ps)^2/2)*I0e(wpi*ps)
+			Fmu = exp(-(wpi - ps)*(wpi - ps)/2)*2*pi*BesselI0e(wpi*ps)*sintheta; // integral over sin(theta) dtheta dphi
+		else
+			Fmu = exp(-(wpi*wpi + ps*ps - 2*wpi*ps*cos(phi))/2);
+		return factor*MRAmplitude(costheta, kappa)*Fmu;
 	}
-	else
-		So = 2*cos(theta)/(cos(theta) + sqrt(cos(theta)*cos(theta) - kc*kc/ki/ki)); // diffusely reflected amplitude
-
-	double b = RMSroughness, w = correlationLength;
-
-	double theta_i = acos(costheta_i);
-	double Fmu = 0; // fourier transform of roughness correlation function
-	if (!integral && !transmit)
-		Fmu = exp(-w*w/2*ki*ki*(sin(theta_i)*sin(theta_i) +       sin(theta)*sin(theta) -                                 2*sin(theta_i)*sin(theta)*cos(phi)));
-	else if (!integral && transmit)
-		Fmu = exp(-w*w/2*(ki*ki*sin(theta_i)*sin(theta_i) + kt*kt*sin(theta)*sin(theta) -                           2*ki*kt*sin(theta_i)*sin(theta)*cos(phi)));
-	else if (integral && !transmit) // if integral is set, precalculate phi-integral using modified Bessel function of first kind
-		Fmu = exp(-w*w/2*ki*ki*(sin(theta_i)*sin(theta_i) +       sin(theta)*sin(theta))) * 2*pi*alglib::besseli0(w*w*ki*ki*sin(theta_i)*sin(theta));
-	else if (integral && transmit)
-		Fmu = exp(-w*w/2*(ki*ki*sin(theta_i)*sin(theta_i) + kt*kt*sin(theta)*sin(theta))) * 2*pi*alglib::besseli0(w*w*ki*kt*sin(theta_i)*sin(theta));
-	double factor = real(kc*kc*kc*kc)*b*b*w*w/8/pi/costheta_i;
-	if (transmit)
-		factor *= kt/ki;
-	if (integral)
-		factor *= sin(theta); // integral over sin(theta) dtheta dphi
-	double result = factor*norm(Si)*norm(So)*Fmu;
-	//	cout << integral << transmit << ' ' << theta_i << ' ' << theta << ' ' << phi << ' ' << ki << ' ' << kt << ' ' << kc << ' ' << factor << ' ' << Si << ' ' << So << ' ' << Fmu << ' ' << result << '\n';
-	return result; // return probability
+};
+
+double MRDist(const bool transmit, const bool integral, const double v[3], const double normal[3], const double Estep, const double RMSroughness, const double correlationLength, const double theta, const double phi){
+	return TMRDistKernel(transmit, integral, v, normal, Estep, RMSroughness, correlationLength)(theta, phi);
+}
+
+void MRDist(const bool transmit, const bool integral, const double v[3], const double normal[3], const double Estep, const double RMSroughness, const double correlationLength,
+		const std::size_t n, const double theta[], const double phi[], double result[]){
+	TMRDistKernel dist(transmit, integral, v, normal, Estep, RMSroughness, correlationLength);
+	for (std::size_t i = 0; i < n; ++i)
+		result[i] = dist(theta[i], integral ? 0 : phi[i]);
 }
 
 /**
@@ -94,13 +191,32 @@ struct TMRParams{
 
 double MRProb(const bool transmit, const double v[3], const double normal[3], const double Estep, const double RMSroughness, const double correlationLength){
 	vector<double> total(1, 0);
-	auto integrand = [transmit, v, normal, Estep, RMSroughness, correlationLength](const vector<double> &dummy, std::vector<double> &result, const double theta){ // use lambda expression to define local function that has the proper parameters for odeint
-		result[0] = MRDist(transmit, true, v, normal, Estep, RMSroughness, correlationLength, theta, 0);
+	TMRDistKernel dist(transmit, true, v, normal, Estep, RMSroughness, correlationLength);
+	auto integrand = [&dist](const vector<double> &dummy, std::vector<double> &result, const double theta){ // use lambda expression to define local function that has the proper parameters for odeint
+		result[0] = dist(theta, 0);
 	};
 	boost::numeric::odeint::integrate(integrand, total, 0.0, (double)pi/2, 0.01); // integrate "differential equation" dP/dtheta = MRdist(theta) from 0 to pi/2
 	return total[0];
 }
 
+double MRProb(const bool transmit, const double v[3], const double normal[3], const double Estep, const double RMSroughness, const double correlationLength, const double tolerance){
+	vector<double> total(1, 0);
+	TMRDistKernel dist(transmit, true, v, normal, Estep, RMSroughness, correlationLength);
+	auto integrand = [&dist](const vector<double> &dummy, std::vector<double> &result, const double theta){
+		result[0] = dist(theta, 0);
+	};
+	// diffusely scattered amplitude has a cusp at the critical angle, the integration is split there so the step-size control does not miss it
+	double v2 = v[0]*v[0] + v[1]*v[1] + v[2]*v[2]; // velocity squared
+	double E = 0.5*m_n*v2; // kinetic energy
+	double cos2theta_c = transmit ? -Estep/(E - Estep) : Estep/E; // squared cosine of critical angle, see MRDist
+	double theta_c = cos2theta_c > 0 && cos2theta_c < 1 ? acos(sqrt(cos2theta_c)) : pi/2;
+	auto stepper = boost::numeric::odeint::make_controlled(tolerance, tolerance, boost::numeric::odeint::runge_kutta_dopri5<vector<double> >());
+	boost::numeric::odeint::integrate_adaptive(stepper, integrand, total, 0.0, theta_c, 0.01);
+	if (theta_c < pi/2)
+		boost::numeric::odeint::integrate_adaptive(stepper, integrand, total, theta_c, (double)pi/2, 0.01);
+	return total[0];
+}
+
 /**
  * Wrapper function of MRDist, is passed to numerical-optimization routine from alglib library
  * 
@@ -131,4 +247,323 @@ double MRDistMax(const bool transmit, const double v[3], const double normal[3],
 	return MRDist(transmit, false, v, normal, Estep, RMSroughness, correlationLength, theta[0], 0);
 }
 
+static const int MR_PROB_TABLE_MAX_CELLS = 128; ///< Maximum number of cells in each dimension of MRProb tables, below and above the critical wave number
+static const double MR_PROB_TABLE_INTEGRATION_TOLERANCE = 1e-3; ///< Tolerance of integration of MRProb table nodes, relative to MRProbTolerance
+static double MRProbTolerance = 0; ///< Accuracy target of MRProb tables, set by EnableMRProbTables
+
+/**
+ * Calculate wave-number axis of MRProb tables, reaching up to the limit 1/RMSroughness where the MicroRoughness model becomes invalid
+ *
+ * Transmission sets in at the critical wave number of the potential step with square-root behavior,
+ * so the axis contains the critical wave number as node and its cells shrink quadratically towards it.
+ *
+ * @param Estep potential step at the material boundary
+ * @param RMSroughness root-mean-square roughness of the surface at the material boundary
+ * @param cells Number of cells below and above the critical wave number
+ *
+ * @return Returns list of nodes
+ */
+static vector<double> MRTableAxis(const double Estep, const double RMSroughness, const int cells){
+	vector<double> axis;
+	double kmax = 1./RMSroughness; // MRValid limit
+	double kc = Estep > 0 ? sqrt(2*m_n*Estep)*ele_e/hbar : 0; // critical wave number
+	if (kc > 0 && kc < kmax){
+		for (int i = 0; i < cells; ++i)
+			axis.push_back(kc*(1 - pow(1 - double(i)/cells, 2)));
+		for (int i = 0; i <= cells; ++i)
+			axis.push_back(kc + (kmax - kc)*pow(double(i)/cells, 2));
+	}
+	else{
+		for (int i = 0; i <= 2*cells; ++i)
+			axis.push_back(kmax*i/2/cells);
+	}
+	return axis;
+}
+
+/**
+ * Calculate velocity of a particle with given wave number hitting the surface with normal (0, 0, 1)
+ *
+ * @param k Incident wave number
+ * @param knormal Component of incident wave number normal to surface
+ * @param v Returns velocity
+ */
+static void MRTableVelocity(const double k, const double knormal, double v[3]){
+	double vconv = hbar/m_n/ele_e; // convert wave number to velocity
+	v[0] = sqrt(k*k - knormal*knormal)*vconv;
+	v[1] = 0;
+	v[2] = -knormal*vconv;
+}
+
+/**
+ * Calculate squared amplitude of specularly transmitted wave, which MRDist is proportional to
+ *
+ * @param k Incident wave number
+ * @param costheta_i Cosine of angle between incident velocity and surface normal
+ * @param Estep potential step at the material boundary
+ *
+ * @return Returns squared amplitude
+ */
+static double MRSpecularAmplitude(const double k, const double costheta_i, const double Estep){
+	return MRAmplitude(costheta_i, 2*m_n*Estep*ele_e*ele_e/hbar/hbar/k/k);
+}
+
+/**
+ * Table of MRProb for fixed potential step and surface parameters, see MRProbTabulated
+ *
+ * MRProb is proportional to MRSpecularAmplitude/costheta_i, which has a cusp at the critical angle. The table stores MRProb divided by this factor,
+ * which is smooth in costheta_i.
+ */
+struct TMRProbTable{
+	vector<double> k; ///< Nodes along incident wave number
+	vector<double> costheta; ///< Nodes along cosine of angle between incident velocity and surface normal
+	vector<double> values; ///< MRProb*costheta_i/MRSpecularAmplitude at each node, row-major in incident wave number, empty if tolerance was not reached
+};
+
+/**
+ * Calculate MRProb*costheta_i/MRSpecularAmplitude for a particle with given wave number hitting a surface
+ *
+ * @param transmit True, if the particle is transmitted through the material boundary
+ * @param k Incident wave number
+ * @param costheta_i Cosine of angle between incident velocity and surface normal
+ * @param Estep potential step at the material boundary
+ * @param RMSroughness root-mean-square roughness of the surface at the material boundary
+ * @param correlationLength correlation length of the surface at the boundary
+ *
+ * @return Returns table value
+ */
+static double MRProbTableValue(const bool transmit, const double k, double costheta_i, const double Estep, const double RMSroughness, const double correlationLength){
+	if (k <= 0) // probability vanishes for particles at rest
+		return 0;
+	costheta_i = max(costheta_i, 1e-6); // table value is finite at grazing incidence, avoid division by zero
+	double v[3], normal[3] = {0, 0, 1};
+	MRTableVelocity(k, k*costheta_i, v);
+	double prob = MRProb(transmit, v, normal, Estep, RMSroughness, correlationLength, MR_PROB_TABLE_INTEGRATION_TOLERANCE*MRProbTolerance);
+	return prob > 0 ? prob*costheta_i/MRSpecularAmplitude(k, costheta_i, Estep) : 0;
+}
+
+/**
+ * Bilinearly interpolate table
+ *
+ * @param x Table nodes in first dimension
+ * @param y Table nodes in second dimension
+ * @param values Values at table nodes, row-major
+ * @param xi Coordinate in first dimension, has to lie inside table
+ * @param yi Coordinate in second dimension, has to lie inside table
+ *
+ * @return Returns interpolated value
+ */
+static double MRInterpolate(const vector<double> &x, const vector<double> &y, const vector<double> &values, const double xi, const double yi){
+	unsigned n = y.size();
+	unsigned i = min<unsigned>(upper_bound(x.begin(), x.end(), xi) - x.begin(), x.size() - 1) - 1;
+	unsigned j = min<unsigned>(upper_bound(y.begin(), y.end(), yi) - y.begin(), n - 1) - 1;
+	double u = (xi - x[i])/(x[i + 1] - x[i]), w = (yi - y[j])/(y[j + 1] - y[j]);
+	return (1 - u)*((1 - w)*values[i*n + j] + w*values[i*n + j + 1]) + u*((1 - w)*values[(i + 1)*n + j] + w*values[(i + 1)*n + j + 1]);
+}
+
+/**
+ * Calculate table of MRProb, see MRProbTabulated
+ *
+ * Starting from a coarse table, the number of cells is doubled until interpolating the previous table reproduces MRProb at all new nodes within MRProbTolerance.
+ *
+ * @param transmit True, if the particle is transmitted through the material boundary
+ * @param Estep potential step at the material boundary
+ * @param RMSroughness root-mean-square roughness of the surface at the material boundary
+ * @param correlationLength correlation length of the surface at the boundary
+ * @param nthreads Number of threads calculating rows of the table in parallel
+ *
+ * @return Returns table
+ */
+static TMRProbTable BuildMRProbTable(const bool transmit, const double Estep, const double RMSroughness, const double correlationLength, const unsigned nthreads = 1){
+	TMRProbTable coarse, fine;
+	for (int cells = 4; cells <= MR_PROB_TABLE_MAX_CELLS; cells *= 2){
+		fine.k = MRTableAxis(Estep, RMSroughness, cells);
+		fine.costheta.resize(2*cells + 1);
+		for (int j = 0; j <= 2*cells; ++j)
+			fine.costheta[j] = 0.5*j/cells;
+		unsigned n = fine.costheta.size();
+		fine.values.resize(fine.k.size()*n);
+		vector<double> rowerror(fine.k.size(), 0.);
+		ParallelFor(fine.k.size(), nthreads, [&](const unsigned long begin, const unsigned long end){
+			for (unsigned i = begin; i < end; ++i){
+				for (unsigned j = 0; j < n; ++j){
+					if (!coarse.values.empty() && i % 2 == 0 && j % 2 == 0) // nodes of coarse table are also nodes of fine table
+						fine.values[i*n + j] = coarse.values[i/2*coarse.costheta.size() + j/2];
+					else
+						fine.values[i*n + j] = MRProbTableValue(transmit, fine.k[i], fine.costheta[j], Estep, RMSroughness, correlationLength);
+					if (!coarse.values.empty() && fine.costheta[j] > 0){
+						double factor = MRSpecularAmplitude(fine.k[i], fine.costheta[j], Estep)/fine.costheta[j];
+						double error = abs(MRInterpolate(coarse.k, coarse.costheta, coarse.values, fine.k[i], fine.costheta[j]) - fine.values[i*n + j])*factor;
+						if (error > rowerror[i]) // comparison also skips NaN
+							rowerror[i] = error;
+					}
+				}
+			}
+		});
+		double maxerror = *max_element(rowerror.begin(), rowerror.end());
+		if (!coarse.values.empty() && maxerror <= MRProbTolerance)
+			return fine;
+		swap(coarse, fine);
+	}
+	std::cout << "MicroRoughness probability table did not reach accuracy " << MRProbTolerance << ". Calculating probabilities directly!\n";
+	return TMRProbTable();
+}
+
+/**
+ * Table of MRProb loaded from a file written by WriteMRProbTable, shared by all threads
+ */
+struct TMRProbTableFile{
+	bool transmit; ///< True if table contains transmission probabilities
+	double Estep; ///< Potential step at the material boundary
+	double RMSroughness; ///< root-mean-square roughness of the surface
+	double correlationLength; ///< correlation length of the surface
+	TMRProbTable table; ///< Table
+};
+static vector<TMRProbTableFile> MRProbTableFiles; ///< Tables loaded by ReadMRProbTables
+
+/**
+ * Find table loaded by ReadMRProbTables for given parameters
+ *
+ * Potential steps are calculated from differences of Fermi potentials during tracking, so parameters are compared with a relative tolerance.
+ *
+ * @return Returns pointer to table, or nullptr if none was loaded
+ */
+static const TMRProbTable* FindMRProbTableFile(const bool transmit, const double Estep, const double RMSroughness, const double correlationLength){
+	auto equal = [](const double a, const double b){ return abs(a - b) <= 1e-9*max(abs(a), abs(b)); };
+	for (const TMRProbTableFile &f: MRProbTableFiles){
+		if (f.transmit == transmit && equal(f.Estep, Estep) && equal(f.RMSroughness, RMSroughness) && equal(f.correlationLength, correlationLength))
+			return &f.table;
+	}
+	return nullptr;
+}
+
+void WriteMRProbTable(const std::string &filename, const bool transmit, const double Estep, const double RMSroughness, const double correlationLength, const unsigned nthreads){
+	if (MRProbTolerance <= 0)
+		throw std::runtime_error("Set MRprobtolerance to write MicroRoughness probability tables!");
+	TMRProbTable T = BuildMRProbTable(transmit, Estep, RMSroughness, correlationLength, nthreads);
+	if (T.values.empty())
+		throw std::runtime_error("MicroRoughness probability table did not reach accuracy, increase MRprobtolerance!");
+	ofstream f(filename, ios::binary);
+	f.precision(17);
+	f << "MRProbTable " << transmit << ' ' << Estep << ' ' << RMSroughness << ' ' << correlationLength << ' ' << T.k.size() << ' ' << T.costheta.size() << '\n';
+	f.write(reinterpret_cast<const char*>(T.k.data()), T.k.size()*sizeof(double));
+	f.write(reinterpret_cast<const char*>(T.costheta.data()), T.costheta.size()*sizeof(double));
+	f.write(reinterpret_cast<const char*>(T.values.data()), T.values.size()*sizeof(double));
+	if (!f)
+		throw std::runtime_error("Could not write " + filename);
+}
+
+void ReadMRProbTables(const std::vector<std::string> &filenames){
+	MRProbTableFiles.clear();
+	for (const string &filename: filenames){
+		ifstream f(filename, ios::binary);
+		string header, name;
+		getline(f, header);
+		TMRProbTableFile t;
+		size_t nk, ncostheta;
+		if (!(istringstream(header) >> name >> t.transmit >> t.Estep >> t.RMSroughness >> t.correlationLength >> nk >> ncostheta) || name != "MRProbTable")
+			throw std::runtime_error("Could not read MicroRoughness probability table " + filename);
+		t.table.k.resize(nk);
+		t.table.costheta.resize(ncostheta);
+		t.table.values.resize(nk*ncostheta);
+		f.read(reinterpret_cast<char*>(t.table.k.data()), nk*sizeof(double));
+		f.read(reinterpret_cast<char*>(t.table.costheta.data()), ncostheta*sizeof(double));
+		f.read(reinterpret_cast<char*>(t.table.values.data()), nk*ncostheta*sizeof(double));
+		if (!f || nk < 2 || ncostheta < 2)
+			throw std::runtime_error("Could not read MicroRoughness probability table " + filename);
+		MRProbTableFiles.push_back(t);
+	}
+}
+
+void EnableMRProbTables(const double tolerance){
+	MRProbTolerance = tolerance;
+}
+
+double MRProbTabulated(const bool transmit, const double v[3], const double normal[3], const double Estep, const double RMSroughness, const double correlationLength){
+	const TMRProbTable *table = FindMRProbTableFile(transmit, Estep, RMSroughness, correlationLength);
+	if (table == nullptr){
+		if (MRProbTolerance <= 0)
+			return MRProb(transmit, v, normal, Estep, RMSroughness, correlationLength);
+
+		thread_local map<tuple<bool, double, double, double>, TMRProbTable> tables; // each thread builds its own tables
+		auto key = make_tuple(transmit, Estep, RMSroughness, correlationLength);
+		auto built = tables.find(key);
+		if (built == tables.end())
+			built = tables.emplace(key, BuildMRProbTable(transmit, Estep, RMSroughness, correlationLength)).first;
+		table = &built->second;
+	}
+
+	double v2 = v[0]*v[0] + v[1]*v[1] + v[2]*v[2]; // velocity squared
+	double vnormal = v[0]*normal[0] + v[1]*normal[1] + v[2]*normal[2]; // velocity projected onto surface normal
+	double E = 0.5*m_n*v2; // kinetic energy
+	double k = sqrt(2*m_n*E)*ele_e/hbar; // incident wave number
+	double costheta_i = abs(vnormal/sqrt(v2)); // cosine of angle between normal and incoming velocity vector
+	const TMRProbTable &T = *table;
+	if (T.values.empty() || !(k > 0 && k <= T.k.back() && costheta_i > 0 && costheta_i <= 1)) // no table or outside of table
+		return MRProb(transmit, v, normal, Estep, RMSroughness, correlationLength);
+	return MRInterpolate(T.k, T.costheta, T.values, k, costheta_i)*MRSpecularAmplitude(k, costheta_i, Estep)/costheta_i;
+}
+
+/**
+ * Calculate factor of MRDist that depends only on the polar angle of the scattered velocity, normalized to the solid-angle density of MRSampleDirection's proposals
+ *
+ * @param transmit True if the particle is transmitted through the surface, false if it is reflected
+ * @param costheta Cosine of polar angle of scattered velocity vector
+ * @param kappa Squared critical wave number divided by squared wave number of scattered wave, negative for transmission
+ *
+ * @return Returns squared amplitude of diffusely scattered wave divided by costheta
+ */
+static double MRPolarFactor(const bool transmit, const double costheta, const double kappa){
+	if (costheta <= 0 || (transmit && kappa > costheta*costheta)) // MRDist vanishes
+		return 0;
+	return MRAmplitude(costheta, kappa)/costheta;
+}
+
+void MRSampleDirection(const bool transmit, const double v[3], const double normal[3], const double Estep, const double RMSroughness, const double correlationLength,
+		TMCGenerator &mc, double &theta, double &phi){
+	double v2 = v[0]*v[0] + v[1]*v[1] + v[2]*v[2]; // velocity squared
+	double vnormal = v[0]*normal[0] + v[1]*normal[1] + v[2]*normal[2]; // velocity projected onto surface normal
+	double E = 0.5*m_n*v2; // kinetic energy
+	double ki = sqrt(2*m_n*E)*ele_e/hbar; // wave number in first solid
+	double ks = transmit ? sqrt(2*m_n*(E - Estep))*ele_e/hbar : ki; // wave number of scattered wave
+	double kc2 = 2*m_n*Estep*ele_e*ele_e/hbar/hbar; // squared critical wave number
+	double kappa = (transmit ? -kc2 : kc2)/ks/ks; // diffusely scattered amplitude is 2*cos(theta)/(cos(theta) + sqrt(cos(theta)^2 - kappa)), see MRDist
+	double costheta_i = abs(vnormal/sqrt(v2)); // cosine of angle between normal and incoming velocity vector
+	double pi_x = ki*sqrt(1 - costheta_i*costheta_i); // parallel momentum of incoming wave, pointing towards phi = 0
+
+	// MRDist*dOmega is proportional to exp(-w^2/2*|p - pi|^2)*d^2p*|So|^2/cos(theta), with parallel momentum p = ks*sin(theta)*(cos(phi), sin(phi)) of scattered wave.
+	// |So|^2/cos(theta) increases up to cos(theta) = sqrt(kappa) (kappa > 0) or sqrt(-kappa/3) (kappa < 0) and decreases above.
+	double costheta_max = min(1., sqrt(kappa > 0 ? kappa : -kappa/3));
+	double polarmax = MRPolarFactor(transmit, costheta_max, kappa);
+	double pmin = max(0., pi_x - ks); // smallest distance between incoming parallel momentum and disk |p| < ks of scattered parallel momenta
+	bool gaussian = ks*correlationLength > 1 && pmin*correlationLength < 1; // sample parallel momentum from Gaussian if most of it overlaps with disk, else uniformly from disk
+	std::normal_distribution<double> gaussdist(0, 1/correlationLength);
+	std::uniform_real_distribution<double> unidist(0, 1);
+	double px, py;
+	while (true){
+		double accept = 1;
+		if (gaussian){
+			px = pi_x + gaussdist(mc);
+			py = gaussdist(mc);
+			if (px*px + py*py >= ks*ks)
+				continue;
+		}
+		else{
+			double r = ks*sqrt(unidist(mc)), a = 2*pi*unidist(mc);
+			px = r*cos(a);
+			py = r*sin(a);
+			accept = exp(-correlationLength*correlationLength/2*((px - pi_x)*(px - pi_x) + py*py - pmin*pmin)); // Gaussian relative to its maximum on disk
+		}
+		double sintheta = sqrt(px*px + py*py)/ks;
+		if (polarmax > 0) // if distribution vanishes everywhere accept any direction
+			accept *= MRPolarFactor(transmit, sqrt(1 - sintheta*sintheta), kappa)/polarmax;
+		if (unidist(mc) < accept){
+			theta = asin(sintheta);
+			phi = atan2(py, px);
+			if (phi < 0)
+				phi += 2*pi;
+			return;
+		}
+	}
+}
+
 }
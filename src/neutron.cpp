@@ -7,6 +7,7 @@
 #include "globals.h"
 #include "proton.h"
 #include "electron.h"
+#include "diagnostics.h"
 
 #include <valarray>
 
@@ -15,14 +16,101 @@ using namespace std;
 const char* NAME_NEUTRON = "neutron";
 
 
+/**
+ * Return nominal or alternative material of a solid for weighted tracking
+ *
+ * @param sld Solid
+ * @param i Index of survival weight (0: nominal material, i > 0: solid::weightmats[i - 1])
+ *
+ * @return Returns material
+ */
+static const material& WeightMaterial(const solid &sld, const unsigned i){
+	return i == 0 ? sld.mat : sld.weightmats[i - 1];
+}
+
+/**
+ * Calculate probability of specular reflection on a potential step, including absorption given by the imaginary Fermi potentials
+ *
+ * @param Enormal Energy normal to surface
+ * @param Estep Potential step
+ * @param Wleaving Imaginary Fermi potential of material that the neutron is leaving [eV]
+ * @param Wentering Imaginary Fermi potential of material that the neutron is entering [eV]
+ *
+ * @return Returns reflection probability
+ */
+static double ReflectionProbability(const double Enormal, const double Estep, const double Wleaving, const double Wentering){
+	complex<double> k1 = sqrt(complex<double>(Enormal, -Wleaving)); // wavenumber in first solid
+	complex<double> k2 = sqrt(complex<double>(Enormal - Estep, -Wentering)); // wavenumber in second solid
+	return norm((k1 - k2)/(k1 + k2));
+}
+
+/**
+ * Calculate probability of specular reflection on a potential step between two materials, see ReflectionProbability above
+ *
+ * @param Enormal Energy normal to surface
+ * @param Estep Potential step
+ * @param leaving Material that the neutron is leaving
+ * @param entering Material that the neutron is entering
+ *
+ * @return Returns reflection probability
+ */
+static double ReflectionProbability(const double Enormal, const double Estep, const material &leaving, const material &entering){
+	return ReflectionProbability(Enormal, Estep, leaving.FermiImag*1e-9, entering.FermiImag*1e-9);
+}
+
+/**
+ * Calculate ratio of probabilities of a Lambert or specular reflection or transmission on an alternative and the nominal material
+ *
+ * @param lambert True if Lambert model was sampled
+ * @param nominal Nominal material
+ * @param alternative Alternative material
+ *
+ * @return Returns factor for survival weight of alternative material
+ */
+static double LambertWeight(const bool lambert, const material &nominal, const material &alternative){
+	double p = nominal.DiffProb + nominal.ModifiedLambertProb;
+	double altp = alternative.DiffProb + alternative.ModifiedLambertProb;
+	if (altp == p)
+		return 1;
+	return lambert ? altp/p : (1 - altp)/(1 - p); // both probabilities are checked when alternative materials are read
+}
+
+
+/**
+ * Sample a vector from a cosine distribution around a unit vector, using two random numbers
+ *
+ * The cosine of the polar angle is the square root of a uniform random number (inverse of its cumulative distribution), the azimuth is uniform.
+ * The vector is built from an orthonormal basis around the axis (Duff et al., J. Comput. Graph. Tech. 6 (2017) 1), so no rotation matrix is needed.
+ *
+ * @param axis Unit vector
+ * @param vabs Length of sampled vector
+ * @param mc Random-number generator
+ * @param v Returns sampled vector, its angle to axis is always smaller than 90 degrees
+ */
+static void CosineDirection(const double axis[3], const double vabs, TMCGenerator &mc, double v[3]){
+	std::uniform_real_distribution<double> unidist(0, 1);
+	double costheta = sqrt(1 - unidist(mc)); // 1 - u lies in (0, 1], so the vector never lies in the plane
+	double sintheta = sqrt(1 - costheta*costheta);
+	double phi = 2*pi*unidist(mc);
+	double sign = copysign(1., axis[2]);
+	double a = -1/(sign + axis[2]);
+	double b = axis[0]*axis[1]*a;
+	double e1[3] = {1 + sign*axis[0]*axis[0]*a, sign*b, -sign*axis[0]};
+	double e2[3] = {b, sign + axis[1]*axis[1]*a, -axis[1]};
+	double c1 = vabs*sintheta*cos(phi), c2 = vabs*sintheta*sin(phi), c3 = vabs*costheta;
+	for (int i = 0; i < 3; ++i)
+		v[i] = c1*e1[i] + c2*e2[i] + c3*axis[i];
+}
+
+
 TNeutron::TNeutron(const int number, const double t, const double x, const double y, const double z, const double E, const double phi, const double theta, const double polarisation,
-		TMCGenerator &amc, const TGeometry &geometry, const TFieldManager &afield)
-		: TParticle(NAME_NEUTRON, 0, m_n, mu_nSI, gamma_n, number, t, x, y, z, E, phi, theta, polarisation, amc, geometry, afield){
+		TMCGenerator &amc, const TGeometry &geometry, const TFieldManager &afield, const solid *startsolid)
+		: TParticle(NAME_NEUTRON, 0, m_n, mu_nSI, gamma_n, number, t, x, y, z, E, phi, theta, polarisation, amc, geometry, afield, startsolid), opticaldepth(-1), absorbingsolid(0), absorptionconst(0){
 
 }
 
 
-void TNeutron::Transmit(const value_type x1, const state_type &y1, value_type &x2, state_type &y2,
+bool TNeutron::Transmit(const value_type x1, const state_type &y1, value_type &x2, state_type &y2,
 		const double normal[3], const double Estep) const{
 	double vnormal = y1[3]*normal[0] + y1[4]*normal[1] + y1[5]*normal[2]; // velocity normal to reflection plane
 
@@ -30,26 +118,18 @@ void TNeutron::Transmit(const value_type x1, const state_type &y1, value_type &x
 	double Enormal = 0.5*m_n*vnormal*vnormal; // energy normal to reflection plane
 	double k1 = sqrt(Enormal); // wavenumber in first solid (use only real part for transmission!)
 	double k2 = sqrt(Enormal - Estep); // wavenumber in second solid (use only real part for transmission!)
+	if (k2/k1 - 1 == 0)
+		return false;
 	for (int i = 0; i < 3; i++)
 		y2[i + 3] += (k2/k1 - 1)*(normal[i]*vnormal); // refract (scale normal velocity by k2/k1)
+	return true;
 }
 
 
 void TNeutron::TransmitMR(const value_type x1, const state_type &y1, value_type &x2, state_type &y2,
 		const double normal[3], const double Estep, const material &mat, TMCGenerator &mc) const{
-
-	if (!MR::MRValid(&y1[3], normal, Estep, mat.RMSRoughness, mat.CorrelLength)){ // check if MicroRoughness model should be applied
-		throw runtime_error("Tried to use micro-roughness model in invalid energy regime. That should not happen!");
-	}
-	
 	double theta_t, phi_t;
-	std::uniform_real_distribution<double> MRprobdist(0, 1.5 * MR::MRDistMax(true, &y1[3], normal, Estep, mat.RMSRoughness, mat.CorrelLength)); // scale up maximum to make sure it lies above all values of scattering distribution
-	std::uniform_real_distribution<double> phidist(0, 2.*pi);
-	std::sin_distribution<double> sindist(0, pi/2.);
-	do{
-		phi_t = phidist(mc);
-		theta_t = sindist(mc);
-	}while (MRprobdist(mc) > MR::MRDist(true, false, &y1[3], normal, Estep, mat.RMSRoughness, mat.CorrelLength, theta_t, phi_t));
+	MR::MRSampleDirection(true, &y1[3], normal, Estep, mat.RMSRoughness, mat.CorrelLength, mc, theta_t, phi_t);
 
 	double vabs = sqrt(y1[3]*y1[3] + y1[4]*y1[4] + y1[5]*y1[5] - 2*Estep/m_n);
 	double vnormal = y1[3]*normal[0] + y1[4]*normal[1] + y1[5]*normal[2]; // velocity normal to reflection plane
@@ -76,23 +156,15 @@ void TNeutron::TransmitLambert(const value_type x1, const state_type &y1, value_
 	std::valarray<double> specular_trans(&y2[3], 3);
 	specular_trans += (k2/k1 - 1)*n*vnormal;
 
-	double theta_t, phi_t;
-
 	double vabs = std::sqrt((specular_trans*specular_trans).sum());
-	do {
-        std::uniform_real_distribution<double> unidist(0, 2.*pi);
-        phi_t = unidist(mc);
-        std::sincos_distribution<double> sincosdist(0, pi/2.);
-        theta_t = sincosdist(mc);
-        y2[3] = vabs * cos(phi_t) * sin(theta_t);    // new velocity with respect to z-axis
-        y2[4] = vabs * sin(phi_t) * sin(theta_t);
-        y2[5] = vabs * cos(theta_t);
-        if (mat.DiffProb > 0) {
-            RotateVector(&y2[3], &n[0], &y1[3]); // rotate velocity into coordinate system defined by incoming velocity and plane normal
-        } else {
-            RotateVector(&y2[3], &specular_trans[0], &y1[3]);
-        }
-    }while(y2[3]*n[0] + y2[4]*n[1] + y2[5]*n[2] <= 0); // resample until velocity points into correct hemisphere
+	if (mat.DiffProb > 0)
+		CosineDirection(&n[0], vabs, mc, &y2[3]);
+	else{ // modified Lambert model: cosine distribution around specularly transmitted velocity, resample until velocity points into correct hemisphere
+		specular_trans /= vabs;
+		do{
+			CosineDirection(&specular_trans[0], vabs, mc, &y2[3]);
+		}while(y2[3]*n[0] + y2[4]*n[1] + y2[5]*n[2] <= 0);
+	}
 }
 
 
@@ -117,19 +189,8 @@ void TNeutron::Reflect(const value_type x1, const state_type &y1, value_type &x2
 
 void TNeutron::ReflectMR(const value_type x1, const state_type &y1, value_type &x2, state_type &y2,
 		const double normal[3], const double Estep, const material &mat, TMCGenerator &mc) const{
-	if (!MR::MRValid(&y1[3], normal, Estep, mat.RMSRoughness, mat.CorrelLength)){
-		throw runtime_error("Tried to use micro-roughness model in invalid energy regime. That should not happen!");
-	}
-
 	double phi_r, theta_r;
-	std::uniform_real_distribution<double> MRprobdist(0, 1.5 * MR::MRDistMax(true, &y1[3], normal, Estep, mat.RMSRoughness, mat.CorrelLength)); // scale up maximum to make sure it lies above all values of scattering distribution
-//			cout << "max: " << MRmax << '\n';
-	std::uniform_real_distribution<double> unidist(0, 2.*pi);
-	std::sin_distribution<double> sindist(0, pi/2.);
-	do{
-		phi_r = unidist(mc);
-		theta_r = sindist(mc);
-	}while (MRprobdist(mc) > MR::MRDist(false, false, &y1[3], normal, Estep, mat.RMSRoughness, mat.CorrelLength, theta_r, phi_r));
+	MR::MRSampleDirection(false, &y1[3], normal, Estep, mat.RMSRoughness, mat.CorrelLength, mc, theta_r, phi_r);
 
 	double vnormal = y1[3]*normal[0] + y1[4]*normal[1] + y1[5]*normal[2]; // velocity normal to reflection plane
 	if (vnormal > 0) theta_r = pi - theta_r; // if velocity points out of volume invert polar angle
@@ -162,101 +223,136 @@ void TNeutron::ReflectLambert(const value_type x1, const state_type &y1, value_t
 	y2[1] = y1[1];
 	y2[2] = y1[2];
 	double vabs = sqrt(y1[3]*y1[3] + y1[4]*y1[4] + y1[5]*y1[5]);
-	do {
-        std::uniform_real_distribution<double> unidist(0, 2.*pi);
-        double phi_r = unidist(mc);
-        std::sincos_distribution<double> sincosdist(0, pi/2.);
-        double theta_r = sincosdist(mc);
-
-        y2[3] = vabs * cos(phi_r) * sin(theta_r);    // new velocity with respect to z-axis
-        y2[4] = vabs * sin(phi_r) * sin(theta_r);
-        y2[5] = vabs * cos(theta_r);
-        if (mat.DiffProb > 0) {
-            RotateVector(&y2[3], &n[0], &y1[3]); // rotate velocity into coordinate system defined by incoming velocity and plane normal
-        } else { // if DiffProb == 0 use modified Lambert model
-            std::valarray<double> specular_refl(&y1[3],3);
-            specular_refl -= 2*vnormal*n;
-            RotateVector(&y2[3], &specular_refl[0], &y1[3]); // rotate velocity into coordinate system defined by specularly reflected velocity vector
-        }
-    }while(y2[3]*n[0] + y2[4]*n[1] + y2[5]*n[2] <= 0); // resample until velocity points into correct reflection hemisphere
+	if (mat.DiffProb > 0)
+		CosineDirection(&n[0], vabs, mc, &y2[3]);
+	else{ // if DiffProb == 0 use modified Lambert model: cosine distribution around specularly reflected velocity, resample until velocity points into correct reflection hemisphere
+		std::valarray<double> specular_refl(&y1[3], 3);
+		specular_refl -= 2*vnormal*n;
+		specular_refl /= vabs;
+		do{
+			CosineDirection(&specular_refl[0], vabs, mc, &y2[3]);
+		}while(y2[3]*n[0] + y2[4]*n[1] + y2[5]*n[2] <= 0);
+	}
 	y2[6] = y1[6];
 	y2[8] = y1[8];
 }
 
 
-void TNeutron::OnHit(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const double normal[3],
+TEventResult TNeutron::OnHit(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const double normal[3],
 		const solid &leaving, const solid &entering, TMCGenerator &mc, stopID &ID, std::vector<TParticle*> &secondaries) const{
 
     double vnormal = y1[3]*normal[0] + y1[4]*normal[1] + y1[5]*normal[2]; // velocity normal to reflection plane
     double Enormal = 0.5*m_n*vnormal*vnormal; // energy normal to reflection plane
-    material mat = vnormal < 0 ? entering.mat : leaving.mat; // use material properties of the solid whose surface was hit
+    const material &mat = vnormal < 0 ? entering.mat : leaving.mat; // use material properties of the solid whose surface was hit
+    const TMaterialInterface &interface = leaving.GetInterface(entering); // constants of both materials calculated when the geometry was loaded
+    const TMaterialInterface::TSide &side = vnormal < 0 ? interface.entering : interface.leaving;
 
     std::uniform_real_distribution<double> unidist(0, 1);
-    if (unidist(mc) < mat.SpinflipProb){ // should spin be flipped?
+    bool spinflipped = unidist(mc) < side.SpinflipProb; // should spin be flipped?
+    if (spinflipped){
         y2[7] *= -1;
     }
 
-    double Estep = CalcPotentialStep(leaving.mat, entering.mat, y2);
+    double Estep = interface.potentialstep - interface.fieldstep*GetMagneticMoment()*y2[7]/ele_e; // same as CalcPotentialStep
 
 //		cout << "Leaving " << leaving->ID << " Entering " << entering->ID << " Enormal = " << Enormal << " Estep = " << Estep;
 
-    bool UseMRModel = MR::MRValid(&y1[3], normal, Estep, mat.RMSRoughness, mat.CorrelLength);
+    vector<double> &weights = SurvivalWeights();
+    double E = GetKineticEnergy(&y1[3]);
+    bool UseMRModel = max(max(E, Estep), E - Estep) < side.MRmaxenergy; // wave numbers in both materials are small enough, same as MR::MRValid
+	if (not UseMRModel && side.MRmaxenergy > 0){ // roughness was set, but the energy is outside of the model's range
+		Diagnostics::Count(DIAG_MR_NOT_APPLICABLE, vnormal < 0 ? entering.ID : leaving.ID, GetParticleNumber(), x1, &y1[0], Estep);
+	}
 	double MRreflprob = 0, MRtransprob = 0;
 	if (UseMRModel){ 	// handle MicroRoughness reflection/transmission separately
-		MRreflprob = MR::MRProb(false, &y1[3], normal, Estep, mat.RMSRoughness, mat.CorrelLength);
-		if (GetKineticEnergy(&y1[3]) > Estep) // MicroRoughness transmission can happen if neutron energy > potential step
-			MRtransprob = MR::MRProb(true, &y1[3], normal, Estep, mat.RMSRoughness, mat.CorrelLength);
+		MRreflprob = MR::MRProbTabulated(false, &y1[3], normal, Estep, mat.RMSRoughness, mat.CorrelLength);
+		if (E > Estep) // MicroRoughness transmission can happen if neutron energy > potential step
+			MRtransprob = MR::MRProbTabulated(true, &y1[3], normal, Estep, mat.RMSRoughness, mat.CorrelLength);
+	}
+	double reflprob = ReflectionProbability(Enormal, Estep, interface.leaving.FermiImag, interface.entering.FermiImag); // specular reflection probability
+	double MRcorrection = 1, absprob = 0;
+	if (Enormal <= Estep){ // total reflection
+		if (UseMRModel){
+			double kc = sqrt(2*m_n*Estep)*ele_e/hbar;
+			double addtrans = 2*pow(entering.mat.RMSRoughness, 2)*kc*kc/(1 + 0.85*kc*entering.mat.CorrelLength + 2*kc*kc*pow(entering.mat.CorrelLength, 2));
+			MRcorrection = sqrt(1 + addtrans); // second order correction for reflection on MicroRoughness surfaces
+		}
+		absprob = (1 - reflprob + side.LossPerBounce)*MRcorrection; // absorption probability during total reflection, add loss per bounce
 	}
+	AddHitProbabilities(absprob*(1 - MRreflprob - MRtransprob), side.SpinflipProb); // expected loss and depolarisation, extrapolated by statistical fate sampling
+
 	double prob = unidist(mc);
 	if (UseMRModel && prob < MRreflprob){
 		ReflectMR(x1, y1, x2, y2, normal, Estep, mat, mc);
+		return EVENT_REFLECTED;
 	}
 	else if (UseMRModel && prob < MRreflprob + MRtransprob){
 		TransmitMR(x1, y1, x2, y2, normal, Estep, mat, mc);
+		return EVENT_TRANSMITTED;
 	}
 
 	else{
-		complex<double> k1 = sqrt(complex<double>(Enormal, -leaving.mat.FermiImag*1e-9)); // wavenumber in first solid
-		complex<double> k2 = sqrt(complex<double>(Enormal - Estep, -entering.mat.FermiImag*1e-9)); // wavenumber in second solid
-		double reflprob = norm((k1 - k2)/(k1 + k2)); // specular reflection probability
 		if (Enormal > Estep){ // transmission only possible if Enormal > Estep
-			if (prob < MRreflprob + MRtransprob + reflprob*(1 - MRreflprob - MRtransprob)){ // reflection, scale down reflprob so MRreflprob + MRtransprob + reflprob + transprob = 1
-				if (!UseMRModel && unidist(mc) < mat.DiffProb + mat.ModifiedLambertProb){
+			bool reflected = prob < MRreflprob + MRtransprob + reflprob*(1 - MRreflprob - MRtransprob); // reflection, scale down reflprob so MRreflprob + MRtransprob + reflprob + transprob = 1
+			bool lambert = !UseMRModel && unidist(mc) < side.LambertProb;
+			for (unsigned i = 1; i < weights.size(); ++i){ // reweight alternative materials by ratio of probabilities of sampled reflection or transmission
+				double altreflprob = ReflectionProbability(Enormal, Estep, WeightMaterial(leaving, i), WeightMaterial(entering, i));
+				weights[i] *= reflected ? altreflprob/reflprob : (1 - altreflprob)/(1 - reflprob);
+				weights[i] *= LambertWeight(lambert, mat, vnormal < 0 ? WeightMaterial(entering, i) : WeightMaterial(leaving, i));
+			}
+			if (reflected){
+				if (lambert){
 					ReflectLambert(x1, y1, x2, y2, normal, mat, mc); // Lambert reflection
 				}
 				else{
 					Reflect(x1, y1, x2, y2, normal); // specular reflection
 				}
+				return EVENT_REFLECTED;
 			}
 			else{
-				if (!UseMRModel && unidist(mc) < mat.DiffProb + mat.ModifiedLambertProb){
+				if (lambert){
 					TransmitLambert(x1, y1, x2, y2, normal, Estep, mat, mc); // Lambert transmission
 				}
-				else{
-					Transmit(x1, y1, x2, y2, normal, Estep); // specular transmission
+				else if (!Transmit(x1, y1, x2, y2, normal, Estep) && !spinflipped){ // specular transmission
+					return EVENT_UNCHANGED; // no potential step, particle continues its step
 				}
+				return EVENT_TRANSMITTED;
 			}
 		}
 		else{ // total reflection (Enormal < Estep)
-			double absprob = 1 - reflprob + mat.LossPerBounce; // absorption probability during total reflection, add loss per bounce
-
-			if (UseMRModel){
-				double kc = sqrt(2*m_n*Estep)*ele_e/hbar;
-				double addtrans = 2*pow(entering.mat.RMSRoughness, 2)*kc*kc/(1 + 0.85*kc*entering.mat.CorrelLength + 2*kc*kc*pow(entering.mat.CorrelLength, 2));
-				absprob *= sqrt(1 + addtrans); // second order correction for reflection on MicroRoughness surfaces
+			if (IsAdjoint() && !UseMRModel && unidist(mc) < side.LambertProb){ // reverse of a diffuse reflection, whose losses depend on the sampled direction, from which the neutron arrived in forward direction
+				ReflectLambert(x1, y1, x2, y2, normal, mat, mc);
+				double vout = y2[3]*normal[0] + y2[4]*normal[1] + y2[5]*normal[2];
+				double Eout = 0.5*m_n*vout*vout;
+				for (unsigned i = 0; i < weights.size(); ++i){
+					const material &altmat = vnormal < 0 ? WeightMaterial(entering, i) : WeightMaterial(leaving, i);
+					double altabsprob = 1 - ReflectionProbability(Eout, Estep, WeightMaterial(leaving, i), WeightMaterial(entering, i)) + altmat.LossPerBounce;
+					weights[i] *= max(0., 1 - altabsprob)*LambertWeight(true, mat, altmat);
+				}
+				if (weights.empty() && unidist(mc) < 1 - ReflectionProbability(Eout, Estep, interface.leaving.FermiImag, interface.entering.FermiImag) + side.LossPerBounce){
+					ID = ID_ABSORBED_ON_SURFACE;
+					return EVENT_ABSORBED;
+				}
+				return EVENT_REFLECTED;
 			}
-	//			cout << " ReflProb = " << reflprob << '\n';
-
-			if (prob < MRreflprob + MRtransprob + absprob*(1 - MRreflprob - MRtransprob)){ // -> absorption on reflection, scale down absprob so MRreflprob + MRtransprob + absprob + reflprob = 1
+			if (weights.empty() && prob < MRreflprob + MRtransprob + absprob*(1 - MRreflprob - MRtransprob)){ // -> absorption on reflection, scale down absprob so MRreflprob + MRtransprob + absprob + reflprob = 1
 				ID = ID_ABSORBED_ON_SURFACE;
+				return EVENT_ABSORBED;
 			}
 			else{ // no absorption -> reflection
-				if (!UseMRModel && unidist(mc) < mat.DiffProb + mat.ModifiedLambertProb){
+				bool lambert = !UseMRModel && unidist(mc) < side.LambertProb;
+				for (unsigned i = 0; i < weights.size(); ++i){ // weighted tracking never absorbs, multiply weights by reflection probability instead
+					const material &altmat = vnormal < 0 ? WeightMaterial(entering, i) : WeightMaterial(leaving, i);
+					double altabsprob = (1 - ReflectionProbability(Enormal, Estep, WeightMaterial(leaving, i), WeightMaterial(entering, i)) + altmat.LossPerBounce)*MRcorrection;
+					weights[i] *= max(0., 1 - altabsprob)*LambertWeight(lambert, mat, altmat);
+				}
+				if (lambert){
 					ReflectLambert(x1, y1, x2, y2, normal, mat, mc); // Lambert reflection
 				}
 				else{
 					Reflect(x1, y1, x2, y2, normal); // specular reflection
 				}
+				return EVENT_REFLECTED;
 			}
 		}
 	}
@@ -264,21 +360,42 @@ void TNeutron::OnHit(const value_type x1, const state_type &y1, value_type &x2,
 }
 
 
-void TNeutron::OnStep(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const dense_stepper_type &stepper,
+TEventResult TNeutron::OnStep(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const TStepper &stepper,
 					const solid &currentsolid, TMCGenerator &mc, stopID &ID, std::vector<TParticle*> &secondaries) const{
-	if (currentsolid.mat.FermiImag > 0){
-		complex<double> E(0.5*(double)m_n*(y1[3]*y1[3] + y1[4]*y1[4] + y1[5]*y1[5]), currentsolid.mat.FermiImag*1e-9); // E + i*W
-		complex<double> k = sqrt(2*(double)m_n*E)*(double)ele_e/(double)hbar; // wave vector
+	vector<double> &weights = SurvivalWeights();
+	if (not weights.empty()){ // weighted tracking never absorbs, multiply weights by probability to pass through material instead
+		double E = 0.5*(double)m_n*(y1[3]*y1[3] + y1[4]*y1[4] + y1[5]*y1[5]);
+		double l = sqrt(pow(y2[0] - y1[0], 2) + pow(y2[1] - y1[1], 2) + pow(y2[2] - y1[2], 2)); // travelled length
+		for (unsigned i = 0; i < weights.size(); ++i){
+			double W = WeightMaterial(currentsolid, i).FermiImag*1e-9;
+			if (W > 0){
+				double mu = 2*sqrt((double)m_n)*W*(double)ele_e/(double)hbar/sqrt(sqrt(E*E + W*W) + E); // absorption coefficient 2*Im(k), k = sqrt(2*m_n*(E + i*W))*e/hbar
+				weights[i] *= exp(-mu*l);
+			}
+		}
+	}
+	else if (currentsolid.mat.FermiImag > 0){
+		double W = currentsolid.mat.FermiImag*1e-9;
+		if (opticaldepth < 0 || absorbingsolid != currentsolid.ID){ // entering absorbing solid, sample optical depth until absorption
+			opticaldepth = std::exponential_distribution<double>(1)(mc);
+			absorbingsolid = currentsolid.ID;
+			absorptionconst = 2*sqrt((double)m_n)*W*(double)ele_e/(double)hbar;
+		}
+		double E = 0.5*(double)m_n*(y1[3]*y1[3] + y1[4]*y1[4] + y1[5]*y1[5]);
+		double mu = absorptionconst/sqrt(sqrt(E*E + W*W) + E); // absorption coefficient 2*Im(k), k = sqrt(2*m_n*(E + i*W))*e/hbar
 		double l = sqrt(pow(y2[0] - y1[0], 2) + pow(y2[1] - y1[1], 2) + pow(y2[2] - y1[2], 2)); // travelled length
-		std::exponential_distribution<double> expdist(2*imag(k));
-		double abspath = expdist(mc);
-		if (abspath < l){
-			x2 = x1 + abspath/l*(x2 - x1); // if absorbed, interpolate stopping time and position
+		if (opticaldepth < mu*l){
+			x2 = x1 + opticaldepth/(mu*l)*(x2 - x1); // if absorbed, interpolate stopping time and position
 			stepper.calc_state(x2, y2);
 			ID = ID_ABSORBED_IN_MATERIAL;
+			opticaldepth = 0;
 //			printf("Absorption!\n");
+			return EVENT_ABSORBED;
 		}
+		else
+			opticaldepth -= mu*l;
 	}
+	return EVENT_UNCHANGED;
 }
 
 
@@ -11,9 +11,61 @@
 #include <boost/math/tools/roots.hpp>
 
 #include "particle.h"
+#include "profiler.h"
 
 using namespace std;
 
+/**
+ * Memory blocks of destroyed particles, kept by each thread for reuse
+ *
+ * Derived particle classes have different sizes, so blocks are grouped by size. A block is kept by the thread that destroys the particle,
+ * which can differ from the thread that created it if another thread tracked a secondary particle.
+ */
+struct TParticlePool{
+	std::vector<std::pair<std::size_t, std::vector<void*> > > blocks; ///< List of free blocks of each size
+
+	/**
+	 * Get list of free blocks with given size
+	 *
+	 * @param size Size of blocks
+	 *
+	 * @return Returns list of free blocks
+	 */
+	std::vector<void*>& FreeList(const std::size_t size){
+		for (auto &b: blocks){
+			if (b.first == size)
+				return b.second;
+		}
+		blocks.emplace_back(size, std::vector<void*>());
+		return blocks.back().second;
+	}
+
+	/**
+	 * Destructor, returns all free blocks to the global allocator when the thread exits
+	 */
+	~TParticlePool(){
+		for (auto &b: blocks){
+			for (void *ptr: b.second)
+				::operator delete(ptr);
+		}
+	}
+};
+
+static thread_local TParticlePool particlepool; ///< Free blocks of particles destroyed by this thread
+
+void* TParticle::operator new(std::size_t size){
+	std::vector<void*> &freelist = particlepool.FreeList(size);
+	if (freelist.empty())
+		return ::operator new(size);
+	void *ptr = freelist.back();
+	freelist.pop_back();
+	return ptr;
+}
+
+void TParticle::operator delete(void *ptr, std::size_t size){
+	particlepool.FreeList(size).push_back(ptr);
+}
+
 double TParticle::GetInitialTotalEnergy(const TGeometry &geom, const TFieldManager &field) const{
 	return GetKineticEnergy(&ystart[3]) + GetPotentialEnergy(tstart, ystart, field, geom.GetSolid(tstart, &ystart[0]));
 }
@@ -35,9 +87,12 @@ double TParticle::GetFinalKineticEnergy() const{
 
 TParticle::TParticle(const char *aname, const  double qq, const long double mm, const long double mumu, const long double agamma, const int number,
 		const double t, const double x, const double y, const double z, const double E, const double phi, const double theta, const double polarisation,
-		TMCGenerator &amc, const TGeometry &geometry, const TFieldManager &afield)
-		: name(aname), q(qq), m(mm), mu(mumu), gamma(agamma), particlenumber(number), ID(ID_UNKNOWN),
-		  tstart(t), tend(t), Hmax(0), Nhit(0), Nspinflip(0), noflipprob(1), Nstep(0){
+		TMCGenerator &amc, const TGeometry &geometry, const TFieldManager &afield, const solid *startsolid)
+		: name(aname), q(qq), m(mm), mu(mumu), gamma(agamma),
+		  constants{static_cast<double>(qq/(mm*ele_e)), static_cast<double>(mumu/(mm*ele_e)), static_cast<double>(agamma),
+		            static_cast<double>(gravconst), static_cast<double>(1/(c_0*c_0))},
+		  particlenumber(number), ID(ID_UNKNOWN),
+		  tstart(t), tend(t), Hmax(0), Nhit(0), Nspinflip(0), noflipprob(1), Nstep(0), tau(-1), statweight(1), hitlossprob(0), hitflipprob(0), fatesampled(false), cell{{0, 0, 0}}, adjoint(false){
 
 	// for small velocities Ekin/m is very small and the relativstic claculation beta^2 = 1 - 1/gamma^2 gives large round-off errors
 	// the round-off error can be estimated as 2*epsilon
@@ -54,7 +109,7 @@ TParticle::TParticle(const char *aname, const  double qq, const long double mm,
 	if (polarisation < -1 || polarisation > 1)
 		throw std::runtime_error("Polarisation has to be between -1 and 1");
 
-	ystart.resize(STATE_VARIABLES, 0);
+	ystart.fill(0);
 	ystart[0] = x; // position
 	ystart[1] = y;
 	ystart[2] = z;
@@ -67,7 +122,7 @@ TParticle::TParticle(const char *aname, const  double qq, const long double mm,
 	ystart[8] = 0;
 	yend = ystart;
 
-	spinstart.resize(SPIN_STATE_VARIABLES, 0);
+	spinstart.fill(0);
 
 	double B[3];
 	afield.BField(x, y, z, t, B);
@@ -86,8 +141,10 @@ TParticle::TParticle(const char *aname, const  double qq, const long double mm,
 
 	spinend = spinstart;
 
-	solidend = solidstart = geometry.GetSolid(t, &ystart[0]); // set to solid with highest priority
-	Hmax = GetInitialTotalEnergy(geometry, afield);
+	solidend = solidstart = startsolid ? startsolid : &geometry.GetSolid(t, &ystart[0]); // set to solid with highest priority
+	if (not geometry.defaultsolid.weightmats.empty())
+		weights.assign(geometry.defaultsolid.weightmats.size() + 1, 1.); // weighted tracking, every solid has the same number of alternative materials
+	Hmax = GetKineticEnergy(&ystart[3]) + GetPotentialEnergy(tstart, ystart, afield, *solidstart); // initial total energy, reusing solid found above
 }
 
 
@@ -95,63 +152,147 @@ TParticle::TParticle(const char *aname, const  double qq, const long double mm,
 
 
 void TParticle::derivs(const state_type &y, state_type &dydx, const value_type x, const TFieldManager *field) const{
+	if (q != 0 && mu != 0)
+		TEquationOfMotion<true, true>{*this, *field}(y, dydx, x);
+	else if (q != 0)
+		TEquationOfMotion<true, false>{*this, *field}(y, dydx, x);
+	else if (mu != 0)
+		TEquationOfMotion<false, true>{*this, *field}(y, dydx, x);
+	else
+		TEquationOfMotion<false, false>{*this, *field}(y, dydx, x);
+}
+
+void TParticle::EquationOfMotion(const state_type &y, state_type &dydx, const value_type x, const double B[3], const double dBidxj[3][3], const double E[3]) const{
+	if (q != 0 && mu != 0)
+		EquationOfMotion<true, true>(y, dydx, x, B, dBidxj, E);
+	else if (q != 0)
+		EquationOfMotion<true, false>(y, dydx, x, B, dBidxj, E);
+	else if (mu != 0)
+		EquationOfMotion<false, true>(y, dydx, x, B, dBidxj, E);
+	else
+		EquationOfMotion<false, false>(y, dydx, x, B, dBidxj, E);
+}
+
+template<bool charged, bool magnetic>
+void TEquationOfMotion<charged, magnetic>::operator()(const state_type &y, state_type &dydx, const value_type x) const{
+	PROFILE(PROFILE_DERIVS);
+	++particle.TrackingCost().derivs;
 	double B[3], dBidxj[3][3], E[3], V; // magnetic/electric field and electric potential in lab frame
-	if (q != 0 || (mu != 0 && y[7] != 0)) // if particle has charge or magnetic moment, calculate magnetic field
-		field->BField(y[0],y[1],y[2], x, B, dBidxj);
- 	if (q != 0) // if particle has charge caculate electric field
-		field->EField(y[0],y[1],y[2], x, V, E);
-	EquationOfMotion(y, dydx, x, B, dBidxj, E);
+	if (charged || (magnetic && y[7] != 0)) // if particle has charge or magnetic moment, calculate magnetic field
+		field.BField(y[0],y[1],y[2], x, B, magnetic && y[7] != 0 ? dBidxj : nullptr); // gradient is only needed for force on magnetic moment
+	if (charged) // if particle has charge caculate electric field
+		field.EField(y[0],y[1],y[2], x, V, E);
+	particle.EquationOfMotion<charged, magnetic>(y, dydx, x, B, dBidxj, E);
 }
 
+template<bool charged, bool magnetic>
 void TParticle::EquationOfMotion(const state_type &y, state_type &dydx, const value_type x, const double B[3], const double dBidxj[3][3], const double E[3]) const{
 	dydx[0] = y[3]; // time derivatives of position = velocity
 	dydx[1] = y[4];
 	dydx[2] = y[5];
 
-	value_type F[3] = {0,0,0}; // Force in lab frame
-	F[2] += -gravconst*m*ele_e; // add gravitation to force
-	if (q != 0){
-		F[0] += q*(E[0] + y[4]*B[2] - y[5]*B[1]); // add Lorentz-force
-		F[1] += q*(E[1] + y[5]*B[0] - y[3]*B[2]);
-		F[2] += q*(E[2] + y[3]*B[1] - y[4]*B[0]);
+	const TParticleConstants &c = constants;
+	double a[3] = {0, 0, -c.g}; // Force divided by mass in lab frame, starting with gravitation
+	if (charged){
+		a[0] += c.chargepermass*(E[0] + y[4]*B[2] - y[5]*B[1]); // add Lorentz-force
+		a[1] += c.chargepermass*(E[1] + y[5]*B[0] - y[3]*B[2]);
+		a[2] += c.chargepermass*(E[2] + y[3]*B[1] - y[4]*B[0]);
 	}
-	if (mu != 0 && y[7] != 0 && (B[0] != 0 || B[1] != 0 || B[2] != 0)){
+	if (magnetic && y[7] != 0 && (B[0] != 0 || B[1] != 0 || B[2] != 0)){
 		double Babs = sqrt(B[0]*B[0] + B[1]*B[1] + B[2]*B[2]);
 		double dBdxi[3] = {	(B[0]*dBidxj[0][0] + B[1]*dBidxj[1][0] + B[2]*dBidxj[2][0])/Babs,
 							(B[0]*dBidxj[0][1] + B[1]*dBidxj[1][1] + B[2]*dBidxj[2][1])/Babs,
 							(B[0]*dBidxj[0][2] + B[1]*dBidxj[1][2] + B[2]*dBidxj[2][2])/Babs}; // derivatives of |B|
-		F[0] += y[7]*mu*dBdxi[0]; // add force on magnetic dipole moment
-		F[1] += y[7]*mu*dBdxi[1];
-		F[2] += y[7]*mu*dBdxi[2];
+		a[0] += y[7]*c.mupermass*dBdxi[0]; // add force on magnetic dipole moment
+		a[1] += y[7]*c.mupermass*dBdxi[1];
+		a[2] += y[7]*c.mupermass*dBdxi[2];
 	}
 	double v2 = y[3]*y[3] + y[4]*y[4] + y[5]*y[5];
-	value_type inversegamma = sqrt(1 - v2/(c_0*c_0)); // relativstic factor 1/gamma
-	dydx[3] = inversegamma/m/ele_e*(F[0] - (y[3]*y[3]*F[0] + y[3]*y[4]*F[1] + y[3]*y[5]*F[2])/c_0/c_0); // general relativstic equation of motion
-	dydx[4] = inversegamma/m/ele_e*(F[1] - (y[4]*y[3]*F[0] + y[4]*y[4]*F[1] + y[4]*y[5]*F[2])/c_0/c_0); // dv/dt = 1/gamma/m*(F - v * v^T * F / c^2)
-	dydx[5] = inversegamma/m/ele_e*(F[2] - (y[5]*y[3]*F[0] + y[5]*y[4]*F[1] + y[5]*y[5]*F[2])/c_0/c_0);
+	double inversegamma = sqrt(1 - v2*c.inversec2); // relativstic factor 1/gamma
+	double va = (y[3]*a[0] + y[4]*a[1] + y[5]*a[2])*c.inversec2;
+	dydx[3] = inversegamma*(a[0] - y[3]*va); // general relativstic equation of motion
+	dydx[4] = inversegamma*(a[1] - y[4]*va); // dv/dt = 1/gamma/m*(F - v * v^T * F / c^2)
+	dydx[5] = inversegamma*(a[2] - y[5]*va);
 
 	dydx[6] = inversegamma; // derivative of proper time is 1/gamma
 	dydx[7] = 0; // polarisaton does not change
 	dydx[8] = sqrt(v2); // derivative of path length is abs(velocity)
 }
 
+template struct TEquationOfMotion<true, true>;
+template struct TEquationOfMotion<true, false>;
+template struct TEquationOfMotion<false, true>;
+template struct TEquationOfMotion<false, false>;
+
 
 
 
 
-void TParticle::SpinPrecessionAxis(const double t, const dense_stepper_type &stepper, const TFieldManager &field, double &Omegax, double &Omegay, double &Omegaz) const{
+void TSpinAxisInterpolant::Build(const TParticle &p, const value_type x1, const value_type x2, const TStepper &stepper, const TFieldManager &field){
+	for (int i = 0; i < POINTS; i++){ // calculate precession axis at several points along trajectory step
+		t[i] = x1 + i*(x2 - x1)/(POINTS - 1);
+		p.SpinPrecessionAxis(t[i], stepper, field, omega[0][i], omega[1][i], omega[2][i]);
+	}
+
+	for (int j = 0; j < 3; j++){
+		// solve tridiagonal system a[i]*d[i-1] + b[i]*d[i] + c[i]*d[i+1] = r[i] for derivatives d at nodes, with parabolic termination at both ends
+		const std::array<double, POINTS> &y = omega[j];
+		std::array<double, POINTS> &d = domega[j];
+		std::array<double, POINTS> b, c;
+		b[0] = 1;
+		c[0] = 1;
+		d[0] = 2*(y[1] - y[0])/(t[1] - t[0]);
+		for (int i = 1; i < POINTS - 1; i++){
+			double a = t[i + 1] - t[i];
+			b[i] = 2*(t[i + 1] - t[i - 1]);
+			c[i] = t[i] - t[i - 1];
+			d[i] = 3*(y[i] - y[i - 1])/(t[i] - t[i - 1])*(t[i + 1] - t[i]) + 3*(y[i + 1] - y[i])/(t[i + 1] - t[i])*(t[i] - t[i - 1]);
+			double f = a/b[i - 1]; // forward elimination
+			b[i] -= f*c[i - 1];
+			d[i] -= f*d[i - 1];
+		}
+		b[POINTS - 1] = 1;
+		d[POINTS - 1] = 2*(y[POINTS - 1] - y[POINTS - 2])/(t[POINTS - 1] - t[POINTS - 2]);
+		double f = 1/b[POINTS - 2];
+		b[POINTS - 1] -= f*c[POINTS - 2];
+		d[POINTS - 1] -= f*d[POINTS - 2];
+		d[POINTS - 1] /= b[POINTS - 1]; // back substitution
+		for (int i = POINTS - 2; i >= 0; i--)
+			d[i] = (d[i] - c[i]*d[i + 1])/b[i];
+	}
+}
+
+void TSpinAxisInterpolant::Evaluate(const value_type x, double &omegax, double &omegay, double &omegaz) const{
+	int i = std::min(std::max(static_cast<int>((x - t[0])/(t[POINTS - 1] - t[0])*(POINTS - 1)), 0), POINTS - 2); // find interval containing x
+	if (i > 0 && x <= t[i])
+		i--;
+	else if (i < POINTS - 2 && x > t[i + 1])
+		i++;
+	double h = t[i + 1] - t[i];
+	double s = x - t[i];
+	double *result[3] = {&omegax, &omegay, &omegaz};
+	for (int j = 0; j < 3; j++){ // evaluate cubic Hermite polynomial with values and derivatives at both ends of interval
+		const double y0 = omega[j][i], y1 = omega[j][i + 1], d0 = domega[j][i], d1 = domega[j][i + 1];
+		const double c2 = (3*(y1 - y0) - 2*d0*h - d1*h)/(h*h);
+		const double c3 = (2*(y0 - y1) + d0*h + d1*h)/(h*h*h);
+		*result[j] = y0 + s*(d0 + s*(c2 + s*c3));
+	}
+}
+
+void TParticle::SpinPrecessionAxis(const double t, const TStepper &stepper, const TFieldManager &field, double &Omegax, double &Omegay, double &Omegaz) const{
 	double B[3], dBidxj[3][3], V, E[3];
-	state_type y(STATE_VARIABLES), dydt(STATE_VARIABLES);
+	state_type y, dydt;
 	stepper.calc_state(t, y); // calculate particle state at time t
-	field.BField(y[0], y[1], y[2], t, B, dBidxj);
+	field.BField(y[0], y[1], y[2], t, B, mu != 0 && y[7] != 0 ? dBidxj : nullptr);
 	field.EField(y[0], y[1], y[2], t, V, E);
 	EquationOfMotion(y, dydt, t, B, dBidxj, E); // calculate velocity and acceleration required for vxE effect and Thomas precession
 	SpinPrecessionAxis(t, B, E, dydt, Omegax, Omegay, Omegaz); // calculate precession axis
 }
 
 void TParticle::SpinPrecessionAxis(const double t, const double B[3], const double E[3], const state_type &dydt, double &Omegax, double &Omegay, double &Omegaz) const{
+	const double gyro = constants.gyro, inversec2 = constants.inversec2;
 	double v2 = dydt[0]*dydt[0] + dydt[1]*dydt[1] + dydt[2]*dydt[2];
-	double gamma_rel = 1./sqrt(1. - v2/c_0/c_0);
+	double gamma_rel = 1./sqrt(1. - v2*inversec2);
 	double Bdotv = B[0]*dydt[0] + B[1]*dydt[1] + B[2]*dydt[2];
 	double Bparallel[3];
 	for (int j = 0; j < 3; j++)
@@ -159,15 +300,15 @@ void TParticle::SpinPrecessionAxis(const double t, const double B[3], const doub
 
 	// spin precession axis due to relativistically distorted magnetic field, omega_B = -gyro/gamma * ( (1 - gamma)*(v.B)*v/v^2 + gamma*B - gamma*(v x E)/c^2 )
 	double OmegaB[3];
-	OmegaB[0] = -gamma/gamma_rel * ((1 - gamma_rel)*Bparallel[0] + gamma_rel*B[0] - gamma_rel*(dydt[1]*E[2] - dydt[2]*E[1])/c_0/c_0);
-	OmegaB[1] = -gamma/gamma_rel * ((1 - gamma_rel)*Bparallel[1] + gamma_rel*B[1] - gamma_rel*(dydt[2]*E[0] - dydt[0]*E[2])/c_0/c_0);
-	OmegaB[2] = -gamma/gamma_rel * ((1 - gamma_rel)*Bparallel[2] + gamma_rel*B[2] - gamma_rel*(dydt[0]*E[1] - dydt[1]*E[0])/c_0/c_0);
+	OmegaB[0] = -gyro/gamma_rel * ((1 - gamma_rel)*Bparallel[0] + gamma_rel*B[0] - gamma_rel*(dydt[1]*E[2] - dydt[2]*E[1])*inversec2);
+	OmegaB[1] = -gyro/gamma_rel * ((1 - gamma_rel)*Bparallel[1] + gamma_rel*B[1] - gamma_rel*(dydt[2]*E[0] - dydt[0]*E[2])*inversec2);
+	OmegaB[2] = -gyro/gamma_rel * ((1 - gamma_rel)*Bparallel[2] + gamma_rel*B[2] - gamma_rel*(dydt[0]*E[1] - dydt[1]*E[0])*inversec2);
 
 	// Thomas precession in lab frame, omega_T = gamma^2/(gamma + 1)/c^2*(dv/dt x v)
 	double OmegaT[3] = {0,0,0};
-	OmegaT[0] = gamma_rel*gamma_rel/(gamma_rel + 1)*(dydt[4]*dydt[2] - dydt[5]*dydt[1])/c_0/c_0;
-	OmegaT[1] = gamma_rel*gamma_rel/(gamma_rel + 1)*(dydt[5]*dydt[0] - dydt[3]*dydt[2])/c_0/c_0;
-	OmegaT[2] = gamma_rel*gamma_rel/(gamma_rel + 1)*(dydt[3]*dydt[1] - dydt[4]*dydt[0])/c_0/c_0;
+	OmegaT[0] = gamma_rel*gamma_rel/(gamma_rel + 1)*(dydt[4]*dydt[2] - dydt[5]*dydt[1])*inversec2;
+	OmegaT[1] = gamma_rel*gamma_rel/(gamma_rel + 1)*(dydt[5]*dydt[0] - dydt[3]*dydt[2])*inversec2;
+	OmegaT[2] = gamma_rel*gamma_rel/(gamma_rel + 1)*(dydt[3]*dydt[1] - dydt[4]*dydt[0])*inversec2;
 
 	// Total spin precession is sum of magnetic-field precession and Thomas precession
 	Omegax = OmegaB[0] + OmegaT[0];
@@ -176,13 +317,31 @@ void TParticle::SpinPrecessionAxis(const double t, const double B[3], const doub
 }
 
 
-void TParticle::SpinDerivs(const state_type &y, state_type &dydx, const value_type x, const dense_stepper_type &stepper, const TFieldManager *field, const std::vector<alglib::spline1dinterpolant> &omega) const{
-	double omegax, omegay, omegaz;
-	if (omega.size() == 3){ // if interpolator exists, use it
-		omegax = alglib::spline1dcalc(omega[0], x);
-		omegay = alglib::spline1dcalc(omega[1], x);
-		omegaz = alglib::spline1dcalc(omega[2], x);
+void TParticle::RFSpinPrecessionAxes(const double t, const TStepper &stepper, const TFieldManager &field, double Omega0[3], double Omegac[3], double Omegas[3]) const{
+	double B[3], dBidxj[3][3], V, E[3], B0[3], B1c[3], B1s[3];
+	const double zero[3] = {0, 0, 0};
+	state_type y, dydt;
+	stepper.calc_state(t, y);
+	field.BField(y[0], y[1], y[2], t, B, mu != 0 && y[7] != 0 ? dBidxj : nullptr);
+	field.EField(y[0], y[1], y[2], t, V, E);
+	EquationOfMotion(y, dydt, t, B, dBidxj, E);
+	field.BFieldRF(y[0], y[1], y[2], t, B0, B1c, B1s);
+	double OmegaT[3]; // precession axis is affine in B, so Thomas precession has to be subtracted from the RF contributions
+	SpinPrecessionAxis(t, zero, zero, dydt, OmegaT[0], OmegaT[1], OmegaT[2]);
+	SpinPrecessionAxis(t, B0, E, dydt, Omega0[0], Omega0[1], Omega0[2]);
+	SpinPrecessionAxis(t, B1c, zero, dydt, Omegac[0], Omegac[1], Omegac[2]);
+	SpinPrecessionAxis(t, B1s, zero, dydt, Omegas[0], Omegas[1], Omegas[2]);
+	for (int i = 0; i < 3; ++i){
+		Omegac[i] -= OmegaT[i];
+		Omegas[i] -= OmegaT[i];
 	}
+}
+
+
+void TParticle::SpinDerivs(const spin_state_type &y, spin_state_type &dydx, const value_type x, const TStepper &stepper, const TFieldManager *field, const TSpinAxisInterpolant *omega) const{
+	double omegax, omegay, omegaz;
+	if (omega) // if interpolator exists, use it
+		omega->Evaluate(x, omegax, omegay, omegaz);
 	else
 		SpinPrecessionAxis(x, stepper, *field, omegax, omegay, omegaz); // else calculate precession axis directly
 
@@ -194,33 +353,49 @@ void TParticle::SpinDerivs(const state_type &y, state_type &dydx, const value_ty
 }
 
 
-void TParticle::DoStep(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const dense_stepper_type &stepper,
-                       const solid &currentsolid, TMCGenerator &mc, const TFieldManager &field){
-    state_type y2temp = y2;
-    vector<TParticle*> secs;
-    OnStep(x1, y1, x2, y2, stepper, currentsolid, mc, ID, secs);
-    for (auto s: secs) secondaries.push_back(unique_ptr<TParticle>(s));
-    Hmax = max(GetKineticEnergy(&y2[3]) + GetPotentialEnergy(x2, y2, field, currentsolid), Hmax);
-    if (y2temp[7] != y2[7])
+void TParticle::AddSecondaries(std::vector<TParticle*> &secs){
+    for (auto s: secs){
+        s->statweight = statweight;
+        s->weights = weights;
+        s->cell = cell;
+        secondaries.push_back(unique_ptr<TParticle>(s));
+    }
+    secs.clear(); // keeps capacity, so the slot can be reused
+}
+
+TEventResult TParticle::DoStep(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const TStepper &stepper,
+                       const solid &currentsolid, TMCGenerator &mc, const TFieldManager &field, const unsigned energyinterval){
+    double polarization = y2[7];
+    TEventResult result = OnStep(x1, y1, x2, y2, stepper, currentsolid, mc, ID, newsecondaries);
+    if (!newsecondaries.empty())
+        AddSecondaries(newsecondaries);
+    if (energyinterval > 0 && Nstep % energyinterval == 0) // fields at the end of the step were just evaluated by the integrator and are taken from the field cache
+        Hmax = max(GetKineticEnergy(&y2[3]) + GetPotentialEnergy(x2, y2, field, currentsolid), Hmax);
+    if (polarization != y2[7])
         Nspinflip++;
     Nstep++;
+    return result;
 }
 
-void TParticle::DoHit(const value_type x1, const state_type &y1, value_type &x2, state_type &y2,
+TEventResult TParticle::DoHit(const value_type x1, const state_type &y1, value_type &x2, state_type &y2,
                       const double normal[3], const solid &leaving, const solid &entering, TMCGenerator &mc){
-    state_type y2temp = y2;
-    vector<TParticle*> secs;
-    OnHit(x1, y1, x2, y2, normal, leaving, entering, mc, ID, secs); // do particle specific things
-    for (auto s: secs) secondaries.push_back(unique_ptr<TParticle>(s));
-    if (y2temp[7] != y2[7])
+    double polarization = y2[7];
+    TEventResult result;
+    {
+        PROFILE(PROFILE_ONHIT);
+        result = OnHit(x1, y1, x2, y2, normal, leaving, entering, mc, ID, newsecondaries); // do particle specific things
+    }
+    if (!newsecondaries.empty())
+        AddSecondaries(newsecondaries);
+    if (polarization != y2[7])
         Nspinflip++;
     Nhit++;
+    return result;
 }
 
 void TParticle::DoDecay(const double t, const state_type &y, TMCGenerator &mc, const TGeometry &geom, const TFieldManager &field){
-    vector<TParticle*> secs;
-    Decay(t, y, mc, geom, field, secs);
-    for (auto s: secs) secondaries.push_back(unique_ptr<TParticle>(s));
+    Decay(t, y, mc, geom, field, newsecondaries);
+    AddSecondaries(newsecondaries);
 }
 
 void TParticle::DoPolarize(const double t, state_type &y, const double polarization, const bool flipspin, TMCGenerator &mc){
@@ -269,9 +444,60 @@ double TParticle::GetPotentialEnergy(const value_type t, const state_type &y, co
 	return result;
 }
 
-void TParticle::SetFinalState(const value_type& x, const state_type& y, const state_type& spin, const solid& sld) {
+void TParticle::SetFinalState(const value_type& x, const state_type& y, const spin_state_type& spin, const solid& sld) {
     tend = x;
     yend = y;
     spinend = spin;
-    solidend = sld;
+    solidend = &sld;
+    startsolids.clear(); // particle might have moved away from its starting point
+}
+
+void TParticle::WriteState(std::ostream &out) const{
+	out << std::setprecision(std::numeric_limits<long double>::max_digits10);
+	out << particlenumber << ' ' << ID << ' ' << tstart << ' ' << tend;
+	for (auto v: ystart)
+		out << ' ' << v;
+	for (auto v: yend)
+		out << ' ' << v;
+	for (auto v: spinstart)
+		out << ' ' << v;
+	for (auto v: spinend)
+		out << ' ' << v;
+	out << ' ' << solidstart->ID << ' ' << solidend->ID << ' ' << Hmax << ' ' << Nhit << ' ' << Nspinflip << ' ' << noflipprob << ' ' << Nstep << ' ' << tau;
+	out << ' ' << statweight << ' ' << weights.size();
+	for (auto w: weights)
+		out << ' ' << w;
+	out << ' ' << cost.walltime << ' ' << cost.cputime << ' ' << cost.derivs << ' ' << cost.collisionqueries << ' ' << cost.steps << ' ' << cost.stepsum << ' ' << (cost.steps > 0 ? cost.minstep : 0) // infinity could not be read back
+		<< ' ' << cost.iterations << ' ' << cost.spinsteps;
+	out << ' ' << hitlossprob << ' ' << hitflipprob << ' ' << fatesampled << ' ' << cell[0] << ' ' << cell[1] << ' ' << cell[2];
+	out << '\n';
+}
+
+void TParticle::ReadState(std::istream &in, const TGeometry &geometry){
+	int aID;
+	unsigned startID, endID;
+	in >> particlenumber >> aID >> tstart >> tend;
+	for (auto &v: ystart)
+		in >> v;
+	for (auto &v: yend)
+		in >> v;
+	for (auto &v: spinstart)
+		in >> v;
+	for (auto &v: spinend)
+		in >> v;
+	in >> startID >> endID >> Hmax >> Nhit >> Nspinflip >> noflipprob >> Nstep >> tau;
+	size_t nweights = 0;
+	in >> statweight >> nweights;
+	weights.resize(nweights);
+	for (auto &w: weights)
+		in >> w;
+	in >> cost.walltime >> cost.cputime >> cost.derivs >> cost.collisionqueries >> cost.steps >> cost.stepsum >> cost.minstep >> cost.iterations >> cost.spinsteps;
+	in >> hitlossprob >> hitflipprob >> fatesampled >> cell[0] >> cell[1] >> cell[2];
+	if (cost.steps == 0)
+		cost.minstep = std::numeric_limits<double>::infinity();
+	if (!in)
+		throw std::runtime_error("Could not read state of " + name + " from checkpoint!");
+	ID = static_cast<stopID>(aID);
+	solidstart = &geometry.GetSolid(startID);
+	solidend = &geometry.GetSolid(endID);
 }
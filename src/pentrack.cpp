@@ -0,0 +1,345 @@
+#include "pentrack.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include "tracking.h"
+#include "particle.h"
+#include "config.h"
+#include "fields.h"
+#include "geometry.h"
+#include "source.h"
+#include "mc.h"
+#include "microroughness.h"
+#include "globals.h"
+
+using namespace std;
+
+static const vector<string> PARTICLE_NAMES = {"neutron", "proton", "electron", "mercury", "xenon"};
+
+static const vector<string> FIELD_SECTIONS = {"FIELDS", "FORMULAS", "GLOBAL"}; ///< Sections read by TFieldManager
+static const vector<string> GEOMETRY_SECTIONS = {"GEOMETRY", "MATERIALS", "SOURCE", "GLOBAL"}; ///< Sections naming files read by geometry and source
+
+static const vector<string> RESULT_COLUMNS = {"particle", "tstart", "xstart", "ystart", "zstart", "vxstart", "vystart", "vzstart", "polstart",
+		"Sxstart", "Systart", "Szstart", "Hstart", "Estart", "solidstart",
+		"tend", "xend", "yend", "zend", "vxend", "vyend", "vzend", "polend", "Sxend", "Syend", "Szend", "Hend", "Eend", "solidend",
+		"stopID", "Nspinflip", "spinflipprob", "Nhit", "Nstep", "propert", "trajlength", "Hmax", "statweight"};
+
+
+TSimulation::TSimulation(const std::string &aconfigfile, const std::map<std::string, std::string> &overrides, const std::uint64_t aseed,
+		const long long ajobnumber, const std::string &aoutpath, const bool awritelogs): seed(aseed), jobnumber(ajobnumber), writelogs(awritelogs){
+	::jobnumber = jobnumber;
+	configpath = boost::filesystem::absolute(aconfigfile);
+	if (boost::filesystem::is_directory(configpath))
+		configpath /= "config.in";
+	configfile = configpath.native();
+	outpath = boost::filesystem::absolute(aoutpath);
+	quit = false;
+
+	config = ReadConfig(overrides);
+	istringstream((*config)["GLOBAL"]["simtime"]) >> simtime;
+	istringstream((*config)["GLOBAL"]["secondaries"]) >> secondaries;
+
+	if (seed == 0)
+		seed = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+
+	fieldfiles = InputFiles(FIELD_SECTIONS);
+	geometryfiles = InputFiles(GEOMETRY_SECTIONS);
+	TConfig geomconfig = *config; // geometry is loaded in the background while fields are loaded, map::operator[] inserts missing options, so it needs its own copy
+	future<unique_ptr<TGeometry> > geomloading = async(launch::async, [&geomconfig]{ return unique_ptr<TGeometry>(new TGeometry(geomconfig)); });
+	field.reset(new TFieldManager(*config));
+	geometry = geomloading.get();
+	source.reset(CreateParticleSource(*config, *geometry));
+	regionmap = TRegionMap::Create(*config, *geometry, *field);
+}
+
+
+std::unique_ptr<TConfig> TSimulation::ReadConfig(const std::map<std::string, std::string> &overrides) const{
+	unique_ptr<TConfig> conf(new TConfig(configfile));
+	conf->convert(configfile);
+	for (auto &o: overrides){
+		string::size_type dot = o.first.find('.');
+		if (dot == string::npos)
+			throw runtime_error("Option " + o.first + " has to be given as SECTION.option!");
+		(*conf)[o.first.substr(0, dot)][o.first.substr(dot + 1)] = o.second;
+	}
+
+	double MRprobtolerance = 0;
+	istringstream((*conf)["GLOBAL"]["MRprobtolerance"]) >> MRprobtolerance;
+	MR::EnableMRProbTables(MRprobtolerance);
+	vector<string> MRprobtables;
+	istringstream MRprobtablesin((*conf)["GLOBAL"]["MRprobtables"]);
+	boost::filesystem::path MRprobtablefile;
+	while (MRprobtablesin >> MRprobtablefile) // tables calculated by simtype 9, relative to the config file
+		MRprobtables.push_back(boost::filesystem::absolute(MRprobtablefile, configpath.parent_path()).native());
+	MR::ReadMRProbTables(MRprobtables);
+
+	// add default parameters from PARTICLES section to each individual particle's parameters, as the executable does
+	for (auto &option: (*conf)["PARTICLES"]){
+		for (auto &name: PARTICLE_NAMES)
+			(*conf)[name].insert(option);
+	}
+	for (auto &name: PARTICLE_NAMES){
+		try{
+			TParticleOptions options((*conf)[name]);
+		}
+		catch (std::runtime_error &e){
+			throw std::runtime_error("Invalid options for " + name + ": " + e.what());
+		}
+		if (not writelogs){
+			for (string log: {"endlog", "tracklog", "hitlog", "snapshotlog", "spinlog", "diagnosticlog"})
+				(*conf)[name][log] = "0";
+		}
+	}
+	if (not writelogs)
+		(*conf)["HISTOGRAMS"].clear();
+	return conf;
+}
+
+
+std::map<std::string, std::time_t> TSimulation::InputFiles(const std::vector<std::string> &sections) const{
+	map<string, time_t> files;
+	boost::filesystem::path configdir = boost::filesystem::path(configfile).parent_path();
+	for (auto &section: *config){
+		string name = IsSourceSection(section.first) ? "SOURCE" : section.first; // files of all sources are searched with SOURCE
+		if (find(sections.begin(), sections.end(), name) == sections.end())
+			continue;
+		for (auto &option: section.second){
+			istringstream tokens(option.second);
+			string token;
+			while (tokens >> token){ // any token naming an existing file, relative paths are relative to the config file
+				boost::system::error_code error;
+				boost::filesystem::path file = boost::filesystem::absolute(token, configdir);
+				if (boost::filesystem::is_regular_file(file, error))
+					files[file.native()] = boost::filesystem::last_write_time(file, error);
+			}
+		}
+	}
+	return files;
+}
+
+
+/**
+ * Check if sections of two configurations differ
+ *
+ * @param a First configuration
+ * @param b Second configuration
+ * @param select Returns true for names of sections to be compared
+ *
+ * @return Returns true if any selected section differs, options of GLOBAL that only affect tracking are ignored
+ */
+static bool SectionsDiffer(TConfig &a, TConfig &b, const function<bool(const string&)> &select){
+	auto selected = [&](TConfig &conf){
+		map<string, map<string, string> > sections;
+		for (auto &section: conf){
+			if (select(section.first))
+				sections.insert(section);
+		}
+		auto global = sections.find("GLOBAL");
+		if (global != sections.end()){
+			for (const char *option: {"simtime", "secondaries"})
+				global->second.erase(option);
+		}
+		return sections;
+	};
+	return selected(a) != selected(b);
+}
+
+
+std::string TSimulation::Reconfigure(const std::map<std::string, std::string> &overrides){
+	::jobnumber = jobnumber;
+	configpath = configfile;
+	unique_ptr<TConfig> oldconfig = move(config);
+	config = ReadConfig(overrides);
+	map<string, time_t> newfieldfiles = InputFiles(FIELD_SECTIONS), newgeometryfiles = InputFiles(GEOMETRY_SECTIONS);
+
+	auto isfield = [](const string &section){ return find(FIELD_SECTIONS.begin(), FIELD_SECTIONS.end(), section) != FIELD_SECTIONS.end(); };
+	auto isgeometry = [](const string &section){
+		return section == "GLOBAL" || (section != "FIELDS" && section != "FORMULAS" && not IsSourceSection(section) && section != "HISTOGRAMS"
+				&& section != "PARTICLES" && find(PARTICLE_NAMES.begin(), PARTICLE_NAMES.end(), section) == PARTICLE_NAMES.end());
+	};
+	bool reloadfields = newfieldfiles != fieldfiles || SectionsDiffer(*oldconfig, *config, isfield);
+	bool reloadgeometry = newgeometryfiles != geometryfiles || SectionsDiffer(*oldconfig, *config, isgeometry);
+	bool reloadsource = reloadgeometry || SectionsDiffer(*oldconfig, *config, IsSourceSection);
+	fieldfiles = newfieldfiles;
+	geometryfiles = newgeometryfiles;
+	istringstream((*config)["GLOBAL"]["simtime"]) >> simtime;
+	istringstream((*config)["GLOBAL"]["secondaries"]) >> secondaries;
+
+	string reloaded;
+	future<unique_ptr<TGeometry> > geomloading;
+	TConfig geomconfig = *config;
+	if (reloadgeometry){
+		geometry.reset(); // free memory of old geometry first
+		geomloading = async(launch::async, [&geomconfig]{ return unique_ptr<TGeometry>(new TGeometry(geomconfig)); });
+	}
+	if (reloadfields){
+		field.reset();
+		field.reset(new TFieldManager(*config));
+		reloaded += "fields ";
+	}
+	if (reloadgeometry){
+		geometry = geomloading.get();
+		reloaded += "geometry ";
+	}
+	if (reloadsource){
+		source.reset(CreateParticleSource(*config, *geometry));
+		sourceprepared = false;
+		reloaded += "source ";
+	}
+	if (reloadfields || reloadgeometry){ // regionmap is a GLOBAL option, so changing it reloads the geometry
+		regionmap.reset();
+		regionmap = TRegionMap::Create(*config, *geometry, *field);
+	}
+	if (not reloaded.empty())
+		reloaded.pop_back();
+	return reloaded;
+}
+
+
+TSimulation::~TSimulation() = default;
+
+
+void TSimulation::SetSource(const std::map<std::string, std::string> &options){
+	for (auto &o: options)
+		(*config)["SOURCE"][o.first] = o.second;
+	source.reset(CreateParticleSource(*config, *geometry));
+	sourceprepared = false;
+}
+
+
+/**
+ * Append final state of particle to result row
+ *
+ * @param p Particle
+ * @param geom Geometry
+ * @param field Fields
+ * @param row Returns values of TTrackResult columns
+ */
+static void AppendResult(const TParticle &p, const TGeometry &geom, const TFieldManager &field, vector<double> &row){
+	const state_type &ystart = p.GetInitialState();
+	const state_type &yend = p.GetFinalState();
+	const spin_state_type &spinstart = p.GetInitialSpin();
+	const spin_state_type &spinend = p.GetFinalSpin();
+	double tend = p.GetFinalTime();
+	row.insert(row.end(), {static_cast<double>(p.GetParticleNumber()), static_cast<double>(p.GetInitialTime()),
+			ystart[0], ystart[1], ystart[2], ystart[3], ystart[4], ystart[5], ystart[7], spinstart[0], spinstart[1], spinstart[2],
+			p.GetInitialTotalEnergy(geom, field), p.GetInitialKineticEnergy(), static_cast<double>(p.GetInitialSolid().ID),
+			tend, yend[0], yend[1], yend[2], yend[3], yend[4], yend[5], yend[7], spinend[0], spinend[1], spinend[2],
+			p.GetFinalTotalEnergy(geom, field), p.GetFinalKineticEnergy(), static_cast<double>(geom.GetSolid(tend, &yend[0]).ID),
+			static_cast<double>(p.GetStopID()), static_cast<double>(p.GetNumberOfSpinflips()), 1 - p.GetNoSpinFlipProbability(),
+			static_cast<double>(p.GetNumberOfHits()), static_cast<double>(p.GetNumberOfSteps()), yend[6], yend[8], p.GetMaxTotalEnergy(),
+			p.GetStatisticalWeight()});
+}
+
+
+TTrackResult TSimulation::Track(const long long count, const long long firstparticle, const int nthreads){
+	if (count < 0 || firstparticle < 1 || nthreads < 1)
+		throw runtime_error("Invalid particle count, first particle number, or thread count!");
+	::jobnumber = jobnumber; // another simulation in this process might have changed the job number
+
+	// results are collected per primary particle, so the order does not depend on the thread that tracked it
+	vector<vector<double> > rows(count);
+	vector<vector<string> > names(count);
+	vector<long long> threadsteps(nthreads, 0);
+	atomic<long long> next(0);
+	const long long blocksize = max(1LL, min(16LL, count/(4LL*nthreads))); // primaries are created in blocks, small enough to balance the load of the threads
+	mutex sourcemutex;
+	vector<string> errors(nthreads);
+
+	auto simulate = [&](const int ithread){
+		try{
+			TConfig threadconfig = *config; // map::operator[] inserts missing options, so each thread needs its own copy
+			TTracker t(threadconfig, nthreads > 1 ? ithread : -1);
+			t.SetRegionMap(regionmap.get());
+			struct TQueued{
+				unique_ptr<TParticle> particle;
+				TMCGenerator::result_type secondaryindex;
+				TMCGenerator mc;
+			};
+			long long first;
+			vector<TMCGenerator> blockmc;
+			vector<unique_ptr<TParticle> > block;
+			while ((first = next.fetch_add(blocksize)) < count && not quit.load()){
+				blockmc.assign(min(blocksize, count - first), TMCGenerator(seed, jobnumber));
+				for (long long j = 0; j < static_cast<long long>(blockmc.size()); ++j)
+					blockmc[j].SetSubstream(firstparticle + first + j, 0); // same substreams as the executable
+				{
+					lock_guard<mutex> lock(sourcemutex);
+					if (not sourceprepared){
+						TMCGenerator sourcemc(seed, jobnumber);
+						source->Prepare(sourcemc, *geometry, *field);
+						sourceprepared = true;
+					}
+					source->CreateParticles(firstparticle + first, blockmc, *geometry, *field, block);
+				}
+				for (long long i = first; i < first + static_cast<long long>(block.size()) && not quit.load(); ++i){
+					vector<TQueued> queue(1);
+					queue[0].secondaryindex = 0;
+					queue[0].mc = blockmc[i - first];
+					queue[0].particle = move(block[i - first]);
+					while (not queue.empty()){ // track primary particle, then its secondaries and clones depth-first
+						TQueued task = move(queue.back());
+						queue.pop_back();
+						unique_ptr<TParticle> &p = task.particle;
+						t.IntegrateParticle(p, simtime, task.mc, *geometry, *field);
+						auto push = [&](unique_ptr<TParticle> &particle, const TMCGenerator::result_type n){
+							TQueued secondary;
+							secondary.particle = move(particle);
+							secondary.secondaryindex = TMCGenerator::SecondaryIndex(task.secondaryindex, n);
+							secondary.mc = TMCGenerator(seed, jobnumber);
+							secondary.mc.SetSubstream(secondary.particle->GetParticleNumber(), secondary.secondaryindex);
+							queue.push_back(move(secondary));
+						};
+						for (auto &clone: t.TakeClones())
+							push(clone.first, clone.second);
+						if (secondaries == 1){
+							auto &secs = p->GetSecondaryParticles();
+							for (unsigned j = 0; j < secs.size(); ++j)
+								push(secs[j], j);
+						}
+						AppendResult(*p, *geometry, *field, rows[i]);
+						names[i].push_back(p->GetName());
+						threadsteps[ithread] += p->GetNumberOfSteps();
+					}
+				}
+			}
+		}
+		catch (std::exception &e){
+			errors[ithread] = e.what();
+			quit = true; // stop other threads
+		}
+	};
+
+	vector<thread> threads;
+	for (int i = 1; i < nthreads; ++i)
+		threads.emplace_back(simulate, i);
+	simulate(0);
+	for (auto &th: threads)
+		th.join();
+	for (auto &e: errors){
+		if (not e.empty()){
+			quit = false;
+			throw runtime_error(e);
+		}
+	}
+	if (quit.load())
+		throw runtime_error("Tracking was interrupted!");
+
+	TTrackResult result;
+	result.columns = RESULT_COLUMNS;
+	for (long long i = 0; i < count; ++i){
+		result.values.insert(result.values.end(), rows[i].begin(), rows[i].end());
+		result.particles.insert(result.particles.end(), names[i].begin(), names[i].end());
+	}
+	for (auto s: threadsteps)
+		result.steps += s;
+	return result;
+}
@@ -0,0 +1,533 @@
+#include "primitives.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+
+#include <boost/format.hpp>
+
+namespace{
+
+/**
+ * Solve quadratic equation a*s^2 + b*s + c = 0 and append roots in range [0, 1] to list
+ *
+ * Tangential solutions (vanishing discriminant) are not returned, since the segment does not cross the surface there.
+ *
+ * @param a Quadratic coefficient
+ * @param b Linear coefficient
+ * @param c Constant coefficient
+ * @param roots Roots are appended to this list
+ */
+void SegmentRoots(const double a, const double b, const double c, std::vector<double> &roots){
+	if (a == 0){
+		if (b != 0 && -c/b >= 0 && -c/b <= 1)
+			roots.push_back(-c/b);
+		return;
+	}
+	double disc = b*b - 4*a*c;
+	if (disc <= 0)
+		return;
+	double q = -0.5*(b + std::copysign(std::sqrt(disc), b)); // numerically stable roots, see Numerical Recipes 3rd ed., p. 227
+	for (double s: {q/a, c/q}){
+		if (s >= 0 && s <= 1)
+			roots.push_back(s);
+	}
+}
+
+/**
+ * Distance of a point to a line segment in two dimensions
+ *
+ * @param px First coordinate of point
+ * @param py Second coordinate of point
+ * @param ax First coordinate of segment start
+ * @param ay Second coordinate of segment start
+ * @param bx First coordinate of segment end
+ * @param by Second coordinate of segment end
+ *
+ * @return Returns distance
+ */
+double SegmentDistance2D(const double px, const double py, const double ax, const double ay, const double bx, const double by){
+	double dx = bx - ax, dy = by - ay;
+	double l2 = dx*dx + dy*dy;
+	double t = l2 > 0 ? std::max(0., std::min(1., ((px - ax)*dx + (py - ay)*dy)/l2)) : 0;
+	return std::hypot(px - ax - t*dx, py - ay - t*dy);
+}
+
+
+/**
+ * Recursively parse expression of an analytic solid, see TPrimitive::Parse
+ *
+ * @param expression Complete expression
+ * @param pos Position in expression at which the solid starts, returns position after its closing parenthesis
+ *
+ * @return Returns solid
+ */
+std::unique_ptr<TPrimitive> ParsePrimitive(const std::string &expression, std::size_t &pos){
+	auto error = [&expression, &pos](const std::string &message){
+		return std::runtime_error((boost::format("Could not parse analytic solid %s at position %d: %s!") % expression % pos % message).str());
+	};
+	std::size_t open = expression.find('(', pos);
+	if (open == std::string::npos)
+		throw error("expected '('");
+	std::string name = expression.substr(pos, open - pos);
+	pos = open + 1;
+
+	if (name == "union" || name == "difference"){
+		std::vector<std::unique_ptr<TPrimitive> > parts;
+		while (true){
+			parts.push_back(ParsePrimitive(expression, pos));
+			if (pos < expression.size() && expression[pos] == ','){
+				++pos;
+				continue;
+			}
+			if (pos < expression.size() && expression[pos] == ')'){
+				++pos;
+				break;
+			}
+			throw error("expected ',' or ')'");
+		}
+		if (parts.size() < 2)
+			throw error(name + " needs at least two solids");
+		return std::unique_ptr<TPrimitive>(new TCSGPrimitive(name == "union" ? TCSGPrimitive::csgunion : TCSGPrimitive::csgdifference, std::move(parts)));
+	}
+
+	std::vector<double> args;
+	while (true){
+		const char *start = expression.c_str() + pos;
+		char *end;
+		double arg = std::strtod(start, &end);
+		if (end == start)
+			throw error("expected number");
+		args.push_back(arg);
+		pos += end - start;
+		if (pos < expression.size() && expression[pos] == ','){
+			++pos;
+			continue;
+		}
+		if (pos < expression.size() && expression[pos] == ')'){
+			++pos;
+			break;
+		}
+		throw error("expected ',' or ')'");
+	}
+
+	auto checkargs = [&](const std::size_t n){
+		if (args.size() != n)
+			throw error((boost::format("%s needs %d parameters") % name % n).str());
+	};
+	if (name == "box"){
+		checkargs(6);
+		return std::unique_ptr<TPrimitive>(new TBoxPrimitive(CPoint(args[0], args[1], args[2]), CPoint(args[3], args[4], args[5])));
+	}
+	else if (name == "sphere"){
+		checkargs(4);
+		return std::unique_ptr<TPrimitive>(new TSpherePrimitive(CPoint(args[0], args[1], args[2]), args[3]));
+	}
+	else if (name == "cylinder"){
+		checkargs(7);
+		return std::unique_ptr<TPrimitive>(new TConePrimitive(CPoint(args[0], args[1], args[2]), CPoint(args[3], args[4], args[5]), args[6], args[6]));
+	}
+	else if (name == "cone"){
+		checkargs(8);
+		return std::unique_ptr<TPrimitive>(new TConePrimitive(CPoint(args[0], args[1], args[2]), CPoint(args[3], args[4], args[5]), args[6], args[7]));
+	}
+	else if (name == "plane"){
+		checkargs(6);
+		return std::unique_ptr<TPrimitive>(new THalfSpacePrimitive(CPoint(args[0], args[1], args[2]), CVector(args[3], args[4], args[5])));
+	}
+	else if (name == "revolution"){
+		if (args.size() < 12 || args.size() % 2 != 0)
+			throw error("revolution needs a point and direction of its axis and at least three corners r,h of its profile");
+		std::vector<std::pair<double, double> > corners;
+		for (std::size_t i = 6; i < args.size(); i += 2)
+			corners.push_back(std::make_pair(args[i], args[i + 1]));
+		return std::unique_ptr<TPrimitive>(new TRevolutionPrimitive(CPoint(args[0], args[1], args[2]), CVector(args[3], args[4], args[5]), corners));
+	}
+	throw error("unknown solid " + name);
+}
+
+}
+
+
+std::unique_ptr<TPrimitive> TPrimitive::Parse(const std::string &expression){
+	std::size_t pos = 0;
+	std::unique_ptr<TPrimitive> primitive = ParsePrimitive(expression, pos);
+	if (pos != expression.size())
+		throw std::runtime_error("Unexpected characters after analytic solid " + expression + "!");
+	return primitive;
+}
+
+bool TPrimitive::IsPrimitive(const std::string &description){
+	std::string name = description.substr(0, description.find('('));
+	if (name.size() == description.size())
+		return false;
+	for (const char *known: {"box", "sphere", "cylinder", "cone", "plane", "revolution", "union", "difference"}){
+		if (name == known)
+			return true;
+	}
+	return false;
+}
+
+
+TBoxPrimitive::TBoxPrimitive(const CPoint &corner1, const CPoint &corner2)
+		: min(std::min(corner1.x(), corner2.x()), std::min(corner1.y(), corner2.y()), std::min(corner1.z(), corner2.z())),
+		  max(std::max(corner1.x(), corner2.x()), std::max(corner1.y(), corner2.y()), std::max(corner1.z(), corner2.z())){
+	for (int i = 0; i < 3; ++i){
+		if (not (min[i] < max[i]))
+			throw std::runtime_error("Corners of box have to differ in every coordinate!");
+	}
+}
+
+bool TBoxPrimitive::Inside(const CPoint &p) const{
+	for (int i = 0; i < 3; ++i){
+		if (not (p[i] > min[i] && p[i] < max[i]))
+			return false;
+	}
+	return true;
+}
+
+void TBoxPrimitive::Intersect(const CSegment &segment, std::vector<TPrimitiveCrossing> &crossings) const{
+	const CPoint &p1 = segment.source();
+	CVector d = segment.to_vector();
+	for (int i = 0; i < 3; ++i){
+		if (d[i] == 0) // segment is parallel to faces
+			continue;
+		for (int side = 0; side < 2; ++side){
+			double face = side == 0 ? min[i] : max[i];
+			double s = (face - p1[i])/d[i];
+			if (not (s >= 0 && s <= 1))
+				continue;
+			CPoint p = p1 + s*d;
+			int j = (i + 1) % 3, k = (i + 2) % 3;
+			if (p[j] >= min[j] && p[j] <= max[j] && p[k] >= min[k] && p[k] <= max[k]){
+				double n[3] = {0, 0, 0};
+				n[i] = side == 0 ? -1 : 1;
+				crossings.push_back({s, CVector(n[0], n[1], n[2])});
+			}
+		}
+	}
+}
+
+double TBoxPrimitive::Distance(const CPoint &p) const{
+	double inside = std::numeric_limits<double>::infinity();
+	double outside2 = 0;
+	for (int i = 0; i < 3; ++i){
+		double below = min[i] - p[i], above = p[i] - max[i];
+		inside = std::min(inside, std::min(-below, -above));
+		double out = std::max(0., std::max(below, above));
+		outside2 += out*out;
+	}
+	return inside > 0 ? inside : std::sqrt(outside2);
+}
+
+CGAL::Bbox_3 TBoxPrimitive::BoundingBox() const{
+	return CGAL::Bbox_3(min.x(), min.y(), min.z(), max.x(), max.y(), max.z());
+}
+
+
+TSpherePrimitive::TSpherePrimitive(const CPoint &c, const double r): center(c), radius(r){
+	if (not (radius > 0))
+		throw std::runtime_error("Radius of sphere has to be positive!");
+}
+
+bool TSpherePrimitive::Inside(const CPoint &p) const{
+	return CGAL::squared_distance(p, center) < radius*radius;
+}
+
+void TSpherePrimitive::Intersect(const CSegment &segment, std::vector<TPrimitiveCrossing> &crossings) const{
+	CVector q = segment.source() - center;
+	CVector d = segment.to_vector();
+	std::vector<double> roots;
+	SegmentRoots(d*d, 2*(q*d), q*q - radius*radius, roots);
+	for (double s: roots)
+		crossings.push_back({s, (q + s*d)/radius});
+}
+
+double TSpherePrimitive::Distance(const CPoint &p) const{
+	return std::abs(std::sqrt(CGAL::squared_distance(p, center)) - radius);
+}
+
+CGAL::Bbox_3 TSpherePrimitive::BoundingBox() const{
+	return CGAL::Bbox_3(center.x() - radius, center.y() - radius, center.z() - radius, center.x() + radius, center.y() + radius, center.z() + radius);
+}
+
+
+TConePrimitive::TConePrimitive(const CPoint &c1, const CPoint &c2, const double r1, const double r2): base(c1), radius1(r1), radius2(r2){
+	length = std::sqrt(CGAL::squared_distance(c1, c2));
+	if (not (length > 0))
+		throw std::runtime_error("Faces of cylinder or cone have to be at different points!");
+	if (not (r1 >= 0 && r2 >= 0 && r1 + r2 > 0))
+		throw std::runtime_error("Radii of cylinder or cone have to be positive!");
+	axis = (c2 - c1)/length;
+	slope = (r2 - r1)/length;
+}
+
+bool TConePrimitive::Inside(const CPoint &p) const{
+	CVector w = p - base;
+	double h = w*axis;
+	if (not (h > 0 && h < length))
+		return false;
+	double r = radius1 + slope*h;
+	return w*w - h*h < r*r;
+}
+
+void TConePrimitive::Intersect(const CSegment &segment, std::vector<TPrimitiveCrossing> &crossings) const{
+	CVector w = segment.source() - base;
+	CVector d = segment.to_vector();
+	double h0 = w*axis, dh = d*axis;
+	double r0 = radius1 + slope*h0;
+
+	// lateral surface: squared distance from axis equals squared radius at height h = h0 + s*dh
+	std::vector<double> roots;
+	SegmentRoots(d*d - dh*dh*(1 + slope*slope), 2*(w*d - h0*dh - slope*dh*r0), w*w - h0*h0 - r0*r0, roots);
+	for (double s: roots){
+		double h = h0 + s*dh;
+		if (not (h >= 0 && h <= length))
+			continue;
+		CVector radial = w + s*d - h*axis;
+		double rho = std::sqrt(radial.squared_length());
+		if (rho == 0) // segment crosses tip of cone
+			continue;
+		crossings.push_back({s, (radial/rho - slope*axis)/std::sqrt(1 + slope*slope)});
+	}
+
+	// flat faces
+	if (dh == 0)
+		return;
+	for (int face = 0; face < 2; ++face){
+		double r = face == 0 ? radius1 : radius2;
+		if (r == 0)
+			continue;
+		double s = ((face == 0 ? 0 : length) - h0)/dh;
+		if (not (s >= 0 && s <= 1))
+			continue;
+		CVector radial = w + s*d - (face == 0 ? 0 : length)*axis;
+		if (radial.squared_length() <= r*r)
+			crossings.push_back({s, face == 0 ? -axis : axis});
+	}
+}
+
+double TConePrimitive::Distance(const CPoint &p) const{
+	// the cone is rotationally symmetric, so the distance equals the distance to its outline in the plane containing p and the axis
+	CVector w = p - base;
+	double h = w*axis;
+	double rho = std::sqrt(std::max(0., w*w - h*h));
+	return std::min({SegmentDistance2D(rho, h, 0, 0, radius1, 0),
+					SegmentDistance2D(rho, h, radius1, 0, radius2, length),
+					SegmentDistance2D(rho, h, radius2, length, 0, length)});
+}
+
+CGAL::Bbox_3 TConePrimitive::BoundingBox() const{
+	CGAL::Bbox_3 bbox;
+	for (int face = 0; face < 2; ++face){
+		CPoint c = base + (face == 0 ? 0 : length)*axis;
+		double r = face == 0 ? radius1 : radius2;
+		double e[3]; // extent of circular face along each axis
+		for (int i = 0; i < 3; ++i)
+			e[i] = r*std::sqrt(std::max(0., 1 - axis[i]*axis[i]));
+		CGAL::Bbox_3 facebox(c.x() - e[0], c.y() - e[1], c.z() - e[2], c.x() + e[0], c.y() + e[1], c.z() + e[2]);
+		bbox = face == 0 ? facebox : bbox + facebox;
+	}
+	return bbox;
+}
+
+
+THalfSpacePrimitive::THalfSpacePrimitive(const CPoint &p, const CVector &n): point(p){
+	double l = std::sqrt(n.squared_length());
+	if (not (l > 0))
+		throw std::runtime_error("Normal of plane must not be zero!");
+	normal = n/l;
+}
+
+bool THalfSpacePrimitive::Inside(const CPoint &p) const{
+	return (p - point)*normal < 0;
+}
+
+void THalfSpacePrimitive::Intersect(const CSegment &segment, std::vector<TPrimitiveCrossing> &crossings) const{
+	double f1 = (segment.source() - point)*normal;
+	double f2 = (segment.target() - point)*normal;
+	if (f1 == f2) // segment parallel to plane
+		return;
+	double s = f1/(f1 - f2);
+	if (s >= 0 && s <= 1)
+		crossings.push_back({s, normal});
+}
+
+double THalfSpacePrimitive::Distance(const CPoint &p) const{
+	return std::abs((p - point)*normal);
+}
+
+CGAL::Bbox_3 THalfSpacePrimitive::BoundingBox() const{
+	double inf = std::numeric_limits<double>::infinity();
+	return CGAL::Bbox_3(-inf, -inf, -inf, inf, inf, inf);
+}
+
+
+TRevolutionPrimitive::TRevolutionPrimitive(const CPoint &c, const CVector &a, const std::vector<std::pair<double, double> > &corners): base(c), profile(corners){
+	double l = std::sqrt(a.squared_length());
+	if (not (l > 0))
+		throw std::runtime_error("Axis of solid of revolution must not be zero!");
+	axis = a/l;
+	if (profile.size() < 3)
+		throw std::runtime_error("Profile of solid of revolution needs at least three corners!");
+	double area = 0, rmax = 0, hmin = std::numeric_limits<double>::infinity(), hmax = -hmin;
+	for (std::size_t i = 0; i < profile.size(); ++i){
+		const std::pair<double, double> &p1 = profile[i], &p2 = profile[(i + 1) % profile.size()];
+		if (not (p1.first >= 0))
+			throw std::runtime_error("Profile of solid of revolution must not cross its axis!");
+		area += p1.first*p2.second - p2.first*p1.second;
+		rmax = std::max(rmax, p1.first);
+		hmin = std::min(hmin, p1.second);
+		hmax = std::max(hmax, p1.second);
+	}
+	if (not (std::abs(area) > 0))
+		throw std::runtime_error("Profile of solid of revolution must enclose an area!");
+	if (area < 0)
+		std::reverse(profile.begin(), profile.end());
+
+	double e[3]; // extent of circle with largest radius along each axis
+	for (int i = 0; i < 3; ++i)
+		e[i] = rmax*std::sqrt(std::max(0., 1 - axis[i]*axis[i]));
+	CPoint c1 = base + hmin*axis, c2 = base + hmax*axis;
+	bbox = CGAL::Bbox_3(c1.x() - e[0], c1.y() - e[1], c1.z() - e[2], c1.x() + e[0], c1.y() + e[1], c1.z() + e[2])
+		 + CGAL::Bbox_3(c2.x() - e[0], c2.y() - e[1], c2.z() - e[2], c2.x() + e[0], c2.y() + e[1], c2.z() + e[2]);
+}
+
+void TRevolutionPrimitive::ProfileCoordinates(const CPoint &p, double &rho, double &h) const{
+	CVector w = p - base;
+	h = w*axis;
+	rho = std::sqrt(std::max(0., w*w - h*h));
+}
+
+bool TRevolutionPrimitive::Inside(const CPoint &p) const{
+	double rho, h;
+	ProfileCoordinates(p, rho, h);
+	bool inside = false;
+	for (std::size_t i = 0, j = profile.size() - 1; i < profile.size(); j = i++){ // count crossings of ray from (rho, h) towards larger r with profile
+		const std::pair<double, double> &p1 = profile[i], &p2 = profile[j];
+		if ((p1.second > h) != (p2.second > h) && rho < p1.first + (h - p1.second)*(p2.first - p1.first)/(p2.second - p1.second))
+			inside = not inside;
+	}
+	return inside;
+}
+
+void TRevolutionPrimitive::Intersect(const CSegment &segment, std::vector<TPrimitiveCrossing> &crossings) const{
+	CVector w = segment.source() - base;
+	CVector d = segment.to_vector();
+	double h0 = w*axis, dh = d*axis;
+	std::vector<double> roots;
+	for (std::size_t i = 0; i < profile.size(); ++i){
+		const std::pair<double, double> &p1 = profile[i], &p2 = profile[(i + 1) % profile.size()];
+		double er = p2.first - p1.first, eh = p2.second - p1.second;
+		double el = std::sqrt(er*er + eh*eh);
+		if (el == 0 || (p1.first == 0 && p2.first == 0)) // edges on the axis do not sweep a surface
+			continue;
+		double nr = eh/el, nh = -er/el; // outward normal of counter-clockwise profile in (r, h) plane
+
+		if (eh == 0){ // annulus perpendicular to axis
+			if (dh == 0)
+				continue;
+			double s = (p1.second - h0)/dh;
+			if (not (s >= 0 && s <= 1))
+				continue;
+			CVector radial = w + s*d - p1.second*axis;
+			double rho2 = radial.squared_length();
+			if (rho2 >= std::min(p1.first, p2.first)*std::min(p1.first, p2.first) && rho2 <= std::max(p1.first, p2.first)*std::max(p1.first, p2.first))
+				crossings.push_back({s, nh*axis});
+			continue;
+		}
+
+		// cone or cylinder: squared distance from axis equals squared radius r = r0 + slope*h at height h = h0 + s*dh, see TConePrimitive::Intersect
+		double slope = er/eh;
+		double r0 = p1.first + slope*(h0 - p1.second);
+		roots.clear();
+		SegmentRoots(d*d - dh*dh*(1 + slope*slope), 2*(w*d - h0*dh - slope*dh*r0), w*w - h0*h0 - r0*r0, roots);
+		for (double s: roots){
+			double h = h0 + s*dh;
+			if (not (h >= std::min(p1.second, p2.second) && h <= std::max(p1.second, p2.second)))
+				continue;
+			CVector radial = w + s*d - h*axis;
+			double rho = std::sqrt(radial.squared_length());
+			if (rho == 0) // segment crosses tip of cone
+				continue;
+			crossings.push_back({s, nr*radial/rho + nh*axis});
+		}
+	}
+}
+
+double TRevolutionPrimitive::Distance(const CPoint &p) const{
+	double rho, h;
+	ProfileCoordinates(p, rho, h);
+	double d = std::numeric_limits<double>::infinity();
+	for (std::size_t i = 0; i < profile.size(); ++i){
+		const std::pair<double, double> &p1 = profile[i], &p2 = profile[(i + 1) % profile.size()];
+		if (p1.first > 0 || p2.first > 0)
+			d = std::min(d, SegmentDistance2D(rho, h, p1.first, p1.second, p2.first, p2.second));
+	}
+	return d;
+}
+
+CGAL::Bbox_3 TRevolutionPrimitive::BoundingBox() const{
+	return bbox;
+}
+
+
+TCSGPrimitive::TCSGPrimitive(const TOperation op, std::vector<std::unique_ptr<TPrimitive> > &&p): operation(op), parts(std::move(p)){
+	if (parts.size() < 2)
+		throw std::runtime_error("Unions and differences need at least two solids!");
+	bbox = parts[0]->BoundingBox();
+	if (operation == csgunion){
+		for (auto &part: parts)
+			bbox = bbox + part->BoundingBox();
+	}
+}
+
+bool TCSGPrimitive::Inside(const CPoint &p) const{
+	if (operation == csgunion)
+		return std::any_of(parts.begin(), parts.end(), [&p](const std::unique_ptr<TPrimitive> &part){ return part->Inside(p); });
+	return parts[0]->Inside(p) && std::none_of(parts.begin() + 1, parts.end(), [&p](const std::unique_ptr<TPrimitive> &part){ return part->Inside(p); });
+}
+
+void TCSGPrimitive::Intersect(const CSegment &segment, std::vector<TPrimitiveCrossing> &crossings) const{
+	CGAL::Bbox_3 segbox = segment.bbox();
+	std::vector<TPrimitiveCrossing> partcrossings;
+	for (std::size_t i = 0; i < parts.size(); ++i){
+		if (not CGAL::do_overlap(segbox, parts[i]->BoundingBox()))
+			continue;
+		partcrossings.clear();
+		parts[i]->Intersect(segment, partcrossings);
+		for (const TPrimitiveCrossing &c: partcrossings){
+			CPoint p = segment.source() + c.s*segment.to_vector();
+			auto insideother = [this, i, &p](const std::size_t first){ // check if crossing lies inside any other part, starting from first
+				for (std::size_t j = first; j < parts.size(); ++j){
+					if (j != i && parts[j]->Inside(p))
+						return true;
+				}
+				return false;
+			};
+			if (operation == csgunion){
+				if (not insideother(0))
+					crossings.push_back(c);
+			}
+			else if (i == 0){
+				if (not insideother(1))
+					crossings.push_back(c);
+			}
+			else if (parts[0]->Inside(p) && not insideother(1))
+				crossings.push_back({c.s, -c.normal}); // surface of subtracted solid faces into it
+		}
+	}
+}
+
+double TCSGPrimitive::Distance(const CPoint &p) const{
+	double d = std::numeric_limits<double>::infinity();
+	for (auto &part: parts)
+		d = std::min(d, part->Distance(p));
+	return d;
+}
+
+CGAL::Bbox_3 TCSGPrimitive::BoundingBox() const{
+	return bbox;
+}
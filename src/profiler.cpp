@@ -0,0 +1,443 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include "globals.h"
+
+#ifdef USEPERFCOUNTERS
+#include <atomic>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+/**
+ * Number and total duration of calls
+ */
+struct TProfileCounter{
+	unsigned long long calls = 0; ///< Number of calls
+	long long ns = 0; ///< Total duration in nanoseconds
+	unsigned long long events[PROFILE_EVENTS] = {}; ///< Total number of each hardware event
+
+	/**
+	 * Add counts of another counter
+	 *
+	 * @param c Counter
+	 */
+	void Add(const TProfileCounter &c){
+		calls += c.calls;
+		ns += c.ns;
+		for (int i = 0; i < PROFILE_EVENTS; ++i)
+			events[i] += c.events[i];
+	}
+
+	/**
+	 * Return number of an event per 1000 instructions
+	 *
+	 * @param event Hardware event
+	 */
+	double PerKiloInstruction(const TProfileEvent event) const{
+		return events[PROFILE_INSTRUCTIONS] > 0 ? 1000.*events[event]/events[PROFILE_INSTRUCTIONS] : 0.;
+	}
+};
+
+/**
+ * Profile of a single particle type
+ */
+struct TParticleProfile{
+	TProfileCounter phases[PROFILE_PHASES]; ///< Counters of each tracking phase
+	vector<TProfileCounter> fields; ///< Counters of each field in TFieldManager
+	unsigned long long bisections = 0; ///< Total number of bisections in collision-point iterations
+	unsigned maxbisections = 0; ///< Largest number of bisections in a single collision-point iteration
+};
+
+/**
+ * Span of a tracking phase recorded for the trace file
+ */
+struct TTraceSpan{
+	TProfilePhase phase; ///< Tracking phase
+	long long start; ///< Start in nanoseconds since start of trace
+	long long ns; ///< Duration in nanoseconds
+};
+
+/**
+ * Profiles of all particle types tracked by a single thread
+ */
+struct TThreadProfile{
+	map<string, TParticleProfile> particles; ///< Profile of each particle type
+	TParticleProfile *current = nullptr; ///< Profile to which measurements are currently added
+	unsigned index = 0; ///< Number of thread in order of registration, used as thread ID in the trace file
+	string particlename; ///< Type of particle currently tracked
+	int particlenumber = 0; ///< Number of particle currently tracked
+	bool tracing = false; ///< True if spans of the current particle are recorded
+	vector<TTraceSpan> spans; ///< Recorded spans not yet written to the trace file
+};
+
+static mutex registrymutex; ///< Lock for registry
+static vector<shared_ptr<TThreadProfile> > registry; ///< Profiles of all threads, kept after threads have finished
+
+static const char *PHASE_NAMES[PROFILE_PHASES] = {"do_step", "derivs", "GetCollisions", "iterate_collision", "DoHit", "OnHit", "IntegrateSpin",
+		"Print", "PrintSnapshot", "PrintTrack", "PrintHit", "PrintSpin"}; ///< Names of tracking phases
+
+static const size_t TRACE_BUFFER_SPANS = 1 << 16; ///< Number of spans a thread collects before it writes them to the trace file
+
+static mutex tracemutex; ///< Lock for tracefile
+static ofstream tracefile; ///< Trace file, open while tracing
+static bool tracingenabled = false; ///< True if particles are traced, set before tracking starts
+static chrono::steady_clock::time_point tracestart; ///< Time origin of trace file
+static vector<pair<int, int> > traceranges; ///< Ranges of particle numbers to trace
+static int traceinterval = 0; ///< Trace every traceinterval-th particle (0: none)
+
+/**
+ * Return profile of the calling thread, registering it on first use
+ */
+static TThreadProfile& ThreadProfile(){
+	thread_local shared_ptr<TThreadProfile> profile;
+	if (!profile){
+		profile = make_shared<TThreadProfile>();
+		lock_guard<mutex> lock(registrymutex);
+		profile->index = registry.size();
+		registry.push_back(profile);
+	}
+	return *profile;
+}
+
+/**
+ * Return profile of the particle type currently tracked by the calling thread
+ */
+static TParticleProfile& CurrentProfile(){
+	TThreadProfile &profile = ThreadProfile();
+	if (profile.current == nullptr)
+		profile.current = &profile.particles["unknown"];
+	return *profile.current;
+}
+
+
+/**
+ * Write spans recorded by a thread to the trace file and clear them
+ *
+ * @param profile Profile of thread
+ * @param particlestart Also write a span covering the whole particle, starting at this time
+ */
+static void WriteSpans(TThreadProfile &profile, const chrono::steady_clock::time_point *particlestart = nullptr){
+	ostringstream events; // format outside of lock
+	char span[256];
+	auto print = [&](const char *name, const long long start, const long long ns){
+		snprintf(span, sizeof(span), ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":0,\"tid\":%u,\"args\":{\"particle\":%d}}",
+				name, profile.particlename.c_str(), start*1e-3, ns*1e-3, profile.index, profile.particlenumber);
+		events << span;
+	};
+	if (particlestart != nullptr){
+		chrono::steady_clock::time_point now = chrono::steady_clock::now();
+		string name = profile.particlename + " " + to_string(profile.particlenumber);
+		print(name.c_str(), chrono::duration_cast<chrono::nanoseconds>(*particlestart - tracestart).count(), chrono::duration_cast<chrono::nanoseconds>(now - *particlestart).count());
+	}
+	for (const TTraceSpan &s: profile.spans)
+		print(PHASE_NAMES[s.phase], s.start, s.ns);
+	profile.spans.clear();
+	lock_guard<mutex> lock(tracemutex);
+	tracefile << events.str();
+}
+
+void Profiler::SetParticle(const std::string &name, const int number){
+	TThreadProfile &profile = ThreadProfile();
+	profile.current = &profile.particles[name];
+	profile.particlename = name;
+	profile.particlenumber = number;
+	profile.tracing = false;
+	if (tracingenabled && number > 0){
+		profile.tracing = (traceinterval > 0 && number % traceinterval == 0) || InNumberRanges(traceranges, number);
+	}
+}
+
+void Profiler::SetRegion(const std::string &region){
+	TThreadProfile &profile = ThreadProfile();
+	profile.current = &profile.particles[region.empty() ? profile.particlename : profile.particlename + ":" + region];
+}
+
+void Profiler::FinishParticle(const std::chrono::steady_clock::time_point start){
+	TThreadProfile &profile = ThreadProfile();
+	if (profile.tracing)
+		WriteSpans(profile, &start);
+	profile.tracing = false;
+}
+
+void Profiler::Add(const TProfilePhase phase, const std::chrono::steady_clock::time_point start, const long long ns){
+	TThreadProfile &profile = ThreadProfile();
+	if (profile.current == nullptr)
+		profile.current = &profile.particles["unknown"];
+	TProfileCounter &c = profile.current->phases[phase];
+	c.calls++;
+	c.ns += ns;
+	if (profile.tracing && phase != PROFILE_DERIVS){ // derivs is called several times in each step and would only bloat the trace
+		profile.spans.push_back({phase, chrono::duration_cast<chrono::nanoseconds>(start - tracestart).count(), ns});
+		if (profile.spans.size() >= TRACE_BUFFER_SPANS)
+			WriteSpans(profile);
+	}
+}
+
+#ifdef USEPERFCOUNTERS
+static atomic<bool> eventavailable[PROFILE_EVENTS]; ///< True if an event could be opened by any thread
+
+/**
+ * Group of hardware counters of a single thread, read together with a single system call
+ */
+struct TPerfEvents{
+	int fds[PROFILE_EVENTS]; ///< File descriptor of each event, -1 if it could not be opened
+	int slots[PROFILE_EVENTS]; ///< Position of each event in the values read from the group, -1 if not available
+	int nslots = 0; ///< Number of opened events
+
+	/**
+	 * Constructor, opens and starts counters of calling thread
+	 */
+	TPerfEvents(){
+		static const pair<uint32_t, uint64_t> EVENTS[PROFILE_EVENTS] = {
+				{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+				{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+				{PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+				{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+				{PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)}};
+		for (int i = 0; i < PROFILE_EVENTS; ++i){
+			perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = EVENTS[i].first;
+			attr.config = EVENTS[i].second;
+			attr.disabled = i == 0; // group is started when all members were added
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			attr.read_format = PERF_FORMAT_GROUP;
+			fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, i == 0 ? -1 : fds[0], 0); // this thread on any CPU
+			slots[i] = fds[i] >= 0 ? nslots++ : -1;
+			if (fds[i] >= 0)
+				eventavailable[i] = true;
+			else if (i == 0){ // without a group leader no event can be counted
+				static atomic<bool> warned(false);
+				if (!warned.exchange(true))
+					cout << "Warning: Hardware performance counters cannot be opened (" << strerror(errno) << "), check /proc/sys/kernel/perf_event_paranoid\n";
+				for (int j = 1; j < PROFILE_EVENTS; ++j){
+					fds[j] = -1;
+					slots[j] = -1;
+				}
+				return;
+			}
+		}
+		ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+
+	/**
+	 * Destructor, closes counters
+	 */
+	~TPerfEvents(){
+		for (int fd: fds){
+			if (fd >= 0)
+				close(fd);
+		}
+	}
+
+	/**
+	 * Read counters
+	 *
+	 * @param counts Returns count of each event, zero if not available
+	 */
+	void Read(unsigned long long counts[PROFILE_EVENTS]){
+		uint64_t values[1 + PROFILE_EVENTS] = {}; // number of events followed by their counts
+		if (nslots > 0 && read(fds[0], values, sizeof(values)) <= 0)
+			values[0] = 0;
+		for (int i = 0; i < PROFILE_EVENTS; ++i)
+			counts[i] = slots[i] >= 0 && static_cast<uint64_t>(slots[i]) < values[0] ? values[1 + slots[i]] : 0;
+	}
+};
+#endif
+
+void Profiler::ReadEvents(unsigned long long counts[PROFILE_EVENTS]){
+#ifdef USEPERFCOUNTERS
+	thread_local TPerfEvents events;
+	events.Read(counts);
+#else
+	fill(counts, counts + PROFILE_EVENTS, 0ULL);
+#endif
+}
+
+void Profiler::AddEvents(const TProfilePhase phase, const unsigned long long counts[PROFILE_EVENTS]){
+	TProfileCounter &c = CurrentProfile().phases[phase];
+	for (int i = 0; i < PROFILE_EVENTS; ++i)
+		c.events[i] += counts[i];
+}
+
+void Profiler::AddField(const unsigned field, const long long ns){
+	vector<TProfileCounter> &fields = CurrentProfile().fields;
+	if (field >= fields.size())
+		fields.resize(field + 1);
+	fields[field].calls++;
+	fields[field].ns += ns;
+}
+
+void Profiler::AddIterationDepth(const unsigned depth){
+	TParticleProfile &p = CurrentProfile();
+	p.bisections += depth;
+	p.maxbisections = max(p.maxbisections, depth);
+}
+
+#ifdef USEPERFCOUNTERS
+/**
+ * Print hardware events per call and per instruction of each tracking phase of a particle type, and which optimizations they suggest
+ *
+ * @param profile Profile of particle type
+ */
+static void PrintEvents(const TParticleProfile &profile){
+	static const double MISS_LIMIT = 5; // LLC or branch misses per 1000 instructions above which a phase is considered memory- or branch-bound
+	static const double TLB_LIMIT = 1; // dTLB misses per 1000 instructions above which a phase is considered TLB-bound
+	static const double IPC_LIMIT = 2; // instructions per cycle above which a phase is considered compute-bound
+	if (not eventavailable[PROFILE_CYCLES] || not eventavailable[PROFILE_INSTRUCTIONS])
+		return;
+	printf("Hardware counters (user space, including nested phases; LLC, branch and dTLB misses per 1000 instructions):\n");
+	printf("%20s %14s %8s %10s %10s %10s\n", "phase", "cycles/call", "IPC", "LLC", "branch", "dTLB");
+	for (int i = 0; i < PROFILE_PHASES; ++i){
+		const TProfileCounter &c = profile.phases[i];
+		if (c.calls == 0 || c.events[PROFILE_CYCLES] == 0)
+			continue;
+		printf("%20s %14.0f %8.2f", PHASE_NAMES[i], 1.*c.events[PROFILE_CYCLES]/c.calls, 1.*c.events[PROFILE_INSTRUCTIONS]/c.events[PROFILE_CYCLES]);
+		for (TProfileEvent e: {PROFILE_LLC_MISSES, PROFILE_BRANCH_MISSES, PROFILE_DTLB_MISSES}){
+			if (eventavailable[e])
+				printf(" %10.2f", c.PerKiloInstruction(e));
+			else
+				printf(" %10s", "n/a");
+		}
+		printf("\n");
+	}
+
+	auto hint = [&](const TProfilePhase phase, const char *memory, const char *tlb, const char *branch, const char *compute){
+		const TProfileCounter &c = profile.phases[phase];
+		if (c.calls == 0 || c.events[PROFILE_CYCLES] == 0)
+			return;
+		double ipc = 1.*c.events[PROFILE_INSTRUCTIONS]/c.events[PROFILE_CYCLES];
+		if (memory && c.PerKiloInstruction(PROFILE_LLC_MISSES) > MISS_LIMIT)
+			printf("%s is memory-bound: %s\n", PHASE_NAMES[phase], memory);
+		else if (tlb && c.PerKiloInstruction(PROFILE_DTLB_MISSES) > TLB_LIMIT)
+			printf("%s is TLB-bound: %s\n", PHASE_NAMES[phase], tlb);
+		else if (branch && c.PerKiloInstruction(PROFILE_BRANCH_MISSES) > MISS_LIMIT)
+			printf("%s is branch-bound: %s\n", PHASE_NAMES[phase], branch);
+		else if (compute && ipc > IPC_LIMIT)
+			printf("%s is compute-bound: %s\n", PHASE_NAMES[phase], compute);
+		else
+			printf("%s is latency-bound (IPC %.2f with few misses), changes of data layout or vector instructions will gain little.\n", PHASE_NAMES[phase], ipc);
+	};
+	hint(PROFILE_DERIVS, "single-precision field tables (float), prefetching table cells along the trajectory (fieldprefetch 1), coarser tables (fieldstride), or a smaller bakefields box will pay off more than vector instructions.",
+			"field tables span too many pages, check that transparent huge pages are enabled in /sys/kernel/mm/transparent_hugepage/enabled.",
+			nullptr,
+			"vector instructions (-DNATIVE_ARCH=ON) or baking analytic fields into a table (bakefields) will pay off.");
+	hint(PROFILE_GETCOLLISIONS, "the geometry does not fit into the cache, the collision cache (collisioncache 1) will pay off more than vector instructions.",
+			"the geometry spans too many pages, the collision cache (collisioncache 1) will pay off.",
+			"the tree search mispredicts branches, the SIMD bounding-volume hierarchy (collisionsearch BVH) will pay off.",
+			"the SIMD bounding-volume hierarchy (collisionsearch BVH) with -DNATIVE_ARCH=ON will pay off.");
+	hint(PROFILE_INTEGRATESPIN, "field evaluations along the spin trajectory wait for memory, single-precision field tables (float) will pay off.",
+			nullptr, nullptr,
+			"interpolating fields along the step (interpolatefields) will pay off more than data layout.");
+	hint(PROFILE_PRINTTRACK, nullptr, nullptr, nullptr, "formatting numbers as text dominates the track log, binary logs (HDF5log or ROOTlog) will pay off.");
+}
+#endif
+
+void Profiler::Print(const boost::filesystem::path &file){
+#ifdef USEPROFILER
+	map<string, TParticleProfile> total;
+	{
+		lock_guard<mutex> lock(registrymutex);
+		for (auto &thread: registry){
+			for (auto &particle: thread->particles){
+				TParticleProfile &t = total[particle.first];
+				for (int i = 0; i < PROFILE_PHASES; ++i)
+					t.phases[i].Add(particle.second.phases[i]);
+				if (t.fields.size() < particle.second.fields.size())
+					t.fields.resize(particle.second.fields.size());
+				for (unsigned f = 0; f < particle.second.fields.size(); ++f)
+					t.fields[f].Add(particle.second.fields[f]);
+				t.bisections += particle.second.bisections;
+				t.maxbisections = max(t.maxbisections, particle.second.maxbisections);
+			}
+		}
+	}
+
+	ofstream out(file.string());
+	out << "particle phase calls time bisections maxbisections";
+#ifdef USEPERFCOUNTERS
+	out << " cycles instructions LLCmisses branchmisses dTLBmisses";
+#endif
+	out << '\n';
+	for (auto &particle: total){
+		printf("\nProfile of %s (time summed over all threads):\n", particle.first.c_str());
+		printf("%20s %14s %12s %12s\n", "phase", "calls", "time [s]", "mean [us]");
+		auto print = [&](const string &name, const TProfileCounter &c, const unsigned long long bisections, const unsigned maxbisections){
+			if (c.calls == 0)
+				return;
+			printf("%20s %14llu %12.3f %12.3f\n", name.c_str(), c.calls, c.ns*1e-9, c.ns*1e-3/c.calls);
+			out << particle.first << ' ' << name << ' ' << c.calls << ' ' << c.ns*1e-9 << ' ' << bisections << ' ' << maxbisections;
+#ifdef USEPERFCOUNTERS
+			for (unsigned long long e: c.events)
+				out << ' ' << e;
+#endif
+			out << '\n';
+		};
+		for (int i = 0; i < PROFILE_PHASES; ++i){
+			if (i == PROFILE_ITERATE_COLLISION)
+				print(PHASE_NAMES[i], particle.second.phases[i], particle.second.bisections, particle.second.maxbisections);
+			else
+				print(PHASE_NAMES[i], particle.second.phases[i], 0, 0);
+		}
+		for (unsigned f = 0; f < particle.second.fields.size(); ++f)
+			print("field" + to_string(f), particle.second.fields[f], 0, 0);
+		const TProfileCounter &iterations = particle.second.phases[PROFILE_ITERATE_COLLISION];
+		if (iterations.calls > 0)
+			printf("Collision-point iterations took %.2f bisections on average, %u at most.\n",
+					1.*particle.second.bisections/iterations.calls, particle.second.maxbisections);
+#ifdef USEPERFCOUNTERS
+		PrintEvents(particle.second);
+#endif
+	}
+	if (!out)
+		cout << "Warning: Could not write profile " << file << "\n";
+#endif
+}
+
+void Profiler::StartTrace(const boost::filesystem::path &file, const std::string &particles, const int interval){
+	vector<pair<int, int> > ranges = ReadNumberRanges(particles);
+	if (ranges.empty() && interval <= 0)
+		return;
+#ifdef USEPROFILER
+	traceranges = ranges;
+	traceinterval = max(interval, 0);
+	tracefile.open(file.string());
+	if (!tracefile)
+		throw runtime_error("Could not open trace file " + file.string());
+	tracefile << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"PENTrack\"}}";
+	tracestart = chrono::steady_clock::now();
+	tracingenabled = true;
+	cout << "Writing trace of selected particles to " << file << "\n";
+#else
+	cout << "Warning: Particles can only be traced if PENTrack is compiled with -DPROFILE=ON\n";
+#endif
+}
+
+void Profiler::StopTrace(){
+	if (!tracingenabled)
+		return;
+	tracingenabled = false;
+	lock_guard<mutex> lock(tracemutex);
+	tracefile << "\n]}\n";
+	tracefile.close();
+	if (!tracefile)
+		cout << "Warning: Could not write trace file\n";
+}
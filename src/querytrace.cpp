@@ -0,0 +1,112 @@
+#include "querytrace.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+
+#include "globals.h"
+
+using namespace std;
+
+static const char MAGIC[8] = {'P', 'T', 'Q', 'U', 'E', 'R', 'Y', '1'}; ///< First bytes of trace file
+static const size_t BUFFER_QUERIES = 1 << 16; ///< Number of queries a thread collects before it writes them to the trace file
+
+thread_local bool QueryTrace::recording = false;
+static thread_local vector<TQuery> buffer; ///< Queries recorded by calling thread, not yet written to the trace file
+
+static mutex filemutex; ///< Lock for tracefile
+static ofstream tracefile; ///< Trace file, open while recording
+static bool enabled = false; ///< True if particles are selected for recording, set before tracking starts
+static vector<pair<int, int> > ranges; ///< Ranges of particle numbers to record
+static int interval = 0; ///< Record every interval-th particle (0: none)
+
+/**
+ * Write queries buffered by the calling thread to the trace file and clear them
+ */
+static void WriteBuffer(){
+	string records; // serialize outside of lock
+	records.reserve(buffer.size()*(1 + 8*sizeof(double)));
+	for (const TQuery &q: buffer){
+		records.push_back(static_cast<char>(q.type));
+		double values[8] = {q.t1, q.p1[0], q.p1[1], q.p1[2], q.t2, q.p2[0], q.p2[1], q.p2[2]};
+		records.append(reinterpret_cast<const char*>(values), (q.type == TQuery::SEGMENT ? 8 : 4)*sizeof(double));
+	}
+	buffer.clear();
+	lock_guard<mutex> lock(filemutex);
+	tracefile.write(records.data(), records.size());
+}
+
+
+void QueryTrace::Start(const boost::filesystem::path &file, const std::string &particles, const int ainterval){
+	ranges = ReadNumberRanges(particles);
+	interval = max(ainterval, 0);
+	if (ranges.empty() && interval == 0)
+		return;
+	tracefile.open(file.string(), ofstream::binary);
+	if (!tracefile)
+		throw runtime_error("Could not open query trace " + file.string());
+	tracefile.write(MAGIC, sizeof(MAGIC));
+	enabled = true;
+	cout << "Writing field and geometry queries of selected particles to " << file << "\n";
+}
+
+
+void QueryTrace::Stop(){
+	if (!enabled)
+		return;
+	enabled = false;
+	lock_guard<mutex> lock(filemutex);
+	tracefile.close();
+	if (!tracefile)
+		cout << "Warning: Could not write query trace\n";
+}
+
+
+void QueryTrace::SetParticle(const int number){
+	recording = enabled && number > 0 && ((interval > 0 && number % interval == 0) || InNumberRanges(ranges, number));
+	if (recording)
+		buffer.push_back({TQuery::PARTICLE, static_cast<double>(number), {0., 0., 0.}, 0., {0., 0., 0.}});
+}
+
+
+void QueryTrace::FinishParticle(){
+	if (recording)
+		WriteBuffer();
+	recording = false;
+}
+
+
+void QueryTrace::AddQuery(const TQuery &q){
+	buffer.push_back(q);
+	if (buffer.size() >= BUFFER_QUERIES)
+		WriteBuffer();
+}
+
+
+std::vector<TQuery> QueryTrace::Read(const boost::filesystem::path &file){
+	ifstream in(file.string(), ifstream::binary);
+	char magic[sizeof(MAGIC)];
+	if (!in.read(magic, sizeof(magic)) || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+		throw runtime_error(file.string() + " is not a query trace!");
+	vector<TQuery> queries;
+	char type;
+	while (in.get(type)){
+		if (type < TQuery::PARTICLE || type > TQuery::SEGMENT)
+			throw runtime_error("Invalid query in " + file.string());
+		TQuery q = {static_cast<TQuery::TType>(type), 0., {0., 0., 0.}, 0., {0., 0., 0.}};
+		double values[8];
+		if (!in.read(reinterpret_cast<char*>(values), (q.type == TQuery::SEGMENT ? 8 : 4)*sizeof(double)))
+			throw runtime_error("Truncated query in " + file.string());
+		q.t1 = values[0];
+		copy(values + 1, values + 4, q.p1);
+		if (q.type == TQuery::SEGMENT){
+			q.t2 = values[4];
+			copy(values + 5, values + 8, q.p2);
+		}
+		queries.push_back(q);
+	}
+	return queries;
+}
@@ -0,0 +1,218 @@
+#include "regionmap.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+#include <boost/format.hpp>
+
+#include "config.h"
+#include "field_3d.h"
+#include "fields.h"
+#include "geometry.h"
+#include "globals.h"
+
+using namespace std;
+
+static const char REGIONMAP_HEADER[] = "PENTrack region map 1\n"; ///< First line of cache files
+static const size_t REGIONMAP_MAX_VOXELS = 100000000; ///< Largest number of voxels, protects against voxel sizes given in the wrong unit
+
+
+TRegionMap::TRegionMap(const std::array<double, 3> &amin, const double asize, const std::array<std::size_t, 3> &an)
+		: min(amin), voxelsize(asize), n(an), voxels(an[0]*an[1]*an[2]){
+}
+
+
+/**
+ * Collect options and input files that determine fields and geometry
+ *
+ * @param config Configuration
+ *
+ * @return Returns options of field and geometry sections and relevant GLOBAL options, plus size and modification time of every file they name
+ */
+static string RegionMapParameters(TConfig &config){
+	static const set<string> sections = {"FIELDS", "FORMULAS", "GEOMETRY", "MATERIALS", "PERIODIC"};
+	static const set<string> globaloptions = {"materials_file", "fieldstride", "bakefields", "simtype", "simtime", "mergesolids"};
+	ostringstream parameters;
+	parameters.precision(17);
+	boost::filesystem::path configdir = configpath.parent_path();
+	for (auto &section: config){
+		bool global = section.first == "GLOBAL";
+		if (not global && sections.count(section.first) == 0)
+			continue;
+		for (auto &option: section.second){
+			if (global && globaloptions.count(option.first) == 0)
+				continue;
+			parameters << section.first << ' ' << option.first << ' ' << option.second << '\n';
+			istringstream tokens(option.second);
+			string token;
+			while (tokens >> token){ // files are identified by size and modification time, hashing their contents would take as long as loading them
+				boost::system::error_code error;
+				boost::filesystem::path file = boost::filesystem::absolute(token, configdir);
+				if (boost::filesystem::is_regular_file(file, error))
+					parameters << file.native() << ' ' << boost::filesystem::file_size(file, error) << ' ' << boost::filesystem::last_write_time(file, error) << '\n';
+			}
+		}
+	}
+	return parameters.str();
+}
+
+
+std::unique_ptr<TRegionMap> TRegionMap::Create(TConfig &config, const TGeometry &geom, const TFieldManager &field){
+	double voxelsize = 0;
+	istringstream(config["GLOBAL"]["regionmap"]) >> voxelsize;
+	if (not (voxelsize > 0))
+		return nullptr;
+	unsigned nthreads = 1;
+	istringstream(config["GLOBAL"]["nthreads"]) >> nthreads;
+	boost::filesystem::path cachedir;
+	istringstream(config["GLOBAL"]["fieldcache"]) >> cachedir;
+
+	CGAL::Bbox_3 box = geom.GetBoundingBox();
+	std::array<double, 3> min = {{box.xmin(), box.ymin(), box.zmin()}}, max = {{box.xmax(), box.ymax(), box.zmax()}};
+	std::array<std::size_t, 3> n;
+	double count = 1;
+	for (int i = 0; i < 3; ++i){
+		n[i] = static_cast<std::size_t>(std::max(std::ceil((max[i] - min[i])/voxelsize), 1.));
+		count *= n[i];
+	}
+	if (count > REGIONMAP_MAX_VOXELS)
+		throw std::runtime_error((boost::format("Region map with voxel size %1% m would contain %2% voxels, increase regionmap!") % voxelsize % count).str());
+	std::unique_ptr<TRegionMap> map(new TRegionMap(min, voxelsize, n));
+
+	std::uint64_t key = TableKey(RegionMapParameters(config) + (field.IsBFieldStatic() ? "static" : "time-dependent"));
+	boost::filesystem::path cachefile;
+	if (not cachedir.empty()){
+		cachedir = boost::filesystem::absolute(cachedir, configpath.parent_path());
+		boost::filesystem::create_directories(cachedir);
+		cachefile = cachedir / (boost::format("regionmap.%1$016x.bin") % key).str();
+		if (map->Read(cachefile, key)){
+			cout << "Loaded region map from " << cachefile << '\n';
+			return map;
+		}
+	}
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	cout << "Building " << n[0] << " by " << n[1] << " by " << n[2] << " region map\n";
+	map->Build(geom, field, nthreads);
+	double farvolume = 0, adiabaticvolume = 0;
+	for (const TVoxel &v: map->voxels){
+		farvolume += v.walldistance > 0;
+		adiabaticvolume += v.Bmin > 0 && v.gradB < std::numeric_limits<float>::infinity();
+	}
+	printf("Region map built in %.1fs: %.0f%% of voxels are away from walls, fields in %.0f%% have bounded gradients\n", chrono::duration<double>(chrono::steady_clock::now() - start).count(),
+			100*farvolume/map->voxels.size(), 100*adiabaticvolume/map->voxels.size());
+	if (not cachefile.empty())
+		map->Write(cachefile, key);
+	return map;
+}
+
+
+void TRegionMap::Build(const TGeometry &geom, const TFieldManager &field, const unsigned nthreads){
+	const double halfdiagonal = 0.5*std::sqrt(3.)*voxelsize;
+	const bool staticfield = field.IsBFieldStatic();
+	const std::size_t m[3] = {n[0] + 1, n[1] + 1, n[2] + 1}; // number of voxel corners along each axis
+	vector<float> cornerB, cornergrad; // field magnitude and gradient at each voxel corner
+	if (staticfield){
+		cornerB.resize(m[0]*m[1]*m[2]);
+		cornergrad.resize(cornerB.size());
+		ParallelFor(m[0], nthreads, [&](const unsigned long begin, const unsigned long end){
+			for (std::size_t i = begin; i < end; ++i){
+				for (std::size_t j = 0; j < m[1]; ++j){
+					for (std::size_t k = 0; k < m[2]; ++k){
+						double B[3] = {0, 0, 0}, dBidxj[3][3] = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}};
+						field.BField(min[0] + i*voxelsize, min[1] + j*voxelsize, min[2] + k*voxelsize, 0, B, dBidxj);
+						double grad2 = 0;
+						for (int a = 0; a < 3; ++a){
+							for (int b = 0; b < 3; ++b)
+								grad2 += dBidxj[a][b]*dBidxj[a][b];
+						}
+						std::size_t c = (i*m[1] + j)*m[2] + k;
+						cornerB[c] = std::sqrt(B[0]*B[0] + B[1]*B[1] + B[2]*B[2]);
+						cornergrad[c] = std::sqrt(grad2);
+					}
+				}
+			}
+		});
+	}
+
+	ParallelFor(n[0], nthreads, [&](const unsigned long begin, const unsigned long end){
+		for (std::size_t i = begin; i < end; ++i){
+			for (std::size_t j = 0; j < n[1]; ++j){
+				for (std::size_t k = 0; k < n[2]; ++k){
+					TVoxel &v = voxels[(i*n[1] + j)*n[2] + k];
+					double center[3] = {min[0] + (i + 0.5)*voxelsize, min[1] + (j + 0.5)*voxelsize, min[2] + (k + 0.5)*voxelsize};
+					v.walldistance = std::max(geom.GetSafetyDistance(center) - halfdiagonal, 0.); // distance changes by at most the distance moved
+					if (not staticfield){ // bounds would depend on time
+						v.Bmin = 0;
+						v.Bmax = v.gradB = std::numeric_limits<float>::infinity();
+						continue;
+					}
+					double Bmin = std::numeric_limits<double>::infinity(), Bmax = 0, grad = 0;
+					for (int corner = 0; corner < 8; ++corner){
+						std::size_t c = ((i + (corner & 1))*m[1] + j + ((corner >> 1) & 1))*m[2] + k + (corner >> 2);
+						Bmin = std::min<double>(Bmin, cornerB[c]);
+						Bmax = std::max<double>(Bmax, cornerB[c]);
+						grad = std::max<double>(grad, cornergrad[c]);
+					}
+					grad *= 2; // gradient inside the voxel is assumed to be at most twice as large as at its corners
+					v.gradB = grad;
+					v.Bmin = std::max(Bmin - grad*halfdiagonal, 0.);
+					v.Bmax = Bmax + grad*halfdiagonal;
+				}
+			}
+		}
+	});
+}
+
+
+bool TRegionMap::Read(const boost::filesystem::path &file, const std::uint64_t key){
+	ifstream f(file.string(), ios::binary);
+	if (not f.is_open())
+		return false;
+	char header[sizeof(REGIONMAP_HEADER) - 1];
+	std::uint64_t filekey;
+	std::array<double, 3> filemin;
+	double filesize;
+	std::array<std::uint64_t, 3> filen;
+	f.read(header, sizeof(header));
+	f.read(reinterpret_cast<char*>(&filekey), sizeof(filekey));
+	f.read(reinterpret_cast<char*>(filemin.data()), sizeof(filemin));
+	f.read(reinterpret_cast<char*>(&filesize), sizeof(filesize));
+	f.read(reinterpret_cast<char*>(filen.data()), sizeof(filen));
+	if (not f || not std::equal(header, header + sizeof(header), REGIONMAP_HEADER) || filekey != key || filemin != min || filesize != voxelsize
+			|| filen[0] != n[0] || filen[1] != n[1] || filen[2] != n[2])
+		return false;
+	f.read(reinterpret_cast<char*>(voxels.data()), voxels.size()*sizeof(TVoxel));
+	return bool(f);
+}
+
+
+void TRegionMap::Write(const boost::filesystem::path &file, const std::uint64_t key) const{
+	boost::filesystem::path tmp = file;
+	tmp += boost::filesystem::unique_path(".%%%%%%%%");
+	{
+		ofstream f(tmp.string(), ios::binary);
+		std::array<std::uint64_t, 3> filen = {{n[0], n[1], n[2]}};
+		f.write(REGIONMAP_HEADER, sizeof(REGIONMAP_HEADER) - 1);
+		f.write(reinterpret_cast<const char*>(&key), sizeof(key));
+		f.write(reinterpret_cast<const char*>(min.data()), sizeof(min));
+		f.write(reinterpret_cast<const char*>(&voxelsize), sizeof(voxelsize));
+		f.write(reinterpret_cast<const char*>(filen.data()), sizeof(filen));
+		f.write(reinterpret_cast<const char*>(voxels.data()), voxels.size()*sizeof(TVoxel));
+		if (not f){
+			cout << "Could not write region map to " << file << '\n';
+			boost::system::error_code error;
+			boost::filesystem::remove(tmp, error);
+			return;
+		}
+	}
+	boost::filesystem::rename(tmp, file); // other processes never read an incomplete file
+}
@@ -0,0 +1,39 @@
+#include "replay.h"
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+using namespace std;
+
+std::vector<TRecordedTrajectory> ReadTrajectories(const std::vector<boost::filesystem::path> &files){
+	const size_t headersize = sizeof(TRAJECTORY_HEADER) - 1;
+	vector<TRecordedTrajectory> trajectories;
+	size_t nknots = 0;
+	for (auto &file: files){
+		ifstream f(file.native(), ios::binary);
+		char header[headersize];
+		if (!f.read(header, headersize) || memcmp(header, TRAJECTORY_HEADER, headersize) != 0)
+			throw runtime_error("Could not read trajectory file " + file.native());
+		string line;
+		while (getline(f, line)){
+			TRecordedTrajectory trajectory;
+			string::size_type space = line.find(' ');
+			double count;
+			if (space == string::npos || !f.read(reinterpret_cast<char*>(&count), sizeof(count)) || count < 1)
+				throw runtime_error("Trajectory file " + file.native() + " is corrupted!");
+			trajectory.name = line.substr(0, space);
+			trajectory.state = line.substr(space + 1);
+			trajectory.knots.resize(static_cast<size_t>(count));
+			if (!f.read(reinterpret_cast<char*>(trajectory.knots.data()), trajectory.knots.size()*sizeof(TTrajectoryKnot)))
+				throw runtime_error("Trajectory file " + file.native() + " is truncated!");
+			nknots += trajectory.knots.size();
+			trajectories.push_back(move(trajectory));
+		}
+	}
+	if (trajectories.empty())
+		throw runtime_error("Trajectory files contain no particles!");
+	cout << "Read " << trajectories.size() << " trajectories with " << nknots << " knots from " << files.size() << " files\n";
+	return trajectories;
+}
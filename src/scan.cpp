@@ -0,0 +1,75 @@
+#include "scan.h"
+
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#include <boost/algorithm/string.hpp>
+
+using namespace std;
+
+TParameterScan::TParameterScan(TConfig &config){
+	for (auto &section: config){
+		if (section.first != "SCAN")
+			continue;
+		for (auto &entry: section.second){
+			string::size_type dot = entry.first.find('.');
+			if (dot == string::npos || dot == 0 || dot + 1 == entry.first.size())
+				throw runtime_error("Could not read SCAN entry " + entry.first + ", use SECTION.variable value1 | value2 | ...!");
+			string sectionname = entry.first.substr(0, dot);
+			if (sectionname == "GLOBAL" || sectionname == "GEOMETRY" || sectionname == "SCAN")
+				throw runtime_error("Options in section " + sectionname + " cannot be scanned!");
+			config[sectionname]; // throws if section does not exist
+
+			vector<string> entryvalues;
+			boost::split(entryvalues, entry.second, boost::is_any_of("|"));
+			for (auto &v: entryvalues)
+				boost::trim(v);
+			if (entryvalues.empty() || (entryvalues.size() == 1 && entryvalues[0].empty()))
+				throw runtime_error("SCAN entry " + entry.first + " contains no values!");
+			sections.push_back(sectionname);
+			variables.push_back(entry.first.substr(dot + 1));
+			values.push_back(entryvalues);
+		}
+	}
+}
+
+unsigned long TParameterScan::size() const{
+	if (values.empty())
+		return 0;
+	unsigned long n = 1;
+	for (auto &v: values)
+		n *= v.size();
+	return n;
+}
+
+std::vector<std::string> TParameterScan::Values(const unsigned long point) const{
+	vector<string> pointvalues(values.size());
+	unsigned long rest = point;
+	for (int i = values.size() - 1; i >= 0; --i){ // last variable varies fastest
+		pointvalues[i] = values[i][rest % values[i].size()];
+		rest /= values[i].size();
+	}
+	return pointvalues;
+}
+
+TConfig TParameterScan::Point(TConfig config, const unsigned long point) const{
+	vector<string> pointvalues = Values(point);
+	for (unsigned i = 0; i < pointvalues.size(); ++i){
+		if (sections[i] == "PARTICLES"){ // defaults were already copied to each particle type
+			for (string particlename: {"neutron", "proton", "electron", "mercury", "xenon"})
+				config[particlename][variables[i]] = pointvalues[i];
+		}
+		config[sections[i]][variables[i]] = pointvalues[i];
+	}
+	return config;
+}
+
+void TParameterScan::Print(std::ostream &str) const{
+	str << "point variable value\n";
+	for (unsigned long point = 0; point < size(); ++point){
+		vector<string> pointvalues = Values(point);
+		for (unsigned i = 0; i < pointvalues.size(); ++i)
+			str << point << ' ' << sections[i] << '.' << variables[i] << ' ' << pointvalues[i] << '\n';
+	}
+}
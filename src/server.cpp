@@ -0,0 +1,280 @@
+/**
+ * \file
+ * Server keeping fields and geometry of a TSimulation loaded, built with cmake -DBUILD_SERVER=ON.
+ *
+ * Usage: PENTrack_server location/of/config.in path/of/socket [nthreads [jobnumber [seed]]]
+ *
+ * Clients connect to the Unix socket and send requests as text lines, e.g. with socat - UNIX-CONNECT:path/of/socket:
+ *
+ *     set SOURCE.Emax 200e-9      option replacing the one in the configuration, may be repeated
+ *     count 1000                  number of primary particles (default: 1)
+ *     first 1                     number of first particle (default: 1)
+ *     threads 8                   number of threads tracking particles (default: nthreads given on the command line)
+ *     output results.out          write the table to this file instead of sending it back
+ *     track                       run the request
+ *
+ * Before tracking, the configuration file is read again and the simulation reloads only the parts whose options or input files changed.
+ * The server answers with a line "reloaded <parts>", followed by the column names and one row per particle (unless output was given),
+ * and a final line "done <rows> <steps> <seconds>", or with a line "error <message>". The options of a request are reset after each track.
+ * "quit" closes the connection, "shutdown" stops the server. Connections are served one after another.
+ */
+
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "pentrack.h"
+
+using namespace std;
+
+static volatile sig_atomic_t stopserver = 0; ///< set by signal handler to stop accepting connections
+
+/**
+ * Signal handler, stops server after the current request
+ */
+static void StopServer(int){
+	stopserver = 1;
+}
+
+
+/**
+ * Thrown when the client closed the connection before the answer was written
+ */
+struct TDisconnected: public std::runtime_error{
+	TDisconnected(): std::runtime_error("Client closed connection"){ }
+};
+
+
+/**
+ * Connection to a client, reading lines and writing answers
+ */
+class TConnection{
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param afd Socket of connection, closed by destructor
+	 */
+	explicit TConnection(const int afd): fd(afd){ }
+
+	~TConnection(){ close(fd); }
+
+	/**
+	 * Read next line
+	 *
+	 * @param line Returns line without line break
+	 *
+	 * @return Returns false if the client closed the connection
+	 */
+	bool ReadLine(string &line){
+		string::size_type end;
+		while ((end = input.find('\n')) == string::npos){
+			char buffer[4096];
+			ssize_t n = read(fd, buffer, sizeof(buffer));
+			if (n < 0 && errno == EINTR && not stopserver)
+				continue;
+			if (n <= 0)
+				return false;
+			input.append(buffer, n);
+		}
+		line = input.substr(0, end);
+		input.erase(0, end + 1);
+		if (not line.empty() && line.back() == '\r')
+			line.pop_back();
+		return true;
+	}
+
+	/**
+	 * Write text to client
+	 *
+	 * @param text Text to write
+	 */
+	void Write(const string &text){
+		const char *p = text.data();
+		size_t left = text.size();
+		while (left > 0){
+			ssize_t n = write(fd, p, left);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				throw TDisconnected();
+			p += n;
+			left -= n;
+		}
+	}
+
+private:
+	int fd; ///< Socket
+	string input; ///< Received text not yet returned by ReadLine
+};
+
+
+/**
+ * Format result table, one line per particle starting with its name
+ *
+ * @param result Result of tracking
+ * @param out Stream to write to
+ */
+static void WriteResult(const TTrackResult &result, ostream &out){
+	out.precision(10);
+	out << "name";
+	for (auto &column: result.columns)
+		out << ' ' << column;
+	out << '\n';
+	for (size_t i = 0; i < result.size(); ++i){
+		out << result.particles[i];
+		for (size_t j = 0; j < result.columns.size(); ++j)
+			out << ' ' << result.values[i*result.columns.size() + j];
+		out << '\n';
+	}
+}
+
+
+int main(int argc, char **argv){
+	if (argc < 3 || argc > 6){
+		cout << "Usage:\nPENTrack_server location/of/config.in path/of/socket [nthreads [jobnumber [seed]]]" << endl;
+		return argc > 1 && strcmp(argv[1], "-h") == 0 ? 0 : 1;
+	}
+	string configfile = argv[1], socketpath = argv[2];
+	int defaultthreads = argc > 3 ? stoi(argv[3]) : 1;
+	long long jobnumber = argc > 4 ? stoll(argv[4]) : 0;
+	uint64_t seed = argc > 5 ? stoull(argv[5]) : 0;
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = StopServer; // no SA_RESTART, so accept returns when the server is stopped
+	sigaction(SIGINT, &action, nullptr);
+	sigaction(SIGTERM, &action, nullptr);
+	signal(SIGPIPE, SIG_IGN); // clients closing their connection early are reported by write
+
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (socketpath.size() >= sizeof(address.sun_path)){
+		cerr << "Socket path " << socketpath << " is too long!\n";
+		return 1;
+	}
+	strncpy(address.sun_path, socketpath.c_str(), sizeof(address.sun_path) - 1);
+	int server = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(socketpath.c_str()); // remove socket left over by a server that was killed
+	if (server < 0 || bind(server, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(server, 16) < 0){
+		cerr << "Could not listen on " << socketpath << ": " << strerror(errno) << '\n';
+		return 1;
+	}
+
+	cout << "Loading " << configfile << "...\n";
+	unique_ptr<TSimulation> sim(new TSimulation(configfile, {}, seed, jobnumber, "out/", false));
+	seed = sim->GetSeed();
+	cout << "Random Seed: " << seed << "\nListening on " << socketpath << '\n';
+
+	while (not stopserver){
+		int client = accept(server, nullptr, nullptr);
+		if (client < 0)
+			continue; // interrupted by signal
+		TConnection connection(client);
+		map<string, string> overrides;
+		long long count = 1, first = 1;
+		int nthreads = defaultthreads;
+		string output, line;
+		try{
+			while (not stopserver && connection.ReadLine(line)){
+				istringstream request(line);
+				string command;
+				request >> command;
+				try{
+					if (command.empty())
+						continue;
+					else if (command == "set"){
+						string option, value;
+						request >> option;
+						getline(request >> ws, value);
+						if (option.empty())
+							throw runtime_error("set needs SECTION.option and value");
+						overrides[option] = value;
+					}
+					else if (command == "count" || command == "first" || command == "threads"){
+						long long n;
+						if (not (request >> n))
+							throw runtime_error(command + " needs a number");
+						if (command == "count")
+							count = n;
+						else if (command == "first")
+							first = n;
+						else
+							nthreads = static_cast<int>(n);
+					}
+					else if (command == "output")
+						getline(request >> ws, output);
+					else if (command == "track"){
+						chrono::steady_clock::time_point start = chrono::steady_clock::now();
+						if (not sim) // a failed reload left no usable simulation
+							sim.reset(new TSimulation(configfile, overrides, seed, jobnumber, "out/", false));
+						string reloaded;
+						try{
+							reloaded = sim->Reconfigure(overrides);
+						}
+						catch (...){
+							sim.reset();
+							throw;
+						}
+						cout << "Tracking " << count << " particles" << (reloaded.empty() ? "" : " after reloading " + reloaded) << '\n';
+						connection.Write("reloaded " + (reloaded.empty() ? string("-") : reloaded) + '\n');
+						TTrackResult result = sim->Track(count, first, nthreads);
+						if (output.empty()){
+							ostringstream table;
+							WriteResult(result, table);
+							connection.Write(table.str());
+						}
+						else{
+							ofstream file(output);
+							WriteResult(result, file);
+							if (not file)
+								throw runtime_error("Could not write " + output);
+						}
+						ostringstream done;
+						done << "done " << result.size() << ' ' << result.steps << ' ' << chrono::duration<double>(chrono::steady_clock::now() - start).count() << '\n';
+						connection.Write(done.str());
+						overrides.clear();
+						count = first = 1;
+						nthreads = defaultthreads;
+						output.clear();
+					}
+					else if (command == "quit")
+						break;
+					else if (command == "shutdown"){
+						stopserver = 1;
+						break;
+					}
+					else
+						throw runtime_error("Unknown command " + command);
+				}
+				catch (TDisconnected&){
+					throw;
+				}
+				catch (std::exception &e){
+					connection.Write("error " + string(e.what()) + '\n');
+				}
+			}
+		}
+		catch (std::exception &e){
+			cout << e.what() << '\n';
+		}
+	}
+	close(server);
+	unlink(socketpath.c_str());
+	cout << "Server stopped\n";
+	return 0;
+}
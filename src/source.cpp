@@ -6,6 +6,11 @@
 
 #include "source.h"
 
+#include <fstream>
+#include <mutex>
+#include <algorithm>
+#include <cstring>
+
 #include <boost/format.hpp>
 
 #include "neutron.h"
@@ -15,13 +20,17 @@
 #include "xenon.h"
 #include "geometry.h"
 #include "globals.h"
+#include "field_3d.h"
 
 using namespace std;
 
-TParticleSource::TParticleSource(std::map<std::string, std::string> &sourceconf): fActiveTime(0), polarization(0), ParticleCounter(0){
+TParticleSource::TParticleSource(std::map<std::string, std::string> &sourceconf): fActiveTime(0), polarization(0), fQuasiRandomDimensions(0), ParticleCounter(0){
 	istringstream(sourceconf["particle"]) >> fParticleName;
 	istringstream(sourceconf["ActiveTime"]) >> fActiveTime;
 	istringstream(sourceconf["polarization"]) >> polarization;
+	istringstream(sourceconf["quasirandom"]) >> fQuasiRandomDimensions;
+	if (fQuasiRandomDimensions > TScrambledHalton::MAX_DIMENSIONS)
+		throw runtime_error("Source option quasirandom can be at most " + to_string(TScrambledHalton::MAX_DIMENSIONS) + "!");
 
 	double rmin, rmax;
 	istringstream(sourceconf["Emin"]) >> rmin;
@@ -39,33 +48,71 @@ TParticleSource::TParticleSource(std::map<std::string, std::string> &sourceconf)
 
 
 TParticle* TParticleSource::CreateParticle(double t, double x, double y, double z, double E, double phi, double theta, double polarisation,
-		TMCGenerator &mc, const TGeometry &geometry, const TFieldManager &field){
-	TParticle *p;
-	if (fParticleName == NAME_NEUTRON)
-		p = new TNeutron(++ParticleCounter, t, x, y, z, E, phi, theta, polarisation, mc, geometry, field);
-	else if (fParticleName == NAME_PROTON)
-		p = new TProton(++ParticleCounter, t, x, y, z, E, phi, theta, polarisation, mc, geometry, field);
-	else if (fParticleName == NAME_ELECTRON)
-		p = new TElectron(++ParticleCounter, t, x, y, z, E, phi, theta, polarisation, mc, geometry, field);
-	else if (fParticleName == NAME_MERCURY)
-		p = new TMercury(++ParticleCounter, t, x, y, z, E, phi, theta, polarisation, mc, geometry, field);
-	else if (fParticleName == NAME_XENON) 
-		p = new TXenon(++ParticleCounter, t, x, y, z, E, phi, theta, polarisation, mc, geometry, field);
-	else{
-		cout << "Could not create particle " << fParticleName << '\n';
-		exit(-1);
+		TMCGenerator &mc, const TGeometry &geometry, const TFieldManager &field, const solid *startsolid){
+	return ::CreateParticle(fParticleName, ++ParticleCounter, t, x, y, z, E, phi, theta, polarisation, mc, geometry, field, startsolid);
+}
+
+
+void TParticleSource::CreateParticles(const long long firstnumber, std::vector<TMCGenerator> &mc, TGeometry &geometry, const TFieldManager &field,
+		std::vector<std::unique_ptr<TParticle> > &particles){
+	particles.clear();
+	for (std::size_t i = 0; i < mc.size(); ++i){
+		ParticleCounter = firstnumber + i - 1; // the source numbers the next particle
+		StartQuasiRandom(mc[i], firstnumber + i);
+		particles.emplace_back(CreateParticle(mc[i], geometry, field));
+		mc[i].StopQuasiRandom();
 	}
-	return p;
 }
 
 
+void TParticleSource::StartQuasiRandom(TMCGenerator &mc, const long long number){
+	if (fQuasiRandomDimensions == 0)
+		return;
+	if (not quasirandom)
+		quasirandom.reset(new TScrambledHalton(fQuasiRandomDimensions, mc));
+	mc.StartQuasiRandom(*quasirandom, number);
+}
+
+
+const TParticle& TParticleSource::GetProbe(TMCGenerator &mc, const TGeometry &geometry, const TFieldManager &field){
+	if (not probe){
+		probe.reset(CreateParticle(0, 0, 0, 0, 0, 0, 0, polarization, mc, geometry, field)); // particle type determines potential energy, its state is not used
+		ParticleCounter--;
+	}
+	return *probe;
+}
+
+
+double TParticleSource::GetPotentialEnergy(const double t, const double x, const double y, const double z, const double polarisation,
+		const TGeometry &geometry, const TFieldManager &field, const solid *&sld) const{
+	state_type ystate;
+	ystate.fill(0);
+	ystate[0] = x;
+	ystate[1] = y;
+	ystate[2] = z;
+	ystate[7] = polarisation;
+	sld = &geometry.GetSolid(t, &ystate[0]);
+	return probe->GetPotentialEnergy(t, ystate, field, *sld);
+}
+
 TParticle* TSurfaceSource::CreateParticle(TMCGenerator &mc, TGeometry &geometry, const TFieldManager &field){
+	if (triangles.empty()){ // collect triangles intersecting the source volume when first particle is created
+		for (const TMeshTriangle &t: geometry.mesh->GetTriangles(GetSourceVolumeBoundingBox()))
+			triangles.push_back({t, TriangleInSourceVolume(t.vertices)});
+		if (triangles.empty())
+			throw std::runtime_error("Error: no surfaces found in source volume!");
+		vector<double> areas;
+		transform(triangles.begin(), triangles.end(), back_inserter(areas), [](const TSourceTriangle &t){ return t.triangle.area; });
+		triangle_sampler = std::alias_distribution<std::size_t>(areas.begin(), areas.end());
+	}
+
     CPoint p;
-    CVector nv;
-    unsigned ID;
+    const TSourceTriangle *t;
     do{
-        geometry.mesh.RandomPointOnSurface(p, nv, ID, mc, GetSourceVolumeBoundingBox());
-    } while(!InSourceVolume(p[0], p[1], p[2]));
+        t = &triangles[triangle_sampler(mc)];
+        p = TTriangleMesh::RandomPointOnTriangle(t->triangle.vertices, mc);
+    } while(!t->inside && !InSourceVolume(p[0], p[1], p[2])); // only points on triangles crossing the boundary of the source volume need to be checked
+    const CVector &nv = t->triangle.normal;
 	p = p + nv*REFLECT_TOLERANCE; // move point slightly away from surface
 
 	double Ekin = spectrum(mc);
@@ -87,38 +134,265 @@ TParticle* TSurfaceSource::CreateParticle(TMCGenerator &mc, TGeometry &geometry,
 	theta = acos(v[2]);
 
 	std::uniform_real_distribution<double> timedist(0., fActiveTime);
-	return TParticleSource::CreateParticle(timedist(mc), p[0], p[1], p[2], Ekin, phi, theta, polarization, mc, geometry, field);
+	double tstart = timedist(mc);
+	// the point lies in front of the triangle, outside of its solid, so its mesh does not have to be tested by casting rays exactly at the surface
+	double x[3] = {p[0], p[1], p[2]};
+	vector<pair<const solid*, bool> > solids = geometry.GetSolids(tstart, x, t->triangle.ID);
+	const solid *startsolid = solids.front().first;
+	for (auto &s: solids){
+		if (!s.second && s.first->ID > startsolid->ID) // solid with highest priority that is not ignored, as in TGeometry::GetSolid
+			startsolid = s.first;
+	}
+	TParticle *particle = TParticleSource::CreateParticle(tstart, p[0], p[1], p[2], Ekin, phi, theta, polarization, mc, geometry, field, startsolid);
+	particle->SetStartSolids(solids);
+	return particle;
+}
+
+
+double TVolumeSource::MinimalPotentialEnergy(const double t, const double x, const double y, const double z, const TGeometry &geometry, const TFieldManager &field) const{
+	double V = numeric_limits<double>::infinity();
+	const solid *sld;
+	for (double pol: {-1., 1.}){
+		if (pol*polarization == -1) // skip polarisation that the source never creates
+			continue;
+		V = min(V, GetPotentialEnergy(t, x, y, z, pol, geometry, field, sld));
+	}
+	return V;
 }
 
 
 void TVolumeSource::FindPotentialMinimum(TMCGenerator &mc, const TGeometry &geometry, const TFieldManager &field){
+	if (not MinPotCacheFile.empty() && boost::filesystem::exists(MinPotCacheFile)){
+		std::uint64_t key;
+		double V;
+		ifstream f(MinPotCacheFile.string());
+		if (f >> hex >> key >> dec >> V && key == MinPotCacheKey){
+			MinPot = V;
+			cout << "Loaded minimal potential = " << MinPot << "eV from " << MinPotCacheFile << "\n";
+			return;
+		}
+		cout << "Warning: Could not load " << MinPotCacheFile << ", sampling phase space instead\n";
+	}
+
+	GetProbe(mc, geometry, field);
+	MinPot = SamplePotentialMinimum(mc, geometry, field);
+	cout << " minimal potential = " << MinPot << "eV\n";
+
+	if (not MinPotCacheFile.empty()){
+		boost::filesystem::path tmpfile = MinPotCacheFile.string() + boost::filesystem::unique_path(".%%%%%%%%").string();
+		ofstream f(tmpfile.string());
+		f << hex << MinPotCacheKey << dec << " " << boost::format("%1$.17g") % MinPot << "\n";
+		f.close();
+		boost::system::error_code ec;
+		if (f)
+			boost::filesystem::rename(tmpfile, MinPotCacheFile, ec); // rename is atomic, so simultaneous jobs never read an incomplete file
+		if (!f || ec){
+			cout << "Warning: Could not write " << MinPotCacheFile << "\n";
+			boost::filesystem::remove(tmpfile, ec);
+		}
+	}
+}
+
+
+double TVolumeSource::SamplePotentialMinimum(TMCGenerator &mc, const TGeometry &geometry, const TFieldManager &field) const{
+	const int N = 100000; // number of random samples
+	const int Nchunks = 100; // samples are split into chunks with their own random-number streams, so the result does not depend on the number of threads
+	const int Nbest = 10; // number of lowest samples that are refined by local search
+
+	struct TSample{
+		double V, t, x, y, z; ///< potential energy at time t and position x, y, z
+		bool operator< (const TSample &s) const { return V < s.V; }
+	};
+
+	vector<TMCGenerator::result_type> seeds(Nchunks);
+	for (auto &seed: seeds)
+		seed = mc();
+
 	cout << "Sampling phase space ";
-	const int N = 100000;
 	progress_display progress(N);
-	for (int i = 0; i < N; i++){
-	    ++progress;
-		std::uniform_real_distribution<double> timedist(0, fActiveTime);
-		double t = timedist(mc);
-		double x, y, z;
-		RandomPointInSourceVolume(x, y, z, mc); // dice point in source volume
-		TParticle *p = TParticleSource::CreateParticle(t, x, y, z, 0, 0, 0, polarization, mc, geometry, field); // create dummy particle with Ekin = 0
-		double V = p->GetInitialTotalEnergy(geometry, field); // potential at particle position equals its total energy
-		if (V < MinPot)
-			MinPot = V; // remember minimal potential
-		delete p;
-		ParticleCounter--;
+	std::mutex progressmutex;
+	vector<vector<TSample> > chunkbest(Nchunks);
+	vector<array<double, 6> > chunkbounds(Nchunks); // bounding box of samples in each chunk
+	ParallelFor(Nchunks, fNThreads, [&](const unsigned long begin, const unsigned long end){
+		for (unsigned long chunk = begin; chunk < end; ++chunk){
+			TMCGenerator chunkmc(seeds[chunk]);
+			std::uniform_real_distribution<double> timedist(0, fActiveTime);
+			vector<TSample> &best = chunkbest[chunk];
+			array<double, 6> &bounds = chunkbounds[chunk];
+			bounds = {numeric_limits<double>::infinity(), -numeric_limits<double>::infinity(), numeric_limits<double>::infinity(),
+					-numeric_limits<double>::infinity(), numeric_limits<double>::infinity(), -numeric_limits<double>::infinity()};
+			for (int i = 0; i < N/Nchunks; ++i){
+				TSample s;
+				s.t = timedist(chunkmc);
+				RandomPointInSourceVolume(s.x, s.y, s.z, chunkmc); // dice point in source volume
+				s.V = MinimalPotentialEnergy(s.t, s.x, s.y, s.z, geometry, field);
+				best.push_back(s);
+				if (best.size() >= 2*Nbest){ // only keep lowest samples
+					nth_element(best.begin(), best.begin() + Nbest, best.end());
+					best.resize(Nbest);
+				}
+				double pos[3] = {s.x, s.y, s.z};
+				for (int j = 0; j < 3; ++j){
+					bounds[2*j] = min(bounds[2*j], pos[j]);
+					bounds[2*j + 1] = max(bounds[2*j + 1], pos[j]);
+				}
+			}
+			lock_guard<mutex> lock(progressmutex);
+			progress += N/Nchunks;
+		}
+	});
+
+	vector<TSample> best;
+	array<double, 6> bounds = chunkbounds[0];
+	for (int chunk = 0; chunk < Nchunks; ++chunk){
+		best.insert(best.end(), chunkbest[chunk].begin(), chunkbest[chunk].end());
+		for (int j = 0; j < 3; ++j){
+			bounds[2*j] = min(bounds[2*j], chunkbounds[chunk][2*j]);
+			bounds[2*j + 1] = max(bounds[2*j + 1], chunkbounds[chunk][2*j + 1]);
+		}
+	}
+	double extent = max(max(bounds[1] - bounds[0], bounds[3] - bounds[2]), bounds[5] - bounds[4]); // size of source volume
+	sort(best.begin(), best.end());
+	best.resize(min<size_t>(best.size(), Nbest));
+
+	// refine lowest samples with compass search: try steps along each axis, halve step size if none of them lowers the potential
+	ParallelFor(best.size(), fNThreads, [&](const unsigned long begin, const unsigned long end){
+		for (unsigned long i = begin; i < end; ++i){
+			TSample &s = best[i];
+			double step = extent/cbrt(N); // start with typical distance between samples
+			const double minstep = 1e-4*step;
+			while (step > minstep){
+				bool improved = false;
+				for (int j = 0; j < 6; ++j){
+					double pos[3] = {s.x, s.y, s.z};
+					pos[j/2] += j % 2 == 0 ? step : -step;
+					if (not InSourceVolume(pos[0], pos[1], pos[2]))
+						continue;
+					double V = MinimalPotentialEnergy(s.t, pos[0], pos[1], pos[2], geometry, field);
+					if (V < s.V){
+						s.V = V;
+						s.x = pos[0];
+						s.y = pos[1];
+						s.z = pos[2];
+						improved = true;
+					}
+				}
+				if (not improved)
+					step *= 0.5;
+			}
+		}
+	});
+	return best.empty() ? numeric_limits<double>::infinity() : min_element(best.begin(), best.end())->V;
+}
+
+void TVolumeSource::BuildPotentialGrid(TMCGenerator &mc, const TGeometry &geometry, const TFieldManager &field){
+	const int N = 20000; // number of random samples
+	const int Nchunks = 100; // samples are split into chunks with their own random-number streams, so the result does not depend on the number of threads
+	const int Ncells = 16; // number of cells along longest axis of source volume
+
+	vector<TMCGenerator::result_type> seeds(Nchunks);
+	for (auto &seed: seeds)
+		seed = mc();
+
+	GetProbe(mc, geometry, field);
+	cout << "Bounding potential in source volume ";
+	progress_display progress(N);
+	std::mutex progressmutex;
+	vector<vector<array<double, 4> > > chunksamples(Nchunks); // position and potential energy of each sample
+	ParallelFor(Nchunks, fNThreads, [&](const unsigned long begin, const unsigned long end){
+		for (unsigned long chunk = begin; chunk < end; ++chunk){
+			TMCGenerator chunkmc(seeds[chunk]);
+			std::uniform_real_distribution<double> timedist(0, fActiveTime);
+			for (int i = 0; i < N/Nchunks; ++i){
+				double t = timedist(chunkmc);
+				array<double, 4> s;
+				RandomPointInSourceVolume(s[0], s[1], s[2], chunkmc);
+				s[3] = MinimalPotentialEnergy(t, s[0], s[1], s[2], geometry, field);
+				chunksamples[chunk].push_back(s);
+			}
+			lock_guard<mutex> lock(progressmutex);
+			progress += N/Nchunks;
+		}
+	});
+
+	array<double, 3> lower, upper;
+	lower.fill(numeric_limits<double>::infinity());
+	upper.fill(-numeric_limits<double>::infinity());
+	for (const auto &samples: chunksamples){
+		for (const auto &s: samples){
+			for (int j = 0; j < 3; ++j){
+				lower[j] = min(lower[j], s[j]);
+				upper[j] = max(upper[j], s[j]);
+			}
+		}
+	}
+	double extent = max(max(upper[0] - lower[0], upper[1] - lower[1]), upper[2] - lower[2]);
+	for (int j = 0; j < 3; ++j){
+		PotGridSize[j] = max(1, static_cast<int>(ceil(Ncells*(upper[j] - lower[j])/extent)));
+		double margin = 0.5*extent/Ncells; // samples do not reach boundary of source volume, extend grid by half a cell
+		PotGridOrigin[j] = lower[j] - margin;
+		PotGridSpacing[j] = (upper[j] - lower[j] + 2*margin)/PotGridSize[j];
+	}
+
+	PotGridBound.assign(PotGridSize[0]*PotGridSize[1]*PotGridSize[2], numeric_limits<double>::infinity());
+	vector<double> cellmin = PotGridBound; // lowest sample in each cell
+	for (const auto &samples: chunksamples){
+		for (const auto &s: samples){
+			double &V = cellmin[PotentialGridCell(s[0], s[1], s[2])];
+			V = min(V, s[3]);
+		}
+	}
+	for (int i = 0; i < PotGridSize[0]; ++i){
+		for (int j = 0; j < PotGridSize[1]; ++j){
+			for (int k = 0; k < PotGridSize[2]; ++k){
+				double V = cellmin[(i*PotGridSize[1] + j)*PotGridSize[2] + k];
+				double step = -1; // largest difference to lowest sample in neighbouring cells
+				for (int ni = max(i - 1, 0); ni <= min(i + 1, PotGridSize[0] - 1); ++ni){
+					for (int nj = max(j - 1, 0); nj <= min(j + 1, PotGridSize[1] - 1); ++nj){
+						for (int nk = max(k - 1, 0); nk <= min(k + 1, PotGridSize[2] - 1); ++nk){
+							double Vn = cellmin[(ni*PotGridSize[1] + nj)*PotGridSize[2] + nk];
+							if (Vn != numeric_limits<double>::infinity() && (ni != i || nj != j || nk != k))
+								step = max(step, abs(Vn - V));
+						}
+					}
+				}
+				// potential can fall below lowest sample in cell by about as much as it changes between neighbouring cells
+				double &bound = PotGridBound[(i*PotGridSize[1] + j)*PotGridSize[2] + k];
+				if (V == numeric_limits<double>::infinity() || step < 0) // no samples to estimate bound
+					bound = MinPot;
+				else
+					bound = max(V - step, MinPot);
+			}
+		}
+	}
+	cout << " potential bounded in " << PotGridBound.size() << " cells\n";
+}
+
+std::size_t TVolumeSource::PotentialGridCell(const double x, const double y, const double z) const{
+	double pos[3] = {x, y, z};
+	int index[3];
+	for (int j = 0; j < 3; ++j){
+		double i = floor((pos[j] - PotGridOrigin[j])/PotGridSpacing[j]);
+		if (i < 0 || i >= PotGridSize[j])
+			return PotGridBound.size();
+		index[j] = static_cast<int>(i);
+	}
+	return (index[0]*PotGridSize[1] + index[1])*PotGridSize[2] + index[2];
+}
+
+void TVolumeSource::Prepare(TMCGenerator &mc, TGeometry &geometry, const TFieldManager &field){
+	if (fPhaseSpaceWeighting && MinPot == numeric_limits<double>::infinity()){ // if minimum potential energy has not yet been determined
+		FindPotentialMinimum(mc, geometry, field); // find minimum potential energy
+		if (MinPot > spectrum.max()) // abort program if spectrum completely out of potential range
+			throw std::runtime_error( (boost::format("Error: your chosen spectrum is below the minimal potential energy in the source volume (%1% eV < %2% eV). Exiting!\n") % spectrum.max() % MinPot).str() );
+		BuildPotentialGrid(mc, geometry, field);
 	}
-	cout << " minimal potential = " << MinPot << "eV\n";
 }
 
 TParticle* TVolumeSource::CreateParticle(TMCGenerator &mc, TGeometry &geometry, const TFieldManager &field){
 	std::uniform_real_distribution<double> timedist(0, fActiveTime);
 	if (fPhaseSpaceWeighting){ // if particle density should be weighted by available phase space
-		if (MinPot == numeric_limits<double>::infinity()){ // if minimum potential energy has not yet been determined
-			FindPotentialMinimum(mc, geometry, field); // find minimum potential energy
-			if (MinPot > spectrum.max()) // abort program if spectrum completely out of potential range
-				throw std::runtime_error( (boost::format("Error: your chosen spectrum is below the minimal potential energy in the source volume (%1% eV < %2% eV). Exiting!\n") % spectrum.max() % MinPot).str() );
-		}
+		Prepare(mc, geometry, field);
 
 		if (MinPot > spectrum.min()){ // give warning if chosen spectrum contains energy ranges that are not possible
 			cout << "Warning: your chosen spectrum contains energies below the minimal potential energy in the source volume (" << spectrum.min() << "eV < " << MinPot << "eV). The energy spectrum will be cut off!\n";
@@ -129,21 +403,32 @@ TParticle* TVolumeSource::CreateParticle(TMCGenerator &mc, TGeometry &geometry,
 		}while (H < MinPot);
 
 //		cout << "Trying to find starting point for particle with total energy " << H << "eV ...";
+		GetProbe(mc, geometry, field);
+		std::polarization_distribution<double> pdist(polarization);
+		std::uniform_real_distribution<double> Hdist(0, sqrt(H - MinPot));
 		for (int i = 0; true; i++){
 			double t = timedist(mc); // dice start time
 			double x, y, z;
 			RandomPointInSourceVolume(x, y, z, mc); // dice point in source volume
-			TParticle *proposed_p = TParticleSource::CreateParticle(t, x, y, z, 0, 0, 0, polarization, mc, geometry, field); // create new particle with Ekin = 0
-			double V = proposed_p->GetInitialTotalEnergy(geometry, field); // potential at particle position equals its total energy
-			delete proposed_p;
-			ParticleCounter--; // delete particle and decrement particle counter
+			double u = Hdist(mc);
+			// particle will be accepted with probability sqrt(H-V)/sqrt(H-Vmin) (phase space weighting according to Golub).
+			// Since V is larger than the lower bound Vcell of the potential in the grid cell, points with sqrt(H-Vcell) < u are rejected without calculating V,
+			// so positions are effectively drawn in proportion to the available phase space in each cell and exactly weighted inside the cell
+			std::size_t cell = PotentialGridCell(x, y, z);
+			double Vcell = cell < PotGridBound.size() ? PotGridBound[cell] : MinPot;
+			if (H < Vcell || sqrt(H - Vcell) <= u)
+				continue;
+
+			const solid *sld;
+			double V = GetPotentialEnergy(t, x, y, z, pdist(mc), geometry, field, sld); // potential at particle position
+			if (V < Vcell && cell < PotGridBound.size())
+				PotGridBound[cell] = max(V, MinPot); // sampling missed lower potential in this cell, lower its bound for following particles
 
 			if (H < V)
 				continue; // if total energy < potential energy then particle is not possible at this point
-			std::uniform_real_distribution<double> Hdist(0, sqrt(H - MinPot));
-			if (sqrt(H - V) > Hdist(mc)){ // accept particle with probability sqrt(H-V)/sqrt(H-Vmin) (phase space weighting according to Golub)
+			if (sqrt(H - V) > u){
 //				cout << " found after " << i+1 << " tries\n";
-				return TParticleSource::CreateParticle(t, x, y, z, H - V, phi_v(mc), theta_v(mc), polarization, mc, geometry, field); // if accepted, return new particle with correct Ekin
+				return TParticleSource::CreateParticle(t, x, y, z, H - V, phi_v(mc), theta_v(mc), polarization, mc, geometry, field, sld); // if accepted, return new particle with correct Ekin
 			}
 		}
 		assert(false); // this will never be reached
@@ -156,20 +441,109 @@ TParticle* TVolumeSource::CreateParticle(TMCGenerator &mc, TGeometry &geometry,
 	}
 }
 
-TParticleSource* CreateParticleSource(TConfig &config, const TGeometry &geometry){
-	std::map<std::string, std::string> &sc = config["SOURCE"];
+void TVolumeSource::CreateParticles(const long long firstnumber, std::vector<TMCGenerator> &mc, TGeometry &geometry, const TFieldManager &field,
+		std::vector<std::unique_ptr<TParticle> > &particles){
+	if (fPhaseSpaceWeighting){ // rejection sampling draws a different number of points for each particle
+		TParticleSource::CreateParticles(firstnumber, mc, geometry, field, particles);
+		return;
+	}
+	std::uniform_real_distribution<double> timedist(0, fActiveTime);
+	std::vector<std::array<double, 4> > starts(mc.size()); // time and position of each particle
+	for (std::size_t i = 0; i < mc.size(); ++i){
+		StartQuasiRandom(mc[i], firstnumber + i);
+		starts[i][0] = timedist(mc[i]);
+		RandomPointInSourceVolume(starts[i][1], starts[i][2], starts[i][3], mc[i]);
+	}
+	std::vector<const solid*> solids(mc.size());
+	for (std::size_t i = 0; i < mc.size(); ++i)
+		solids[i] = &geometry.GetSolid(starts[i][0], &starts[i][1]);
+	particles.clear();
+	for (std::size_t i = 0; i < mc.size(); ++i){
+		ParticleCounter = firstnumber + i - 1;
+		particles.emplace_back(TParticleSource::CreateParticle(starts[i][0], starts[i][1], starts[i][2], starts[i][3], spectrum(mc[i]), phi_v(mc[i]), theta_v(mc[i]),
+				polarization, mc[i], geometry, field, solids[i]));
+		mc[i].StopQuasiRandom();
+	}
+}
+
+TPhaseSpaceSource::TPhaseSpaceSource(std::map<std::string, std::string> &sourceconf): TParticleSource(sourceconf), nrecords(0), resample(false){
+	istringstream(sourceconf["resample"]) >> resample;
+	istringstream filenames(sourceconf["phasespacefiles"]);
+	boost::filesystem::path filename;
+	const size_t headersize = sizeof(PHASESPACE_HEADER) - 1;
+	while (filenames >> filename){
+		boost::filesystem::path file = boost::filesystem::absolute(filename, configpath.parent_path());
+		if (not boost::filesystem::exists(file))
+			throw runtime_error("Could not open phase-space file " + file.native());
+		if (boost::filesystem::file_size(file) == headersize) // file without particles
+			continue;
+		boost::iostreams::mapped_file_source mapped(file.native());
+		if (mapped.size() < headersize || memcmp(mapped.data(), PHASESPACE_HEADER, headersize) != 0 || (mapped.size() - headersize) % sizeof(TPhaseSpaceRecord) != 0)
+			throw runtime_error("Could not read phase-space file " + file.native());
+		firstrecords.push_back(nrecords);
+		nrecords += (mapped.size() - headersize)/sizeof(TPhaseSpaceRecord);
+		files.push_back(mapped);
+	}
+	if (nrecords == 0)
+		throw runtime_error("Phase-space files given in phasespacefiles contain no particles!");
+	cout << "Read " << nrecords << " particles from " << files.size() << " phase-space files\n";
+}
+
+
+TParticle* TPhaseSpaceSource::CreateParticle(TMCGenerator &mc, TGeometry &geometry, const TFieldManager &field){
+	size_t index;
+	if (resample){
+		std::uniform_int_distribution<size_t> recorddist(0, nrecords - 1);
+		index = recorddist(mc);
+	}
+	else
+		index = static_cast<size_t>(ParticleCounter) % nrecords; // ParticleCounter is the number of the previous particle
+	size_t ifile = upper_bound(firstrecords.begin(), firstrecords.end(), index) - firstrecords.begin() - 1;
+	TPhaseSpaceRecord r;
+	memcpy(&r, files[ifile].data() + sizeof(PHASESPACE_HEADER) - 1 + (index - firstrecords[ifile])*sizeof(TPhaseSpaceRecord), sizeof(r)); // records are not aligned
+
+	double v2 = r.vx*r.vx + r.vy*r.vy + r.vz*r.vz;
+	double beta2 = v2/static_cast<double>(c_0*c_0);
+	double s = sqrt(1 - beta2);
+	double Ekin = GetProbe(mc, geometry, field).GetMass()*static_cast<double>(c_0*c_0)*beta2/(s*(1 + s)); // m*c^2*(gamma - 1), without cancellation for small velocities
+	double phi = atan2(r.vy, r.vx);
+	double theta = v2 > 0 ? acos(r.vz/sqrt(v2)) : 0;
+	TParticle *p = TParticleSource::CreateParticle(r.t, r.x, r.y, r.z, Ekin, phi, theta, r.polarisation, mc, geometry, field);
+	if (r.Sx != 0 || r.Sy != 0 || r.Sz != 0){ // keep spin initialized by particle if it was not tracked in the earlier simulation
+		spin_state_type spin = p->GetInitialSpin();
+		spin[0] = r.Sx;
+		spin[1] = r.Sy;
+		spin[2] = r.Sz;
+		p->SetInitialSpin(spin);
+	}
+	p->SetStatisticalWeight(r.statweight);
+	return p;
+}
+
+
+/**
+ * Create particle source defined in a section of config
+ *
+ * @param config TConfig class containing source options
+ * @param sourcesection Section containing options of source
+ *
+ * @return Returns particle source
+ */
+static TParticleSource* CreateSingleSource(TConfig &config, const std::string &sourcesection){
+	std::map<std::string, std::string> &sc = config[sourcesection];
 	std::string sourcemode;
 	std::istringstream(sc["sourcemode"]) >> sourcemode;
 
 	TParticleSource *source = nullptr;
+	TVolumeSource *volumesource = nullptr;
 	if (sourcemode == "boxvolume"){
-		source = new TCuboidVolumeSource(sc);
+		source = volumesource = new TCuboidVolumeSource(sc);
 	}
 	else if (sourcemode == "cylvolume"){
-		source = new TCylindricalVolumeSource(sc);
+		source = volumesource = new TCylindricalVolumeSource(sc);
 	}
 	else if (sourcemode == "STLvolume"){
-		source = new TSTLVolumeSource(sc);
+		source = volumesource = new TSTLVolumeSource(sc);
 	}
 	else if (sourcemode == "cylsurface"){
 		source = new TCylindricalSurfaceSource(sc);
@@ -177,9 +551,184 @@ TParticleSource* CreateParticleSource(TConfig &config, const TGeometry &geometry
 	else if (sourcemode == "STLsurface"){
 		source = new TSTLSurfaceSource(sc);
 	}
+	else if (sourcemode == "phasespace"){
+		source = new TPhaseSpaceSource(sc);
+	}
 	else
-		throw std::runtime_error((boost::format("Could not load source %1%!") % sourcemode).str());
+		throw std::runtime_error((boost::format("Could not load source %1% in section %2%!") % sourcemode % sourcesection).str());
 //	cout << '\n';
 
+	if (volumesource){
+		boost::filesystem::path cachedir; // minimal potential energy is cached in the same directory as field interpolation coefficients
+		int nthreads = 1;
+		std::map<std::string, std::string> &global = config["GLOBAL"];
+		if (global.count("fieldcache") > 0)
+			std::istringstream(global["fieldcache"]) >> cachedir;
+		if (global.count("nthreads") > 0)
+			std::istringstream(global["nthreads"]) >> nthreads;
+
+		boost::filesystem::path cachefile;
+		std::uint64_t key = 0;
+		if (not cachedir.empty()){
+			// key contains all options that influence the potential energy in the source volume, and size and modification time of all files they refer to
+			std::string parameters = "potentialminimum";
+			if (global.count("bakefields") > 0)
+				parameters += "\nbakefields " + global["bakefields"];
+			for (const auto &section: config){
+				if (section.first != sourcesection && section.first != "GEOMETRY" && section.first != "MATERIALS" && section.first != "FIELDS" && section.first != "FORMULAS")
+					continue;
+				for (const auto &option: section.second){
+					parameters += "\n" + section.first + " " + option.first + " " + option.second;
+					std::istringstream ss(option.second);
+					std::string token;
+					while (ss >> token){
+						boost::system::error_code ec;
+						boost::filesystem::path f = boost::filesystem::absolute(token, configpath.parent_path());
+						if (boost::filesystem::is_regular_file(f, ec))
+							parameters += (boost::format(" %1% %2%") % boost::filesystem::file_size(f, ec) % boost::filesystem::last_write_time(f, ec)).str();
+					}
+				}
+			}
+			key = TableKey(parameters);
+			cachedir = boost::filesystem::absolute(cachedir, configpath.parent_path());
+			boost::filesystem::create_directories(cachedir);
+			cachefile = cachedir / (boost::format("potentialminimum.%1$016x.txt") % key).str();
+		}
+		volumesource->SetPotentialMinimumSearch(cachefile, key, nthreads > 0 ? nthreads : 1);
+	}
+
 	return source;
 }
+
+
+bool IsSourceSection(const std::string &section){
+	return section == "SOURCE" || section.compare(0, 7, "SOURCE_") == 0;
+}
+
+
+TParticleSource* CreateParticleSource(TConfig &config, const TGeometry &geometry){
+	std::vector<std::string> sections;
+	for (auto &section: config){
+		if (IsSourceSection(section.first))
+			sections.push_back(section.first); // SOURCE comes first, followed by SOURCE_<name> in alphabetical order
+	}
+	if (sections.size() <= 1)
+		return CreateSingleSource(config, "SOURCE");
+
+	long long simcount = 1;
+	std::istringstream(config["GLOBAL"]["simcount"]) >> simcount;
+	std::vector<long long> counts(sections.size(), -1);
+	std::vector<double> weights(sections.size(), 0.);
+	long long remaining = simcount;
+	double totalweight = 0;
+	for (std::size_t i = 0; i < sections.size(); ++i){
+		std::map<std::string, std::string> &sc = config[sections[i]];
+		if (sc.count("sourcecount") > 0){
+			if (not (std::istringstream(sc["sourcecount"]) >> counts[i]) || counts[i] < 0)
+				throw std::runtime_error("Invalid sourcecount in section " + sections[i]);
+			remaining -= counts[i];
+		}
+		else{
+			weights[i] = 1;
+			if (sc.count("sourceweight") > 0 && (not (std::istringstream(sc["sourceweight"]) >> weights[i]) || weights[i] < 0))
+				throw std::runtime_error("Invalid sourceweight in section " + sections[i]);
+			totalweight += weights[i];
+		}
+	}
+	if (remaining < 0)
+		throw std::runtime_error("The sourcecounts of all sources add up to more than simcount!");
+	// split remaining particles by weight, rounding so the counts add up to the remaining particles
+	double cumulativeweight = 0;
+	long long assigned = 0;
+	for (std::size_t i = 0; i < sections.size(); ++i){
+		if (counts[i] >= 0)
+			continue;
+		cumulativeweight += weights[i];
+		long long last = totalweight > 0 ? std::llround(remaining*cumulativeweight/totalweight) : 0;
+		counts[i] = last - assigned;
+		assigned = last;
+	}
+
+	std::vector<std::unique_ptr<TParticleSource> > sources;
+	std::string names;
+	std::cout << "Combining sources:";
+	for (std::size_t i = 0; i < sections.size(); ++i){
+		sources.emplace_back(CreateSingleSource(config, sections[i]));
+		std::cout << " " << sections[i] << " (" << counts[i] << " " << sources.back()->GetParticleName() << "s)";
+		if (names.find(sources.back()->GetParticleName()) == std::string::npos)
+			names += (names.empty() ? "" : "/") + sources.back()->GetParticleName();
+	}
+	std::cout << "\n";
+	std::map<std::string, std::string> multiconf = {{"particle", names}, {"spectrum", "1"}, {"phi_v", "1"}, {"theta_v", "1"}};
+	return new TMultiSource(multiconf, sources, counts);
+}
+
+
+TMultiSource::TMultiSource(std::map<std::string, std::string> &sourceconf, std::vector<std::unique_ptr<TParticleSource> > &asources, const std::vector<long long> &counts)
+		: TParticleSource(sourceconf), sources(std::move(asources)){
+	long long last = 0;
+	for (auto count: counts){
+		last += count;
+		lastnumbers.push_back(last);
+	}
+	if (last <= 0)
+		throw std::runtime_error("Combined sources do not create any particles!");
+}
+
+
+std::size_t TMultiSource::SourceIndex(const long long number) const{
+	long long n = (number - 1) % lastnumbers.back() + 1; // numbers beyond the last range start over with the first source
+	return std::upper_bound(lastnumbers.begin(), lastnumbers.end(), n - 1) - lastnumbers.begin();
+}
+
+
+TParticle* TMultiSource::CreateParticle(TMCGenerator &mc, TGeometry &geometry, const TFieldManager &field){
+	long long number = ParticleCounter + 1;
+	TParticleSource &source = *sources[SourceIndex(number)];
+	source.ParticleCounter = ParticleCounter;
+	source.StartQuasiRandom(mc, number); // each source has its own quasi-random sequence
+	TParticle *p = source.CreateParticle(mc, geometry, field);
+	ParticleCounter = source.ParticleCounter;
+	return p;
+}
+
+
+void TMultiSource::CreateParticles(const long long firstnumber, std::vector<TMCGenerator> &mc, TGeometry &geometry, const TFieldManager &field,
+		std::vector<std::unique_ptr<TParticle> > &particles){
+	particles.clear();
+	std::vector<std::unique_ptr<TParticle> > created;
+	for (std::size_t begin = 0; begin < mc.size(); ){ // let each source create the part of the block in its range at once
+		std::size_t index = SourceIndex(firstnumber + begin), end = begin + 1;
+		while (end < mc.size() && SourceIndex(firstnumber + end) == index)
+			++end;
+		std::vector<TMCGenerator> sourcemc(mc.begin() + begin, mc.begin() + end);
+		sources[index]->CreateParticles(firstnumber + begin, sourcemc, geometry, field, created);
+		std::copy(sourcemc.begin(), sourcemc.end(), mc.begin() + begin);
+		for (auto &p: created)
+			particles.push_back(std::move(p));
+		begin = end;
+	}
+	ParticleCounter = firstnumber + mc.size() - 1;
+}
+
+
+void TMultiSource::Prepare(TMCGenerator &mc, TGeometry &geometry, const TFieldManager &field){
+	for (auto &source: sources)
+		source->Prepare(mc, geometry, field);
+}
+
+
+TParticle* CreateParticle(const std::string &name, const int number, double t, double x, double y, double z, double E, double phi, double theta, double polarisation,
+		TMCGenerator &mc, const TGeometry &geometry, const TFieldManager &field, const solid *startsolid){
+	if (name == NAME_NEUTRON)
+		return new TNeutron(number, t, x, y, z, E, phi, theta, polarisation, mc, geometry, field, startsolid);
+	else if (name == NAME_PROTON)
+		return new TProton(number, t, x, y, z, E, phi, theta, polarisation, mc, geometry, field, startsolid);
+	else if (name == NAME_ELECTRON)
+		return new TElectron(number, t, x, y, z, E, phi, theta, polarisation, mc, geometry, field, startsolid);
+	else if (name == NAME_MERCURY)
+		return new TMercury(number, t, x, y, z, E, phi, theta, polarisation, mc, geometry, field, startsolid);
+	else if (name == NAME_XENON)
+		return new TXenon(number, t, x, y, z, E, phi, theta, polarisation, mc, geometry, field, startsolid);
+	throw std::runtime_error("Could not create particle " + name);
+}
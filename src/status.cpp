@@ -0,0 +1,164 @@
+#include "status.h"
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "globals.h"
+
+using namespace std;
+
+void ResidentMemory(long &current, long &peak){
+	current = 0;
+	peak = 0;
+	long pages;
+	ifstream statm("/proc/self/statm"); // only available on Linux
+	if (statm >> pages >> pages)
+		current = pages*(sysconf(_SC_PAGESIZE)/1024);
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0){
+		peak = usage.ru_maxrss;
+#ifdef __APPLE__
+		peak /= 1024; // macOS reports bytes instead of kilobytes
+#endif
+	}
+}
+
+
+TStatusMonitor::TStatusMonitor(const boost::filesystem::path &afile, const double ainterval, const TFormat aformat, const int nthreads,
+		const unsigned long atotal, const unsigned long afinished, const std::map<std::string, std::map<int, double> > &aID_counter, const long long asteps)
+		: file(afile), interval(ainterval), format(aformat), total(atotal), startfinished(afinished), startsteps(asteps),
+		  start(chrono::steady_clock::now()), lastupdate(start), finished(afinished), steps(asteps), ID_counter(aID_counter),
+		  currentnames(nthreads), currentnumbers(nthreads, 0), currentstarts(nthreads, start){
+	if (interval > 0)
+		Write("running");
+}
+
+void TStatusMonitor::StartParticle(const int ithread, const std::string &name, const long long number){
+	if (interval <= 0)
+		return;
+	lock_guard<mutex> lock(countermutex);
+	currentnames[ithread] = name;
+	currentnumbers[ithread] = number;
+	currentstarts[ithread] = chrono::steady_clock::now();
+}
+
+void TStatusMonitor::FinishParticle(const int ithread, const std::string &name, const int stopID, const double weight, const long long particlesteps, const bool primary){
+	if (interval <= 0)
+		return;
+	steps += particlesteps;
+	if (primary)
+		++finished;
+	lock_guard<mutex> lock(countermutex);
+	ID_counter[name][stopID] += weight;
+	currentnames[ithread].clear();
+}
+
+void TStatusMonitor::Update(){
+	if (interval <= 0 || chrono::duration<double>(chrono::steady_clock::now() - lastupdate).count() < interval)
+		return;
+	Write("running");
+}
+
+void TStatusMonitor::Finish(const std::string &state){
+	if (interval > 0)
+		Write(state);
+}
+
+void TStatusMonitor::Write(const std::string &state){
+	chrono::steady_clock::time_point now = chrono::steady_clock::now();
+	lastupdate = now;
+	double elapsed = chrono::duration<double>(now - start).count();
+	unsigned long nfinished = finished.load();
+	long long nsteps = steps.load();
+	double particlerate = elapsed > 0 ? (nfinished - startfinished)/elapsed : 0;
+	double steprate = elapsed > 0 ? (nsteps - startsteps)/elapsed : 0;
+	double remaining = particlerate > 0 && total > nfinished ? (total - nfinished)/particlerate : (total > nfinished ? -1 : 0); // -1: unknown
+	long memory, peakmemory;
+	ResidentMemory(memory, peakmemory);
+
+	boost::filesystem::path tmpfile = file.string() + boost::filesystem::unique_path(".%%%%%%%%").string();
+	ofstream f(tmpfile.string());
+	f << setprecision(numeric_limits<double>::max_digits10); // counters are sums of statistical weights
+	lock_guard<mutex> lock(countermutex);
+	if (format == JSON){
+		f << "{\n";
+		f << "  \"jobnumber\": " << jobnumber << ",\n";
+		f << "  \"state\": \"" << state << "\",\n";
+		f << "  \"elapsed_s\": " << elapsed << ",\n";
+		f << "  \"particles_total\": " << total << ",\n";
+		f << "  \"particles_finished\": " << nfinished << ",\n";
+		f << "  \"steps\": " << nsteps << ",\n";
+		f << "  \"particles_per_second\": " << particlerate << ",\n";
+		f << "  \"steps_per_second\": " << steprate << ",\n";
+		f << "  \"remaining_s\": " << remaining << ",\n";
+		f << "  \"memory_kB\": " << memory << ",\n";
+		f << "  \"peak_memory_kB\": " << peakmemory << ",\n";
+		f << "  \"stopIDs\": {";
+		for (auto particle = ID_counter.begin(); particle != ID_counter.end(); ++particle){
+			f << (particle == ID_counter.begin() ? "\n" : ",\n") << "    \"" << particle->first << "\": {";
+			for (auto stopID = particle->second.begin(); stopID != particle->second.end(); ++stopID)
+				f << (stopID == particle->second.begin() ? "" : ", ") << '"' << stopID->first << "\": " << stopID->second;
+			f << "}";
+		}
+		f << (ID_counter.empty() ? "},\n" : "\n  },\n");
+		f << "  \"threads\": [";
+		for (unsigned i = 0; i < currentnames.size(); ++i){
+			f << (i == 0 ? "\n" : ",\n") << "    {";
+			if (currentnames[i].empty())
+				f << "\"particle\": null";
+			else
+				f << "\"particle\": \"" << currentnames[i] << "\", \"number\": " << currentnumbers[i]
+				  << ", \"tracking_s\": " << chrono::duration<double>(now - currentstarts[i]).count();
+			f << "}";
+		}
+		f << "\n  ]\n}\n";
+	}
+	else{
+		string job = "job=\"" + to_string(jobnumber) + "\"";
+		f << "# TYPE pentrack_running gauge\n";
+		f << "pentrack_running{" << job << "} " << (state == "running" ? 1 : 0) << '\n';
+		f << "# TYPE pentrack_elapsed_seconds gauge\n";
+		f << "pentrack_elapsed_seconds{" << job << "} " << elapsed << '\n';
+		f << "# TYPE pentrack_particles_total gauge\n";
+		f << "pentrack_particles_total{" << job << "} " << total << '\n';
+		f << "# TYPE pentrack_particles_finished counter\n";
+		f << "pentrack_particles_finished{" << job << "} " << nfinished << '\n';
+		f << "# TYPE pentrack_steps counter\n";
+		f << "pentrack_steps{" << job << "} " << nsteps << '\n';
+		f << "# TYPE pentrack_particles_per_second gauge\n";
+		f << "pentrack_particles_per_second{" << job << "} " << particlerate << '\n';
+		f << "# TYPE pentrack_steps_per_second gauge\n";
+		f << "pentrack_steps_per_second{" << job << "} " << steprate << '\n';
+		f << "# TYPE pentrack_remaining_seconds gauge\n";
+		f << "pentrack_remaining_seconds{" << job << "} " << remaining << '\n';
+		f << "# TYPE pentrack_memory_bytes gauge\n";
+		f << "pentrack_memory_bytes{" << job << "} " << memory*1024 << '\n';
+		f << "# TYPE pentrack_peak_memory_bytes gauge\n";
+		f << "pentrack_peak_memory_bytes{" << job << "} " << peakmemory*1024 << '\n';
+		f << "# TYPE pentrack_stopid_weight counter\n";
+		for (auto &particle: ID_counter){
+			for (auto &stopID: particle.second)
+				f << "pentrack_stopid_weight{" << job << ",particle=\"" << particle.first << "\",stopID=\"" << stopID.first << "\"} " << stopID.second << '\n';
+		}
+		f << "# TYPE pentrack_thread_tracking_seconds gauge\n";
+		for (unsigned i = 0; i < currentnames.size(); ++i){
+			double tracking = currentnames[i].empty() ? 0 : chrono::duration<double>(now - currentstarts[i]).count();
+			f << "pentrack_thread_tracking_seconds{" << job << ",thread=\"" << i << "\",particle=\"" << currentnames[i] << "\",number=\""
+			  << (currentnames[i].empty() ? 0 : currentnumbers[i]) << "\"} " << tracking << '\n';
+		}
+	}
+	f.close();
+
+	boost::system::error_code ec;
+	if (f)
+		boost::filesystem::rename(tmpfile, file, ec); // rename is atomic, so readers never see an incomplete file
+	if (!f || ec){
+		cout << "Warning: Could not write status file " << file << "\n";
+		boost::filesystem::remove(tmpfile, ec);
+	}
+}
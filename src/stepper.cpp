@@ -0,0 +1,562 @@
+/**
+ * \file
+ * Trajectory integrators.
+ */
+
+#include "stepper.h"
+
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+#include "particle.h"
+#include "globals.h"
+
+using namespace std;
+
+static const controlled_rkf78_stepper_type::stepper_type RKF78_STEPPER; ///< Prototype of the stepper controlled by TStepper::rkf78, its temporary buffers are zero-initialized since it is static
+
+TStepper::TStepper(const TMethod amethod, const double abstol, const double reltol, const double asteps, const double adiabaticity, const double walldistance,
+		const TGeometry *geom, const bool aballistic)
+	: method(amethod), dopri5(boost::numeric::odeint::make_dense_output(abstol, reltol, stepper_type())),
+	  rkf78(controlled_rkf78_stepper_type::error_checker_type(abstol, reltol), controlled_rkf78_stepper_type::step_adjuster_type(), RKF78_STEPPER), bulirschstoer(abstol, reltol),
+	  stepsperperiod(asteps), gcadiabaticity(adiabaticity), gcwalldistance(walldistance), geometry(geom), ballistic(aballistic){
+	if (!(abstol > 0) || !(reltol > 0))
+		throw std::runtime_error("Integration tolerances have to be larger than zero!");
+	if ((method == BORIS || method == GUIDINGCENTER) && !(stepsperperiod > 0))
+		throw std::runtime_error("Number of Boris steps per gyration period has to be larger than zero!");
+	if (method == GUIDINGCENTER && geometry == nullptr)
+		throw std::runtime_error("Guiding-center tracking requires a geometry!");
+}
+
+void TStepper::initialize(const state_type &y, const value_type x, const value_type adt){
+	freeflight = false;
+	if (method == DOPRI5)
+		dopri5.initialize(y, x, adt);
+	else if (method == BULIRSCHSTOER)
+		bulirschstoer.initialize(y, x, adt);
+	else{
+		x1 = x2 = x;
+		y1 = y2 = y;
+		dt = adt;
+		guiding = false;
+	}
+}
+
+void TStepper::restart(const state_type &y, const value_type x){
+	freeflight = false;
+	if (method == DOPRI5)
+		dopri5.initialize(y, x, dopri5.current_time_step());
+	else if (method == BULIRSCHSTOER)
+		bulirschstoer.initialize(y, x, bulirschstoer.current_time_step());
+	else{ // dt and Babs of the last step are kept
+		x1 = x2 = x;
+		y1 = y2 = y;
+		guiding = false; // the guiding-center state does not describe the changed trajectory
+	}
+}
+
+void TStepper::set_tolerances(const double abstol, const double reltol, const state_type &y, const value_type x){
+	if (!(abstol > 0) || !(reltol > 0))
+		throw std::runtime_error("Integration tolerances have to be larger than zero!");
+	if (method == DOPRI5){
+		value_type adt = dopri5.current_time_step();
+		dopri5 = boost::numeric::odeint::make_dense_output(abstol, reltol, stepper_type());
+		dopri5.initialize(y, x, adt);
+		freeflight = false;
+	}
+	else if (method == BULIRSCHSTOER){
+		value_type adt = bulirschstoer.current_time_step();
+		bulirschstoer = dense_bs_stepper_type(abstol, reltol);
+		bulirschstoer.initialize(y, x, adt);
+		freeflight = false;
+	}
+	else if (method == RKF78) // state and step length are kept in y2, x2, and dt
+		rkf78 = controlled_rkf78_stepper_type(controlled_rkf78_stepper_type::error_checker_type(abstol, reltol), controlled_rkf78_stepper_type::step_adjuster_type(), RKF78_STEPPER);
+}
+
+void TStepper::do_step(const TParticle &p, const TFieldManager &field){
+	if (method == FREEMOLECULAR){ // fly on a parabola until the collision check finds the next wall, independent of fields
+		x1 = x2;
+		y1 = y2;
+		freeflight = true;
+		FreeFlightStep(numeric_limits<double>::infinity());
+		return;
+	}
+	if (ballistic && !guiding){
+		const state_type &y = current_state();
+		double d = field.FieldFreeDistance(y[0], y[1], y[2]);
+		if (d > 10*MAX_TRACK_DEVIATION){ // do not approach fields in many short steps
+			x1 = current_time();
+			y1 = y;
+			freeflight = true;
+			FreeFlightStep(d);
+			return;
+		}
+		if (freeflight){ // continue integration at end of ballistic step
+			freeflight = false;
+			if (method == DOPRI5)
+				dopri5.initialize(y2, x2, dopri5.current_time_step());
+			else if (method == BULIRSCHSTOER)
+				bulirschstoer.initialize(y2, x2, bulirschstoer.current_time_step());
+			else
+				Babs = -1;
+		}
+	}
+	if (method == BORIS || method == GUIDINGCENTER){
+		x1 = x2;
+		y1 = y2;
+		if (method == GUIDINGCENTER && p.GetCharge() != 0){
+			double B[3], dBidxj[3][3];
+			if (guiding){
+				field.BField(gc[0], gc[1], gc[2], x1, B, dBidxj);
+				if (!GuidingCenterValid(p, &gc[0], uperp2B*sqrt(B[0]*B[0] + B[1]*B[1] + B[2]*B[2]), B, dBidxj, 1)){ // switch to full tracking at current gyrophase
+					FromGuidingCenter(p, B, y1, false);
+					y2 = y1;
+					guiding = false;
+					Babs = -1;
+				}
+			}
+			else{
+				field.BField(y1[0], y1[1], y1[2], x1, B, dBidxj);
+				double v2 = y1[3]*y1[3] + y1[4]*y1[4] + y1[5]*y1[5];
+				double gamma2 = 1/(1 - v2*p.GetConstants().inversec2);
+				double B2 = B[0]*B[0] + B[1]*B[1] + B[2]*B[2];
+				double vpar = B2 > 0 ? (y1[3]*B[0] + y1[4]*B[1] + y1[5]*B[2])/sqrt(B2) : 0;
+				if (B2 > 0 && GuidingCenterValid(p, &y1[0], gamma2*(v2 - vpar*vpar), B, dBidxj, 0.5)){ // switch to guiding-center tracking, with some margin
+					ToGuidingCenter(p, B);
+					FromGuidingCenter(p, B, y1, true); // start step at guiding center
+					guiding = true;
+				}
+			}
+		}
+		if (guiding)
+			GuidingCenterStep(p, field);
+		else
+			BorisStep(p, field);
+		return;
+	}
+	bool charged = p.GetCharge() != 0, magnetic = p.GetMagneticMoment() != 0;
+	if (charged && magnetic) // use equations of motion specialized for particle type
+		RungeKuttaStep(TEquationOfMotion<true, true>{p, field});
+	else if (charged)
+		RungeKuttaStep(TEquationOfMotion<true, false>{p, field});
+	else if (magnetic)
+		RungeKuttaStep(TEquationOfMotion<false, true>{p, field});
+	else
+		RungeKuttaStep(TEquationOfMotion<false, false>{p, field});
+}
+
+template<class System> void TStepper::RungeKuttaStep(const System &eom){
+	if (method == DOPRI5){
+		dopri5.do_step(eom);
+		return;
+	}
+	if (method == BULIRSCHSTOER){
+		bulirschstoer.do_step(eom);
+		return;
+	}
+	x1 = x2;
+	y1 = y2;
+	if (method == RKF78){
+		int fails = 0;
+		while (rkf78.try_step(eom, y2, x2, dt) == boost::numeric::odeint::fail){ // try_step reduces dt after a failed step and proposes the next dt after a successful one
+			if (++fails >= 500)
+				throw std::runtime_error("RKF78 stepper could not reach requested tolerance!");
+		}
+	}
+	else{
+		double v = sqrt(y1[3]*y1[3] + y1[4]*y1[4] + y1[5]*y1[5]);
+		dt = v > 0 ? 10.*MAX_TRACK_DEVIATION/v : dt; // fixed spatial step length
+		rk4.do_step(eom, y2, x2, dt);
+		x2 += dt;
+	}
+	for (int i = 0; i < 3; ++i){
+		dr1[i] = y1[3 + i];
+		dr2[i] = y2[3 + i];
+	}
+}
+
+void TStepper::set_step(const value_type ax1, const state_type &ay1, const value_type ax2, const state_type &ay2){
+	if (dense_output())
+		throw std::logic_error("Steps can only be set for integration methods without dense output!");
+	freeflight = false;
+	guiding = false;
+	x1 = ax1;
+	y1 = ay1;
+	x2 = ax2;
+	y2 = ay2;
+	dt = x2 - x1;
+	for (int i = 0; i < 3; ++i){
+		dr1[i] = y1[3 + i];
+		dr2[i] = y2[3 + i];
+	}
+}
+
+void TStepper::BorisStep(const TParticle &p, const TFieldManager &field){
+	const double q = p.GetCharge(), M = p.GetMass()*ele_e, mu = p.GetMagneticMoment(); // charge [C], mass [kg], magnetic moment [J/T]
+	const double inversec2 = p.GetConstants().inversec2;
+	double v = sqrt(y1[3]*y1[3] + y1[4]*y1[4] + y1[5]*y1[5]);
+	double gamma = 1./sqrt(1 - v*v*inversec2);
+
+	double B[3], dBidxj[3][3], E[3] = {0,0,0}, V;
+	if (Babs < 0){ // determine magnetic field at start point for first step length
+		field.BField(y1[0], y1[1], y1[2], x1, B);
+		Babs = sqrt(B[0]*B[0] + B[1]*B[1] + B[2]*B[2]);
+	}
+	dt = numeric_limits<double>::infinity();
+	if (q != 0 && Babs > 0)
+		dt = 2*pi*gamma*M/(abs(q)*Babs)/stepsperperiod; // resolve gyration period
+	if (v > 0)
+		dt = min(dt, 10.*MAX_TRACK_DEVIATION/v); // limit spatial step length
+	if (!std::isfinite(dt))
+		throw std::runtime_error("Could not determine Boris step length!");
+
+	// drift for half a step
+	double xh[3] = {y1[0] + 0.5*dt*y1[3], y1[1] + 0.5*dt*y1[4], y1[2] + 0.5*dt*y1[5]};
+	value_type th = x1 + 0.5*dt;
+
+	// forces at half step
+	field.BField(xh[0], xh[1], xh[2], th, B, mu != 0 ? dBidxj : nullptr);
+	Babs = sqrt(B[0]*B[0] + B[1]*B[1] + B[2]*B[2]);
+	if (q != 0)
+		field.EField(xh[0], xh[1], xh[2], th, V, E);
+	double F[3] = {q*E[0], q*E[1], q*E[2]}; // force in lab frame, except for Lorentz force from magnetic field
+	F[2] -= p.GetConstants().g*M;
+	if (mu != 0 && y1[7] != 0 && Babs > 0){
+		for (int i = 0; i < 3; ++i)
+			F[i] += y1[7]*mu*(B[0]*dBidxj[0][i] + B[1]*dBidxj[1][i] + B[2]*dBidxj[2][i])/Babs; // force on magnetic dipole moment
+	}
+
+	// kick: half acceleration, rotation in magnetic field, half acceleration
+	double u[3]; // relativistic velocity gamma*v
+	for (int i = 0; i < 3; ++i)
+		u[i] = gamma*y1[3 + i] + 0.5*dt*F[i]/M;
+	double gammam = sqrt(1 + (u[0]*u[0] + u[1]*u[1] + u[2]*u[2])*inversec2);
+	double t[3] = {0.5*dt*q*B[0]/(M*gammam), 0.5*dt*q*B[1]/(M*gammam), 0.5*dt*q*B[2]/(M*gammam)};
+	double sf = 2/(1 + t[0]*t[0] + t[1]*t[1] + t[2]*t[2]);
+	double up[3] = {u[0] + u[1]*t[2] - u[2]*t[1], u[1] + u[2]*t[0] - u[0]*t[2], u[2] + u[0]*t[1] - u[1]*t[0]};
+	u[0] += sf*(up[1]*t[2] - up[2]*t[1]) + 0.5*dt*F[0]/M;
+	u[1] += sf*(up[2]*t[0] - up[0]*t[2]) + 0.5*dt*F[1]/M;
+	u[2] += sf*(up[0]*t[1] - up[1]*t[0]) + 0.5*dt*F[2]/M;
+	double gamma2 = sqrt(1 + (u[0]*u[0] + u[1]*u[1] + u[2]*u[2])*inversec2);
+
+	// drift for second half step
+	x2 = x1 + dt;
+	for (int i = 0; i < 3; ++i){
+		y2[3 + i] = u[i]/gamma2;
+		y2[i] = xh[i] + 0.5*dt*y2[3 + i];
+	}
+	double v2 = sqrt(y2[3]*y2[3] + y2[4]*y2[4] + y2[5]*y2[5]);
+	y2[6] = y1[6] + 0.5*dt*(1/gamma + 1/gamma2); // proper time
+	y2[7] = y1[7]; // polarization does not change
+	y2[8] = y1[8] + 0.5*dt*(v + v2); // path length
+	for (int i = 0; i < 3; ++i){
+		dr1[i] = y1[3 + i];
+		dr2[i] = y2[3 + i];
+	}
+}
+
+bool TStepper::GuidingCenterValid(const TParticle &p, const double pos[3], const double uperp2, const double B[3], const double dBidxj[3][3], const double margin) const{
+	double B2 = B[0]*B[0] + B[1]*B[1] + B[2]*B[2];
+	if (B2 == 0)
+		return false;
+	double Babs = sqrt(B2);
+	double gradB[3];
+	for (int i = 0; i < 3; ++i)
+		gradB[i] = (B[0]*dBidxj[0][i] + B[1]*dBidxj[1][i] + B[2]*dBidxj[2][i])/Babs;
+	double rL = p.GetMass()*ele_e*sqrt(uperp2)/(abs(p.GetCharge())*Babs); // Larmor radius
+	double adiabaticity = rL*sqrt(gradB[0]*gradB[0] + gradB[1]*gradB[1] + gradB[2]*gradB[2])/Babs;
+	return adiabaticity < margin*gcadiabaticity && geometry->GetSafetyDistance(pos)*margin > gcwalldistance*rL;
+}
+
+/**
+ * Calculate two unit vectors perpendicular to unit vector b, used to define gyrophase
+ *
+ * @param b Unit vector
+ * @param e1 Returns first perpendicular unit vector
+ * @param e2 Returns second perpendicular unit vector, b x e1
+ */
+static void perpendicular_basis(const double b[3], double e1[3], double e2[3]){
+	if (abs(b[2]) < 0.9){ // e1 = b x z
+		e1[0] = b[1];
+		e1[1] = -b[0];
+		e1[2] = 0;
+	}
+	else{ // e1 = b x x
+		e1[0] = 0;
+		e1[1] = b[2];
+		e1[2] = -b[1];
+	}
+	double e1abs = sqrt(e1[0]*e1[0] + e1[1]*e1[1] + e1[2]*e1[2]);
+	for (int i = 0; i < 3; ++i)
+		e1[i] /= e1abs;
+	e2[0] = b[1]*e1[2] - b[2]*e1[1];
+	e2[1] = b[2]*e1[0] - b[0]*e1[2];
+	e2[2] = b[0]*e1[1] - b[1]*e1[0];
+}
+
+/**
+ * Calculate velocity of gyrating particle
+ *
+ * @param b Magnetic-field direction
+ * @param upar Parallel relativistic velocity gamma*v_par
+ * @param uperp Perpendicular relativistic velocity gamma*v_perp
+ * @param phase Gyrophase, relative to perpendicular_basis
+ * @param inversec2 1/c^2 [s^2/m^2]
+ * @param v Returns velocity
+ *
+ * @return Returns relativistic factor gamma
+ */
+static double gyration_velocity(const double b[3], const double upar, const double uperp, const double phase, const double inversec2, double v[3]){
+	double e1[3], e2[3];
+	perpendicular_basis(b, e1, e2);
+	double gamma = sqrt(1 + (upar*upar + uperp*uperp)*inversec2);
+	for (int i = 0; i < 3; ++i)
+		v[i] = (upar*b[i] + uperp*(cos(phase)*e1[i] + sin(phase)*e2[i]))/gamma;
+	return gamma;
+}
+
+void TStepper::ToGuidingCenter(const TParticle &p, const double B[3]){
+	const double M = p.GetMass()*ele_e, q = p.GetCharge();
+	double B2 = B[0]*B[0] + B[1]*B[1] + B[2]*B[2];
+	double Babs = sqrt(B2);
+	double b[3] = {B[0]/Babs, B[1]/Babs, B[2]/Babs};
+	double v2 = y2[3]*y2[3] + y2[4]*y2[4] + y2[5]*y2[5];
+	double gamma = 1/sqrt(1 - v2*p.GetConstants().inversec2);
+	double u[3] = {gamma*y2[3], gamma*y2[4], gamma*y2[5]};
+	double upar = u[0]*b[0] + u[1]*b[1] + u[2]*b[2];
+	double uperp[3] = {u[0] - upar*b[0], u[1] - upar*b[1], u[2] - upar*b[2]};
+	double vxB[3] = {y2[4]*B[2] - y2[5]*B[1], y2[5]*B[0] - y2[3]*B[2], y2[3]*B[1] - y2[4]*B[0]};
+	for (int i = 0; i < 3; ++i)
+		gc[i] = y2[i] + M*gamma/(q*B2)*vxB[i]; // gyration center
+	gc[3] = upar;
+	gc[4] = y2[6];
+	gc[5] = y2[8];
+	double e1[3], e2[3];
+	perpendicular_basis(b, e1, e2);
+	gc[6] = atan2(uperp[0]*e2[0] + uperp[1]*e2[1] + uperp[2]*e2[2], uperp[0]*e1[0] + uperp[1]*e1[1] + uperp[2]*e1[2]);
+	uperp2B = (uperp[0]*uperp[0] + uperp[1]*uperp[1] + uperp[2]*uperp[2])/Babs;
+}
+
+void TStepper::FromGuidingCenter(const TParticle &p, const double B[3], state_type &y, const bool atgc) const{
+	const double M = p.GetMass()*ele_e, q = p.GetCharge();
+	double B2 = B[0]*B[0] + B[1]*B[1] + B[2]*B[2];
+	double Babs = sqrt(B2);
+	double b[3] = {B[0]/Babs, B[1]/Babs, B[2]/Babs};
+	double gamma = gyration_velocity(b, gc[3], sqrt(uperp2B*Babs), gc[6], p.GetConstants().inversec2, &y[3]);
+	double vxB[3] = {y[4]*B[2] - y[5]*B[1], y[5]*B[0] - y[3]*B[2], y[3]*B[1] - y[4]*B[0]};
+	for (int i = 0; i < 3; ++i)
+		y[i] = atgc ? gc[i] : gc[i] - M*gamma/(q*B2)*vxB[i];
+	y[6] = gc[4];
+	y[7] = y1[7];
+	y[8] = gc[5];
+}
+
+void TStepper::GuidingCenterDerivs(const TParticle &p, const TFieldManager &field, const gc_state_type &g, const value_type x, gc_state_type &dgdx) const{
+	const double M = p.GetMass()*ele_e, q = p.GetCharge(), mu = p.GetMagneticMoment();
+	double B[3], dBidxj[3][3], V, E[3];
+	field.BField(g[0], g[1], g[2], x, B, dBidxj);
+	field.EField(g[0], g[1], g[2], x, V, E);
+	double B2 = B[0]*B[0] + B[1]*B[1] + B[2]*B[2];
+	double Babs = sqrt(B2);
+	double b[3] = {B[0]/Babs, B[1]/Babs, B[2]/Babs};
+	double gradB[3], kappa[3]; // gradient of |B| and field-line curvature (b.grad)b
+	for (int i = 0; i < 3; ++i)
+		gradB[i] = b[0]*dBidxj[0][i] + b[1]*dBidxj[1][i] + b[2]*dBidxj[2][i];
+	double bgradB = b[0]*gradB[0] + b[1]*gradB[1] + b[2]*gradB[2];
+	for (int i = 0; i < 3; ++i)
+		kappa[i] = (b[0]*dBidxj[i][0] + b[1]*dBidxj[i][1] + b[2]*dBidxj[i][2] - b[i]*bgradB)/Babs;
+
+	double uperp2 = uperp2B*Babs;
+	double gamma = sqrt(1 + (g[3]*g[3] + uperp2)*p.GetConstants().inversec2);
+	double F[3] = {q*E[0], q*E[1], q*E[2]}; // non-magnetic forces
+	F[2] -= p.GetConstants().g*M;
+	if (mu != 0 && y1[7] != 0){
+		for (int i = 0; i < 3; ++i)
+			F[i] += y1[7]*mu*gradB[i]; // force on magnetic dipole moment
+	}
+	// drift velocity: F x B drift, gradient drift, and curvature drift
+	double W[3]; // W = F/(q*B) + M*uperp^2/(2*gamma*q*B^2)*gradB + M*upar^2/(gamma*q*B)*kappa, drift = W x b
+	for (int i = 0; i < 3; ++i)
+		W[i] = F[i]/(q*Babs) + M*uperp2/(2*gamma*q*B2)*gradB[i] + M*g[3]*g[3]/(gamma*q*Babs)*kappa[i];
+	for (int i = 0; i < 3; ++i)
+		dgdx[i] = g[3]/gamma*b[i] + W[(i + 1) % 3]*b[(i + 2) % 3] - W[(i + 2) % 3]*b[(i + 1) % 3];
+	dgdx[3] = (F[0]*b[0] + F[1]*b[1] + F[2]*b[2])/M - uperp2/(2*gamma*Babs)*bgradB; // parallel force and mirror force
+	dgdx[4] = 1/gamma; // proper time
+	dgdx[5] = sqrt(dgdx[0]*dgdx[0] + dgdx[1]*dgdx[1] + dgdx[2]*dgdx[2]); // path length of guiding center
+	dgdx[6] = q*Babs/(gamma*M); // gyrophase
+}
+
+void TStepper::GuidingCenterStep(const TParticle &p, const TFieldManager &field){
+	gc_state_type k1, k2, k3, k4, g;
+	GuidingCenterDerivs(p, field, gc, x1, k1);
+
+	double B[3], dBidxj[3][3];
+	field.BField(gc[0], gc[1], gc[2], x1, B, dBidxj);
+	double Babs = sqrt(B[0]*B[0] + B[1]*B[1] + B[2]*B[2]);
+	gc1 = gc;
+	for (int i = 0; i < 3; ++i)
+		b1[i] = B[i]/Babs;
+	uperp1 = sqrt(uperp2B*Babs);
+	double dBdt = 0; // change of |B| along guiding-center path
+	for (int i = 0; i < 3; ++i)
+		dBdt += (B[0]*dBidxj[0][i] + B[1]*dBidxj[1][i] + B[2]*dBidxj[2][i])/Babs*k1[i];
+	double vgc = sqrt(k1[0]*k1[0] + k1[1]*k1[1] + k1[2]*k1[2]);
+	double rL = p.GetMass()*ele_e*sqrt(uperp2B*Babs)/(abs(p.GetCharge())*Babs);
+	dt = numeric_limits<double>::infinity();
+	if (vgc > 0)
+		dt = min(10.*MAX_TRACK_DEVIATION, 0.5*(geometry->GetSafetyDistance(&gc[0]) - gcwalldistance*rL))/vgc; // limit step length and stay away from walls
+	if (dBdt != 0)
+		dt = min(dt, 0.01*Babs/abs(dBdt)); // limit change of magnetic field
+	if (!std::isfinite(dt) || dt <= 0)
+		throw std::runtime_error("Could not determine guiding-center step length!");
+
+	for (int i = 0; i < 7; ++i)
+		g[i] = gc[i] + 0.5*dt*k1[i];
+	GuidingCenterDerivs(p, field, g, x1 + 0.5*dt, k2);
+	for (int i = 0; i < 7; ++i)
+		g[i] = gc[i] + 0.5*dt*k2[i];
+	GuidingCenterDerivs(p, field, g, x1 + 0.5*dt, k3);
+	for (int i = 0; i < 7; ++i)
+		g[i] = gc[i] + dt*k3[i];
+	GuidingCenterDerivs(p, field, g, x1 + dt, k4);
+	for (int i = 0; i < 7; ++i)
+		gc[i] += dt/6*(k1[i] + 2*k2[i] + 2*k3[i] + k4[i]);
+	x2 = x1 + dt;
+
+	// report guiding-center position with particle velocity at current gyrophase
+	GuidingCenterDerivs(p, field, gc, x2, k4);
+	field.BField(gc[0], gc[1], gc[2], x2, B);
+	FromGuidingCenter(p, B, y2, true);
+	Babs = sqrt(B[0]*B[0] + B[1]*B[1] + B[2]*B[2]);
+	for (int i = 0; i < 3; ++i)
+		b2[i] = B[i]/Babs;
+	uperp2 = sqrt(uperp2B*Babs);
+	for (int i = 0; i < 3; ++i){
+		dr1[i] = k1[i];
+		dr2[i] = k4[i];
+	}
+}
+
+/**
+ * Calculate length of a parabolic path
+ *
+ * @param vh Constant horizontal velocity
+ * @param w1 Vertical velocity at start of path
+ * @param w2 Vertical velocity at end of path
+ * @param t Duration
+ *
+ * @return Returns path length
+ */
+static double parabola_length(const double vh, const double w1, const double w2, const value_type t){
+	auto v = [vh](const double w){ return sqrt(vh*vh + w*w); };
+	if (abs(w2 - w1) < 1e-3*v(w1)) // closed form suffers from cancellation if velocity barely changes, use Simpson's rule instead
+		return t/6*(v(w1) + 4*v(0.5*(w1 + w2)) + v(w2));
+	auto F = [vh, &v](const double w){ return 0.5*(w*v(w) + (vh > 0 ? vh*vh*asinh(w/vh) : 0)); }; // antiderivative of v(w)
+	return (F(w1) - F(w2))*t/(w1 - w2);
+}
+
+void TStepper::FreeFlightStep(const double length){
+	dt = sqrt(4*MAX_TRACK_DEVIATION/gravconst); // parabola deviates by g/8*dt^2 = MAX_TRACK_DEVIATION/2 from straight line, so step does not have to be split for collision checks
+	double v = sqrt(y1[3]*y1[3] + y1[4]*y1[4] + y1[5]*y1[5]);
+	if (v*dt + 0.5*gravconst*dt*dt > length)
+		dt = 2*length/(v + sqrt(v*v + 2*gravconst*length)); // solution of v*dt + g/2*dt^2 = length
+	x2 = x1 + dt;
+	FreeFlightState(x2, y2);
+}
+
+void TStepper::FreeFlightState(const value_type x, state_type &y) const{
+	value_type t = x - x1;
+	for (int i = 0; i < 3; ++i){
+		y[i] = y1[i] + y1[3 + i]*t;
+		y[3 + i] = y1[3 + i];
+	}
+	y[2] -= 0.5*gravconst*t*t;
+	y[5] -= gravconst*t;
+	// Newtonian parabola, gravity changes velocities of relativistic particles only negligibly
+	auto inversegamma = [](const double vz, const double vh2){ return sqrt(1 - (vh2 + vz*vz)/(c_0*c_0)); };
+	double vh2 = y1[3]*y1[3] + y1[4]*y1[4];
+	y[6] = y1[6] + t/6*(inversegamma(y1[5], vh2) + 4*inversegamma(0.5*(y1[5] + y[5]), vh2) + inversegamma(y[5], vh2)); // proper time
+	y[7] = y1[7]; // polarization does not change
+	y[8] = y1[8] + parabola_length(sqrt(vh2), y1[5], y[5], t); // path length
+}
+
+bool TStepper::plane_crossing(const value_type xa, const value_type xb, const double p[3], const double n[3], value_type &x) const{
+	if (!freeflight)
+		return false;
+	// solve a*t^2 + b*t + c = 0 for distance of parabola to plane
+	double a = -0.5*gravconst*n[2];
+	double b = y1[3]*n[0] + y1[4]*n[1] + y1[5]*n[2];
+	double c = (y1[0] - p[0])*n[0] + (y1[1] - p[1])*n[1] + (y1[2] - p[2])*n[2];
+	double roots[2];
+	int nroots = 0;
+	if (a == 0){
+		if (b != 0)
+			roots[nroots++] = -c/b;
+	}
+	else{
+		double disc = b*b - 4*a*c;
+		if (disc >= 0){
+			double q = -0.5*(b + copysign(sqrt(disc), b)); // avoid cancellation
+			roots[nroots++] = q/a;
+			if (q != 0)
+				roots[nroots++] = c/q;
+		}
+	}
+	for (int i = 0; i < nroots; ++i){
+		value_type xc = x1 + roots[i];
+		if (xc >= xa && xc <= xb){
+			x = xc;
+			return true;
+		}
+	}
+	return false;
+}
+
+void TStepper::calc_state(const value_type x, state_type &y) const{
+	if (freeflight){
+		FreeFlightState(x, y);
+		return;
+	}
+	if (method == DOPRI5){
+		dopri5.calc_state(x, y);
+		return;
+	}
+	if (method == BULIRSCHSTOER){
+		bulirschstoer.calc_state(x, y);
+		return;
+	}
+	if (x2 == x1){
+		y = y2;
+		return;
+	}
+	// cubic Hermite interpolation of position, consistent with its derivatives at both ends, and linear interpolation of other variables
+	value_type h = x2 - x1;
+	value_type s = (x - x1)/h;
+	double h00 = (1 + 2*s)*(1 - s)*(1 - s), h10 = s*(1 - s)*(1 - s), h01 = s*s*(3 - 2*s), h11 = s*s*(s - 1);
+	double dh00 = 6*s*(s - 1), dh10 = (1 - s)*(1 - 3*s), dh11 = s*(3*s - 2);
+	for (int i = 0; i < 3; ++i)
+		y[i] = h00*y1[i] + h10*h*dr1[i] + h01*y2[i] + h11*h*dr2[i];
+	for (int i = 6; i < STATE_VARIABLES; ++i)
+		y[i] = (1 - s)*y1[i] + s*y2[i];
+	if (guiding){ // velocity at interpolated gyrophase, parallel velocity, and magnetic-field direction
+		double b[3] = {(1 - s)*b1[0] + s*b2[0], (1 - s)*b1[1] + s*b2[1], (1 - s)*b1[2] + s*b2[2]};
+		double babs = sqrt(b[0]*b[0] + b[1]*b[1] + b[2]*b[2]);
+		for (int i = 0; i < 3; ++i)
+			b[i] /= babs;
+		gyration_velocity(b, (1 - s)*gc1[3] + s*gc[3], (1 - s)*uperp1 + s*uperp2, (1 - s)*gc1[6] + s*gc[6], static_cast<double>(1/(c_0*c_0)), &y[3]);
+		return;
+	}
+	for (int i = 0; i < 3; ++i)
+		y[3 + i] = (dh00*(y1[i] - y2[i]))/h + dh10*y1[3 + i] + dh11*y2[3 + i];
+	if (method != BORIS && method != GUIDINGCENTER) // RK4 and RKF78 steps are not limited to a fraction of a gyration, their velocity can change direction and absolute value
+		return;
+	// interpolating the velocity vector shortens it when the particle gyrates, so scale it to the linearly interpolated absolute velocity
+	double v = sqrt(y[3]*y[3] + y[4]*y[4] + y[5]*y[5]);
+	if (v > 0){
+		double vabs = (1 - s)*sqrt(y1[3]*y1[3] + y1[4]*y1[4] + y1[5]*y1[5]) + s*sqrt(y2[3]*y2[3] + y2[4]*y2[4] + y2[5]*y2[5]);
+		for (int i = 3; i < 6; ++i)
+			y[i] *= vabs/v;
+	}
+}
@@ -0,0 +1,119 @@
+/**
+ * \file
+ * Fast reader for text files containing tables of numbers.
+ */
+
+#include "tablereader.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#include <boost/iostreams/filter/bzip2.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+
+static const std::size_t BLOCK_SIZE = 1 << 20; ///< Number of bytes read from file at once
+static const std::size_t MAX_TOKEN_LENGTH = 256; ///< Numbers must not be longer than this, so they always fit completely into the buffer when parsed
+
+
+TTableReader::TTableReader(const boost::filesystem::path &filepath): file(filepath.string(), std::ifstream::in | std::ifstream::binary){
+	if (boost::filesystem::extension(filepath) == ".bz2"){
+		stream.push(boost::iostreams::bzip2_decompressor());
+	}
+	else if (boost::filesystem::extension(filepath) == ".gz"){
+		stream.push(boost::iostreams::gzip_decompressor());
+	}
+	stream.push(file);
+	if (!file.is_open() or !stream.is_complete()){
+		throw std::runtime_error("Could not open " + filepath.string());
+	}
+	buffer.resize(BLOCK_SIZE + MAX_TOKEN_LENGTH + 1);
+	buffer[0] = 0;
+}
+
+
+bool TTableReader::Fill(const std::size_t minimum){
+	if (end - pos >= minimum)
+		return true;
+	if (not eof){
+		std::memmove(&buffer[0], &buffer[pos], end - pos); // move unread data to front of buffer and append next block
+		end -= pos;
+		pos = 0;
+		while (not eof and end < minimum){
+			stream.read(&buffer[end], buffer.size() - 1 - end);
+			end += stream.gcount();
+			if (!stream)
+				eof = true;
+		}
+		buffer[end] = 0;
+	}
+	return end > pos;
+}
+
+
+bool TTableReader::Skip(const bool newlines, const bool commas){
+	while (Fill(1)){
+		char c = buffer[pos];
+		if (c == '\n'){
+			if (not newlines)
+				return false;
+			++line;
+		}
+		else if (not (c == ' ' or c == '\t' or c == '\r' or c == '\v' or c == '\f' or (commas and c == ',')))
+			return true;
+		++pos;
+	}
+	return false;
+}
+
+
+bool TTableReader::Parse(double &value){
+	Fill(MAX_TOKEN_LENGTH);
+	const char *start = &buffer[pos];
+	char *stop;
+	value = std::strtod(start, &stop);
+	if (stop == start)
+		return false;
+	pos += stop - start;
+	return true;
+}
+
+
+bool TTableReader::ReadNumber(double &value){
+	return Skip(true, false) and Parse(value);
+}
+
+
+bool TTableReader::ReadNumberInLine(double &value){
+	return Skip(false, true) and Parse(value);
+}
+
+
+bool TTableReader::ReadLine(std::string &str){
+	str.clear();
+	if (not Fill(1))
+		return false;
+	while (Fill(1)){
+		const char *start = &buffer[pos];
+		const char *newline = static_cast<const char*>(std::memchr(start, '\n', end - pos));
+		if (newline != nullptr){
+			str.append(start, newline);
+			pos += newline - start + 1;
+			++line;
+			return true;
+		}
+		str.append(start, end - pos);
+		pos = end;
+	}
+	return true;
+}
+
+
+bool TTableReader::SkipEmptyLines(){
+	return Skip(true, false);
+}
+
+
+char TTableReader::Peek(){
+	return Fill(1) ? buffer[pos] : 0;
+}
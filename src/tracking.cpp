@@ -3,30 +3,285 @@
 //
 
 #include <sstream>
+#include <atomic>
 #include <random>
+#include <chrono>
+#include <ctime>
 #include <boost/format.hpp>
 
 #include "tracking.h"
+#include "source.h"
+#include "profiler.h"
+#include "querytrace.h"
 
 using namespace std;
 
-TTracker::TTracker(TConfig& config){
-    logger = CreateLogger(config);
+/**
+ * CPU time used by the calling thread [s]
+ */
+static double ThreadCPUTime(){
+    timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return t.tv_sec + 1e-9*t.tv_nsec;
 }
 
-void TTracker::IntegrateParticle(std::unique_ptr<TParticle>& p, const double tmax, std::map<std::string, std::string> &particleconf,
-        TMCGenerator &mc, const TGeometry &geom, const TFieldManager &field){
-    double tau = 0;
-    istringstream(particleconf["tau"]) >> tau;
-    if (tau > 0){
-        exponential_distribution<double> expdist(1./tau);
-        tau = expdist(mc);
+static atomic<int> busythreads(0); ///< Number of threads of this process that are tracking particles or integrating parareal slices
+
+/**
+ * Counts the thread creating it in busythreads as long as it exists
+ */
+struct TBusyThread{
+    TBusyThread(){ ++busythreads; } ///< Constructor, counts thread as busy
+    ~TBusyThread(){ --busythreads; } ///< Destructor, counts thread as idle
+};
+
+/**
+ * Read a particle-specific option, keeping its default if it is missing or empty
+ *
+ * @param particleconf Option map containing particle specific options
+ * @param name Name of option
+ * @param value Returns value of option
+ */
+template<typename T>
+static void ReadOption(const std::map<std::string, std::string> &particleconf, const std::string &name, T &value){
+    auto option = particleconf.find(name);
+    if (option == particleconf.end() || option->second.find_first_not_of(" \t\r") == string::npos)
+        return;
+    istringstream ss(option->second);
+    if (!(ss >> value))
+        throw std::runtime_error("Could not read option " + name + ":" + option->second);
+}
+
+TSpinOptions::TSpinOptions(const std::map<std::string, std::string> &particleconf){
+    ReadOption(particleconf, "flipspin", flipspin);
+    ReadOption(particleconf, "interpolatefields", interpolatefields);
+
+    string spinintegrator = "dopri5";
+    ReadOption(particleconf, "spinintegrator", spinintegrator);
+    if (spinintegrator != "dopri5" && spinintegrator != "magnus" && spinintegrator != "rwa")
+        throw std::runtime_error("Unknown spinintegrator " + spinintegrator + "! Use dopri5, magnus, or rwa.");
+    magnus = spinintegrator == "magnus";
+    rwa = spinintegrator == "rwa";
+
+    ReadOption(particleconf, "Bmax", Bmax);
+    ReadOption(particleconf, "spinadiabaticity", adiabaticity);
+    if (adiabaticity < 0)
+        throw std::runtime_error("Option spinadiabaticity has to be >= 0!");
+    auto option = particleconf.find("spintimes");
+    if (option != particleconf.end()){
+        istringstream spintimes(option->second);
+        double t;
+        while (spintimes >> t)
+            times.push_back(t);
+        if (!spintimes.eof())
+            throw std::runtime_error("Could not read option spintimes:" + option->second);
+    }
+}
+
+TIntegratorOptions::TIntegratorOptions(const std::map<std::string, std::string> &particleconf){
+    string integrator = "dopri5";
+    ReadOption(particleconf, "integrator", integrator);
+    if (integrator == "rkf78")
+        method = TStepper::RKF78;
+    else if (integrator == "bulirschstoer")
+        method = TStepper::BULIRSCHSTOER;
+    else if (integrator == "rk4")
+        method = TStepper::RK4;
+    else if (integrator == "freemolecular")
+        method = TStepper::FREEMOLECULAR;
+    else if (integrator == "boris")
+        method = TStepper::BORIS;
+    else if (integrator == "guidingcenter")
+        method = TStepper::GUIDINGCENTER;
+    else if (integrator != "dopri5")
+        throw std::runtime_error("Unknown integrator " + integrator + "! Use dopri5, rkf78, bulirschstoer, rk4, boris, guidingcenter, or freemolecular.");
+    ReadOption(particleconf, "abstol", abstol);
+    ReadOption(particleconf, "reltol", reltol);
+    ReadOption(particleconf, "borissteps", borissteps);
+    ReadOption(particleconf, "gcadiabaticity", gcadiabaticity);
+    ReadOption(particleconf, "gcwalldistance", gcwalldistance);
+    ReadOption(particleconf, "ballistic", ballistic);
+    if (abstol <= 0 || reltol <= 0)
+        throw std::runtime_error("Integrator tolerances abstol and reltol have to be larger than zero!");
+    if (borissteps <= 0)
+        throw std::runtime_error("borissteps has to be larger than zero!");
+}
+
+TParticleOptions::TParticleOptions(const std::map<std::string, std::string> &particleconf): integrator(particleconf), spin(particleconf){
+    ReadOption(particleconf, "tau", tau);
+    ReadOption(particleconf, "tmax", tmax);
+    ReadOption(particleconf, "lmax", lmax);
+    ReadOption(particleconf, "maxcputime", maxcputime);
+    ReadOption(particleconf, "maxsteps", maxsteps);
+    ReadOption(particleconf, "maxhits", maxhits);
+    ReadOption(particleconf, "fatehits", fatehits);
+    ReadOption(particleconf, "fatetime", fatetime);
+    ReadOption(particleconf, "batchsize", batchsize);
+    ReadOption(particleconf, "parareal", parareal);
+    ReadOption(particleconf, "pararealtol", pararealtol);
+    ReadOption(particleconf, "pararealcoarsetol", pararealcoarsetol);
+    auto energymonitor = particleconf.find("energymonitor");
+    if (energymonitor != particleconf.end() && energymonitor->second.find_first_not_of(" \t\r") != string::npos){
+        istringstream ss(energymonitor->second);
+        string mode;
+        ss >> mode;
+        if (mode == "exact")
+            energyinterval = 1;
+        else if (mode == "off")
+            energyinterval = 0;
+        else if (mode != "sampled" || !(ss >> energyinterval) || energyinterval == 0)
+            throw std::runtime_error("Could not read option energymonitor:" + energymonitor->second + "! Use exact, sampled <steps>, or off.");
+    }
+    if (tau < 0 || tmax < 0 || lmax < 0)
+        throw std::runtime_error("tau, tmax, and lmax must not be negative!");
+    if (maxcputime < 0 || maxsteps < 0 || maxhits < 0)
+        throw std::runtime_error("maxcputime, maxsteps, and maxhits must not be negative!");
+    if (fatehits < 0 || fatetime < 0)
+        throw std::runtime_error("fatehits and fatetime must not be negative!");
+    if (parareal > 1){
+        if (!(pararealtol > 0) || !(pararealcoarsetol > 0))
+            throw std::runtime_error("pararealtol and pararealcoarsetol have to be larger than zero!");
+        if (!spin.times.empty() || spin.adiabaticity > 0) // the spin would have to be integrated along the whole trajectory, one slice after the other
+            throw std::runtime_error("Parareal integration cannot be combined with spin integration (spintimes or spinadiabaticity)!");
+        if (integrator.method == TStepper::FREEMOLECULAR)
+            throw std::runtime_error("Parareal integration cannot be used with the freemolecular integrator!");
+        bool snapshotlog = false, tracklog = false, trajectorylog = false;
+        string snapshots;
+        ReadOption(particleconf, "snapshotlog", snapshotlog);
+        ReadOption(particleconf, "snapshots", snapshots);
+        ReadOption(particleconf, "tracklog", tracklog);
+        ReadOption(particleconf, "trajectorylog", trajectorylog);
+        if ((snapshotlog && !snapshots.empty()) || tracklog || trajectorylog) // the steps within the advanced slices are not logged
+            throw std::runtime_error("Parareal integration cannot be combined with snapshots, tracklog, or trajectorylog!");
+        if (fatehits > 0 || fatetime > 0) // the fate would be sampled from the rates of the advanced slices, which are not known
+            throw std::runtime_error("Parareal integration cannot be combined with fate sampling (fatehits or fatetime)!");
+    }
+}
+
+TToleranceRegion::TToleranceRegion(const std::string &aname, const std::string &definition): name(aname){
+    istringstream ss(definition);
+    string typestr;
+    ss >> typestr;
+    if (typestr == "solid"){
+        type = SOLID;
+        ss >> solidID;
+    }
+    else if (typestr == "box"){
+        type = BOX;
+        ss >> min[0] >> min[1] >> min[2] >> max[0] >> max[1] >> max[2];
     }
+    else if (typestr == "nearwall")
+        type = NEARWALL;
+    else if (typestr == "gradient")
+        type = GRADIENT;
     else
-        istringstream(particleconf["tmax"]) >> tau;
+        throw std::runtime_error("Unknown type " + typestr + " of tolerance region " + name + "! Use solid, box, nearwall, or gradient.");
+    if (type == NEARWALL || type == GRADIENT)
+        ss >> limit;
+    if (!(ss >> abstol >> reltol >> maxdeviation))
+        throw std::runtime_error("Could not read tolerance region " + name + ":" + definition);
+    if (!(abstol > 0) || !(reltol > 0) || !(maxdeviation > 0))
+        throw std::runtime_error("Tolerances and max. deviation of tolerance region " + name + " have to be larger than zero!");
+    for (int i = 0; i < 3; ++i){
+        if (min[i] > max[i])
+            std::swap(min[i], max[i]);
+    }
+}
 
-    double maxtraj;
-    istringstream(particleconf["lmax"]) >> maxtraj;
+bool TToleranceRegion::Contains(const double p[3], const solid &currentsolid, const TRegionMap *map) const{
+    switch (type){
+        case SOLID:
+            return currentsolid.ID == solidID;
+        case BOX:
+            return p[0] >= min[0] && p[0] <= max[0] && p[1] >= min[1] && p[1] <= max[1] && p[2] >= min[2] && p[2] <= max[2];
+        case NEARWALL:
+            return map->WallDistance(p) < limit;
+        case GRADIENT:{
+            const TRegionMap::TVoxel *voxel = map->Find(p);
+            return voxel != nullptr && voxel->gradB > limit;
+        }
+    }
+    return false;
+}
+
+TTracker::TTracker(TConfig& config, const int shard){
+    logger = CreateLogger(config, shard);
+
+    std::string collisioniteration = "bisection";
+    istringstream(config["GLOBAL"]["collisioniteration"]) >> collisioniteration;
+    if (collisioniteration == "rootfinding")
+        rootfinding = true;
+    else if (collisioniteration != "bisection")
+        throw std::runtime_error("Unknown collisioniteration " + collisioniteration + "! Use bisection or rootfinding.");
+    istringstream(config["GLOBAL"]["checkpoint"]) >> checkpoint;
+    int trackedsecondaries = 1;
+    istringstream(config["GLOBAL"]["secondaries"]) >> trackedsecondaries;
+    secondaries = trackedsecondaries == 1;
+    istringstream(config["GLOBAL"]["fieldprefetch"]) >> fieldprefetch;
+    istringstream(config["GLOBAL"]["adjoint"]) >> adjoint;
+    istringstream(config["GLOBAL"]["nthreads"]) >> nthreads;
+    nthreads = max(nthreads, 1);
+    if (adjoint) // decay products have no meaning in backward tracking
+        secondaries = false;
+
+    map<string, TToleranceRegion> toleranceregions;
+    for (auto &section: config){ // TOLERANCES section is optional
+        if (section.first == "TOLERANCES"){
+            for (auto &entry: section.second)
+                toleranceregions.emplace(entry.first, TToleranceRegion(entry.first, entry.second));
+        }
+    }
+    for (string particlename: {"neutron", "proton", "electron", "mercury", "xenon"}){
+        TParticleOptions options(config[particlename]);
+        istringstream regionnames(config[particlename]["tolerancemap"]);
+        string regionname;
+        while (regionnames >> regionname){
+            auto region = toleranceregions.find(regionname);
+            if (region == toleranceregions.end())
+                throw std::runtime_error("Tolerance region " + regionname + " of " + particlename + " is not defined in the TOLERANCES section!");
+            options.tolerancemap.push_back(region->second);
+        }
+        particleoptions.emplace(particlename, options);
+    }
+}
+
+const TParticleOptions& TTracker::GetParticleOptions(const std::string &particlename) const{
+    auto options = particleoptions.find(particlename);
+    if (options == particleoptions.end())
+        throw std::runtime_error("No options for particle type " + particlename + "!");
+    return options->second;
+}
+
+void TTracker::IntegrateParticle(std::unique_ptr<TParticle>& p, const double tmax, TMCGenerator &mc, const TGeometry &geom, const TFieldManager &field){
+    TBusyThread busy;
+    PROFILE_PARTICLE(p->GetName(), p->GetParticleNumber());
+    TQueryTraceParticle querytraceparticle(p->GetParticleNumber());
+    cost = &p->TrackingCost();
+    chrono::steady_clock::time_point trackingstart = chrono::steady_clock::now();
+    double cpustart = ThreadCPUTime();
+    auto addwalltime = [&](){ // add time since last call to tracking cost
+        chrono::steady_clock::time_point now = chrono::steady_clock::now();
+        double cpunow = ThreadCPUTime();
+        cost->walltime += chrono::duration<double>(now - trackingstart).count();
+        cost->cputime += cpunow - cpustart;
+        trackingstart = now;
+        cpustart = cpunow;
+    };
+
+    if (adjoint && p->GetCharge() != 0)
+        throw std::runtime_error("Adjoint tracking cannot be used for charged particles!");
+    p->SetAdjoint(adjoint);
+
+    const TParticleOptions &options = GetParticleOptions(p->GetName());
+    double tau = InitStopProperTime(p, options, mc);
+    energyinterval = options.energyinterval;
+
+    const double maxtraj = options.lmax;
+
+    const double maxcputime = options.maxcputime; // budgets stopping particles stuck in pathological trajectories (0: unlimited)
+    const int maxsteps = options.maxsteps, maxhits = options.maxhits;
+    const int fatehits = options.fatehits; // warm-up after which the remaining fate is sampled (0: never)
+    const double fatetime = options.fatetime;
 
 //	cout << "Particle no.: " << particlenumber << " particle type: " << name << '\n';
 //	cout << "x: " << yend[0] << "m y: " << yend[1] << "m z: " << yend[2]
@@ -42,43 +297,99 @@ void TTracker::IntegrateParticle(std::unique_ptr<TParticle>& p, const double tma
 
     logger->PrintTrack(p, x, y, x, y, p->GetFinalSpin(), p->GetFinalSolid(), field);
 
-    bool flipspin = false;
-    istringstream(particleconf["flipspin"]) >> flipspin;
-
-    bool spininterpolatefields = false;
-    istringstream(particleconf["interpolatefields"]) >> spininterpolatefields;
+    const TSpinOptions &spinoptions = options.spin;
+    spin_state_type spin = p->GetFinalSpin();
 
-    double SpinBmax = 0;
-    vector<double> SpinTimes;
-    istringstream(particleconf["Bmax"]) >> SpinBmax;
-    istringstream SpinTimess(particleconf["spintimes"]);
-    do{
-        double t;
-        SpinTimess >> t;
-        if (SpinTimess)
-            SpinTimes.push_back(t);
-    }while(SpinTimess.good());
-    state_type spin = p->GetFinalSpin();
-
-    dense_stepper_type stepper = boost::numeric::odeint::make_dense_output(1e-9, 1e-9, stepper_type());
+    const TIntegratorOptions &integrator = options.integrator;
+    for (const TToleranceRegion &region: options.tolerancemap){
+        if ((region.type == TToleranceRegion::NEARWALL || region.type == TToleranceRegion::GRADIENT) && regionmap == nullptr)
+            throw std::runtime_error("Tolerance region " + region.name + " needs a region map, set the GLOBAL option regionmap!");
+    }
+    const TToleranceRegion *toleranceregion = nullptr; // region of the tolerance map the particle is in (nullptr: none, the particle's own tolerances apply)
+    trackdeviation = MAX_TRACK_DEVIATION;
+    if (integrator.method == TStepper::FREEMOLECULAR && p->GetCharge() != 0)
+        throw std::runtime_error("Free-molecular tracking ignores fields and cannot be used for charged particles!");
+    TStepper stepper(integrator.method, integrator.abstol, integrator.reltol, integrator.borissteps, integrator.gcadiabaticity, integrator.gcwalldistance, &geom, integrator.ballistic);
     stepper.initialize(y, x, 10.*MAX_TRACK_DEVIATION/sqrt(y[3]*y[3] + y[4]*y[4] + y[5]*y[5])); // initialize stepper with fixed spatial length
 
 //	progress_display progress(100, cout, ' ' + to_string(particlenumber) + ' ');
 
-    currentsolids = geom.GetSolids(x, &y[0]);
+    currentsolids = p->GetStartSolids().empty() ? geom.GetSolids(x, &y[0]) : p->GetStartSolids(); // surface sources already know on which side of which surface the particle starts
+    UpdateCurrentsolid();
+    double importance = GetCurrentsolid().importance;
+    unsigned solidID = GetCurrentsolid().ID;
     p->SetStopID(ID_UNKNOWN);
+    safetyradius = 0;
+    collisioncache.valid = false;
+    transferentry = nullptr; // passes through recorded guide sections are not continued after an interruption
+
+    unsigned long pararealsteps = 0; // steps of parareal slices count toward the step budget like the particle's own steps
+    auto exceed = [&](const TDiagnostic code, const double budget){
+        p->SetStopID(ID_BUDGET_EXCEEDED);
+        addwalltime();
+        logger->PrintDiagnostic(p, code, x, y, GetCurrentsolid(), budget);
+    };
+    auto checkbudgets = [&](){ // stop particles stuck in pathological trajectories when they exceed their budget
+        if (maxsteps > 0 && p->GetNumberOfSteps() + pararealsteps >= static_cast<unsigned long>(maxsteps))
+            exceed(DIAG_STEP_BUDGET, maxsteps);
+        else if (maxhits > 0 && p->GetNumberOfHits() >= maxhits)
+            exceed(DIAG_HIT_BUDGET, maxhits);
+        else if (maxcputime > 0 && cost->cputime + ThreadCPUTime() - cpustart >= maxcputime)
+            exceed(DIAG_CPUTIME_BUDGET, maxcputime);
+    };
+
+    if (options.parareal > 1 && geom.GetLatticeDimension() == 0 && GetCurrentsolid().mat.FermiImag == 0){ // long trajectory in vacuum, advance it in slices integrated in parallel
+        value_type x0 = x;
+        state_type y0 = y;
+        const long stepbudget = maxsteps > 0 ? maxsteps - p->GetNumberOfSteps() : numeric_limits<long>::max();
+        const double cpubudget = maxcputime > 0 ? maxcputime - (cost->cputime + ThreadCPUTime() - cpustart) : numeric_limits<double>::infinity();
+        if (AdvanceParareal(p, x, y, tmax, tau, options, geom, field, stepbudget, cpubudget, pararealsteps)){
+            TStepper jump(TStepper::RK4); // holds the advanced slices as a single step, so the spin follows the magnetic field from their start to their end
+            jump.set_step(x0, y0, x, y);
+            IntegrateSpin(p, spin, jump, x, y, spinoptions.times, field, spinoptions.interpolatefields, spinoptions.magnus, spinoptions.rwa, spinoptions.Bmax, spinoptions.adiabaticity, mc, spinoptions.flipspin);
+            logger->PrintTrack(p, x0, y0, x, y, spin, GetCurrentsolid(), field, true);
+            stepper.initialize(y, x, 10.*MAX_TRACK_DEVIATION/sqrt(y[3]*y[3] + y[4]*y[4] + y[5]*y[5]));
+        }
+        checkbudgets();
+    }
 
     while (p->GetStopID() == ID_UNKNOWN){ // integrate as long as nothing happened to particle
+        if (quit.load() || suspendtracking.load()){ // interrupted between two steps, store state so tracking can be continued later
+            p->SetFinalState(x, y, spin, GetCurrentsolid());
+            addwalltime();
+            return;
+        }
         if (resetintegration){
-            stepper.initialize(y, x, stepper.current_time_step()); // (re-)start integration with last step size
+            stepper.restart(y, x); // continue integration with last step size
+        }
+        if (!options.tolerancemap.empty()){ // change tolerances when the particle crossed into another region of its tolerance map
+            const TToleranceRegion *region = nullptr;
+            for (const TToleranceRegion &r: options.tolerancemap){
+                if (r.Contains(&y[0], GetCurrentsolid(), regionmap)){
+                    region = &r;
+                    break;
+                }
+            }
+            if (region != toleranceregion){
+                toleranceregion = region;
+                stepper.set_tolerances(region ? region->abstol : integrator.abstol, region ? region->reltol : integrator.reltol, y, x);
+                trackdeviation = region ? region->maxdeviation : MAX_TRACK_DEVIATION;
+                PROFILE_REGION(region ? region->name : "");
+            }
         }
         value_type x1 = x; // save point before next step
         state_type y1 = y;
 
         try{
-            stepper.do_step(std::bind(&TParticle::derivs, p.get(), std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, &field));
+            PROFILE(PROFILE_DO_STEP);
+            stepper.do_step(*p, field);
             x = stepper.current_time();
             y = stepper.current_state();
+            ++cost->steps;
+            cost->stepsum += x - x1;
+            cost->minstep = min(cost->minstep, x - x1);
+            if (fieldprefetch) // next step will probably be as long as this one, load the field-table cells along it while collisions are checked
+                field.Prefetch(y[0], y[1], y[2], y[0] + y[3]*(x - x1), y[1] + y[4]*(x - x1), y[2] + y[5]*(x - x1));
         }
         catch(...){ // catch Exceptions thrown by odeint
             p->SetStopID(ID_ODEINT_ERROR);
@@ -93,18 +404,30 @@ void TTracker::IntegrateParticle(std::unique_ptr<TParticle>& p, const double tma
             stepper.calc_state(x, y);
         }
 
-        while (x1 < x){ // split integration step in pieces (x1,y1->x2,y2) to reduce chord length, go through all pieces
-            if (quit.load())
-                return;
+        collisionfreetime = -numeric_limits<value_type>::infinity();
+        double stepdev2 = 0.25*(pow(y[8] - y1[8], 2) - pow(y[0] - y1[0], 2) - pow(y[1] - y1[1], 2) - pow(y[2] - y1[2], 2));
+        if (stepdev2 > trackdeviation*trackdeviation){ // step will be split into chords, check once whether the whole curved path is far from any surface
+            // the path lies in an ellipsoid with foci at start and end point, contained in their bounding box extended by the max. deviation
+            double dev = sqrt(stepdev2) + REFLECT_TOLERANCE;
+            double boxmin[3], boxmax[3];
+            for (int i = 0; i < 3; ++i){
+                boxmin[i] = min(y1[i], y[i]) - dev;
+                boxmax[i] = max(y1[i], y[i]) + dev;
+            }
+            if (not geom.BoxContainsSurface(boxmin, boxmax))
+                collisionfreetime = x;
+        }
 
+        const int hits = p->GetNumberOfHits();
+        while (x1 < x){ // split integration step in pieces (x1,y1->x2,y2) to reduce chord length, go through all pieces
             double l2 = pow(y[8] - y1[8], 2); // actual length of step squared
             double d2 = pow(y[0] - y1[0], 2) + pow(y[1] - y1[1], 2) + pow(y[2] - y1[2], 2); // length of straight line between start and end point of step squared
             double dev2 = 0.25*(l2 - d2); // max. possible squared deviation of real path from straight line
             value_type x2 = x;
             state_type y2 = y;
-            if (dev2 > MAX_TRACK_DEVIATION*MAX_TRACK_DEVIATION){ // if deviation is larger than MAX_TRACK_DEVIATION
+            if (dev2 > trackdeviation*trackdeviation){ // if deviation is larger than max. deviation in current tolerance region
 //				cout << "split " << x - x1 << " " << sqrt(l2) << " " << sqrt(d2) << " " << sqrt(dev2) << "\n";
-                x2 = x1 + (x - x1)/ceil(sqrt(dev2)/MAX_TRACK_DEVIATION); // split step to reduce deviation
+                x2 = x1 + (x - x1)/ceil(sqrt(dev2)/trackdeviation); // split step to reduce deviation
                 stepper.calc_state(x2, y2);
                 assert(x2 <= x);
             }
@@ -112,7 +435,14 @@ void TTracker::IntegrateParticle(std::unique_ptr<TParticle>& p, const double tma
 //			d2 = pow(y2[0] - y1[0], 2) + pow(y2[1] - y1[1], 2) + pow(y2[2] - y1[2], 2);
 //			cout << x2 - x1 << " " << sqrt(l2) << " " << sqrt(d2) << " " << 0.5*sqrt(l2 - d2) << "\n";
 
+            unsigned cellaxis = 0;
+            int celldirection = 0;
+            const bool leavescell = geom.GetLatticeDimension() > 0 && FindCellExit(x1, y1, x2, y2, stepper, geom, cellaxis, celldirection); // end chord where it leaves the periodic unit cell
             resetintegration = CheckHit(p, x1, y1, x2, y2, stepper, mc, geom, field); // check if particle hit a material boundary or was absorbed between y1 and y2
+            if (leavescell && !resetintegration && p->GetStopID() == ID_UNKNOWN){ // particle re-enters the unit cell through the opposite face
+                CrossCell(p, x2, y2, cellaxis, celldirection, geom);
+                resetintegration = true;
+            }
             if (resetintegration){
                 x = x2; // if particle path was changed: reset integration end point
                 y = y2;
@@ -123,28 +453,63 @@ void TTracker::IntegrateParticle(std::unique_ptr<TParticle>& p, const double tma
         }
 
         // take snapshots at certain times
-        logger->PrintSnapshot(p, stepper.previous_time(), stepper.previous_state(), x, y, spin, stepper, geom, field);
+        const bool snapshot = logger->PrintSnapshot(p, stepper.previous_time(), stepper.previous_state(), x, y, spin, stepper, geom, field);
 
-        IntegrateSpin(p, spin, stepper, x, y, SpinTimes, field, spininterpolatefields, SpinBmax, mc, flipspin); // calculate spin precession and spin-flip probability
+        logger->PrintTrajectory(p, stepper, x, y);
 
-        logger->PrintTrack(p, stepper.previous_time(), stepper.previous_state(), x, y, spin, GetCurrentsolid(), field);
+        IntegrateSpin(p, spin, stepper, x, y, spinoptions.times, field, spinoptions.interpolatefields, spinoptions.magnus, spinoptions.rwa, spinoptions.Bmax, spinoptions.adiabaticity, mc, spinoptions.flipspin); // calculate spin precession and spin-flip probability
+
+        logger->PrintTrack(p, stepper.previous_time(), stepper.previous_state(), x, y, spin, GetCurrentsolid(), field, snapshot || p->GetNumberOfHits() != hits); // track simplification keeps ends of steps with hits or snapshots
 
 //		progress += 100*max(y[6]/tau, max((x - tstart)/(tmax - tstart), y[8]/maxtraj)) - progress.count();
 
+        if (p->GetStopID() == ID_UNKNOWN && GetCurrentsolid().ID != solidID && DoTransfer(p, x, y, tmax, tau, mc, geom)){ // particle jumped to the exit of a guide section
+            resetintegration = true;
+            safetyradius = 0;
+            collisioncache.valid = false;
+        }
+        const solid &currentsolid = GetCurrentsolid();
+        if (p->GetStopID() == ID_UNKNOWN && currentsolid.ID != solidID && currentsolid.record){ // particle entered solid marked in PHASESPACE section during this step, recorded before it is split by its importance
+            logger->PrintPhaseSpace(p, x, y, spin);
+            if (currentsolid.stoprecorded)
+                p->SetStopID(ID_RECORDED);
+        }
+        solidID = currentsolid.ID;
+
+        double newimportance = GetCurrentsolid().importance;
+        if (p->GetStopID() == ID_UNKNOWN && newimportance != importance){ // particle entered region with different importance
+            ChangeImportance(p, newimportance/importance, x, y, spin, mc, geom, field);
+            importance = newimportance;
+        }
+
         if (p->GetStopID() == ID_UNKNOWN && y[6] >= tau) // proper time >= tau?
             p->SetStopID(ID_DECAYED);
         else if (p->GetStopID() == ID_UNKNOWN && (x >= tmax || y[8] >= maxtraj)) // time > tmax or trajectory length > max length?
             p->SetStopID(ID_NOT_FINISH);
+
+        if (p->GetStopID() == ID_UNKNOWN)
+            checkbudgets();
+
+        if (p->GetStopID() == ID_UNKNOWN && transferentry == nullptr &&
+                ((fatehits > 0 && p->GetNumberOfHits() >= fatehits) || (fatetime > 0 && x - p->GetInitialTime() >= fatetime)))
+            SampleFate(p, x, y, tmax, tau, maxtraj, mc);
     }
 
+    PROFILE_REGION(""); // decay and logging are not attributed to the last tolerance region
+
 //	cout << "Done" << endl;
 
-    if (p->GetStopID() == ID_DECAYED){ // if particle reached its lifetime call TParticle::Decay
+    if (p->GetStopID() == ID_DECAYED && secondaries){ // if particle reached its lifetime call TParticle::Decay, its decay products are neither logged nor tracked otherwise
 //		cout << "Decayed!\n";
         p->DoDecay(x, y, mc, geom, field);
     }
 
+    if (transferentry != nullptr && p->GetStopID() != ID_NOT_FINISH) // particle stopped in a recorded guide section, particles reaching tmax are not a property of the section
+        logger->PrintTransfer(p, transferentry->ID, transferx, transfery, transferweight, x, y, p->GetStopID());
+    transferentry = nullptr;
+
     p->SetFinalState(x, y, spin, GetCurrentsolid());
+    addwalltime();
     logger->Print(p, x, y, spin, geom, field);
 
 
@@ -163,8 +528,114 @@ void TTracker::IntegrateParticle(std::unique_ptr<TParticle>& p, const double tma
 }
 
 
+bool TTracker::DoTransfer(const std::unique_ptr<TParticle>& p, value_type &x, state_type &y, const double tmax, const double tau, TMCGenerator &mc, const TGeometry &geom){
+    const solid &entered = GetCurrentsolid();
+    if (transferentry != nullptr && (entered.ID == transferentry->transferexit || entered.ID == transferentry->ID)){ // particle left recorded section through its exit, or returned to its entrance
+        logger->PrintTransfer(p, transferentry->ID, transferx, transfery, transferweight, x, y, 0);
+        transferentry = nullptr;
+    }
+    if (entered.transferexit == 0)
+        return false;
+    if (not entered.transfer){ // start recording section
+        transferentry = &entered;
+        transferx = x;
+        transfery = y;
+        transferweight = p->GetStatisticalWeight();
+        return false;
+    }
+
+    const TTransferRecord *r = entered.transfer->Sample(&y[3], mc);
+    if (r == nullptr || x + r->delay >= tmax || y[6] + r->propertime >= tau) // track particle through the section instead
+        return false;
+    x += r->delay;
+    y[0] = r->x;
+    y[1] = r->y;
+    y[2] = r->z;
+    y[3] = r->exitvx;
+    y[4] = r->exitvy;
+    y[5] = r->exitvz;
+    y[6] += r->propertime;
+    y[8] += r->length;
+    p->SetStatisticalWeight(p->GetStatisticalWeight()*r->weightratio);
+    if (r->stopID != 0)
+        p->SetStopID(static_cast<stopID>(r->stopID));
+    currentsolids = geom.GetSolids(x, &y[0]);
+    UpdateCurrentsolid();
+    return true;
+}
+
+
+bool TTracker::FindCellExit(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const TStepper &stepper, const TGeometry &geom,
+                            unsigned &axis, int &direction) const{
+    double s = numeric_limits<double>::infinity(), face = 0;
+    for (unsigned i = 0; i < geom.GetLatticeDimension(); ++i){ // find face crossed first by straight segment
+        double f1 = geom.GetCellCoordinate(i, &y1[0]), f2 = geom.GetCellCoordinate(i, &y2[0]);
+        if (f2 >= 0 && f2 < 1)
+            continue;
+        double facei = f2 < 0 ? 0 : 1;
+        double si = f1 != f2 ? (facei - f1)/(f2 - f1) : 0; // negative if the start point already lies outside the cell, e.g. in a corner
+        if (si < s){
+            s = si;
+            axis = i;
+            face = facei;
+            direction = f2 < 0 ? -1 : 1;
+        }
+    }
+    if (std::isinf(s))
+        return false;
+
+    auto outside = [&](const state_type &y){ // distance of point from the face in units of the lattice vector, positive outside of cell
+        return direction*(geom.GetCellCoordinate(axis, &y[0]) - face);
+    };
+    value_type a = x1, b = x2;
+    state_type ya = y1, yc;
+    double fa = outside(y1), fb = outside(y2);
+    if (fa >= 0){ // start point already lies outside of cell, move particle before taking the step
+        x2 = x1;
+        y2 = y1;
+        return true;
+    }
+    int side = 0;
+    for (int iteration = 0; iteration < 100; ++iteration){
+        if (pow(y2[0] - ya[0], 2) + pow(y2[1] - ya[1], 2) + pow(y2[2] - ya[2], 2) < REFLECT_TOLERANCE*REFLECT_TOLERANCE || b - a < 4*(a + b)*numeric_limits<value_type>::epsilon())
+            break;
+        value_type c = (a*fb - b*fa)/(fb - fa);
+        stepper.calc_state(c, yc);
+        double fc = outside(yc);
+        if (fc >= 0){ // keep end point outside of cell, so the particle is moved inside the opposite face
+            b = c;
+            fb = fc;
+            y2 = yc;
+            if (side == -1)
+                fa *= 0.5; // Illinois modification, see find_collision_root
+            side = -1;
+        }
+        else{
+            a = c;
+            fa = fc;
+            ya = yc;
+            if (side == 1)
+                fb *= 0.5;
+            side = 1;
+        }
+    }
+    x2 = b;
+    return true;
+}
+
+
+void TTracker::CrossCell(const std::unique_ptr<TParticle>& p, const value_type x, state_type &y, const unsigned axis, const int direction, const TGeometry &geom){
+    geom.ShiftCell(&y[0], axis, -direction);
+    p->ChangeCell(axis, direction);
+    currentsolids = geom.GetSolids(x, &y[0]);
+    UpdateCurrentsolid();
+    safetyradius = 0;
+    collisioncache.valid = false;
+}
+
+
 bool TTracker::CheckHit(const std::unique_ptr<TParticle>& p, const value_type x1, const state_type &y1, value_type &x2, state_type &y2,
-        const dense_stepper_type &stepper, TMCGenerator &mc, const TGeometry &geom, const TFieldManager &field){
+        const TStepper &stepper, TMCGenerator &mc, const TGeometry &geom, const TFieldManager &field){
     if (!geom.CheckSegment(&y1[0], &y2[0])){ // check if start point is inside bounding box of the simulation geometry
 //    printf("\nParticle has hit outer boundaries: Stopping it! t=%g x=%g y=%g z=%g\n",x2,y2[0],y2[1],y2[2]);
         p->SetStopID(ID_HIT_BOUNDARIES);
@@ -173,12 +644,14 @@ bool TTracker::CheckHit(const std::unique_ptr<TParticle>& p, const value_type x1
     if (x2 == x1)
         return false;
 
-    solid currentsolid = GetCurrentsolid();
+    const solid &currentsolid = GetCurrentsolid();
+
+    if (x2 <= collisionfreetime || InSafetySphere(y1, y2, geom)) // segment is too far from any surface to collide, just check for absorption
+        return DoStep(p, x1, y1, x2, y2, stepper, currentsolid, mc, field);
 
-    multimap<TCollision, bool> colls;
     bool collfound = false;
     try{
-        collfound = geom.GetCollisions(x1, &y1[0], x2, &y2[0], colls);
+        collfound = CollisionQuery(x1, y1, x2, y2, collisions, geom);
     }
     catch(...){
         p->SetStopID(ID_CGAL_ERROR);
@@ -186,11 +659,19 @@ bool TTracker::CheckHit(const std::unique_ptr<TParticle>& p, const value_type x1
     }
 
     if (collfound){	// if there is a collision with a wall
+        safetyradius = 0; // particle will be close to a surface after this step
         value_type xc1 = x1, xc2 = x2;
-//    for (auto c: colls)
-//      cout << x1 << " " << x2 - x1 << " " << c.first.distnormal << " " << c.first.s << " " << c.first.ID << endl;
+//    for (auto c: collisions)
+//      cout << x1 << " " << x2 - x1 << " " << c.distnormal << " " << c.s << " " << c.ID << endl;
         state_type yc1 = y1, yc2 = y2;
-        if (iterate_collision(xc1, yc1, xc2, yc2, colls.begin()->first, stepper, geom)){
+        bool iterated;
+        if (rootfinding or stepper.free_flight())
+            iterated = find_collision_root(p, xc1, yc1, xc2, yc2, collisions.front(), stepper, geom);
+        else{
+            PROFILE(PROFILE_ITERATE_COLLISION);
+            iterated = iterate_collision(p, xc1, yc1, xc2, yc2, collisions.front(), stepper, geom);
+        }
+        if (iterated){
             if (xc1 > x1 && DoStep(p, x1, y1, xc1, yc1, stepper, currentsolid, mc, field)){
                 x2 = xc1;
                 y2 = yc1;
@@ -215,37 +696,68 @@ bool TTracker::CheckHit(const std::unique_ptr<TParticle>& p, const value_type x1
     return false;
 }
 
-bool TTracker::iterate_collision(value_type &x1, state_type &y1, value_type &x2, state_type &y2,
-        const TCollision &coll, const dense_stepper_type &stepper, const TGeometry &geom, unsigned int iteration){
+bool TTracker::InSafetySphere(const state_type &y1, const state_type &y2, const TGeometry &geom){
+    auto inside = [this](const state_type &y){
+        return pow(y[0] - safetycenter[0], 2) + pow(y[1] - safetycenter[1], 2) + pow(y[2] - safetycenter[2], 2) < safetyradius*safetyradius;
+    };
+    // the sphere is convex, so a segment with both ends inside cannot cross the surface
+    if (inside(y1) and inside(y2))
+        return true;
+    safetycenter = {y1[0], y1[1], y1[2]};
+    if (regionmap){ // try the precomputed lower bound first, it is usually large enough far from walls
+        safetyradius = regionmap->WallDistance(&y1[0]) - REFLECT_TOLERANCE;
+        if (inside(y2))
+            return true;
+    }
+    safetyradius = geom.GetSafetyDistance(&y1[0]) - REFLECT_TOLERANCE; // keep a margin to account for rounding in the collision test
+    if (safetyradius < 0)
+        safetyradius = 0;
+    return inside(y2);
+}
+
+bool TTracker::CollisionQuery(const value_type x1, const state_type &y1, const value_type x2, const state_type &y2,
+        std::vector<TCollision> &colls, const TGeometry &geom){
+    ++cost->collisionqueries;
+    return geom.GetCollisions(x1, &y1[0], x2, &y2[0], colls, collisioncache);
+}
+
+bool TTracker::iterate_collision(const std::unique_ptr<TParticle>& p, value_type &x1, state_type &y1, value_type &x2, state_type &y2,
+        const TCollision coll, const TStepper &stepper, const TGeometry &geom, unsigned int iteration){
+    ++cost->iterations;
     if (pow(y2[0] - y1[0], 2) + pow(y2[1] - y1[1], 2) + pow(y2[2] - y1[2], 2) < REFLECT_TOLERANCE*REFLECT_TOLERANCE){
+        PROFILE_DEPTH(iteration);
+        hitcollisions = collisions; // collisions of this segment were found by the caller, DoHit does not have to query them again
         return true; // successfully iterated collision point
     }
     if (x2 - x1 < 4*(x1 + x2)*numeric_limits<value_type>::epsilon()){
-        cout << "Collision point iteration limited by numerical precision.\n";
+        logger->PrintDiagnostic(p, DIAG_ITERATION_PRECISION, x1, y1, GetCurrentsolid(), x2 - x1);
+        PROFILE_DEPTH(iteration);
+        hitcollisions = collisions;
         return true;
     }
     if (iteration >= 100){
-        cout << "Collision point iteration reached max. iterations. " << x1 << " " << x2 - x1 << " " << coll.distnormal << " " << coll.s << "\n";
+        logger->PrintDiagnostic(p, DIAG_ITERATION_MAX, x1, y1, GetCurrentsolid(), x2 - x1);
+        PROFILE_DEPTH(iteration);
+        hitcollisions = collisions;
         return true;
     }
 
 //  value_type xc = x1 + (x2 - x1)*coll.s;
 //  if (xc == x1 || xc == x2)
     value_type xc = x1 + (x2 - x1)*0.5;
-    state_type yc(STATE_VARIABLES);
+    state_type yc;
     stepper.calc_state(xc, yc);
-    multimap<TCollision, bool> colls;
-    if (geom.GetCollisions(x1, &y1[0], xc, &yc[0], colls)){ // if collision in first segment, further iterate
+    if (CollisionQuery(x1, y1, xc, yc, collisions, geom)){ // if collision in first segment, further iterate
 //    cout << "1 " << x1 << " " << xc1 - x1 << endl;
-        if (iterate_collision(x1, y1, xc, yc, colls.begin()->first, stepper, geom, iteration + 1)){
+        if (iterate_collision(p, x1, y1, xc, yc, collisions.front(), stepper, geom, iteration + 1)){
             x2 = xc;
             y2 = yc;
             return true; // if successfully iterated
         }
     }
-    if (geom.GetCollisions(xc, &yc[0], x2, &y2[0], colls)){ // if collision in second segment, further iterate
+    if (CollisionQuery(xc, yc, x2, y2, collisions, geom)){ // if collision in second segment, further iterate
 //    cout << "2 " << xc1 << " " << xc2 - xc1 << endl;
-        if (iterate_collision(xc, yc, x2, y2, colls.begin()->first, stepper, geom, iteration + 1)){
+        if (iterate_collision(p, xc, yc, x2, y2, collisions.front(), stepper, geom, iteration + 1)){
             x1 = xc;
             y1 = yc;
             return true; // if successfully iterated
@@ -255,46 +767,108 @@ bool TTracker::iterate_collision(value_type &x1, state_type &y1, value_type &x2,
 }
 
 
-bool TTracker::DoStep(const std::unique_ptr<TParticle>& p, const value_type x1, const state_type &y1, value_type &x2, state_type &y2,
-        const dense_stepper_type &stepper, const solid &currentsolid, TMCGenerator &mc, const TFieldManager &field) {
-    value_type x2temp = x2;
-    state_type y2temp = y2;
-    p->DoStep(x1, y1, x2, y2, stepper, currentsolid, mc, field);
-    if (x2temp == x2 && y2temp == y2)
-        return false;
-    else{
-        return true;
+bool TTracker::find_collision_root(const std::unique_ptr<TParticle>& p, value_type &x1, state_type &y1, value_type &x2, state_type &y2,
+        const TCollision coll, const TStepper &stepper, const TGeometry &geom){
+    double cp[3]; // collision point on straight segment, lies in plane of hit triangle
+    for (int i = 0; i < 3; ++i)
+        cp[i] = y1[i] + coll.s*(y2[i] - y1[i]);
+    state_type y;
+    auto distance = [&](const value_type x){ // signed distance of trajectory to plane at time x
+        stepper.calc_state(x, y);
+        return (y[0] - cp[0])*coll.normal[0] + (y[1] - cp[1])*coll.normal[1] + (y[2] - cp[2])*coll.normal[2];
+    };
+
+    value_type a = x1, b = x2, c = x1;
+    double fa = (y1[0] - cp[0])*coll.normal[0] + (y1[1] - cp[1])*coll.normal[1] + (y1[2] - cp[2])*coll.normal[2];
+    double fb = (y2[0] - cp[0])*coll.normal[0] + (y2[1] - cp[1])*coll.normal[1] + (y2[2] - cp[2])*coll.normal[2];
+    if (fa*fb <= 0 and fa != fb){ // only iterate if plane is crossed between start and end of segment
+        int side = 0;
+        bool analytic = stepper.plane_crossing(x1, x2, cp, coll.normal, c); // ballistic trajectories cross the plane at an analytically known time
+        for (int iteration = 0; iteration < 100 and not analytic; ++iteration){
+            c = (a*fb - b*fa)/(fb - fa);
+            double fc = distance(c);
+            if (abs(fc) < 0.1*REFLECT_TOLERANCE)
+                break;
+            if (fc*fb > 0){
+                b = c;
+                fb = fc;
+                if (side == -1)
+                    fa *= 0.5; // Illinois modification, avoids slow convergence if the same end point is kept
+                side = -1;
+            }
+            else{
+                a = c;
+                fa = fc;
+                if (side == 1)
+                    fb *= 0.5;
+                side = 1;
+            }
+        }
+
+        // shrink segment around crossing to less than REFLECT_TOLERANCE
+        stepper.calc_state(c, y);
+        value_type dx = 0.25*REFLECT_TOLERANCE/sqrt(y[3]*y[3] + y[4]*y[4] + y[5]*y[5]);
+        value_type xa = max(x1, c - dx), xb = min(x2, c + dx);
+        state_type ya, yb;
+        stepper.calc_state(xa, ya);
+        stepper.calc_state(xb, yb);
+        if (xa == x1)
+            ya = y1;
+        if (xb == x2)
+            yb = y2;
+        // make sure that the trajectory did not hit anything before the short segment and that the segment contains a collision, whose list is kept for DoHit
+        if (pow(yb[0] - ya[0], 2) + pow(yb[1] - ya[1], 2) + pow(yb[2] - ya[2], 2) < REFLECT_TOLERANCE*REFLECT_TOLERANCE){
+            if ((xa == x1 or not CollisionQuery(x1, y1, xa, ya, collisions, geom))
+                and CollisionQuery(xa, ya, xb, yb, collisions, geom)){
+                x1 = xa;
+                y1 = ya;
+                x2 = xb;
+                y2 = yb;
+                hitcollisions = collisions;
+                return true;
+            }
+            CollisionQuery(x1, y1, x2, y2, collisions, geom); // iterate_collision expects the collisions of the whole segment
+        }
     }
+    return iterate_collision(p, x1, y1, x2, y2, coll, stepper, geom);
+}
+
+
+bool TTracker::DoStep(const std::unique_ptr<TParticle>& p, const value_type x1, const state_type &y1, value_type &x2, state_type &y2,
+        const TStepper &stepper, const solid &currentsolid, TMCGenerator &mc, const TFieldManager &field) {
+    bool changed = p->DoStep(x1, y1, x2, y2, stepper, currentsolid, mc, field, energyinterval) != EVENT_UNCHANGED;
+    logger->ScoreStep(p, y1, y2);
+    return changed;
 }
 
 bool TTracker::DoHit(const std::unique_ptr<TParticle>& p, const value_type x1, const state_type &y1, value_type &x2, state_type &y2,
-        const dense_stepper_type &stepper, TMCGenerator &mc, const TGeometry &geom) {
+        const TStepper &stepper, TMCGenerator &mc, const TGeometry &geom) {
+    PROFILE(PROFILE_DOHIT);
     bool trajectoryaltered = false, traversed = true;
 
-    multimap<TCollision, bool> colls;
-    if (!geom.GetCollisions(x1, &y1[0], x2, &y2[0], colls))
+    if (hitcollisions.empty())
         throw std::runtime_error("Called DoHit for a trajectory segment that does not contain a collision!");
 
-    vector<pair<solid, bool> > newsolids = currentsolids;
-    for (auto coll: colls){
-//    cout << x1 << " " << x2 - x1 << " " << coll.first.distnormal << " " << coll.first.s << " " << coll.first.ID << endl;
-        solid sld = geom.GetSolid(coll.first.ID);
-        auto foundsld = find_if(newsolids.begin(), newsolids.end(), [&sld](const std::pair<solid, bool> s){ return s.first.ID == sld.ID; });
-        if (coll.first.distnormal < 0){ // if entering solid
+    newsolids = currentsolids;
+    for (auto &coll: hitcollisions){
+//    cout << x1 << " " << x2 - x1 << " " << coll.distnormal << " " << coll.s << " " << coll.ID << endl;
+        const solid &sld = geom.GetSolid(coll.ID);
+        auto foundsld = find_if(newsolids.begin(), newsolids.end(), [&sld](const std::pair<const solid*, bool> &s){ return s.first == &sld; });
+        if (coll.distnormal < 0){ // if entering solid
             if (foundsld != newsolids.end()){ // if solid has been entered before (self-intersecting surface)
-//	cout << x1 << " " << x2 - x1 << " " << coll.first.distnormal << " " << coll.first.s << " " << sld.name << endl;
-                if (coll.first.s > 0) // if collision happened right at the start of the step it is likely that the hit solid was already added to the list in the previous step and we will ignore this one
-                    newsolids.push_back(make_pair(sld, foundsld->second)); // add additional entry to list, with ignore state as on first entry
+//	cout << x1 << " " << x2 - x1 << " " << coll.distnormal << " " << coll.s << " " << sld.name << endl;
+                if (coll.s > 0) // if collision happened right at the start of the step it is likely that the hit solid was already added to the list in the previous step and we will ignore this one
+                    newsolids.push_back(make_pair(&sld, foundsld->second)); // add additional entry to list, with ignore state as on first entry
             }
             else
-                newsolids.push_back(make_pair(sld, coll.second)); // add solid to list
+                newsolids.push_back(make_pair(&sld, coll.ignored)); // add solid to list
         }
-        else if (coll.first.distnormal > 0){ // if leaving solid
+        else if (coll.distnormal > 0){ // if leaving solid
             if (foundsld == newsolids.end()){ // if solid was not entered before something went wrong
-                if (coll.first.s > 0){ // if collision happened right at the start of the step it is likely that the hit solid was already removed from the list in the previous step and this is not an error
-//	  cout << x1 << " " << x2 - x1 << " " << coll.first.distnormal << " " << coll.first.s << " " << sld.name << endl;
+                if (coll.s > 0){ // if collision happened right at the start of the step it is likely that the hit solid was already removed from the list in the previous step and this is not an error
+//	  cout << x1 << " " << x2 - x1 << " " << coll.distnormal << " " << coll.s << " " << sld.name << endl;
 //          throw runtime_error((boost::format("Particle inside '%1%' which it did not enter before!") % sld.name).str());
-                    cout << "Particle inside solid " << sld.name << " which it did not enter before. Stopping it!\n";
+                    logger->PrintDiagnostic(p, DIAG_SOLID_NOT_ENTERED, x1, y1, GetCurrentsolid(), sld.ID);
                     p->SetStopID(ID_GEOMETRY_ERROR);
                     return true;
                 }
@@ -304,73 +878,668 @@ bool TTracker::DoHit(const std::unique_ptr<TParticle>& p, const value_type x1, c
         }
         else{
 //      throw runtime_error("Particle crossed surface with parallel track!");
-            cout << "Particle crossed surface with parallel track. Stopping it!\n";
+            logger->PrintDiagnostic(p, DIAG_PARALLEL_TRACK, x1, y1, GetCurrentsolid(), sld.ID);
             p->SetStopID(ID_GEOMETRY_ERROR);
             return true;
         }
     }
 
-    solid leaving = GetCurrentsolid(); // particle can only leave highest-priority solid
-    solid entering = geom.defaultsolid;
-    for (auto sld: newsolids){
-        if (!sld.second && sld.first.ID > entering.ID)
+    const solid &leaving = GetCurrentsolid(); // particle can only leave highest-priority solid
+    const solid *entering = &geom.GetSolid(geom.defaultsolid.ID);
+    for (auto &sld: newsolids){
+        if (!sld.second && sld.first->ID > entering->ID)
             entering = sld.first;
     }
 //  cout << "Leaving " << leaving.name << ", entering " << entering.name << '\n';
-    if (leaving.ID != entering.ID){ // if the particle actually traversed a material interface
-        auto coll = find_if(colls.begin(), colls.end(), [&leaving, &entering](const pair<TCollision, bool> &c){ return c.first.ID == leaving.ID or (c.first.ID == entering.ID and not c.second); });
-        if (coll == colls.end())
-            throw std::runtime_error((boost::format("Did not find collision going from %5% to %6%! t=%1%s, x=%2%, y=%3%, z=%4%") % x1 % y1[0] % y1[1] % y1[2] % leaving.ID % entering.ID).str());
-        value_type x2temp = x2;
-        state_type y2temp = y2;
-        p->DoHit(x1, y1, x2, y2, coll->first.normal, leaving, entering, mc); // do particle specific things
-        if (x2temp == x2 && y2temp == y2){ // if end point of step was not modified
-            trajectoryaltered = false;
-            traversed = true;
+    if (leaving.ID != entering->ID){ // if the particle actually traversed a material interface
+        auto coll = find_if(hitcollisions.begin(), hitcollisions.end(), [&leaving, &entering](const TCollision &c){ return c.ID == leaving.ID or (c.ID == entering->ID and not c.ignored); });
+        if (coll == hitcollisions.end())
+            throw std::runtime_error((boost::format("Did not find collision going from %5% to %6%! t=%1%s, x=%2%, y=%3%, z=%4%") % x1 % y1[0] % y1[1] % y1[2] % leaving.ID % entering->ID).str());
+        // tagged triangles of the hit solid can have their own material
+        const solid &hitleaving = coll->ID == leaving.ID ? leaving.GetSurface(coll->tag) : leaving;
+        const solid &hitentering = coll->ID == entering->ID ? entering->GetSurface(coll->tag) : *entering;
+        TEventResult result = p->DoHit(x1, y1, x2, y2, coll->normal, hitleaving, hitentering, mc); // do particle specific things
+        trajectoryaltered = result != EVENT_UNCHANGED;
+        traversed = result != EVENT_REFLECTED; // reflected particles continue from the start of the step in the solid they were leaving
+        if (result == EVENT_REFLECTED && (x2 != x1 || y2[0] != y1[0] || y2[1] != y1[1] || y2[2] != y1[2]))
+            throw std::runtime_error("OnHit routine returned inconsistent position. That should not happen!");
+
+        logger->PrintHit(p, x1, y1, y2, coll->normal, hitleaving, hitentering); // print collision to file if requested
+        logger->TallyHit(p, y1, *coll, result == EVENT_ABSORBED, geom);
+    }
+
+    if (traversed){
+        currentsolids.swap(newsolids); // if surface was traversed (even if it was  physically ignored) replace current solids with list of new solids
+        UpdateCurrentsolid();
+    }
+
+    if (trajectoryaltered || p->GetStopID() != ID_UNKNOWN)
+        return true;
+
+    return false;
+}
+
+std::vector<std::pair<std::unique_ptr<TParticle>, TMCGenerator::result_type> > TTracker::TakeClones(){
+    std::vector<std::pair<std::unique_ptr<TParticle>, TMCGenerator::result_type> > c;
+    c.swap(clones);
+    return c;
+}
+
+double TTracker::InitStopProperTime(const std::unique_ptr<TParticle>& p, const TParticleOptions &options, TMCGenerator &mc){
+    double tau = p->GetStopProperTime();
+    if (tau < 0){ // draw decay time only once, a particle resumed from a checkpoint or advanced by AdvanceBatch keeps it
+        tau = options.tau;
+        if (tau > 0){
+            exponential_distribution<double> expdist(1./tau);
+            tau = expdist(mc);
         }
-        else{
-            trajectoryaltered = true;
-            if (x2 == x2temp && y2[0] == y2temp[0] && y2[1] == y2temp[1] && y2[2] == y2temp[2]){
-                traversed = true;
+        else
+            tau = options.tmax;
+        p->SetStopProperTime(tau);
+    }
+    return tau;
+}
+
+void TTracker::AdvanceBatch(const std::vector<std::pair<std::unique_ptr<TParticle>*, TMCGenerator*> > &batch, const double tmax,
+        const TGeometry &geom, const TFieldManager &field){
+    if (batch.empty())
+        return;
+    TBusyThread busy;
+    const TParticle &first = **batch.front().first;
+    PROFILE_PARTICLE(first.GetName(), 0); // a batch interleaves several particles, so it is not traced
+    chrono::steady_clock::time_point batchstart = chrono::steady_clock::now();
+    double cpustart = ThreadCPUTime();
+
+    const TParticleOptions &options = GetParticleOptions(first.GetName());
+    energyinterval = options.energyinterval;
+    const double maxtraj = options.lmax;
+    const int maxsteps = options.maxsteps;
+    const TSpinOptions &spinoptions = options.spin;
+    TStepper stepper(TStepper::RK4); // holds the last step of each particle in turn, so snapshots and spin tracking can interpolate it
+
+    struct TBatchParticle{
+        std::unique_ptr<TParticle> *p; ///< Particle
+        TMCGenerator *mc; ///< Random-number generator of particle
+        double tau; ///< Proper time at which particle stops
+        spin_state_type spin; ///< Spin vector
+        const solid *sld; ///< Solid the particle is in, does not change since particles are peeled off before they cross a surface
+        std::array<double, 3> safetycenter; ///< Center of particle's safety sphere, see TTracker::safetycenter
+        double safetyradius; ///< Radius of particle's safety sphere
+    };
+    vector<TBatchParticle> particles;
+    for (auto &b: batch){
+        unique_ptr<TParticle> &p = *b.first;
+        if (p->GetStopID() != ID_UNKNOWN || p->GetCharge() != 0 || p->GetName() != first.GetName()) // the equation of motion below only covers neutral particles of one type
+            continue;
+        double tau = InitStopProperTime(p, options, *b.second);
+        state_type y = p->GetFinalState();
+        currentsolids = p->GetStartSolids().empty() ? geom.GetSolids(p->GetFinalTime(), &y[0]) : p->GetStartSolids();
+        UpdateCurrentsolid();
+        particles.push_back({&p, b.second, tau, p->GetFinalSpin(), currentsolid, {{0, 0, 0}}, 0});
+    }
+
+    // time, step length, state at start and end of step, stage state, stage derivatives, and magnetic field of each particle still in the batch, in the order of particles
+    size_t n = particles.size();
+    vector<value_type> x(n), dt(n), xs(n);
+    array<vector<value_type>, STATE_VARIABLES> y, ynew, ys, k;
+    array<vector<double>, 3> B;
+    array<array<vector<double>, 3>, 3> dB;
+    for (int j = 0; j < STATE_VARIABLES; ++j){
+        y[j].resize(n);
+        ynew[j].resize(n);
+        ys[j].resize(n);
+        k[j].resize(n);
+    }
+    double *Bptr[3], *dBptr[3][3];
+    for (int i = 0; i < 3; ++i){
+        B[i].resize(n);
+        Bptr[i] = B[i].data();
+        for (int j = 0; j < 3; ++j){
+            dB[i][j].resize(n);
+            dBptr[i][j] = dB[i][j].data();
+        }
+    }
+    for (size_t i = 0; i < n; ++i){
+        x[i] = (*particles[i].p)->GetFinalTime();
+        state_type yi = (*particles[i].p)->GetFinalState();
+        for (int j = 0; j < STATE_VARIABLES; ++j)
+            y[j][i] = yi[j];
+    }
+
+    // hand particle over to IntegrateParticle, the last particle in the batch takes its place
+    auto peel = [&](const size_t i){
+        state_type yi;
+        for (int j = 0; j < STATE_VARIABLES; ++j)
+            yi[j] = y[j][i];
+        (*particles[i].p)->SetFinalState(x[i], yi, particles[i].spin, *particles[i].sld);
+        --n;
+        swap(particles[i], particles[n]);
+        swap(x[i], x[n]);
+        swap(dt[i], dt[n]);
+        for (int j = 0; j < STATE_VARIABLES; ++j){
+            swap(y[j][i], y[j][n]);
+            swap(ynew[j][i], ynew[j][n]);
+        }
+    };
+
+    // steps of particles leaving their safety spheres, tested for collisions together
+    vector<size_t> queried; // index of each step's particle
+    array<vector<double>, 2> qx; // start and end time of each step
+    array<vector<array<double, 3> >, 2> qp; // start and end point of each step
+    vector<vector<TCollision> > qcolls; // collisions of each step
+
+    const TParticleConstants &constants = first.GetConstants();
+    const bool magnetic = first.GetMagneticMoment() != 0;
+    const double steplength = 10.*MAX_TRACK_DEVIATION;
+    while (n > 0 && !quit.load() && !suspendtracking.load()){
+        for (size_t i = 0; i < n;){ // peel off particles whose next step could end their tracking or which are in an absorbing material
+            double v = sqrt(y[3][i]*y[3][i] + y[4][i]*y[4][i] + y[5][i]*y[5][i]);
+            dt[i] = v > 0 ? steplength/v : 0;
+            const TBatchParticle &bp = particles[i];
+            if (v == 0 || x[i] + dt[i] > tmax || y[6][i] + dt[i] >= bp.tau || y[8][i] + 2*steplength >= maxtraj
+                    || (maxsteps > 0 && (*bp.p)->GetNumberOfSteps() + 1 >= maxsteps) || bp.sld->mat.FermiImag > 0)
+                peel(i);
+            else
+                ++i;
+        }
+        if (n == 0)
+            break;
+
+        { // classic Runge-Kutta step, each stage is computed for all particles in loops over the arrays
+            PROFILE(PROFILE_DO_STEP);
+            static const double c[4] = {0, 0.5, 0.5, 1}, w[4] = {1./6, 1./3, 1./3, 1./6};
+            for (int s = 0; s < 4; ++s){
+                for (int j = 0; j < STATE_VARIABLES; ++j){
+                    for (size_t i = 0; i < n; ++i)
+                        ys[j][i] = s == 0 ? y[j][i] : y[j][i] + c[s]*dt[i]*k[j][i];
+                }
+                for (size_t i = 0; i < n; ++i)
+                    xs[i] = x[i] + c[s]*dt[i];
+                if (magnetic)
+                    field.BField(n, ys[0].data(), ys[1].data(), ys[2].data(), xs.data(), Bptr, dBptr);
+                for (size_t i = 0; i < n; ++i){ // equation of motion of TParticle::EquationOfMotion for neutral particles
+                    double a[3] = {0, 0, -constants.g}; // force divided by mass
+                    double Babs = magnetic ? sqrt(B[0][i]*B[0][i] + B[1][i]*B[1][i] + B[2][i]*B[2][i]) : 0;
+                    if (Babs > 0 && ys[7][i] != 0){
+                        for (int j = 0; j < 3; ++j)
+                            a[j] += ys[7][i]*constants.mupermass*(B[0][i]*dB[0][j][i] + B[1][i]*dB[1][j][i] + B[2][i]*dB[2][j][i])/Babs; // force on magnetic dipole moment
+                    }
+                    double v2 = ys[3][i]*ys[3][i] + ys[4][i]*ys[4][i] + ys[5][i]*ys[5][i];
+                    double inversegamma = sqrt(1 - v2*constants.inversec2);
+                    double va = (ys[3][i]*a[0] + ys[4][i]*a[1] + ys[5][i]*a[2])*constants.inversec2;
+                    for (int j = 0; j < 3; ++j){
+                        k[j][i] = ys[3 + j][i];
+                        k[3 + j][i] = inversegamma*(a[j] - ys[3 + j][i]*va);
+                    }
+                    k[6][i] = inversegamma;
+                    k[7][i] = 0;
+                    k[8][i] = sqrt(v2);
+                }
+                for (int j = 0; j < STATE_VARIABLES; ++j){
+                    for (size_t i = 0; i < n; ++i)
+                        ynew[j][i] = (s == 0 ? y[j][i] : ynew[j][i]) + w[s]*dt[i]*k[j][i];
+                }
             }
-            else if (x2 == x1 && y2[0] == y1[0] && y2[1] == y1[1] && y2[2] == y1[2]){
-                traversed = false;
+        }
+
+        { // steps leaving a particle's safety sphere are tested for collisions together, steps that collide are discarded and repeated by IntegrateParticle
+            queried.clear();
+            for (int j = 0; j < 2; ++j){
+                qx[j].clear();
+                qp[j].clear();
             }
-            else{
-                throw std::runtime_error("OnHit routine returned inconsistent position. That should not happen!");
+            for (size_t i = 0; i < n;){
+                TBatchParticle &bp = particles[i];
+                state_type y1, y2;
+                for (int j = 0; j < STATE_VARIABLES; ++j){
+                    y1[j] = y[j][i];
+                    y2[j] = ynew[j][i];
+                }
+                double dev2 = 0.25*(pow(y2[8] - y1[8], 2) - pow(y2[0] - y1[0], 2) - pow(y2[1] - y1[1], 2) - pow(y2[2] - y1[2], 2));
+                if (dev2 > MAX_TRACK_DEVIATION*MAX_TRACK_DEVIATION || !geom.CheckSegment(&y1[0], &y2[0]) || !geom.InCell(&y2[0])){ // straight segment is not accurate enough, leaves the geometry, or leaves the periodic unit cell
+                    peel(i);
+                    continue;
+                }
+                safetycenter = bp.safetycenter;
+                safetyradius = bp.safetyradius;
+                bool insphere = InSafetySphere(y1, y2, geom);
+                bp.safetycenter = safetycenter;
+                bp.safetyradius = safetyradius;
+                if (!insphere){
+                    queried.push_back(i);
+                    qx[0].push_back(x[i]);
+                    qx[1].push_back(x[i] + dt[i]);
+                    qp[0].push_back({{y1[0], y1[1], y1[2]}});
+                    qp[1].push_back({{y2[0], y2[1], y2[2]}});
+                }
+                ++i;
+            }
+            if (!queried.empty()){
+                bool failed = false;
+                try{
+                    geom.GetCollisions(qx[0], qp[0], qx[1], qp[1], qcolls);
+                }
+                catch(...){ // IntegrateParticle repeats the query and stops the particle
+                    failed = true;
+                }
+                for (size_t q = queried.size(); q-- > 0;){ // peel in descending order, so particles moved into the gaps were already checked
+                    ++(*particles[queried[q]].p)->TrackingCost().collisionqueries;
+                    if (failed || !qcolls[q].empty())
+                        peel(queried[q]);
+                }
             }
         }
 
-        logger->PrintHit(p, x1, y1, y2, coll->first.normal, leaving, entering); // print collision to file if requested
+        for (size_t i = 0; i < n; ++i){ // handle step of each particle like a collision-free step in IntegrateParticle
+            TBatchParticle &bp = particles[i];
+            unique_ptr<TParticle> &p = *bp.p;
+            value_type x1 = x[i], x2 = x[i] + dt[i];
+            state_type y1, y2;
+            for (int j = 0; j < STATE_VARIABLES; ++j){
+                y1[j] = y[j][i];
+                y2[j] = ynew[j][i];
+            }
+
+            cost = &p->TrackingCost();
+            cost->derivs += 4;
+            ++cost->steps;
+            cost->stepsum += dt[i];
+            cost->minstep = min(cost->minstep, dt[i]);
+            stepper.set_step(x1, y1, x2, y2);
+            if (DoStep(p, x1, y1, x2, y2, stepper, *bp.sld, *bp.mc, field) || p->GetStopID() != ID_UNKNOWN)
+                throw std::logic_error("OnStep of " + p->GetName() + " changed its trajectory outside of absorbing materials, it cannot be tracked in batches!");
+            const bool snapshot = logger->PrintSnapshot(p, x1, y1, x2, y2, bp.spin, stepper, geom, field);
+            logger->PrintTrajectory(p, stepper, x2, y2);
+            IntegrateSpin(p, bp.spin, stepper, x2, y2, spinoptions.times, field, spinoptions.interpolatefields, spinoptions.magnus, spinoptions.rwa, spinoptions.Bmax, spinoptions.adiabaticity, *bp.mc, spinoptions.flipspin);
+            logger->PrintTrack(p, x1, y1, x2, y2, bp.spin, *bp.sld, field, snapshot);
+            x[i] = x2;
+            for (int j = 0; j < STATE_VARIABLES; ++j)
+                y[j][i] = y2[j];
+        }
     }
+    while (n > 0) // tracking was interrupted
+        peel(0);
+
+    // batch time is shared equally between its particles
+    double walltime = chrono::duration<double>(chrono::steady_clock::now() - batchstart).count(), cputime = ThreadCPUTime() - cpustart;
+    for (auto &bp: particles){
+        (*bp.p)->TrackingCost().walltime += walltime/particles.size();
+        (*bp.p)->TrackingCost().cputime += cputime/particles.size();
+    }
+}
 
-    if (traversed){
-        currentsolids = newsolids; // if surface was traversed (even if it was  physically ignored) replace current solids with list of new solids
+
+void TTracker::ReplaySpin(const std::unique_ptr<TParticle>& p, const std::vector<TTrajectoryKnot> &knots, TMCGenerator &mc, const TGeometry &geom, const TFieldManager &field){
+    PROFILE_PARTICLE(p->GetName(), p->GetParticleNumber());
+    TQueryTraceParticle querytraceparticle(p->GetParticleNumber());
+    const TSpinOptions &spinoptions = GetParticleOptions(p->GetName()).spin;
+    cost = &p->TrackingCost();
+    TStepper stepper(TStepper::RK4); // holds each recorded step in turn, so spin tracking can interpolate it
+
+    auto wallflip = [&](const std::size_t i){ // polarisation flipped in jump to knot i
+        return knots[i].continued == 0 && knots[i - 1].y[7] != 0 && knots[i].y[7] == -knots[i - 1].y[7];
+    };
+    int wallflips = 0;
+    for (std::size_t i = 1; i < knots.size(); ++i)
+        wallflips += wallflip(i);
+    p->ResetSpinFlips(wallflips);
+
+    spin_state_type spin = p->GetInitialSpin();
+    double polarisation = p->GetInitialState()[7];
+    for (std::size_t i = 1; i < knots.size() && not quit.load(); ++i){
+        if (knots[i].continued == 0){ // spin is kept when particle jumps
+            if (wallflip(i))
+                polarisation = -polarisation;
+            continue;
+        }
+        state_type y1 = knots[i - 1].y, y2 = knots[i].y;
+        y1[7] = polarisation;
+        y2[7] = polarisation;
+        stepper.set_step(knots[i - 1].t, y1, knots[i].t, y2);
+        IntegrateSpin(p, spin, stepper, knots[i].t, y2, spinoptions.times, field, spinoptions.interpolatefields, spinoptions.magnus, spinoptions.rwa, spinoptions.Bmax, spinoptions.adiabaticity, mc, spinoptions.flipspin);
+        polarisation = y2[7];
     }
 
-    if (trajectoryaltered || p->GetStopID() != ID_UNKNOWN)
-        return true;
+    state_type y = knots.back().y;
+    y[7] = polarisation;
+    p->SetFinalState(knots.back().t, y, spin, p->GetFinalSolid());
+    logger->Print(p, knots.back().t, y, spin, geom, field);
+}
 
-    return false;
+
+void TTracker::SampleFate(const std::unique_ptr<TParticle>& p, value_type &x, state_type &y, const double tmax, const double tau, const double lmax, TMCGenerator &mc) const{
+    const value_type dt = x - p->GetInitialTime();
+    const state_type &ystart = p->GetInitialState();
+    if (p->GetNumberOfHits() == 0 || dt <= 0 || not p->GetSurvivalWeights().empty())
+        return;
+    double lossprob, flipprob;
+    p->GetHitProbabilities(lossprob, flipprob);
+
+    // stop conditions in the same order as in IntegrateParticle, extrapolated with average rates of proper time and trajectory length
+    value_type tstop = tmax;
+    stopID ID = ID_NOT_FINISH;
+    if (y[8] > ystart[8])
+        tstop = min(tstop, x + (lmax - y[8])*dt/(y[8] - ystart[8]));
+    if (y[6] > ystart[6]){
+        value_type tdecay = x + (tau - y[6])*dt/(y[6] - ystart[6]);
+        if (tdecay <= tstop){
+            tstop = tdecay;
+            ID = ID_DECAYED;
+        }
+    }
+    if (lossprob > 0){
+        value_type tloss = x + exponential_distribution<double>(lossprob/dt)(mc);
+        if (tloss < tstop){
+            tstop = tloss;
+            ID = ID_ABSORBED_ON_SURFACE;
+        }
+    }
+    tstop = max(tstop, x);
+
+    double remaining = (tstop - x)/dt;
+    int hits = remaining > 0 ? poisson_distribution<int>(p->GetNumberOfHits()*remaining)(mc) : 0;
+    int flips = remaining > 0 && flipprob > 0 ? poisson_distribution<int>(flipprob*remaining)(mc) : 0;
+    if (flips % 2 == 1)
+        y[7] = -y[7];
+    y[6] += (y[6] - ystart[6])*remaining;
+    y[8] += (y[8] - ystart[8])*remaining;
+    x = tstop;
+    p->SetFateSampled(hits, flips);
+    p->SetStopID(ID);
+}
+
+
+/**
+ * Step and CPU-time budgets left for the parareal iterations of a particle, shared by all threads integrating its slices
+ */
+struct TPararealBudget{
+    atomic<long> steps; ///< Number of steps left
+    atomic<long long> cputime; ///< CPU time left [ns]
+
+    /**
+     * Constructor
+     *
+     * @param maxsteps Number of steps left
+     * @param maxcputime CPU time left [s]
+     */
+    TPararealBudget(const long maxsteps, const double maxcputime): steps(maxsteps), cputime(static_cast<long long>(min(maxcputime, 1e9)*1e9)){ }
+
+    /**
+     * Check if the steps or the CPU time are used up
+     */
+    bool Exhausted() const{ return steps.load() <= 0 || cputime.load() <= 0; }
+};
+
+
+/**
+ * Threads that were not busy, reserved to integrate parareal slices as long as this object exists
+ */
+struct TReservedThreads{
+    int count; ///< Number of reserved threads
+
+    /**
+     * Constructor, reserves threads and counts them in busythreads
+     *
+     * @param wanted Number of threads that would be used
+     * @param nthreads Number of threads available to the process
+     */
+    TReservedThreads(const int wanted, const int nthreads){
+        int busy = busythreads.load();
+        do{
+            count = max(0, min(wanted, nthreads - busy));
+        } while (count > 0 && !busythreads.compare_exchange_weak(busy, busy + count));
+    }
+
+    /**
+     * Destructor, releases threads
+     */
+    ~TReservedThreads(){ busythreads -= count; }
+};
+
+
+/**
+ * Integrate a trajectory over a time interval, optionally checking every step for collisions with surfaces
+ *
+ * @param stepper Trajectory integrator
+ * @param p Particle whose equation of motion is integrated, counts evaluations of the equation of motion
+ * @param field TFieldManager containing all electromagnetic fields
+ * @param x1 Start time
+ * @param y State at start time, returns state at end time
+ * @param x2 End time
+ * @param geom Geometry against which the steps are checked (nullptr: no checks)
+ * @param cost Returns number of steps, sum of step lengths, number of collision queries, and CPU time
+ * @param budget Budget from which each step and its CPU time are subtracted, integration stops when it is used up
+ *
+ * @return Returns false if a step may collide with a surface or leave the geometry, y then contains the state at the end of that step, or if the budget is used up
+ */
+static bool Propagate(TStepper &stepper, const TParticle &p, const TFieldManager &field, const value_type x1, state_type &y, const value_type x2,
+                      const TGeometry *geom, TTrackingCost &cost, TPararealBudget &budget){
+    stepper.initialize(y, x1, 10.*MAX_TRACK_DEVIATION/sqrt(y[3]*y[3] + y[4]*y[4] + y[5]*y[5]));
+    double safetycenter[3] = {y[0], y[1], y[2]}, safetyradius = 0;
+    vector<TCollision> colls;
+    value_type x = x1;
+    double cpu = ThreadCPUTime();
+    while (x < x2 && !quit.load() && !suspendtracking.load()){
+        value_type xprev = x;
+        state_type yprev = y;
+        stepper.do_step(p, field);
+        x = stepper.current_time();
+        y = stepper.current_state();
+        if (x > x2){
+            x = x2;
+            stepper.calc_state(x, y);
+        }
+        double cpunow = ThreadCPUTime();
+        ++cost.steps;
+        cost.stepsum += x - xprev;
+        cost.cputime += cpunow - cpu;
+        --budget.steps;
+        budget.cputime -= static_cast<long long>((cpunow - cpu)*1e9);
+        cpu = cpunow;
+        if (budget.Exhausted()) // also stops the other threads
+            return false;
+        if (geom == nullptr)
+            continue;
+        double l = y[8] - yprev[8]; // the step lies in a sphere with its length as radius around its start point
+        double d = sqrt(pow(yprev[0] - safetycenter[0], 2) + pow(yprev[1] - safetycenter[1], 2) + pow(yprev[2] - safetycenter[2], 2));
+        if (d + l < safetyradius)
+            continue;
+        copy(yprev.begin(), yprev.begin() + 3, safetycenter);
+        safetyradius = geom->GetSafetyDistance(&yprev[0]);
+        if (l < safetyradius)
+            continue;
+        double dev2 = 0.25*(l*l - pow(y[0] - yprev[0], 2) - pow(y[1] - yprev[1], 2) - pow(y[2] - yprev[2], 2));
+        int chords = dev2 > MAX_TRACK_DEVIATION*MAX_TRACK_DEVIATION ? static_cast<int>(ceil(sqrt(dev2)/MAX_TRACK_DEVIATION)) : 1; // split step like IntegrateParticle
+        state_type ya = yprev, yb;
+        for (int i = 1; i <= chords; ++i){
+            value_type xa = xprev + (x - xprev)*(i - 1)/chords, xb = xprev + (x - xprev)*i/chords;
+            stepper.calc_state(xb, yb);
+            ++cost.collisionqueries;
+            if (!geom->CheckSegment(&ya[0], &yb[0]) || geom->GetCollisions(xa, &ya[0], xb, &yb[0], colls))
+                return false;
+            ya = yb;
+        }
+    }
+    return x >= x2;
+}
+
+
+bool TTracker::AdvanceParareal(const std::unique_ptr<TParticle>& p, value_type &x, state_type &y, const double tmax, const double tau, const TParticleOptions &options,
+        const TGeometry &geom, const TFieldManager &field, const long maxsteps, const double maxcputime, unsigned long &steps){
+    const unsigned N = options.parareal;
+    const value_type xend = min<value_type>(tmax, x + tau - y[6]); // proper time does not advance faster than time, so the particle does not decay before xend
+    if (!(xend > x))
+        return false;
+    vector<value_type> xs(N + 1);
+    for (unsigned n = 0; n <= N; ++n)
+        xs[n] = x + (xend - x)*n/N;
+    xs[N] = xend;
+
+    const TIntegratorOptions &integrator = options.integrator;
+    TStepper coarse(TStepper::DOPRI5, options.pararealcoarsetol, options.pararealcoarsetol);
+    TMCGenerator proxymc; // each slice is integrated with its own particle of the same type, since evaluations of the equation of motion count them in the particle
+    vector<unique_ptr<TParticle> > proxies;
+    for (unsigned n = 0; n < N; ++n)
+        proxies.emplace_back(CreateParticle(p->GetName(), p->GetParticleNumber(), x, y[0], y[1], y[2], p->GetFinalKineticEnergy(), 0, 0, y[7], proxymc, geom, field, &GetCurrentsolid()));
+    vector<state_type> U(N + 1), G(N), F(N);
+    vector<char> collisionfree(N, false); // vector<bool> cannot be written by several threads
+    vector<TTrackingCost> finecost(N);
+    TTrackingCost coarsecost;
+    TPararealBudget budget(maxsteps, maxcputime);
+    double workercputime = 0; // CPU time of slices integrated in other threads, which IntegrateParticle does not measure
+    bool aborted = false;
+
+    try{
+        U[0] = y;
+        for (unsigned n = 0; n < N; ++n){ // initial prediction with coarse propagator
+            G[n] = U[n];
+            Propagate(coarse, *p, field, xs[n], G[n], xs[n + 1], nullptr, coarsecost, budget);
+            U[n + 1] = G[n];
+        }
+        for (unsigned k = 0; k < N && !budget.Exhausted(); ++k){
+            TReservedThreads reserved(min<int>(N - k, nthreads) - 1, nthreads); // the calling thread waits for the slices, so they can use its thread as well
+            double cputime = 0;
+            for (unsigned n = k; n < N; ++n)
+                cputime -= finecost[n].cputime;
+            ParallelFor(N - k, 1 + reserved.count, [&](const unsigned long begin, const unsigned long end){ // first k slices are exact and not integrated again
+                for (unsigned long i = begin; i < end; ++i){
+                    unsigned n = k + i;
+                    TStepper fine(integrator.method, integrator.abstol, integrator.reltol, integrator.borissteps, integrator.gcadiabaticity, integrator.gcwalldistance, &geom, integrator.ballistic);
+                    F[n] = U[n];
+                    collisionfree[n] = Propagate(fine, *proxies[n], field, xs[n], F[n], xs[n + 1], &geom, finecost[n], budget);
+                }
+            });
+            if (reserved.count > 0){ // ParallelFor used its own threads
+                for (unsigned n = k; n < N; ++n)
+                    cputime += finecost[n].cputime;
+                workercputime += cputime;
+            }
+            if (quit.load() || suspendtracking.load() || budget.Exhausted()){
+                aborted = true;
+                break;
+            }
+
+            double change = 0;
+            for (unsigned n = k; n < N; ++n){ // serial correction U[n + 1] = G(new U[n]) + F(old U[n]) - G(old U[n])
+                state_type g = U[n];
+                Propagate(coarse, *p, field, xs[n], g, xs[n + 1], nullptr, coarsecost, budget);
+                state_type u;
+                for (int j = 0; j < STATE_VARIABLES; ++j)
+                    u[j] = g[j] + F[n][j] - G[n][j];
+                G[n] = g;
+                for (int j = 0; j < 3; ++j) // a changed velocity changes the positions at all later slice boundaries, so only positions are compared
+                    change = max(change, abs(u[j] - U[n + 1][j]));
+                U[n + 1] = u;
+            }
+            if (change < options.pararealtol)
+                break;
+        }
+    }
+    catch(...){ // exceptions of odeint, the particle is tracked normally and stopped there if the error persists
+        aborted = true;
+    }
+
+    steps = coarsecost.steps;
+    cost->cputime += workercputime;
+    for (unsigned n = 0; n < N; ++n){
+        steps += finecost[n].steps;
+        cost->derivs += proxies[n]->TrackingCost().derivs;
+        cost->steps += finecost[n].steps;
+        cost->stepsum += finecost[n].stepsum;
+        cost->collisionqueries += finecost[n].collisionqueries;
+    }
+    if (aborted || budget.Exhausted())
+        return false;
+    unsigned advanced = 0; // slices advanced before the first slice that may touch a surface or exceed lmax
+    while (advanced < N && collisionfree[advanced] && F[advanced][8] < options.lmax)
+        ++advanced;
+    if (advanced == 0)
+        return false;
+    x = xs[advanced];
+    y = F[advanced - 1];
+    return true;
 }
 
-const solid& TTracker::GetCurrentsolid() const{
-    auto sld = max_element(currentsolids.begin(), currentsolids.end(), [](const pair<solid, bool> &s1, const pair<solid, bool> &s2){ return s1.second || (!s2.second && s1.first.ID < s2.first.ID); });
-    return sld->first;
+
+void TTracker::ChangeImportance(const std::unique_ptr<TParticle>& p, const double ratio, const value_type x, const state_type &y, const spin_state_type &spin,
+                                TMCGenerator &mc, const TGeometry &geom, const TFieldManager &field){
+    uniform_real_distribution<double> unidist(0, 1);
+    if (ratio < 1){ // Russian roulette, survivors carry the weight of killed particles
+        if (unidist(mc) < ratio)
+            p->SetStatisticalWeight(p->GetStatisticalWeight()/ratio);
+        else
+            p->SetStopID(ID_KILLED_BY_ROULETTE); // keeps its weight, so the summary shows how much weight was transferred to survivors
+        return;
+    }
+
+    unsigned long n = static_cast<unsigned long>(ratio); // split into ratio particles on average
+    if (unidist(mc) < ratio - n)
+        ++n;
+    if (n > MAX_CLONES)
+        throw runtime_error((boost::format("Tried to split particle into %1% copies, reduce the importance ratio of neighbouring regions!") % n).str());
+    p->SetStatisticalWeight(p->GetStatisticalWeight()/ratio);
+    p->SetFinalState(x, y, spin, GetCurrentsolid());
+    stringstream state;
+    p->WriteState(state);
+    for (unsigned long i = 1; i < n; ++i){
+        TMCGenerator clonemc; // initial state of copy is overwritten by ReadState, random numbers drawn by constructor do not matter
+        unique_ptr<TParticle> clone(CreateParticle(p->GetName(), p->GetParticleNumber(), x, y[0], y[1], y[2], 0, 0, 0, 0, clonemc, geom, field, &GetCurrentsolid()));
+        state.clear();
+        state.seekg(0);
+        clone->ReadState(state, geom);
+        TMCGenerator::result_type index = CLONE_INDEX | (static_cast<TMCGenerator::result_type>(p->GetNumberOfSteps()) << 20) | i; // a particle is split at most once per step
+        clones.push_back(make_pair(move(clone), index));
+    }
 }
 
+void TTracker::UpdateCurrentsolid(){
+    auto sld = max_element(currentsolids.begin(), currentsolids.end(), [](const pair<const solid*, bool> &s1, const pair<const solid*, bool> &s2){ return s1.second || (!s2.second && s1.first->ID < s2.first->ID); });
+    currentsolid = sld->first;
+}
 
-void TTracker::IntegrateSpin(const std::unique_ptr<TParticle>& p, state_type &spin, const dense_stepper_type &stepper,
+
+/**
+ * Adiabaticity parameter of spin precession
+ *
+ * @param gamma Absolute gyromagnetic ratio of particle [1/Ts]
+ * @param v Velocity of particle [m/s]
+ * @param B Magnetic field [T]
+ * @param dBidxj Magnetic-field gradient [T/m]
+ * @param Babs Absolute magnetic field [T]
+ *
+ * @return Returns Larmor frequency divided by the rotation rate of the field direction seen by the particle moving through the static field gradient
+ */
+static double SpinAdiabaticity(const double gamma, const value_type v[3], const double B[3], const double dBidxj[3][3], const double Babs){
+    double dBdt[3]; // change of field along trajectory, (v.grad)B
+    for (int i = 0; i < 3; ++i)
+        dBdt[i] = dBidxj[i][0]*v[0] + dBidxj[i][1]*v[1] + dBidxj[i][2]*v[2];
+    double dBpar = (dBdt[0]*B[0] + dBdt[1]*B[1] + dBdt[2]*B[2])/Babs;
+    double dBperp2 = dBdt[0]*dBdt[0] + dBdt[1]*dBdt[1] + dBdt[2]*dBdt[2] - dBpar*dBpar; // only the component perpendicular to B rotates the field
+    if (dBperp2 <= 0)
+        return std::numeric_limits<double>::infinity();
+    return gamma*Babs*Babs/sqrt(dBperp2);
+}
+
+
+void TTracker::IntegrateSpin(const std::unique_ptr<TParticle>& p, spin_state_type &spin, const TStepper &stepper,
         const double x2, state_type &y2, const std::vector<double> &times, const TFieldManager &field,
-        const bool interpolatefields, const double Bmax, TMCGenerator &mc, const bool flipspin) const{
+        const bool interpolatefields, const bool magnus, const bool rwa, const double Bmax, const double adiabaticity, TMCGenerator &mc, const bool flipspin){
+    PROFILE(PROFILE_INTEGRATESPIN);
     value_type x1 = stepper.previous_time();
     if (p->GetGyromagneticRatio() == 0 || x1 == x2)
         return;
 
     state_type y1 = stepper.previous_state();
-    double B1[3], B2[3], polarisation;
-    field.BField(y1[0], y1[1], y1[2], x1, B1);
-    field.BField(y2[0], y2[1], y2[2], x2, B2);
+    double B1[3], B2[3], dB1idxj[3][3], dB2idxj[3][3], polarisation;
+    bool adiabaticregion = false; // region map guarantees that the adiabaticity parameter is large at both ends, so gradients are not needed
+    if (adiabaticity > 0 && regionmap){
+        double gamma = std::abs(p->GetGyromagneticRatio());
+        adiabaticregion = regionmap->Adiabaticity(&y1[0], gamma, sqrt(y1[3]*y1[3] + y1[4]*y1[4] + y1[5]*y1[5])) >= adiabaticity
+                          && regionmap->Adiabaticity(&y2[0], gamma, sqrt(y2[3]*y2[3] + y2[4]*y2[4] + y2[5]*y2[5])) >= adiabaticity;
+    }
+    bool gradients = adiabaticity > 0 && !adiabaticregion; // field gradients are only needed to decide on spin integration automatically
+    field.BField(y1[0], y1[1], y1[2], x1, B1, gradients ? dB1idxj : nullptr);
+    field.BField(y2[0], y2[1], y2[2], x2, B2, gradients ? dB2idxj : nullptr);
     double Babs1 = sqrt(B1[0]*B1[0] + B1[1]*B1[1] + B1[2]*B1[2]);
     double Babs2 = sqrt(B2[0]*B2[0] + B2[1]*B2[1] + B2[2]*B2[2]);
 
@@ -395,56 +1564,55 @@ void TTracker::IntegrateSpin(const std::unique_ptr<TParticle>& p, state_type &sp
         integrate1 |= (x1 >= times[i] && x1 < times[i+1]);
         integrate2 |= (x2 >= times[i] && x2 < times[i+1]);
     }
+    if (adiabaticity > 0 && !integrate1 && !integrate2 && (Babs1 < Bmax || Babs2 < Bmax)){ // integrate where the spin might not follow the field adiabatically
+        double gamma = std::abs(p->GetGyromagneticRatio());
+        double stepangle = atan2(sqrt(pow(B1[1]*B2[2] - B1[2]*B2[1], 2) + pow(B1[2]*B2[0] - B1[0]*B2[2], 2) + pow(B1[0]*B2[1] - B1[1]*B2[0], 2)),
+                                 B1[0]*B2[0] + B1[1]*B2[1] + B1[2]*B2[2]); // also catches explicitly time-dependent fields that rotate across the step
+        integrate1 = !adiabaticregion && SpinAdiabaticity(gamma, &y1[3], B1, dB1idxj, Babs1) < adiabaticity;
+        integrate2 = (!adiabaticregion && SpinAdiabaticity(gamma, &y2[3], B2, dB2idxj, Babs2) < adiabaticity)
+                     || gamma*std::min(Babs1, Babs2)*(x2 - x1) < adiabaticity*stepangle;
+    }
 
     if ((integrate1 || integrate2) && (Babs1 < Bmax || Babs2 < Bmax)){ // do spin integration only, if time is in specified range and field is smaller than Bmax
 //		if ((!integrate1 && integrate2) || (Babs1 > Bmax && Babs2 < Bmax))
 //			std::cout << x1 << "s " << y1[7] - polarisation << " ";
 
-        vector<alglib::spline1dinterpolant> omega_int;
-        if (interpolatefields){
-            alglib::real_1d_array ts; // set up values for interpolation of precession axis
-            vector<alglib::real_1d_array> omega(3);
-            omega_int.resize(3);
-            const int int_points = 10;
-            ts.setlength(int_points + 1);
-            for (int i = 0; i < 3; i++)
-                omega[i].setlength(int_points + 1);
-
-            for (int i = 0; i <= int_points; i++){ // calculate precession axis at several points along trajectory step
-                double t = x1 + i*(x2 - x1)/int_points;
-                ts[i] = t;
-                p->SpinPrecessionAxis(t, stepper, field, omega[0][i], omega[1][i], omega[2][i]);
-            }
-
-            for (int i = 0; i < 3; i++)
-                alglib::spline1dbuildcubic(ts, omega[i], omega_int[i]); // interpolate all three components of precession axis
+        const TSpinAxisInterpolant *omega_int = nullptr;
+        if (interpolatefields && !(rwa && field.RFFrequency() != 0)){
+            spinaxis.Build(*p, x1, x2, stepper, field); // interpolate all three components of precession axis
+            omega_int = &spinaxis;
         }
 
+        logger->PrintSpin(p, 0, x1, spin, stepper, field); // print initial spin state
+        if (rwa && field.RFFrequency() != 0)
+            IntegrateSpinRWA(p, spin, stepper, x1, x2, field);
+        else if (magnus)
+            IntegrateSpinMagnus(p, spin, stepper, x1, x2, field, omega_int);
+        else{
+            spinstepper.initialize(spin, x1, std::abs(pi/p->GetGyromagneticRatio()/Babs1)); // initialize integrator with step size = half rotation
+            while (true){
+                if (quit.load() && not checkpoint)
+                    return;
+
+                // take an integration step, SpinDerivs contains right-hand side of equation of motion
+                spinstepper.do_step(std::bind(&TParticle::SpinDerivs, p.get(), std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::cref(stepper), &field, omega_int));
+                ++cost->spinsteps;
+                double t = spinstepper.current_time();
+                if (t > x2){ // if stepper overshot, calculate end point and stop
+                    t = x2;
+                    spinstepper.calc_state(t, spin);
+                }
+                else
+                    spin = spinstepper.current_state();
 
-        dense_stepper_type spinstepper = boost::numeric::odeint::make_dense_output(1e-12, 1e-12, stepper_type());
-        spinstepper.initialize(spin, x1, std::abs(pi/p->GetGyromagneticRatio()/Babs1)); // initialize integrator with step size = half rotation
-        logger->PrintSpin(p, x1, spinstepper, stepper, field);
-        unsigned int steps = 0;
-        while (true){
-            if (quit.load())
-                return;
+                logger->PrintSpin(p, spinstepper.previous_time(), t, spin, stepper, field);
 
-            // take an integration step, SpinDerivs contains right-hand side of equation of motion
-            spinstepper.do_step(std::bind(&TParticle::SpinDerivs, p.get(), std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, stepper, &field, omega_int));
-            steps++;
-            double t = spinstepper.current_time();
-            if (t > x2){ // if stepper overshot, calculate end point and stop
-                t = x2;
-                spinstepper.calc_state(t, spin);
+                if (t >= x2)
+                    break;
             }
-            else
-                spin = spinstepper.current_state();
-
-            logger->PrintSpin(p, t, spinstepper, stepper, field);
-
-            if (t >= x2)
-                break;
         }
+        if (quit.load() && not checkpoint)
+            return;
 
         // calculate new spin projection
         polarisation = (spin[0]*B2[0] + spin[1]*B2[1] + spin[2]*B2[2])/Babs2/sqrt(spin[0]*spin[0] + spin[1]*spin[1] + spin[2]*spin[2]);
@@ -472,3 +1640,146 @@ void TTracker::IntegrateSpin(const std::unique_ptr<TParticle>& p, state_type &sp
         spin[2] = B2[2]*y2[7]/Babs2;
     }
 }
+
+void TTracker::IntegrateSpinMagnus(const std::unique_ptr<TParticle>& p, spin_state_type &spin, const TStepper &stepper,
+        const value_type x1, const value_type x2, const TFieldManager &field, const TSpinAxisInterpolant *omega_int){
+    auto axis = [&](const value_type t, double Omega[3]){ // evaluate precession axis from interpolant or directly
+        if (omega_int)
+            omega_int->Evaluate(t, Omega[0], Omega[1], Omega[2]);
+        else
+            p->SpinPrecessionAxis(t, stepper, field, Omega[0], Omega[1], Omega[2]);
+    };
+
+    const double c1 = 0.5 - sqrt(3.)/6, c2 = 0.5 + sqrt(3.)/6; // Gauss-Legendre nodes
+    value_type t = x1;
+    double h = x2 - x1;
+    while (t < x2){
+        if (quit.load() && not checkpoint)
+            return;
+
+        h = std::min(h, x2 - t);
+        double Omega1[3], Omega2[3], Omegam[3];
+        axis(t + c1*h, Omega1);
+        axis(t + c2*h, Omega2);
+        axis(t + 0.5*h, Omegam);
+        // fourth-order Magnus expansion of rotation vector over step: h/2*(W1 + W2) + sqrt(3)/12*h^2*(W2 x W1)
+        double theta[3] = {	0.5*h*(Omega1[0] + Omega2[0]) + sqrt(3.)/12*h*h*(Omega2[1]*Omega1[2] - Omega2[2]*Omega1[1]),
+                            0.5*h*(Omega1[1] + Omega2[1]) + sqrt(3.)/12*h*h*(Omega2[2]*Omega1[0] - Omega2[0]*Omega1[2]),
+                            0.5*h*(Omega1[2] + Omega2[2]) + sqrt(3.)/12*h*h*(Omega2[0]*Omega1[1] - Omega2[1]*Omega1[0])};
+        // error estimate: difference to second-order midpoint rotation h*Wm
+        double err = sqrt(pow(theta[0] - h*Omegam[0], 2) + pow(theta[1] - h*Omegam[1], 2) + pow(theta[2] - h*Omegam[2], 2));
+        double scale = err > 0 ? 0.9*cbrt(MAGNUS_SPIN_TOLERANCE/err) : 5.;
+        if (err > MAGNUS_SPIN_TOLERANCE){ // reject step and retry with smaller step
+            h *= std::max(scale, 0.2);
+            if (t + h == t)
+                throw std::runtime_error("Spin integration step size underflow");
+            continue;
+        }
+
+        double angle = sqrt(theta[0]*theta[0] + theta[1]*theta[1] + theta[2]*theta[2]);
+        if (angle > 0){ // rotate spin around rotation vector with Rodrigues' formula
+            double k[3] = {theta[0]/angle, theta[1]/angle, theta[2]/angle};
+            double c = cos(angle), s = sin(angle);
+            double kdotS = k[0]*spin[0] + k[1]*spin[1] + k[2]*spin[2];
+            double kxS[3] = {k[1]*spin[2] - k[2]*spin[1], k[2]*spin[0] - k[0]*spin[2], k[0]*spin[1] - k[1]*spin[0]};
+            for (int i = 0; i < 3; i++)
+                spin[i] = spin[i]*c + kxS[i]*s + k[i]*kdotS*(1 - c);
+        }
+        ++cost->spinsteps;
+        spin[3] += h; // integrate time
+        spin[4] += 0.5*h*(sqrt(Omega1[0]*Omega1[0] + Omega1[1]*Omega1[1] + Omega1[2]*Omega1[2]) + sqrt(Omega2[0]*Omega2[0] + Omega2[1]*Omega2[1] + Omega2[2]*Omega2[2])); // integrate precession phase
+
+        value_type tprev = t;
+        t = h < x2 - t ? t + h : x2;
+        logger->PrintSpin(p, tprev, t, spin, stepper, field);
+        h *= std::min(scale, 5.);
+    }
+}
+
+
+/**
+ * Rotate a vector about a unit axis with Rodrigues' formula
+ *
+ * @param v Vector, returns rotated vector
+ * @param k Unit rotation axis
+ * @param c Cosine of rotation angle
+ * @param s Sine of rotation angle
+ */
+static void RotateAboutAxis(double v[3], const double k[3], const double c, const double s){
+    double kdotv = k[0]*v[0] + k[1]*v[1] + k[2]*v[2];
+    double kxv[3] = {k[1]*v[2] - k[2]*v[1], k[2]*v[0] - k[0]*v[2], k[0]*v[1] - k[1]*v[0]};
+    for (int i = 0; i < 3; i++)
+        v[i] = v[i]*c + kxv[i]*s + k[i]*kdotv*(1 - c);
+}
+
+void TTracker::IntegrateSpinRWA(const std::unique_ptr<TParticle>& p, spin_state_type &spin, const TStepper &stepper,
+        const value_type x1, const value_type x2, const TFieldManager &field){
+    const double omega = field.RFFrequency();
+    double Omega0[3], Omegac[3], Omegas[3];
+    p->RFSpinPrecessionAxes(x1, stepper, field, Omega0, Omegac, Omegas);
+    double Omega0abs = sqrt(Omega0[0]*Omega0[0] + Omega0[1]*Omega0[1] + Omega0[2]*Omega0[2]);
+    if (Omega0abs == 0){ // rotating frame is undefined without static field
+        IntegrateSpinMagnus(p, spin, stepper, x1, x2, field, nullptr);
+        return;
+    }
+    const double n[3] = {Omega0[0]/Omega0abs, Omega0[1]/Omega0abs, Omega0[2]/Omega0abs};
+
+    // precession axis in rotating frame: detuning along n plus co-rotating half of the perpendicular RF components, (Omegac + n x Omegas)/2
+    auto axis = [&](const value_type t, double W[3], double &Omegapar){
+        p->RFSpinPrecessionAxes(t, stepper, field, Omega0, Omegac, Omegas);
+        Omegapar = Omega0[0]*n[0] + Omega0[1]*n[1] + Omega0[2]*n[2];
+        double cpar = Omegac[0]*n[0] + Omegac[1]*n[1] + Omegac[2]*n[2];
+        double nxs[3] = {n[1]*Omegas[2] - n[2]*Omegas[1], n[2]*Omegas[0] - n[0]*Omegas[2], n[0]*Omegas[1] - n[1]*Omegas[0]};
+        for (int i = 0; i < 3; ++i)
+            W[i] = (Omegapar - omega)*n[i] + 0.5*(Omegac[i] - cpar*n[i] + nxs[i]);
+    };
+    auto tolab = [&](spin_state_type &s, const value_type t){ // rotating frame coincides with lab frame at t = 0
+        RotateAboutAxis(&s[0], n, cos(omega*t), sin(omega*t));
+    };
+
+    spin_state_type rotspin = spin;
+    RotateAboutAxis(&rotspin[0], n, cos(omega*x1), -sin(omega*x1));
+    double W[3], Omegapar;
+    axis(x1, W, Omegapar);
+    double Wabs = sqrt(W[0]*W[0] + W[1]*W[1] + W[2]*W[2]);
+    spinstepper.initialize(rotspin, x1, Wabs > 0 ? std::min<value_type>(x2 - x1, pi/Wabs) : x2 - x1); // initialize integrator with step size = half rotation in rotating frame
+    while (true){
+        if (quit.load() && not checkpoint)
+            return;
+
+        spinstepper.do_step([&](const spin_state_type &y, spin_state_type &dydx, const value_type t){
+            double w[3], wpar;
+            axis(t, w, wpar);
+            dydx[0] = w[1]*y[2] - w[2]*y[1]; // dS/dt = W x S
+            dydx[1] = w[2]*y[0] - w[0]*y[2];
+            dydx[2] = w[0]*y[1] - w[1]*y[0];
+            dydx[3] = 1.; // integrate time
+            dydx[4] = std::abs(wpar); // integrate precession phase in lab frame
+        });
+        ++cost->spinsteps;
+        double t = spinstepper.current_time();
+        if (t > x2){ // if stepper overshot, calculate end point and stop
+            t = x2;
+            spinstepper.calc_state(t, rotspin);
+        }
+        else
+            rotspin = spinstepper.current_state();
+        spin = rotspin;
+        tolab(spin, t);
+
+        logger->PrintSpin(p, spinstepper.previous_time(), t, spin, stepper, field);
+
+        if (t >= x2)
+            break;
+    }
+
+    // spin follows the rotation of the static precession axis from n to its direction at the end of the step
+    p->RFSpinPrecessionAxes(x2, stepper, field, Omega0, Omegac, Omegas);
+    double nxn2[3] = {n[1]*Omega0[2] - n[2]*Omega0[1], n[2]*Omega0[0] - n[0]*Omega0[2], n[0]*Omega0[1] - n[1]*Omega0[0]};
+    double sine = sqrt(nxn2[0]*nxn2[0] + nxn2[1]*nxn2[1] + nxn2[2]*nxn2[2]);
+    if (sine > 0){
+        double angle = atan2(sine, n[0]*Omega0[0] + n[1]*Omega0[1] + n[2]*Omega0[2]);
+        double k[3] = {nxn2[0]/sine, nxn2[1]/sine, nxn2[2]/sine};
+        RotateAboutAxis(&spin[0], k, cos(angle), sin(angle));
+    }
+}
@@ -0,0 +1,85 @@
+#include "transfer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <stdexcept>
+
+using namespace std;
+
+TTransferTable::TTransferTable(const std::vector<std::string> &files, const std::array<double, 3> &guideaxis, const unsigned speedbins, const unsigned anglebins):
+		vmin(numeric_limits<double>::infinity()), vmax(0), nspeed(speedbins), nangle(anglebins){
+	double norm = sqrt(guideaxis[0]*guideaxis[0] + guideaxis[1]*guideaxis[1] + guideaxis[2]*guideaxis[2]);
+	if (norm == 0 || nspeed == 0 || nangle == 0)
+		throw runtime_error("Transfer tables need a guide axis and at least one speed and angle bin!");
+	for (int i = 0; i < 3; ++i)
+		axis[i] = guideaxis[i]/norm;
+
+	const size_t headersize = sizeof(TRANSFER_HEADER) - 1;
+	vector<TTransferRecord> unsorted;
+	for (auto &file: files){
+		ifstream f(file, ios::binary);
+		char header[headersize];
+		if (!f.read(header, headersize) || memcmp(header, TRANSFER_HEADER, headersize) != 0)
+			throw runtime_error("Could not read transfer file " + file);
+		TTransferRecord r;
+		while (f.read(reinterpret_cast<char*>(&r), sizeof(r)))
+			unsorted.push_back(r);
+		if (f.gcount() != 0)
+			throw runtime_error("Transfer file " + file + " is truncated!");
+	}
+	if (unsorted.empty())
+		throw runtime_error("Transfer files contain no particles!");
+	for (auto &r: unsorted){
+		double v = sqrt(r.vx*r.vx + r.vy*r.vy + r.vz*r.vz);
+		vmin = min(vmin, v);
+		vmax = max(vmax, v);
+	}
+	vmax = nextafter(vmax, numeric_limits<double>::infinity()); // fastest record lies inside last bin
+
+	// counting sort of records by bin
+	size_t nbins = nspeed*nangle;
+	vector<size_t> bins(unsorted.size());
+	binstart.assign(nbins + 1, 0);
+	for (size_t i = 0; i < unsorted.size(); ++i){
+		bins[i] = Bin(&unsorted[i].vx);
+		++binstart[bins[i] + 1];
+	}
+	for (size_t i = 0; i < nbins; ++i)
+		binstart[i + 1] += binstart[i];
+	records.resize(unsorted.size());
+	vector<size_t> next(binstart.begin(), binstart.end() - 1);
+	for (size_t i = 0; i < unsorted.size(); ++i)
+		records[next[bins[i]]++] = unsorted[i];
+
+	size_t transmitted = count_if(records.begin(), records.end(), [](const TTransferRecord &r){ return r.stopID == 0; });
+	size_t empty = 0;
+	for (size_t i = 0; i < nbins; ++i)
+		empty += binstart[i] == binstart[i + 1];
+	cout << "Read " << records.size() << " transfer records (" << transmitted << " transmitted) from " << files.size() << " files, "
+			<< empty << " of " << nbins << " bins are empty\n";
+}
+
+
+std::size_t TTransferTable::Bin(const double v[3]) const{
+	double speed = sqrt(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+	if (speed < vmin || speed >= vmax || speed == 0)
+		return nspeed*nangle;
+	double cosangle = (v[0]*axis[0] + v[1]*axis[1] + v[2]*axis[2])/speed;
+	unsigned ispeed = min(nspeed - 1, static_cast<unsigned>((speed - vmin)/(vmax - vmin)*nspeed));
+	unsigned iangle = min(nangle - 1, static_cast<unsigned>(max(0., (cosangle + 1)/2*nangle)));
+	return ispeed*nangle + iangle;
+}
+
+
+const TTransferRecord* TTransferTable::Sample(const double v[3], TMCGenerator &mc) const{
+	size_t bin = Bin(v);
+	if (bin >= nspeed*nangle || binstart[bin] == binstart[bin + 1])
+		return nullptr;
+	uniform_int_distribution<size_t> recorddist(binstart[bin], binstart[bin + 1] - 1);
+	return &records[recorddist(mc)];
+}
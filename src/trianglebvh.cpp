@@ -0,0 +1,378 @@
+/**
+ * \file
+ * Bounding-volume hierarchy over triangles, as a faster alternative to the CGAL AABB tree for segment-triangle intersection tests.
+ */
+
+#include "trianglebvh.h"
+
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <stdexcept>
+
+static const std::uint32_t NO_CHILD = std::numeric_limits<std::uint32_t>::max(); ///< Marks empty child slot of a node
+static const double BOX_PADDING = 1e-9; ///< Boxes are enlarged by this fraction of their size (plus the same absolute amount), so rounding errors never let a segment miss a box containing a hit triangle
+static const double EDGE_TOLERANCE = 1e-9; ///< Crossings closer than this (in barycentric coordinates) to an edge are checked with the watertight test
+static const double PARALLEL_TOLERANCE = 1e-12; ///< Segments with smaller sine of angle to a triangle's plane are checked with the watertight test
+
+
+TTriangleBVH::TTriangleBVH(const std::vector<TTriangle> &tris): triangles(tris){
+	if (triangles.size() >= NO_CHILD)
+		throw std::runtime_error("Too many triangles for bounding-volume hierarchy");
+	std::vector<std::uint32_t> order(triangles.size());
+	std::vector<TVertex> centroids(triangles.size());
+	for (std::size_t i = 0; i < triangles.size(); ++i){
+		order[i] = i;
+		for (int j = 0; j < 3; ++j)
+			centroids[i][j] = (triangles[i][0][j] + triangles[i][1][j] + triangles[i][2][j])/3;
+	}
+	nodes.reserve(2*triangles.size()/maxleaf + 1);
+	packets.reserve(triangles.size()/width + 1);
+	if (triangles.size() > maxleaf)
+		Build(order, centroids, 0, order.size());
+	else{ // root is a node with a single leaf
+		nodes.emplace_back();
+		std::fill_n(nodes[0].child, width, NO_CHILD);
+		std::fill_n(nodes[0].packets, width, 0);
+		if (not triangles.empty()){
+			SetBox(0, 0, order, 0, order.size());
+			AddLeaf(0, 0, order, 0, order.size());
+		}
+	}
+}
+
+
+std::uint32_t TTriangleBVH::Build(std::vector<std::uint32_t> &order, const std::vector<TVertex> &centroids, const std::size_t begin, const std::size_t end){
+	// split range in two at the median along the axis with the largest spread of centroids
+	auto split = [&order, &centroids](const std::size_t b, const std::size_t e){
+		TVertex min = centroids[order[b]], max = min;
+		for (std::size_t i = b; i < e; ++i){
+			for (int j = 0; j < 3; ++j){
+				min[j] = std::min(min[j], centroids[order[i]][j]);
+				max[j] = std::max(max[j], centroids[order[i]][j]);
+			}
+		}
+		int axis = 0;
+		for (int j = 1; j < 3; ++j){
+			if (max[j] - min[j] > max[axis] - min[axis])
+				axis = j;
+		}
+		std::size_t mid = b + (e - b)/2;
+		std::nth_element(order.begin() + b, order.begin() + mid, order.begin() + e, [&centroids, axis](const std::uint32_t i1, const std::uint32_t i2){
+			return centroids[i1][axis] < centroids[i2][axis];
+		});
+		return mid;
+	};
+	std::size_t mid = split(begin, end);
+	std::size_t bounds[width + 1] = {begin, split(begin, mid), mid, split(mid, end), end};
+
+	std::uint32_t node = nodes.size();
+	nodes.emplace_back();
+	for (int k = 0; k < width; ++k){
+		nodes[node].child[k] = NO_CHILD;
+		nodes[node].packets[k] = 0;
+		if (bounds[k + 1] == bounds[k])
+			continue;
+		SetBox(node, k, order, bounds[k], bounds[k + 1]);
+		if (bounds[k + 1] - bounds[k] <= maxleaf)
+			AddLeaf(node, k, order, bounds[k], bounds[k + 1]);
+		else{
+			std::uint32_t child = Build(order, centroids, bounds[k], bounds[k + 1]); // nodes might be reallocated, so do not hold a reference across this call
+			nodes[node].child[k] = child;
+		}
+	}
+	return node;
+}
+
+
+void TTriangleBVH::SetBox(const std::uint32_t node, const int slot, const std::vector<std::uint32_t> &order, const std::size_t begin, const std::size_t end){
+	double min[3], max[3];
+	for (int j = 0; j < 3; ++j){
+		min[j] = std::numeric_limits<double>::infinity();
+		max[j] = -std::numeric_limits<double>::infinity();
+	}
+	for (std::size_t i = begin; i < end; ++i){
+		for (const TVertex &v: triangles[order[i]]){
+			for (int j = 0; j < 3; ++j){
+				min[j] = std::min(min[j], v[j]);
+				max[j] = std::max(max[j], v[j]);
+			}
+		}
+	}
+	for (int j = 0; j < 3; ++j){
+		double padding = BOX_PADDING*(max[j] - min[j] + std::max(std::abs(min[j]), std::abs(max[j])) + 1);
+		nodes[node].min[j][slot] = min[j] - padding;
+		nodes[node].max[j][slot] = max[j] + padding;
+	}
+}
+
+
+void TTriangleBVH::AddLeaf(const std::uint32_t node, const int slot, const std::vector<std::uint32_t> &order, const std::size_t begin, const std::size_t end){
+	nodes[node].child[slot] = packets.size();
+	nodes[node].packets[slot] = (end - begin + width - 1)/width;
+	for (std::size_t i = begin; i < end; i += width){
+		TPacket p = TPacket();
+		for (int k = 0; k < width; ++k){
+			if (i + k >= end){
+				p.triangle[k] = NO_CHILD;
+				continue;
+			}
+			const TTriangle &tri = triangles[order[i + k]];
+			double e1sq = 0, e2sq = 0;
+			for (int j = 0; j < 3; ++j){
+				p.v0[j][k] = tri[0][j];
+				p.e1[j][k] = tri[1][j] - tri[0][j];
+				p.e2[j][k] = tri[2][j] - tri[0][j];
+				e1sq += p.e1[j][k]*p.e1[j][k];
+				e2sq += p.e2[j][k]*p.e2[j][k];
+			}
+			p.scale[k] = e1sq*e2sq;
+			p.triangle[k] = order[i + k];
+		}
+		packets.push_back(p);
+	}
+}
+
+
+bool TTriangleBVH::WatertightIntersection(const double p1[3], const double d[3], const std::size_t triangle, double &t) const{
+	// choose axis along which segment is longest as z axis, keeping the coordinate system right-handed
+	int kz = 0;
+	for (int j = 1; j < 3; ++j){
+		if (std::abs(d[j]) > std::abs(d[kz]))
+			kz = j;
+	}
+	if (d[kz] == 0)
+		return false;
+	int kx = (kz + 1) % 3, ky = (kx + 1) % 3;
+	if (d[kz] < 0)
+		std::swap(kx, ky);
+	// shear and scale vertices, so the segment points along z from the origin
+	double Sx = d[kx]/d[kz], Sy = d[ky]/d[kz], Sz = 1./d[kz];
+	const TTriangle &tri = triangles[triangle];
+	double x[3], y[3], z[3];
+	for (int i = 0; i < 3; ++i){
+		double a[3] = {tri[i][0] - p1[0], tri[i][1] - p1[1], tri[i][2] - p1[2]};
+		x[i] = a[kx] - Sx*a[kz];
+		y[i] = a[ky] - Sy*a[kz];
+		z[i] = Sz*a[kz];
+	}
+	double U = x[2]*y[1] - y[2]*x[1];
+	double V = x[0]*y[2] - y[0]*x[2];
+	double W = x[1]*y[0] - y[1]*x[0];
+	if (U == 0 || V == 0 || W == 0){ // segment crosses an edge within rounding error, recalculate with extended precision
+		U = static_cast<long double>(x[2])*y[1] - static_cast<long double>(y[2])*x[1];
+		V = static_cast<long double>(x[0])*y[2] - static_cast<long double>(y[0])*x[2];
+		W = static_cast<long double>(x[1])*y[0] - static_cast<long double>(y[1])*x[0];
+	}
+	if ((U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0))
+		return false;
+	double det = U + V + W;
+	if (det == 0)
+		return false;
+	t = (U*z[0] + V*z[1] + W*z[2])/det;
+	return t >= 0 && t <= 1;
+}
+
+
+void TTriangleBVH::IntersectTriangles(const TPacket &p, const double p1[3], const double d[3], const double dd, std::vector<THit> &hits) const{
+	auto addhit = [&](const double t, const std::uint32_t triangle){
+		hits.push_back({t, triangle, {p1[0] + t*d[0], p1[1] + t*d[1], p1[2] + t*d[2]}});
+	};
+	double status[width]; // 0: no intersection, 1: intersection, 2: close to edge or parallel, use watertight test (stored as double, so all lanes have the same width in SIMD registers)
+	double tval[width]; // parametric coordinate of intersection
+	for (int l = 0; l < width; ++l){ // Moeller-Trumbore test of all four triangles at once, without branches and with range checks scaled by the determinant instead of divided by it
+		double px = d[1]*p.e2[2][l] - d[2]*p.e2[1][l];
+		double py = d[2]*p.e2[0][l] - d[0]*p.e2[2][l];
+		double pz = d[0]*p.e2[1][l] - d[1]*p.e2[0][l];
+		double det = p.e1[0][l]*px + p.e1[1][l]*py + p.e1[2][l]*pz;
+		double tx = p1[0] - p.v0[0][l], ty = p1[1] - p.v0[1][l], tz = p1[2] - p.v0[2][l];
+		double qx = ty*p.e1[2][l] - tz*p.e1[1][l];
+		double qy = tz*p.e1[0][l] - tx*p.e1[2][l];
+		double qz = tx*p.e1[1][l] - ty*p.e1[0][l];
+		double sign = std::copysign(1., det);
+		double adet = std::abs(det);
+		double u = (tx*px + ty*py + tz*pz)*sign;
+		double v = (d[0]*qx + d[1]*qy + d[2]*qz)*sign;
+		double t = (p.e2[0][l]*qx + p.e2[1][l]*qy + p.e2[2][l]*qz)*sign;
+		double margin = EDGE_TOLERANCE*adet;
+		double edge = std::min(std::min(u, v), adet - u - v); // scaled distance of crossing to closest edge in barycentric coordinates
+		// conditions as 0 or 1, each from a single comparison and combined arithmetically, so the compiler can evaluate them for all lanes with masks
+		double parallel = adet*adet <= PARALLEL_TOLERANCE*PARALLEL_TOLERANCE*dd*p.scale[l] ? 1. : 0.;
+		double valid = p.scale[l] > 0 ? 1. : 0.;
+		double inrange = std::min(t, adet - t) >= 0 ? 1. : 0.;
+		double inside = edge > margin ? 1. : 0.;
+		double near = edge >= -margin ? 1. : 0.;
+		tval[l] = t/adet;
+		status[l] = 2*parallel*valid + (1 - parallel)*inrange*(2*near - inside);
+	}
+	for (int l = 0; l < width; ++l){
+		if (status[l] == 1)
+			addhit(std::min(tval[l], 1.), p.triangle[l]);
+		else if (status[l] == 2){
+			double t;
+			if (WatertightIntersection(p1, d, p.triangle[l], t))
+				addhit(t, p.triangle[l]);
+		}
+	}
+}
+
+
+void TTriangleBVH::Intersect(const double p1[3], const double p2[3], std::vector<THit> &hits) const{
+	hits.clear();
+	const double d[3] = {p2[0] - p1[0], p2[1] - p1[1], p2[2] - p1[2]};
+	IntersectSubtree(0, p1, d, hits);
+}
+
+
+void TTriangleBVH::IntersectSubtree(const std::uint32_t root, const double p1[3], const double d[3], std::vector<THit> &hits) const{
+	const double dd = d[0]*d[0] + d[1]*d[1] + d[2]*d[2];
+	double inv[3];
+	for (int j = 0; j < 3; ++j)
+		inv[j] = d[j] != 0 ? 1./d[j] : 1e300; // a large finite value keeps zero distances to slabs zero instead of NaN
+
+	std::uint32_t stack[64*width];
+	int stacksize = 0;
+	stack[stacksize++] = root;
+	while (stacksize > 0){
+		const TNode &node = nodes[stack[--stacksize]];
+		double t0[width], t1[width]; // slab test of all four boxes at once
+		for (int k = 0; k < width; ++k){
+			t0[k] = 0;
+			t1[k] = 1;
+		}
+		for (int j = 0; j < 3; ++j){
+			for (int k = 0; k < width; ++k){
+				double a = (node.min[j][k] - p1[j])*inv[j];
+				double b = (node.max[j][k] - p1[j])*inv[j];
+				t0[k] = std::max(t0[k], std::min(a, b));
+				t1[k] = std::min(t1[k], std::max(a, b));
+			}
+		}
+		for (int k = 0; k < width; ++k){
+			if (t0[k] > t1[k] || node.child[k] == NO_CHILD)
+				continue;
+			if (node.packets[k] == 0){
+				stack[stacksize++] = node.child[k];
+				continue;
+			}
+			for (std::uint32_t pi = node.child[k]; pi < node.child[k] + node.packets[k]; ++pi)
+				IntersectTriangles(packets[pi], p1, d, dd, hits);
+		}
+	}
+}
+
+
+void TTriangleBVH::IntersectPacket(const std::uint32_t *segments, const int count, const std::vector<TVertex> &p1, const std::vector<TVertex> &p2,
+		std::vector<std::vector<THit> > &hits) const{
+	// segments as structure of arrays, unused lanes get a degenerate segment far outside of all boxes
+	double o[3][segmentpacket], d[3][segmentpacket], inv[3][segmentpacket], dd[segmentpacket];
+	for (int s = 0; s < segmentpacket; ++s){
+		dd[s] = 0;
+		for (int j = 0; j < 3; ++j){
+			o[j][s] = s < count ? p1[segments[s]][j] : std::numeric_limits<double>::max();
+			d[j][s] = s < count ? p2[segments[s]][j] - p1[segments[s]][j] : 0;
+			inv[j][s] = d[j][s] != 0 ? 1./d[j][s] : 1e300; // a large finite value keeps zero distances to slabs zero instead of NaN
+			dd[s] += d[j][s]*d[j][s];
+		}
+	}
+
+	typedef std::uint32_t TMask; // bit s is set if segment s hits a box
+	static_assert(segmentpacket <= 8*sizeof(TMask), "Mask has fewer bits than segments in a packet");
+	std::pair<std::uint32_t, TMask> stack[64*width]; // node and segments that hit its box
+	int stacksize = 0;
+	stack[stacksize++] = std::make_pair(0u, static_cast<TMask>((1ull << count) - 1));
+	while (stacksize > 0){
+		const std::pair<std::uint32_t, TMask> top = stack[--stacksize];
+		int active = 0;
+		for (int s = 0; s < count; ++s)
+			active += top.second >> s & 1;
+		if (active <= segmentpacket/4){ // testing all segments of the packet costs more than traversing the subtree with each of the few segments left
+			for (int s = 0; s < count; ++s){
+				if (top.second >> s & 1){
+					const double ps[3] = {o[0][s], o[1][s], o[2][s]}, ds[3] = {d[0][s], d[1][s], d[2][s]};
+					IntersectSubtree(top.first, ps, ds, hits[segments[s]]);
+				}
+			}
+			continue;
+		}
+		const TNode &node = nodes[top.first];
+		for (int k = 0; k < width; ++k){
+			if (node.child[k] == NO_CHILD)
+				continue;
+			double hit[segmentpacket]; // slab test of box with all segments at once, same arithmetic as for a single segment
+			for (int s = 0; s < segmentpacket; ++s){
+				double t0 = 0, t1 = 1;
+				for (int j = 0; j < 3; ++j){
+					double a = (node.min[j][k] - o[j][s])*inv[j][s];
+					double b = (node.max[j][k] - o[j][s])*inv[j][s];
+					t0 = std::max(t0, std::min(a, b));
+					t1 = std::min(t1, std::max(a, b));
+				}
+				hit[s] = t0 > t1 ? 0. : 1.;
+			}
+			TMask mask = 0;
+			for (int s = 0; s < count; ++s)
+				mask |= static_cast<TMask>(hit[s] != 0) << s;
+			mask &= top.second;
+			if (mask == 0)
+				continue;
+			if (node.packets[k] == 0){
+				stack[stacksize++] = std::make_pair(node.child[k], mask);
+				continue;
+			}
+			for (int s = 0; s < count; ++s){
+				if ((mask >> s & 1) == 0)
+					continue;
+				const double ps[3] = {o[0][s], o[1][s], o[2][s]}, ds[3] = {d[0][s], d[1][s], d[2][s]};
+				for (std::uint32_t pi = node.child[k]; pi < node.child[k] + node.packets[k]; ++pi)
+					IntersectTriangles(packets[pi], ps, ds, dd[s], hits[segments[s]]);
+			}
+		}
+	}
+}
+
+
+void TTriangleBVH::Intersect(const std::vector<TVertex> &p1, const std::vector<TVertex> &p2, std::vector<std::vector<THit> > &hits) const{
+	const std::size_t count = p1.size();
+	if (p2.size() != count)
+		throw std::runtime_error("Different numbers of start and end points of segments");
+	if (count >= NO_CHILD)
+		throw std::runtime_error("Too many segments for a single query of the bounding-volume hierarchy");
+	hits.resize(count);
+	for (std::vector<THit> &h: hits)
+		h.clear();
+
+	// sort segments along a Morton curve through the bounding box of the root's children, so segments in a packet are close to each other
+	std::vector<std::uint32_t> order(count);
+	for (std::size_t i = 0; i < count; ++i)
+		order[i] = i;
+	if (count > static_cast<std::size_t>(segmentpacket)){
+		double min[3], max[3];
+		for (int j = 0; j < 3; ++j){
+			min[j] = std::numeric_limits<double>::infinity();
+			max[j] = -std::numeric_limits<double>::infinity();
+			for (int k = 0; k < width; ++k){
+				if (nodes[0].child[k] != NO_CHILD){
+					min[j] = std::min(min[j], nodes[0].min[j][k]);
+					max[j] = std::max(max[j], nodes[0].max[j][k]);
+				}
+			}
+		}
+		std::vector<std::uint32_t> keys(count);
+		for (std::size_t i = 0; i < count; ++i){
+			std::uint32_t key = 0, cell[3];
+			for (int j = 0; j < 3; ++j){
+				double f = max[j] > min[j] ? (0.5*(p1[i][j] + p2[i][j]) - min[j])/(max[j] - min[j]) : 0;
+				cell[j] = static_cast<std::uint32_t>(std::min(std::max(f, 0.), 1.)*1023); // 10 bits per axis
+			}
+			for (int b = 9; b >= 0; --b){
+				for (int j = 0; j < 3; ++j)
+					key = key << 1 | (cell[j] >> b & 1);
+			}
+			keys[i] = key;
+		}
+		std::stable_sort(order.begin(), order.end(), [&keys](const std::uint32_t i1, const std::uint32_t i2){ return keys[i1] < keys[i2]; });
+	}
+	for (std::size_t first = 0; first < count; first += segmentpacket)
+		IntersectPacket(&order[first], std::min<std::size_t>(segmentpacket, count - first), p1, p2, hits);
+}
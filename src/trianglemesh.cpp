@@ -2,7 +2,22 @@
 
 #include <fstream>
 #include <random>
+#include <limits>
+#include <cmath>
+#include <cstring>
+#include <set>
+#include <map>
+#include <sstream>
+#include <atomic>
+#include <unordered_map>
+#include <numeric>
 #include <boost/format.hpp>
+#include <boost/interprocess/sync/file_lock.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/function_output_iterator.hpp>
+#include <boost/iterator/counting_iterator.hpp>
+#include <CGAL/Surface_mesh.h>
+#include <CGAL/Polygon_mesh_processing/compute_normal.h>
 #include <CGAL/Polygon_mesh_processing/polygon_soup_to_polygon_mesh.h>
 #include <CGAL/Polygon_mesh_processing/repair_polygon_soup.h>
 #include <CGAL/Polygon_mesh_processing/self_intersections.h>
@@ -12,160 +27,1153 @@
 #include <CGAL/boost/graph/Face_filtered_graph.h>
 #include <CGAL/Polygon_mesh_processing/repair.h>
 
+#include "field_3d.h"
+#include "globals.h"
 
-// read triangles from STL-file
-std::string TTriangleMesh::ReadFile(const std::string &filename, const int ID){
-	std::ifstream f(filename, std::fstream::binary);
-	if (!f.is_open())
+typedef CGAL::Surface_mesh<CPoint> CMesh; ///< CGAL triangle mesh type, only used to repair and validate meshes
+
+/**
+ * Header of cache file containing a validated mesh, see TValidatedMesh
+ */
+struct TMeshCacheHeader{
+    char magic[8]; ///< Identifies file as mesh cache
+    std::uint64_t version; ///< Version of cache format
+    std::uint64_t key; ///< Key identifying STL file
+    std::uint64_t namelength; ///< Length of name in STL header
+    std::uint64_t vertices; ///< Number of vertices
+    std::uint64_t faces; ///< Number of triangles
+    std::uint64_t components; ///< Number of connected components
+    std::uint64_t affected_components; ///< Number of components that are not closed, do not bound a volume, or are self-intersecting
+    std::uint64_t polygon_mesh; ///< 1 if the triangles in the STL file form a mesh, 0 otherwise
+    double area; ///< Total area of mesh [cm2]
+    double volume; ///< Volume enclosed by mesh [cm3]
+    double border_length; ///< Total circumference of holes in mesh [cm]
+    double self_intersecting_area; ///< Self-intersecting area of mesh [cm2]
+    std::uint64_t voxelresolution; ///< Number of voxels along longest side of bounding box, see TVoxelGrid (0: no voxels)
+    std::uint64_t voxelcells[3]; ///< Number of voxels along each axis
+    double voxelorigin[3]; ///< Lower corner of voxel grid
+    double voxelsize[3]; ///< Size of voxels along each axis
+};
+
+const char mesh_cache_magic[8] = "PENMesh"; ///< Magic string at start of mesh cache file
+const std::uint64_t mesh_cache_version = 4; ///< Version of mesh cache format, increase when layout of file or mesh repair changes
+
+/**
+ * Repaired mesh read from an STL file, together with the results of its validation
+ */
+struct TValidatedMesh{
+    TMeshCacheHeader info; ///< Sizes and validation results
+    std::string name; ///< Name in STL header
+    std::vector<CPoint> vertices; ///< Vertices of repaired mesh
+    std::vector<std::array<std::uint64_t, 3> > faces; ///< Vertex indices of each triangle, in the order of vertices_around_face
+    std::vector<CVector> normals; ///< Unit normal of each triangle
+    std::vector<double> areas; ///< Area of each triangle
+    std::vector<std::uint16_t> tags; ///< Surface tag of each triangle, taken from the attribute bytes in the STL file (0: untagged)
+    TVoxelGrid voxels; ///< Classification of voxels covering the mesh
+};
+
+/**
+ * Merge vertices closer than a tolerance when building a list of vertices
+ *
+ * Vertices are stored in a hash map of cubic cells that are much larger than the tolerance,
+ * so a new vertex usually only has to be compared to the vertices in its own cell, and to those in neighbouring cells only if it lies within the tolerance of a cell boundary.
+ */
+class TVertexWelder{
+private:
+    typedef std::array<std::int64_t, 3> TCell; ///< Integer coordinates of a cell
+
+    /**
+     * Hash function for cell coordinates
+     */
+    struct TCellHash{
+        std::size_t operator()(const TCell &c) const{
+            std::uint64_t h = 14695981039346656037ULL;
+            for (std::int64_t i: c)
+                h = (h ^ static_cast<std::uint64_t>(i))*1099511628211ULL;
+            return h;
+        }
+    };
+
+    std::vector<CPoint> &vertices; ///< List of vertices
+    double tolerance; ///< Vertices closer than this are merged
+    double cellsize; ///< Size of cells
+    std::unordered_map<TCell, std::size_t, TCellHash> cells; ///< Index of last vertex added to each cell
+    std::vector<std::size_t> previous; ///< Index of vertex added to the same cell before each vertex (none: first vertex in cell)
+    static const std::size_t none = std::numeric_limits<std::size_t>::max(); ///< Marks end of list of vertices in a cell
+public:
+    /**
+     * Constructor
+     *
+     * @param v List to which vertices are added, has to be empty
+     * @param tol Vertices closer than this are merged
+     */
+    TVertexWelder(std::vector<CPoint> &v, const double tol): vertices(v), tolerance(tol), cellsize(1024*tol){ }
+
+    /**
+     * Add vertex to list, if there is no vertex within tolerance in the list yet
+     *
+     * @param p Vertex
+     *
+     * @return Returns index of vertex in list
+     */
+    std::size_t Add(const CPoint &p){
+        TCell c;
+        std::int64_t lower[3], upper[3]; // range of neighbouring cells that can contain vertices within tolerance
+        for (int i = 0; i < 3; ++i){
+            double x = p[i]/cellsize;
+            c[i] = static_cast<std::int64_t>(std::floor(x));
+            lower[i] = x - c[i] < tolerance/cellsize ? -1 : 0;
+            upper[i] = c[i] + 1 - x < tolerance/cellsize ? 1 : 0;
+        }
+        for (std::int64_t i = lower[0]; i <= upper[0]; ++i){
+            for (std::int64_t j = lower[1]; j <= upper[1]; ++j){
+                for (std::int64_t k = lower[2]; k <= upper[2]; ++k){
+                    auto cell = cells.find({c[0] + i, c[1] + j, c[2] + k});
+                    if (cell == cells.end())
+                        continue;
+                    for (std::size_t v = cell->second; v != none; v = previous[v]){
+                        if (CGAL::squared_distance(p, vertices[v]) < tolerance*tolerance)
+                            return v;
+                    }
+                }
+            }
+        }
+        auto cell = cells.insert(std::make_pair(c, none)).first; // returns existing cell, if there is one
+        previous.push_back(cell->second);
+        cell->second = vertices.size();
+        vertices.push_back(p);
+        return vertices.size() - 1;
+    }
+};
+const std::size_t TVertexWelder::none;
+
+
+/**
+ * Read and validate STL file
+ *
+ * Repairs and orients the triangle soup, builds a mesh from it and checks each connected component for holes and self-intersections.
+ * Components are checked in parallel.
+ *
+ * @param filename Filename of STL file
+ * @param nthreads Number of threads used to check components
+ * @param out Stream receiving progress messages
+ *
+ * @return Returns repaired mesh and results of validation
+ */
+static TValidatedMesh ValidateMesh(const std::string &filename, const unsigned nthreads, std::ostream &out){
+	boost::iostreams::mapped_file_source file;
+	try{
+		file.open(filename);
+	}
+	catch (std::exception &e){
 		throw std::runtime_error( (boost::format("Could not open %1%") % filename).str() );
+	}
+	const std::size_t HEADER = 84, RECORD = 50; // 80-byte header and triangle count, each triangle is stored as normal, three vertices, and 2 attribute bytes, not used in the STL standard (http://www.ennex.com/~fabbers/StL.asp)
+	if (file.size() < HEADER)
+		throw std::runtime_error( (boost::format("%1% is too short for an STL file") % filename).str() );
 
-	char header[80];
-	f.read(header, 80); // read 80-byte header
-	std::string sldname(std::move(header), 80);
+	TValidatedMesh result;
+	std::string sldname(file.data(), 80);
 	sldname.erase(sldname.find_last_not_of(" ") + 1); // strip trailing whitespace from header
+	result.name = sldname;
 
-	unsigned int filefacecount;
-	f.read((char*)&filefacecount,4);
+	std::uint32_t filefacecount;
+	std::memcpy(&filefacecount, file.data() + 80, 4);
 	if (filefacecount == 0)
 		throw std::runtime_error( (boost::format("%1% contains no triangles") % filename).str() );
-	std::cout << "Reading '" << filename << "' containing " << filefacecount << " triangles ... ";    // print header
+	out << "Reading '" << filename << "' containing " << filefacecount << " triangles ... ";    // print header
 
+	std::size_t nrecords = (file.size() - HEADER)/RECORD;
+	bool lasttagmissing = (file.size() - HEADER) % RECORD >= RECORD - 2; // attribute bytes of last triangle might be missing
+	if (lasttagmissing)
+		++nrecords;
+	if (nrecords != filefacecount)
+		throw std::runtime_error( (boost::format("%1% should contain %2% triangles but read %3%") % filename % filefacecount % nrecords).str() );
+
+	// parse records directly from the mapped file into flat arrays of welded vertices, vertex indices, and tags
 	std::vector<CPoint> vertices;
-	std::vector<std::vector<size_t> > faces;
-	while (f){
-		f.seekg(3*4,std::fstream::cur);  // skip normal in STL-file (will be calculated from vertices)
-        std::vector<size_t> vidx;
+	vertices.reserve(filefacecount/2 + 3); // closed meshes have about half as many vertices as triangles
+	TVertexWelder welder(vertices, REFLECT_TOLERANCE);
+	std::vector<size_t> indices(3*nrecords);
+	std::vector<std::uint16_t> filetags(nrecords, 0); // attribute bytes of each triangle in the file
+	for (std::size_t i = 0; i < nrecords; ++i){
+		const char *record = file.data() + HEADER + i*RECORD;
+		if (i + 1 < nrecords || not lasttagmissing)
+			std::memcpy(&filetags[i], record + 48, 2);
+		float v[9];
+		std::memcpy(v, record + 12, sizeof(v)); // skip normal in STL-file (will be calculated from vertices), records are not aligned
 		for (short j = 0; j < 3; j++){
-		    float v[3];
-		    f.read((char*)v,12);
-			if (f) {
-                CPoint p(std::abs(v[0]) < REFLECT_TOLERANCE ? 0. : v[0], std::abs(v[1]) < REFLECT_TOLERANCE ? 0. : v[1], std::abs(v[2]) < REFLECT_TOLERANCE ? 0. : v[2]);
-                auto vertex = vertices.end(); //std::find_if(vertices.begin(), vertices.end(), [&p](const CPoint &p2) { return CGAL::squared_distance(p, p2) < std::pow(REFLECT_TOLERANCE, 2); });
-                vidx.push_back(std::distance(vertices.begin(), vertex));
-                if (vertex == vertices.end())
-                    vertices.push_back(p);
-            }
+			CPoint p(std::abs(v[3*j]) < REFLECT_TOLERANCE ? 0. : v[3*j], std::abs(v[3*j + 1]) < REFLECT_TOLERANCE ? 0. : v[3*j + 1], std::abs(v[3*j + 2]) < REFLECT_TOLERANCE ? 0. : v[3*j + 2]);
+			indices[3*i + j] = welder.Add(p); // merge vertices closer than REFLECT_TOLERANCE
 		}
-		if (f) {
-            faces.push_back(vidx);
-            f.seekg(2, std::fstream::cur);    // 2 attribute bytes, not used in the STL standard (http://www.ennex.com/~fabbers/StL.asp)
-        }
 	}
-	f.close();
+	file.close();
 
-	if (faces.size() != filefacecount)
-		throw std::runtime_error( (boost::format("%1% should contain %2% triangles but read %3%") % filename % filefacecount % faces.size()).str() );
+	// repairing the soup removes and reorders triangles, so tags are looked up by the sorted vertices of each triangle afterwards
+	typedef std::array<CPoint, 3> TSortedVertices;
+	std::map<TSortedVertices, std::uint16_t> tagged;
+	auto sorted = [](TSortedVertices v){ std::sort(v.begin(), v.end()); return v; };
+	for (std::size_t i = 0; i < nrecords; ++i){
+		if (filetags[i] != 0)
+			tagged[sorted({{vertices[indices[3*i]], vertices[indices[3*i + 1]], vertices[indices[3*i + 2]]}})] = filetags[i];
+	}
+
+	std::vector<std::vector<size_t> > faces; // the soup functions of CGAL remove vertices from polygons, so they need resizable polygons
+	faces.reserve(nrecords);
+	for (std::size_t i = 0; i < nrecords; ++i)
+		faces.emplace_back(indices.begin() + 3*i, indices.begin() + 3*i + 3);
+	std::vector<size_t>().swap(indices);
 
     namespace PMP = CGAL::Polygon_mesh_processing;
     typedef boost::graph_traits<CMesh>::face_descriptor fd;
-    auto cerr_precision = std::cerr.precision(3);
-    auto cout_precision = std::cout.precision(3);
     PMP::repair_polygon_soup(vertices, faces/*, CGAL::parameters::require_same_orientation(true)*/);
     PMP::orient_polygon_soup(vertices, faces);
-    std::unique_ptr<CMesh> mesh(new CMesh());
-
-    if (not PMP::is_polygon_soup_a_polygon_mesh(faces))
-        //throw(std::runtime_error("Triangles do not form a mesh"));
-        std::cerr << "Triangles in " << filename << " do not form a mesh\n";
-    PMP::polygon_soup_to_polygon_mesh(vertices, faces, *mesh);
-//    CGAL::Polygon_mesh_processing::duplicate_non_manifold_vertices(*mesh);
-    double A = PMP::area(*mesh)*1e4;
-    double V = PMP::volume(*mesh)*1e6;
-
-    auto fccmap = mesh->add_property_map<fd, boost::graph_traits<CMesh>::faces_size_type>("f:CC").first;
-    auto num = PMP::connected_components(*mesh, fccmap);
-    std::cout << "built mesh with " << mesh->number_of_faces() << " triangles and " << num << " components (" << A << "cm2, " << V << "cm3)\n";
-    int affected_components = 0;
-    double border_length = 0.;
-    double self_intersecting_area = 0.;
-    for (size_t i = 0; i < num; ++i) {
-        CGAL::Face_filtered_graph<CMesh> ffg(*mesh, i, fccmap);
-        bool not_closed = not CGAL::is_closed(ffg);
-        bool not_bounding = not PMP::does_bound_a_volume(ffg);
-        bool self_intersecting = PMP::does_self_intersect(ffg);
-        if (not_closed){
-            std::vector<boost::graph_traits<CMesh>::halfedge_descriptor> border_edges;
-            PMP::border_halfedges(ffg, std::back_inserter(border_edges));
-            for (auto edge: border_edges)
-                border_length += PMP::edge_length(edge, *mesh);
-        }
-        if (self_intersecting){
-            std::vector<std::pair<fd, fd> > self_intersecting_face_pairs;
-            PMP::self_intersections(ffg, std::back_inserter(self_intersecting_face_pairs));
-            std::set<fd> self_intersecting_faces;
-            for (auto face_pair: self_intersecting_face_pairs) {
-                self_intersecting_faces.insert(face_pair.first);
-                self_intersecting_faces.insert(face_pair.second);
-            }
-            for (auto face: self_intersecting_faces)
-                self_intersecting_area += PMP::face_area(face, *mesh);
-        }
-        if (not_closed or not_bounding or self_intersecting) {
-            ++affected_components;
-        }
-    }
-    if (affected_components > 0) {
-        std::cerr << "\nWarning: " << affected_components << " of " << num << " components in "
-                  << filename << " have holes with total circumference "
-                  << border_length * 1e2 << "cm and " << self_intersecting_area * 1e4
-                  << "cm2 of their area is self-intersecting!\n\n";
-    }
-    std::cerr.precision(cout_precision);
-    std::cerr.precision(cerr_precision);
-
-    std::vector<double> areas;
-    std::transform(mesh->faces_begin(), mesh->faces_end(), std::back_inserter(areas), [&mesh](const CMesh::Face_index &fi){ return CGAL::Polygon_mesh_processing::face_area(fi, *mesh); });
-    std::discrete_distribution<size_t> triangle_sampler(areas.begin(), areas.end());
-
-    std::unique_ptr<CTree> tree(new CTree(mesh->faces_begin(), mesh->faces_end(), *mesh));
-    tree->accelerate_distance_queries();
+    CMesh mesh;
+
+    result.info.polygon_mesh = PMP::is_polygon_soup_a_polygon_mesh(faces);
+    PMP::polygon_soup_to_polygon_mesh(vertices, faces, mesh);
+//    CGAL::Polygon_mesh_processing::duplicate_non_manifold_vertices(mesh);
+    result.info.area = PMP::area(mesh)*1e4;
+    result.info.volume = PMP::volume(mesh)*1e6;
+
+    auto fccmap = mesh.add_property_map<fd, boost::graph_traits<CMesh>::faces_size_type>("f:CC").first;
+    result.info.components = PMP::connected_components(mesh, fccmap);
+    struct TComponentCheck{
+        bool affected; ///< True if component is not closed, does not bound a volume, or is self-intersecting
+        double border_length; ///< Circumference of holes in component [cm]
+        double self_intersecting_area; ///< Self-intersecting area of component [cm2]
+    };
+    std::vector<TComponentCheck> checks(result.info.components);
+    ParallelFor(checks.size(), nthreads, [&](const unsigned long begin, const unsigned long end){
+        for (unsigned long i = begin; i < end; ++i) {
+            CGAL::Face_filtered_graph<CMesh> ffg(mesh, i, fccmap);
+            bool not_closed = not CGAL::is_closed(ffg);
+            bool not_bounding = not PMP::does_bound_a_volume(ffg);
+            bool self_intersecting = PMP::does_self_intersect(ffg);
+            TComponentCheck &check = checks[i];
+            check.border_length = 0.;
+            check.self_intersecting_area = 0.;
+            if (not_closed){
+                std::vector<boost::graph_traits<CMesh>::halfedge_descriptor> border_edges;
+                PMP::border_halfedges(ffg, std::back_inserter(border_edges));
+                for (auto edge: border_edges)
+                    check.border_length += PMP::edge_length(edge, mesh)*1e2;
+            }
+            if (self_intersecting){
+                std::vector<std::pair<fd, fd> > self_intersecting_face_pairs;
+                PMP::self_intersections(ffg, std::back_inserter(self_intersecting_face_pairs));
+                std::set<fd> self_intersecting_faces;
+                for (auto face_pair: self_intersecting_face_pairs) {
+                    self_intersecting_faces.insert(face_pair.first);
+                    self_intersecting_faces.insert(face_pair.second);
+                }
+                for (auto face: self_intersecting_faces)
+                    check.self_intersecting_area += PMP::face_area(face, mesh)*1e4;
+            }
+            check.affected = not_closed or not_bounding or self_intersecting;
+        }
+    });
+    result.info.affected_components = 0;
+    result.info.border_length = 0.;
+    result.info.self_intersecting_area = 0.;
+    for (const TComponentCheck &check: checks){ // sum in order of components, so results do not depend on the number of threads
+        result.info.affected_components += check.affected;
+        result.info.border_length += check.border_length;
+        result.info.self_intersecting_area += check.self_intersecting_area;
+    }
+
+    for (auto v: mesh.vertices())
+        result.vertices.push_back(mesh.point(v));
+    auto normals = mesh.add_property_map<CMesh::Face_index, CVector>("f:normal").first;
+    PMP::compute_face_normals(mesh, normals);
+    for (auto face: mesh.faces()){
+        std::array<std::uint64_t, 3> vidx;
+        auto v = vidx.begin();
+        for (auto vertex: CGAL::vertices_around_face(mesh.halfedge(face), mesh))
+            *v++ = vertex.idx();
+        result.faces.push_back(vidx);
+        result.normals.push_back(normals[face]);
+        result.areas.push_back(PMP::face_area(face, mesh));
+        std::uint16_t tag = 0;
+        if (not tagged.empty()){
+            auto t = tagged.find(sorted({{result.vertices[vidx[0]], result.vertices[vidx[1]], result.vertices[vidx[2]]}}));
+            if (t != tagged.end())
+                tag = t->second;
+        }
+        result.tags.push_back(tag);
+    }
+    result.info.namelength = result.name.size();
+    result.info.vertices = result.vertices.size();
+    result.info.faces = result.faces.size();
+    return result;
+}
+
+
+/**
+ * Classify voxels covering a validated mesh as inside, outside, or intersected by triangles
+ *
+ * Voxels intersected by triangles are marked as boundary. The other voxels in each column along z are classified by the number of triangles above them that are crossed by a vertical line through the column,
+ * at an asymmetric point so the line does not hit triangle edges of axis-aligned surfaces. Meshes with holes or self-intersections are not classified, since the parity of crossings is not meaningful for them.
+ *
+ * @param mesh Validated mesh, its voxels are replaced
+ * @param resolution Number of voxels along the longest side of the mesh's bounding box (0: do not classify)
+ */
+static void VoxelizeMesh(TValidatedMesh &mesh, const unsigned resolution){
+    TVoxelGrid &grid = mesh.voxels;
+    grid = TVoxelGrid();
+    grid.resolution = resolution;
+    if (resolution == 0 || mesh.info.affected_components > 0 || mesh.faces.empty())
+        return;
+
+    CGAL::Bbox_3 bbox = CGAL::bbox_3(mesh.vertices.begin(), mesh.vertices.end());
+    double maxextent = std::max({bbox.xmax() - bbox.xmin(), bbox.ymax() - bbox.ymin(), bbox.zmax() - bbox.zmin()});
+    if (not (maxextent > 0))
+        return;
+    double margin = 1e-6*maxextent; // grid extends slightly beyond bounding box, so vertices do not lie on its boundary
+    for (int i = 0; i < 3; ++i){
+        double extent = bbox.max(i) - bbox.min(i) + 2*margin;
+        grid.cells[i] = std::max<std::uint64_t>(std::ceil(resolution*extent/(maxextent + 2*margin)), 1);
+        grid.origin[i] = bbox.min(i) - margin;
+        grid.size[i] = extent/grid.cells[i];
+    }
+    const std::uint64_t nx = grid.cells[0], ny = grid.cells[1], nz = grid.cells[2];
+    std::vector<std::uint8_t> states(nx*ny*nz, TVoxelGrid::outside);
+    std::vector<std::vector<double> > crossings(nx*ny); // z coordinates of triangles crossing the vertical line through each column
+
+    auto cellrange = [&grid](const int axis, const double min, const double max, std::uint64_t &first, std::uint64_t &last){
+        first = std::min<std::uint64_t>(std::max((min - grid.origin[axis])/grid.size[axis], 0.), grid.cells[axis] - 1);
+        last = std::min<std::uint64_t>(std::max((max - grid.origin[axis])/grid.size[axis], 0.), grid.cells[axis] - 1);
+    };
+    for (const auto &face: mesh.faces){
+        CKernel::Triangle_3 triangle(mesh.vertices[face[0]], mesh.vertices[face[1]], mesh.vertices[face[2]]);
+        CGAL::Bbox_3 b = triangle.bbox();
+        std::uint64_t first[3], last[3];
+        for (int i = 0; i < 3; ++i)
+            cellrange(i, b.min(i), b.max(i), first[i], last[i]);
+        for (std::uint64_t k = first[2]; k <= last[2]; ++k){
+            for (std::uint64_t j = first[1]; j <= last[1]; ++j){
+                for (std::uint64_t i = first[0]; i <= last[0]; ++i){
+                    std::uint8_t &state = states[(k*ny + j)*nx + i];
+                    if (state == TVoxelGrid::boundary)
+                        continue;
+                    // enlarge voxel slightly, so rounding errors never classify a voxel touched by a triangle as inside or outside
+                    CPoint vmin(grid.origin[0] + (i - 1e-3)*grid.size[0], grid.origin[1] + (j - 1e-3)*grid.size[1], grid.origin[2] + (k - 1e-3)*grid.size[2]);
+                    CPoint vmax(grid.origin[0] + (i + 1 + 1e-3)*grid.size[0], grid.origin[1] + (j + 1 + 1e-3)*grid.size[1], grid.origin[2] + (k + 1 + 1e-3)*grid.size[2]);
+                    if (CGAL::do_intersect(triangle, CCuboid(vmin, vmax)))
+                        state = TVoxelGrid::boundary;
+                }
+            }
+        }
+
+        const CPoint &p0 = triangle[0], &p1 = triangle[1], &p2 = triangle[2];
+        double det = (p1.x() - p0.x())*(p2.y() - p0.y()) - (p2.x() - p0.x())*(p1.y() - p0.y());
+        if (det == 0) // triangle parallel to z axis is never crossed by vertical lines
+            continue;
+        for (std::uint64_t j = first[1]; j <= last[1]; ++j){
+            for (std::uint64_t i = first[0]; i <= last[0]; ++i){
+                double x = grid.origin[0] + (i + 0.618034)*grid.size[0], y = grid.origin[1] + (j + 0.414214)*grid.size[1];
+                double a = ((x - p0.x())*(p2.y() - p0.y()) - (p2.x() - p0.x())*(y - p0.y()))/det; // barycentric coordinates of line in projection of triangle
+                double c = ((p1.x() - p0.x())*(y - p0.y()) - (x - p0.x())*(p1.y() - p0.y()))/det;
+                if (a >= 0 && c >= 0 && a + c <= 1)
+                    crossings[j*nx + i].push_back(p0.z() + a*(p1.z() - p0.z()) + c*(p2.z() - p0.z()));
+            }
+        }
+    }
+
+    for (std::uint64_t j = 0; j < ny; ++j){
+        for (std::uint64_t i = 0; i < nx; ++i){
+            std::vector<double> &zs = crossings[j*nx + i];
+            std::sort(zs.begin(), zs.end());
+            for (std::uint64_t k = 0; k < nz; ++k){
+                std::uint8_t &state = states[(k*ny + j)*nx + i];
+                if (state == TVoxelGrid::boundary)
+                    continue;
+                double z = grid.origin[2] + (k + 0.732051)*grid.size[2];
+                std::size_t above = zs.end() - std::upper_bound(zs.begin(), zs.end(), z);
+                state = above % 2 != 0 ? TVoxelGrid::inside : TVoxelGrid::outside;
+            }
+        }
+    }
+    grid.states.swap(states);
+}
+
+
+/**
+ * Read validated mesh from cache file
+ *
+ * @param cachefile Cache file written by WriteMeshCache
+ * @param key Key identifying STL file
+ *
+ * @return Returns validated mesh
+ */
+static TValidatedMesh ReadMeshCache(const boost::filesystem::path &cachefile, const std::uint64_t key){
+    std::ifstream f(cachefile.string(), std::ifstream::binary);
+    TValidatedMesh result;
+    if (not f.read(reinterpret_cast<char*>(&result.info), sizeof(result.info)))
+        throw std::runtime_error("Cache file " + cachefile.string() + " is too short");
+    if (std::memcmp(result.info.magic, mesh_cache_magic, sizeof(mesh_cache_magic)) != 0 || result.info.version != mesh_cache_version)
+        throw std::runtime_error("Cache file " + cachefile.string() + " has incompatible format");
+    if (result.info.key != key)
+        throw std::runtime_error("Cache file " + cachefile.string() + " does not match STL file");
+    std::uint64_t voxelcount = result.info.voxelcells[0]*result.info.voxelcells[1]*result.info.voxelcells[2];
+    std::uint64_t size = sizeof(result.info) + result.info.namelength + result.info.vertices*3*sizeof(double) + result.info.faces*(3*sizeof(std::uint64_t) + 4*sizeof(double) + sizeof(std::uint16_t))
+                         + voxelcount;
+    if (boost::filesystem::file_size(cachefile) != size)
+        throw std::runtime_error("Cache file " + cachefile.string() + " has wrong size");
+
+    result.name.resize(result.info.namelength);
+    f.read(&result.name[0], result.name.size());
+    std::vector<double> coords(3*std::max(result.info.vertices, result.info.faces));
+    f.read(reinterpret_cast<char*>(coords.data()), result.info.vertices*3*sizeof(double));
+    for (std::uint64_t i = 0; i < result.info.vertices; ++i)
+        result.vertices.emplace_back(coords[3*i], coords[3*i + 1], coords[3*i + 2]);
+    result.faces.resize(result.info.faces);
+    f.read(reinterpret_cast<char*>(result.faces.data()), result.faces.size()*sizeof(result.faces[0]));
+    f.read(reinterpret_cast<char*>(coords.data()), result.info.faces*3*sizeof(double));
+    for (std::uint64_t i = 0; i < result.info.faces; ++i)
+        result.normals.emplace_back(coords[3*i], coords[3*i + 1], coords[3*i + 2]);
+    result.areas.resize(result.info.faces);
+    f.read(reinterpret_cast<char*>(result.areas.data()), result.areas.size()*sizeof(double));
+    result.tags.resize(result.info.faces);
+    f.read(reinterpret_cast<char*>(result.tags.data()), result.tags.size()*sizeof(std::uint16_t));
+    TVoxelGrid &grid = result.voxels;
+    grid.resolution = result.info.voxelresolution;
+    for (int i = 0; i < 3; ++i){
+        grid.cells[i] = result.info.voxelcells[i];
+        grid.origin[i] = result.info.voxelorigin[i];
+        grid.size[i] = result.info.voxelsize[i];
+    }
+    grid.states.resize(voxelcount);
+    f.read(reinterpret_cast<char*>(grid.states.data()), grid.states.size());
+    if (!f)
+        throw std::runtime_error("Could not read " + cachefile.string());
+    for (const auto &face: result.faces){
+        if (std::any_of(face.begin(), face.end(), [&result](const std::uint64_t v){ return v >= result.info.vertices; }))
+            throw std::runtime_error("Cache file " + cachefile.string() + " is corrupt");
+    }
+    if (std::any_of(grid.states.begin(), grid.states.end(), [](const std::uint8_t state){ return state > TVoxelGrid::boundary; }))
+        throw std::runtime_error("Cache file " + cachefile.string() + " is corrupt");
+    return result;
+}
+
+
+/**
+ * Write validated mesh to cache file
+ *
+ * @param cachefile Cache file
+ * @param key Key identifying STL file
+ * @param mesh Validated mesh
+ */
+static void WriteMeshCache(const boost::filesystem::path &cachefile, const std::uint64_t key, TValidatedMesh &mesh){
+    std::memcpy(mesh.info.magic, mesh_cache_magic, sizeof(mesh_cache_magic));
+    mesh.info.version = mesh_cache_version;
+    mesh.info.key = key;
+    mesh.info.voxelresolution = mesh.voxels.resolution;
+    for (int i = 0; i < 3; ++i){
+        mesh.info.voxelcells[i] = mesh.voxels.cells[i];
+        mesh.info.voxelorigin[i] = mesh.voxels.origin[i];
+        mesh.info.voxelsize[i] = mesh.voxels.size[i];
+    }
+
+    // write to temporary file first, so other processes never see a partially written cache
+    boost::filesystem::path tmpfile = boost::filesystem::unique_path(cachefile.string() + ".%%%%-%%%%.tmp");
+    {
+        std::ofstream f(tmpfile.string(), std::ofstream::binary);
+        f.write(reinterpret_cast<const char*>(&mesh.info), sizeof(mesh.info));
+        f.write(mesh.name.data(), mesh.name.size());
+        for (const CPoint &p: mesh.vertices){
+            double coords[3] = {p.x(), p.y(), p.z()};
+            f.write(reinterpret_cast<const char*>(coords), sizeof(coords));
+        }
+        f.write(reinterpret_cast<const char*>(mesh.faces.data()), mesh.faces.size()*sizeof(mesh.faces[0]));
+        for (const CVector &n: mesh.normals){
+            double coords[3] = {n.x(), n.y(), n.z()};
+            f.write(reinterpret_cast<const char*>(coords), sizeof(coords));
+        }
+        f.write(reinterpret_cast<const char*>(mesh.areas.data()), mesh.areas.size()*sizeof(double));
+        f.write(reinterpret_cast<const char*>(mesh.tags.data()), mesh.tags.size()*sizeof(std::uint16_t));
+        f.write(reinterpret_cast<const char*>(mesh.voxels.states.data()), mesh.voxels.states.size());
+        if (!f){
+            boost::system::error_code ec;
+            boost::filesystem::remove(tmpfile, ec);
+            throw std::runtime_error("Could not write " + tmpfile.string());
+        }
+    }
+    boost::filesystem::rename(tmpfile, cachefile);
+}
+
+
+/**
+ * Load validated mesh from cache file, or read and validate STL file and store it in cache file
+ *
+ * Holds a lock on the cache file while the STL file is validated, so simultaneous jobs validate it only once.
+ * If the voxels in the cache file have a different resolution, they are classified again and the cache file is replaced.
+ *
+ * @param filename Filename of STL file
+ * @param cachedir Cache directory (empty: do not use cache)
+ * @param nthreads Number of threads used to validate the mesh
+ * @param voxelresolution Number of voxels along longest side of mesh's bounding box, see VoxelizeMesh
+ * @param out Stream receiving progress messages
+ *
+ * @return Returns validated mesh
+ */
+static TValidatedMesh GetValidatedMesh(const std::string &filename, const boost::filesystem::path &cachedir, const unsigned nthreads, const unsigned voxelresolution, std::ostream &out){
+    if (cachedir.empty()){
+        TValidatedMesh mesh = ValidateMesh(filename, nthreads, out);
+        VoxelizeMesh(mesh, voxelresolution);
+        return mesh;
+    }
+
+    std::uint64_t key = TableKey("STL mesh", filename);
+    boost::filesystem::path cachefile = cachedir / (boost::format("%1%.%2$016x.mesh") % boost::filesystem::path(filename).filename().string() % key).str();
+    boost::filesystem::path lockfile = cachefile.string() + ".lock";
+    boost::interprocess::file_lock lock;
+    try{
+        std::ofstream(lockfile.string(), std::ofstream::app); // file_lock requires an existing file
+        boost::interprocess::file_lock(lockfile.c_str()).swap(lock);
+        lock.lock();
+    }
+    catch (boost::interprocess::interprocess_exception &e){
+        out << "Warning: Could not lock " << lockfile << " (" << e.what() << "), simultaneous jobs might validate the mesh themselves\n";
+        boost::interprocess::file_lock().swap(lock);
+    }
+
+    TValidatedMesh mesh;
+    bool cached = false;
+    if (boost::filesystem::exists(cachefile)){
+        try{
+            mesh = ReadMeshCache(cachefile, key);
+            out << "Reading '" << filename << "' from " << cachefile << " ... ";
+            cached = true;
+        }
+        catch (std::exception &e){
+            out << "Warning: Could not load " << cachefile << " (" << e.what() << "), validating mesh instead\n";
+        }
+    }
+    if (cached && mesh.voxels.resolution == voxelresolution)
+        return mesh;
+    if (not cached)
+        mesh = ValidateMesh(filename, nthreads, out);
+    VoxelizeMesh(mesh, voxelresolution);
+    try{
+        WriteMeshCache(cachefile, key, mesh);
+    }
+    catch (std::exception &e){
+        out << "Warning: Could not write " << cachefile << " (" << e.what() << ")\n";
+    }
+    return mesh;
+}
+
+
+/**
+ * Find face planes of a validated mesh if it bounds a single convex volume
+ *
+ * Coplanar triangles are merged into one plane, and the mesh is convex if all vertices lie behind all planes.
+ * Only closed meshes with a single component and a few planes are checked, so the test stays cheap and point and segment tests with the planes are faster than with the search tree.
+ *
+ * @param mesh Validated mesh
+ *
+ * @return Returns face planes, empty if the mesh is not convex or has too many planes
+ */
+static std::vector<THalfSpace> ConvexHalfSpaces(const TValidatedMesh &mesh){
+    const std::size_t MAX_PLANES = 64;
+    std::vector<THalfSpace> planes;
+    if (mesh.info.components != 1 || mesh.info.affected_components > 0 || mesh.faces.size() > 64*MAX_PLANES)
+        return planes;
+    for (std::size_t i = 0; i < mesh.faces.size(); ++i){
+        const CVector &n = mesh.normals[i];
+        double offset = n*(mesh.vertices[mesh.faces[i][0]] - CGAL::ORIGIN);
+        std::uint16_t tag = mesh.tags.empty() ? 0 : mesh.tags[i];
+        auto plane = std::find_if(planes.begin(), planes.end(), [&n, offset](const THalfSpace &h){
+            return h.normal*n > 1 - 1e-10 && std::abs(h.offset - offset) < REFLECT_TOLERANCE;
+        });
+        if (plane == planes.end()){
+            if (planes.size() >= MAX_PLANES)
+                return std::vector<THalfSpace>();
+            planes.push_back({n, offset, tag});
+        }
+        else if (plane->tag != tag) // tags of triangles in a plane would be lost
+            return std::vector<THalfSpace>();
+    }
+    for (const CPoint &v: mesh.vertices){
+        for (const THalfSpace &h: planes){
+            if (h.normal*(v - CGAL::ORIGIN) - h.offset > REFLECT_TOLERANCE)
+                return std::vector<THalfSpace>();
+        }
+    }
+    return planes;
+}
+
+
+/**
+ * Combine transformed copies of a validated mesh into a single mesh
+ *
+ * Validation results that are sums over components are multiplied by the number of copies. The copies are assumed not to intersect each other.
+ *
+ * @param mesh Validated mesh
+ * @param instances Rigid transformations of the copies
+ * @param voxelresolution Number of voxels along longest side of the combined mesh's bounding box, see VoxelizeMesh
+ *
+ * @return Returns combined mesh
+ */
+static TValidatedMesh InstantiateMesh(const TValidatedMesh &mesh, const std::vector<CTransformation> &instances, const unsigned voxelresolution){
+    TValidatedMesh result;
+    result.info = mesh.info;
+    result.name = mesh.name;
+    const std::uint64_t nvertices = mesh.vertices.size();
+    for (std::size_t i = 0; i < instances.size(); ++i){
+        const CTransformation &T = instances[i];
+        for (const CPoint &p: mesh.vertices)
+            result.vertices.push_back(T.transform(p));
+        for (const auto &face: mesh.faces)
+            result.faces.push_back({{face[0] + i*nvertices, face[1] + i*nvertices, face[2] + i*nvertices}});
+        for (const CVector &n: mesh.normals)
+            result.normals.push_back(T.transform(n));
+        result.areas.insert(result.areas.end(), mesh.areas.begin(), mesh.areas.end());
+        result.tags.insert(result.tags.end(), mesh.tags.begin(), mesh.tags.end());
+    }
+    const std::uint64_t n = instances.size();
+    result.info.vertices = result.vertices.size();
+    result.info.faces = result.faces.size();
+    result.info.components *= n;
+    result.info.affected_components *= n;
+    result.info.area *= n;
+    result.info.volume *= n;
+    result.info.border_length *= n;
+    result.info.self_intersecting_area *= n;
+    VoxelizeMesh(result, voxelresolution);
+    return result;
+}
+
+
+// read triangles from STL-file
+std::string TTriangleMesh::ReadFile(const std::string &filename, const int ID, const boost::filesystem::path &cachedir, const unsigned voxelresolution){
+    return ReadFiles({std::make_pair(filename, ID)}, cachedir, 1, voxelresolution).front();
+}
+
+
+std::vector<std::string> TTriangleMesh::ReadFiles(const std::vector<std::pair<std::string, int> > &files, const boost::filesystem::path &cachedir, const unsigned nthreads,
+        const unsigned voxelresolution, const std::vector<std::vector<CTransformation> > &instances){
+    std::vector<CTriangleMesh> loaded(files.size());
+    std::vector<std::string> names(files.size()), messages(files.size()), warnings(files.size());
+    std::atomic<std::size_t> next(0);
+    unsigned nworkers = std::max<unsigned>(std::min<std::size_t>(nthreads, files.size()), 1);
+    ParallelFor(nworkers, nworkers, [&](const unsigned long, const unsigned long){
+        for (std::size_t i = next++; i < files.size(); i = next++){ // each thread takes the next file from the list when it is done with the last one
+            std::ostringstream out, err;
+            out.precision(3);
+            err.precision(3);
+            const std::string &filename = files[i].first;
+            TValidatedMesh validated = GetValidatedMesh(filename, cachedir, std::max(nthreads/nworkers, 1u), voxelresolution, out);
+            if (i < instances.size() && not instances[i].empty()){
+                validated = InstantiateMesh(validated, instances[i], voxelresolution);
+                out << "placed " << instances[i].size() << " instances ... ";
+            }
+
+            std::vector<THalfSpace> halfspaces = ConvexHalfSpaces(validated);
+
+            // keep only the triangles, the validated mesh is released after they have been moved out of it
+            if (validated.vertices.size() > std::numeric_limits<std::uint32_t>::max() || validated.faces.size() > std::numeric_limits<std::uint32_t>::max())
+                throw std::runtime_error( (boost::format("%1% contains too many triangles") % filename).str() );
+            std::unique_ptr<TCompactMesh> mesh(new TCompactMesh());
+            mesh->points.swap(validated.vertices);
+            mesh->faces.reserve(validated.faces.size());
+            for (const auto &face: validated.faces)
+                mesh->faces.push_back({{static_cast<std::uint32_t>(face[0]), static_cast<std::uint32_t>(face[1]), static_cast<std::uint32_t>(face[2])}});
+            std::vector<std::array<std::uint64_t, 3> >().swap(validated.faces);
+            mesh->normals.swap(validated.normals);
+            mesh->tags.swap(validated.tags);
+            mesh->area = std::accumulate(validated.areas.begin(), validated.areas.end(), 0.);
+
+            if (not validated.info.polygon_mesh)
+                //throw(std::runtime_error("Triangles do not form a mesh"));
+                err << "Triangles in " << filename << " do not form a mesh\n";
+            out << "built mesh with " << mesh->faces.size() << " triangles and " << validated.info.components << " components ("
+                << validated.info.area << "cm2, " << validated.info.volume << "cm3)\n";
+            if (validated.info.affected_components > 0) {
+                err << "\nWarning: " << validated.info.affected_components << " of " << validated.info.components << " components in "
+                    << filename << " have holes with total circumference "
+                    << validated.info.border_length << "cm and " << validated.info.self_intersecting_area
+                    << "cm2 of their area is self-intersecting!\n\n";
+            }
+
+            std::discrete_distribution<size_t> triangle_sampler(validated.areas.begin(), validated.areas.end());
+
+            std::unique_ptr<CTree> tree(new CTree(boost::counting_iterator<std::uint32_t>(0), boost::counting_iterator<std::uint32_t>(mesh->faces.size()), *mesh));
+            tree->accelerate_distance_queries();
 
+            if (not halfspaces.empty())
+                out << "Mesh is convex with " << halfspaces.size() << " face planes\n";
+
+            loaded[i] = {std::move(mesh), std::move(tree), files[i].second, triangle_sampler, std::move(validated.voxels), std::move(halfspaces)};
+            names[i] = validated.name;
+            messages[i] = out.str();
+            warnings[i] = err.str();
+        }
+    });
+
+    for (std::size_t i = 0; i < files.size(); ++i){ // print messages and add meshes in order of files
+        std::cout << messages[i];
+        std::cerr << warnings[i];
+        meshes.push_back(std::move(loaded[i]));
+        meshboxes.push_back(meshes.back().tree->bbox());
+        boundingbox += meshboxes.back();
+    }
     std::vector<double> total_areas;
-    std::transform(meshes.begin(), meshes.end(), std::back_inserter(total_areas), [](const CTriangleMesh &m){ return CGAL::Polygon_mesh_processing::area(*m.mesh); });
+    std::transform(meshes.begin(), meshes.end(), std::back_inserter(total_areas), [](const CTriangleMesh &m){ return m.mesh->area; });
     mesh_sampler = std::discrete_distribution<size_t>(total_areas.begin(), total_areas.end());
+    globaltree.reset(); // global tree and bounding-volume hierarchy do not contain new meshes
+    bvh.reset();
+    bvhfaces.clear();
+
+    return names;
+}
+
+
+std::vector<TMeshTriangle> TTriangleMesh::GetTriangles(const CCuboid &bbox) const{
+    std::vector<TMeshTriangle> triangles;
+    for (const CTriangleMesh &m: meshes){
+        if (not CGAL::do_intersect(m.tree->bbox(), bbox))
+            continue;
+        for (std::uint32_t face = 0; face < m.mesh->faces.size(); ++face){
+            CKernel::Triangle_3 triangle = m.mesh->Triangle(face);
+            if (CGAL::do_intersect(triangle, bbox))
+                triangles.push_back({m.mesh->Vertices(face), m.mesh->normals[face], std::sqrt(triangle.squared_area()), static_cast<unsigned>(m.ID)});
+        }
+    }
+    return triangles;
+}
+
 
-    meshes.push_back({std::move(mesh), std::move(tree), ID, triangle_sampler});
+std::vector<CTriangleVertices> TTriangleMesh::GetSolidTriangles(const unsigned ID) const{
+    std::vector<CTriangleVertices> triangles;
+    for (const CTriangleMesh &m: meshes){
+        if (static_cast<unsigned>(m.ID) != ID)
+            continue;
+        for (std::uint32_t face = 0; face < m.mesh->faces.size(); ++face)
+            triangles.push_back(m.mesh->Vertices(face));
+    }
+    return triangles;
+}
 
-	return sldname;
+
+std::uint32_t TTriangleMesh::ClosestTriangle(const unsigned ID, const double p[3]) const{
+    for (const CTriangleMesh &m: meshes){
+        if (static_cast<unsigned>(m.ID) == ID)
+            return m.tree->closest_point_and_primitive(CPoint(p[0], p[1], p[2])).second;
+    }
+    return NO_TRIANGLE;
+}
+
+
+std::size_t TTriangleMesh::MemoryUsage() const{
+    const std::size_t treeprimitive = sizeof(CGAL::Bbox_3) + 2*sizeof(void*) + sizeof(CPoint); // node with box and two children, and point for distance queries per primitive
+    std::size_t bytes = meshes.capacity()*sizeof(CTriangleMesh) + meshboxes.capacity()*sizeof(CGAL::Bbox_3);
+    for (const CTriangleMesh &m: meshes){
+        bytes += m.mesh->points.capacity()*sizeof(CPoint) + m.mesh->faces.capacity()*sizeof(std::array<std::uint32_t, 3>)
+                + m.mesh->normals.capacity()*sizeof(CVector) + m.mesh->tags.capacity()*sizeof(std::uint16_t);
+        if (m.tree)
+            bytes += m.tree->size()*(sizeof(CPrimitive) + treeprimitive);
+        bytes += 2*m.triangle_sampler.probabilities().size()*sizeof(double); // probabilities and their cumulative sums
+        bytes += m.voxels.states.capacity() + m.halfspaces.capacity()*sizeof(THalfSpace);
+    }
+    bytes += 2*mesh_sampler.probabilities().size()*sizeof(double);
+    if (globaltree)
+        bytes += globaltree->size()*(sizeof(CGlobalPrimitive) + treeprimitive);
+    if (bvh)
+        bytes += bvh->MemoryUsage();
+    bytes += bvhfaces.capacity()*sizeof(std::pair<unsigned, std::uint32_t>);
+    bytes += volumecells.capacity()*sizeof(TVolumeCell) + volumecell_sampler.size()*(sizeof(double) + sizeof(size_t));
+    return bytes;
+}
+
+
+void TTriangleMesh::BuildGlobalTree(){
+    globaltree.reset(new CGlobalTree());
+    for (auto &m: meshes)
+        globaltree->insert(boost::counting_iterator<std::uint32_t>(0), boost::counting_iterator<std::uint32_t>(m.mesh->faces.size()), *m.mesh);
+    globaltree->build();
+    globaltree->accelerate_distance_queries();
+    std::cout << "Built global search tree containing " << globaltree->size() << " triangles of " << meshes.size() << " meshes\n";
+}
+
+
+void TTriangleMesh::BuildBVH(){
+    std::vector<TTriangleBVH::TTriangle> triangles;
+    bvhfaces.clear();
+    for (unsigned i = 0; i < meshes.size(); ++i){
+        for (std::uint32_t face = 0; face < meshes[i].mesh->faces.size(); ++face){
+            CTriangleVertices v = meshes[i].mesh->Vertices(face);
+            triangles.push_back({{ {{v[0].x(), v[0].y(), v[0].z()}}, {{v[1].x(), v[1].y(), v[1].z()}}, {{v[2].x(), v[2].y(), v[2].z()}} }});
+            bvhfaces.push_back(std::make_pair(i, face));
+        }
+    }
+    bvh.reset(new TTriangleBVH(triangles));
+    std::cout << "Built bounding-volume hierarchy with " << bvh->NodeCount() << " nodes containing " << triangles.size() << " triangles of " << meshes.size() << " meshes\n";
+}
+
+
+void TTriangleMesh::BuildVolumeCells(const double maxboundaryfraction, const size_t maxcells){
+    volumecells.clear();
+    if (meshes.empty())
+        return;
+    auto intersected = [this](const CCuboid &box){
+        return std::any_of(meshes.begin(), meshes.end(), [&box](const CTriangleMesh &m){ return m.tree->do_intersect(box); });
+    };
+    std::vector<CCuboid> boundary = {GetBoundingBox()};
+    double insidevolume = 0, boundaryvolume = boundary.front().volume();
+    while (boundaryvolume > maxboundaryfraction*(insidevolume + boundaryvolume) && volumecells.size() + 8*boundary.size() <= maxcells){
+        std::vector<CCuboid> children;
+        for (const CCuboid &b: boundary){ // split each box intersected by triangles into eight
+            CPoint c = CGAL::midpoint(b.min(), b.max());
+            for (int i = 0; i < 8; ++i){
+                CPoint cmin(i & 1 ? c.x() : b.xmin(), i & 2 ? c.y() : b.ymin(), i & 4 ? c.z() : b.zmin());
+                CPoint cmax(i & 1 ? b.xmax() : c.x(), i & 2 ? b.ymax() : c.y(), i & 4 ? b.zmax() : c.z());
+                CCuboid child(cmin, cmax);
+                if (intersected(child))
+                    children.push_back(child);
+                else if (InSolid(cmin + CVector(0.618034*(cmax.x() - cmin.x()), 0.414214*(cmax.y() - cmin.y()), 0.732051*(cmax.z() - cmin.z())))){
+                    // box without triangles is either completely inside or outside, test an asymmetric point so rays do not hit triangle edges of axis-aligned surfaces
+                    volumecells.push_back({child, true});
+                    insidevolume += child.volume();
+                }
+            }
+        }
+        boundary.swap(children);
+        boundaryvolume = 0;
+        for (const CCuboid &b: boundary)
+            boundaryvolume += b.volume();
+    }
+    for (const CCuboid &b: boundary)
+        volumecells.push_back({b, false});
+
+    std::vector<double> volumes;
+    std::transform(volumecells.begin(), volumecells.end(), std::back_inserter(volumes), [](const TVolumeCell &c){ return c.box.volume(); });
+    volumecell_sampler = std::alias_distribution<size_t>(volumes.begin(), volumes.end());
+    std::cout << "Decomposed volume into " << volumecells.size() << " boxes, " << boundary.size() << " of them containing surface triangles with "
+              << boundaryvolume/(insidevolume + boundaryvolume)*100 << "% of the volume\n";
 }
 
 
 // test segment p1->p2 for collision with triangles and return a list of all found collisions
-std::vector<TCollision> TTriangleMesh::Collision(const std::vector<double> &p1, const std::vector<double> &p2) const{
+void TTriangleMesh::Collision(const double p1[3], const double p2[3], std::vector<TCollision> &colls) const{
 	CSegment segment(CPoint(p1[0], p1[1], p1[2]), CPoint(p2[0], p2[1], p2[2]));
-	std::vector<TCollision> colls;
-	for (auto &it: meshes) {
-        std::vector<CIntersection> out;
-        it.tree->all_intersections(segment, std::back_inserter(out)); // search intersections of segment with mesh
-        for (auto &i: out){
-            const CPoint *collp = boost::get<CPoint>(&(i->first));
+	colls.clear();
+	// insert collisions sorted by distance along segment, collisions with equal distance and ID stay in the order they were found
+	auto add = [&colls](const TCollision &c){ colls.insert(std::upper_bound(colls.begin(), colls.end(), c), c); };
+	if (bvh){
+        std::vector<TTriangleBVH::THit> hits; // only allocates memory if the segment hits a triangle
+        bvh->Intersect(p1, p2, hits);
+        AddBVHCollisions(segment, hits, colls);
+	}
+	else if (globaltree){
+        globaltree->all_intersections(segment, boost::make_function_output_iterator([&](const CGlobalIntersection &i){ // search intersections of segment with all meshes at once
+            const CPoint *collp = boost::get<CPoint>(&(i.first));
             if (collp) { // if intersection is a point
-                CVector n = CGAL::Polygon_mesh_processing::compute_face_normal(i->second, *it.mesh);
-                colls.push_back(TCollision(segment, n, *collp, it.ID)); // add collision to list
+                const CTriangleMesh &m = GetMesh(i.second.second);
+                add(TCollision(segment, m.mesh->normals[i.second.first], *collp, m.ID, m.mesh->tags[i.second.first], i.second.first)); // add collision to list
             }
-            else
-                throw std::runtime_error("Segment-triangle intersection happened to not be a point");
+            // otherwise the segment lies in the triangle's plane and does not cross it
+        }));
+	}
+	else for (auto &it: meshes) {
+        if (ConvexCollisionTest(it)){
+            ConvexCollisions(it, segment, colls);
+            continue;
         }
+        it.tree->all_intersections(segment, boost::make_function_output_iterator([&](const CIntersection &i){ // search intersections of segment with mesh
+            const CPoint *collp = boost::get<CPoint>(&(i.first));
+            if (collp) { // if intersection is a point
+                add(TCollision(segment, it.mesh->normals[i.second], *collp, it.ID, it.mesh->tags[i.second], i.second)); // add collision to list
+            }
+            // otherwise the segment lies in the triangle's plane and does not cross it
+        }));
+    }
+}
+
+
+void TTriangleMesh::Collision(const std::vector<std::array<double, 3> > &p1, const std::vector<std::array<double, 3> > &p2, std::vector<std::vector<TCollision> > &colls) const{
+    if (p1.size() != p2.size())
+        throw std::runtime_error("Different numbers of start and end points of segments");
+    colls.resize(p1.size());
+    if (not bvh){
+        for (std::size_t i = 0; i < p1.size(); ++i)
+            Collision(p1[i].data(), p2[i].data(), colls[i]);
+        return;
     }
+    std::vector<std::vector<TTriangleBVH::THit> > hits;
+    bvh->Intersect(p1, p2, hits);
+    for (std::size_t i = 0; i < p1.size(); ++i){
+        colls[i].clear();
+        AddBVHCollisions(CSegment(CPoint(p1[i][0], p1[i][1], p1[i][2]), CPoint(p2[i][0], p2[i][1], p2[i][2])), hits[i], colls[i]);
+    }
+}
 
-	std::sort(	colls.begin(),
-				colls.end(),
-				[](const TCollision &c1, const TCollision &c2){
-					if (c1.s == c2.s){
-                        //std::cout << "Coincident collision between solids " << c1.ID << " and " << c2.ID << std::endl;
-						return c1.ID > c2.ID;
-					}
-					else
-						return c1.s < c2.s;
-				}
-	);
-	return colls;
 
+void TTriangleMesh::AddBVHCollisions(const CSegment &segment, const std::vector<TTriangleBVH::THit> &hits, std::vector<TCollision> &colls) const{
+    for (const TTriangleBVH::THit &hit: hits){
+        const CTriangleMesh &m = meshes[bvhfaces[hit.triangle].first];
+        std::uint32_t face = bvhfaces[hit.triangle].second;
+        TCollision c(segment, m.mesh->normals[face], CPoint(hit.point[0], hit.point[1], hit.point[2]), m.ID, m.mesh->tags[face], face);
+        colls.insert(std::upper_bound(colls.begin(), colls.end(), c), c); // collisions with equal distance and ID stay in the order they were found
+    }
+}
+
+
+void TTriangleMesh::Collision(const double p1[3], const double p2[3], std::vector<TCollision> &colls, TCollisionCache &cache) const{
+    if (bvh){
+        Collision(p1, p2, colls);
+        return;
+    }
+    CSegment segment(CPoint(p1[0], p1[1], p1[2]), CPoint(p2[0], p2[1], p2[2]));
+    double length = std::sqrt(segment.squared_length());
+    // segment has to keep a margin to the box, so triangles touching the segment cannot be missed due to rounding when the box is filled
+    double margin = 1e-6*COLLISION_CACHE_PADDING*length + REFLECT_TOLERANCE;
+    auto inbox = [&cache, margin](const double p[3]){
+        for (int i = 0; i < 3; ++i){
+            if (p[i] - cache.box.min()[i] < margin || cache.box.max()[i] - p[i] < margin)
+                return false;
+        }
+        return true;
+    };
+    if (not cache.valid or not inbox(p1) or not inbox(p2)){
+        double padding = COLLISION_CACHE_PADDING*length + 2*margin;
+        CCuboid segbox(segment.bbox());
+        cache.box = CCuboid(segbox.min() - CVector(padding, padding, padding), segbox.max() + CVector(padding, padding, padding));
+        cache.triangles.clear();
+        cache.valid = true;
+        cache.crowded = false;
+        for (unsigned i = 0; i < meshes.size() && not cache.crowded; ++i){
+            if (ConvexCollisionTest(meshes[i]) || not CGAL::do_intersect(meshes[i].tree->bbox(), cache.box)) // convex meshes are tested with their face planes
+                continue;
+            const CTriangleMesh &m = meshes[i];
+            m.tree->all_intersected_primitives(cache.box, boost::make_function_output_iterator([&cache, &m, i](const std::uint32_t face){
+                if (cache.triangles.size() >= COLLISION_CACHE_MAX_TRIANGLES)
+                    cache.crowded = true;
+                else
+                    cache.triangles.push_back({i, face, m.mesh->Triangle(face).bbox()});
+            }));
+        }
+        if (cache.crowded)
+            cache.triangles.clear();
+        else{
+            CPoint center = CGAL::midpoint(cache.box.min(), cache.box.max());
+            cache.origin = {{center.x(), center.y(), center.z()}};
+            for (std::size_t t = 0; t < cache.triangles.size(); ++t){
+                CTriangleVertices v = meshes[cache.triangles[t].mesh].mesh->Vertices(cache.triangles[t].face);
+                CVector n = CGAL::cross_product(v[1] - v[0], v[2] - v[0]);
+                n = n/std::sqrt(n.squared_length()); // degenerate triangles get NaN planes, which never reject a segment
+                for (int j = 0; j < 3; ++j)
+                    cache.plane[j][t] = static_cast<float>(n[j]);
+                cache.plane[3][t] = static_cast<float>(n*(v[0] - center));
+                cache.extent[t] = 0;
+                for (int i = 0; i < 3; ++i){
+                    for (int j = 0; j < 3; ++j){
+                        cache.vertices[i][j][t] = static_cast<float>(v[i][j] - cache.origin[j]);
+                        cache.extent[t] = std::max(cache.extent[t], std::abs(cache.vertices[i][j][t]));
+                    }
+                }
+            }
+        }
+    }
+    if (cache.crowded){ // too many triangles close to segment, searching the tree is faster
+        Collision(p1, p2, colls);
+        return;
+    }
+
+    colls.clear();
+    if (cache.triangles.empty())
+        return;
+    float missed[COLLISION_CACHE_MAX_TRIANGLES];
+    FilterCachedTriangles(cache, p1, p2, missed);
+    CGAL::Bbox_3 segbox = segment.bbox();
+    for (std::size_t t = 0; t < cache.triangles.size(); ++t){
+        if (missed[t] != 0) // the double-precision test would reject the triangle as well
+            continue;
+        const TCollisionCache::TTriangle &triangle = cache.triangles[t];
+        if (not CGAL::do_overlap(segbox, triangle.bbox) || not CGAL::do_intersect(segment, triangle.bbox)) // check bounding box first, like the AABB tree
+            continue;
+        const CTriangleMesh &m = meshes[triangle.mesh];
+        auto intersection = CGAL::intersection(m.mesh->Triangle(triangle.face), segment); // same test and argument order as AABB tree
+        if (not intersection)
+            continue;
+        const CPoint *collp = boost::get<CPoint>(&*intersection);
+        if (collp){ // if intersection is a point, otherwise the segment lies in the triangle's plane like in Collision without cache
+            TCollision c(segment, m.mesh->normals[triangle.face], *collp, m.ID, m.mesh->tags[triangle.face], triangle.face);
+            colls.insert(std::upper_bound(colls.begin(), colls.end(), c), c); // insert sorted like Collision without cache
+        }
+    }
+    for (const CTriangleMesh &m: meshes){
+        if (ConvexCollisionTest(m))
+            ConvexCollisions(m, segment, colls);
+    }
+}
+
+
+void TTriangleMesh::FilterCachedTriangles(const TCollisionCache &cache, const double p1[3], const double p2[3], float missed[COLLISION_CACHE_MAX_TRIANGLES]){
+    // Coordinates relative to the origin are rounded to single precision with absolute errors of about eps*M (eps = 2^-24), where M is the largest coordinate involved.
+    // The distances of the end points to a triangle's plane are then off by less than about 10*eps*M, the edge orientations d*(a x b) by less than about 100*eps*|d|*M^2.
+    const float PLANE_ERROR = 1.f/262144; // 64*eps
+    const float EDGE_ERROR = 1.f/16384; // 1024*eps
+    const float MIN_EXTENT = 1e-9f; // triangles closer to the origin are always tested in double precision, so the error bounds cannot underflow
+    float s[3], e[3], d[3], segextent = 0, dnorm = 0;
+    for (int j = 0; j < 3; ++j){
+        s[j] = static_cast<float>(p1[j] - cache.origin[j]);
+        e[j] = static_cast<float>(p2[j] - cache.origin[j]);
+        d[j] = static_cast<float>(p2[j] - p1[j]);
+        segextent = std::max(segextent, std::max(std::abs(s[j]), std::abs(e[j])));
+        dnorm += std::abs(d[j]);
+    }
+    const float (&v)[3][3][COLLISION_CACHE_MAX_TRIANGLES] = cache.vertices;
+    const float (&plane)[4][COLLISION_CACHE_MAX_TRIANGLES] = cache.plane;
+    for (std::size_t t = 0; t < cache.triangles.size(); ++t){ // without branches, so the loop is vectorized
+        float M = std::max(segextent, cache.extent[t]);
+        // distances of start and end point to triangle plane
+        float planebound = PLANE_ERROR*M;
+        float dist1 = plane[0][t]*s[0] + plane[1][t]*s[1] + plane[2][t]*s[2] - plane[3][t];
+        float dist2 = plane[0][t]*e[0] + plane[1][t]*e[1] + plane[2][t]*e[2] - plane[3][t];
+        float sameside = std::min(dist1, dist2) > planebound || std::max(dist1, dist2) < -planebound ? 1.f : 0.f;
+        // orientations of triangle edges relative to line through segment, with vertices relative to start of segment
+        float edgebound = EDGE_ERROR*dnorm*M*M;
+        float a[3], b[3], c[3];
+        for (int j = 0; j < 3; ++j){
+            a[j] = v[0][j][t] - s[j];
+            b[j] = v[1][j][t] - s[j];
+            c[j] = v[2][j][t] - s[j];
+        }
+        float e1 = d[0]*(a[1]*b[2] - a[2]*b[1]) + d[1]*(a[2]*b[0] - a[0]*b[2]) + d[2]*(a[0]*b[1] - a[1]*b[0]);
+        float e2 = d[0]*(b[1]*c[2] - b[2]*c[1]) + d[1]*(b[2]*c[0] - b[0]*c[2]) + d[2]*(b[0]*c[1] - b[1]*c[0]);
+        float e3 = d[0]*(c[1]*a[2] - c[2]*a[1]) + d[1]*(c[2]*a[0] - c[0]*a[2]) + d[2]*(c[0]*a[1] - c[1]*a[0]);
+        float outside = std::max(std::max(e1, e2), e3) > edgebound && std::min(std::min(e1, e2), e3) < -edgebound ? 1.f : 0.f;
+        float trusted = M > MIN_EXTENT ? 1.f : 0.f;
+        missed[t] = trusted*std::max(sameside, outside);
+    }
+}
+
+
+bool TTriangleMesh::IntersectsBox(const CCuboid &box) const{
+    if (globaltree)
+        return not globaltree->empty() && globaltree->do_intersect(box);
+    return std::any_of(meshes.begin(), meshes.end(), [&box](const CTriangleMesh &m){ return CGAL::do_intersect(m.tree->bbox(), box) && m.tree->do_intersect(box); });
+}
+
+double TTriangleMesh::Distance(const double x, const double y, const double z) const{
+    if (globaltree)
+        return globaltree->empty() ? std::numeric_limits<double>::infinity() : std::sqrt(globaltree->squared_distance(CPoint(x, y, z)));
+    double d2 = std::numeric_limits<double>::infinity();
+    for (auto &it: meshes)
+        d2 = std::min(d2, it.tree->squared_distance(CPoint(x, y, z)));
+    return std::sqrt(d2);
+}
+
+
+void TTriangleMesh::ConvexCollisions(const CTriangleMesh &m, const CSegment &segment, std::vector<TCollision> &colls){
+    const CVector d = segment.to_vector(), p = segment.source() - CGAL::ORIGIN;
+    double senter = 0, sleave = 1;
+    const THalfSpace *enter = nullptr, *leave = nullptr;
+    for (const THalfSpace &h: m.halfspaces){
+        double num = h.offset - h.normal*p; // distance of start point behind plane
+        double den = h.normal*d;
+        if (den == 0){
+            if (num < 0) // segment parallel to and in front of plane
+                return;
+        }
+        else if (den < 0){ // segment enters half space
+            double s = num/den;
+            if (s >= senter){
+                senter = s;
+                enter = &h;
+            }
+        }
+        else{ // segment leaves half space
+            double s = num/den;
+            if (s <= sleave){
+                sleave = s;
+                leave = &h;
+            }
+        }
+        if (senter > sleave)
+            return;
+    }
+    auto add = [&](const THalfSpace &h, const double s){
+        TCollision c(segment, h.normal, segment.source() + s*d, m.ID, h.tag);
+        colls.insert(std::upper_bound(colls.begin(), colls.end(), c), c);
+    };
+    if (enter != nullptr) // segment crosses surface where it enters the last half space, unless it starts inside
+        add(*enter, senter);
+    if (leave != nullptr)
+        add(*leave, sleave);
 }
 
 
 bool TTriangleMesh::InSolid(const double x, const double y, const double z) const{
-    return std::any_of(meshes.begin(), meshes.end(), [x,y,z](const CTriangleMesh &mesh){
-        return mesh.tree->number_of_intersected_primitives(CKernel::Ray_3(CPoint(x,y,z), CVector(0.,0.,1.))) % 2 != 0;
-    });
+    std::vector<size_t> counts;
+    for (unsigned i = 0; i < meshes.size(); ++i){
+        TVoxelGrid::TState state = meshes[i].voxels.State(x, y, z);
+        if (state == TVoxelGrid::inside)
+            return true;
+        else if (state == TVoxelGrid::boundary && not meshes[i].halfspaces.empty()){
+            if (InConvex(meshes[i], x, y, z))
+                return true;
+        }
+        else if (state == TVoxelGrid::boundary){
+            std::size_t count;
+            if (globaltree){
+                if (counts.empty())
+                    counts = CountRayIntersections(x, y, z); // global tree counts intersections with all meshes at once
+                count = counts[i];
+            }
+            else
+                count = meshes[i].tree->number_of_intersected_primitives(CKernel::Ray_3(CPoint(x,y,z), CVector(0.,0.,1.)));
+            if (count % 2 != 0)
+                return true;
+        }
+    }
+    return false;
+}
+
+
+std::vector<unsigned> TTriangleMesh::GetSolids(const double x, const double y, const double z, const int outside) const{
+    std::vector<unsigned> solids;
+    std::vector<size_t> counts;
+    for (unsigned i = 0; i < meshes.size(); ++i){
+        if (meshes[i].ID == outside)
+            continue;
+        TVoxelGrid::TState state = meshes[i].voxels.State(x, y, z);
+        if (state == TVoxelGrid::boundary && not meshes[i].halfspaces.empty())
+            state = InConvex(meshes[i], x, y, z) ? TVoxelGrid::inside : TVoxelGrid::outside;
+        else if (state == TVoxelGrid::boundary){
+            std::size_t count;
+            if (globaltree){
+                if (counts.empty())
+                    counts = CountRayIntersections(x, y, z); // global tree counts intersections with all meshes at once
+                count = counts[i];
+            }
+            else
+                count = meshes[i].tree->number_of_intersected_primitives(CKernel::Ray_3(CPoint(x,y,z), CVector(0.,0.,1.)));
+            state = count % 2 != 0 ? TVoxelGrid::inside : TVoxelGrid::outside;
+        }
+        if (state == TVoxelGrid::inside)
+            solids.push_back(meshes[i].ID);
+    }
+    return solids;
+}
+
+
+std::vector<size_t> TTriangleMesh::CountRayIntersections(const double x, const double y, const double z) const{
+    CKernel::Ray_3 ray(CPoint(x,y,z), CVector(0.,0.,1.));
+    std::vector<size_t> counts(meshes.size(), 0);
+    if (globaltree){
+        std::vector<CGlobalTree::Primitive_id> primitives;
+        globaltree->all_intersected_primitives(ray, std::back_inserter(primitives));
+        for (auto &primitive: primitives){
+            auto mesh = std::find_if(meshes.begin(), meshes.end(), [&primitive](const CTriangleMesh &m){ return m.mesh.get() == primitive.second; });
+            ++counts[mesh - meshes.begin()];
+        }
+    }
+    else{
+        for (unsigned i = 0; i < meshes.size(); ++i)
+            counts[i] = meshes[i].tree->number_of_intersected_primitives(ray);
+    }
+    return counts;
 }
@@ -0,0 +1,78 @@
+#!/bin/bash
+
+# Run PENTrack with a test configuration, record its throughput, and compare it to a baseline.
+#
+# Usage: RunThroughputTest.sh PENTrack name config.in resultdir baselinedir margin [option=value | PLACEHOLDER=value]...
+#
+# Lower-case options replace the value of the option in the configuration (e.g. simcount=100),
+# upper-case placeholders are replaced everywhere in the configuration (e.g. WPFREQ=183250).
+# The result is written to resultdir/name.json. If baselinedir/name.json does not exist, the result is stored there as new baseline.
+# Fails if the throughput (particles per second, or runs per second if no particles are tracked) is lower than the baseline by more than the fraction margin.
+
+set -e
+
+PENTRACK=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+NAME=$2
+CONFIG=$3
+RESULTDIR=$4
+BASELINEDIR=$5
+MARGIN=$6
+shift 6
+
+# write modified configuration next to the original one, so relative paths in it stay valid
+TESTCONFIG=$(dirname "$CONFIG")/throughput_${NAME}_$$.in
+OUTDIR=$(mktemp -d)
+trap 'rm -rf "$TESTCONFIG" "$OUTDIR"' EXIT
+cp "$CONFIG" "$TESTCONFIG"
+for override in "$@"; do
+  key=${override%%=*}
+  value=${override#*=}
+  if [[ $key =~ ^[A-Z0-9_]+$ ]]; then
+    sed -i.bak "s/$key/$value/g" "$TESTCONFIG"
+  else
+    sed -i.bak -E "s/^$key([[:space:]].*)?$/$key $value/" "$TESTCONFIG"
+  fi
+  rm -f "$TESTCONFIG.bak"
+done
+
+# fixed job number and seed, so every run tracks the same particles
+start=$(date +%s.%N)
+"$PENTRACK" 0 "$TESTCONFIG" "$OUTDIR" 42 > "$OUTDIR/stdout"
+end=$(date +%s.%N)
+
+simtype=$(awk '{sub(/\r$/, "")} $1 == "simtype" {print $2; exit}' "$TESTCONFIG")
+particles=0
+if [ "$simtype" == "1" ]; then
+  particles=$(awk '{sub(/\r$/, "")} $1 == "simcount" {print $2; exit}' "$TESTCONFIG")
+fi
+steps=$(sed -n 's/^The integrator made \([0-9]*\) steps.*/\1/p' "$OUTDIR/stdout")
+rss=$(sed -n 's/^Memory at exit:.*peak resident \([0-9.]*\) MB$/\1/p' "$OUTDIR/stdout")
+
+mkdir -p "$RESULTDIR"
+awk -v name="$NAME" -v start="$start" -v end="$end" -v particles="$particles" -v steps="${steps:-0}" -v rss="${rss:-0}" 'BEGIN {
+  time = end - start
+  rss = rss*1024 # MB to kB
+  throughput = particles > 0 ? particles/time : 1/time
+  printf "{\n  \"test\": \"%s\",\n  \"time\": %.3f,\n  \"particles\": %d,\n  \"steps\": %d,\n", name, time, particles, steps
+  printf "  \"particles_per_second\": %.6g,\n  \"steps_per_second\": %.6g,\n  \"peak_rss_kB\": %d,\n  \"throughput\": %.6g\n}\n", particles/time, steps/time, rss, throughput
+}' > "$RESULTDIR/$NAME.json"
+cat "$RESULTDIR/$NAME.json"
+
+throughput() {
+  sed -n 's/.*"throughput": \([^,]*\).*/\1/p' "$1"
+}
+
+if [ ! -f "$BASELINEDIR/$NAME.json" ]; then
+  mkdir -p "$BASELINEDIR"
+  cp "$RESULTDIR/$NAME.json" "$BASELINEDIR/$NAME.json"
+  echo "No baseline found, stored result as baseline in $BASELINEDIR/$NAME.json"
+  exit 0
+fi
+
+awk -v current="$(throughput "$RESULTDIR/$NAME.json")" -v baseline="$(throughput "$BASELINEDIR/$NAME.json")" -v margin="$MARGIN" 'BEGIN {
+  printf "Throughput %.6g, baseline %.6g (%+.1f%%)\n", current, baseline, 100*(current/baseline - 1)
+  if (current < (1 - margin)*baseline) {
+    printf "Throughput dropped by more than %.0f%%!\n", 100*margin
+    exit 1
+  }
+}'
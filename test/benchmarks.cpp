@@ -0,0 +1,434 @@
+/**
+ * Benchmarks of the kernels dominating the tracking time: field interpolation, collision and inside tests, micro-roughness probabilities, and whole trajectories.
+ *
+ * Usage: PENTrack_bench [filter [path/to/test]]
+ *        PENTrack_bench replay path/to/queries.bin path/to/config.in
+ *
+ * Only benchmarks whose name contains filter are run. Test files are read from the test directory of the source tree, unless another path is given.
+ * The replay mode instead measures the field evaluations and collision tests recorded by PENTrack with the querytraceparticles option
+ * against the fields and geometry of the given configuration, e.g. to compare field-table layouts or collision-search backends on real trajectories.
+ * Each benchmark draws its inputs from a random-number generator with a fixed seed, so every run measures the same calls.
+ * The number of calls per repetition is doubled until a repetition takes at least 0.2s, the minimum and median time per call of five repetitions are printed.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "analyticFields.h"
+#include "config.h"
+#include "field_2d.h"
+#include "field_3d.h"
+#include "fields.h"
+#include "geometry.h"
+#include "globals.h"
+#include "harmonicfields.h"
+#include "mc.h"
+#include "microroughness.h"
+#include "querytrace.h"
+#include "source.h"
+#include "tracking.h"
+#include "trianglemesh.h"
+
+#ifndef PENTRACK_TEST_DIR
+#define PENTRACK_TEST_DIR "test"
+#endif
+
+using namespace std;
+
+static const unsigned SEED = 42; ///< Seed of random-number generator drawing inputs of benchmarks
+static const unsigned NINPUTS = 1024; ///< Number of different inputs each benchmark cycles through
+static const double MIN_TIME = 0.2; ///< Minimum duration of a repetition [s]
+static const unsigned REPETITIONS = 5; ///< Number of repetitions of each benchmark
+
+volatile double sink; ///< Results of benchmarked calls are added here, so the compiler cannot remove them
+
+/**
+ * Benchmark
+ */
+struct TBenchmark{
+	string name; ///< Name of benchmark
+	function<function<void(unsigned long)>()> setup; ///< Prepares benchmark and returns function making a given number of calls
+};
+
+
+/**
+ * Draw points uniformly distributed in a box
+ *
+ * @param min Minimum coordinates of box
+ * @param max Maximum coordinates of box
+ *
+ * @return Returns NINPUTS points
+ */
+static vector<array<double, 3> > RandomPoints(const array<double, 3> &min, const array<double, 3> &max){
+	mt19937 rng(SEED);
+	vector<array<double, 3> > points(NINPUTS);
+	for (auto &p: points){
+		for (int i = 0; i < 3; ++i)
+			p[i] = uniform_real_distribution<double>(min[i], max[i])(rng);
+	}
+	return points;
+}
+
+/**
+ * Create benchmark of magnetic-field evaluations, including spatial derivatives
+ *
+ * @param f Field
+ * @param min Minimum coordinates of box in which field is evaluated
+ * @param max Maximum coordinates of box in which field is evaluated
+ *
+ * @return Returns function making a given number of calls
+ */
+template<class Field>
+static function<void(unsigned long)> BFieldBenchmark(shared_ptr<Field> f, const array<double, 3> &min, const array<double, 3> &max){
+	vector<array<double, 3> > points = RandomPoints(min, max);
+	return [f, points](const unsigned long n){
+		double B[3], dBidxj[3][3], sum = 0;
+		for (unsigned long i = 0; i < n; ++i){
+			const array<double, 3> &p = points[i % NINPUTS];
+			f->BField(p[0], p[1], p[2], 0., B, dBidxj);
+			sum += B[2] + dBidxj[2][2];
+		}
+		sink = sink + sum;
+	};
+}
+
+/**
+ * Load mesh of test chamber
+ *
+ * @param testdir Test directory
+ * @param bvh Build bounding-volume hierarchy
+ *
+ * @return Returns mesh
+ */
+static shared_ptr<TTriangleMesh> LoadChamber(const boost::filesystem::path &testdir, const bool bvh){
+	auto mesh = make_shared<TTriangleMesh>();
+	mesh->ReadFile((testdir / "nEDMchamber_R200x100.STL").string(), 2);
+	if (bvh)
+		mesh->BuildBVH();
+	return mesh;
+}
+
+/**
+ * Create benchmark of collision tests of short segments, typical for trajectory steps, around the test chamber
+ *
+ * @param mesh Mesh of test chamber
+ *
+ * @return Returns function making a given number of calls
+ */
+static function<void(unsigned long)> CollisionBenchmark(shared_ptr<TTriangleMesh> mesh){
+	vector<array<double, 3> > starts = RandomPoints({-0.25, -0.25, -0.1}, {0.25, 0.25, 0.1});
+	vector<array<double, 3> > steps = RandomPoints({-0.02, -0.02, -0.02}, {0.02, 0.02, 0.02});
+	return [mesh, starts, steps](const unsigned long n){
+		vector<TCollision> colls;
+		unsigned long found = 0;
+		for (unsigned long i = 0; i < n; ++i){
+			const array<double, 3> &p1 = starts[i % NINPUTS], &d = steps[i % NINPUTS];
+			double p2[3] = {p1[0] + d[0], p1[1] + d[1], p1[2] + d[2]};
+			colls.clear();
+			mesh->Collision(&p1[0], p2, colls);
+			found += colls.size();
+		}
+		sink = sink + found;
+	};
+}
+
+/**
+ * Create benchmark of micro-roughness probabilities for UCN hitting a copper surface, parameters from Steyerl's paper (DOI:10.1007/BF01380066)
+ *
+ * @param prob Function calculating probability, either MR::MRProb or MR::MRDistMax
+ *
+ * @return Returns function making a given number of calls
+ */
+static function<void(unsigned long)> MRBenchmark(double (*prob)(const bool, const double*, const double*, const double, const double, const double)){
+	double kCu = 0.00894/1e-10; // critical wave number
+	double FermiCu = static_cast<double>(hbar*hbar*kCu*kCu/2./m_n/ele_e/ele_e);
+	double vconv = static_cast<double>(hbar/m_n/ele_e);
+	mt19937 rng(SEED);
+	uniform_real_distribution<double> kdist(0.05*kCu, 3.*kCu), thetadist(0., pi/2);
+	vector<array<double, 3> > velocities(NINPUTS);
+	for (auto &v: velocities){
+		double k = kdist(rng), theta = thetadist(rng);
+		v = {k*vconv*sin(theta), 0., k*vconv*cos(theta)};
+	}
+	return [prob, FermiCu, velocities](const unsigned long n){
+		double normal[3] = {0., 0., -1.}, sum = 0;
+		for (unsigned long i = 0; i < n; ++i)
+			sum += prob(i % 2 == 1, &velocities[i % NINPUTS][0], normal, FermiCu, 35e-10, 250e-10);
+		sink = sink + sum;
+	};
+}
+
+/**
+ * Simulation set up from a configuration file, tracking one particle per call
+ */
+struct TSimulation{
+	TConfig config; ///< Configuration
+	unique_ptr<TFieldManager> field; ///< Fields
+	unique_ptr<TGeometry> geom; ///< Geometry
+	unique_ptr<TParticleSource> source; ///< Particle source
+	unique_ptr<TTracker> tracker; ///< Tracker
+	double simtime = 0; ///< Maximum simulation time
+
+	/**
+	 * Constructor, loads fields, geometry, and source and disables all logs
+	 *
+	 * @param file Configuration file
+	 */
+	explicit TSimulation(const boost::filesystem::path &file): config(file.string()){
+		configpath = file;
+		outpath = boost::filesystem::temp_directory_path();
+		istringstream(config["GLOBAL"]["simtime"]) >> simtime;
+		for (string particlename: {"neutron", "proton", "electron", "mercury", "xenon"}){
+			for (auto &option: config["PARTICLES"])
+				config[particlename].insert(option);
+			for (string log: {"endlog", "tracklog", "hitlog", "snapshotlog", "spinlog"})
+				config[particlename][log] = "0";
+		}
+		field.reset(new TFieldManager(config));
+		geom.reset(new TGeometry(config));
+		source.reset(CreateParticleSource(config, *geom));
+		TMCGenerator mc(SEED, 0);
+		source->Prepare(mc, *geom, *field);
+		tracker.reset(new TTracker(config));
+	}
+
+	/**
+	 * Track a particle
+	 *
+	 * @param number Particle number, selects random-number substream
+	 */
+	void Track(const unsigned long number){
+		TMCGenerator mc(SEED, 0);
+		mc.SetSubstream(number + 1, 0);
+		source->ParticleCounter = number;
+		unique_ptr<TParticle> p(source->CreateParticle(mc, *geom, *field));
+		tracker->IntegrateParticle(p, simtime, mc, *geom, *field);
+		sink = sink + p->GetFinalTime();
+	}
+};
+
+
+/**
+ * Fields and geometry of a configuration against which a query trace is replayed
+ */
+struct TReplay{
+	TConfig config; ///< Configuration
+	unique_ptr<TFieldManager> field; ///< Fields
+	unique_ptr<TGeometry> geom; ///< Geometry
+	vector<TQuery> fieldqueries; ///< Recorded field evaluations
+	vector<TQuery> segmentqueries; ///< Recorded collision tests, each particle starts with a PARTICLE query
+
+	/**
+	 * Constructor, reads query trace and loads fields and geometry
+	 *
+	 * @param tracefile Query trace
+	 * @param file Configuration file
+	 */
+	TReplay(const boost::filesystem::path &tracefile, const boost::filesystem::path &file): config(file.string()){
+		configpath = file;
+		unsigned long particles = 0, gradients = 0;
+		for (const TQuery &q: QueryTrace::Read(tracefile)){
+			if (q.type == TQuery::SEGMENT || q.type == TQuery::PARTICLE)
+				segmentqueries.push_back(q);
+			else
+				fieldqueries.push_back(q);
+			particles += q.type == TQuery::PARTICLE;
+			gradients += q.type == TQuery::BGRADIENT;
+		}
+		printf("Replaying %lu field evaluations (%lu with gradients) and %lu collision tests of %lu particles\n",
+				fieldqueries.size(), gradients, segmentqueries.size() - particles, particles);
+		field.reset(new TFieldManager(config));
+		geom.reset(new TGeometry(config));
+	}
+};
+
+
+/**
+ * List benchmarks replaying a query trace
+ *
+ * @param tracefile Query trace written by PENTrack
+ * @param configfile Configuration file defining fields and geometry
+ *
+ * @return Returns benchmarks
+ */
+static vector<TBenchmark> ReplayBenchmarks(const boost::filesystem::path &tracefile, const boost::filesystem::path &configfile){
+	auto replay = make_shared<TReplay>(tracefile, configfile);
+	vector<TBenchmark> benchmarks;
+	if (not replay->fieldqueries.empty()){
+		benchmarks.push_back({"replay TFieldManager", [replay]() -> function<void(unsigned long)>{
+			return [replay](const unsigned long n){ // queries are replayed in recorded order, so cache hits and memory accesses follow the trajectories
+				const vector<TQuery> &queries = replay->fieldqueries;
+				double B[3], dBidxj[3][3], V, E[3], sum = 0;
+				for (unsigned long i = 0; i < n; ++i){
+					const TQuery &q = queries[i % queries.size()];
+					if (q.type == TQuery::EFIELD){
+						replay->field->EField(q.p1[0], q.p1[1], q.p1[2], q.t1, V, E);
+						sum += V;
+					}
+					else{
+						replay->field->BField(q.p1[0], q.p1[1], q.p1[2], q.t1, B, q.type == TQuery::BGRADIENT ? dBidxj : nullptr);
+						sum += B[2];
+					}
+				}
+				sink = sink + sum;
+			};
+		}});
+	}
+	if (any_of(replay->segmentqueries.begin(), replay->segmentqueries.end(), [](const TQuery &q){ return q.type == TQuery::SEGMENT; })){
+		benchmarks.push_back({"replay TGeometry::GetCollisions", [replay]() -> function<void(unsigned long)>{
+			return [replay](const unsigned long n){
+				const vector<TQuery> &queries = replay->segmentqueries;
+				vector<TCollision> colls;
+				TCollisionCache cache;
+				unsigned long found = 0, i = 0;
+				for (unsigned long calls = 0; calls < n; ++i){
+					const TQuery &q = queries[i % queries.size()];
+					if (q.type == TQuery::PARTICLE){ // every particle starts with an empty collision cache, as in TTracker
+						cache.valid = false;
+						continue;
+					}
+					colls.clear();
+					replay->geom->GetCollisions(q.t1, q.p1, q.t2, q.p2, colls, cache);
+					found += colls.size();
+					++calls;
+				}
+				sink = sink + found;
+			};
+		}});
+	}
+	return benchmarks;
+}
+
+
+/**
+ * List all benchmarks
+ *
+ * @param testdir Test directory
+ *
+ * @return Returns benchmarks
+ */
+static vector<TBenchmark> Benchmarks(const boost::filesystem::path &testdir){
+	vector<TBenchmark> benchmarks;
+	benchmarks.push_back({"TabField3::BField", [testdir]{
+		TFieldContainer f = ReadOperaField3("OPERA3D " + (testdir / "VerticalLinearGradientField3D.tab").string() + " 1 0 0 0.01", {});
+		return BFieldBenchmark(make_shared<TFieldContainer>(move(f)), {0., 0., 0.}, {1., 1., 1.});
+	}});
+	benchmarks.push_back({"TabField::BField", [testdir]{
+		auto f = make_shared<TabField>((testdir / "VerticalLinearGradientField2D.tab").string(), 0.01);
+		return BFieldBenchmark(f, {-0.7, -0.7, 0.}, {0.7, 0.7, 1.});
+	}});
+	benchmarks.push_back({"HarmonicExpandedBField::BField", []{
+		auto f = make_shared<HarmonicExpandedBField>(0.1, -0.2, 0.3, 0, 0, 1, 0.5, 1, 2, 3, 0.1, 0, 0.2, 0, 0, 0.01, 0, 0, 0, 0, 0.03, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+		return BFieldBenchmark(f, {-1., -1., -1.}, {1., 1., 1.});
+	}});
+	benchmarks.push_back({"TCustomBField::BField", []{
+		auto f = make_shared<TCustomBField>("x*y*z", "sin(x)*t", "y*z^2");
+		return BFieldBenchmark(f, {-1., -1., -1.}, {1., 1., 1.});
+	}});
+	benchmarks.push_back({"TTriangleMesh::Collision (CGAL)", [testdir]{
+		return CollisionBenchmark(LoadChamber(testdir, false));
+	}});
+	benchmarks.push_back({"TTriangleMesh::Collision (BVH)", [testdir]{
+		return CollisionBenchmark(LoadChamber(testdir, true));
+	}});
+	benchmarks.push_back({"TTriangleMesh::Collision (BVH packets)", [testdir]() -> function<void(unsigned long)>{
+		shared_ptr<TTriangleMesh> mesh = LoadChamber(testdir, true);
+		vector<array<double, 3> > starts = RandomPoints({-0.25, -0.25, -0.1}, {0.25, 0.25, 0.1});
+		vector<array<double, 3> > ends = RandomPoints({-0.02, -0.02, -0.02}, {0.02, 0.02, 0.02});
+		for (unsigned i = 0; i < NINPUTS; ++i){
+			for (int j = 0; j < 3; ++j)
+				ends[i][j] += starts[i][j];
+		}
+		return [mesh, starts, ends](const unsigned long n){ // same segments as the other collision benchmarks, each call tests one of them in batches of NINPUTS
+			vector<vector<TCollision> > colls;
+			unsigned long found = 0;
+			for (unsigned long i = 0; i < n; i += NINPUTS){
+				if (n - i < NINPUTS)
+					mesh->Collision(vector<array<double, 3> >(starts.begin(), starts.begin() + (n - i)), vector<array<double, 3> >(ends.begin(), ends.begin() + (n - i)), colls);
+				else
+					mesh->Collision(starts, ends, colls);
+				for (auto &c: colls)
+					found += c.size();
+			}
+			sink = sink + found;
+		};
+	}});
+	benchmarks.push_back({"TTriangleMesh::InSolid", [testdir]() -> function<void(unsigned long)>{
+		shared_ptr<TTriangleMesh> mesh = LoadChamber(testdir, false);
+		vector<array<double, 3> > points = RandomPoints({-0.25, -0.25, -0.1}, {0.25, 0.25, 0.1});
+		return [mesh, points](const unsigned long n){
+			unsigned long inside = 0;
+			for (unsigned long i = 0; i < n; ++i){
+				const array<double, 3> &p = points[i % NINPUTS];
+				inside += mesh->InSolid(p[0], p[1], p[2]);
+			}
+			sink = sink + inside;
+		};
+	}});
+	benchmarks.push_back({"MR::MRProb", []{
+		return MRBenchmark(&MR::MRProb);
+	}});
+	benchmarks.push_back({"MR::MRDistMax", []{
+		return MRBenchmark(&MR::MRDistMax);
+	}});
+	benchmarks.push_back({"TTracker::IntegrateParticle", [testdir]() -> function<void(unsigned long)>{
+		auto sim = make_shared<TSimulation>(testdir / "IntegrationTest" / "config.in");
+		return [sim](const unsigned long n){
+			for (unsigned long i = 0; i < n; ++i)
+				sim->Track(i % NINPUTS);
+		};
+	}});
+	return benchmarks;
+}
+
+
+int main(int argc, char **argv){
+	string filter = argc > 1 ? argv[1] : "";
+	vector<TBenchmark> benchmarks;
+	if (filter == "replay"){
+		if (argc < 4){
+			cout << "Usage: PENTrack_bench replay path/to/queries.bin path/to/config.in\n";
+			return 1;
+		}
+		benchmarks = ReplayBenchmarks(argv[2], boost::filesystem::absolute(argv[3]));
+	}
+	else
+		benchmarks = Benchmarks(boost::filesystem::absolute(argc > 2 ? argv[2] : PENTRACK_TEST_DIR));
+
+	printf("%-35s %12s %14s %14s\n", "benchmark", "calls", "min [ns]", "median [ns]");
+	for (auto &benchmark: benchmarks){
+		if (benchmark.name.find(filter) == string::npos && filter != "replay")
+			continue;
+		function<void(unsigned long)> run = benchmark.setup();
+
+		unsigned long n = 1;
+		while (true){ // double number of calls until a repetition takes long enough
+			auto start = chrono::steady_clock::now();
+			run(n);
+			if (chrono::duration<double>(chrono::steady_clock::now() - start).count() >= MIN_TIME)
+				break;
+			n *= 2;
+		}
+
+		vector<double> times;
+		for (unsigned r = 0; r < REPETITIONS; ++r){
+			auto start = chrono::steady_clock::now();
+			run(n);
+			times.push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - start).count()/n);
+		}
+		sort(times.begin(), times.end());
+		printf("%-35s %12lu %14.1f %14.1f\n", benchmark.name.c_str(), n, times.front(), times[REPETITIONS/2]);
+		cout.flush();
+	}
+	return 0;
+}
@@ -2,7 +2,10 @@
  * This file contains unit tests for (eventually all) field classes
  */
 
+#include <fstream>
 #include <random>
+#include <thread>
+#include <vector>
 
 #include <boost/test/unit_test.hpp>
 #include <boost/format.hpp>
@@ -12,6 +15,10 @@
 #include "globals.h"
 #include "edmfields.h"
 #include "fields.h"
+#include "field_2d.h"
+#include "field_3d.h"
+#include "field_fem.h"
+#include "harmonicfields.h"
 #include "config.h"
 
 #include <iostream>
@@ -202,6 +209,84 @@ BOOST_AUTO_TEST_CASE(TCustomBFieldTest){
     checkMagneticFieldZero(f, 1., 2., 3.);
 }
 
+// check that TCustomBField with derivative formulas returns the same field as with numerical derivatives
+BOOST_AUTO_TEST_CASE(TCustomBFieldDerivativesTest){
+    TCustomBField numerical("x*y*z", "sin(x)*t", "y*z^2");
+    TCustomBField analytical("x*y*z", "sin(x)*t", "y*z^2", {"y*z", "x*z", "x*y", "cos(x)*t", "0", "0", "0", "z^2", "2*y*z"});
+    BOOST_CHECK_THROW(TCustomBField("x", "y", "z", {"1", "0", "0"}), std::runtime_error);
+    BOOST_CHECK_THROW(TCustomBField("x", "y", "z", {"1", "0", "0", "0", "1", "0", "0", "0", "a"}), std::runtime_error);
+    int nTests = 100;
+    for (int n = 0; n < nTests; ++n){
+        double x = uni(rng), y = uni(rng), z = uni(rng), t = uni(rng);
+        BOOST_TEST_CONTEXT("Parameters: x = " << x << ", y = " << y << ", z = " << z << ", t = " << t){
+            compareMagneticFields(analytical, numerical, x, y, z, t);
+        }
+    }
+
+    bool correct[4] = {true, true, true, true};
+    std::vector<std::thread> threads; // evaluate the same interpreted field in several threads simultaneously
+    for (int i = 0; i < 4; ++i){
+        threads.emplace_back([&numerical, &correct, i](){
+            for (int n = 0; n < 10000; ++n){
+                double x = i + n*1e-4, B[3], dBidxj[3][3];
+                numerical.BField(x, 2., 3., 1., B, dBidxj);
+                if (std::abs(B[0] - x*6.) > 1e-12*x || B[1] != sin(x) || B[2] != 18. || std::abs(dBidxj[0][0] - 6.) > 1e-6)
+                    correct[i] = false;
+            }
+        });
+    }
+    for (auto &t: threads)
+        t.join();
+    for (int i = 0; i < 4; ++i){
+        BOOST_CHECK(correct[i]);
+    }
+}
+
+// check that formulas compiled to native code return the same values as the interpreter and unsupported formulas are rejected
+BOOST_AUTO_TEST_CASE(NativeFormulaTest){
+    boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("NativeFormulaTest-%%%%-%%%%");
+    BOOST_CHECK(CompileNativeFormula("t", {"t"}) == nullptr); // disabled by default
+    EnableNativeFormulas(dir);
+    TNativeFormula ramp = CompileNativeFormula("t < 0.5 ? 0 : (t > 2 ? 1 : sin(pi*(t - 0.5)/3)^2) + 2^-2 - 3 % 2 + min(t, 1, 2)*(T == 1 or not(t))", {"t"});
+    TNativeFormula field = CompileNativeFormula("if(x > y and z != 0, hypot(x, y)*exp(-z^2), abs(x)*atan2(y, z)) + 1/2", {"t", "x", "y", "z"});
+    BOOST_CHECK(CompileNativeFormula("var a := t; a", {"t"}) == nullptr);
+    BOOST_CHECK(CompileNativeFormula("2t", {"t"}) == nullptr);
+    BOOST_CHECK(CompileNativeFormula("x", {"t"}) == nullptr);
+    if (ramp == nullptr or field == nullptr){
+        BOOST_TEST_MESSAGE("No compiler available, skipping tests of compiled formulas");
+    }
+    else{
+        TFieldScaler interpreted("t < 0.5 ? 0 : (t > 2 ? 1 : sin(pi*(t - 0.5)/3)^2) + 2^-2 - 3 % 2 + min(t, 1, 2)*(T == 1 or not(t))");
+        TCustomBField custom("x*y*z", "sin(x)*t", "y*z^2");
+        EnableNativeFormulas(boost::filesystem::path());
+        TCustomBField interpretedcustom("x*y*z", "sin(x)*t", "y*z^2");
+        for (int n = 0; n < 100; ++n){
+            double t = uni(rng), x = uni(rng), y = uni(rng), z = uni(rng);
+            BOOST_TEST_CONTEXT("Parameters: x = " << x << ", y = " << y << ", z = " << z << ", t = " << t){
+                BOOST_CHECK_CLOSE(ramp(t, 0, 0, 0) + 1., interpreted.scalingFactor(t) + 1., 1e-10);
+                BOOST_CHECK_CLOSE(field(t, x, y, z) + 1., (x > y and z != 0 ? sqrt(x*x + y*y)*exp(-z*z) : abs(x)*atan2(y, z)) + 1.5, 1e-10);
+                compareMagneticFields(custom, interpretedcustom, x, y, z, t);
+            }
+        }
+    }
+    EnableNativeFormulas(boost::filesystem::path());
+    boost::filesystem::remove_all(dir);
+}
+
+// check that HarmonicExpandedBField returns the expected second-order expansion
+BOOST_AUTO_TEST_CASE(HarmonicExpandedBFieldTest){
+    HarmonicExpandedBField f(0.1, -0.2, 0.3, 0, 0, 0, 0, 1, 2, 3, 0.1, 0, 0.2, 0, 0, 0.01, 0, 0, 0, 0, 0.03, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    TCustomBField f2("3 + 0.1*(y - 0.2) - 0.1*(x + 0.1) + 0.02*(x + 0.1)*(y - 0.2) + 0.06*(x + 0.1)*(z + 0.3)",
+                     "1 + 0.1*(x + 0.1) - 0.1*(y - 0.2) + 0.01*((x + 0.1)^2 - (y - 0.2)^2) - 0.06*(y - 0.2)*(z + 0.3)",
+                     "2 + 0.2*(z + 0.3) + 0.03*((x + 0.1)^2 - (y - 0.2)^2)");
+    for (int i = 0; i < 100; ++i){
+        double x = uni(rng), y = uni(rng), z = uni(rng);
+        BOOST_TEST_CONTEXT("Parameters: x = " << x << ", y = " << y << ", z = " << z){
+            compareMagneticFields(f, f2, x, y, z);
+        }
+    }
+}
+
 // check that TFieldScaler correctly identifies invalid formulas and returns expected scaling factor
 BOOST_AUTO_TEST_CASE(TFieldScalerTest){
     BOOST_CHECK_THROW(TFieldScaler("asgd"), std::runtime_error);
@@ -221,6 +306,48 @@ BOOST_AUTO_TEST_CASE(TFieldScalerTest){
             BOOST_CHECK_EQUAL(dFidxj[i][j], scaler2.scalingFactor(1.));
         }
     }
+
+    BOOST_CHECK(scaler.isConstant()); // formulas without time dependence should be identified as constant
+    BOOST_CHECK(TFieldScaler("2*pi").isConstant());
+    BOOST_CHECK(not scaler2.isConstant());
+    BOOST_CHECK_EQUAL(TFieldScaler("2*pi").scalingFactor(1.), 2*M_PI);
+
+    bool correct[4] = {true, true, true, true};
+    std::vector<std::thread> threads; // evaluate the same scaler in several threads simultaneously
+    for (int i = 0; i < 4; ++i){
+        threads.emplace_back([&scaler2, &correct, i](){
+            for (int n = 0; n < 10000; ++n){
+                double t = i + n*1e-4;
+                if (scaler2.scalingFactor(t) != 10*t + 1)
+                    correct[i] = false;
+            }
+        });
+    }
+    for (auto &t: threads)
+        t.join();
+    for (int i = 0; i < 4; ++i){
+        BOOST_CHECK(correct[i]);
+    }
+
+    for (int i = 1; i <= 3; ++i){ // scalers created after others were destroyed reuse their slots and must not evaluate the stale expressions
+        TFieldScaler reloaded(std::to_string(i) + "*t");
+        BOOST_CHECK_EQUAL(reloaded.scalingFactor(2.), 2.*i);
+    }
+}
+
+// check that tabulated scaling formulas stay within tolerance and keep discontinuities
+BOOST_AUTO_TEST_CASE(TFieldScalerTableTest){
+    const std::string formula = "t < 1.234 ? 0 : (t < 3 ? exp(-(t - 1.234))*sin(5*t) : 1)";
+    TFieldScaler direct(formula), table(formula);
+    BOOST_CHECK_EQUAL(table.tabulate(0, 5, 0.1, 1e-8), 2); // jumps at 1.234 and 3
+    for (int i = 0; i <= 10000; ++i){
+        double t = i*5e-4;
+        if (std::abs(t - 1.234) > 1e-6 and std::abs(t - 3) > 1e-6)
+            BOOST_CHECK_SMALL(table.scalingFactor(t) - direct.scalingFactor(t), 2e-8);
+    }
+    BOOST_CHECK_EQUAL(table.scalingFactor(1.2), 0.);
+    BOOST_CHECK_EQUAL(table.scalingFactor(4), 1.);
+    BOOST_CHECK_EQUAL(table.scalingFactor(6), direct.scalingFactor(6)); // outside table
 }
 
 // check that TFieldBoundaryBox correctly identifies invalid parameters and correctly scales within and outside of boundary (without smoothing)
@@ -300,6 +427,27 @@ BOOST_AUTO_TEST_CASE(TFieldContainerTest){
     }
 }
 
+// check that a TFieldContainer declared as RF pulse multiplies its envelope by the carrier and is no longer static
+BOOST_AUTO_TEST_CASE(TFieldContainerRFTest){
+    TFieldContainer c(std::unique_ptr<TField>(new TCustomBField("1", "2*x", "0")), "2", "0");
+    BOOST_CHECK(c.IsBFieldStatic());
+    c.DeclareRF(183., 0.5);
+    BOOST_CHECK(c.IsBFieldStatic() == false);
+    BOOST_CHECK_EQUAL(c.GetRFFrequency(), 183.);
+    for (int n = 0; n < 100; ++n){
+        double x = uni(rng), y = uni(rng), z = uni(rng), t = uni(rng);
+        BOOST_TEST_CONTEXT("Parameters: x = " << x << ", y = " << y << ", z = " << z << ", t = " << t){
+            double B[3], A[3];
+            c.BField(x, y, z, t, B, nullptr);
+            c.RFAmplitude(x, y, z, t, A);
+            BOOST_CHECK_CLOSE(A[0], 2., 1e-12);
+            BOOST_CHECK_CLOSE(A[1], 4*x, 1e-12);
+            for (int i = 0; i < 3; ++i)
+                BOOST_CHECK_SMALL(B[i] - A[i]*cos(183.*t + 0.5), 1e-12);
+        }
+    }
+}
+
 // compare field calculated from a conductor along the z axis to a TCustomBField with same field calculation formula, using randomly selected parameters and positions
 BOOST_AUTO_TEST_CASE(TConductorFieldTest){
     int nTests = 100;
@@ -317,6 +465,56 @@ BOOST_AUTO_TEST_CASE(TConductorFieldTest){
     }
 }
 
+/**
+ * Sum of several TConductorFields
+ */
+struct TConductorSum{
+    std::vector<TConductorField> conductors;
+    void BField(const double x, const double y, const double z, const double t, double B[3], double dBidxj[3][3]) const{
+        double Btmp[3], dBtmp[3][3], dBsum[3][3] = {{0., 0., 0.}, {0., 0., 0.}, {0., 0., 0.}};
+        B[0] = B[1] = B[2] = 0.;
+        for (auto &c: conductors){
+            c.BField(x, y, z, t, Btmp, dBtmp);
+            for (int i = 0; i < 3; ++i){
+                B[i] += Btmp[i];
+                for (int j = 0; j < 3; ++j)
+                    dBsum[i][j] += dBtmp[i][j];
+            }
+        }
+        for (int i = 0; i < 3 and dBidxj != nullptr; ++i){
+            for (int j = 0; j < 3; ++j)
+                dBidxj[i][j] = dBsum[i][j];
+        }
+    }
+};
+
+// compare field of a set of conductors read from a file to the sum of the fields of the individual conductors, using randomly selected segments and positions
+BOOST_AUTO_TEST_CASE(TConductorSetFieldTest){
+    boost::filesystem::path segfile = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("TConductorSetFieldTest-%%%%-%%%%.txt");
+    TConductorSum f2;
+    {
+        std::ofstream f(segfile.string());
+        f.precision(17);
+        f << "# I x1 y1 z1 x2 y2 z2\n";
+        for (int n = 0; n < 11; ++n){ // number of segments that is not a multiple of the vector lanes
+            double I = 1e4*uni(rng), p[6];
+            for (double &c: p)
+                c = uni(rng);
+            f << I << " " << p[0] << " " << p[1] << " " << p[2] << " " << p[3] << " " << p[4] << " " << p[5] << "\n";
+            f2.conductors.push_back(TConductorField(p[0], p[1], p[2], p[3], p[4], p[5], I));
+        }
+    }
+    TConductorSetField f1(segfile);
+    boost::filesystem::remove(segfile);
+    for (int n = 0; n < 100; ++n){
+        double x = uni(rng), y = uni(rng), z = uni(rng);
+        BOOST_TEST_CONTEXT("Parameters: x = " << x << ", y = " << y << ", z = " << z){
+            compareMagneticFields(f1, f2, x, y, z);
+            checkElectricFieldZero(f1, x, y, z);
+        }
+    }
+}
+
 // compare field calculated from TEDMStaticB0GradZField along the y axis to a TCustomBField with same field calculation formula, using randomly selected offsets, parameters and positions
 BOOST_AUTO_TEST_CASE(TEDMStaticB0GradZFieldTest){
     int nTests = 100;
@@ -374,6 +572,634 @@ BOOST_AUTO_TEST_CASE(TFieldManagerTest){
 }
 
 
+/**
+ * Check that TFieldManager evaluates fields at many points stored as structure of arrays like at each single point
+ */
+BOOST_AUTO_TEST_CASE(TFieldManagerBatchTest){
+    TConfig config({{"FIELDS", {{"0", "B0GradZ 1 2 3 1 -1 1 -1 1 -1 1"}, {"1", "LinearFieldZ 0 1 1 -1 1 -1 1 -1 sin(t)"}}}});
+    TFieldManager m(config);
+    const std::size_t n = 100;
+    std::vector<double> x(n), y(n), z(n), t(n);
+    for (std::size_t i = 0; i < n; ++i){
+        x[i] = 2*uni(rng);
+        y[i] = 2*uni(rng);
+        z[i] = 2*uni(rng);
+        t[i] = uni(rng);
+    }
+    std::array<std::vector<double>, 3> B;
+    std::array<std::array<std::vector<double>, 3>, 3> dB;
+    double *Bptr[3], *dBptr[3][3];
+    for (int i = 0; i < 3; ++i){
+        B[i].resize(n);
+        Bptr[i] = B[i].data();
+        for (int j = 0; j < 3; ++j){
+            dB[i][j].resize(n);
+            dBptr[i][j] = dB[i][j].data();
+        }
+    }
+    m.BField(n, x.data(), y.data(), z.data(), t.data(), Bptr, dBptr);
+    for (std::size_t k = 0; k < n; ++k){
+        double Bk[3], dBk[3][3];
+        m.BField(x[k], y[k], z[k], t[k], Bk, dBk);
+        BOOST_TEST_CONTEXT("Parameters: x = " << x[k] << ", y = " << y[k] << ", z = " << z[k] << ", t = " << t[k]){
+            for (int i = 0; i < 3; ++i){
+                BOOST_CHECK_EQUAL(B[i][k], Bk[i]);
+                for (int j = 0; j < 3; ++j)
+                    BOOST_CHECK_EQUAL(dB[i][j][k], dBk[i][j]);
+            }
+        }
+    }
+}
+
+
+/**
+ * Check that TFieldManager finds all fields that contain a point when it only visits fields whose boundary boxes overlap the point
+ */
+BOOST_AUTO_TEST_CASE(TFieldManagerIndexTest){
+    std::vector<std::array<double, 6> > boxes; // xmax, xmin, ymax, ymin, zmax, zmin
+    std::map<std::string, std::string> fieldconf;
+    for (int i = 0; i < 20; ++i){
+        double x = uni(rng), y = uni(rng), z = uni(rng), d = 0.5*(uni(rng) + 2.);
+        boxes.push_back({{x + d, x, y + d, y, z + 0.1*d, z}});
+        fieldconf[std::to_string(i)] = (boost::format("LinearFieldZ 0 %1% %2$.17g %3$.17g %4$.17g %5$.17g %6$.17g %7$.17g 1") % (i + 1)
+                                        % boxes[i][0] % boxes[i][1] % boxes[i][2] % boxes[i][3] % boxes[i][4] % boxes[i][5]).str();
+    }
+    fieldconf["20"] = "LinearFieldZ 0 1000 0 0 0 0 0 0 1"; // field without boundary
+    TConfig config({{"FIELDS", fieldconf}});
+    TFieldManager m(config);
+    int nTests = 10000;
+    for (int n = 0; n < nTests; ++n){
+        double x = 1.5*uni(rng), y = 1.5*uni(rng), z = 1.5*uni(rng);
+        if (n < static_cast<int>(boxes.size())){ // check corners of boxes
+            x = boxes[n][1];
+            y = boxes[n][3];
+            z = boxes[n][5];
+        }
+        double Bz = 1000;
+        for (unsigned i = 0; i < boxes.size(); ++i){
+            if (x >= boxes[i][1] and x < boxes[i][0] and y >= boxes[i][3] and y < boxes[i][2] and z >= boxes[i][5] and z < boxes[i][4])
+                Bz += i + 1;
+        }
+        double B[3];
+        m.BField(x, y, z, 0, B, nullptr);
+        BOOST_TEST_CONTEXT("Parameters: x = " << x << ", y = " << y << ", z = " << z){
+            BOOST_CHECK_EQUAL(B[2], Bz);
+        }
+    }
+}
+
+
+/**
+ * Check that baking static fields into a table reproduces them inside the baked region, keeps time-dependent fields, and does not change fields outside the region
+ */
+BOOST_AUTO_TEST_CASE(TFieldManagerBakeTest){
+    std::map<std::string, std::string> fieldconf = {{"0", "Conductor 100 3 0 -1 3 0 1 1"}, // straight wire outside baked region
+                                                    {"1", "LinearFieldZ 0.5 1 2 -2 2 -2 2 -2 1"},
+                                                    {"2", "LinearFieldZ 0 1 2 -2 2 -2 2 -2 sin(t)"}}; // time-dependent field is not baked
+    TConfig config({{"FIELDS", fieldconf}});
+    TFieldManager m(config);
+    boost::filesystem::path cachedir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("TFieldManagerBakeTest-%%%%-%%%%");
+    TConfig bakedconfig({{"FIELDS", fieldconf}, {"GLOBAL", {{"bakefields", "1 -1 1 -1 1 -1 0.1"}, {"fieldcache", cachedir.string()}}}});
+    TFieldManager baked(bakedconfig);
+    TFieldManager cached(bakedconfig); // loads baked table from cache
+    int nTests = 1000;
+    for (int n = 0; n < nTests; ++n){
+        double x = uni(rng), y = uni(rng), z = uni(rng), t = uni(rng);
+        double B1[3], B2[3], B3[3];
+        m.BField(x, y, z, t, B1, nullptr);
+        baked.BField(x, y, z, t, B2, nullptr);
+        cached.BField(x, y, z, t, B3, nullptr);
+        BOOST_TEST_CONTEXT("Parameters: x = " << x << ", y = " << y << ", z = " << z << ", t = " << t){
+            for (int i = 0; i < 3; ++i){
+                if (abs(x) < 1 and abs(y) < 1 and abs(z) < 1)
+                    BOOST_CHECK_SMALL(B1[i] - B2[i], 1e-9);
+                else
+                    BOOST_CHECK_EQUAL(B1[i], B2[i]);
+                BOOST_CHECK_EQUAL(B2[i], B3[i]);
+            }
+        }
+    }
+    boost::filesystem::remove_all(cachedir);
+}
+
+
+/**
+ * Linear magnetic field B = (y + z, x + z, x + y) used as reference for interpolated tables
+ */
+struct TLinearTestField{
+    void BField(const double x, const double y, const double z, const double t, double B[3], double dBidxj[3][3]) const{
+        B[0] = y + z;
+        B[1] = x + z;
+        B[2] = x + y;
+        if (dBidxj != nullptr){
+            for (int i = 0; i < 3; ++i){
+                for (int j = 0; j < 3; ++j)
+                    dBidxj[i][j] = i == j ? 0. : 1.;
+            }
+        }
+    }
+};
+
+/**
+ * Create a 3D table of TLinearTestField on a grid
+ */
+TabField3 TabulateLinearTestField(const std::vector<double> &grid, const bool single_precision = false, const unsigned nthreads = 1, const bool trilinear = false){
+    std::array<std::vector<double>, 3> xyz, B;
+    TLinearTestField f;
+    for (auto x: grid){
+        for (auto y: grid){
+            for (auto z: grid){
+                double Bi[3];
+                f.BField(x, y, z, 0, Bi, nullptr);
+                xyz[0].push_back(x);
+                xyz[1].push_back(y);
+                xyz[2].push_back(z);
+                for (int i = 0; i < 3; ++i)
+                    B[i].push_back(Bi[i]);
+            }
+        }
+    }
+    return TabField3(xyz, B, std::vector<double>(), single_precision, nthreads, trilinear);
+}
+
+/**
+ * Check that tricubic interpolation reproduces a linear field on uniform grids, where grid cells are calculated directly, and on non-uniform grids, where they are found by binary search
+ */
+BOOST_AUTO_TEST_CASE(TabField3Test){
+    std::vector<double> uniform, nonuniform;
+    for (int i = 0; i <= 20; ++i){
+        uniform.push_back(-2. + 0.2*i);
+        nonuniform.push_back(-2. + 4.*i*i/400.);
+    }
+    TabField3 uniformtab = TabulateLinearTestField(uniform);
+    TabField3 nonuniformtab = TabulateLinearTestField(nonuniform);
+    TLinearTestField f;
+    int nTests = 1000;
+    for (int n = 0; n < nTests; ++n){
+        double x = uni(rng), y = uni(rng), z = uni(rng);
+        BOOST_TEST_CONTEXT("Parameters: x = " << x << ", y = " << y << ", z = " << z){
+            compareMagneticFields(uniformtab, f, x, y, z);
+            compareMagneticFields(nonuniformtab, f, x, y, z);
+        }
+    }
+    for (unsigned i = 0; i + 1 < uniform.size(); ++i){ // check grid points, where rounding errors could select the wrong cell
+        BOOST_TEST_CONTEXT("Parameters: x = " << uniform[i]){
+            compareMagneticFields(uniformtab, f, uniform[i], uniform[i], uniform[i]);
+        }
+    }
+}
+
+/**
+ * Check that the batched evaluation of a table inside a container with scaling and boundary gives the same results as single points, including points outside the grid
+ */
+BOOST_AUTO_TEST_CASE(TabField3BatchTest){
+    std::vector<double> grid;
+    for (int i = 0; i <= 20; ++i)
+        grid.push_back(-2. + 0.2*i);
+    std::shared_ptr<const TField> tab = std::make_shared<TabField3>(TabulateLinearTestField(grid));
+    TFieldContainer c(tab, "sin(t)", "0", 1.5, -1.5, 1.5, -1.5, 1.5, -1.5, 0.5);
+    const std::size_t n = 200;
+    std::vector<double> x(n), y(n), z(n), t(n), F(12*n);
+    for (std::size_t k = 0; k < n; ++k){
+        x[k] = 2*uni(rng);
+        y[k] = 2*uni(rng);
+        z[k] = 2*uni(rng);
+        t[k] = uni(rng);
+    }
+    double *const B[3] = {&F[0], &F[n], &F[2*n]};
+    double *const dB[3][3] = {{&F[3*n], &F[4*n], &F[5*n]}, {&F[6*n], &F[7*n], &F[8*n]}, {&F[9*n], &F[10*n], &F[11*n]}};
+    c.BField(n, x.data(), y.data(), z.data(), t.data(), B, dB);
+    for (std::size_t k = 0; k < n; ++k){
+        BOOST_TEST_CONTEXT("Parameters: x = " << x[k] << ", y = " << y[k] << ", z = " << z[k] << ", t = " << t[k]){
+            double Bi[3] = {0, 0, 0}, dBi[3][3] = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}};
+            c.BField(x[k], y[k], z[k], t[k], Bi, dBi);
+            for (int i = 0; i < 3; ++i){
+                BOOST_CHECK_EQUAL(Bi[i], B[i][k]);
+                for (int j = 0; j < 3; ++j)
+                    BOOST_CHECK_EQUAL(dBi[i][j], dB[i][j][k]);
+            }
+        }
+    }
+}
+
+/**
+ * Check that an octree resampled from a field with a localized peak reproduces the field within the requested tolerance
+ */
+BOOST_AUTO_TEST_CASE(TabField3AdaptiveTest){
+    TCustomBField f("1e-3*exp(-((x - 0.3)^2 + y^2 + z^2)/0.01)", "0.01*x*y", "1e-3 + 1e-4*z^2");
+    const double tolerance = 1e-7;
+    TabField3Adaptive tab(f, {-1., -1., -1.}, {1., 1., 1.}, 0.01, tolerance, 1., 2);
+    for (int n = 0; n < 1000; ++n){
+        double x = uni(rng)/2, y = uni(rng)/2, z = uni(rng)/2;
+        BOOST_TEST_CONTEXT("Parameters: x = " << x << ", y = " << y << ", z = " << z){
+            double B1[3] = {0., 0., 0.}, B2[3] = {0., 0., 0.}, dB1[3][3], dB2[3][3];
+            tab.BField(x, y, z, 0., B1, dB1);
+            f.BField(x, y, z, 0., B2, dB2);
+            for (int i = 0; i < 3; ++i){
+                BOOST_TEST_INFO("i = " << i);
+                BOOST_CHECK_SMALL(B1[i] - B2[i], 10*tolerance);
+                for (int j = 0; j < 3; ++j){
+                    BOOST_TEST_INFO("j = " << j);
+                    BOOST_CHECK_SMALL(dB1[i][j] - dB2[i][j], 1e-4);
+                }
+            }
+        }
+    }
+    checkMagneticFieldZero(tab, 1., 0., 0.); // upper bounds are outside
+}
+
+/**
+ * Check that a TabField3 loaded from a cache file returns the same fields as the original table and that mismatching keys are rejected
+ */
+BOOST_AUTO_TEST_CASE(TabField3CacheTest){
+    std::vector<double> grid;
+    for (int i = 0; i <= 10; ++i)
+        grid.push_back(-2. + 0.4*i);
+    TabField3 tab = TabulateLinearTestField(grid);
+    boost::filesystem::path cachefile = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("TabField3CacheTest-%%%%-%%%%.tricubic");
+    tab.WriteCache(cachefile, 42);
+    BOOST_CHECK_THROW(TabField3(cachefile, 43), std::runtime_error);
+    {
+        TabField3 cached(cachefile, 42);
+        for (int n = 0; n < 100; ++n){
+            double x = uni(rng), y = uni(rng), z = uni(rng);
+            double B1[3] = {0, 0, 0}, B2[3] = {0, 0, 0}, dB1[3][3], dB2[3][3];
+            tab.BField(x, y, z, 0, B1, dB1);
+            cached.BField(x, y, z, 0, B2, dB2);
+            for (int i = 0; i < 3; ++i){
+                BOOST_CHECK_EQUAL(B1[i], B2[i]);
+                for (int j = 0; j < 3; ++j)
+                    BOOST_CHECK_EQUAL(dB1[i][j], dB2[i][j]);
+            }
+        }
+    }
+    boost::filesystem::remove(cachefile);
+}
+
+
+/**
+ * Check that a TabField3 with single-precision coefficients matches the linear field within single-precision rounding errors, also after loading it from a cache file
+ */
+BOOST_AUTO_TEST_CASE(TabField3SinglePrecisionTest){
+    std::vector<double> grid;
+    for (int i = 0; i <= 10; ++i)
+        grid.push_back(-2. + 0.4*i);
+    TabField3 tab = TabulateLinearTestField(grid, true);
+    boost::filesystem::path cachefile = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("TabField3SinglePrecisionTest-%%%%-%%%%.tricubic");
+    tab.WriteCache(cachefile, 42);
+    TabField3 cached(cachefile, 42);
+    TLinearTestField f;
+    for (int n = 0; n < 100; ++n){
+        double x = uni(rng), y = uni(rng), z = uni(rng);
+        BOOST_TEST_CONTEXT("Parameters: x = " << x << ", y = " << y << ", z = " << z){
+            double B0[3], B1[3], B2[3], dB0[3][3], dB1[3][3], dB2[3][3];
+            f.BField(x, y, z, 0, B0, dB0);
+            tab.BField(x, y, z, 0, B1, dB1);
+            cached.BField(x, y, z, 0, B2, dB2);
+            for (int i = 0; i < 3; ++i){
+                BOOST_CHECK_SMALL(B1[i] - B0[i], 1e-5);
+                BOOST_CHECK_EQUAL(B1[i], B2[i]);
+                for (int j = 0; j < 3; ++j){
+                    BOOST_CHECK_SMALL(dB1[i][j] - dB0[i][j], 1e-4);
+                    BOOST_CHECK_EQUAL(dB1[i][j], dB2[i][j]);
+                }
+            }
+        }
+    }
+    boost::filesystem::remove(cachefile);
+}
+
+
+/**
+ * Check that a TabField3 with trilinear interpolation reproduces the linear field on a non-uniform grid, also after loading it from a cache file and in batches
+ */
+BOOST_AUTO_TEST_CASE(TabField3TrilinearTest){
+    std::vector<double> grid;
+    for (int i = 0; i <= 10; ++i)
+        grid.push_back(-2. + 0.4*i + 0.01*i*i);
+    std::array<std::vector<double>, 3> xyz, B;
+    BOOST_CHECK_THROW(TabField3(xyz, B, std::vector<double>(), true, 1, true), std::runtime_error);
+    TabField3 tab = TabulateLinearTestField(grid, false, 2, true);
+    boost::filesystem::path cachefile = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("TabField3TrilinearTest-%%%%-%%%%.tricubic");
+    tab.WriteCache(cachefile, 42);
+    TabField3 cached(cachefile, 42);
+    TLinearTestField f;
+    const std::size_t n = 100;
+    std::vector<double> x(n), y(n), z(n), t(n, 0.), F(12*n, 0.);
+    for (std::size_t k = 0; k < n; ++k){
+        x[k] = uni(rng);
+        y[k] = uni(rng);
+        z[k] = uni(rng);
+    }
+    double *const Bbatch[3] = {&F[0], &F[n], &F[2*n]};
+    double *const dBbatch[3][3] = {{&F[3*n], &F[4*n], &F[5*n]}, {&F[6*n], &F[7*n], &F[8*n]}, {&F[9*n], &F[10*n], &F[11*n]}};
+    tab.BField(n, x.data(), y.data(), z.data(), t.data(), Bbatch, dBbatch);
+    for (std::size_t k = 0; k < n; ++k){
+        BOOST_TEST_CONTEXT("Parameters: x = " << x[k] << ", y = " << y[k] << ", z = " << z[k]){
+            compareMagneticFields(tab, f, x[k], y[k], z[k]);
+            double B1[3] = {0, 0, 0}, B2[3] = {0, 0, 0}, dB1[3][3], dB2[3][3];
+            tab.BField(x[k], y[k], z[k], 0, B1, dB1);
+            cached.BField(x[k], y[k], z[k], 0, B2, dB2);
+            for (int i = 0; i < 3; ++i){
+                BOOST_CHECK_EQUAL(B1[i], B2[i]);
+                BOOST_CHECK_EQUAL(B1[i], Bbatch[i][k]);
+                for (int j = 0; j < 3; ++j){
+                    BOOST_CHECK_EQUAL(dB1[i][j], dB2[i][j]);
+                    BOOST_CHECK_EQUAL(dB1[i][j], dBbatch[i][j][k]);
+                }
+            }
+        }
+    }
+    boost::filesystem::remove(cachefile);
+}
+
+
+/**
+ * Check that calculating interpolation coefficients in several threads gives the same results as in a single thread
+ */
+BOOST_AUTO_TEST_CASE(TabField3ThreadsTest){
+    std::vector<double> grid;
+    for (int i = 0; i <= 10; ++i)
+        grid.push_back(-2. + 0.4*i + 0.01*i*i);
+    TabField3 tab = TabulateLinearTestField(grid);
+    TabField3 threadedtab = TabulateLinearTestField(grid, false, 3);
+    for (int n = 0; n < 100; ++n){
+        double x = uni(rng), y = uni(rng), z = uni(rng);
+        double B1[3] = {0, 0, 0}, B2[3] = {0, 0, 0}, dB1[3][3], dB2[3][3];
+        tab.BField(x, y, z, 0, B1, dB1);
+        threadedtab.BField(x, y, z, 0, B2, dB2);
+        for (int i = 0; i < 3; ++i){
+            BOOST_CHECK_EQUAL(B1[i], B2[i]);
+            for (int j = 0; j < 3; ++j)
+                BOOST_CHECK_EQUAL(dB1[i][j], dB2[i][j]);
+        }
+    }
+}
+
+
+/**
+ * Fields used as reference for symmetric tables, both are reproduced exactly by tricubic interpolation
+ *
+ * B = (yz, xz, xy) is mirror-symmetric at all coordinate planes.
+ * B = (-y, x, z) and V = z are symmetric under rotations about the z axis and change sign at z = 0.
+ */
+struct TSymmetricTestField{
+    bool octant; ///< true: mirror-symmetric field, false: rotationally symmetric field
+    void BField(const double x, const double y, const double z, const double t, double B[3], double dBidxj[3][3]) const{
+        double b[3] = {y*z, x*z, x*y}, db[3][3] = {{0, z, y}, {z, 0, x}, {y, x, 0}};
+        if (not octant){
+            double br[3] = {-y, x, z}, dbr[3][3] = {{0, -1, 0}, {1, 0, 0}, {0, 0, 1}};
+            std::copy(br, br + 3, b);
+            std::copy(&dbr[0][0], &dbr[0][0] + 9, &db[0][0]);
+        }
+        for (int i = 0; i < 3; ++i){
+            B[i] = b[i];
+            if (dBidxj != nullptr)
+                std::copy(db[i], db[i] + 3, dBidxj[i]);
+        }
+    }
+    void EField(const double x, const double y, const double z, const double t, double &V, double Ei[3]) const{
+        V = octant ? 0. : z;
+        Ei[0] = Ei[1] = 0.;
+        Ei[2] = octant ? 0. : -1.;
+    }
+};
+
+/**
+ * Check that a table covering only the positive octant reproduces symmetric fields everywhere, both for single points and batches
+ */
+BOOST_AUTO_TEST_CASE(TabField3SymmetricTest){
+    for (bool octant: {true, false}){
+        TSymmetricTestField f{octant};
+        std::array<std::vector<double>, 3> xyz, B;
+        std::vector<double> V;
+        for (int i = 0; i <= 10; ++i){
+            for (int j = 0; j <= 10; ++j){
+                for (int k = 0; k <= 10; ++k){
+                    double p[3] = {0.2*i, 0.2*j, 0.2*k}, Bi[3], Vi, Ei[3];
+                    f.BField(p[0], p[1], p[2], 0, Bi, nullptr);
+                    f.EField(p[0], p[1], p[2], 0, Vi, Ei);
+                    for (int l = 0; l < 3; ++l){
+                        xyz[l].push_back(p[l]);
+                        B[l].push_back(Bi[l]);
+                    }
+                    V.push_back(Vi);
+                }
+            }
+        }
+        TTableSymmetry symmetry;
+        if (octant)
+            symmetry.mirror = {{1, 1, 1}};
+        else{
+            symmetry.mirror = {{0, 0, -1}};
+            symmetry.rotation = 4;
+        }
+        TabField3Symmetric tab(std::make_shared<TabField3>(xyz, B, V), {{0., 0., 0.}}, {{2., 2., 2.}}, symmetry);
+        std::array<double, 3> min, max;
+        tab.GetBounds(min, max);
+        double r = octant ? 2. : std::sqrt(8.);
+        BOOST_CHECK_EQUAL(min[0], -r);
+        BOOST_CHECK_EQUAL(max[1], r);
+        BOOST_CHECK_EQUAL(min[2], -2.);
+        BOOST_CHECK_EQUAL(max[2], 2.);
+
+        const std::size_t n = 1000;
+        std::vector<double> x(n), y(n), z(n), t(n, 0.), F(12*n, 0.);
+        for (std::size_t k = 0; k < n; ++k){
+            x[k] = uni(rng);
+            y[k] = uni(rng);
+            z[k] = uni(rng);
+        }
+        x[0] = 0; // points on the boundaries of sectors and mirror planes
+        y[1] = 0;
+        z[2] = 0;
+        double *const Bk[3] = {&F[0], &F[n], &F[2*n]};
+        double *const dBk[3][3] = {{&F[3*n], &F[4*n], &F[5*n]}, {&F[6*n], &F[7*n], &F[8*n]}, {&F[9*n], &F[10*n], &F[11*n]}};
+        tab.BField(n, x.data(), y.data(), z.data(), t.data(), Bk, dBk);
+        for (std::size_t k = 0; k < n; ++k){
+            BOOST_TEST_CONTEXT("Parameters: octant = " << octant << ", x = " << x[k] << ", y = " << y[k] << ", z = " << z[k]){
+                compareMagneticFields(tab, f, x[k], y[k], z[k]);
+                double V1 = 0, V2 = 0, E1[3] = {0, 0, 0}, E2[3] = {0, 0, 0}, B1[3] = {0, 0, 0}, dB1[3][3];
+                tab.EField(x[k], y[k], z[k], 0, V1, E1);
+                f.EField(x[k], y[k], z[k], 0, V2, E2);
+                BOOST_CHECK_SMALL(V1 - V2, 1e-10);
+                tab.BField(x[k], y[k], z[k], 0, B1, dB1);
+                for (int i = 0; i < 3; ++i){
+                    BOOST_CHECK_SMALL(E1[i] - E2[i], 1e-5);
+                    BOOST_CHECK_EQUAL(B1[i], Bk[i][k]);
+                    for (int j = 0; j < 3; ++j)
+                        BOOST_CHECK_EQUAL(dB1[i][j], dBk[i][j][k]);
+                }
+            }
+        }
+    }
+}
+
+
+/**
+ * Axisymmetric linear magnetic field Br = r/2, Bphi = 0, Bz = 1 - z and potential V = r + 2z used as reference for interpolated 2D tables
+ */
+struct TLinearCylTestField{
+    void BField(const double x, const double y, const double z, const double t, double B[3], double dBidxj[3][3]) const{
+        B[0] = x/2;
+        B[1] = y/2;
+        B[2] = 1. - z;
+        if (dBidxj != nullptr){
+            for (int i = 0; i < 3; ++i){
+                for (int j = 0; j < 3; ++j)
+                    dBidxj[i][j] = i != j ? 0. : (i < 2 ? 0.5 : -1.);
+            }
+        }
+    }
+};
+
+/**
+ * Check that a table coarsened by a grid stride covers the same region, still reproduces a linear field, and is cached separately from the full table
+ */
+BOOST_AUTO_TEST_CASE(TabField3StrideTest){
+    boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("TabField3StrideTest-%%%%-%%%%");
+    boost::filesystem::create_directories(dir);
+    boost::filesystem::path tabfile = dir / "table.txt";
+    {
+        std::ofstream f(tabfile.string());
+        f.precision(17);
+        TLinearTestField field;
+        for (int i = 0; i <= 20; ++i){
+            for (int j = 0; j <= 20; ++j){
+                for (int k = 0; k <= 20; ++k){
+                    double x = -2. + 0.2*i, y = -2. + 0.2*j, z = -2. + 0.2*k, B[3];
+                    field.BField(x, y, z, 0, B, nullptr);
+                    f << x << " " << y << " " << z << " " << B[0] << " " << B[1] << " " << B[2] << "\n";
+                }
+            }
+        }
+    }
+    std::string params = "COMSOL " + tabfile.string() + " 1 0 1";
+    TFieldContainer full = ReadComsolField(params, {}, dir);
+    TFieldContainer coarse = ReadComsolField(params, {}, dir, 1, 3); // keeps every third node and the last one, so the last cell is smaller
+    int cachefiles = 0;
+    for (boost::filesystem::directory_iterator it(dir); it != boost::filesystem::directory_iterator(); ++it)
+        cachefiles += it->path().extension() == ".tricubic";
+    BOOST_CHECK_EQUAL(cachefiles, 2);
+    std::array<double, 3> fullmin, fullmax, coarsemin, coarsemax;
+    BOOST_REQUIRE(full.GetBounds(fullmin, fullmax) and coarse.GetBounds(coarsemin, coarsemax));
+    for (int i = 0; i < 3; ++i){
+        BOOST_CHECK_EQUAL(fullmin[i], coarsemin[i]);
+        BOOST_CHECK_EQUAL(fullmax[i], coarsemax[i]);
+    }
+    TLinearTestField f;
+    for (int n = 0; n < 1000; ++n){
+        double x = uni(rng), y = uni(rng), z = uni(rng);
+        BOOST_TEST_CONTEXT("Parameters: x = " << x << ", y = " << y << ", z = " << z){
+            compareMagneticFields(coarse, f, x, y, z);
+        }
+    }
+    boost::filesystem::remove_all(dir);
+}
+
+
+/**
+ * Check that a tetrahedral mesh with non-uniform elements reproduces a linear field and its gradient exactly, and that points outside the mesh are left unchanged
+ */
+BOOST_AUTO_TEST_CASE(TabFieldFEMTest){
+    boost::filesystem::path meshfile = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("TabFieldFEMTest-%%%%-%%%%.txt");
+    const int n = 8;
+    auto coordinate = [](const int i){ return -2. + 4.*i*i/(n*n); };
+    auto node = [](const int i, const int j, const int k){ return (i*(n + 1) + j)*(n + 1) + k + 1; };
+    {
+        std::ofstream f(meshfile.string());
+        f.precision(17);
+        TLinearTestField field;
+        f << "% Model: TabFieldFEMTest\n% Coordinates\n";
+        for (int i = 0; i <= n; ++i){
+            for (int j = 0; j <= n; ++j){
+                for (int k = 0; k <= n; ++k)
+                    f << coordinate(i) << " " << coordinate(j) << " " << coordinate(k) << "\n";
+            }
+        }
+        f << "% Elements (tetrahedra)\n";
+        const int axes[6][3] = {{0, 1, 2}, {0, 2, 1}, {1, 0, 2}, {1, 2, 0}, {2, 0, 1}, {2, 1, 0}}; // each cube is split into six tetrahedra along its diagonal
+        for (int i = 0; i < n; ++i){
+            for (int j = 0; j < n; ++j){
+                for (int k = 0; k < n; ++k){
+                    for (auto &order: axes){
+                        int corner[3] = {i, j, k};
+                        f << node(i, j, k);
+                        for (int axis: order){
+                            ++corner[axis];
+                            f << " " << node(corner[0], corner[1], corner[2]);
+                        }
+                        f << "\n";
+                    }
+                }
+            }
+        }
+        for (int component = 0; component < 3; ++component){
+            f << "% Data (B" << component << ")\n";
+            for (int i = 0; i <= n; ++i){
+                for (int j = 0; j <= n; ++j){
+                    for (int k = 0; k <= n; ++k){
+                        double B[3];
+                        field.BField(coordinate(i), coordinate(j), coordinate(k), 0, B, nullptr);
+                        f << B[component] << "\n";
+                    }
+                }
+            }
+        }
+    }
+    TFieldContainer mesh = ReadFEMField("FEM " + meshfile.string() + " 1 0 1", {});
+    TLinearTestField f;
+    for (int i = 0; i < 1000; ++i){
+        double x = uni(rng), y = uni(rng), z = uni(rng);
+        BOOST_TEST_CONTEXT("Parameters: x = " << x << ", y = " << y << ", z = " << z){
+            compareMagneticFields(mesh, f, x, y, z);
+        }
+    }
+    TabFieldFEM tab({{{0., 0., 0.}}, {{1., 0., 0.}}, {{0., 1., 0.}}, {{0., 0., 1.}}}, {{{1., 2., 3.}}, {{1., 2., 3.}}, {{1., 2., 3.}}, {{1., 2., 3.}}}, {{{0, 1, 2, 3}}});
+    double B[3] = {0., 0., 0.};
+    tab.BField(0.5, 0.5, 0.5, 0, B, nullptr); // inside bounding box, but outside the tetrahedron
+    BOOST_CHECK_EQUAL(B[0], 0.);
+    tab.BField(0.1, 0.2, 0.3, 0, B, nullptr);
+    BOOST_CHECK_CLOSE(B[2], 3., 1e-10);
+    boost::filesystem::remove(meshfile);
+}
+
+
+/**
+ * Check that bicubic interpolation of a 2D table reproduces an axisymmetric linear field and the gradient of a linear potential
+ */
+BOOST_AUTO_TEST_CASE(TabFieldTest){
+    boost::filesystem::path tabfile = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("TabFieldTest-%%%%-%%%%.tab");
+    {
+        std::ofstream f(tabfile.string());
+        f << "11 1 21 2\n 1 X [LENGU]\n 2 Z [LENGU]\n 3 RBX [FLUXU]\n 4 RBZ [FLUXU]\n 5 RV [ELPOT]\n 0\n";
+        f.precision(17);
+        for (int i = 0; i <= 10; ++i){
+            double r = 0.2*i + 0.001*i*i; // slightly non-uniform grid
+            for (int j = 0; j <= 20; ++j){
+                double z = -2. + 0.2*j;
+                f << r << " " << z << " " << r/2 << " " << 1. - z << " " << r + 2*z << "\n";
+            }
+        }
+    }
+    TabField tab(tabfile.string(), 1.);
+    boost::filesystem::remove(tabfile);
+    TLinearCylTestField f;
+    for (int n = 0; n < 1000; ++n){
+        double x = 0.7*uni(rng), y = 0.7*uni(rng), z = uni(rng);
+        BOOST_TEST_CONTEXT("Parameters: x = " << x << ", y = " << y << ", z = " << z){
+            compareMagneticFields(tab, f, x, y, z);
+            double V = 0, Ei[3] = {0, 0, 0}, r = sqrt(x*x + y*y);
+            tab.EField(x, y, z, 0, V, Ei);
+            BOOST_CHECK_SMALL(V - r - 2*z, 1e-10);
+            BOOST_CHECK_SMALL(Ei[0] + x/r, 1e-10);
+            BOOST_CHECK_SMALL(Ei[1] + y/r, 1e-10);
+            BOOST_CHECK_SMALL(Ei[2] + 2., 1e-10);
+        }
+    }
+}
+
+
 /*****************************************************************************
  * MORE TO COME --- tests for TabField, TabField3, HarmonicExpandedBField, ...
- ****************************************************************************/
\ No newline at end of file
+ ****************************************************************************/
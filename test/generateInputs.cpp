@@ -0,0 +1,280 @@
+/**
+ * Generator of synthetic inputs of arbitrary size, to measure how throughput and memory scale with the number of triangles, solids, and field-table nodes.
+ *
+ * Usage: PENTrack_inputs path/to/output [triangles=N] [solids=N] [nodes=N]
+ *
+ * Writes binary STL files of a closed spherical shell (solid 2) and of solids - 1 balls on a cubic lattice inside it (solids 3, 4, ...),
+ * sharing about the given total number of triangles (default: 100000) equally among the solids (default: 10).
+ * The field table field.tab in OPERA3D format covers the shell with about the given number of nodes (default: 1000000, 0: no field).
+ * config.in stores neutrons in the shell, bouncing off the balls, and can be run directly with PENTrack or test/ThroughputTest/RunThroughputTest.sh.
+ * All files are deterministic, so inputs generated with the same parameters are identical.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+using namespace std;
+
+static const double SHELL_INNER_RADIUS = 1.0; ///< Inner radius of shell [m]
+static const double SHELL_OUTER_RADIUS = 1.05; ///< Outer radius of shell [m]
+static const double LATTICE_SIZE = 1.0; ///< Edge length of cube centered on the origin containing the lattice of balls [m]
+static const double BALL_RADIUS = 0.3; ///< Radius of balls relative to lattice spacing
+static const double TABLE_SIZE = 1.1; ///< Field table covers the cube from -TABLE_SIZE to TABLE_SIZE along each axis [m]
+
+/**
+ * Triangle with vertices in counterclockwise order seen from outside
+ */
+struct TTriangle{
+	double v[3][3]; ///< Vertices
+};
+
+
+/**
+ * Add a tessellated sphere to a list of triangles
+ *
+ * The sphere is divided into stacks of constant polar angle and twice as many slices of constant azimuth.
+ * Shared vertices are calculated from the same indices, so they are bitwise identical and the mesh is closed.
+ *
+ * @param center Center of sphere
+ * @param radius Radius of sphere
+ * @param triangles Approximate number of triangles, at least 8 are used
+ * @param inward Orient triangles with normals pointing to the center, e.g. for the inner surface of a shell
+ * @param mesh Triangles are appended to this list
+ */
+static void AddSphere(const double center[3], const double radius, const unsigned long triangles, const bool inward, vector<TTriangle> &mesh){
+	unsigned long stacks = max(2UL, static_cast<unsigned long>(round((1 + sqrt(1. + triangles))/2))); // 2*slices*(stacks - 1) triangles with slices = 2*stacks
+	unsigned long slices = 2*stacks;
+	auto vertex = [&](const unsigned long i, const unsigned long j, double v[3]){
+		double theta = M_PI*i/stacks, phi = 2*M_PI*(j % slices)/slices;
+		double s = i == 0 || i == stacks ? 0. : sin(theta); // poles are single vertices
+		v[0] = center[0] + radius*s*cos(phi);
+		v[1] = center[1] + radius*s*sin(phi);
+		v[2] = center[2] + radius*cos(theta);
+	};
+	auto add = [&](const unsigned long i1, const unsigned long j1, const unsigned long i2, const unsigned long j2, const unsigned long i3, const unsigned long j3){
+		TTriangle t;
+		vertex(i1, j1, t.v[0]);
+		vertex(i2, j2, t.v[inward ? 2 : 1]);
+		vertex(i3, j3, t.v[inward ? 1 : 2]);
+		mesh.push_back(t);
+	};
+	for (unsigned long i = 0; i < stacks; ++i){
+		for (unsigned long j = 0; j < slices; ++j){ // polar direction cross azimuthal direction points outward
+			if (i > 0)
+				add(i, j, i + 1, j, i + 1, j + 1);
+			if (i < stacks - 1)
+				add(i, j, i + 1, j + 1, i, j + 1);
+		}
+	}
+}
+
+
+/**
+ * Write triangles to a binary STL file
+ *
+ * @param filename Output file
+ * @param name Name written into the header
+ * @param mesh Triangles
+ */
+static void WriteSTL(const boost::filesystem::path &filename, const string &name, const vector<TTriangle> &mesh){
+	ofstream f(filename.string(), ofstream::binary);
+	char header[80] = {0};
+	strncpy(header, ("solid " + name).c_str(), sizeof(header) - 1);
+	f.write(header, sizeof(header));
+	uint32_t n = mesh.size();
+	f.write(reinterpret_cast<const char*>(&n), sizeof(n));
+	for (const TTriangle &t: mesh){
+		double e1[3], e2[3];
+		for (int i = 0; i < 3; ++i){
+			e1[i] = t.v[1][i] - t.v[0][i];
+			e2[i] = t.v[2][i] - t.v[0][i];
+		}
+		double normal[3] = {e1[1]*e2[2] - e1[2]*e2[1], e1[2]*e2[0] - e1[0]*e2[2], e1[0]*e2[1] - e1[1]*e2[0]};
+		double length = sqrt(normal[0]*normal[0] + normal[1]*normal[1] + normal[2]*normal[2]);
+		char record[50] = {0}; // normal, three vertices, and attribute byte count
+		float values[12];
+		for (int i = 0; i < 3; ++i){
+			values[i] = normal[i]/length;
+			for (int k = 0; k < 3; ++k)
+				values[3 + 3*k + i] = t.v[k][i];
+		}
+		memcpy(record, values, sizeof(values));
+		f.write(record, sizeof(record));
+	}
+	if (not f)
+		throw runtime_error("Could not write " + filename.string());
+}
+
+
+/**
+ * Write an OPERA3D table of a smooth, non-polynomial magnetic field on a regular grid
+ *
+ * @param filename Output file
+ * @param n Number of nodes along each axis
+ */
+static void WriteTable(const boost::filesystem::path &filename, const unsigned long n){
+	FILE *f = fopen(filename.c_str(), "w");
+	if (f == nullptr)
+		throw runtime_error("Could not open " + filename.string());
+	vector<char> buffer(1 << 24);
+	setvbuf(f, buffer.data(), _IOFBF, buffer.size());
+	fprintf(f, " %10lu %10lu %10lu 2\n 1 X [LENGU]\n 2 Y [LENGU]\n 3 Z [LENGU]\n 4 BX [FLUXU]\n 5 BY [FLUXU]\n 6 BZ [FLUXU]\n 0\n", n, n, n);
+	vector<double> coords(n);
+	for (unsigned long i = 0; i < n; ++i)
+		coords[i] = -TABLE_SIZE + 2*TABLE_SIZE*i/(n - 1);
+	for (unsigned long i = 0; i < n; ++i){
+		double x = coords[i];
+		for (double y: coords){
+			for (double z: coords)
+				fprintf(f, "%.9g %.9g %.9g %.9g %.9g %.9g\n", x, y, z, 0.01*sin(3*y)*cos(2*z), 0.01*sin(3*z)*cos(2*x), 0.1 + 0.01*sin(3*x)*cos(2*y));
+		}
+		if ((i + 1)*10/n != i*10/n){
+			cout << '.';
+			cout.flush();
+		}
+	}
+	cout << '\n';
+	if (fclose(f) != 0)
+		throw runtime_error("Could not write " + filename.string());
+}
+
+
+/**
+ * Write configuration tracking neutrons in the generated geometry and field
+ *
+ * @param filename Output file
+ * @param solids Number of solids
+ * @param field Add field table to FIELDS section
+ */
+static void WriteConfig(const boost::filesystem::path &filename, const unsigned long solids, const bool field){
+	ofstream f(filename.string());
+	f << "# synthetic benchmark input written by PENTrack_inputs\n"
+			"[GLOBAL]\n"
+			"simtype 1\n"
+			"simcount 1000\n"
+			"simtime 100\n"
+			"secondaries 0\n"
+			"nthreads 1\n"
+			"[MATERIALS]\n"
+			"default\t0\t0\t0\t0\t0\t0\n"
+			"Steel\t183\t0.1\t0.03\t0\t0\t0\n"
+			"[GEOMETRY]\n"
+			"1\tignored\tdefault\n"
+			"2\tshell.stl\tSteel\n";
+	for (unsigned long i = 1; i < solids; ++i)
+		f << i + 2 << "\tball" << i << ".stl\tSteel\n";
+	f << "[SOURCE]\n"
+			"sourcemode boxvolume\n"
+			"parameters -0.2 0.2 -0.2 0.2 0.6 0.7\n"
+			"particle neutron\n"
+			"ActiveTime 0\n"
+			"Enormal 0\n"
+			"PhaseSpaceWeighting 0\n"
+			"Emin 0\n"
+			"Emax 100e-9\n"
+			"spectrum sqrt(x)\n"
+			"phi_v_min 0\n"
+			"phi_v_max 360\n"
+			"phi_v 1\n"
+			"theta_v_min 0\n"
+			"theta_v_max 180\n"
+			"theta_v sin(x)\n"
+			"polarization 1\n"
+			"[FIELDS]\n";
+	if (field)
+		f << "1 OPERA3D field.tab 1 1 0 1\n";
+	f << "[PARTICLES]\n"
+			"tau 0\n"
+			"tmax 9e99\n"
+			"lmax 9e99\n"
+			"endlog 1\n"
+			"tracklog 0\n"
+			"hitlog 0\n"
+			"snapshotlog 0\n"
+			"spinlog 0\n"
+			"snapshots 0\n"
+			"trackloginterval 5e-3\n"
+			"spinloginterval 5e-7\n"
+			"spintimes 0 0\n"
+			"Bmax 0.1\n"
+			"flipspin 0\n"
+			"interpolatefields 0\n"
+			"[neutron]\n"
+			"[proton]\n"
+			"[electron]\n"
+			"[mercury]\n"
+			"[xenon]\n"
+			"[FORMULAS]\n";
+	if (not f)
+		throw runtime_error("Could not write " + filename.string());
+}
+
+
+int main(int argc, char **argv){
+	if (argc < 2 || strcmp(argv[1], "-h") == 0){
+		cout << "Usage:\nPENTrack_inputs path/to/output [triangles=N] [solids=N] [nodes=N]\n";
+		return argc < 2 ? 1 : 0;
+	}
+	boost::filesystem::path outdir = argv[1];
+	unsigned long long triangles = 100000, solids = 10, nodes = 1000000;
+	for (int i = 2; i < argc; ++i){
+		string arg = argv[i];
+		size_t eq = arg.find('=');
+		string key = arg.substr(0, eq);
+		unsigned long long value = eq == string::npos ? 0 : stoull(arg.substr(eq + 1));
+		if (key == "triangles")
+			triangles = value;
+		else if (key == "solids")
+			solids = value;
+		else if (key == "nodes")
+			nodes = value;
+		else
+			throw runtime_error("Unknown parameter " + arg + "! Use triangles=N, solids=N, or nodes=N.");
+	}
+	if (solids < 1 || triangles > numeric_limits<uint32_t>::max())
+		throw runtime_error("At least one solid and less than 2^32 triangles are required!");
+	unsigned long long n = nodes == 0 ? 0 : max(2ULL, static_cast<unsigned long long>(round(cbrt(static_cast<double>(nodes)))));
+	if (n*n*n > static_cast<unsigned long long>(numeric_limits<int>::max()))
+		throw runtime_error("OPERA3D tables cannot contain more than 2^31 nodes!");
+	boost::filesystem::create_directories(outdir);
+
+	unsigned long pertriangles = triangles/solids; // triangles of each solid
+	unsigned long long written = 0;
+	vector<TTriangle> mesh;
+	const double origin[3] = {0, 0, 0};
+	AddSphere(origin, SHELL_OUTER_RADIUS, pertriangles/2, false, mesh);
+	AddSphere(origin, SHELL_INNER_RADIUS, pertriangles/2, true, mesh);
+	WriteSTL(outdir / "shell.stl", "shell", mesh);
+	written += mesh.size();
+
+	unsigned long balls = solids - 1;
+	unsigned long k = ceil(cbrt(static_cast<double>(balls)) - 1e-9); // balls along each axis of lattice
+	double spacing = LATTICE_SIZE/max(k, 1UL);
+	for (unsigned long i = 0; i < balls; ++i){
+		double center[3] = {(i/(k*k) + 0.5)*spacing - LATTICE_SIZE/2, (i/k % k + 0.5)*spacing - LATTICE_SIZE/2, (i % k + 0.5)*spacing - LATTICE_SIZE/2};
+		mesh.clear();
+		AddSphere(center, BALL_RADIUS*spacing, pertriangles, false, mesh);
+		WriteSTL(outdir / ("ball" + to_string(i + 1) + ".stl"), "ball" + to_string(i + 1), mesh);
+		written += mesh.size();
+	}
+	cout << "Wrote " << written << " triangles in " << solids << " solids\n";
+
+	if (n > 0){
+		cout << "Writing field table with " << n*n*n << " nodes";
+		WriteTable(outdir / "field.tab", n);
+	}
+	WriteConfig(outdir / "config.in", solids, n > 0);
+	cout << "Wrote " << outdir / "config.in" << "\n";
+	return 0;
+}
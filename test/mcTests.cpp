@@ -0,0 +1,89 @@
+/**
+ * This file contains unit tests for random-number generation
+ */
+
+#include <array>
+#include <cmath>
+#include <vector>
+#include <sstream>
+#include <boost/test/unit_test.hpp>
+
+#include "mc.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_CASE(philoxKnownAnswerTest){
+    // known-answer vectors for Philox4x64-10 from the Random123 library
+    array<TMCGenerator::result_type, 4> zero = TMCGenerator::philox({0, 0, 0, 0}, {0, 0});
+    array<TMCGenerator::result_type, 4> zeroexpected = {0x16554d9eca36314cULL, 0xdb20fe9d672d0fdcULL, 0xd7e772cee186176bULL, 0x7e68b68aec7ba23bULL};
+    BOOST_CHECK(zero == zeroexpected);
+
+    array<TMCGenerator::result_type, 4> pi = TMCGenerator::philox({0x243f6a8885a308d3ULL, 0x13198a2e03707344ULL, 0xa4093822299f31d0ULL, 0x082efa98ec4e6c89ULL},
+                                                                   {0x452821e638d01377ULL, 0xbe5466cf34e90c6cULL});
+    array<TMCGenerator::result_type, 4> piexpected = {0xa528f45403e61d95ULL, 0x38c72dbd566e9788ULL, 0xa5a1610e72fd18b5ULL, 0x57bd43b5e52b7fe6ULL};
+    BOOST_CHECK(pi == piexpected);
+}
+
+BOOST_AUTO_TEST_CASE(philoxSubstreamTest){
+    // random numbers of a particle only depend on seed, job number, and particle number, not on numbers drawn for other particles
+    TMCGenerator mc1(42, 7), mc2(42, 7);
+    mc1.SetSubstream(3, 0);
+    vector<TMCGenerator::result_type> first;
+    for (int i = 0; i < 10; ++i)
+        first.push_back(mc1());
+
+    for (int i = 0; i < 1001; ++i) // draw numbers for another particle first
+        mc2();
+    mc2.SetSubstream(3, 0);
+    for (int i = 0; i < 10; ++i)
+        BOOST_CHECK_EQUAL(mc2(), first[i]);
+
+    mc2.SetSubstream(3, TMCGenerator::SecondaryIndex(0, 0));
+    BOOST_CHECK_NE(mc2(), first[0]);
+    TMCGenerator mc3(42, 8);
+    mc3.SetSubstream(3, 0);
+    BOOST_CHECK_NE(mc3(), first[0]);
+}
+
+BOOST_AUTO_TEST_CASE(philoxSerializationTest){
+    // generator read back from a stream continues with the same numbers
+    TMCGenerator mc1(42, 7);
+    mc1.SetSubstream(3, 5);
+    for (int i = 0; i < 6; ++i)
+        mc1();
+    stringstream state;
+    state << mc1;
+    TMCGenerator mc2;
+    state >> mc2;
+    for (int i = 0; i < 10; ++i)
+        BOOST_CHECK_EQUAL(mc2(), mc1());
+}
+
+BOOST_AUTO_TEST_CASE(scrambledHaltonTest){
+    // digit permutations keep the stratification of the Halton sequence: the first b^k points fall into different intervals of width b^-k in each dimension
+    TMCGenerator mc(42, 7);
+    TScrambledHalton halton(3, mc);
+    const array<unsigned, 3> npoints = {256, 243, 125}; // powers of the bases 2, 3, and 5
+    for (unsigned d = 0; d < 3; ++d){
+        vector<bool> filled(npoints[d], false);
+        for (unsigned n = 0; n < npoints[d]; ++n){
+            double x = ldexp(double(halton.Coordinate(n, d)), -64);
+            BOOST_REQUIRE(x >= 0 && x < 1);
+            unsigned interval = x*npoints[d];
+            BOOST_CHECK(not filled[interval]);
+            filled[interval] = true;
+        }
+    }
+
+    // other jobs get other permutations, the generator continues with its pseudo-random substream after the coordinates of a point
+    TScrambledHalton other(3, TMCGenerator(42, 8));
+    BOOST_CHECK_NE(halton.Coordinate(1, 0), other.Coordinate(1, 0));
+    TMCGenerator mc1(42, 7), mc2(42, 7);
+    mc1.SetSubstream(3, 0);
+    mc2.SetSubstream(3, 0);
+    mc1.StartQuasiRandom(halton, 3);
+    for (unsigned d = 0; d < 3; ++d)
+        BOOST_CHECK_EQUAL(mc1(), halton.Coordinate(3, d));
+    for (int i = 0; i < 10; ++i)
+        BOOST_CHECK_EQUAL(mc1(), mc2());
+}
@@ -4,10 +4,13 @@
 
 #include <cmath>
 #include <chrono>
+#include <array>
+#include <random>
 #include <boost/test/unit_test.hpp>
 
 #include "globals.h"
 #include "microroughness.h"
+#include "geometry.h"
 
 using namespace std;
 
@@ -93,4 +96,111 @@ BOOST_AUTO_TEST_CASE(microroughnessDistributionTest){
     nickelReflection = MR::MRProb(false, &v[0], &normal[0], FermiNi, bNi, wNi);
     nickelTransmission = MR::MRProb(true, &v[0], &normal[0], FermiNi, bNi, wNi);
 */
-}
\ No newline at end of file
+}
+
+BOOST_AUTO_TEST_CASE(microroughnessSamplingTest){
+    // parameters for Cu surface from Steyerl's microroughness paper (DOI:10.1007/BF01380066)
+    double kCu = 0.00894/1e-10; // critical wave number
+    double FermiCu = static_cast<double>(hbar*hbar*kCu*kCu/2./m_n/ele_e/ele_e);
+    double bCu = 35e-10;
+    double wCu = 250e-10;
+    array<double, 3> normal = {0., 0., -1.};
+
+    TMCGenerator mc(42);
+    // incident wavelengths [A] and angles: above critical wave number, below critical wave number, grazing incidence
+    for (auto incidence: vector<pair<double, double> >{{300., 73.5}, {800., 30.}, {300., 88.}}){
+        double theta_i = incidence.second/180.*pi;
+        double vabs = 2.*pi*hbar/m_n/ele_e/(incidence.first*1e-10);
+        array<double, 3> v = {vabs*sin(theta_i), 0., vabs*cos(theta_i)};
+        for (bool transmit: {false, true}){
+            if (transmit && 0.5*m_n*vabs*vabs <= FermiCu)
+                continue;
+            // mean cos(theta) and sin(theta)*cos(phi) of distribution by midpoint integration
+            double norm = 0, costheta = 0, sinthetacosphi = 0;
+            const int N = 400;
+            for (int i = 0; i < N; ++i){
+                double theta = (i + 0.5)*pi/2/N;
+                for (int j = 0; j < N; ++j){
+                    double phi = (j + 0.5)*2*pi/N;
+                    double p = MR::MRDist(transmit, false, &v[0], &normal[0], FermiCu, bCu, wCu, theta, phi)*sin(theta);
+                    norm += p;
+                    costheta += p*cos(theta);
+                    sinthetacosphi += p*sin(theta)*cos(phi);
+                }
+            }
+            double samplecostheta = 0, samplesinthetacosphi = 0;
+            const int samples = 20000;
+            for (int i = 0; i < samples; ++i){
+                double theta, phi;
+                MR::MRSampleDirection(transmit, &v[0], &normal[0], FermiCu, bCu, wCu, mc, theta, phi);
+                BOOST_REQUIRE(theta >= 0 && theta <= pi/2 && phi >= 0 && phi < 2*pi);
+                samplecostheta += cos(theta)/samples;
+                samplesinthetacosphi += sin(theta)*cos(phi)/samples;
+            }
+            BOOST_TEST_CONTEXT("Parameters: wavelength = " << incidence.first << "A, theta_i = " << incidence.second << ", transmit = " << transmit){
+                BOOST_CHECK_SMALL(samplecostheta - costheta/norm, 0.01);
+                BOOST_CHECK_SMALL(samplesinthetacosphi - sinthetacosphi/norm, 0.01);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(microroughnessProbTableTest){
+    // parameters for Cu surface from Steyerl's microroughness paper (DOI:10.1007/BF01380066)
+    double kCu = 0.00894/1e-10; // critical wave number
+    double FermiCu = static_cast<double>(hbar*hbar*kCu*kCu/2./m_n/ele_e/ele_e);
+    double bCu = 35e-10;
+    double wCu = 250e-10;
+    array<double, 3> normal = {0., 0., -1.};
+
+    double tolerance = 1e-3;
+    MR::EnableMRProbTables(tolerance);
+    mt19937 rng(42);
+    uniform_real_distribution<double> kdist(0.05*kCu, 3.*kCu), thetadist(0., pi/2);
+    double vconv = hbar/m_n/ele_e;
+    chrono::duration<double> tdirect(0), ttable(0);
+    for (int i = 0; i < 2000; ++i){
+        double k = kdist(rng), theta_i = thetadist(rng);
+        array<double, 3> v = {k*vconv*sin(theta_i), 0., k*vconv*cos(theta_i)};
+        for (bool transmit: {false, true}){
+            auto t0 = chrono::high_resolution_clock::now();
+            double direct = MR::MRProb(transmit, &v[0], &normal[0], FermiCu, bCu, wCu, 1e-3*tolerance);
+            auto t1 = chrono::high_resolution_clock::now();
+            double tabulated = MR::MRProbTabulated(transmit, &v[0], &normal[0], FermiCu, bCu, wCu);
+            auto t2 = chrono::high_resolution_clock::now();
+            tdirect += t1 - t0;
+            if (i > 0) ttable += t2 - t1; // exclude table calculation
+            BOOST_TEST_CONTEXT("Parameters: k = " << k << ", theta_i = " << theta_i << ", transmit = " << transmit){
+                BOOST_CHECK_SMALL(tabulated - direct, 2*tolerance); // tolerance is only checked at table nodes of next-finer table
+            }
+        }
+    }
+    MR::EnableMRProbTables(0);
+    cout << "Calculated 4000 microroughness integrals in " << chrono::duration_cast<chrono::microseconds>(tdirect).count() << " us, interpolated them in "
+         << chrono::duration_cast<chrono::microseconds>(ttable).count() << " us\n";
+}
+
+BOOST_AUTO_TEST_CASE(microroughnessInterfaceTest){
+    // the energy limit precalculated for each material interface has to agree with the wave-number limits checked by MRValid
+    material vacuum = {"vacuum", 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    material copper = {"copper", 168, 0.0224, 0, 0, 35e-10, 250e-10, 0, 0, 0};
+    TMaterialInterface in(vacuum, copper), out(copper, vacuum);
+    BOOST_CHECK_EQUAL(in.leaving.MRmaxenergy, 0);
+    BOOST_CHECK_CLOSE(in.potentialstep, 168e-9, 1e-9);
+    BOOST_CHECK_CLOSE(out.potentialstep, -168e-9, 1e-9);
+    BOOST_CHECK_CLOSE(in.entering.FermiImag, 0.0224e-9, 1e-9);
+
+    double Emax = in.entering.MRmaxenergy;
+    array<double, 3> normal = {0., 0., -1.};
+    mt19937 rng(42);
+    uniform_real_distribution<double> Edist(0., 2*Emax), stepdist(-2*Emax, 2*Emax);
+    for (int i = 0; i < 10000; ++i){
+        double E = Edist(rng), Estep = stepdist(rng);
+        double vabs = sqrt(2*E/m_n);
+        array<double, 3> v = {0., 0., vabs};
+        bool valid = max(max(E, Estep), E - Estep) < Emax;
+        double margin = min(abs(E - Emax), min(abs(Estep - Emax), abs(E - Estep - Emax)))/Emax;
+        if (margin > 1e-9) // results may differ by rounding at the limit
+            BOOST_CHECK_EQUAL(valid, MR::MRValid(&v[0], &normal[0], Estep, copper.RMSRoughness, copper.CorrelLength));
+    }
+}
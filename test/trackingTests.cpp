@@ -0,0 +1,87 @@
+/**
+ * This file contains unit tests for particle tracking
+ */
+
+#include <cmath>
+#include <map>
+#include <memory>
+#include <string>
+
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+
+#include "config.h"
+#include "fields.h"
+#include "geometry.h"
+#include "globals.h"
+#include "mc.h"
+#include "source.h"
+#include "tracking.h"
+
+/**
+ * Track a neutron for one second in a magnetic trap inside a large hollow box, without touching any surface
+ *
+ * @param parareal Number of parareal slices (0: serial integration)
+ * @param pararealtol Convergence tolerance of the parareal iterations [m]
+ * @param maxsteps Step budget of the neutron (0: unlimited)
+ *
+ * @return Returns tracked neutron
+ */
+static std::unique_ptr<TParticle> TrackTrappedNeutron(const unsigned parareal, const double pararealtol, const int maxsteps = 0){
+    outpath = boost::filesystem::temp_directory_path(); // all logs are disabled, but the logger needs an output directory
+    TConfig config({
+        {"GLOBAL", {{"nthreads", "4"}}},
+        {"MATERIALS", {{"default", "0 0 0 0 0 0 0 0 0"}, {"PolishedSteel", "183 0.0852 0 1e-5 2.6e-9 20e-9 0 0 0"}}},
+        {"GEOMETRY", {{"1", "ignored default"}, {"2", "difference(box(-10,-10,-10,10,10,10),box(-9,-9,-9,9,9,9)) PolishedSteel"}}},
+        {"FIELDS", {{"1", "B0GradZ 10 0 0.1 10 -10 10 -10 10 -10 1"}}}, // low-field seekers oscillate vertically around the field minimum
+        {"neutron", {{"tmax", "9e99"}, {"abstol", "1e-10"}, {"reltol", "1e-10"}, {"parareal", std::to_string(parareal)}, {"pararealtol", std::to_string(pararealtol)},
+                     {"maxsteps", std::to_string(maxsteps)}, {"endlog", "0"}, {"diagnosticlog", "0"}}},
+        {"proton", {}}, {"electron", {}}, {"mercury", {}}, {"xenon", {}}
+    });
+    TFieldManager field(config);
+    TGeometry geom(config);
+    TTracker tracker(config);
+    TMCGenerator mc(1, 0);
+    std::unique_ptr<TParticle> p(CreateParticle("neutron", 1, 0, 0, 0, 0, 100e-9, 0.5, 1.2, 1, mc, geom, field));
+    tracker.IntegrateParticle(p, 1, mc, geom, field);
+    return p;
+}
+
+// check that a trajectory advanced with the parareal algorithm ends where serial integration ends
+BOOST_AUTO_TEST_CASE(PararealTest){
+    const double pararealtol = 1e-6;
+    std::unique_ptr<TParticle> serial = TrackTrappedNeutron(0, pararealtol);
+    std::unique_ptr<TParticle> parareal = TrackTrappedNeutron(8, pararealtol);
+    BOOST_CHECK_EQUAL(serial->GetStopID(), ID_NOT_FINISH);
+    BOOST_CHECK_EQUAL(parareal->GetStopID(), ID_NOT_FINISH);
+    BOOST_CHECK_EQUAL(parareal->GetFinalTime(), serial->GetFinalTime());
+    BOOST_CHECK(parareal->GetNumberOfSteps() < serial->GetNumberOfSteps()/10); // only the end of the last slice is integrated step by step
+
+    state_type yserial = serial->GetFinalState(), yparareal = parareal->GetFinalState();
+    double distance = std::sqrt(std::pow(yparareal[0] - yserial[0], 2) + std::pow(yparareal[1] - yserial[1], 2) + std::pow(yparareal[2] - yserial[2], 2));
+    BOOST_CHECK_SMALL(distance, pararealtol);
+
+    std::unique_ptr<TParticle> limited = TrackTrappedNeutron(8, pararealtol, 100);
+    BOOST_CHECK_EQUAL(limited->GetStopID(), ID_BUDGET_EXCEEDED);
+    BOOST_CHECK_EQUAL(limited->GetNumberOfSteps(), 0); // steps of all slices count toward the step budget, so the particle stops before taking steps of its own
+}
+
+// check that the TOLERANCES section is optional and that tolerance maps are resolved from it
+BOOST_AUTO_TEST_CASE(ToleranceMapTest){
+    outpath = boost::filesystem::temp_directory_path();
+    std::map<std::string, std::map<std::string, std::string> > sections = {
+        {"GLOBAL", {}}, {"neutron", {{"endlog", "0"}}}, {"proton", {}}, {"electron", {}}, {"mercury", {}}, {"xenon", {}}
+    };
+    TConfig config(sections);
+    BOOST_CHECK_NO_THROW(TTracker tracker(config));
+
+    sections["neutron"]["tolerancemap"] = "precession";
+    TConfig undefined(sections);
+    BOOST_CHECK_THROW(TTracker tracker(undefined), std::runtime_error); // region is not defined
+
+    sections["TOLERANCES"]["precession"] = "box -1 -1 -1 1 1 1 1e-9 1e-9 1e-4";
+    TConfig defined(sections);
+    TTracker tracker(defined);
+    BOOST_REQUIRE_EQUAL(tracker.GetParticleOptions("neutron").tolerancemap.size(), 1);
+    BOOST_CHECK_EQUAL(tracker.GetParticleOptions("neutron").tolerancemap[0].abstol, 1e-9);
+}